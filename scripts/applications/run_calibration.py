@@ -10,7 +10,7 @@ Example:
     $ python run_calibration.py \
         --color=/path/to/colors
         --rig_in=/path/to/input/rig
-        --matches=/path/to/output/matches.json
+        --matches=/path/to/output/matches.bin
         --rig_out=/path/to/output/rig_calibrated.json
 """
 
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# Copyright 2004-present Facebook. All Rights Reserved.
+
+# This source code is licensed under the BSD-style license found in the
+# LICENSE file in the root directory of this source tree.
+
+"""Aggregates the per stage profiles written by depth estimation.
+
+DerpCLI saves one JSON profile per frame and level in [output_root]/profiles/level_[L]/,
+with wall time, cost evaluations, pixels touched and bytes allocated for each stage, both for
+the whole stage (empty dst) and for every dst. This sums them over frames, so profiles of many
+frames (or of many workers sharing an output root) can be compared stage by stage.
+
+Memory is reported as the resident set size of the process at the end of each stage and its high
+water mark during the stage, which are maxed rather than summed. The per level peaks of the
+process and of the level's own mats are printed after the stages, to size --threads and instances.
+
+Example:
+    To print the aggregated profile of a render:
+
+        $ python profiles.py \
+          --output_root=/path/to/output
+
+Attributes:
+    FLAGS (absl.flags._flagvalues.FlagValues): Globally defined flags for profiles.py.
+"""
+
+import glob
+import json
+import os
+
+from absl import app, flags
+
+FLAGS = flags.FLAGS
+
+COUNTERS = ["calls", "seconds", "cost_evaluations", "pixels", "bytes"]
+PEAKS = ["rss_bytes", "peak_rss_bytes"]
+LEVEL_PEAKS = ["mat_bytes", "peak_rss_bytes"]
+
+
+def aggregate_profiles(profiles_dir, per_dst=False):
+    """Sums the profiles in a directory over frames.
+
+    Args:
+        profiles_dir (str): Path to the profiles directory (i.e. [output_root]/profiles).
+        per_dst (bool): Whether to keep separate entries for each dst. Otherwise entries for
+            a whole stage (empty dst) are reported, with counters summed over dsts.
+
+    Returns:
+        dict[tuple(str, int, str), dict[str, float]]: Counters keyed by (stage, level, dst),
+            plus the number of frames they were summed over in "frames".
+        dict[int, dict[str, int]]: Highest memory of every level over frames.
+    """
+    totals = {}
+    frames = {}
+    levels = {}
+    for fn in sorted(glob.glob(os.path.join(profiles_dir, "level_*", "*.json"))):
+        with open(fn) as f:
+            profile = json.load(f)
+        level_peaks = levels.setdefault(profile["level"], {p: 0 for p in LEVEL_PEAKS})
+        for peak in LEVEL_PEAKS:
+            level_peaks[peak] = max(level_peaks[peak], profile.get(peak, 0))
+        for entry in profile["stages"]:
+            if per_dst:
+                key = (entry["stage"], entry["level"], entry["dst"])
+            else:
+                key = (entry["stage"], entry["level"], "")
+            total = totals.setdefault(key, {c: 0 for c in COUNTERS + PEAKS})
+            for counter in COUNTERS:
+                # Time overlaps across dsts, so whole stage time comes from its own entry
+                is_time = counter in ["calls", "seconds"]
+                if per_dst or not entry["dst"] or not is_time:
+                    total[counter] += entry[counter]
+            for peak in PEAKS:
+                total[peak] = max(total[peak], entry.get(peak, 0))
+            frames.setdefault(key, set()).add(profile["frame"])
+    for key, total in totals.items():
+        total["frames"] = len(frames[key])
+    return totals, levels
+
+
+def main(argv):
+    profiles_dir = os.path.join(FLAGS.output_root, "profiles")
+    totals, levels = aggregate_profiles(profiles_dir, FLAGS.per_dst)
+    header = ["stage", "level", "dst", "frames"] + COUNTERS + PEAKS
+    print("\t".join(header))
+    for key in sorted(totals, key=lambda k: (-k[1], k[0], k[2])):
+        total = totals[key]
+        row = list(key) + [total["frames"]] + [total[c] for c in COUNTERS + PEAKS]
+        print("\t".join(str(v) for v in row))
+
+    print()
+    print("\t".join(["level"] + LEVEL_PEAKS))
+    for level in sorted(levels, reverse=True):
+        print("\t".join(str(v) for v in [level] + [levels[level][p] for p in LEVEL_PEAKS]))
+
+
+if __name__ == "__main__":
+    flags.DEFINE_string("output_root", None, "Output root of the render")
+    flags.DEFINE_boolean("per_dst", False, "Report each dst separately")
+
+    # Required FLAGS.
+    flags.mark_flag_as_required("output_root")
+    app.run(main)
@@ -38,6 +38,7 @@ from absl import app, flags
 from network import get_frame_name, get_sample_file
 
 FLAGS = flags.FLAGS
+MANIFEST_FILENAME = ".manifest.json"  # see source/util/ImageManifest.h
 imageio.plugins.freeimage.download()  # allows PFM file I/O
 
 
@@ -85,6 +86,47 @@ def resize_camera(src_dir, dst_dir, camera, rig_resolution, frame, threshold):
             cv2.imwrite(new_file, scaled)
 
 
+def write_manifest(image_dir):
+    """Writes the manifest of an image directory, as read by image_util::getManifest, so that
+    binaries do not have to list its camera directories or decode images to learn their size.
+
+    Args:
+        image_dir (str): Path to a directory laid out as [camera]/[frame][extension].
+    """
+    cameras = {}
+    for camera in sorted(os.listdir(image_dir)):
+        camera_dir = os.path.join(image_dir, camera)
+        if camera.startswith(".") or not os.path.isdir(camera_dir):
+            continue
+        files = sorted(
+            f
+            for f in os.listdir(camera_dir)
+            if not f.startswith(".") and os.path.isfile(os.path.join(camera_dir, f))
+        )
+        if len(files) == 0:
+            continue
+        _, ext = os.path.splitext(files[0])
+        first_file = os.path.join(camera_dir, files[0])
+        if ext == ".pfm":
+            img = imageio.imread(first_file)
+        else:
+            img = cv2.imread(first_file, cv2.IMREAD_UNCHANGED)
+        cameras[camera] = {
+            "extension": ext,
+            "size": [img.shape[1], img.shape[0]] if img is not None else [0, 0],
+            "frames": [
+                os.path.splitext(f)[0] for f in files if os.path.splitext(f)[1] == ext
+            ],
+        }
+
+    # Concurrent producers may write the same manifest, readers see one of them in full
+    manifest_path = os.path.join(image_dir, MANIFEST_FILENAME)
+    tmp_path = f"{manifest_path}.{os.getpid()}.tmp"
+    with open(tmp_path, "w") as f:
+        json.dump({"cameras": cameras}, f, sort_keys=True)
+    os.replace(tmp_path, manifest_path)
+
+
 def verify_frame(src_dir, camera, frame):
     original_file = get_frame_path(src_dir, camera, frame)
     if not os.path.isfile(original_file):
@@ -132,6 +174,11 @@ def resize_frames(src_dir, dst_dir, rig, first, last, threshold=None):
     pool.close()
     pool.join()
 
+    for level in range(len(config.WIDTHS)):
+        level_dir = os.path.join(dst_dir, f"level_{level}")
+        if os.path.isdir(level_dir):
+            write_manifest(level_dir)
+
 
 def main(argv):
     """Validates flags and resizes the frame pointed at by them if determined to be valid.
@@ -25,6 +25,7 @@ import functools
 import json
 import os
 import shutil
+import subprocess
 import sys
 import threading
 from copy import copy
@@ -61,6 +62,54 @@ from setup import bin_to_flags
 
 FLAGS = flags.FLAGS
 
+# Binaries that can stay resident and take one job per stdin line (see runJobs in SystemUtil.h)
+SERVABLE_APPS = [
+    "ConvertToBinary",
+    "DerpCLI",
+    "TemporalBilateralFilter",
+    "UpsampleDisparity",
+]
+JOB_REPLY_PREFIX = "[job] "
+
+servers = {}
+servers_lock = threading.Lock()
+
+
+def _serve_bin(app_name, bin_path, cmd_flags):
+    """Runs a job on the resident instance of the binary, starting it if needed.
+
+    Args:
+        app_name (str): Name of the binary.
+        bin_path (str): Path to the binary.
+        cmd_flags (str): Space-separated flags of the job.
+
+    Raises:
+        Exception: If the job failed or the binary exited.
+    """
+    with servers_lock:
+        server = servers.get(app_name)
+        if server is None or server.poll() is not None:
+            env = dict(os.environ, GLOG_alsologtostderr="1", GLOG_stderrthreshold="0")
+            server = subprocess.Popen(
+                [bin_path, "--serve"],
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                env=env,
+                universal_newlines=True,
+            )
+            servers[app_name] = server
+        server.stdin.write(cmd_flags + "\n")
+        server.stdin.flush()
+        for line in server.stdout:
+            if not line.startswith(JOB_REPLY_PREFIX):
+                print(line, end="")
+                continue
+            status = line[len(JOB_REPLY_PREFIX) :].strip()
+            if status != "ok":
+                raise Exception(f"{app_name} failed: {status}")
+            return
+        raise Exception(f"{app_name} exited with code {server.wait()}")
+
 
 def _run_bin(msg):
     """Runs the binary associated with the message. The execution assumes the worker is
@@ -102,6 +151,9 @@ def _run_bin(msg):
             cmd_flags = cmd_flags.replace(root, root_to_docker[root])
 
     bin_path = os.path.join(config.DOCKER_BUILD_ROOT, "bin", app_name)
+    if FLAGS.serve and app_name in SERVABLE_APPS:
+        _serve_bin(app_name, bin_path, cmd_flags)
+        return
     cmd = f"GLOG_alsologtostderr=1 GLOG_stderrthreshold=0 {bin_path} {cmd_flags}"
     run_command(cmd)
 
@@ -561,6 +613,7 @@ def main_loop(argv):
 if __name__ == "__main__":
     # Abseil entry point app.run() expects all flags to be already defined
     flags.DEFINE_string("master", None, "master IP")
+    flags.DEFINE_bool("serve", False, "keep binaries resident across messages")
 
     # Required FLAGS.
     flags.mark_flag_as_required("master")
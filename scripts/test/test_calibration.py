@@ -36,7 +36,7 @@ class CalibrationTest(DepTest):
         """Defines default I/O paths for calibration tests."""
         self.io_args.color = self.io_args.color_full
         self.io_args.rig_in = self.io_args.rig
-        self.io_args.matches = os.path.join(self.io_args.output_root, "matches.json")
+        self.io_args.matches = os.path.join(self.io_args.output_root, "matches.bin")
         self.io_args.rig_out = os.path.join(self.io_args.output_root, "rig.json")
 
     def _get_setup(self, dataset_name):
@@ -189,7 +189,7 @@ class Calibration:
         flags["log_dir"] = self.path_logs
         flags["rig_in"] = rig_in
         flags["rig_out"] = rig_out
-        flags["matches"] = os.path.join(self.path_calibration, "matches.json")
+        flags["matches"] = os.path.join(self.path_calibration, "matches.bin")
         flags["color"] = os.path.join(
             project, dlg.dd_calibrate_calibrate_color.currentText()
         )
@@ -109,6 +109,7 @@ def _set_image_type_paths():
     image_type_paths["foreground_masks_levels"] = "video/foreground_masks_levels"
     image_type_paths["fused"] = "fused"
     image_type_paths["mismatches"] = "mismatches"
+    image_type_paths["profiles"] = "profiles"
     image_type_paths["video_bin"] = "video/bin"
     image_type_paths["video_disp"] = "video/disparity"
     image_type_paths["video_disp_levels"] = "video/disparity_levels"
@@ -0,0 +1,148 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+#include <glog/logging.h>
+
+#include "source/render/ReprojectionTable.h"
+#include "source/test/TestRig.h"
+#include "source/util/Camera.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+const int kNumSamples = 1024;
+
+std::vector<Camera::Vector2> randomPixels(const Camera& camera) {
+  std::mt19937 engine(1);
+  std::vector<Camera::Vector2> pixels;
+  for (int i = 0; i < kNumSamples; ++i) {
+    pixels.emplace_back(
+        std::uniform_real_distribution<Camera::Real>(0, camera.resolution.x())(engine),
+        std::uniform_real_distribution<Camera::Real>(0, camera.resolution.y())(engine));
+  }
+  return pixels;
+}
+
+} // namespace
+
+static void BM_CameraPixel(benchmark::State& state) {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const Camera& camera = rig[0];
+  std::vector<Camera::Vector3> points;
+  for (const Camera::Vector2& pixel : randomPixels(camera)) {
+    points.push_back(camera.rig(pixel, 2.0));
+  }
+
+  int i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(camera.pixel(points[i++ % kNumSamples]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CameraPixel);
+
+static void BM_CameraRig(benchmark::State& state) {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const Camera& camera = rig[0];
+  const std::vector<Camera::Vector2> pixels = randomPixels(camera);
+
+  int i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(camera.rig(pixels[i++ % kNumSamples]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CameraRig);
+
+static void BM_CameraRigs(benchmark::State& state) {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const Camera& camera = rig[0];
+  const std::vector<Camera::Vector2> pixels = randomPixels(camera);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(camera.rigs(pixels, 2.0).data());
+  }
+  state.SetItemsProcessed(state.iterations() * kNumSamples);
+}
+BENCHMARK(BM_CameraRigs);
+
+// First camera of the test rig and the first camera that overlaps it
+static std::pair<Camera, Camera> getOverlappingPair() {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  for (int i = 1; i < int(rig.size()); ++i) {
+    if (rig[i].overlap(rig[0]) > 0) {
+      return std::make_pair(rig[0], rig[i]);
+    }
+  }
+  LOG(FATAL) << "No camera overlaps " << rig[0].id;
+  return std::make_pair(rig[0], rig[0]);
+}
+
+// Same tolerance and margin as ReprojectionTexture
+static ReprojectionTable makeTable(Camera dst, Camera src) {
+  const Camera::Vector2 tol = 0.03 / src.resolution.array();
+  const Camera::Vector2 margin(0.05, 0.05);
+  dst.normalize();
+  src.normalize();
+  return ReprojectionTable(dst, src, tol, margin);
+}
+
+static void BM_ReprojectionTableConstruct(benchmark::State& state) {
+  const std::pair<Camera, Camera> cameras = getOverlappingPair();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(makeTable(cameras.first, cameras.second).values.data());
+  }
+}
+BENCHMARK(BM_ReprojectionTableConstruct)->Unit(benchmark::kMillisecond);
+
+static void BM_ReprojectionTableLookup(benchmark::State& state) {
+  const std::pair<Camera, Camera> cameras = getOverlappingPair();
+  const ReprojectionTable table = makeTable(cameras.first, cameras.second);
+
+  std::mt19937 engine(1);
+  std::uniform_real_distribution<float> coord(0, 1);
+  std::uniform_real_distribution<float> disparity(
+      ReprojectionTable::minDisparity(), ReprojectionTable::maxDisparity());
+  std::vector<std::pair<ReprojectionTable::Entry, float>> samples;
+  for (int i = 0; i < kNumSamples; ++i) {
+    samples.emplace_back(ReprojectionTable::Entry(coord(engine), coord(engine)), disparity(engine));
+  }
+
+  int i = 0;
+  for (auto _ : state) {
+    const auto& sample = samples[i++ % kNumSamples];
+    benchmark::DoNotOptimize(table.lookup(sample.first, sample.second));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ReprojectionTableLookup);
+
+static void BM_ReprojectionTableLookups(benchmark::State& state) {
+  const std::pair<Camera, Camera> cameras = getOverlappingPair();
+  const ReprojectionTable table = makeTable(cameras.first, cameras.second);
+
+  std::mt19937 engine(1);
+  std::uniform_real_distribution<float> coord(0, 1);
+  std::uniform_real_distribution<float> disparity(
+      ReprojectionTable::minDisparity(), ReprojectionTable::maxDisparity());
+  std::vector<ReprojectionTable::Entry> xys;
+  std::vector<float> disparities;
+  for (int i = 0; i < kNumSamples; ++i) {
+    xys.emplace_back(coord(engine), coord(engine));
+    disparities.push_back(disparity(engine));
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(table.lookup(xys, disparities).data());
+  }
+  state.SetItemsProcessed(state.iterations() * kNumSamples);
+}
+BENCHMARK(BM_ReprojectionTableLookups);
@@ -0,0 +1,33 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <benchmark/benchmark.h>
+#include <boost/filesystem.hpp>
+
+#include "source/conversion/BC7Util.h"
+
+using namespace fb360_dep;
+
+// Args: image size, threads
+static void BM_CompressBC7(benchmark::State& state) {
+  const cv::Size size(state.range(0), state.range(0));
+  cv::Mat_<cv::Vec3f> image(size);
+  cv::theRNG().state = 1;
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(1));
+  const boost::filesystem::path dds = boost::filesystem::temp_directory_path() /
+      boost::filesystem::unique_path("bc7_%%%%%%%%.dds");
+  for (auto _ : state) {
+    bc7_util::compressBC7(image, dds, 2.2 / 1.8, true, "veryfast", state.range(1));
+  }
+  boost::filesystem::remove(dds);
+  state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_CompressBC7)
+    ->Args({256, 0})
+    ->Args({1024, 0})
+    ->Args({1024, -1})
+    ->Unit(benchmark::kMillisecond);
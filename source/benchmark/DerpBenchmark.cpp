@@ -0,0 +1,165 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <memory>
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/DerpUtil.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/test/TestRig.h"
+#include "source/util/CvUtil.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+namespace {
+
+const cv::Size kLevelSize(336, 216); // test rig resolution / 10
+const int kNumSamples = 1024;
+
+cv::Mat_<PixelType> randomColor(const cv::Size& size, const int seed) {
+  cv::Mat_<PixelType> color(size);
+  cv::theRNG().state = seed;
+  cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(65535));
+  // Smooth it a little so it looks more like an image than noise
+  cv::GaussianBlur(color, color, cv::Size(5, 5), 0);
+  return color;
+}
+
+// Single level pyramid of the test rig, ready for computeCost
+std::unique_ptr<PyramidLevel<PixelType>> makeTestLevel() {
+  Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const int widthFullSize = rig[0].resolution.x();
+  const int heightFullSize = rig[0].resolution.y();
+  Camera::normalizeRig(rig);
+  const int numCams = rig.size();
+
+  std::vector<cv::Mat_<PixelType>> colors;
+  for (int i = 0; i < numCams; ++i) {
+    colors.push_back(randomColor(kLevelSize, i));
+  }
+
+  static const int kLevel = 0;
+  auto pyramidLevel = std::make_unique<PyramidLevel<PixelType>>(
+      0, // frameIdx
+      "000000",
+      1, // numFrames
+      kLevel,
+      1, // numLevels
+      std::map<int, cv::Size>{{kLevel, kLevelSize}},
+      rig,
+      rig,
+      mapSrcToDstIndexes(rig, rig),
+      colors,
+      cv_util::generateAllPassMasks(kLevelSize, numCams),
+      generateFovMasks(rig, kLevelSize, -1),
+      std::vector<cv::Mat_<float>>(numCams),
+      widthFullSize,
+      heightFullSize,
+      "", // color
+      4e-5, // varNoiseFloor
+      1e-3, // varHighThresh
+      false, // useForegroundMasks
+      "", // outputRoot
+      -1); // threads
+  precomputeProjections(*pyramidLevel);
+  reprojectColors(*pyramidLevel);
+  return pyramidLevel;
+}
+
+} // namespace
+
+// Args: SSDKernel, radius
+static void BM_ComputeSSD(benchmark::State& state) {
+  const SSDKernel kernel = SSDKernel(state.range(0));
+  const int radius = state.range(1);
+  if (kernel > getBestSSDKernel()) {
+    state.SkipWithError("kernel not supported on this CPU");
+    return;
+  }
+  const cv::Mat_<PixelType> dstColor = randomColor(kLevelSize, 0);
+  const cv::Mat_<PixelType> dstSrcColor = randomColor(kLevelSize, 1);
+
+  std::mt19937 engine(1);
+  std::vector<cv::Point2f> samples;
+  for (int i = 0; i < kNumSamples; ++i) {
+    samples.emplace_back(
+        std::uniform_real_distribution<float>(radius, kLevelSize.width - radius)(engine),
+        std::uniform_real_distribution<float>(radius, kLevelSize.height - radius)(engine));
+  }
+
+  int i = 0;
+  for (auto _ : state) {
+    const cv::Point2f& p = samples[i++ % kNumSamples];
+    const int x = p.x;
+    const int y = p.y;
+    benchmark::DoNotOptimize(computeSSD(
+        kernel,
+        dstColor,
+        x,
+        y,
+        dstColor(y, x),
+        dstSrcColor,
+        p.x + 0.25f,
+        p.y + 0.25f,
+        dstSrcColor(y, x),
+        radius));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ComputeSSD)
+    ->ArgsProduct({{int(SSDKernel::Scalar), int(SSDKernel::SSE), int(SSDKernel::AVX)}, {1, 2}});
+
+static void BM_ComputeCost(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> pyramidLevel = makeTestLevel();
+  static const int kDstIdx = 0;
+
+  std::mt19937 engine(1);
+  const int radius = kSearchWindowRadius;
+  std::vector<cv::Point3f> samples; // x, y, disparity
+  for (int i = 0; i < kNumSamples; ++i) {
+    samples.emplace_back(
+        std::uniform_int_distribution<int>(radius, kLevelSize.width - radius - 1)(engine),
+        std::uniform_int_distribution<int>(radius, kLevelSize.height - radius - 1)(engine),
+        std::uniform_real_distribution<float>(1e-4, 2)(engine));
+  }
+
+  int i = 0;
+  for (auto _ : state) {
+    const cv::Point3f& s = samples[i++ % kNumSamples];
+    benchmark::DoNotOptimize(computeCost(*pyramidLevel, kDstIdx, s.z, s.x, s.y));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ComputeCost);
+
+// Args: radius
+static void BM_GeneralizedJointBilateralFilter(benchmark::State& state) {
+  const int radius = state.range(0);
+  const cv::Mat_<PixelType> color = randomColor(kLevelSize, 0);
+  cv::Mat_<float> disparity(kLevelSize);
+  cv::randu(disparity, 0, 1);
+  const cv::Mat_<bool> mask(kLevelSize, true);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(generalizedJointBilateralFilter<float, PixelType>(
+        disparity,
+        color,
+        color,
+        mask,
+        radius,
+        kBilateralSigma,
+        kBilateralWeightB,
+        kBilateralWeightG,
+        kBilateralWeightR));
+  }
+  state.SetItemsProcessed(state.iterations() * kLevelSize.area());
+}
+BENCHMARK(BM_GeneralizedJointBilateralFilter)->Arg(1)->Arg(5)->Unit(benchmark::kMillisecond);
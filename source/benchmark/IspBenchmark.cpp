@@ -0,0 +1,84 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <benchmark/benchmark.h>
+#include <folly/Format.h>
+
+#include "source/isp/CameraIsp.h"
+
+using namespace fb360_dep;
+
+// Args: DemosaicFilter
+// getImage() runs the whole pipeline (executePipeline) and converts the result
+static void BM_CameraIspExecutePipeline(benchmark::State& state) {
+  const cv::Size size(1024, 1024);
+  cv::Mat_<uint16_t> raw(size);
+  cv::theRNG().state = 1;
+  cv::randu(raw, 0, 65535);
+
+  const std::string json = folly::sformat(
+      R"({{"CameraIsp": {{"bitsPerPixel": 16, "width": {}, "height": {}}}}})",
+      size.width,
+      size.height);
+  CameraIsp cameraIsp(json);
+  cameraIsp.setDemosaicFilter(DemosaicFilter(state.range(0)));
+  for (auto _ : state) {
+    state.PauseTiming();
+    cameraIsp.loadImage(raw);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(cameraIsp.getImage<uint16_t>());
+  }
+  state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_CameraIspExecutePipeline)
+    ->Arg(int(DemosaicFilter::BILINEAR))
+    ->Arg(int(DemosaicFilter::FREQUENCY))
+    ->Arg(int(DemosaicFilter::EDGE_AWARE))
+    ->Arg(int(DemosaicFilter::CHROMA_SUPRESSED_BILINEAR))
+    ->Unit(benchmark::kMillisecond);
+
+// Args: 0 = iirLowPassReference, 1 = iirLowPass on one thread, 2 = iirLowPass on all threads
+static void BM_IirLowPass(benchmark::State& state) {
+  const cv::Size size(2048, 2048);
+  cv::Mat_<cv::Vec3f> image(size);
+  cv::theRNG().state = 1;
+  cv::randu(image, 0, 1);
+  cv::Mat_<cv::Vec3f> lowPass(size);
+  using Boundary = isp::ReflectBoundary<int>;
+  const Boundary boundary;
+  const float kAmount = 10.0f / 2048.0f; // CameraIsp's default sharpening support
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      isp::iirLowPassReference<Boundary, Boundary, cv::Vec3f>(
+          image, kAmount, lowPass, boundary, boundary, 1.0f);
+    } else {
+      isp::iirLowPass<Boundary, Boundary, cv::Vec3f>(
+          image, kAmount, lowPass, boundary, boundary, 1.0f, state.range(0) == 1 ? 0 : -1);
+    }
+    benchmark::DoNotOptimize(lowPass.data);
+  }
+  state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_IirLowPass)->Arg(0)->Arg(1)->Arg(2)->Unit(benchmark::kMillisecond);
+
+// Args: 0 = cv::dct, 1 = parallelDct on one thread, 2 = parallelDct on all threads
+static void BM_Dct(benchmark::State& state) {
+  const cv::Size size(isp::getOptimalDctSize(3000), isp::getOptimalDctSize(2000));
+  cv::Mat_<float> plane(size);
+  cv::theRNG().state = 1;
+  cv::randu(plane, 0, 1);
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      cv::dct(plane, plane);
+    } else {
+      isp::parallelDct(plane, false, state.range(0) == 1 ? 0 : -1);
+    }
+    benchmark::DoNotOptimize(plane.data);
+  }
+  state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_Dct)->Arg(0)->Arg(1)->Arg(2)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,415 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/String.h>
+
+#include "source/util/Camera.h"
+#include "source/util/CvUtil.h"
+#include "source/util/ImageTypes.h"
+#include "source/util/ImageUtil.h"
+#include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+const std::string kUsageMessage = R"(
+ - Measures the throughput of the whole pipeline on a synthetic, deterministic scene, so runs can
+ be compared across versions and machines.
+
+ - For each of --rigs, RigSimulator renders random icosahedrons around the rig at --seed, and the
+ same frame is used --frames times. The pipeline binaries then run one after the other, as the
+ render scripts run them: foreground masks, pyramid resize (in this process), depth estimation,
+ temporal filtering, upsampling, ConvertToBinary and fusion. Foreground masks are computed against
+ the skybox alone, but depth estimation solves the full frames, as when there is no background.
+
+ - For each stage, frames per second and peak resident memory are reported, and the upsampled
+ disparity of the first frame is compared to the simulator's ground truth depth:
+   disparity_rmse: RMS error of 1 / depth (1/m) inside the image circles
+   depth_within_10pct: percentage of scene (non-skybox) pixels whose depth is within 10%
+
+ - Results are logged and written to --report as CSV. Linux only, as stages run as child
+ processes whose peak memory is read from wait4.
+
+ - Example:
+   ./dep_pipeline_bench \
+   --work_dir=/tmp/pipeline_bench
+ )";
+
+DEFINE_string(bin_dir, "", "directory of the pipeline binaries (empty = this binary's directory)");
+DEFINE_int32(frames, 5, "number of frames run through the pipeline");
+DEFINE_string(
+    level_widths,
+    "2048,1024,512,256,200,128,100,80,60,50",
+    "pyramid level widths, finest first (see scripts/render/config.py)");
+DEFINE_string(report, "", "path to the CSV report (empty = <work_dir>/pipeline_bench.csv)");
+DEFINE_int32(resolution, 512, "depth estimation resolution (width in pixels)");
+DEFINE_string(rigs, "ftheta_ring,icosahedron", "RigSimulator modes to benchmark, comma separated");
+DEFINE_int32(seed, 1, "random seed of the simulated scene and skybox");
+DEFINE_int32(threads, -1, "number of threads of every stage (-1 = auto, 0 = none)");
+DEFINE_int32(width, 1024, "simulated camera width (height is 4/3 of it)");
+DEFINE_string(work_dir, "", "scratch directory, cleared for every rig (required)");
+
+// Scene close enough to the rig to have parallax, in meters
+const int kIcosahedrons = 100;
+const double kMinIcosahedronDist = 1.0;
+const double kMaxIcosahedronDist = 4.0;
+const double kMinIcosahedronRadius = 0.1;
+const double kMaxIcosahedronRadius = 0.4;
+const double kTopCamVerticalOffset = 0.1;
+
+const float kMaxSceneDepth = 1e3; // farther is skybox
+const float kDepthTolerance = 0.1;
+
+struct StageResult {
+  std::string stage;
+  double seconds;
+  int64_t peakBytes;
+};
+
+struct Quality {
+  double disparityRmse;
+  double depthWithin;
+};
+
+std::string dir(const filesystem::path& root, const ImageType type) {
+  return (root / imageTypes[int(type)]).string();
+}
+
+std::string frameName(const int frame) {
+  return image_util::intToStringZeroPad(frame);
+}
+
+// Runs a pipeline binary to completion, measuring its wall time and peak resident memory
+StageResult runStage(
+    const std::string& stage,
+    const std::string& binary,
+    const std::vector<std::string>& args) {
+  const filesystem::path binDir = FLAGS_bin_dir;
+  std::vector<std::string> command = {(binDir / binary).string()};
+  command.insert(command.end(), args.begin(), args.end());
+  command.push_back(folly::sformat("--threads={}", FLAGS_threads));
+  LOG(INFO) << folly::sformat("{}: {}", stage, folly::join(" ", command));
+
+  std::vector<char*> argv;
+  for (std::string& arg : command) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  const auto start = std::chrono::steady_clock::now();
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0) << "cannot fork";
+  if (pid == 0) {
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  CHECK_EQ(wait4(pid, &status, 0, &usage), pid);
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      << folly::sformat("{} failed, see its log above", command[0]);
+  return {stage, elapsed.count(), int64_t(usage.ru_maxrss) * 1024}; // kilobytes
+}
+
+// Deterministic, textured skybox, so depth estimation has something to match everywhere
+void writeSkybox(const filesystem::path& path) {
+  cv::Mat_<cv::Vec3b> skybox(1024, 2048);
+  cv::theRNG().state = FLAGS_seed;
+  cv::randu(skybox, cv::Scalar::all(0), cv::Scalar::all(255));
+  cv::GaussianBlur(skybox, skybox, cv::Size(7, 7), 0);
+  cv_util::imwriteExceptionOnFail(path, skybox);
+}
+
+StageResult simulate(const std::string& mode, const filesystem::path& root) {
+  const filesystem::path skybox = root / "skybox.png";
+  writeSkybox(skybox);
+  const int width = FLAGS_width;
+  const std::vector<std::string> args = {
+      "--mode=" + mode,
+      "--scene=icosahedron",
+      folly::sformat("--seed={}", FLAGS_seed),
+      "--skybox_path=" + skybox.string(),
+      "--rig_out=" + (root / "rig.json").string(),
+      folly::sformat("--ftheta_width={}", width),
+      folly::sformat("--ftheta_height={}", width * 4 / 3),
+      folly::sformat("--ftheta_image_circle_radius={}", width * 5 / 6),
+      folly::sformat("--top_cam_vertical_offset={}", kTopCamVerticalOffset),
+      folly::sformat("--min_icosahedron_dist={}", kMinIcosahedronDist),
+      folly::sformat("--max_icosahedron_dist={}", kMaxIcosahedronDist),
+      folly::sformat("--min_icosahedron_radius={}", kMinIcosahedronRadius),
+      folly::sformat("--max_icosahedron_radius={}", kMaxIcosahedronRadius)};
+
+  std::vector<std::string> sceneArgs = args;
+  sceneArgs.push_back(folly::sformat("--num_random_icosahedrons={}", kIcosahedrons));
+  sceneArgs.push_back("--dest_cam_images=" + (root / "simulation").string());
+  filesystem::create_directories(root / "simulation");
+  StageResult result = runStage("simulate", "RigSimulator", sceneArgs);
+
+  std::vector<std::string> backgroundArgs = args;
+  backgroundArgs.push_back("--num_random_icosahedrons=0");
+  backgroundArgs.push_back("--dest_cam_images=" + (root / "simulation_background").string());
+  filesystem::create_directories(root / "simulation_background");
+  result.seconds += runStage("simulate", "RigSimulator", backgroundArgs).seconds;
+
+  // Every frame is the simulated one, the background is the scene without icosahedrons
+  const Camera::Rig rig = Camera::loadRig(root / "rig.json");
+  for (const Camera& cam : rig) {
+    const filesystem::path colorDir = filesystem::path(dir(root, ImageType::color)) / cam.id;
+    filesystem::create_directories(colorDir);
+    for (int frame = 0; frame < FLAGS_frames; ++frame) {
+      filesystem::copy_file(
+          root / "simulation" / (cam.id + ".png"), colorDir / (frameName(frame) + ".png"));
+    }
+    const filesystem::path backgroundDir =
+        filesystem::path(dir(root, ImageType::background_color)) / cam.id;
+    filesystem::create_directories(backgroundDir);
+    filesystem::copy_file(
+        root / "simulation_background" / (cam.id + ".png"), backgroundDir / "000000.png");
+  }
+  return result;
+}
+
+// Level widths no wider than the simulated cameras, finest first
+std::vector<int> getLevelWidths() {
+  std::vector<std::string> levelWidths;
+  folly::split(",", FLAGS_level_widths, levelWidths);
+  std::vector<int> widths;
+  for (const std::string& width : levelWidths) {
+    if (std::stoi(width) <= FLAGS_width) {
+      widths.push_back(std::stoi(width));
+    }
+  }
+  return widths;
+}
+
+// Same as scripts/render/resize.py, timed in this process
+StageResult resize(const filesystem::path& root, const std::vector<int>& widths) {
+  const Camera::Rig rig = Camera::loadRig(root / "rig.json");
+  system_util::RssHighWater highWater;
+  const auto start = std::chrono::steady_clock::now();
+  ThreadPool threadPool(FLAGS_threads);
+  for (const Camera& cam : rig) {
+    for (int frame = 0; frame < FLAGS_frames; ++frame) {
+      threadPool.spawn([&, frame] {
+        const filesystem::path colorDir = dir(root, ImageType::color);
+        const cv::Mat color = cv_util::imreadExceptionOnFail(
+            colorDir / cam.id / (frameName(frame) + ".png"), cv::IMREAD_UNCHANGED);
+        for (int level = 0; level < int(widths.size()); ++level) {
+          const filesystem::path levelDir = filesystem::path(dir(root, ImageType::color_levels)) /
+              ("level_" + std::to_string(level)) / cam.id;
+          filesystem::create_directories(levelDir);
+          const int height = std::round(double(color.rows) * widths[level] / color.cols);
+          cv::Mat resized;
+          cv::resize(color, resized, cv::Size(widths[level], height), 0, 0, cv::INTER_AREA);
+          cv_util::imwriteExceptionOnFail(levelDir / (frameName(frame) + ".png"), resized);
+        }
+      });
+    }
+  }
+  threadPool.join();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return {"resize", elapsed.count(), highWater.get()};
+}
+
+Quality measureQuality(const filesystem::path& root) {
+  const Camera::Rig rig = Camera::loadRig(root / "rig.json");
+  double sumSq = 0;
+  int64_t count = 0;
+  int64_t sceneCount = 0;
+  int64_t sceneWithin = 0;
+  for (const Camera& cam : rig) {
+    const cv::Mat_<float> depth =
+        cv_util::readCvMat32FC1FromPFM(root / "simulation" / (cam.id + "_depth.pfm"));
+    const cv::Mat_<float> disparity = cv_util::readCvMat32FC1FromPFM(
+        root / "disparity" / cam.id / (frameName(0) + ".pfm"));
+    CHECK_EQ(depth.size(), disparity.size());
+    for (int y = 0; y < depth.rows; ++y) {
+      for (int x = 0; x < depth.cols; ++x) {
+        const Camera::Vector2 pixel(x + 0.5, y + 0.5);
+        if (cam.isOutsideImageCircle(pixel) || !std::isfinite(disparity(y, x))) {
+          continue;
+        }
+        const double error = disparity(y, x) - 1.0 / depth(y, x);
+        sumSq += error * error;
+        ++count;
+        if (depth(y, x) < kMaxSceneDepth) {
+          ++sceneCount;
+          const double estimate = 1.0 / std::max(disparity(y, x), FLT_MIN);
+          sceneWithin += std::abs(estimate - depth(y, x)) <= kDepthTolerance * depth(y, x);
+        }
+      }
+    }
+  }
+  CHECK_GT(count, 0);
+  return {std::sqrt(sumSq / count), sceneCount ? 100.0 * sceneWithin / sceneCount : 0.0};
+}
+
+std::vector<StageResult> runPipeline(const filesystem::path& root) {
+  const std::string rig = (root / "rig.json").string();
+  const std::string first = "--first=" + frameName(0);
+  const std::string last = "--last=" + frameName(FLAGS_frames - 1);
+  const std::vector<int> widths = getLevelWidths();
+  const auto level = std::find(widths.begin(), widths.end(), FLAGS_resolution);
+  CHECK(level != widths.end()) << "--resolution must be one of --level_widths <= --width";
+  const int levelEnd = level - widths.begin();
+
+  std::vector<StageResult> results;
+  results.push_back(runStage(
+      "masks",
+      "GenerateForegroundMasks",
+      {"--rig=" + rig,
+       first,
+       last,
+       "--color=" + dir(root, ImageType::color),
+       "--background_color=" + dir(root, ImageType::background_color),
+       "--foreground_masks=" + dir(root, ImageType::foreground_masks),
+       folly::sformat("--width={}", FLAGS_resolution)}));
+  results.push_back(resize(root, widths));
+  results.push_back(runStage(
+      "derp",
+      "DerpCLI",
+      {"--rig=" + rig,
+       first,
+       last,
+       "--input_root=" + root.string(),
+       "--output_root=" + root.string(),
+       folly::sformat("--resolution={}", FLAGS_resolution)}));
+  results.push_back(runStage(
+      "temporal",
+      "TemporalBilateralFilter",
+      {"--rig=" + rig,
+       first,
+       last,
+       "--input_root=" + root.string(),
+       "--output_root=" + root.string(),
+       folly::sformat("--level={}", levelEnd),
+       folly::sformat("--resolution={}", FLAGS_resolution)}));
+  results.push_back(runStage(
+      "upsample",
+      "UpsampleDisparity",
+      {"--rig=" + rig,
+       first,
+       last,
+       folly::sformat(
+           "--disparity={}/level_{}",
+           dir(root, ImageType::disparity_time_filtered_levels),
+           levelEnd),
+       "--color=" + dir(root, ImageType::color),
+       "--output=" + dir(root, ImageType::disparity),
+       "--output_formats=pfm",
+       folly::sformat("--resolution={}", FLAGS_width)}));
+  results.push_back(runStage(
+      "convert",
+      "ConvertToBinary",
+      {"--rig=" + rig,
+       first,
+       last,
+       "--color=" + dir(root, ImageType::color),
+       "--disparity=" + dir(root, ImageType::disparity),
+       "--bin=" + dir(root, ImageType::bin)}));
+  results.push_back(runStage(
+      "fuse",
+      "ConvertToBinary",
+      {"--rig=" + rig,
+       first,
+       last,
+       "--run_conversion=false",
+       "--bin=" + dir(root, ImageType::bin),
+       "--fused=" + dir(root, ImageType::fused)}));
+  return results;
+}
+
+int main(int argc, char* argv[]) {
+  system_util::initDep(argc, argv, kUsageMessage);
+
+  CHECK_NE(FLAGS_work_dir, "");
+  CHECK_GT(FLAGS_frames, 0);
+  CHECK_GT(FLAGS_width, 0);
+  CHECK_LE(FLAGS_resolution, FLAGS_width);
+  if (FLAGS_bin_dir.empty()) {
+    FLAGS_bin_dir = filesystem::absolute(argv[0]).parent_path().string();
+  }
+  if (FLAGS_report.empty()) {
+    FLAGS_report = (filesystem::path(FLAGS_work_dir) / "pipeline_bench.csv").string();
+  }
+
+  std::vector<std::string> reportLines = {
+      "rig,stage,frames,seconds,fps,peak_rss_mb,disparity_rmse,depth_within_10pct"};
+  std::vector<std::string> modes;
+  folly::split(",", FLAGS_rigs, modes);
+  for (const std::string& mode : modes) {
+    const filesystem::path root = filesystem::path(FLAGS_work_dir) / mode;
+    filesystem::remove_all(root);
+    filesystem::create_directories(root);
+
+    const StageResult simulation = simulate(mode, root);
+    LOG(INFO) << folly::sformat("{}: simulated in {:.2f}s", mode, simulation.seconds);
+    const std::vector<StageResult> results = runPipeline(root);
+    const Quality quality = measureQuality(root);
+
+    StageResult total = {"total", 0, 0};
+    for (const StageResult& result : results) {
+      total.seconds += result.seconds;
+      total.peakBytes = std::max(total.peakBytes, result.peakBytes);
+    }
+    LOG(INFO) << folly::sformat("{} ({} frames):", mode, FLAGS_frames);
+    for (const StageResult& result : results) {
+      LOG(INFO) << folly::sformat(
+          "  {:<10} {:8.2f} fps {:8.0f} MB",
+          result.stage,
+          FLAGS_frames / result.seconds,
+          result.peakBytes / 1e6);
+      reportLines.push_back(folly::sformat(
+          "{},{},{},{:.3f},{:.3f},{:.0f},,",
+          mode,
+          result.stage,
+          FLAGS_frames,
+          result.seconds,
+          FLAGS_frames / result.seconds,
+          result.peakBytes / 1e6));
+    }
+    LOG(INFO) << folly::sformat(
+        "  {:<10} {:8.2f} fps {:8.0f} MB, disparity RMSE {:.4f}, depth within 10% {:.1f}%",
+        total.stage,
+        FLAGS_frames / total.seconds,
+        total.peakBytes / 1e6,
+        quality.disparityRmse,
+        quality.depthWithin);
+    reportLines.push_back(folly::sformat(
+        "{},{},{},{:.3f},{:.3f},{:.0f},{:.6f},{:.2f}",
+        mode,
+        total.stage,
+        FLAGS_frames,
+        total.seconds,
+        FLAGS_frames / total.seconds,
+        total.peakBytes / 1e6,
+        quality.disparityRmse,
+        quality.depthWithin));
+  }
+
+  std::ofstream report(FLAGS_report);
+  report << folly::join("\n", reportLines) << std::endl;
+  CHECK(report) << "cannot write " << FLAGS_report;
+  LOG(INFO) << "Report written to " << FLAGS_report;
+  return EXIT_SUCCESS;
+}
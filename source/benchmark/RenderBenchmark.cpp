@@ -0,0 +1,96 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "source/render/MeshSimplifier.h"
+#include "source/render/MeshUtil.h"
+#include "source/test/TestRig.h"
+#include "source/util/Camera.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+const cv::Size kDepthSize(336, 216); // test rig resolution / 10
+
+// Equi-error vertexes of a tilted plane seen from the first camera of the test rig
+Eigen::MatrixXd makeVertexes() {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  cv::Mat_<float> depth(kDepthSize);
+  for (int y = 0; y < depth.rows; ++y) {
+    for (int x = 0; x < depth.cols; ++x) {
+      depth(y, x) = 1.0f + 4.0f * x / depth.cols + 0.5f * std::sin(0.1f * y);
+    }
+  }
+  return mesh_util::getVertexesEquiError(depth, rig[0]);
+}
+
+} // namespace
+
+// Args: number of threads
+static void BM_GetFaces(benchmark::State& state) {
+  const Eigen::MatrixXd vertexes = makeVertexes();
+  static const bool kWrapHorizontally = false;
+  static const bool kIsRigCoordinates = false;
+  static const float kTearRatio = 0.95;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(mesh_util::getFaces(
+        vertexes,
+        kDepthSize.width,
+        kDepthSize.height,
+        kWrapHorizontally,
+        kIsRigCoordinates,
+        kTearRatio,
+        state.range(0)));
+  }
+  state.SetItemsProcessed(state.iterations() * kDepthSize.area());
+}
+BENCHMARK(BM_GetFaces)->Arg(1)->Arg(-1)->Unit(benchmark::kMillisecond);
+
+// Args: number of threads
+static void BM_GetFacesFloat(benchmark::State& state) {
+  using Vertexes = Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor>;
+  using Faces = Eigen::Matrix<uint32_t, Eigen::Dynamic, 3, Eigen::RowMajor>;
+  const Vertexes vertexes = makeVertexes().cast<float>();
+  Faces faces;
+  static const bool kWrapHorizontally = false;
+  static const bool kIsRigCoordinates = false;
+  static const float kTearRatio = 0.95;
+  for (auto _ : state) {
+    mesh_util::computeFaces(
+        faces,
+        vertexes,
+        kDepthSize.width,
+        kDepthSize.height,
+        kWrapHorizontally,
+        kIsRigCoordinates,
+        kTearRatio,
+        state.range(0));
+    benchmark::DoNotOptimize(faces.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kDepthSize.area());
+}
+BENCHMARK(BM_GetFacesFloat)->Arg(1)->Arg(-1)->Unit(benchmark::kMillisecond);
+
+// Args: number of threads
+static void BM_MeshSimplifierSimplify(benchmark::State& state) {
+  const Eigen::MatrixXd vertexes = makeVertexes();
+  const Eigen::MatrixXi faces =
+      mesh_util::getFaces(vertexes, kDepthSize.width, kDepthSize.height, false, false);
+  static const bool kIsEquiError = true;
+  static const float kStrictness = 0.2;
+  const int numFacesOut = faces.rows() / 10;
+  for (auto _ : state) {
+    state.PauseTiming();
+    render::MeshSimplifier simplifier(vertexes, faces, kIsEquiError, state.range(0));
+    state.ResumeTiming();
+    simplifier.simplify(numFacesOut, kStrictness);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_MeshSimplifierSimplify)->Arg(1)->Arg(-1)->Unit(benchmark::kMillisecond);
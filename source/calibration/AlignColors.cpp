@@ -10,9 +10,12 @@
 #include <opencv2/opencv.hpp>
 
 #include <folly/Format.h>
+#include <folly/json.h>
 
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/RemapUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::image_util;
@@ -36,35 +39,52 @@ DEFINE_string(color, "", "path to input color images (required)");
 DEFINE_string(first, "", "first frame to process (lexical)");
 DEFINE_string(last, "", "last frame to process (lexical)");
 DEFINE_string(output, "", "path to output directory (must be different than color path)");
+DEFINE_string(remap_cache_dir, "", "directory to cache warp maps in (empty = no cache)");
 DEFINE_string(rig_blue, "", "path to camera blue rig .json filename (required)");
 DEFINE_string(rig_green, "", "path to camera green rig .json filename (required)");
 DEFINE_string(rig_red, "", "path to camera red rig .json filename (required)");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 
 using Image = cv::Mat_<cv::Vec3w>;
-using WarpMap = cv::Mat_<cv::Point2f>;
-
-cv::Vec3w getPixelColor(const Image& srcImage, const cv::Point2f& srcPixel) {
-  return cv_util::getPixelBilinear(srcImage, srcPixel.x, srcPixel.y);
-}
+using WarpMap = remap_util::RemapTable;
 
+// For each pixel of dstCamera, where srcCamera sees it, as a fixed-point remap table
 WarpMap createWarpMap(const Camera& srcCamera, const Camera& dstCamera) {
   const int width = int(srcCamera.resolution.x());
   const int height = int(srcCamera.resolution.y());
-  cv::Mat_<cv::Point2f> warpMap(height, width);
-  for (double x = 0.5; x < width; ++x) {
-    for (double y = 0.5; y < height; ++y) {
-      const Camera::Vector2 dstPixel(x, y);
-      const double dstR = (dstPixel - dstCamera.principal).norm() / dstCamera.getScalarFocal();
-
-      const double theta = dstCamera.undistort(dstR);
-      const double srcR = srcCamera.distort(theta);
-      const Camera::Vector2 srcPixel = (dstPixel - dstCamera.principal) /
-              (dstPixel - dstCamera.principal).norm() * srcCamera.getScalarFocal() * srcR +
-          dstCamera.principal;
-      warpMap(y, x) = cv::Point2f(srcPixel.x(), srcPixel.y());
-    }
-  }
-  return warpMap;
+  cv::Mat_<cv::Vec2f> warpMap(height, width);
+  parallelFor(
+      0,
+      height,
+      1,
+      [&](const int y) {
+        for (int x = 0; x < width; ++x) {
+          const Camera::Vector2 dstPixel(x + 0.5, y + 0.5);
+          const double dstR = (dstPixel - dstCamera.principal).norm() / dstCamera.getScalarFocal();
+
+          const double theta = dstCamera.undistort(dstR);
+          const double srcR = srcCamera.distort(theta);
+          const Camera::Vector2 srcPixel = (dstPixel - dstCamera.principal) /
+                  (dstPixel - dstCamera.principal).norm() * srcCamera.getScalarFocal() * srcR +
+              dstCamera.principal;
+
+          // cv::remap has pixel centers at integer coordinates
+          warpMap(y, x) = cv::Vec2f(srcPixel.x() - 0.5, srcPixel.y() - 0.5);
+        }
+      },
+      FLAGS_threads);
+  const bool kIsNearest = false;
+  return remap_util::makeTable(warpMap, kIsNearest);
+}
+
+// Warp maps only depend on the cameras, so they are saved once per rig
+WarpMap getWarpMap(const Camera& srcCamera, const Camera& dstCamera) {
+  const std::string key = remap_util::getKey(
+      folly::sformat("align_colors {}", folly::toJson(dstCamera.serialize())),
+      srcCamera,
+      cv::Size(srcCamera.resolution.x(), srcCamera.resolution.y()));
+  return remap_util::getOrCompute(
+      FLAGS_remap_cache_dir, key, [&] { return createWarpMap(srcCamera, dstCamera); });
 }
 
 void createCalibratedRBRigs(
@@ -93,24 +113,14 @@ void createCalibratedRBRigs(
   }
 }
 
-Image warpImage(
-    const Image& currentImage,
-    const WarpMap& redWarpMap,
-    const WarpMap& blueWarpMap,
-    const int width,
-    const int height) {
-  Image alignedImage(height, width);
-  for (double x = 0.5; x < width; ++x) {
-    for (double y = 0.5; y < height; ++y) {
-      cv::Vec3w alignedColor(0, 0, 0);
-      alignedColor[1] = currentImage(y, x)[1];
-      cv::Vec3w interpolatedRed = getPixelColor(currentImage, redWarpMap(y, x));
-      alignedColor[2] = interpolatedRed[2];
-      cv::Vec3w interpolatedBlue = getPixelColor(currentImage, blueWarpMap(y, x));
-      alignedColor[0] = interpolatedBlue[0];
-      alignedImage(y, x) = alignedColor;
-    }
-  }
+// Green is kept, red and blue are gathered bilinearly through their warp maps
+Image warpImage(const Image& currentImage, const WarpMap& redWarpMap, const WarpMap& blueWarpMap) {
+  std::vector<cv::Mat> channels;
+  cv::split(currentImage, channels);
+  channels[2] = remap_util::remap(channels[2], redWarpMap, cv::BORDER_REPLICATE);
+  channels[0] = remap_util::remap(channels[0], blueWarpMap, cv::BORDER_REPLICATE);
+  Image alignedImage;
+  cv::merge(channels, alignedImage);
   return alignedImage;
 }
 
@@ -140,44 +150,45 @@ int main(int argc, char* argv[]) {
   createCalibratedRBRigs(
       calibratedRedRig, calibratedBlueRig, redRig, greenRig, blueRig, calibratedGreenRig);
 
+  CHECK_EQ(greenRig.size(), 1);
+  CHECK_EQ(redRig.size(), 1);
+  CHECK_EQ(blueRig.size(), 1);
+
   std::vector<WarpMap> redWarpMaps;
   std::vector<WarpMap> blueWarpMaps;
   for (unsigned long i = 0; i < calibratedGreenRig.size(); ++i) {
-    redWarpMaps.emplace_back(createWarpMap(calibratedRedRig[i], calibratedGreenRig[i]));
-    blueWarpMaps.emplace_back(createWarpMap(calibratedBlueRig[i], calibratedGreenRig[i]));
+    redWarpMaps.emplace_back(getWarpMap(calibratedRedRig[i], calibratedGreenRig[i]));
+    blueWarpMaps.emplace_back(getWarpMap(calibratedBlueRig[i], calibratedGreenRig[i]));
   }
 
   std::pair<int, int> frameRange =
       getFrameRange(FLAGS_color, calibratedGreenRig, FLAGS_first, FLAGS_last);
 
-  for (int iFrame = frameRange.first; iFrame <= frameRange.second; ++iFrame) {
-    const std::string frameName = intToStringZeroPad(iFrame);
-    LOG(INFO) << folly::sformat("Loading frame {}", frameName);
-
-    // Load input color images
-    const std::vector<Image> images =
-        loadImages<cv::Vec3w>(FLAGS_color, calibratedGreenRig, frameName);
-    CHECK_GT(images.size(), 0) << "no images loaded!";
-    CHECK_EQ(images.size(), calibratedGreenRig.size());
-    CHECK_EQ(greenRig.size(), 1);
-    CHECK_EQ(redRig.size(), 1);
-    CHECK_EQ(blueRig.size(), 1);
-
-    // Align to green
-    for (ssize_t imageIndex = 0; imageIndex < ssize(images); ++imageIndex) {
-      LOG(INFO) << folly::sformat("Aligning camera : {}", calibratedGreenRig[imageIndex].id);
-      const int width = int(calibratedGreenRig[imageIndex].resolution.x());
-      const int height = int(calibratedGreenRig[imageIndex].resolution.y());
-      const Image& alignedImage = warpImage(
-          images[imageIndex], redWarpMaps[imageIndex], blueWarpMaps[imageIndex], width, height);
-
-      const filesystem::path camDir =
-          filesystem::path(FLAGS_output) / calibratedGreenRig[imageIndex].id;
-      filesystem::create_directories(camDir);
-      const std::string outputFile = folly::sformat("{}/{}.png", camDir.string(), frameName);
-      cv_util::imwriteExceptionOnFail(outputFile, cv_util::convertTo<uint16_t>(alignedImage));
-    }
-  }
+  // One task per frame and camera, so that memory stays at one image per thread
+  const int numCameras = calibratedGreenRig.size();
+  const int numFrames = frameRange.second - frameRange.first + 1;
+  parallelFor(
+      0,
+      numFrames * numCameras,
+      1,
+      [&](const int i) {
+        const std::string frameName = intToStringZeroPad(frameRange.first + i / numCameras);
+        const int imageIndex = i % numCameras;
+        const Camera& camera = calibratedGreenRig[imageIndex];
+        LOG(INFO) << folly::sformat("Aligning frame {}, camera {}", frameName, camera.id);
+
+        const Image image = loadImage<cv::Vec3w>(FLAGS_color, camera.id, frameName);
+        CHECK_EQ(image.cols, int(camera.resolution.x()));
+        CHECK_EQ(image.rows, int(camera.resolution.y()));
+        const Image alignedImage =
+            warpImage(image, redWarpMaps[imageIndex], blueWarpMaps[imageIndex]);
+
+        const filesystem::path camDir = filesystem::path(FLAGS_output) / camera.id;
+        filesystem::create_directories(camDir);
+        const std::string outputFile = folly::sformat("{}/{}.png", camDir.string(), frameName);
+        cv_util::imwriteExceptionOnFail(outputFile, cv_util::convertTo<uint16_t>(alignedImage));
+      },
+      FLAGS_threads);
 
   return EXIT_SUCCESS;
 }
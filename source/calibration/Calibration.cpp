@@ -7,6 +7,8 @@
 
 #include "source/calibration/Calibration.h"
 
+#include <boost/algorithm/string.hpp>
+
 DEFINE_string(color, "", "path to input data");
 DEFINE_bool(enable_timing, false, "print timing results");
 DEFINE_string(frame, "", "frame to process (lexical)");
@@ -15,7 +17,21 @@ DEFINE_double(
     match_score_threshold,
     0.75,
     "minimum zncc score required for a match to be included");
-DEFINE_string(matches, "", "path to matches .json file");
+DEFINE_string(matches, "", "path to matches file");
+DEFINE_string(matches_format, "binary", "format of the saved matches (binary, json)");
+DEFINE_string(
+    recalibrate_cameras,
+    "",
+    "comma-separated ids of the cameras to recalibrate, e.g. after a bump. Matches between other "
+    "cameras are reused from --matches, and other cameras are locked (empty = calibrate all)");
 DEFINE_string(rig_in, "", "input camera rig .json filename");
 DEFINE_string(rig_out, "", "output camera rig .json filename");
 DEFINE_int32(threads, -1, "number of threads (-1 = max allowed, 0 = no threading)");
+
+std::set<std::string> getRecalibratedCameraIds() {
+  std::set<std::string> result;
+  if (!FLAGS_recalibrate_cameras.empty()) {
+    boost::split(result, FLAGS_recalibrate_cameras, boost::is_any_of(","));
+  }
+  return result;
+}
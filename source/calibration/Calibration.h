@@ -5,13 +5,21 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <set>
+#include <string>
+
 #include <gflags/gflags.h>
 
 int matchCorners();
 double geometricCalibration();
 
+// Cameras in --recalibrate_cameras, empty unless calibrating incrementally
+std::set<std::string> getRecalibratedCameraIds();
+
 DECLARE_string(rig_in);
 DECLARE_string(matches);
+DECLARE_string(matches_format);
+DECLARE_string(recalibrate_cameras);
 DECLARE_string(rig_out);
 
 DECLARE_string(color);
@@ -14,7 +14,8 @@ int calibration(
     const std::string& matches,
     const std::string& input_rig,
     const std::string& color,
-    const std::string& frame) {
+    const std::string& frame,
+    const std::string& recalibrate_cameras) {
   // set up flags
   FLAGS_rig_out = output_rig;
   FLAGS_matches = matches;
@@ -23,6 +24,7 @@ int calibration(
   if (!frame.empty()) {
     FLAGS_frame = frame;
   }
+  FLAGS_recalibrate_cameras = recalibrate_cameras;
 
   // run the calibration
   int result = matchCorners();
@@ -7,9 +7,13 @@
 
 #include <string>
 
+// Runs matchCorners and geometricCalibration. If recalibrate_cameras, a comma-separated list of
+// camera ids, is not empty, input_rig is an already calibrated rig and matches the output of its
+// calibration: only those cameras are rematched and solved for (see --recalibrate_cameras)
 int calibration(
     const std::string& output_rig,
     const std::string& matches,
     const std::string& input_rig,
     const std::string& color,
-    const std::string& frame = "");
+    const std::string& frame = "",
+    const std::string& recalibrate_cameras = "");
@@ -18,17 +18,26 @@ const std::string kUsageMessage = R"(
   - Example:
     ./CalibrationLibMain \
       /path/to/rigs/rig_calibrated.json \
-      /path/to/output/matches.json \
+      /path/to/output/matches.bin \
       /path/to/rigs/rig.json \
       /path/to/video/color
+
+  - An optional fifth argument recalibrates the listed cameras incrementally, e.g. after a bump.
+  The input rig is then the calibrated rig, and the matches those of its calibration:
+    ./CalibrationLibMain \
+      /path/to/rigs/rig_recalibrated.json \
+      /path/to/output/matches.bin \
+      /path/to/rigs/rig_calibrated.json \
+      /path/to/video/color \
+      cam3,cam7
   )";
 
 int main(int argc, char* argv[]) {
-  if (argc != 5) {
-    std::cerr << "Error: expected 4 arguments" << std::endl;
+  if (argc != 5 && argc != 6) {
+    std::cerr << "Error: expected 4 or 5 arguments" << std::endl;
     std::cerr
         << "Usage: calibrationlib <output_rig_filename> <matches_filename> <input_rig_filename> "
-        << "<color_directory>" << std::endl;
+        << "<color_directory> [<recalibrated_camera_ids>]" << std::endl;
     std::cerr << kUsageMessage << std::endl;
     return EXIT_FAILURE;
   }
@@ -36,7 +45,8 @@ int main(int argc, char* argv[]) {
   FLAGS_logtostderr = true;
   google::InitGoogleLogging(argv[0]);
 
-  calibration(argv[1], argv[2], argv[3], argv[4]);
+  const std::string kDefaultFrame = ""; // keep --frame
+  calibration(argv[1], argv[2], argv[3], argv[4], kDefaultFrame, argc == 6 ? argv[5] : "");
 
   return EXIT_SUCCESS;
 }
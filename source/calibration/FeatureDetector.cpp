@@ -7,15 +7,26 @@
 
 #include "source/calibration/FeatureDetector.h"
 
+#include <fstream>
+#include <random>
+#include <unordered_map>
+
 #include <boost/timer/timer.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
 
 #include "source/util/Camera.h"
+#include "source/util/FilesystemUtil.h"
 #include "source/util/ThreadPool.h"
 
+DEFINE_string(
+    corner_cache_dir,
+    "",
+    "directory where detected corners are cached, keyed by image content and detector flags");
 DEFINE_int32(deduplicate_radius, 3, "remove duplicate corners found at different octaves");
 DEFINE_double(harris_parameter, 0.04, "harris parameter");
 DEFINE_double(harris_window_radius, 5, "harris corner detector window radius");
@@ -36,51 +47,57 @@ using ImageId = std::string;
 namespace fb360_dep {
 namespace calibration {
 
-bool isUniqueCorner(
-    const std::vector<Keypoint>& corners,
-    const int previousCornerCount,
-    const Camera::Vector2& corner) {
-  if (FLAGS_deduplicate_radius <= 0) {
-    return true;
+// Corners of previous octaves, hashed by cells as wide as the deduplication radius, so that a
+// corner is only compared to the corners in the 3 x 3 cells around it
+class CornerHash {
+ public:
+  explicit CornerHash(const double radius) : radius(radius) {}
+
+  void add(const Camera::Vector2& corner) {
+    cells[getKey(getCell(corner.x()), getCell(corner.y()))].push_back(corner);
   }
-  for (int previousCorner = 0; previousCorner < previousCornerCount; previousCorner++) {
-    if ((corners[previousCorner].coords - corner).norm() < FLAGS_deduplicate_radius) {
-      return false;
+
+  bool isUnique(const Camera::Vector2& corner) const {
+    if (radius <= 0) {
+      return true;
+    }
+    const int64_t x = getCell(corner.x());
+    const int64_t y = getCell(corner.y());
+    for (int64_t cellY = y - 1; cellY <= y + 1; ++cellY) {
+      for (int64_t cellX = x - 1; cellX <= x + 1; ++cellX) {
+        const auto cell = cells.find(getKey(cellX, cellY));
+        if (cell == cells.end()) {
+          continue;
+        }
+        for (const Camera::Vector2& previous : cell->second) {
+          if ((previous - corner).norm() < radius) {
+            return false;
+          }
+        }
+      }
     }
+    return true;
   }
-  return true;
-}
 
-std::vector<Camera::Vector2> findScaledCorners(
-    const double scale,
-    const cv::Mat_<uint8_t>& imageFull,
-    const cv::Mat_<uint8_t>& maskFull,
-    const std::string& cameraId) {
-  std::vector<Camera::Vector2> cameraCorners;
-  std::vector<cv::Point2f> cvCorners;
-  cv::Mat_<uint8_t> gray;
-  cv::resize(imageFull, gray, cv::Size(), scale, scale, cv::INTER_AREA);
-  cv::Mat_<uint8_t> mask;
-  if (!maskFull.empty()) {
-    cv::resize(maskFull, mask, cv::Size(), scale, scale, cv::INTER_AREA);
+ private:
+  int64_t getCell(const double coord) const {
+    return radius <= 0 ? 0 : int64_t(std::floor(coord / radius));
   }
 
-  // Find corners using the cv harris detector
-  cv::goodFeaturesToTrack(
-      gray,
-      cvCorners,
-      FLAGS_max_corners,
-      FLAGS_min_feature_quality,
-      FLAGS_min_feature_distance * (FLAGS_same_scale ? scale : 1),
-      mask,
-      FLAGS_harris_window_radius,
-      true,
-      FLAGS_harris_parameter);
-  if (cvCorners.empty()) {
-    return cameraCorners;
+  static uint64_t getKey(const int64_t x, const int64_t y) {
+    return (uint64_t(x) << 32) ^ uint32_t(y);
   }
 
-  // Refine corners to subpixel precision
+  const double radius;
+  std::unordered_map<uint64_t, std::vector<Camera::Vector2>> cells;
+};
+
+// Refines corners of gray to subpixel precision, in parallel chunks
+// Returns the corners that refined, converted out of opencv coordinate convention and scaled
+std::vector<Camera::Vector2> refineCorners(
+    const double scale,
+    const cv::Mat_<uint8_t>& gray,
+    const std::vector<cv::Point2f>& cvCorners) {
   const cv::Size windowRadius(FLAGS_refine_corners_radius, FLAGS_refine_corners_radius);
   const cv::Size zeroZone = cv::Size(-1, -1); // means "no zeroZone"
   cv::TermCriteria criteria =
@@ -92,18 +109,69 @@ std::vector<Camera::Vector2> findScaledCorners(
   for (cv::Point2f& p : cvRefined) {
     p += kOffset;
   }
-  cv::cornerSubPix(gray, cvRefined, windowRadius, zeroZone, criteria);
 
-  // Only keep refined points, convert out of opencv coordinate convention, scale
+  // Corners refine independently. Small sets, e.g. when matching reprojected patches, stay inline
+  const int kChunkSize = 256;
+  const int chunkCount = (cvRefined.size() + kChunkSize - 1) / kChunkSize;
+  auto refineChunk = [&](const int chunk) {
+    const auto begin = cvRefined.begin() + chunk * kChunkSize;
+    const auto end = cvRefined.begin() + std::min(int(cvRefined.size()), (chunk + 1) * kChunkSize);
+    std::vector<cv::Point2f> points(begin, end);
+    cv::cornerSubPix(gray, points, windowRadius, zeroZone, criteria);
+    std::copy(points.begin(), points.end(), begin);
+  };
+  if (chunkCount > 1) {
+    parallelFor(0, chunkCount, 1, refineChunk, FLAGS_threads);
+  } else if (chunkCount == 1) {
+    refineChunk(0);
+  }
+
+  std::vector<Camera::Vector2> cameraCorners;
   for (ssize_t i = 0; i < ssize(cvRefined); ++i) {
     if (cvRefined[i] != cvCorners[i] + kOffset) {
       cameraCorners.emplace_back((cvRefined[i].x + 0.5f) / scale, (cvRefined[i].y + 0.5f) / scale);
     }
   }
-
   return cameraCorners;
 }
 
+// Corners of an image already scaled by scale, in full resolution coordinates
+std::vector<Camera::Vector2> findOctaveCorners(
+    const double scale,
+    const cv::Mat_<uint8_t>& gray,
+    const cv::Mat_<uint8_t>& mask) {
+  // Find corners using the cv harris detector
+  std::vector<cv::Point2f> cvCorners;
+  cv::goodFeaturesToTrack(
+      gray,
+      cvCorners,
+      FLAGS_max_corners,
+      FLAGS_min_feature_quality,
+      FLAGS_min_feature_distance * (FLAGS_same_scale ? scale : 1),
+      mask,
+      FLAGS_harris_window_radius,
+      true,
+      FLAGS_harris_parameter);
+  if (cvCorners.empty()) {
+    return {};
+  }
+  return refineCorners(scale, gray, cvCorners);
+}
+
+std::vector<Camera::Vector2> findScaledCorners(
+    const double scale,
+    const cv::Mat_<uint8_t>& imageFull,
+    const cv::Mat_<uint8_t>& maskFull,
+    const std::string& cameraId) {
+  cv::Mat_<uint8_t> gray;
+  cv::resize(imageFull, gray, cv::Size(), scale, scale, cv::INTER_AREA);
+  cv::Mat_<uint8_t> mask;
+  if (!maskFull.empty()) {
+    cv::resize(maskFull, mask, cv::Size(), scale, scale, cv::INTER_AREA);
+  }
+  return findOctaveCorners(scale, gray, mask);
+}
+
 static bool isCloseToEdge(const Camera::Vector2& point, const Image& image, const int margin) {
   if (0 <= point.x() - margin && point.x() + margin < image.cols) {
     if (0 <= point.y() - margin && point.y() + margin < image.rows) {
@@ -126,34 +194,55 @@ cv::Mat_<uint8_t> generateImageCircleMask(const Camera& camera) {
   return mask;
 }
 
-std::vector<Keypoint> findCorners(const Camera& camera, const Image& image, const bool useNearest) {
-  LOG(INFO) << folly::sformat("Processing camera {}... ", camera.id);
+// Corners found at all octaves, deduplicated and away from the edges
+// Each octave of the image and mask is downscaled from the previous one, and octaves are
+// searched in parallel. Deduplication then goes through them in order, against the corners
+// accepted at previous octaves
+std::vector<Camera::Vector2> detectCorners(const Camera& camera, const Image& image) {
+  // if we're comparing across a single scale, we don't rescale while finding corners
+  const int octaveCount = FLAGS_same_scale ? 1 : FLAGS_octave_count;
+  std::vector<Image> grays(octaveCount);
+  std::vector<cv::Mat_<uint8_t>> masks(octaveCount);
+  grays[0] = image;
+  masks[0] = generateImageCircleMask(camera);
+  for (int octave = 1; octave < octaveCount; ++octave) {
+    cv::resize(grays[octave - 1], grays[octave], cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+    cv::resize(masks[octave - 1], masks[octave], cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+  }
+
+  std::vector<std::vector<Camera::Vector2>> octaveCorners(octaveCount);
+  parallelFor(
+      0,
+      octaveCount,
+      1,
+      [&](const int octave) {
+        const double scale = std::pow(0.5, octave);
+        octaveCorners[octave] = findOctaveCorners(scale, grays[octave], masks[octave]);
+        if (FLAGS_log_verbose) {
+          LOG(INFO) << folly::sformat(
+              "{} found {} corners at scale {}", camera.id, octaveCorners[octave].size(), scale);
+        }
+      },
+      FLAGS_threads);
 
-  // Search for features at multiple scales
   int rejectedCorners = 0;
   int deduplicatedCorners = 0;
-  std::vector<Keypoint> corners;
-
-  // if we're comparing across a single scale, we don't rescale while finding corners
-  int octaveCount = FLAGS_same_scale ? 1 : FLAGS_octave_count;
-  const cv::Mat_<uint8_t>& mask = generateImageCircleMask(camera);
+  std::vector<Camera::Vector2> corners;
+  CornerHash previousOctaves(FLAGS_deduplicate_radius);
   for (int octave = 0; octave < octaveCount; ++octave) {
-    double scale = std::pow(0.5, octave);
-    std::vector<Camera::Vector2> octaveCorners = findScaledCorners(scale, image, mask, camera.id);
-    if (FLAGS_log_verbose) {
-      LOG(INFO) << folly::sformat(
-          "{} found {} corners at scale {}", camera.id, octaveCorners.size(), scale);
-    }
-    int cornerCountBeforeOctave = corners.size();
-    for (const Camera::Vector2& octaveCorner : octaveCorners) {
+    const int cornerCountBeforeOctave = corners.size();
+    for (const Camera::Vector2& octaveCorner : octaveCorners[octave]) {
       if (isCloseToEdge(octaveCorner, image, FLAGS_zncc_window_radius)) {
         rejectedCorners++;
-      } else if (!isUniqueCorner(corners, cornerCountBeforeOctave, octaveCorner)) {
+      } else if (!previousOctaves.isUnique(octaveCorner)) {
         deduplicatedCorners++;
       } else {
-        corners.emplace_back(octaveCorner, image, FLAGS_zncc_window_radius, useNearest);
+        corners.push_back(octaveCorner);
       }
     }
+    for (int i = cornerCountBeforeOctave; i < int(corners.size()); ++i) {
+      previousOctaves.add(corners[i]);
+    }
   }
 
   if (FLAGS_deduplicate_radius != 0) {
@@ -171,6 +260,118 @@ std::vector<Keypoint> findCorners(const Camera& camera, const Image& image, cons
   return corners;
 }
 
+// Corner cache file: CornerCacheHeader, then count corners as x, y doubles
+const uint32_t kCornerCacheMagic = 0x524e5243; // "CRNR"
+const int kCornerCacheVersion = 2; // bump when the detector changes
+
+struct CornerCacheHeader {
+  uint32_t magic;
+  uint32_t count;
+};
+
+// Corners only depend on the image, the camera's image circle and the detector flags
+std::string cornerCacheKey(const Camera& camera, const Image& image) {
+  uint64_t imageHash = folly::hash::FNV_64_HASH_START;
+  for (int y = 0; y < image.rows; ++y) {
+    imageHash = folly::hash::fnv64_buf(image.ptr(y), image.cols * sizeof(PixelType), imageHash);
+  }
+  const std::string key = folly::sformat(
+      "{} {} {}x{} {:016x} {} {} {} {} {} {} {} {} {} {} {}",
+      kCornerCacheVersion,
+      folly::toJson(camera.serialize()),
+      image.cols,
+      image.rows,
+      imageHash,
+      FLAGS_deduplicate_radius,
+      FLAGS_harris_parameter,
+      FLAGS_harris_window_radius,
+      FLAGS_max_corners,
+      FLAGS_min_feature_distance,
+      FLAGS_min_feature_quality,
+      FLAGS_refine_corners_epsilon,
+      FLAGS_refine_corners_radius,
+      FLAGS_zncc_window_radius,
+      FLAGS_same_scale ? 1 : FLAGS_octave_count,
+      FLAGS_same_scale);
+  return folly::sformat("{}_{:016x}", camera.id, folly::hash::fnv64(key));
+}
+
+bool loadCachedCorners(std::vector<Camera::Vector2>& corners, const filesystem::path& path) {
+  std::ifstream file(path.string(), std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  CornerCacheHeader header;
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!file || header.magic != kCornerCacheMagic) {
+    LOG(WARNING) << folly::sformat("Ignoring stale corner cache {}", path.string());
+    return false;
+  }
+  std::vector<double> coords(2 * header.count);
+  file.read(reinterpret_cast<char*>(coords.data()), coords.size() * sizeof(double));
+  if (!file || file.peek() != std::ifstream::traits_type::eof()) {
+    LOG(WARNING) << folly::sformat("Ignoring stale corner cache {}", path.string());
+    return false;
+  }
+  corners.clear();
+  for (size_t i = 0; i < header.count; ++i) {
+    corners.emplace_back(coords[2 * i], coords[2 * i + 1]);
+  }
+  return true;
+}
+
+void saveCachedCorners(const std::vector<Camera::Vector2>& corners, const filesystem::path& path) {
+  CornerCacheHeader header;
+  header.magic = kCornerCacheMagic;
+  header.count = corners.size();
+  std::vector<double> coords;
+  for (const Camera::Vector2& corner : corners) {
+    coords.push_back(corner.x());
+    coords.push_back(corner.y());
+  }
+
+  // Write to a temporary file and rename, so concurrent readers never see a partial file
+  filesystem::create_directories(path.parent_path());
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  std::ofstream file(tmpPath.string(), std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(coords.data()), coords.size() * sizeof(double));
+  file.close();
+  if (!file) {
+    LOG(WARNING) << folly::sformat("Cannot write corner cache {}", tmpPath.string());
+    filesystem::remove(tmpPath);
+    return;
+  }
+  filesystem::rename(tmpPath, path);
+}
+
+// Patches are cheap to extract compared to detecting and refining corners, so only the corners
+// are cached and patches are always extracted from the image
+std::vector<Keypoint> findCorners(const Camera& camera, const Image& image, const bool useNearest) {
+  LOG(INFO) << folly::sformat("Processing camera {}... ", camera.id);
+
+  const filesystem::path path = FLAGS_corner_cache_dir.empty()
+      ? filesystem::path()
+      : filesystem::path(FLAGS_corner_cache_dir) / (cornerCacheKey(camera, image) + ".corners");
+  std::vector<Camera::Vector2> coords;
+  if (!path.empty() && loadCachedCorners(coords, path)) {
+    LOG(INFO) << folly::sformat("{} loaded {} cached corners", camera.id, coords.size());
+  } else {
+    coords = detectCorners(camera, image);
+    if (!path.empty()) {
+      saveCachedCorners(coords, path);
+    }
+  }
+
+  std::vector<Keypoint> corners;
+  corners.reserve(coords.size());
+  for (const Camera::Vector2& coord : coords) {
+    corners.emplace_back(coord, image, FLAGS_zncc_window_radius, useNearest);
+  }
+  return corners;
+}
+
 std::map<ImageId, std::vector<Keypoint>>
 findAllCorners(const Camera::Rig& rig, const std::vector<Image>& images, const bool useNearest) {
   std::map<ImageId, std::vector<Keypoint>> allCorners;
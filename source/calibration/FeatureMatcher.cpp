@@ -7,6 +7,7 @@
 
 #include "source/calibration/FeatureMatcher.h"
 
+#include <climits>
 #include <future>
 #include <queue>
 
@@ -15,6 +16,7 @@
 #include <folly/Format.h>
 
 #include "source/calibration/FeatureDetector.h"
+#include "source/calibration/PatchSet.h"
 
 DEFINE_bool(custom_zncc, false, "uses custom ZNCC formula for patch matching");
 DEFINE_double(depth_max, 100.0, "max depth in m");
@@ -83,33 +85,86 @@ struct BestMatch {
   }
 };
 
-double computeZncc(const Keypoint& corner0, const Keypoint& corner1) {
-  CHECK_EQ(corner0.patch.size, corner1.patch.size);
-  double zncc = 0;
-  for (int x = 0; x < corner0.patch.cols; ++x) {
-    for (int y = 0; y < corner0.patch.rows; ++y) {
-      zncc += (corner0.patch(y, x) - corner0.avg) * (corner1.patch(y, x) - corner1.avg);
+// Buckets corners into square cells, so that the corners in a box are found without a scan
+class CornerGrid {
+ public:
+  CornerGrid(const std::vector<Keypoint>& corners, const float cellSize) : cellSize(cellSize) {
+    CHECK_GT(cellSize, 0);
+    if (corners.empty()) {
+      return;
     }
-  }
+    for (const Keypoint& corner : corners) {
+      points.emplace_back(corner.coords.x(), corner.coords.y());
+    }
+    lo = hi = points[0];
+    for (const cv::Point2f& point : points) {
+      lo = cv::Point2f(std::min(lo.x, point.x), std::min(lo.y, point.y));
+      hi = cv::Point2f(std::max(hi.x, point.x), std::max(hi.y, point.y));
+    }
+    cols = clampedCell(hi.x - lo.x, INT_MAX) + 1;
+    rows = clampedCell(hi.y - lo.y, INT_MAX) + 1;
 
-  if (FLAGS_custom_zncc) {
-    /* Custom ZNCC formula:
+    // cell c holds indexes[cellBegin[c], cellBegin[c + 1]), ascending
+    cellBegin.assign(cols * rows + 1, 0);
+    for (const cv::Point2f& point : points) {
+      ++cellBegin[getCell(point) + 1];
+    }
+    for (int c = 0; c < cols * rows; ++c) {
+      cellBegin[c + 1] += cellBegin[c];
+    }
+    indexes.resize(points.size());
+    std::vector<int> fill(cellBegin.begin(), cellBegin.end() - 1);
+    for (int i = 0; i < int(points.size()); ++i) {
+      indexes[fill[getCell(points[i])]++] = i;
+    }
+  }
 
-      mean((p0 - p0.avg) * (p1 - p1.avg)) / p0.avg / p1.avg
-      ---------------------------------------------
-      max(p0.stddev / p0.avg, p1.stddev / p1.avg)^2
-    */
+  // indexes of the corners in box, ascending
+  void find(std::vector<int>& result, const cv::Rect2f& box) const {
+    result.clear();
+    if (points.empty() || box.x > hi.x || box.y > hi.y || box.br().x < lo.x ||
+        box.br().y < lo.y) {
+      return;
+    }
+    const int x0 = clampedCell(box.x - lo.x, cols - 1);
+    const int x1 = clampedCell(box.br().x - lo.x, cols - 1);
+    const int y0 = clampedCell(box.y - lo.y, rows - 1);
+    const int y1 = clampedCell(box.br().y - lo.y, rows - 1);
+    for (int y = y0; y <= y1; ++y) {
+      for (int c = y * cols + x0; c <= y * cols + x1; ++c) {
+        for (int i = cellBegin[c]; i < cellBegin[c + 1]; ++i) {
+          if (box.contains(points[indexes[i]])) {
+            result.push_back(indexes[i]);
+          }
+        }
+      }
+    }
+    std::sort(result.begin(), result.end());
+  }
 
-    zncc /= corner0.patch.total();
-    zncc /= (corner0.avg * corner1.avg); // finishes numerator calculation
+ private:
+  int clampedCell(const float offset, const int maxCell) const {
+    return std::max(0, std::min(maxCell, int(std::floor(offset / cellSize))));
+  }
 
-    float denominator = std::max(corner0.std / corner0.avg, corner1.std / corner1.avg);
-    zncc /= (denominator * denominator);
-  } else {
-    zncc /= (corner0.std * corner1.std * corner0.patch.total());
+  int getCell(const cv::Point2f& point) const {
+    return clampedCell(point.y - lo.y, rows - 1) * cols + clampedCell(point.x - lo.x, cols - 1);
   }
 
-  return zncc;
+  const float cellSize;
+  std::vector<cv::Point2f> points;
+  cv::Point2f lo;
+  cv::Point2f hi;
+  int cols = 0;
+  int rows = 0;
+  std::vector<int> cellBegin;
+  std::vector<int> indexes; // of corners, grouped by cell
+};
+
+void addPatch(PatchSet& patches, const Image& patch) {
+  CHECK_EQ(patch.rows, patches.getSize());
+  CHECK_EQ(patch.cols, patches.getSize());
+  patches.add(patch.ptr(), patch.step);
 }
 
 // Compute a box around the pixel in camera 1 corresponding to the specified point in camera 0
@@ -219,6 +274,19 @@ Overlap findMatches(
   projectCornerTimer.stop();
 
   Image image1; // optimization: avoid reallocation by keeping this outside loop
+  if (corners0.empty() || corners1.empty()) {
+    return Overlap(camera0.id, camera1.id);
+  }
+
+  // corners1 patches contiguous and bucketed by position, a search box covers at most 2 x 2 cells
+  const int patchSize = corners1[0].patch.rows;
+  PatchSet patches1(patchSize);
+  for (const Keypoint& corner1 : corners1) {
+    addPatch(patches1, corner1.patch);
+  }
+  const CornerGrid grid1(corners1, 2 * FLAGS_search_radius);
+  PatchSet projection1(patchSize);
+  std::vector<int> candidates;
 
   // For each corner in corners0, compute its best and second best match in corners1. and vice versa
   std::vector<BestMatch> bestMatches0(corners0.size());
@@ -251,18 +319,18 @@ Overlap findMatches(
           continue;
         }
         firstProjection = false;
+        projection1.clear();
+        addPatch(projection1, image1);
       }
 
-      Keypoint projection1(image1);
-
       // look for a corner in c1 that is in the box and looks similar
       znccTimer.resume();
-      for (ssize_t index1 = 0; index1 < ssize(corners1); ++index1) {
-        cv::Point2f cvCoords(corners1[index1].coords.x(), corners1[index1].coords.y());
-        if (!box1.contains(cvCoords)) {
-          continue;
-        }
-        double score = computeZncc(projection1, corners1[index1]);
+      grid1.find(candidates, box1);
+      for (const int index1 : candidates) {
+        // a score at most both second best scores changes neither best match, don't finish it
+        const double floor = std::min(
+            bestMatches0[index0].secondBestScore, bestMatches1[index1].secondBestScore);
+        const double score = projection1.zncc(0, patches1, index1, floor, FLAGS_custom_zncc);
         bestMatches0[index0].updateCornerScore(score, index1);
         bestMatches1[index1].updateCornerScore(score, index0);
         callsToZncc++;
@@ -318,7 +386,9 @@ Overlap findMatches(
 std::vector<Overlap> findAllMatches(
     const Camera::Rig& rig,
     const std::vector<Image>& images,
-    const std::map<ImageId, std::vector<Keypoint>>& allCorners) {
+    const std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    const OverlapMatrix& overlapMatrix,
+    const std::function<bool(const Camera&, const Camera&)>& isMatched) {
   std::vector<Overlap> overlaps;
   boost::timer::cpu_timer matchTimer;
 
@@ -327,7 +397,13 @@ std::vector<Overlap> findAllMatches(
   std::queue<std::future<Overlap>> overlapFutures;
   for (ssize_t c1 = 0; c1 < ssize(rig); c1++) {
     for (ssize_t c2 = c1 + 1; c2 < ssize(rig); c2++) {
-      if (rig[c1].overlap(rig[c2]) < FLAGS_overlap_threshold) {
+      if (overlapMatrix.overlap(rig[c1].id, rig[c2].id) < FLAGS_overlap_threshold) {
+        continue;
+      }
+      if (isMatched && !isMatched(rig[c1], rig[c2])) {
+        overlapFutures.push(std::async(std::launch::deferred, [&rig, c1, c2] {
+          return Overlap(rig[c1].id, rig[c2].id);
+        }));
         continue;
       }
       overlapFutures.push(std::async(
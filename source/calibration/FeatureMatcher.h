@@ -5,8 +5,11 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <functional>
+
 #include "source/calibration/Keypoint.h"
 #include "source/util/Camera.h"
+#include "source/util/OverlapMatrix.h"
 
 DECLARE_bool(enable_timing);
 DECLARE_int32(threads);
@@ -32,10 +35,14 @@ Overlap findMatches(
     const std::vector<Keypoint>& corners1,
     const Camera& camera1);
 
+// Overlaps of the camera pairs that overlap enough according to overlapMatrix, in rig order. Pairs
+// isMatched rejects are returned without matches
 std::vector<Overlap> findAllMatches(
     const Camera::Rig& rig,
     const std::vector<cv::Mat_<uint8_t>>& images,
-    const std::map<std::string, std::vector<Keypoint>>& allCorners);
+    const std::map<std::string, std::vector<Keypoint>>& allCorners,
+    const OverlapMatrix& overlapMatrix,
+    const std::function<bool(const Camera&, const Camera&)>& isMatched = nullptr);
 
 } // namespace calibration
 } // namespace fb360_dep
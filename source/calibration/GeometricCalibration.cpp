@@ -9,7 +9,10 @@
 
 #include <future>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <random>
+#include <set>
 #include <unordered_map>
 
 #include <boost/algorithm/string.hpp>
@@ -24,6 +27,8 @@
 #include <folly/json.h>
 
 #include "source/calibration/Calibration.h"
+#include "source/calibration/MatchesFile.h"
+#include "source/util/AsyncWriter.h"
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 #include "source/util/MathUtil.h"
@@ -33,11 +38,16 @@ using namespace fb360_dep;
 using namespace fb360_dep::calibration;
 
 DEFINE_int32(cap_traces, 0, "speed up solver by capping the number of traces");
+DEFINE_bool(
+    cap_traces_coarse_to_fine,
+    false,
+    "grow the --cap_traces sample geometrically over the passes, all traces in the last one");
 DEFINE_double(ceres_function_tolerance, 1e-6, "ceres function tolerance");
 DEFINE_int32(
     ceres_threads,
     -1,
-    "number of threads used by ceres. requires compiled support for multithreading (default 1)");
+    "number of threads used by ceres (-1 = --threads). requires compiled support for "
+    "multithreading");
 DEFINE_string(debug_dir, "", "path to debug output");
 DEFINE_double(debug_error_scale, 0, "show scaled reprojection errors");
 DEFINE_double(debug_matches_overlap, 1, "show matches if overlap exceeds this fraction");
@@ -94,6 +104,14 @@ DEFINE_bool(
     shared_principal_and_focal,
     false,
     "all cameras in a group share the same focal, principal");
+DEFINE_int32(
+    stratify_traces,
+    0,
+    "keep --cap_traces traces evenly over an n x n grid in each camera (0 = uniformly at random)");
+DEFINE_int32(
+    triangulation_steps,
+    2,
+    "Gauss-Newton steps refining closed form triangulations (-1 = solve each with ceres)");
 DEFINE_bool(
     weight_by_trace_count,
     false,
@@ -157,13 +175,6 @@ cv::Mat_<cv::Vec3w> loadImage(const filesystem::path& path) {
   return cv_util::loadImage<cv::Vec3w>(colorDir / path);
 }
 
-folly::dynamic parseJsonFile(const std::string& path) {
-  std::string json;
-  folly::readFile(path.c_str(), json);
-  CHECK(!json.empty()) << "could not read JSON file: " << path;
-  return folly::parseJson(json);
-}
-
 // a feature is a point in an image
 struct Feature {
   Camera::Vector2 position; // position of the feature in its image, in pixels
@@ -217,27 +228,22 @@ struct Trace {
   }
 };
 
-/* Parse features from <parsed> JSON which has structure
-    {
-        "images": {
-            image_name: [{"x": x, "y": y, ...}]
-        },
-        ...
-    }
-    where image_name is defined as in imageIdFormat, above.
+/* Features of the images of <matches> (see MatchesData), where image names are defined as in
+    imageIdFormat, above.
 */
-FeatureMap loadFeatureMap(const folly::dynamic& parsed) {
+FeatureMap loadFeatureMap(const MatchesData& matches) {
   FeatureMap result;
 
-  for (const auto& image : parsed["images"].items()) {
-    const ImageId path = image.first.getString();
+  for (const MatchesData::ImageCorners& image : matches.images) {
+    const ImageId& path = image.image;
     if (!hasCameraIndex(path)) {
       LOG(INFO) << folly::sformat("ignoring image id {}", path);
       continue;
     }
     std::vector<Feature>& features = result[path];
-    for (const auto& feature : image.second) {
-      features.emplace_back(Camera::Vector2(feature["x"].asDouble(), feature["y"].asDouble()));
+    features.reserve(image.corners.size());
+    for (const Camera::Vector2& corner : image.corners) {
+      features.emplace_back(corner);
     }
   }
 
@@ -247,38 +253,21 @@ FeatureMap loadFeatureMap(const folly::dynamic& parsed) {
   return result;
 }
 
-/* Parse matches from <parsed> JSON which has structure
-    {
-        "all_matches": [{
-            "image1": image_name1,
-            "image2": image_name1,
-            "matches": [{
-                "idx1": idx1,
-                "idx2": idx2
-            }]
-        }],
-        ...
-    }
+/* Overlaps of <matches> (see MatchesData) between images with a camera index
 */
-std::vector<Overlap> loadOverlaps(const folly::dynamic& parsed) {
+std::vector<Overlap> loadOverlaps(const MatchesData& matches) {
   std::vector<Overlap> result;
 
   size_t count = 0;
-  for (const auto& overlap : parsed["all_matches"]) {
-    ImageId path0 = overlap["image1"].getString();
-    ImageId path1 = overlap["image2"].getString();
-    if (!hasCameraIndex(path0) || !hasCameraIndex(path1)) {
+  for (const MatchesData::ImagePair& overlap : matches.overlaps) {
+    if (!hasCameraIndex(overlap.image1) || !hasCameraIndex(overlap.image2)) {
       continue;
     }
-    result.emplace_back(path0, path1);
-    for (const auto& match : overlap["matches"]) {
+    result.emplace_back(overlap.image1, overlap.image2);
+    for (const MatchesData::Match& match : overlap.matches) {
       // A threshold of 0 indicates that score should be ignored
-      // Check if score should be ignored before attempting to access
-      // match["score"] since it might not be defined in the json
-      if (FLAGS_match_score_threshold == 0 ||
-          FLAGS_match_score_threshold <= match["score"].asDouble()) {
-        result.back().matches.push_back(
-            {{size_t(match["idx1"].asInt()), size_t(match["idx2"].asInt())}});
+      if (FLAGS_match_score_threshold == 0 || FLAGS_match_score_threshold <= match.score) {
+        result.back().matches.push_back({{size_t(match.idx1), size_t(match.idx2)}});
       }
     }
     count += 2 * result.back().matches.size();
@@ -346,7 +335,10 @@ void generateArtificalPoints(
 }
 
 Camera::Vector3 triangulate(const Observations& observations) {
-  return triangulateNonlinear(observations, FLAGS_force_in_front);
+  if (FLAGS_triangulation_steps < 0) {
+    return triangulateNonlinear(observations, FLAGS_force_in_front);
+  }
+  return triangulateLinear(observations, FLAGS_force_in_front, FLAGS_triangulation_steps);
 }
 
 // return reprojection errors for each camera
@@ -486,44 +478,29 @@ void removeInvalidTraces(std::vector<Trace>& traces, FeatureMap& featureMap) {
   LOG(INFO) << folly::sformat("removed {} out of {} traces", removed, total);
 }
 
-void triangulateTracesThread(
-    std::vector<Trace>& traces,
-    const size_t begin,
-    const size_t end,
-    const FeatureMap& featureMap,
-    const std::vector<Camera>& cameras) {
-  for (size_t i = begin; i < end; ++i) {
-    Trace& trace = traces[i];
-    if (!trace.references.empty()) {
-      Observations observations;
-      for (const auto& ref : trace.references) {
-        const Feature& feature = featureMap.at(ref.first)[ref.second];
-        const Camera& camera = cameras[getCameraIndex(ref.first)];
-        observations.emplace_back(camera, feature.position);
-      }
-      trace.position = triangulate(observations);
-    }
-  }
-}
-
 void triangulateTraces(
     std::vector<Trace>& traces,
     const FeatureMap& featureMap,
     const std::vector<Camera>& cameras) {
-  const int threadCount = ThreadPool::getThreadCountFromFlag(FLAGS_threads);
-  std::vector<std::thread> threads;
-  for (int thread = 0; thread < threadCount; ++thread) {
-    threads.emplace_back(
-        triangulateTracesThread,
-        std::ref(traces),
-        thread * traces.size() / threadCount,
-        (thread + 1) * traces.size() / threadCount,
-        std::cref(featureMap),
-        std::cref(cameras));
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
-  }
+  // traces differ a lot in observation count, small chunks keep the threads balanced
+  const int kGrain = 64;
+  parallelFor(
+      0,
+      traces.size(),
+      kGrain,
+      [&](const int i) {
+        Trace& trace = traces[i];
+        if (!trace.references.empty()) {
+          Observations observations;
+          for (const auto& ref : trace.references) {
+            const Feature& feature = featureMap.at(ref.first)[ref.second];
+            const Camera& camera = cameras[getCameraIndex(ref.first)];
+            observations.emplace_back(camera, feature.position);
+          }
+          trace.position = triangulate(observations);
+        }
+      },
+      FLAGS_threads);
 }
 
 std::vector<Trace> assembleTraces(FeatureMap& featureMap, const std::vector<Overlap>& overlaps) {
@@ -608,6 +585,30 @@ cv::Mat_<T> projectImageBetweenCamerasNearest(
   return dstImage;
 }
 
+// Debug images are rendered at most this size, straight at that resolution
+const double kDebugWidth = 1200;
+const double kDebugHeight = 800;
+
+// camera at the resolution its debug images are rendered at
+Camera getDebugCamera(const Camera& camera) {
+  const double factor = std::min(
+      {1.0, kDebugWidth / camera.resolution.x(), kDebugHeight / camera.resolution.y()});
+  return camera.rescale(
+      {std::round(camera.resolution.x() * factor), std::round(camera.resolution.y() * factor)});
+}
+
+// pixel of camera as a pixel of its debug camera
+Camera::Vector2 toDebugPixel(const Camera& debug, const Camera& camera, const Camera::Vector2& p) {
+  return p.cwiseProduct(debug.resolution).cwiseQuotient(camera.resolution);
+}
+
+cv::Mat_<cv::Vec3w> loadDebugImage(const ImageId& image, const Camera& debug) {
+  cv::Mat_<cv::Vec3w> result = loadImage(image);
+  cv::resize(
+      result, result, cv::Size(debug.resolution.x(), debug.resolution.y()), 0, 0, cv::INTER_AREA);
+  return result;
+}
+
 cv::Mat_<cv::Vec3w> renderOverlap(
     const Overlap& overlap,
     const FeatureMap& featureMap,
@@ -618,10 +619,13 @@ cv::Mat_<cv::Vec3w> renderOverlap(
   const ImageId& image1 = overlap.images[1];
   const Camera& camera0 = cameras[getCameraIndex(image0)];
   const Camera& camera1 = cameras[getCameraIndex(image1)];
+  const Camera debug0 = getDebugCamera(camera0);
+  const Camera debug1 = getDebugCamera(camera1);
   const std::vector<Feature>& features0 = featureMap.at(image0);
   const std::vector<Feature>& features1 = featureMap.at(image1);
   cv::Mat_<cv::Vec3w> result = blend(
-      loadImage(image0), projectImageBetweenCamerasNearest(camera0, camera1, loadImage(image1)));
+      loadDebugImage(image0, debug0),
+      projectImageBetweenCamerasNearest(debug0, debug1, loadDebugImage(image1, debug1)));
   for (const auto& match : overlap.matches) {
     Camera::Vector2 p0 = features0[match[0]].position;
     Camera::Vector2 p1 = features1[match[1]].position;
@@ -631,9 +635,9 @@ cv::Mat_<cv::Vec3w> renderOverlap(
         trace < 0 ? triangulate({{camera0, p0}, {camera1, p1}}) : traces[trace].position;
     drawRedGreenLine(
         result,
-        p0, // p0 in red
-        camera0.pixel(camera1.rigNearInfinity(p1)), // transformed p1 in green
-        camera0.pixel(rig)); // via transformed triangulation
+        toDebugPixel(debug0, camera0, p0), // p0 in red
+        debug0.pixel(camera1.rigNearInfinity(p1)), // transformed p1 in green
+        debug0.pixel(rig)); // via transformed triangulation
   }
 
   return result;
@@ -645,10 +649,12 @@ cv::Mat_<cv::Vec3w> renderReprojections(
     const std::vector<Feature>& features,
     const std::vector<Trace>& traces,
     const Camera::Real scale) {
-  cv::Mat_<cv::Vec3w> result = 0.5f * loadImage(image);
-  cv::Mat_<cv::Vec3f> errors = cv::Mat::zeros(result.size(), CV_32FC3);
-  const cv::Scalar green(0, 255, 0);
-  const cv::Scalar red(0, 0, 255);
+  const Camera debug = getDebugCamera(camera);
+  cv::Mat_<cv::Vec3w> result = 0.5f * loadDebugImage(image, debug);
+  cv::Mat_<cv::Vec3f> errors;
+  if (FLAGS_errors_dir != "") {
+    errors = cv::Mat::zeros(camera.resolution.y(), camera.resolution.x(), CV_32FC3);
+  }
   for (const Feature& feature : features) {
     if (feature.trace >= 0) {
       // draw red line from image feature to reprojected world point
@@ -657,9 +663,15 @@ cv::Mat_<cv::Vec3w> renderReprojections(
       Camera::Vector2 error = proj - feature.position;
 
       // OpenCV can only save 1, 3, 4 channels so the third is simply an artifact
-      errors(cv::Point(feature.position.x(), feature.position.y())) =
-          cv::Vec3f(error.x(), error.y(), 0.0f);
-      drawRedGreenLine(result, feature.position, proj + scale * error, proj);
+      if (!errors.empty()) {
+        errors(cv::Point(feature.position.x(), feature.position.y())) =
+            cv::Vec3f(error.x(), error.y(), 0.0f);
+      }
+      drawRedGreenLine(
+          result,
+          toDebugPixel(debug, camera, feature.position),
+          toDebugPixel(debug, camera, proj + scale * error),
+          toDebugPixel(debug, camera, proj));
     }
   }
 
@@ -705,7 +717,17 @@ double acosClamp(double x) {
   return std::acos(std::min(std::max(-1.0, x), 1.0));
 }
 
-std::string getCameraRmseReport(
+// Root mean square differences of the cameras from the ground truth
+struct CameraRmse {
+  Camera::Real position;
+  Camera::Real rotation;
+  Camera::Real principal;
+  Camera::Real distortion;
+  Camera::Real focal;
+  Camera::Real angle;
+};
+
+CameraRmse getCameraRmse(
     const std::vector<Camera>& cameras,
     const std::vector<Camera>& groundTruth) {
   Camera::Real position = 0;
@@ -767,14 +789,22 @@ std::string getCameraRmseReport(
   focal /= cameras.size();
   angle /= angleCount;
 
+  return {
+      sqrt(position), sqrt(rotation), sqrt(principal), sqrt(distortion), sqrt(focal), sqrt(angle)};
+}
+
+std::string getCameraRmseReport(
+    const std::vector<Camera>& cameras,
+    const std::vector<Camera>& groundTruth) {
+  const CameraRmse rmse = getCameraRmse(cameras, groundTruth);
   std::ostringstream result;
   result << "RMSEs: "
-         << "Pos " << sqrt(position) << " "
-         << "Rot " << sqrt(rotation) << " "
-         << "Principal " << sqrt(principal) << " "
-         << "Distortion " << sqrt(distortion) << " "
-         << "Focal " << sqrt(focal) << " "
-         << "Angle " << sqrt(angle) << " ";
+         << "Pos " << rmse.position << " "
+         << "Rot " << rmse.rotation << " "
+         << "Principal " << rmse.principal << " "
+         << "Distortion " << rmse.distortion << " "
+         << "Focal " << rmse.focal << " "
+         << "Angle " << rmse.angle << " ";
 
   return result.str();
 }
@@ -796,6 +826,10 @@ double* parameterBlock(Trace& t) {
 
 template <typename T>
 void lockParameter(ceres::Problem& problem, T& param, const bool lock = true) {
+  // parameters no residual uses, e.g. the relative camera's position, are not in the problem
+  if (!problem.HasParameterBlock(parameterBlock(param))) {
+    return;
+  }
   if (lock) {
     problem.SetParameterBlockConstant(parameterBlock(param));
   } else {
@@ -810,15 +844,22 @@ void lockParameters(ceres::Problem& problem, std::vector<T>& params, const bool
   }
 }
 
-void reasonableResize(cv::Mat_<cv::Vec3w>& mat) {
-  const double kWidth = 1200;
-  const double kHeight = 800;
-  double factor = std::min(kWidth / mat.cols, kHeight / mat.rows);
-  if (factor < 1) {
-    cv::resize(mat, mat, {}, factor, factor, cv::INTER_AREA);
-  }
+// Renders and writes debug images to --debug_dir in the background, so the passes don't wait for
+// them. Tasks render from their own snapshot of the calibration state
+AsyncWriter& getDebugWriter() {
+  const int kThreads = 2;
+  const size_t kCapacity = 64; // pending images, beyond that the passes wait after all
+  static AsyncWriter writer(kThreads, kCapacity);
+  return writer;
 }
 
+// what debug images are rendered from, as of the pass that queued them
+struct DebugSnapshot {
+  std::vector<Camera> cameras;
+  FeatureMap featureMap;
+  std::vector<Trace> traces;
+};
+
 void showMatches(
     const std::vector<Camera>& cameras,
     const FeatureMap& featureMap,
@@ -826,19 +867,24 @@ void showMatches(
     const std::vector<Trace>& traces,
     const int pass) {
   // visualization for debugging
+  std::shared_ptr<const DebugSnapshot> snapshot;
   for (const Overlap& overlap : overlaps) {
     const int idx0 = getCameraIndex(overlap.images[0]);
     const int idx1 = getCameraIndex(overlap.images[1]);
     if (cameras[idx0].overlap(cameras[idx1]) > FLAGS_debug_matches_overlap) {
-      cv::Mat_<cv::Vec3w> image = renderOverlap(overlap, featureMap, traces, cameras);
-      reasonableResize(image);
-
       if (!FLAGS_debug_dir.empty()) {
+        if (!snapshot) {
+          snapshot = std::make_shared<const DebugSnapshot>(
+              DebugSnapshot{cameras, featureMap, traces});
+        }
         std::string filename = FLAGS_debug_dir + "/" + "pass" + std::to_string(pass) + "_" +
             getCameraId(overlap.images[0]) + "-" + getCameraId(overlap.images[1]) + ".png";
-        imwrite(filename, image);
+        getDebugWriter().write([snapshot, overlap, filename] {
+          const DebugSnapshot& state = *snapshot;
+          imwrite(filename, renderOverlap(overlap, state.featureMap, state.traces, state.cameras));
+        });
       } else {
-        cv::imshow("overlap", image);
+        cv::imshow("overlap", renderOverlap(overlap, featureMap, traces, cameras));
         cv::waitKey();
       }
     }
@@ -850,54 +896,253 @@ void showReprojections(
     const FeatureMap& featureMap,
     const std::vector<Trace>& traces,
     const Camera::Real scale) {
+  std::shared_ptr<const DebugSnapshot> snapshot;
+  if (!FLAGS_debug_dir.empty()) {
+    snapshot = std::make_shared<const DebugSnapshot>(DebugSnapshot{cameras, featureMap, traces});
+  }
   for (const auto& entry : featureMap) {
     const ImageId& image = entry.first;
-    const std::vector<Feature>& features = entry.second;
     const Camera& camera = cameras[getCameraIndex(image)];
-    cv::Mat_<cv::Vec3w> render = renderReprojections(image, camera, features, traces, scale);
-    reasonableResize(render);
-    if (!FLAGS_debug_dir.empty()) {
+    if (snapshot) {
       std::string filename = FLAGS_debug_dir + "/" + camera.id + ".png";
-      imwrite(filename, render);
+      getDebugWriter().write([snapshot, image, camera, scale, filename] {
+        const std::vector<Feature>& features = snapshot->featureMap.at(image);
+        imwrite(filename, renderReprojections(image, camera, features, snapshot->traces, scale));
+      });
     } else {
-      cv::imshow("reprojections", render);
+      cv::imshow("reprojections", renderReprojections(image, camera, entry.second, traces, scale));
       cv::waitKey();
     }
   }
 }
 
+std::default_random_engine& getRandomEngine() {
+  static thread_local std::default_random_engine e; // experiments run in parallel
+  return e;
+}
+
 // returns true with a probability of numerator / denominator
 bool randomSample(int numerator, int denominator) {
-  static std::default_random_engine e;
-  return numerator > std::uniform_int_distribution<>(0, denominator - 1)(e);
+  return numerator > std::uniform_int_distribution<>(0, denominator - 1)(getRandomEngine());
+}
+
+// traces a pass keeps, --cap_traces or, coarse to fine, from --cap_traces in the first pass to
+// all of them in the last. 0 = all
+int getTraceCap(const int pass, const int traceCount) {
+  if (!FLAGS_cap_traces || FLAGS_cap_traces >= traceCount) {
+    return 0;
+  }
+  if (!FLAGS_cap_traces_coarse_to_fine || FLAGS_pass_count == 1) {
+    return FLAGS_cap_traces;
+  }
+  const double growth = double(traceCount) / FLAGS_cap_traces; // over all the passes
+  const double fraction = double(pass) / (FLAGS_pass_count - 1);
+  const int cap = std::lround(FLAGS_cap_traces * std::pow(growth, fraction));
+  return cap < traceCount ? cap : 0;
+}
+
+// cap of the traces, evenly over the cameras and a grid x grid grid of cells in each
+// A trace goes in the bin of the cell of each of its features, and the bins take turns keeping
+// one of their traces at random until cap are kept, so bins of dense textured regions keep no
+// more than the sparse ones, once those run out
+std::vector<bool> stratifiedSample(
+    const std::vector<Trace>& traces,
+    const FeatureMap& featureMap,
+    const std::vector<Camera>& cameras,
+    const int cap,
+    const int grid) {
+  std::vector<std::vector<int>> bins(cameras.size() * grid * grid);
+  for (int i = 0; i < int(traces.size()); ++i) {
+    for (const auto& ref : traces[i].references) {
+      const int camera = getCameraIndex(ref.first);
+      const Camera::Vector2& position = featureMap.at(ref.first)[ref.second].position;
+      const Camera::Vector2 cell = position.cwiseQuotient(cameras[camera].resolution) * grid;
+      const int x = math_util::clamp(int(cell.x()), 0, grid - 1);
+      const int y = math_util::clamp(int(cell.y()), 0, grid - 1);
+      bins[(camera * grid + y) * grid + x].push_back(i);
+    }
+  }
+  for (std::vector<int>& bin : bins) {
+    std::shuffle(bin.begin(), bin.end(), getRandomEngine());
+  }
+
+  std::vector<bool> result(traces.size());
+  std::vector<size_t> next(bins.size()); // position in each bin
+  int kept = 0;
+  for (bool isEmpty = false; kept < cap && !isEmpty;) {
+    isEmpty = true;
+    for (int b = 0; b < int(bins.size()) && kept < cap; ++b) {
+      // skip the traces another bin kept
+      while (next[b] < bins[b].size() && result[bins[b][next[b]]]) {
+        ++next[b];
+      }
+      if (next[b] < bins[b].size()) {
+        result[bins[b][next[b]++]] = true;
+        ++kept;
+        isEmpty = false;
+      }
+    }
+  }
+  return result;
+}
+
+// traces pass solves with, see getTraceCap
+std::vector<bool> sampleTraces(
+    const std::vector<Trace>& traces,
+    const FeatureMap& featureMap,
+    const std::vector<Camera>& cameras,
+    const int pass) {
+  const int cap = getTraceCap(pass, traces.size());
+  if (cap == 0) {
+    return std::vector<bool>(traces.size(), true);
+  }
+  LOG(INFO) << folly::sformat("Pass {} keeps {} of {} traces", pass, cap, traces.size());
+  if (FLAGS_stratify_traces) {
+    return stratifiedSample(traces, featureMap, cameras, cap, FLAGS_stratify_traces);
+  }
+  std::vector<bool> result(traces.size());
+  for (int i = 0; i < int(traces.size()); ++i) {
+    result[i] = randomSample(cap, traces.size());
+  }
+  return result;
 }
 
-void solve(ceres::Problem& problem) {
+// a feature, as its image and its index in the image's features
+using FeatureKey = std::pair<ImageId, int>;
+
+// The bundle adjustment problem, kept across passes
+// Consecutive passes mostly see the same observations, so rather than rebuilding the problem each
+// pass updates it: residuals of observations that are gone (outliers, capped traces) or that
+// changed (trace, weight, spherical parameterization) are removed, new ones are added and all
+// parameter values are overwritten in place. A trace's point is keyed by its smallest reference
+struct RefinementProblem {
+  struct Residual {
+    ceres::ResidualBlockId id;
+    FeatureKey point;
+    int weight;
+    bool isSpherical;
+
+    bool isSame(const FeatureKey& otherPoint, const int otherWeight, const bool otherIsSpherical)
+        const {
+      return point == otherPoint && weight == otherWeight && isSpherical == otherIsSpherical;
+    }
+  };
+
+  const int threads; // ceres threads, each experiment solves its own problem
+  ceres::Problem problem;
+
+  // per camera, sized once so that the pointers the problem holds stay valid
+  std::vector<Camera::Vector3> positions;
+  std::vector<Camera::Vector3> rotations;
+  std::vector<Camera::Vector2> principals;
+  std::vector<Camera::Real> focals;
+  std::vector<Camera::Distortion> distortions;
+
+  // position of the relative camera when positions are unlocked. The baseline to the (locked)
+  // reference camera is locked, so radius is set the first time and kept, as are the residuals
+  bool hasRadius = false;
+  Camera::Real radius = 0;
+  Camera::Real theta = 0;
+  Camera::Real phi = 0;
+
+  // map nodes don't move, so neither do the points
+  std::map<FeatureKey, Camera::Vector3> points;
+  std::map<FeatureKey, Residual> residuals;
+
+  RefinementProblem(const int cameraCount, const int threads)
+      : threads(threads),
+        problem(getProblemOptions()),
+        positions(cameraCount),
+        rotations(cameraCount),
+        principals(cameraCount),
+        focals(cameraCount),
+        distortions(cameraCount) {}
+
+  // drop a parameter block once no residual uses it
+  void removeIfUnused(double* values) {
+    if (problem.HasParameterBlock(values)) {
+      std::vector<ceres::ResidualBlockId> ids;
+      problem.GetResidualBlocksForParameterBlock(values, &ids);
+      if (ids.empty()) {
+        problem.RemoveParameterBlock(values);
+      }
+    }
+  }
+
+ private:
+  static ceres::Problem::Options getProblemOptions() {
+    ceres::Problem::Options options;
+    options.enable_fast_removal = true; // residuals are removed every pass
+    return options;
+  }
+};
+
+void solve(RefinementProblem& state, const int pass) {
+  ceres::Problem& problem = state.problem;
   ceres::Solver::Options options;
   options.use_inner_iterations = true;
   options.max_num_iterations = 500;
   options.minimizer_progress_to_stdout = false;
-  options.num_threads = ThreadPool::getThreadCountFromFlag(FLAGS_ceres_threads);
-  if (options.num_threads == 0) {
-    options.num_threads = 1;
-  }
+  options.num_threads = state.threads;
   options.function_tolerance = FLAGS_ceres_function_tolerance;
 
+  // Points only share residuals with cameras, never with each other, so the schur complement
+  // eliminates them and leaves a system the size of the camera parameters
+  if (ceres::IsSparseLinearAlgebraLibraryTypeAvailable(
+          options.sparse_linear_algebra_library_type)) {
+    options.linear_solver_type = ceres::SPARSE_SCHUR;
+  } else {
+    options.linear_solver_type = ceres::ITERATIVE_SCHUR;
+    options.preconditioner_type = ceres::SCHUR_JACOBI;
+  }
+  auto* ordering = new ceres::ParameterBlockOrdering;
+  for (auto& point : state.points) {
+    ordering->AddElementToGroup(point.second.data(), 0);
+  }
+  std::vector<double*> parameterBlocks;
+  problem.GetParameterBlocks(&parameterBlocks);
+  for (double* values : parameterBlocks) {
+    if (!ordering->IsMember(values)) {
+      ordering->AddElementToGroup(values, 1);
+    }
+  }
+  options.linear_solver_ordering.reset(ordering);
+
   ceres::Solver::Summary summary;
 
   LOG(INFO) << getReprojectionReport(problem);
 
+  // FLAGS_v is global, so verbose solves of parallel experiments take turns
+  static std::mutex verboseMutex;
+  std::unique_lock<std::mutex> verboseLock(verboseMutex, std::defer_lock);
+  if (FLAGS_log_verbose) {
+    verboseLock.lock();
+  }
   int previousFLAGS_v = FLAGS_v; // save FLAGS_v
   if (FLAGS_log_verbose) {
     FLAGS_v = std::max(1, FLAGS_v); // overwrite FLAGS_v
   }
   Solve(options, &problem, &summary);
   FLAGS_v = previousFLAGS_v; // restore FLAGS_v
+  if (verboseLock) {
+    verboseLock.unlock();
+  }
 
   LOG(INFO) << summary.BriefReport();
   if (FLAGS_log_verbose) {
     LOG(INFO) << summary.FullReport();
   }
+  LOG(INFO) << folly::sformat(
+      "Pass {} solve: {:.3f}s with {} threads, {} (preprocessor {:.3f}s, linear solver {:.3f}s, "
+      "jacobians {:.3f}s, residuals {:.3f}s)",
+      pass,
+      summary.total_time_in_seconds,
+      summary.num_threads_used,
+      ceres::LinearSolverTypeToString(summary.linear_solver_type_used),
+      summary.preprocessor_time_in_seconds,
+      summary.linear_solver_time_in_seconds,
+      summary.jacobian_evaluation_time_in_seconds,
+      summary.residual_evaluation_time_in_seconds);
 
   if (summary.termination_type == ceres::NO_CONVERGENCE) {
     throw std::runtime_error("Failed to converge");
@@ -993,12 +1238,15 @@ bool positionsUnlocked(int pass) {
   return !FLAGS_lock_positions && pass != 0;
 }
 
+// isSaved: whether this calibration saves the points files and debug output
 double refine(
+    RefinementProblem& state,
     std::vector<Camera>& cameras,
     const std::vector<Camera>& groundTruth,
     FeatureMap featureMap,
     std::vector<Overlap> overlaps,
-    const int pass) {
+    const int pass,
+    const bool isSaved) {
   boost::timer::cpu_timer timer;
   // remove outlier matches
   LOG(INFO) << "Removing outlier matches...";
@@ -1021,27 +1269,27 @@ double refine(
   std::vector<int> weights = calculateCameraWeights(cameras, traces);
 
   // visualization for debugging
-  showMatches(cameras, featureMap, overlaps, traces, pass);
+  if (isSaved) {
+    showMatches(cameras, featureMap, overlaps, traces, pass);
+  }
 
   // read camera parameters from cameras
-  std::vector<Camera::Vector3> positions;
-  std::vector<Camera::Vector3> rotations;
-  std::vector<Camera::Vector2> principals;
-  std::vector<Camera::Real> focals;
-  std::vector<Camera::Distortion> distortions;
-  for (Camera& camera : cameras) {
-    positions.push_back(camera.position);
-    rotations.push_back(camera.getRotation());
-    principals.push_back(camera.principal);
-    focals.push_back(camera.getScalarFocal());
-    distortions.push_back(camera.getDistortion());
-  }
+  for (int i = 0; i < int(cameras.size()); ++i) {
+    state.positions[i] = cameras[i].position;
+    state.rotations[i] = cameras[i].getRotation();
+    state.principals[i] = cameras[i].principal;
+    state.focals[i] = cameras[i].getScalarFocal();
+    state.distortions[i] = cameras[i].getDistortion();
+  }
+  std::vector<Camera::Vector3>& positions = state.positions;
+  std::vector<Camera::Vector3>& rotations = state.rotations;
+  std::vector<Camera::Vector2>& principals = state.principals;
+  std::vector<Camera::Real>& focals = state.focals;
+  std::vector<Camera::Distortion>& distortions = state.distortions;
+  ceres::Problem& problem = state.problem;
 
   int referenceCameraIdx = -1;
   int relativeCameraIdx = -1;
-  Camera::Real theta;
-  Camera::Real phi;
-  Camera::Real radius = 0.0; // initialized to silence compiler but this will never get used
 
   // If positions are unlocked, define a locked reference camera and lock the baseline between
   // the reference camera and relative camera
@@ -1056,57 +1304,133 @@ double refine(
     relativeCameraIdx = (referenceCameraIdx + 1) % ssize(cameras);
 
     Camera::Vector3 relativePosition = positions[relativeCameraIdx] - positions[referenceCameraIdx];
-    cartesianToSpherical(radius, theta, phi, relativePosition);
+    Camera::Real radius;
+    cartesianToSpherical(radius, state.theta, state.phi, relativePosition);
+    if (!state.hasRadius) {
+      state.radius = radius;
+      state.hasRadius = true;
+    }
   }
 
-  // create the problem: add a residual for each observation
-  ceres::Problem problem;
+  // update the problem: add a residual for each observation not in it yet
+  boost::timer::cpu_timer updateTimer;
+  std::map<FeatureKey, RefinementProblem::Residual> residuals;
+  std::set<FeatureKey> pointsUsed;
+  int added = 0;
+  int removed = 0;
   std::vector<int> counts(cameras.size());
-  for (const Trace& trace : traces) {
-    if (FLAGS_cap_traces && !randomSample(FLAGS_cap_traces, traces.size())) {
+  const std::vector<bool> isSampled = sampleTraces(traces, featureMap, cameras, pass);
+  for (int i = 0; i < int(traces.size()); ++i) {
+    const Trace& trace = traces[i];
+    if (!isSampled[i]) {
+      continue;
+    }
+    if (trace.references.empty()) {
       continue;
     }
+    const FeatureKey pointKey =
+        *std::min_element(trace.references.begin(), trace.references.end());
+    Camera::Vector3& point = state.points[pointKey];
+    point = trace.position;
+    pointsUsed.insert(pointKey);
     for (const auto& ref : trace.references) {
       const ImageId& image = ref.first;
       const Feature& feature = featureMap[image][ref.second];
       const int camera = getCameraIndex(image);
       ++counts[camera];
+      const bool isSpherical = camera == relativeCameraIdx;
+
+      auto existing = state.residuals.find(ref);
+      if (existing != state.residuals.end()) {
+        const RefinementProblem::Residual residual = existing->second;
+        state.residuals.erase(existing);
+        if (residual.isSame(pointKey, weights[camera], isSpherical)) {
+          residuals.emplace(ref, residual);
+          continue;
+        }
+        problem.RemoveResidualBlock(residual.id);
+        ++removed;
+      }
+
       const int group = cameraGroupToIndex[cameras[camera].group];
-      if (camera == relativeCameraIdx) {
-        SphericalReprojectionFunctor::addResidual(
+      ceres::ResidualBlockId id;
+      if (isSpherical) {
+        id = SphericalReprojectionFunctor::addResidual(
             problem,
-            theta,
-            phi,
+            state.theta,
+            state.phi,
             rotations[camera],
             principals[FLAGS_shared_principal_and_focal ? group : camera],
             focals[FLAGS_shared_principal_and_focal ? group : camera],
             distortions[FLAGS_shared_distortion ? group : camera],
-            traces[feature.trace].position,
-            radius,
+            point,
+            state.radius,
             cameras[referenceCameraIdx].position,
             cameras[camera],
             feature.position,
             FLAGS_robust,
             weights[camera]);
       } else {
-        ReprojectionFunctor::addResidual(
+        id = ReprojectionFunctor::addResidual(
             problem,
             positions[camera],
             rotations[camera],
             principals[FLAGS_shared_principal_and_focal ? group : camera],
             focals[FLAGS_shared_principal_and_focal ? group : camera],
             distortions[FLAGS_shared_distortion ? group : camera],
-            traces[feature.trace].position,
+            point,
             cameras[camera],
             feature.position,
             FLAGS_robust,
             weights[camera]);
       }
+      residuals.emplace(
+          ref, RefinementProblem::Residual{id, pointKey, weights[camera], isSpherical});
+      ++added;
+    }
+  }
+
+  // whatever is left was not observed this pass
+  for (const auto& entry : state.residuals) {
+    problem.RemoveResidualBlock(entry.second.id);
+    ++removed;
+  }
+  state.residuals.swap(residuals);
+  for (auto it = state.points.begin(); it != state.points.end();) {
+    if (pointsUsed.count(it->first)) {
+      ++it;
+    } else {
+      state.removeIfUnused(it->second.data());
+      it = state.points.erase(it);
     }
   }
+  for (int i = 0; i < int(cameras.size()); ++i) {
+    state.removeIfUnused(positions[i].data());
+    state.removeIfUnused(rotations[i].data());
+    state.removeIfUnused(principals[i].data());
+    state.removeIfUnused(&focals[i]);
+    state.removeIfUnused(distortions[i].data());
+  }
+  state.removeIfUnused(&state.theta);
+  state.removeIfUnused(&state.phi);
+  LOG(INFO) << folly::sformat(
+      "Pass {} problem update: {:.3f}s, {} residuals ({} added, {} removed), {} points",
+      pass,
+      updateTimer.elapsed().wall / 1e9,
+      state.residuals.size(),
+      added,
+      removed,
+      state.points.size());
 
   validateMatchCount(cameras, counts);
 
+  // unlock everything the previous pass locked, then lock for this pass
+  lockParameters(problem, positions, false);
+  lockParameters(problem, rotations, false);
+  lockParameters(problem, principals, false);
+  lockParameters(problem, focals, false);
+  lockParameters(problem, distortions, false);
+
   // lock focal and distortion
   if (pass == 0 || FLAGS_lock_focal) {
     if (FLAGS_shared_principal_and_focal) {
@@ -1134,8 +1458,8 @@ double refine(
   LOG(INFO) << folly::sformat("Pass: {}", pass);
   // If positions are unlocked, only lock the position and rotation of the reference camera
   if (positionsUnlocked(pass)) {
-    problem.SetParameterBlockConstant(positions[referenceCameraIdx].data());
-    problem.SetParameterBlockConstant(rotations[referenceCameraIdx].data());
+    lockParameter(problem, positions[referenceCameraIdx]);
+    lockParameter(problem, rotations[referenceCameraIdx]);
   } else {
     lockParameters(problem, positions);
   }
@@ -1144,6 +1468,40 @@ double refine(
     lockParameters(problem, rotations);
   }
 
+  // When recalibrating incrementally, only the cameras in --recalibrate_cameras move. A parameter
+  // shared by a group moves if any camera in the group does
+  const std::set<std::string> recalibrated = getRecalibratedCameraIds();
+  if (!recalibrated.empty()) {
+    std::vector<bool> lockIntrinsics(cameras.size(), true);
+    std::vector<bool> lockDistortion(cameras.size(), true);
+    for (const std::string& id : recalibrated) {
+      CHECK(cameraIdToIndex.count(id)) << "bad recalibrate_cameras: " << id;
+    }
+    for (int i = 0; i < int(cameras.size()); ++i) {
+      if (recalibrated.count(cameras[i].id)) {
+        const int group = cameraGroupToIndex[cameras[i].group];
+        lockIntrinsics[FLAGS_shared_principal_and_focal ? group : i] = false;
+        lockDistortion[FLAGS_shared_distortion ? group : i] = false;
+        continue;
+      }
+      lockParameter(problem, positions[i]);
+      lockParameter(problem, rotations[i]);
+      if (i == relativeCameraIdx) {
+        lockParameter(problem, state.theta);
+        lockParameter(problem, state.phi);
+      }
+    }
+    for (int i = 0; i < int(cameras.size()); ++i) {
+      if (lockIntrinsics[i]) {
+        lockParameter(problem, principals[i]);
+        lockParameter(problem, focals[i]);
+      }
+      if (lockDistortion[i]) {
+        lockParameter(problem, distortions[i]);
+      }
+    }
+  }
+
   if (FLAGS_robust) {
     std::vector<calibration::ReprojectionErrorOutlier> errorsIgnored =
         getReprojectionErrorOutliers(problem);
@@ -1159,9 +1517,9 @@ double refine(
         errorsIgnored[0].second);
   }
   reportReprojectionErrors(overlaps, featureMap, traces, cameras);
-  solve(problem);
+  solve(state, pass);
   if (positionsUnlocked(pass)) {
-    positions[relativeCameraIdx] = sphericalToCartesian(radius, theta, phi);
+    positions[relativeCameraIdx] = sphericalToCartesian(state.radius, state.theta, state.phi);
     positions[relativeCameraIdx] += positions[referenceCameraIdx];
   }
 
@@ -1172,7 +1530,16 @@ double refine(
     LOG(INFO) << folly::sformat("Warning: Final pass median error too high: {}", median);
   }
 
-  // write optimized camera parameters back into cameras
+  // write optimized points back into traces and camera parameters back into cameras
+  for (Trace& trace : traces) {
+    if (!trace.references.empty()) {
+      auto point =
+          state.points.find(*std::min_element(trace.references.begin(), trace.references.end()));
+      if (point != state.points.end()) {
+        trace.position = point->second;
+      }
+    }
+  }
   for (int i = 0; i < int(cameras.size()); ++i) {
     const int group = cameraGroupToIndex[cameras[i].group];
     cameras[i] = makeCamera(
@@ -1186,15 +1553,15 @@ double refine(
 
   reportReprojectionErrors(overlaps, featureMap, traces, cameras);
 
-  if (FLAGS_points_file != "" && pass == FLAGS_pass_count - 1) {
+  if (FLAGS_points_file != "" && pass == FLAGS_pass_count - 1 && isSaved) {
     savePointsFile(featureMap, traces);
   }
-  if (FLAGS_points_file_json != "" && pass == FLAGS_pass_count - 1) {
+  if (FLAGS_points_file_json != "" && pass == FLAGS_pass_count - 1 && isSaved) {
     savePointsFileJson(featureMap, traces);
   }
 
   // visualization for debugging
-  if (FLAGS_debug_error_scale && pass == FLAGS_pass_count - 1) {
+  if (FLAGS_debug_error_scale && pass == FLAGS_pass_count - 1 && isSaved) {
     showReprojections(cameras, featureMap, traces, FLAGS_debug_error_scale);
   }
 
@@ -1204,11 +1571,81 @@ double refine(
   return median;
 }
 
+// One calibration of perturbed cameras, see --experiments
+struct Experiment {
+  Camera::Rig cameras;
+  double medianError = 0;
+};
+
+void runExperiment(
+    Experiment& experiment,
+    const int index,
+    const Camera::Rig& groundTruth,
+    const FeatureMap& featureMap,
+    const std::vector<Overlap>& overlaps,
+    const int ceresThreads,
+    const bool isSaved) {
+  Camera::Rig& cameras = experiment.cameras;
+  const std::string prefix = FLAGS_experiments > 1 ? folly::sformat("experiment {} ", index) : "";
+  LOG(INFO) << prefix << getCameraRmseReport(cameras, groundTruth);
+  boost::timer::cpu_timer timer;
+
+  RefinementProblem state(cameras.size(), ceresThreads);
+  for (int pass = 0; pass < FLAGS_pass_count; ++pass) {
+    experiment.medianError =
+        refine(state, cameras, groundTruth, featureMap, overlaps, pass, isSaved);
+    std::cout << prefix << "pass " << pass << ": " << getCameraRmseReport(cameras, groundTruth)
+              << std::endl;
+  }
+  if (FLAGS_enable_timing) {
+    LOG(INFO) << folly::sformat("{}Aggregate timing: {}", prefix, timer.format());
+  }
+}
+
+// Mean, standard deviation and max of each statistic over the experiments
+void reportExperiments(const std::vector<Experiment>& experiments, const Camera::Rig& groundTruth) {
+  std::map<std::string, std::vector<double>> stats;
+  for (const Experiment& experiment : experiments) {
+    const CameraRmse rmse = getCameraRmse(experiment.cameras, groundTruth);
+    stats["median error"].push_back(experiment.medianError);
+    stats["pos rmse"].push_back(rmse.position);
+    stats["rot rmse"].push_back(rmse.rotation);
+    stats["principal rmse"].push_back(rmse.principal);
+    stats["distortion rmse"].push_back(rmse.distortion);
+    stats["focal rmse"].push_back(rmse.focal);
+    stats["angle rmse"].push_back(rmse.angle);
+  }
+  std::cout << folly::sformat("{} experiments:", experiments.size()) << std::endl;
+  for (const auto& stat : stats) {
+    const std::vector<double>& values = stat.second;
+    const double mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    double variance = 0;
+    for (const double value : values) {
+      variance += math_util::square(value - mean);
+    }
+    variance /= values.size();
+    std::cout << folly::sformat(
+                     "  {}: mean {:.6f} stddev {:.6f} max {:.6f}",
+                     stat.first,
+                     mean,
+                     std::sqrt(variance),
+                     *std::max_element(values.begin(), values.end()))
+              << std::endl;
+  }
+}
+
+// Experiments are independent calibrations of the same matches and run in parallel, each with
+// its own ceres problem and a share of the ceres threads. Debug output without --debug_dir shows
+// windows, so it runs them one at a time. Only the last experiment saves its rig, points files
+// and debug output
 double geometricCalibration() {
   CHECK_NE(FLAGS_rig_in, "");
   CHECK_NE(FLAGS_rig_out, "");
+  CHECK_GT(FLAGS_experiments, 0);
+  CHECK_GE(FLAGS_stratify_traces, 0);
 
-  if (FLAGS_debug_error_scale || FLAGS_debug_matches_overlap < 1) {
+  const bool isDebugged = FLAGS_debug_error_scale || FLAGS_debug_matches_overlap < 1;
+  if (isDebugged) {
     CHECK_NE(FLAGS_color, "");
   }
 
@@ -1218,46 +1655,52 @@ double geometricCalibration() {
 
   const Camera::Rig groundTruth = Camera::loadRig(FLAGS_rig_in);
   buildCameraIndexMaps(groundTruth);
-  double medianError = 0;
 
   if (FLAGS_seed != -1) {
     std::srand(FLAGS_seed);
   }
 
-  for (int experiment = 0; experiment < FLAGS_experiments; ++experiment) {
-    Camera::Rig cameras = groundTruth;
+  // shared by all the experiments, read only
+  FeatureMap featureMap;
+  std::vector<Overlap> overlaps;
+  if (!FLAGS_matches.empty()) {
+    const MatchesData matches = MatchesData::load(FLAGS_matches);
+    featureMap = loadFeatureMap(matches);
+    overlaps = loadOverlaps(matches);
+  } else {
+    generateArtificalPoints(featureMap, overlaps, groundTruth);
+  }
 
+  // perturbed in order, so --seed gives the same experiments however they are scheduled
+  std::vector<Experiment> experiments(FLAGS_experiments);
+  for (Experiment& experiment : experiments) {
+    experiment.cameras = groundTruth;
     Camera::perturbCameras(
-        cameras,
+        experiment.cameras,
         FLAGS_perturb_positions,
         FLAGS_perturb_rotations,
         FLAGS_perturb_principals,
         FLAGS_perturb_focals);
+  }
 
-    FeatureMap featureMap;
-    std::vector<Overlap> overlaps;
-
-    if (!FLAGS_matches.empty()) {
-      folly::dynamic parsed = parseJsonFile(FLAGS_matches);
-      featureMap = loadFeatureMap(parsed);
-      overlaps = loadOverlaps(parsed);
-    } else {
-      generateArtificalPoints(featureMap, overlaps, groundTruth);
-    }
-
-    LOG(INFO) << getCameraRmseReport(cameras, groundTruth);
-    boost::timer::cpu_timer timer;
-
-    for (int pass = 0; pass < FLAGS_pass_count; ++pass) {
-      medianError = refine(cameras, groundTruth, featureMap, overlaps, pass);
-      std::cout << "pass " << pass << ": " << getCameraRmseReport(cameras, groundTruth)
-                << std::endl;
-    }
-    if (FLAGS_enable_timing) {
-      LOG(INFO) << folly::sformat("Aggregate timing: {}", timer.format());
-    }
-    Camera::saveRig(FLAGS_rig_out, cameras);
+  const int threads = ThreadPool::getThreadCountFromFlag(
+      FLAGS_ceres_threads < 0 ? FLAGS_threads : FLAGS_ceres_threads);
+  const bool isInteractive = isDebugged && FLAGS_debug_dir.empty();
+  const int concurrent = isInteractive ? 1 : std::max(1, std::min(FLAGS_experiments, threads));
+  const int ceresThreads = std::max(1, threads / concurrent);
+  ThreadPool threadPool(concurrent == 1 ? 0 : concurrent);
+  for (int i = 0; i < FLAGS_experiments; ++i) {
+    threadPool.spawn([&, i] {
+      const bool isSaved = i == FLAGS_experiments - 1;
+      runExperiment(experiments[i], i, groundTruth, featureMap, overlaps, ceresThreads, isSaved);
+    });
   }
+  threadPool.join();
 
-  return medianError;
+  if (FLAGS_experiments > 1) {
+    reportExperiments(experiments, groundTruth);
+  }
+  Camera::saveRig(FLAGS_rig_out, experiments.back().cameras);
+  getDebugWriter().flush();
+  return experiments.back().medianError;
 }
@@ -7,6 +7,7 @@
 
 #include <ceres/ceres.h>
 
+#include "source/calibration/ReprojectionFunctors.h"
 #include "source/util/Camera.h"
 
 namespace fb360_dep {
@@ -14,256 +15,6 @@ namespace calibration {
 
 using ReprojectionErrorOutlier = std::pair<double, double>; // <original_error, weighted_error>
 
-Camera makeCamera(
-    const Camera& camera,
-    const Camera::Vector3& position,
-    const Camera::Vector3& rotation,
-    const Camera::Vector2& principal,
-    const Camera::Real& focal,
-    const Camera::Distortion& distortion) {
-  Camera result = camera;
-  result.position = position;
-  result.setRotation(rotation);
-  result.principal = principal;
-  result.setScalarFocal(focal);
-  result.setDistortion(distortion);
-
-  return result;
-}
-
-void cartesianToSpherical(
-    Camera::Real& radius,
-    Camera::Real& theta,
-    Camera::Real& phi,
-    const Camera::Vector3& cartesianCoords) {
-  radius = cartesianCoords.norm();
-  theta = acos(cartesianCoords.z() / radius);
-  phi = atan(cartesianCoords.y() / cartesianCoords.x());
-}
-
-Camera::Vector3
-sphericalToCartesian(const Camera::Real radius, const Camera::Real theta, const Camera::Real phi) {
-  Camera::Vector3 cartesianCoords;
-  cartesianCoords.x() = radius * sin(theta) * cos(phi);
-  cartesianCoords.y() = radius * sin(theta) * sin(phi);
-  cartesianCoords.z() = radius * cos(theta);
-  return cartesianCoords;
-}
-
-struct SphericalReprojectionFunctor {
-  static ceres::CostFunction* addResidual(
-      ceres::Problem& problem,
-      Camera::Real& theta,
-      Camera::Real& phi,
-      Camera::Vector3& rotation,
-      Camera::Vector2& principal,
-      Camera::Real& focal,
-      Camera::Distortion& distortion,
-      Camera::Vector3& world,
-      Camera::Real radius,
-      Camera::Vector3& referencePosition,
-      const Camera& camera,
-      const Camera::Vector2& pixel,
-      bool robust = false,
-      const int weight = 1) {
-    auto* cost = new CostFunction(
-        new SphericalReprojectionFunctor(camera, pixel, weight, radius, referencePosition));
-    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
-    problem.AddResidualBlock(
-        cost,
-        loss,
-        &theta,
-        &phi,
-        rotation.data(),
-        principal.data(),
-        &focal,
-        distortion.data(),
-        world.data());
-    return cost;
-  }
-
-  bool operator()(
-      double const* const theta,
-      double const* const phi,
-      double const* const rotation,
-      double const* const principal,
-      double const* const focal,
-      double const* const distortion,
-      double const* const world,
-      double* residuals) const {
-    // create a camera using parameters
-    Camera::Vector3 position = sphericalToCartesian(radius, theta[0], phi[0]);
-    position += referencePosition;
-    Camera modified = makeCamera(
-        camera,
-        position,
-        Eigen::Map<const Camera::Vector3>(rotation),
-        Eigen::Map<const Camera::Vector2>(principal),
-        *focal,
-        Eigen::Map<const Camera::Distortion>(distortion));
-    // transform world with that camera and compare to pixel
-    Eigen::Map<const Camera::Vector3> w(world);
-    Eigen::Map<Camera::Vector2> r(residuals);
-    r = modified.pixel(w) - pixel;
-    r = r / sqrt(weight);
-    return true;
-  }
-
- private:
-  using CostFunction = ceres::NumericDiffCostFunction<
-      SphericalReprojectionFunctor,
-      ceres::CENTRAL,
-      2, // residuals
-      1, // theta
-      1, // phi
-      3, // rotation
-      2, // principal
-      1, // focal
-      Camera::Distortion::SizeAtCompileTime, // distortion
-      3>; // world
-
-  SphericalReprojectionFunctor(
-      const Camera& camera,
-      const Camera::Vector2& pixel,
-      const int weight,
-      const double radius,
-      const Camera::Vector3& referencePosition)
-      : camera(camera),
-        pixel(pixel),
-        weight(weight),
-        radius(radius),
-        referencePosition(referencePosition) {}
-
-  const Camera& camera;
-  const Camera::Vector2 pixel;
-  const int weight;
-  const Camera::Real radius;
-  const Camera::Vector3& referencePosition;
-};
-
-struct ReprojectionFunctor {
-  static ceres::CostFunction* addResidual(
-      ceres::Problem& problem,
-      Camera::Vector3& position,
-      Camera::Vector3& rotation,
-      Camera::Vector2& principal,
-      Camera::Real& focal,
-      Camera::Distortion& distortion,
-      Camera::Vector3& world,
-      const Camera& camera,
-      const Camera::Vector2& pixel,
-      bool robust = false,
-      const int weight = 1) {
-    auto* cost = new CostFunction(new ReprojectionFunctor(camera, pixel, weight));
-    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
-    problem.AddResidualBlock(
-        cost,
-        loss,
-        position.data(),
-        rotation.data(),
-        principal.data(),
-        &focal,
-        distortion.data(),
-        world.data());
-    return cost;
-  }
-
-  bool operator()(
-      double const* const position,
-      double const* const rotation,
-      double const* const principal,
-      double const* const focal,
-      double const* const distortion,
-      double const* const world,
-      double* residuals) const {
-    // create a camera using parameters
-    Camera modified = makeCamera(
-        camera,
-        Eigen::Map<const Camera::Vector3>(position),
-        Eigen::Map<const Camera::Vector3>(rotation),
-        Eigen::Map<const Camera::Vector2>(principal),
-        *focal,
-        Eigen::Map<const Camera::Distortion>(distortion));
-    // transform world with that camera and compare to pixel
-    Eigen::Map<const Camera::Vector3> w(world);
-    Eigen::Map<Camera::Vector2> r(residuals);
-    r = modified.pixel(w) - pixel;
-    r = r / sqrt(weight);
-
-    return true;
-  }
-
- private:
-  using CostFunction = ceres::NumericDiffCostFunction<
-      ReprojectionFunctor,
-      ceres::CENTRAL,
-      2, // residuals
-      3, // position
-      3, // rotation
-      2, // principal
-      1, // focal
-      Camera::Distortion::SizeAtCompileTime, // distortion
-      3>; // world
-
-  ReprojectionFunctor(const Camera& camera, const Camera::Vector2& pixel, const int weight)
-      : camera(camera), pixel(pixel), weight(weight) {}
-
-  const Camera& camera;
-  const Camera::Vector2 pixel;
-  const int weight;
-};
-
-// The problem with using a world coordinate as the variable when triangulating is that the solver
-// might overshoot and end up behind you. This happens a lot if the initial estimate is e.g. 1000 m
-// away: The solver realizes it is way too far and follows the gradient back close to zero. Very
-// often it will blow past zero and end up behind you
-
-// The trick to fix this is to use inv = world / |world|^2 as the variable instead. Using
-//   disparity = 1 / |world|,
-// it can be seen that
-//   inv = disparty * unit(world),
-// so this accomplishes two things:
-// - The variable is proportional to disparity. We care about pixels, not meters
-// - To end up behind you, the solver needs to cross through infinity (hard) instead of zero (easy)
-struct TriangulationFunctor {
-  static ceres::CostFunction* addResidual(
-      ceres::Problem& problem,
-      Camera::Vector3& inv,
-      const Camera& camera,
-      const Camera::Vector2& pixel,
-      const bool robust = false) {
-    auto* cost = new CostFunction(new TriangulationFunctor(camera, pixel));
-    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
-    problem.AddResidualBlock(cost, loss, inv.data());
-    return cost;
-  }
-
-  bool operator()(double const* const inv, double* residuals) const {
-    Eigen::Map<const Camera::Vector3> i(inv);
-    Eigen::Map<Camera::Vector2> r(residuals);
-
-    Camera::Vector3 w = i / i.squaredNorm();
-
-    // transform world with camera and compare to pixel
-    r = camera.pixel(w) - pixel;
-
-    return true;
-  }
-
- private:
-  using CostFunction = ceres::NumericDiffCostFunction<
-      TriangulationFunctor,
-      ceres::CENTRAL,
-      2, // residuals
-      3>; // inverse world
-
-  TriangulationFunctor(const Camera& camera, const Camera::Vector2& pixel)
-      : camera(camera), pixel(pixel) {}
-
-  const Camera& camera;
-  const Camera::Vector2 pixel;
-};
-
 using Observations = std::vector<std::pair<const Camera&, Camera::Vector2>>;
 
 Camera::Vector3 averageAtDistance(const Observations& observations, const Camera::Real distance) {
@@ -305,6 +56,91 @@ Camera::Vector3 triangulateNonlinear(const Observations& observations, const boo
   return world;
 }
 
+// Same as triangulateNonlinear without setting up a ceres problem per point: starts from the point
+// closest to all the observation rays and refines it with a few hand-written Gauss-Newton steps on
+// the same inverse coordinates, using the analytic jacobians of ReprojectionFunctors.h
+// Falls back to triangulateNonlinear for camera types without analytic jacobians
+Camera::Vector3 triangulateLinear(
+    const Observations& observations,
+    const bool forceInFront,
+    const int steps) {
+  CHECK_GE(observations.size(), 2);
+  for (const auto& obs : observations) {
+    if (!hasAnalyticJacobian(obs.first)) {
+      return triangulateNonlinear(observations, forceInFront);
+    }
+  }
+
+  // minimize the sum of squared distances to the rays: sum(I - d d^T) * world = sum(I - d d^T) * o
+  Camera::Matrix3 a = Camera::Matrix3::Zero();
+  Camera::Vector3 b = Camera::Vector3::Zero();
+  for (const auto& obs : observations) {
+    const Camera::Ray ray = obs.first.rig(obs.second);
+    const Camera::Matrix3 perpendicular =
+        Camera::Matrix3::Identity() - ray.direction() * ray.direction().transpose();
+    a += perpendicular;
+    b += perpendicular * ray.origin();
+  }
+  Camera::Vector3 world = a.ldlt().solve(b);
+
+  // parallel rays, or an intersection behind a camera, start from distant points like ceres
+  const Camera::Real kInitialDistance = 10; // 10 meters, not hugely important
+  bool inFront = world.allFinite();
+  for (const auto& obs : observations) {
+    inFront = inFront && !obs.first.isBehind(world);
+  }
+  if (!inFront) {
+    world = averageAtDistance(observations, kInitialDistance);
+  }
+
+  auto squaredError = [&](const Camera::Vector3& inv) {
+    Camera::Real result = 0;
+    for (const auto& obs : observations) {
+      result += (obs.first.pixel(inv / inv.squaredNorm()) - obs.second).squaredNorm();
+    }
+    return result;
+  };
+  Camera::Vector3 inv = world / world.squaredNorm();
+  Camera::Real current = squaredError(inv);
+  for (int step = 0; step < steps; ++step) {
+    // d(inv / |inv|^2) / dinv = (|inv|^2 * I - 2 * inv * inv^T) / |inv|^4
+    const Camera::Real squaredNorm = inv.squaredNorm();
+    const Camera::Matrix3 dWorld =
+        (squaredNorm * Camera::Matrix3::Identity() - 2 * inv * inv.transpose()) /
+        (squaredNorm * squaredNorm);
+    Camera::Matrix3 jtj = Camera::Matrix3::Zero();
+    Camera::Vector3 jtr = Camera::Vector3::Zero();
+    for (const auto& obs : observations) {
+      Camera::Vector2 pixel;
+      PixelJacobian jacobian;
+      if (!pixelJacobian(pixel, jacobian, obs.first, inv / squaredNorm)) {
+        return triangulateNonlinear(observations, forceInFront);
+      }
+      const Matrix23 j = jacobian.camera * obs.first.rotation * dWorld;
+      jtj += j.transpose() * j;
+      jtr += j.transpose() * (pixel - obs.second);
+    }
+    const Camera::Vector3 next = inv - jtj.ldlt().solve(jtr);
+    const Camera::Real error = squaredError(next);
+    if (!(error < current)) {
+      break; // converged, or the step overshot
+    }
+    inv = next;
+    current = error;
+  }
+  world = inv / inv.squaredNorm();
+
+  if (forceInFront) {
+    for (const auto& obs : observations) {
+      if (obs.first.isBehind(world)) {
+        return averageAtDistance(observations, Camera::kNearInfinity);
+      }
+    }
+  }
+
+  return world;
+}
+
 double calcPercentile(std::vector<double> values, double percentile = 0.5) {
   if (values.empty()) {
     return NAN;
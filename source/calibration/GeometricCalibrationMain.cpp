@@ -14,7 +14,7 @@ const std::string kUsageMessage = R"(
 
    - Example:
      ./GeometricCalibration \
-     --matches=/path/to/output/matches.json \
+     --matches=/path/to/output/matches.bin \
      --rig_in=/path/to/rigs/rig.json \
      --rig_out=/path/to/rigs/rig_calibrated.json
  )";
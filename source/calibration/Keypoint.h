@@ -7,7 +7,7 @@
 
 #pragma once
 
-#include <folly/dynamic.h>
+#include <folly/Format.h>
 
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
@@ -49,30 +49,6 @@ struct Keypoint {
     initializeAvgStd();
   }
 
-  folly::dynamic serialize() const {
-    return folly::dynamic::object("x", coords.x())("y", coords.y());
-  }
-
-  static folly::dynamic serializeVector(const std::vector<Keypoint>& corners) {
-    folly::dynamic cornerArray = folly::dynamic::array();
-    for (const Keypoint& corner : corners) {
-      cornerArray.push_back(corner.serialize());
-    }
-    return cornerArray;
-  }
-
-  static folly::dynamic serializeRig(
-      const std::map<std::string, std::vector<Keypoint>>& allCorners,
-      const std::string& frame,
-      const std::string& imageExt) {
-    folly::dynamic allCornersData = folly::dynamic::object;
-    for (const auto& cameraCorners : allCorners) {
-      allCornersData[getImageFilename(cameraCorners.first, frame, imageExt)] =
-          serializeVector(cameraCorners.second);
-    }
-    return allCornersData;
-  }
-
  private:
   void initializeAvgStd() {
     cv::Scalar_<double> cvMean;
@@ -91,12 +67,6 @@ struct Match {
     corners[0] = corner0;
     corners[1] = corner1;
   }
-
-  folly::dynamic serialize() const {
-    folly::dynamic result =
-        folly::dynamic::object("idx1", corners[0])("idx2", corners[1])("score", score);
-    return result;
-  }
 };
 
 struct Overlap {
@@ -107,17 +77,6 @@ struct Overlap {
     images[0] = image0;
     images[1] = image1;
   }
-
-  folly::dynamic serialize(const std::string& frame, const std::string& imageExt) const {
-    folly::dynamic overlapData = folly::dynamic::object;
-    overlapData["image1"] = getImageFilename(images[0], frame, imageExt);
-    overlapData["image2"] = getImageFilename(images[1], frame, imageExt);
-    overlapData["matches"] = folly::dynamic::array();
-    for (const auto& match : matches) {
-      overlapData["matches"].push_back(match.serialize());
-    }
-    return overlapData;
-  }
 };
 
 } // namespace calibration
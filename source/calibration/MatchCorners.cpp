@@ -7,14 +7,22 @@
 
 #include "source/calibration/MatchCorners.h"
 
+#include <functional>
+#include <map>
+#include <set>
+
+#include <boost/algorithm/string.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <folly/FileUtil.h>
 #include <folly/Format.h>
+#include <folly/json.h>
 
 #include "source/calibration/Calibration.h"
 #include "source/calibration/FeatureDetector.h"
 #include "source/calibration/FeatureMatcher.h"
+#include "source/calibration/MatchesFile.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/ThreadPool.h"
@@ -23,6 +31,7 @@ using namespace fb360_dep;
 using namespace fb360_dep::calibration;
 using namespace fb360_dep::image_util;
 
+DEFINE_bool(cache_overlaps, false, "reuse camera overlaps saved next to the rig");
 DEFINE_int32(
     camera_count,
     0,
@@ -44,42 +53,21 @@ namespace fb360_dep {
 namespace calibration {
 
 Image extractSingleChannelImage(const cv::Mat_<cv::Vec3b>& image) {
-  std::vector<Image> splitImage;
-  cv::split(image, splitImage);
-
-  const int channels = 3;
-  CHECK_EQ(splitImage.size(), channels) << "error loading separate color channels";
-  LOG(INFO) << folly::sformat("Loading single channge images {}", FLAGS_color_channel);
   Image singleChannelImage;
   if (FLAGS_color_channel == "grayscale") {
     cv::cvtColor(image, singleChannelImage, cv::COLOR_BGR2GRAY);
   } else if (FLAGS_color_channel == "blue") {
-    singleChannelImage = splitImage[0];
+    cv::extractChannel(image, singleChannelImage, 0);
   } else if (FLAGS_color_channel == "green") {
-    singleChannelImage = splitImage[1];
+    cv::extractChannel(image, singleChannelImage, 1);
   } else if (FLAGS_color_channel == "red") {
-    singleChannelImage = splitImage[2];
+    cv::extractChannel(image, singleChannelImage, 2);
   } else {
     LOG(FATAL) << folly::sformat("Unknown color channel selected: {}", FLAGS_color_channel);
   }
   return singleChannelImage;
 }
 
-std::vector<Image> loadSingleChannelImages(const filesystem::path& dir, const Camera::Rig& rig) {
-  // Load color images without alpha in bgr format
-  std::vector<cv::Mat_<cv::Vec3b>> images =
-      loadImages<cv::Vec3b>(dir, rig, FLAGS_frame, FLAGS_threads);
-
-  ThreadPool threadPool(FLAGS_threads);
-
-  std::vector<Image> singleChannelImages;
-  for (auto& image : images) {
-    singleChannelImages.emplace_back(extractSingleChannelImage(image));
-  }
-
-  return singleChannelImages;
-}
-
 static void saveMatches(
     const filesystem::path& filename,
     const std::map<ImageId, std::vector<Keypoint>>& allCorners,
@@ -88,59 +76,90 @@ static void saveMatches(
   CHECK(!allCorners.empty());
   const std::string imageExt = filesystem::getFirstExtension(colorDir / allCorners.begin()->first);
 
-  folly::dynamic allCornersData = Keypoint::serializeRig(allCorners, FLAGS_frame, imageExt);
-
-  folly::dynamic allMatches = folly::dynamic::array;
-  for (const auto& overlap : overlaps) {
-    allMatches.push_back(overlap.serialize(FLAGS_frame, imageExt));
+  MatchesData matchesData;
+  for (const auto& cameraCorners : allCorners) {
+    matchesData.images.push_back({getImageFilename(cameraCorners.first, FLAGS_frame, imageExt)});
+    for (const Keypoint& corner : cameraCorners.second) {
+      matchesData.images.back().corners.push_back(corner.coords);
+    }
+  }
+  for (const Overlap& overlap : overlaps) {
+    matchesData.overlaps.push_back(
+        {getImageFilename(overlap.images[0], FLAGS_frame, imageExt),
+         getImageFilename(overlap.images[1], FLAGS_frame, imageExt)});
+    for (const Match& match : overlap.matches) {
+      matchesData.overlaps.back().matches.push_back(
+          {match.score, match.corners[0], match.corners[1]});
+    }
   }
 
-  folly::dynamic matchesData =
-      folly::dynamic::object("all_matches", allMatches)("images", allCornersData);
   LOG(INFO) << folly::sformat("Saving matches to file: {}", filename.string());
-  if (filename.has_parent_path()) {
-    filesystem::create_directories(filename.parent_path());
-  }
-  CHECK(folly::writeFile(folly::toPrettyJson(matchesData), filename.string().data()));
+  matchesData.save(filename, FLAGS_matches_format == "json");
 }
 
-template <typename T>
-static void downscale(cv::Mat_<T>& image) {
-  if (FLAGS_scale != 1.0) {
-    cv::resize(image, image, {}, FLAGS_scale, FLAGS_scale, cv::INTER_AREA);
+// Power of two the decoder can reduce the image by and still have --scale downscale it. Only
+// jpeg reduces while decoding, other formats would be decoded in full and resized
+static int getReducedDecodeFactor(const filesystem::path& path) {
+  const std::string extension = boost::algorithm::to_lower_copy(path.extension().string());
+  if (extension != ".jpg" && extension != ".jpeg") {
+    return 1;
+  }
+  int factor = 1;
+  while (factor < 8 && 2 * factor * FLAGS_scale <= 1) {
+    factor *= 2;
   }
+  return factor;
 }
 
-std::vector<Image> loadChannels(const Camera::Rig& rig) {
-  std::vector<Image> images;
-  LOG(INFO) << "Loading images... ";
-  const filesystem::path colorDir = FLAGS_color;
-  if (FLAGS_color_channel == "grayscale") {
-    images = loadImages<uint8_t>(colorDir, rig, FLAGS_frame, FLAGS_threads);
-  } else if (
-      FLAGS_color_channel == "red" || FLAGS_color_channel == "green" ||
-      FLAGS_color_channel == "blue") {
-    images = loadSingleChannelImages(colorDir, rig);
-
+// The --color_channel of a camera's image at --scale. 8 bit images are decoded straight to the
+// channel, reduced while decoding when --scale allows it
+static Image loadChannel(const Camera& camera) {
+  const filesystem::path path = imagePath(FLAGS_color, camera.id, FLAGS_frame);
+  const bool isGrayscale = FLAGS_color_channel == "grayscale";
+  Image image;
+  double scale = FLAGS_scale;
+  if (path.extension() == ".raw" || path.extension() == ".pfm") {
+    image = isGrayscale ? cv_util::loadImage<uint8_t>(path)
+                        : extractSingleChannelImage(cv_util::loadImage<cv::Vec3b>(path));
   } else {
-    LOG(FATAL) << folly::sformat("Unknown color channel selected: {}", FLAGS_color_channel);
+    const int factor = getReducedDecodeFactor(path);
+    const std::map<int, std::pair<int, int>> kFlags = {
+        // factor: grayscale, color
+        {1, {cv::IMREAD_GRAYSCALE, cv::IMREAD_COLOR}},
+        {2, {cv::IMREAD_REDUCED_GRAYSCALE_2, cv::IMREAD_REDUCED_COLOR_2}},
+        {4, {cv::IMREAD_REDUCED_GRAYSCALE_4, cv::IMREAD_REDUCED_COLOR_4}},
+        {8, {cv::IMREAD_REDUCED_GRAYSCALE_8, cv::IMREAD_REDUCED_COLOR_8}}};
+    const std::pair<int, int>& flags = kFlags.at(factor);
+    const cv::Mat decoded =
+        cv_util::imreadExceptionOnFail(path, isGrayscale ? flags.first : flags.second);
+    image = isGrayscale ? Image(decoded) : extractSingleChannelImage(decoded);
+    scale *= factor;
   }
-  LOG(INFO) << "Images loaded";
-
-  // scale according to FLAGS_scale and verify that resolutions match
-
-  for (Image& image : images) {
-    downscale(image);
+  if (scale != 1.0) {
+    cv::resize(image, image, {}, scale, scale, cv::INTER_AREA);
   }
+
   // check that camera and image aspect ratios match within 1%
-  CHECK_EQ(ssize(rig), ssize(images));
+  const Camera::Vector2 res = camera.resolution;
+  const double ratio = image.cols / double(image.rows);
+  CHECK_LT(ratio - 0.01, res.x() / res.y()) << camera.id << " image and camera shape mismatch";
+  CHECK_LT(res.x() / res.y(), ratio + 0.01) << camera.id << " image and camera shape mismatch";
+  return image;
+}
+
+std::vector<Image> loadChannels(const Camera::Rig& rig) {
+  CHECK(
+      FLAGS_color_channel == "grayscale" || FLAGS_color_channel == "red" ||
+      FLAGS_color_channel == "green" || FLAGS_color_channel == "blue")
+      << folly::sformat("Unknown color channel selected: {}", FLAGS_color_channel);
+  LOG(INFO) << folly::sformat("Loading {} images... ", FLAGS_color_channel);
+  std::vector<Image> images(rig.size());
+  ThreadPool threadPool(FLAGS_threads);
   for (ssize_t i = 0; i < ssize(rig); ++i) {
-    const Camera::Vector2 res = rig[i].resolution;
-    const double ratio = images[i].cols / double(images[i].rows);
-    CHECK_LT(ratio - 0.01, res.x() / res.y()) << rig[i].id << " image and camera shape mismatch";
-    CHECK_LT(res.x() / res.y(), ratio + 0.01) << rig[i].id << " image and camera shape mismatch";
+    threadPool.spawn([&, i] { images[i] = loadChannel(rig[i]); });
   }
-
+  threadPool.join();
+  LOG(INFO) << "Images loaded";
   return images;
 }
 
@@ -187,29 +206,67 @@ static void upscale(
   }
 }
 
-void processScale(
+// Corners of all cameras at one matching scale
+struct ScaleCorners {
+  std::vector<Image> images;
+  Camera::Rig rig; // rescaled to match images
+  std::map<ImageId, std::vector<Keypoint>> corners; // in image coordinates
+};
+
+ScaleCorners findScaleCorners(
     const float scale,
     const Camera::Rig& rigFull,
-    const std::vector<Image>& images,
-    std::map<ImageId, std::vector<Keypoint>>& allCorners,
-    std::vector<Overlap>& overlaps) {
+    const std::vector<Image>& images) {
   LOG(INFO) << folly::sformat("Processing scale: {}", scale);
 
-  std::vector<Image> scaledImages;
+  ScaleCorners result;
   for (const Image& image : images) {
     Image scaledImage;
     cv::resize(image, scaledImage, {}, scale, scale, cv::INTER_AREA);
-    scaledImages.push_back(scaledImage);
+    result.images.push_back(scaledImage);
   }
 
   // rescale rig to match images
-  CHECK(!scaledImages.empty());
-  const Camera::Rig rig = rescale(rigFull, scaledImages);
+  CHECK(!result.images.empty());
+  result.rig = rescale(rigFull, result.images);
+  result.corners = findAllCorners(result.rig, result.images, FLAGS_use_nearest);
+  return result;
+}
+
+// findScaleCorners() at scale 1, loading the images as well. Each camera's corners are found as
+// soon as its image is loaded, while the other images are still loading
+static ScaleCorners loadFirstScaleCorners(const Camera::Rig& rigFull) {
+  LOG(INFO) << folly::sformat("Loading {} images and processing scale: 1", FLAGS_color_channel);
+  ScaleCorners result;
+  result.images.resize(rigFull.size());
+  result.rig = rigFull;
+  std::vector<std::vector<Keypoint>> corners(rigFull.size());
+  ThreadPool threadPool(FLAGS_threads);
+  for (ssize_t i = 0; i < ssize(rigFull); ++i) {
+    threadPool.spawn([&, i] {
+      result.images[i] = loadChannel(rigFull[i]);
+      result.rig[i] = rigFull[i].rescale({result.images[i].cols, result.images[i].rows});
+      corners[i] = findCorners(result.rig[i], result.images[i], FLAGS_use_nearest);
+    });
+  }
+  threadPool.join();
+  for (ssize_t i = 0; i < ssize(rigFull); ++i) {
+    result.corners[rigFull[i].id] = std::move(corners[i]);
+  }
+  return result;
+}
 
-  std::map<ImageId, std::vector<Keypoint>> newCorners =
-      findAllCorners(rig, scaledImages, FLAGS_use_nearest);
-  std::vector<Overlap> newOverlaps = findAllMatches(rig, scaledImages, newCorners);
-  upscale(newCorners, rigFull, scaledImages);
+void processScale(
+    const ScaleCorners& scaleCorners,
+    const Camera::Rig& rigFull,
+    std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    std::vector<Overlap>& overlaps,
+    const OverlapMatrix& overlapMatrix,
+    const std::function<bool(const Camera&, const Camera&)>& isMatched) {
+  std::map<ImageId, std::vector<Keypoint>> newCorners = scaleCorners.corners;
+  std::vector<Overlap> newOverlaps = findAllMatches(
+      scaleCorners.rig, scaleCorners.images, newCorners, overlapMatrix, isMatched);
+  upscale(newCorners, rigFull, scaleCorners.images);
 
   // matches refer to corners by index, so we need to offset these by the total number
   for (Overlap& newOverlap : newOverlaps) {
@@ -240,15 +297,129 @@ void processScale(
   }
 }
 
+// Corners and matches of a previous run, by camera id, reused when calibrating incrementally
+struct PreviousMatches {
+  std::map<ImageId, std::vector<Camera::Vector2>> corners;
+  std::map<std::pair<ImageId, ImageId>, std::vector<Match>> matches;
+};
+
+// saveMatches names images <camera id>/<frame><extension>
+static ImageId getCameraIdFromFilename(const std::string& filename) {
+  return filesystem::path(filename).parent_path().string();
+}
+
+static bool loadPreviousMatches(PreviousMatches& previous, const filesystem::path& filename) {
+  if (!filesystem::exists(filename)) {
+    return false;
+  }
+  const MatchesData matchesData = MatchesData::load(filename);
+  for (const MatchesData::ImageCorners& image : matchesData.images) {
+    std::vector<Camera::Vector2>& corners = previous.corners[getCameraIdFromFilename(image.image)];
+    corners.insert(corners.end(), image.corners.begin(), image.corners.end());
+  }
+  for (const MatchesData::ImagePair& overlap : matchesData.overlaps) {
+    std::vector<Match>& matches = previous.matches[std::make_pair(
+        getCameraIdFromFilename(overlap.image1), getCameraIdFromFilename(overlap.image2))];
+    for (const MatchesData::Match& match : overlap.matches) {
+      matches.emplace_back(match.score, match.idx1, match.idx2);
+    }
+  }
+  return true;
+}
+
+// Whether the corners found for camera at all scales are the ones of the previous run, in which
+// case the previous matches index them correctly
+static bool hasPreviousCorners(
+    const PreviousMatches& previous,
+    const std::vector<ScaleCorners>& scales,
+    const Camera::Rig& rigFull,
+    const ImageId& camera) {
+  const auto found = previous.corners.find(camera);
+  if (found == previous.corners.end()) {
+    return false;
+  }
+  const double kTolerance = 1e-6; // pixels, the json round trip
+  size_t offset = 0;
+  for (const ScaleCorners& scaleCorners : scales) {
+    std::map<ImageId, std::vector<Keypoint>> corners;
+    corners[camera] = scaleCorners.corners.at(camera);
+    upscale(corners, rigFull, scaleCorners.images);
+    for (const Keypoint& corner : corners[camera]) {
+      if (offset >= found->second.size() ||
+          (corner.coords - found->second[offset]).norm() > kTolerance) {
+        return false;
+      }
+      ++offset;
+    }
+  }
+  return offset == found->second.size();
+}
+
+// Incremental mode only matches pairs with a camera in --recalibrate_cameras, or whose corners
+// changed since the previous run. Other pairs keep the matches in --matches
 void processOctaves(
     const Camera::Rig& rigFull,
-    const std::vector<Image>& images,
     std::map<ImageId, std::vector<Keypoint>>& allCorners,
     std::vector<Overlap>& overlaps) {
   int octaveCount = FLAGS_same_scale ? FLAGS_octave_count : 1;
-  for (int octave = 0; octave < octaveCount; octave++) {
+  std::vector<ScaleCorners> scales = {loadFirstScaleCorners(rigFull)};
+  for (int octave = 1; octave < octaveCount; octave++) {
     float scale = std::pow(0.5, octave);
-    processScale(scale, rigFull, images, allCorners, overlaps);
+    scales.push_back(findScaleCorners(scale, rigFull, scales.front().images));
+  }
+
+  std::set<ImageId> rematched = getRecalibratedCameraIds();
+  PreviousMatches previous;
+  const bool isIncremental = !rematched.empty() && loadPreviousMatches(previous, FLAGS_matches);
+  if (!rematched.empty() && !isIncremental) {
+    LOG(WARNING) << folly::sformat(
+        "No previous matches in {}, matching all cameras", FLAGS_matches);
+  }
+  std::function<bool(const Camera&, const Camera&)> isMatched = nullptr;
+  if (isIncremental) {
+    for (const Camera& camera : rigFull) {
+      if (!rematched.count(camera.id) &&
+          !hasPreviousCorners(previous, scales, rigFull, camera.id)) {
+        LOG(INFO) << folly::sformat("{} corners changed since the previous run", camera.id);
+        rematched.insert(camera.id);
+      }
+    }
+    LOG(INFO) << folly::sformat(
+        "Matching pairs with {} of {} cameras", rematched.size(), rigFull.size());
+    isMatched = [&rematched](const Camera& camera0, const Camera& camera1) {
+      return rematched.count(camera0.id) || rematched.count(camera1.id);
+    };
+  }
+
+  // Overlaps don't depend on the scale, every scale shares them
+  const filesystem::path overlapsDir =
+      FLAGS_cache_overlaps ? OverlapMatrix::getDefaultDir(FLAGS_rig_in) : "";
+  const OverlapMatrix overlapMatrix =
+      OverlapMatrix::getOrCompute(overlapsDir, rigFull, FLAGS_threads);
+  for (const ScaleCorners& scaleCorners : scales) {
+    processScale(scaleCorners, rigFull, allCorners, overlaps, overlapMatrix, isMatched);
+  }
+
+  if (isIncremental) {
+    int reused = 0;
+    for (Overlap& overlap : overlaps) {
+      if (rematched.count(overlap.images[0]) || rematched.count(overlap.images[1])) {
+        continue;
+      }
+      const auto same = previous.matches.find(std::make_pair(overlap.images[0], overlap.images[1]));
+      if (same != previous.matches.end()) {
+        overlap.matches = same->second;
+      }
+      const auto swapped =
+          previous.matches.find(std::make_pair(overlap.images[1], overlap.images[0]));
+      if (swapped != previous.matches.end()) {
+        for (const Match& match : swapped->second) {
+          overlap.matches.emplace_back(match.score, match.corners[1], match.corners[0]);
+        }
+      }
+      reused += overlap.matches.size();
+    }
+    LOG(INFO) << folly::sformat("Reused {} matches from {}", reused, FLAGS_matches);
   }
 }
 
@@ -259,6 +430,8 @@ int matchCorners() {
   CHECK_NE(FLAGS_color, "");
   CHECK_NE(FLAGS_rig_in, "");
   CHECK_NE(FLAGS_matches, "");
+  CHECK(FLAGS_matches_format == "binary" || FLAGS_matches_format == "json")
+      << "Invalid matches format: " << FLAGS_matches_format;
 
   // Load camera rig
   const Camera::Rig& rigFull = loadRig();
@@ -266,13 +439,10 @@ int matchCorners() {
   const int validFrame = getSingleFrame(FLAGS_color, rigFull, FLAGS_frame);
   FLAGS_frame = image_util::intToStringZeroPad(validFrame);
 
-  // Load input grayscale images
-  const std::vector<Image>& images = loadChannels(rigFull);
-
   std::map<ImageId, std::vector<Keypoint>> allCorners;
   std::vector<Overlap> overlaps;
 
-  processOctaves(rigFull, images, allCorners, overlaps);
+  processOctaves(rigFull, allCorners, overlaps);
 
   for (const auto& entry : allCorners) {
     if (ssize(entry.second) < FLAGS_min_features) {
@@ -14,7 +14,7 @@ const std::string kUsageMessage = R"(
    - Example:
      ./MatchCorners \
      --color=/path/to/video/color \
-     --matches=/path/to/output/matches.json \
+     --matches=/path/to/output/matches.bin \
      --rig_in=/path/to/rigs/rig.json
  )";
 
@@ -0,0 +1,205 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/calibration/MatchesFile.h"
+
+#include <cstring>
+#include <fstream>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <glog/logging.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Format.h>
+#include <folly/json.h>
+
+namespace fb360_dep {
+namespace calibration {
+
+namespace {
+
+// Binary matches file, all integers little endian:
+//   uint32 magic, uint32 version, uint64 image count, uint64 overlap count
+//   per image: string image, uint64 corner count, corner count * (double x, double y)
+//   per overlap: string image1, string image2, uint64 match count,
+//     match count * (double score, int32 idx1, int32 idx2)
+// where a string is a uint32 length followed by its characters
+const uint32_t kMatchesMagic = 0x4d504544; // "DEPM"
+const uint32_t kMatchesVersion = 1;
+
+static_assert(sizeof(MatchesData::Match) == 16, "Match must not be padded");
+static_assert(sizeof(Camera::Vector2) == 2 * sizeof(double), "Vector2 must not be padded");
+
+class Writer {
+ public:
+  explicit Writer(const filesystem::path& path) : file(path.string(), std::ios::binary) {}
+
+  template <typename T>
+  void write(const T& value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  template <typename T>
+  void write(const std::vector<T>& values) {
+    write(uint64_t(values.size()));
+    file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+  }
+
+  void write(const std::string& s) {
+    write(uint32_t(s.size()));
+    file.write(s.data(), s.size());
+  }
+
+  bool close() {
+    file.close();
+    return bool(file);
+  }
+
+ private:
+  std::ofstream file;
+};
+
+// Reads from memory, checking that it does not run past the end
+class Reader {
+ public:
+  Reader(const char* data, const size_t size) : data(data), end(data + size) {}
+
+  template <typename T>
+  T read() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  void read(std::vector<T>& values) {
+    const uint64_t count = read<uint64_t>();
+    CHECK_LE(count, uint64_t(end - data) / sizeof(T)) << "truncated matches file";
+    values.resize(count);
+    std::memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+  }
+
+  std::string readString() {
+    const uint32_t size = read<uint32_t>();
+    return std::string(take(size), size);
+  }
+
+ private:
+  const char* take(const size_t size) {
+    CHECK_LE(size, size_t(end - data)) << "truncated matches file";
+    const char* result = data;
+    data += size;
+    return result;
+  }
+
+  const char* data;
+  const char* const end;
+};
+
+} // namespace
+
+folly::dynamic MatchesData::toJson() const {
+  folly::dynamic imagesData = folly::dynamic::object;
+  for (const ImageCorners& image : images) {
+    folly::dynamic corners = folly::dynamic::array;
+    for (const Camera::Vector2& corner : image.corners) {
+      corners.push_back(folly::dynamic::object("x", corner.x())("y", corner.y()));
+    }
+    imagesData[image.image] = corners;
+  }
+  folly::dynamic allMatches = folly::dynamic::array;
+  for (const ImagePair& overlap : overlaps) {
+    folly::dynamic matches = folly::dynamic::array;
+    for (const Match& match : overlap.matches) {
+      matches.push_back(
+          folly::dynamic::object("idx1", match.idx1)("idx2", match.idx2)("score", match.score));
+    }
+    allMatches.push_back(folly::dynamic::object("image1", overlap.image1)(
+        "image2", overlap.image2)("matches", matches));
+  }
+  return folly::dynamic::object("all_matches", allMatches)("images", imagesData);
+}
+
+MatchesData MatchesData::fromJson(const folly::dynamic& parsed) {
+  MatchesData result;
+  for (const auto& image : parsed["images"].items()) {
+    result.images.push_back({image.first.asString(), {}});
+    for (const auto& corner : image.second) {
+      result.images.back().corners.emplace_back(corner["x"].asDouble(), corner["y"].asDouble());
+    }
+  }
+  for (const auto& overlap : parsed["all_matches"]) {
+    result.overlaps.push_back({overlap["image1"].asString(), overlap["image2"].asString(), {}});
+    for (const auto& match : overlap["matches"]) {
+      // Score may be missing from hand written files
+      const double score = match.count("score") ? match["score"].asDouble() : 0;
+      result.overlaps.back().matches.push_back(
+          {score, int32_t(match["idx1"].asInt()), int32_t(match["idx2"].asInt())});
+    }
+  }
+  return result;
+}
+
+MatchesData MatchesData::load(const filesystem::path& path) {
+  CHECK(filesystem::exists(path)) << folly::sformat("missing matches file {}", path.string());
+  const boost::interprocess::file_mapping file(
+      path.string().c_str(), boost::interprocess::read_only);
+  const boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+  const char* data = static_cast<const char*>(region.get_address());
+  Reader reader(data, region.get_size());
+  if (region.get_size() < sizeof(kMatchesMagic) || reader.read<uint32_t>() != kMatchesMagic) {
+    const std::string json(data, region.get_size());
+    return fromJson(folly::parseJson(json));
+  }
+  const uint32_t version = reader.read<uint32_t>();
+  CHECK_EQ(version, kMatchesVersion) << folly::sformat("unsupported {}", path.string());
+
+  MatchesData result;
+  result.images.resize(reader.read<uint64_t>());
+  result.overlaps.resize(reader.read<uint64_t>());
+  for (ImageCorners& image : result.images) {
+    image.image = reader.readString();
+    reader.read(image.corners);
+  }
+  for (ImagePair& overlap : result.overlaps) {
+    overlap.image1 = reader.readString();
+    overlap.image2 = reader.readString();
+    reader.read(overlap.matches);
+  }
+  return result;
+}
+
+void MatchesData::save(const filesystem::path& path, const bool json) const {
+  if (path.has_parent_path()) {
+    filesystem::create_directories(path.parent_path());
+  }
+  if (json) {
+    CHECK(folly::writeFile(folly::toPrettyJson(toJson()), path.string().c_str()))
+        << folly::sformat("failed to save matches to {}", path.string());
+    return;
+  }
+
+  Writer writer(path);
+  writer.write(kMatchesMagic);
+  writer.write(kMatchesVersion);
+  writer.write(uint64_t(images.size()));
+  writer.write(uint64_t(overlaps.size()));
+  for (const ImageCorners& image : images) {
+    writer.write(image.image);
+    writer.write(image.corners);
+  }
+  for (const ImagePair& overlap : overlaps) {
+    writer.write(overlap.image1);
+    writer.write(overlap.image2);
+    writer.write(overlap.matches);
+  }
+  CHECK(writer.close()) << folly::sformat("failed to save matches to {}", path.string());
+}
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,63 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <folly/dynamic.h>
+
+#include "source/util/Camera.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+// Corners of every image and matches between pairs of images, as saved by MatchCorners and
+// read by GeometricCalibration
+// Files are either json:
+//   {
+//     "images": {image: [{"x": x, "y": y}, ...]},
+//     "all_matches": [{"image1": image, "image2": image, "matches": [
+//       {"idx1": corner index in image1, "idx2": corner index in image2, "score": score}, ...
+//     ]}, ...]
+//   }
+// or a binary encoding of the same, which is a fraction of the size and is read without parsing
+struct MatchesData {
+  struct Match {
+    double score;
+    int32_t idx1;
+    int32_t idx2;
+  };
+
+  struct ImageCorners {
+    std::string image;
+    std::vector<Camera::Vector2> corners;
+  };
+
+  struct ImagePair {
+    std::string image1;
+    std::string image2;
+    std::vector<Match> matches;
+  };
+
+  std::vector<ImageCorners> images;
+  std::vector<ImagePair> overlaps;
+
+  folly::dynamic toJson() const;
+  static MatchesData fromJson(const folly::dynamic& parsed);
+
+  // Format is detected from the contents, binary files are memory-mapped
+  static MatchesData load(const filesystem::path& path);
+
+  // Binary unless json is true
+  void save(const filesystem::path& path, const bool json = false) const;
+};
+
+} // namespace calibration
+} // namespace fb360_dep
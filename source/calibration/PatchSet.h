@@ -0,0 +1,193 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <emmintrin.h>
+#define DEP_PATCH_SSE2 1
+#endif
+
+#include <glog/logging.h>
+
+namespace fb360_dep {
+namespace calibration {
+
+// Square patches of uint8 pixels, stored contiguously for zncc()
+// With n pixels per patch, the centered dot product of patches p and q is
+//   sum((p - avg(p)) * (q - avg(q))) = sum(p * q) - sum(p) * sum(q) / n
+// so only the integer sum(p * q) depends on both patches. Rows are padded with zeros to a multiple
+// of 16 bytes, and that sum is computed exactly with simd integer multiply-adds
+// Each patch also keeps running sums per row, so that zncc() can bound the rows it has not visited
+// yet and give up on a pair of patches that cannot score above a floor
+class PatchSet {
+ public:
+  explicit PatchSet(const int size)
+      : size(size), stride((size + kAlignment - 1) / kAlignment * kAlignment) {
+    CHECK_GT(size, 0);
+  }
+
+  int getSize() const {
+    return size;
+  }
+
+  int count() const {
+    return avgs.size();
+  }
+
+  // pixels is the first row of a size x size patch, rows step bytes apart. Returns its index
+  int add(const uint8_t* pixels, const size_t step) {
+    const size_t offset = data.size();
+    data.resize(offset + size * stride, 0);
+    std::vector<int64_t> sums(size + 1, 0);
+    std::vector<int64_t> squares(size + 1, 0);
+    for (int y = 0; y < size; ++y) {
+      const uint8_t* row = pixels + y * step;
+      memcpy(&data[offset + y * stride], row, size);
+      sums[y + 1] = sums[y];
+      squares[y + 1] = squares[y];
+      for (int x = 0; x < size; ++x) {
+        sums[y + 1] += row[x];
+        squares[y + 1] += row[x] * row[x];
+      }
+    }
+    rowSums.insert(rowSums.end(), sums.begin(), sums.end());
+    rowSquares.insert(rowSquares.end(), squares.begin(), squares.end());
+    const double n = size * size;
+    const double avg = sums[size] / n;
+    avgs.push_back(avg);
+    stds.push_back(std::sqrt(std::max(0.0, squares[size] / n - avg * avg)));
+    return avgs.size() - 1;
+  }
+
+  void clear() {
+    data.clear();
+    rowSums.clear();
+    rowSquares.clear();
+    avgs.clear();
+    stds.clear();
+  }
+
+  double getAvg(const int i) const {
+    return avgs[i];
+  }
+
+  double getStd(const int i) const {
+    return stds[i];
+  }
+
+  // Zero-mean normalized cross correlation of patch a and patch b of other, which has the same size
+  //   sum((a - avg(a)) * (b - avg(b))) / (n * std(a) * std(b))
+  // or, if isCustom,
+  //   mean((a - avg(a)) * (b - avg(b))) / avg(a) / avg(b) / max(std(a) / avg(a), std(b) / avg(b))^2
+  // Returns -infinity as soon as the score is known to be at most floor, NAN if it is undefined
+  double zncc(
+      const int a,
+      const PatchSet& other,
+      const int b,
+      const double floor = -std::numeric_limits<double>::infinity(),
+      const bool isCustom = false) const {
+    CHECK_EQ(size, other.size);
+    const double n = size * size;
+    double scale;
+    if (isCustom) {
+      const double denominator = std::max(stds[a] / avgs[a], other.stds[b] / other.avgs[b]);
+      scale = 1 / (n * avgs[a] * other.avgs[b] * denominator * denominator);
+    } else {
+      scale = 1 / (n * stds[a] * other.stds[b]);
+    }
+    if (!std::isfinite(scale)) {
+      return NAN;
+    }
+
+    const uint8_t* p = &data[a * size * stride];
+    const uint8_t* q = &other.data[b * size * stride];
+    const int64_t* sumsP = &rowSums[a * (size + 1)];
+    const int64_t* sumsQ = &other.rowSums[b * (size + 1)];
+    const int64_t* squaresP = &rowSquares[a * (size + 1)];
+    const int64_t* squaresQ = &other.rowSquares[b * (size + 1)];
+    const double avgP = avgs[a];
+    const double avgQ = other.avgs[b];
+    int64_t dot = 0;
+    for (int y = 0; y < size;) {
+      const int end = std::min(y + kRowsPerBound, size);
+      for (; y < end; ++y) {
+        dot += dotRow(p + y * stride, q + y * stride);
+      }
+      if (y == size) {
+        break;
+      }
+      // centered dot of rows [0, y), plus cauchy-schwarz on the centered rows [y, size)
+      const double m = y * size;
+      const double visited = dot - avgQ * sumsP[y] - avgP * sumsQ[y] + m * avgP * avgQ;
+      const double restP = centeredSquares(sumsP, squaresP, y, avgP);
+      const double restQ = centeredSquares(sumsQ, squaresQ, y, avgQ);
+      const double bound = (visited + std::sqrt(restP * restQ)) * scale;
+      if (bound + kBoundTolerance <= floor) {
+        return -std::numeric_limits<double>::infinity();
+      }
+    }
+    return (dot - double(sumsP[size]) * sumsQ[size] / n) * scale;
+  }
+
+ private:
+  static const int kAlignment = 16; // bytes in a simd register
+  static const int kRowsPerBound = 8; // rows between bounds
+  static constexpr double kBoundTolerance = 1e-9; // bounds are only exact up to rounding
+
+  // sum((p - avg)^2) over rows [y, size)
+  double centeredSquares(const int64_t* sums, const int64_t* squares, const int y, const double avg)
+      const {
+    const double sum = sums[size] - sums[y];
+    const double m = (size - y) * size;
+    return std::max(0.0, squares[size] - squares[y] - 2 * avg * sum + m * avg * avg);
+  }
+
+  int64_t dotRow(const uint8_t* p, const uint8_t* q) const {
+#ifdef DEP_PATCH_SSE2
+    // products of uint8 fit in int16 pairs summed to int32: at most 2 * 255^2 per lane per step
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (int x = 0; x < stride; x += kAlignment) {
+      const __m128i vp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+      const __m128i vq = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + x));
+      acc = _mm_add_epi32(
+          acc, _mm_madd_epi16(_mm_unpacklo_epi8(vp, zero), _mm_unpacklo_epi8(vq, zero)));
+      acc = _mm_add_epi32(
+          acc, _mm_madd_epi16(_mm_unpackhi_epi8(vp, zero), _mm_unpackhi_epi8(vq, zero)));
+    }
+    alignas(16) int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    return int64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#else
+    // Flattened loop is auto-vectorized by the compiler (e.g. NEON)
+    int32_t sum = 0;
+    for (int x = 0; x < stride; ++x) {
+      sum += p[x] * q[x];
+    }
+    return sum;
+#endif
+  }
+
+  const int size;
+  const int stride; // bytes between rows
+  std::vector<uint8_t> data; // count * size rows of stride bytes
+  std::vector<int64_t> rowSums; // per patch, sum of the rows before y for y in [0, size]
+  std::vector<int64_t> rowSquares; // per patch, sum of the squares of the rows before y
+  std::vector<double> avgs;
+  std::vector<double> stds;
+};
+
+} // namespace calibration
+} // namespace fb360_dep
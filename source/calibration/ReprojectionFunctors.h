@@ -0,0 +1,604 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include <ceres/ceres.h>
+
+#include "source/util/Camera.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+inline Camera makeCamera(
+    const Camera& camera,
+    const Camera::Vector3& position,
+    const Camera::Vector3& rotation,
+    const Camera::Vector2& principal,
+    const Camera::Real& focal,
+    const Camera::Distortion& distortion) {
+  Camera result = camera;
+  result.position = position;
+  result.setRotation(rotation);
+  result.principal = principal;
+  result.setScalarFocal(focal);
+  result.setDistortion(distortion);
+
+  return result;
+}
+
+inline void cartesianToSpherical(
+    Camera::Real& radius,
+    Camera::Real& theta,
+    Camera::Real& phi,
+    const Camera::Vector3& cartesianCoords) {
+  radius = cartesianCoords.norm();
+  theta = acos(cartesianCoords.z() / radius);
+  phi = atan(cartesianCoords.y() / cartesianCoords.x());
+}
+
+inline Camera::Vector3
+sphericalToCartesian(const Camera::Real radius, const Camera::Real theta, const Camera::Real phi) {
+  Camera::Vector3 cartesianCoords;
+  cartesianCoords.x() = radius * sin(theta) * cos(phi);
+  cartesianCoords.y() = radius * sin(theta) * sin(phi);
+  cartesianCoords.z() = radius * cos(theta);
+  return cartesianCoords;
+}
+
+// The functors below are differentiated numerically, which evaluates them, and thus copies and
+// sets up a Camera, twice per parameter. For the camera types we usually calibrate, the cost
+// functions they create instead compute the derivatives of Camera::pixel() analytically
+// They fall back to the numeric derivatives where the analytic ones do not apply: points on the
+// optical axis, behind a rectilinear camera, or past the maximum of the distortion polynomial
+
+using Matrix23 = Eigen::Matrix<Camera::Real, 2, 3, Eigen::RowMajor>;
+
+struct PixelJacobian {
+  Matrix23 camera; // with respect to the point in camera space, rotation * (world - position)
+  Camera::Vector2 focal; // with respect to the scalar focal
+  Eigen::Matrix<Camera::Real, 2, Camera::Distortion::SizeAtCompileTime, Eigen::RowMajor>
+      distortion;
+};
+
+inline bool hasAnalyticJacobian(const Camera& camera) {
+  return camera.type == Camera::Type::FTHETA || camera.type == Camera::Type::RECTILINEAR;
+}
+
+// Same as camera.pixel(world), false if the analytic derivatives do not apply
+inline bool pixelJacobian(
+    Camera::Vector2& pixel,
+    PixelJacobian& jacobian,
+    const Camera& camera,
+    const Camera::Vector3& world) {
+  const Camera::Vector3 v = camera.rotation * (world - camera.position);
+  const Camera::Real xy = v.head<2>().norm();
+  if (xy == 0) {
+    return false;
+  }
+  const Eigen::Matrix<Camera::Real, 1, 3> dxy(v.x() / xy, v.y() / xy, 0);
+
+  // undistorted radius r and its derivative, see Camera::cameraToSensor()
+  Camera::Real r;
+  Eigen::Matrix<Camera::Real, 1, 3> dr;
+  if (camera.type == Camera::Type::FTHETA) {
+    // r = atan2(|xy|, -z)
+    const Camera::Real squaredNorm = v.squaredNorm();
+    r = atan2(xy, -v.z());
+    dr = -v.z() / squaredNorm * dxy;
+    dr.z() = xy / squaredNorm;
+  } else {
+    CHECK(camera.type == Camera::Type::RECTILINEAR) << "unexpected: " << int(camera.type);
+    // r = |xy| / -z
+    if (-v.z() <= 0) {
+      return false;
+    }
+    r = xy / -v.z();
+    dr = dxy / -v.z();
+    dr.z() = xy / (v.z() * v.z());
+  }
+  if (r >= camera.getDistortionMax()) {
+    return false; // distort() is clamped, and distortionMax depends on the distortion
+  }
+
+  // distorted radius R = r + d0 * r^3 + d1 * r^5 ...
+  // dR/dr = 1 + 3 * d0 * r^2 + 5 * d1 * r^4 ...
+  const Camera::Distortion& distortion = camera.getDistortion();
+  Eigen::Matrix<Camera::Real, 1, Camera::Distortion::SizeAtCompileTime> dDistortion;
+  Camera::Real distorted = r;
+  Camera::Real dDistorted = 1;
+  Camera::Real evenPower = 1;
+  for (int i = 0; i < distortion.size(); ++i) {
+    evenPower *= r * r;
+    dDistortion[i] = evenPower * r;
+    distorted += distortion[i] * dDistortion[i];
+    dDistorted += (2 * i + 3) * distortion[i] * evenPower;
+  }
+
+  // sensor = scale * xy, where scale = R / |xy|
+  const Camera::Real scale = distorted / xy;
+  const Eigen::Matrix<Camera::Real, 1, 3> dScale = (dDistorted * dr - scale * dxy) / xy;
+  const Camera::Vector2 sensor = scale * v.head<2>();
+  Matrix23 dSensor = v.head<2>() * dScale;
+  dSensor(0, 0) += scale;
+  dSensor(1, 1) += scale;
+
+  pixel = camera.focal.cwiseProduct(sensor) + camera.principal;
+  jacobian.camera = camera.focal.asDiagonal() * dSensor;
+  jacobian.focal = Camera::Vector2(sensor.x(), -sensor.y()); // focal is {scalar, -scalar}
+  jacobian.distortion = camera.focal.cwiseProduct(v.head<2>() / xy) * dDistortion;
+  return true;
+}
+
+// Derivative of R * u with respect to the angle * axis vector of R, see Gallego and Yezzi, "A
+// compact formula for the derivative of a 3-D rotation in exponential coordinates"
+inline Camera::Matrix3 rotationJacobian(
+    const Camera::Vector3& angleAxis,
+    const Camera::Matrix3& rotation,
+    const Camera::Vector3& u) {
+  auto skew = [](const Camera::Vector3& v) {
+    Camera::Matrix3 result;
+    result << 0, -v.z(), v.y(), v.z(), 0, -v.x(), -v.y(), v.x(), 0;
+    return result;
+  };
+  const Camera::Real squaredAngle = angleAxis.squaredNorm();
+  if (squaredAngle < 1e-12) {
+    return -rotation * skew(u); // limit as the angle goes to zero, avoids dividing by ~0
+  }
+  const Camera::Matrix3 identity = Camera::Matrix3::Identity();
+  return -rotation * skew(u) *
+      (angleAxis * angleAxis.transpose() + (rotation.transpose() - identity) * skew(angleAxis)) /
+      squaredAngle;
+}
+
+// Copies jacobian into the ceres jacobian block, if it was requested, dividing it by divisor
+template <typename Derived>
+void setJacobian(
+    double** jacobians,
+    const int block,
+    const Eigen::MatrixBase<Derived>& jacobian,
+    const Camera::Real divisor = 1) {
+  if (jacobians[block]) {
+    // same layout either way, but eigen rejects row major column vectors
+    const int kCols = Derived::ColsAtCompileTime;
+    const int kOrder = kCols == 1 ? Eigen::ColMajor : Eigen::RowMajor;
+    using Block = Eigen::Matrix<Camera::Real, 2, kCols, kOrder>;
+    Eigen::Map<Block> result(jacobians[block]);
+    result = jacobian / divisor;
+  }
+}
+
+struct SphericalReprojectionFunctor {
+  static ceres::ResidualBlockId addResidual(
+      ceres::Problem& problem,
+      Camera::Real& theta,
+      Camera::Real& phi,
+      Camera::Vector3& rotation,
+      Camera::Vector2& principal,
+      Camera::Real& focal,
+      Camera::Distortion& distortion,
+      Camera::Vector3& world,
+      Camera::Real radius,
+      Camera::Vector3& referencePosition,
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      bool robust = false,
+      const int weight = 1) {
+    auto* cost = makeCostFunction(camera, pixel, weight, radius, referencePosition);
+    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
+    return problem.AddResidualBlock(
+        cost,
+        loss,
+        &theta,
+        &phi,
+        rotation.data(),
+        principal.data(),
+        &focal,
+        distortion.data(),
+        world.data());
+  }
+
+  // Analytic unless analytic is false or the camera type has no analytic derivatives
+  static ceres::CostFunction* makeCostFunction(
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      const int weight,
+      const double radius,
+      const Camera::Vector3& referencePosition,
+      const bool analytic = true) {
+    auto* numeric = new CostFunction(
+        new SphericalReprojectionFunctor(camera, pixel, weight, radius, referencePosition));
+    if (!analytic || !hasAnalyticJacobian(camera)) {
+      return numeric;
+    }
+    return new AnalyticCostFunction(numeric, camera, pixel, weight, radius, referencePosition);
+  }
+
+  bool operator()(
+      double const* const theta,
+      double const* const phi,
+      double const* const rotation,
+      double const* const principal,
+      double const* const focal,
+      double const* const distortion,
+      double const* const world,
+      double* residuals) const {
+    // create a camera using parameters
+    Camera::Vector3 position = sphericalToCartesian(radius, theta[0], phi[0]);
+    position += referencePosition;
+    Camera modified = makeCamera(
+        camera,
+        position,
+        Eigen::Map<const Camera::Vector3>(rotation),
+        Eigen::Map<const Camera::Vector2>(principal),
+        *focal,
+        Eigen::Map<const Camera::Distortion>(distortion));
+    // transform world with that camera and compare to pixel
+    Eigen::Map<const Camera::Vector3> w(world);
+    Eigen::Map<Camera::Vector2> r(residuals);
+    r = modified.pixel(w) - pixel;
+    r = r / sqrt(weight);
+    return true;
+  }
+
+ private:
+  using CostFunction = ceres::NumericDiffCostFunction<
+      SphericalReprojectionFunctor,
+      ceres::CENTRAL,
+      2, // residuals
+      1, // theta
+      1, // phi
+      3, // rotation
+      2, // principal
+      1, // focal
+      Camera::Distortion::SizeAtCompileTime, // distortion
+      3>; // world
+
+  class AnalyticCostFunction : public ceres::SizedCostFunction<
+                                   2, // residuals
+                                   1, // theta
+                                   1, // phi
+                                   3, // rotation
+                                   2, // principal
+                                   1, // focal
+                                   Camera::Distortion::SizeAtCompileTime, // distortion
+                                   3> { // world
+   public:
+    AnalyticCostFunction(
+        ceres::CostFunction* numeric,
+        const Camera& camera,
+        const Camera::Vector2& pixel,
+        const int weight,
+        const double radius,
+        const Camera::Vector3& referencePosition)
+        : numeric(numeric),
+          camera(camera),
+          pixel(pixel),
+          weight(weight),
+          radius(radius),
+          referencePosition(referencePosition) {}
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians)
+        const override {
+      const double theta = parameters[0][0];
+      const double phi = parameters[1][0];
+      const Eigen::Map<const Camera::Vector3> rotation(parameters[2]);
+      const Camera modified = makeCamera(
+          camera,
+          sphericalToCartesian(radius, theta, phi) + referencePosition,
+          rotation,
+          Eigen::Map<const Camera::Vector2>(parameters[3]),
+          parameters[4][0],
+          Eigen::Map<const Camera::Distortion>(parameters[5]));
+      const Eigen::Map<const Camera::Vector3> world(parameters[6]);
+      Camera::Vector2 projected;
+      PixelJacobian jacobian;
+      if (!pixelJacobian(projected, jacobian, modified, world)) {
+        return numeric->Evaluate(parameters, residuals, jacobians);
+      }
+      const Camera::Real divisor = sqrt(weight);
+      Eigen::Map<Camera::Vector2> r(residuals);
+      r = (projected - pixel) / divisor;
+      if (!jacobians) {
+        return true;
+      }
+
+      const Matrix23 dWorld = jacobian.camera * modified.rotation;
+      const Camera::Vector3 dTheta =
+          radius * Camera::Vector3(cos(theta) * cos(phi), cos(theta) * sin(phi), -sin(theta));
+      const Camera::Vector3 dPhi =
+          radius * Camera::Vector3(-sin(theta) * sin(phi), sin(theta) * cos(phi), 0);
+      setJacobian(jacobians, 0, -dWorld * dTheta, divisor);
+      setJacobian(jacobians, 1, -dWorld * dPhi, divisor);
+      setJacobian(
+          jacobians,
+          2,
+          jacobian.camera *
+              rotationJacobian(rotation, modified.rotation, world - modified.position),
+          divisor);
+      setJacobian(jacobians, 3, Eigen::Matrix2d::Identity(), divisor);
+      setJacobian(jacobians, 4, jacobian.focal, divisor);
+      setJacobian(
+          jacobians, 5, jacobian.distortion, divisor);
+      setJacobian(jacobians, 6, dWorld, divisor);
+      return true;
+    }
+
+   private:
+    const std::unique_ptr<ceres::CostFunction> numeric;
+    const Camera& camera;
+    const Camera::Vector2 pixel;
+    const int weight;
+    const Camera::Real radius;
+    const Camera::Vector3& referencePosition;
+  };
+
+  SphericalReprojectionFunctor(
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      const int weight,
+      const double radius,
+      const Camera::Vector3& referencePosition)
+      : camera(camera),
+        pixel(pixel),
+        weight(weight),
+        radius(radius),
+        referencePosition(referencePosition) {}
+
+  const Camera& camera;
+  const Camera::Vector2 pixel;
+  const int weight;
+  const Camera::Real radius;
+  const Camera::Vector3& referencePosition;
+};
+
+struct ReprojectionFunctor {
+  static ceres::ResidualBlockId addResidual(
+      ceres::Problem& problem,
+      Camera::Vector3& position,
+      Camera::Vector3& rotation,
+      Camera::Vector2& principal,
+      Camera::Real& focal,
+      Camera::Distortion& distortion,
+      Camera::Vector3& world,
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      bool robust = false,
+      const int weight = 1) {
+    auto* cost = makeCostFunction(camera, pixel, weight);
+    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
+    return problem.AddResidualBlock(
+        cost,
+        loss,
+        position.data(),
+        rotation.data(),
+        principal.data(),
+        &focal,
+        distortion.data(),
+        world.data());
+  }
+
+  // Analytic unless analytic is false or the camera type has no analytic derivatives
+  static ceres::CostFunction* makeCostFunction(
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      const int weight,
+      const bool analytic = true) {
+    auto* numeric = new CostFunction(new ReprojectionFunctor(camera, pixel, weight));
+    if (!analytic || !hasAnalyticJacobian(camera)) {
+      return numeric;
+    }
+    return new AnalyticCostFunction(numeric, camera, pixel, weight);
+  }
+
+  bool operator()(
+      double const* const position,
+      double const* const rotation,
+      double const* const principal,
+      double const* const focal,
+      double const* const distortion,
+      double const* const world,
+      double* residuals) const {
+    // create a camera using parameters
+    Camera modified = makeCamera(
+        camera,
+        Eigen::Map<const Camera::Vector3>(position),
+        Eigen::Map<const Camera::Vector3>(rotation),
+        Eigen::Map<const Camera::Vector2>(principal),
+        *focal,
+        Eigen::Map<const Camera::Distortion>(distortion));
+    // transform world with that camera and compare to pixel
+    Eigen::Map<const Camera::Vector3> w(world);
+    Eigen::Map<Camera::Vector2> r(residuals);
+    r = modified.pixel(w) - pixel;
+    r = r / sqrt(weight);
+
+    return true;
+  }
+
+ private:
+  using CostFunction = ceres::NumericDiffCostFunction<
+      ReprojectionFunctor,
+      ceres::CENTRAL,
+      2, // residuals
+      3, // position
+      3, // rotation
+      2, // principal
+      1, // focal
+      Camera::Distortion::SizeAtCompileTime, // distortion
+      3>; // world
+
+  class AnalyticCostFunction : public ceres::SizedCostFunction<
+                                   2, // residuals
+                                   3, // position
+                                   3, // rotation
+                                   2, // principal
+                                   1, // focal
+                                   Camera::Distortion::SizeAtCompileTime, // distortion
+                                   3> { // world
+   public:
+    AnalyticCostFunction(
+        ceres::CostFunction* numeric,
+        const Camera& camera,
+        const Camera::Vector2& pixel,
+        const int weight)
+        : numeric(numeric), camera(camera), pixel(pixel), weight(weight) {}
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians)
+        const override {
+      const Eigen::Map<const Camera::Vector3> rotation(parameters[1]);
+      const Camera modified = makeCamera(
+          camera,
+          Eigen::Map<const Camera::Vector3>(parameters[0]),
+          rotation,
+          Eigen::Map<const Camera::Vector2>(parameters[2]),
+          parameters[3][0],
+          Eigen::Map<const Camera::Distortion>(parameters[4]));
+      const Eigen::Map<const Camera::Vector3> world(parameters[5]);
+      Camera::Vector2 projected;
+      PixelJacobian jacobian;
+      if (!pixelJacobian(projected, jacobian, modified, world)) {
+        return numeric->Evaluate(parameters, residuals, jacobians);
+      }
+      const Camera::Real divisor = sqrt(weight);
+      Eigen::Map<Camera::Vector2> r(residuals);
+      r = (projected - pixel) / divisor;
+      if (!jacobians) {
+        return true;
+      }
+
+      const Matrix23 dWorld = jacobian.camera * modified.rotation;
+      setJacobian(jacobians, 0, -dWorld, divisor);
+      setJacobian(
+          jacobians,
+          1,
+          jacobian.camera *
+              rotationJacobian(rotation, modified.rotation, world - modified.position),
+          divisor);
+      setJacobian(jacobians, 2, Eigen::Matrix2d::Identity(), divisor);
+      setJacobian(jacobians, 3, jacobian.focal, divisor);
+      setJacobian(
+          jacobians, 4, jacobian.distortion, divisor);
+      setJacobian(jacobians, 5, dWorld, divisor);
+      return true;
+    }
+
+   private:
+    const std::unique_ptr<ceres::CostFunction> numeric;
+    const Camera& camera;
+    const Camera::Vector2 pixel;
+    const int weight;
+  };
+
+  ReprojectionFunctor(const Camera& camera, const Camera::Vector2& pixel, const int weight)
+      : camera(camera), pixel(pixel), weight(weight) {}
+
+  const Camera& camera;
+  const Camera::Vector2 pixel;
+  const int weight;
+};
+
+// The problem with using a world coordinate as the variable when triangulating is that the solver
+// might overshoot and end up behind you. This happens a lot if the initial estimate is e.g. 1000 m
+// away: The solver realizes it is way too far and follows the gradient back close to zero. Very
+// often it will blow past zero and end up behind you
+
+// The trick to fix this is to use inv = world / |world|^2 as the variable instead. Using
+//   disparity = 1 / |world|,
+// it can be seen that
+//   inv = disparty * unit(world),
+// so this accomplishes two things:
+// - The variable is proportional to disparity. We care about pixels, not meters
+// - To end up behind you, the solver needs to cross through infinity (hard) instead of zero (easy)
+struct TriangulationFunctor {
+  static ceres::CostFunction* addResidual(
+      ceres::Problem& problem,
+      Camera::Vector3& inv,
+      const Camera& camera,
+      const Camera::Vector2& pixel,
+      const bool robust = false) {
+    auto* cost = makeCostFunction(camera, pixel);
+    auto* loss = robust ? new ceres::HuberLoss(1.0) : nullptr;
+    problem.AddResidualBlock(cost, loss, inv.data());
+    return cost;
+  }
+
+  // Analytic unless analytic is false or the camera type has no analytic derivatives
+  static ceres::CostFunction*
+  makeCostFunction(const Camera& camera, const Camera::Vector2& pixel, const bool analytic = true) {
+    auto* numeric = new CostFunction(new TriangulationFunctor(camera, pixel));
+    if (!analytic || !hasAnalyticJacobian(camera)) {
+      return numeric;
+    }
+    return new AnalyticCostFunction(numeric, camera, pixel);
+  }
+
+  bool operator()(double const* const inv, double* residuals) const {
+    Eigen::Map<const Camera::Vector3> i(inv);
+    Eigen::Map<Camera::Vector2> r(residuals);
+
+    Camera::Vector3 w = i / i.squaredNorm();
+
+    // transform world with camera and compare to pixel
+    r = camera.pixel(w) - pixel;
+
+    return true;
+  }
+
+ private:
+  using CostFunction = ceres::NumericDiffCostFunction<
+      TriangulationFunctor,
+      ceres::CENTRAL,
+      2, // residuals
+      3>; // inverse world
+
+  class AnalyticCostFunction : public ceres::SizedCostFunction<2, 3> {
+   public:
+    AnalyticCostFunction(
+        ceres::CostFunction* numeric,
+        const Camera& camera,
+        const Camera::Vector2& pixel)
+        : numeric(numeric), camera(camera), pixel(pixel) {}
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians)
+        const override {
+      const Eigen::Map<const Camera::Vector3> inv(parameters[0]);
+      const Camera::Real squaredNorm = inv.squaredNorm();
+      Camera::Vector2 projected;
+      PixelJacobian jacobian;
+      if (!pixelJacobian(projected, jacobian, camera, inv / squaredNorm)) {
+        return numeric->Evaluate(parameters, residuals, jacobians);
+      }
+      Eigen::Map<Camera::Vector2> r(residuals);
+      r = projected - pixel;
+      if (jacobians) {
+        // d(inv / |inv|^2) / dinv = (|inv|^2 * I - 2 * inv * inv^T) / |inv|^4
+        const Camera::Matrix3 dWorld =
+            (squaredNorm * Camera::Matrix3::Identity() - 2 * inv * inv.transpose()) /
+            (squaredNorm * squaredNorm);
+        setJacobian(jacobians, 0, jacobian.camera * camera.rotation * dWorld);
+      }
+      return true;
+    }
+
+   private:
+    const std::unique_ptr<ceres::CostFunction> numeric;
+    const Camera& camera;
+    const Camera::Vector2 pixel;
+  };
+
+  TriangulationFunctor(const Camera& camera, const Camera::Vector2& pixel)
+      : camera(camera), pixel(pixel) {}
+
+  const Camera& camera;
+  const Camera::Vector2 pixel;
+};
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -6,7 +6,10 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <fstream>
+#include <string>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -14,8 +17,10 @@
 #include "source/thirdparty/bc7_compressor/ISPCTextureCompressor/ispc/ispc_texcomp/ispc_texcomp.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
+#include "source/util/MathUtil.h"
 #include "source/util/RawUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace bc7_util {
@@ -41,45 +46,125 @@ uint8_t gammaCorrect(const float val, const float gammaCorrection) {
   return uint8_t(std::pow(val, gammaCorrection) * 255.0f + 0.5f);
 }
 
-void compressBC7(
+// gammaCorrect() over [0, 1], tabulated and linearly interpolated
+// Interpolation error is orders of magnitude below the 8-bit output step, so results match
+// gammaCorrect() except for values within rounding error of a step boundary
+// Inputs are clamped to [0, 1]
+class GammaLut {
+ public:
+  static const int kSize = 4096;
+
+  explicit GammaLut(const float gammaCorrection) : table(kSize + 1) {
+    for (int i = 0; i < kSize; ++i) {
+      table[i] = std::pow(float(i) / (kSize - 1), gammaCorrection) * 255.0f;
+    }
+    table[kSize] = table[kSize - 1];
+  }
+
+  uint8_t operator()(const float val) const {
+    const float pos = math_util::clamp(val, 0.0f, 1.0f) * (kSize - 1);
+    const int i = int(pos);
+    return uint8_t(table[i] + (pos - i) * (table[i + 1] - table[i]) + 0.5f);
+  }
+
+ private:
+  std::vector<float> table;
+};
+
+// Speed vs quality tradeoffs of the compressor, fastest first
+// Alpha is always opaque, so there is no need for the alpha profiles
+void getProfile(const std::string& profile, bc7_enc_settings* settings) {
+  if (profile == "ultrafast") {
+    GetProfile_ultrafast(settings);
+  } else if (profile == "veryfast") {
+    GetProfile_veryfast(settings);
+  } else if (profile == "fast") {
+    GetProfile_fast(settings);
+  } else if (profile == "basic") {
+    GetProfile_basic(settings);
+  } else if (profile == "slow") {
+    GetProfile_slow(settings);
+  } else {
+    LOG(FATAL) << "Invalid BC7 profile: " << profile;
+  }
+}
+
+// Number of block rows (4 pixel rows) compressed per task
+static const int kBlockRowsPerTask = 4;
+
+// Packs rows [yBegin, yEnd) of srcImg as gamma corrected, opaque rgba8 rows of width pixels
+// Rows and columns past the edge of srcImg replicate its last row and column
+void packRgbaRows(
+    uint8_t* dst,
+    const cv::Mat_<cv::Vec3f>& srcImg,
+    const GammaLut& gammaLut,
+    const int yBegin,
+    const int yEnd,
+    const int width) {
+  const int bytesPerPixel = 4;
+  for (int y = yBegin; y < yEnd; ++y) {
+    const cv::Vec3f* srcRow = srcImg.ptr<cv::Vec3f>(std::min(y, srcImg.rows - 1));
+    uint8_t* dstRow = &dst[y * width * bytesPerPixel];
+    for (int x = 0; x < width; ++x) {
+      const cv::Vec3f& src = srcRow[std::min(x, srcImg.cols - 1)];
+      dstRow[x * bytesPerPixel + 0] = gammaLut(src[2]);
+      dstRow[x * bytesPerPixel + 1] = gammaLut(src[1]);
+      dstRow[x * bytesPerPixel + 2] = gammaLut(src[0]);
+      dstRow[x * bytesPerPixel + 3] = 255;
+    }
+  }
+}
+
+// Returns the compressed image, preceded by a DDS header if writeDDSHeader is set
+// Bands of block rows are packed and compressed in parallel. Blocks are independent, so the
+// result does not depend on numThreads
+std::vector<uint8_t> compressBC7ToBuffer(
     const cv::Mat& image,
-    const filesystem::path& destFilename,
     const float gammaCorrection = 2.2 / 1.8,
-    const bool writeDDSHeader = true) {
+    const bool writeDDSHeader = true,
+    const std::string& profile = "veryfast",
+    const int numThreads = -1) {
   const cv::Mat_<cv::Vec3f> srcImg = cv_util::convertImage<cv::Vec3f>(image);
+  const GammaLut gammaLut(gammaCorrection);
+
+  bc7_enc_settings settings;
+  getProfile(profile, &settings);
 
-  // Pack the image data in the format the BC7 compressor expects
   const int w = srcImg.cols;
   const int h = srcImg.rows;
   const int bytesPerPixel = 4;
   std::vector<uint8_t> uncompressedImage(w * h * bytesPerPixel);
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      const cv::Vec3f srcColor = srcImg(y, x);
-      const int offset = (x + y * w) * bytesPerPixel;
-      uncompressedImage[offset + 0] = gammaCorrect(srcColor[2], gammaCorrection);
-      uncompressedImage[offset + 1] = gammaCorrect(srcColor[1], gammaCorrection);
-      uncompressedImage[offset + 2] = gammaCorrect(srcColor[0], gammaCorrection);
-      uncompressedImage[offset + 3] = 255;
-    }
-  }
 
-  rgba_surface surface;
-  surface.width = w;
-  surface.height = h;
-  surface.stride = surface.width * bytesPerPixel;
-  surface.ptr = uncompressedImage.data();
+  static const int kHeaderSize = 148;
+  const int headerSize = writeDDSHeader ? kHeaderSize : 0;
+  const int dataSize = w * h;
+  std::vector<uint8_t> result(headerSize + dataSize);
 
-  bc7_enc_settings settings;
-  GetProfile_veryfast(&settings);
+  // Each 4x4 block compresses to 16 bytes, i.e. one byte per pixel
+  static const int kBandRows = 4 * kBlockRowsPerTask;
+  const int numBands = (h + kBandRows - 1) / kBandRows;
+  parallelFor(
+      0,
+      numBands,
+      1,
+      [&](const int band) {
+        const int yBegin = band * kBandRows;
+        const int yEnd = std::min(yBegin + kBandRows, h);
 
-  std::vector<unsigned char> bc7data(w * h);
-  CompressBlocksBC7(&surface, bc7data.data(), &settings);
+        // Pack the image data in the format the BC7 compressor expects
+        packRgbaRows(uncompressedImage.data(), srcImg, gammaLut, yBegin, yEnd, w);
 
-  std::ofstream outFile(destFilename.string(), std::ios::binary);
+        rgba_surface surface;
+        surface.width = w;
+        surface.height = yEnd - yBegin;
+        surface.stride = w * bytesPerPixel;
+        surface.ptr = &uncompressedImage[yBegin * w * bytesPerPixel];
+        bc7_enc_settings bandSettings = settings;
+        CompressBlocksBC7(&surface, result.data() + headerSize + yBegin * w, &bandSettings);
+      },
+      numThreads);
 
   if (writeDDSHeader) {
-    static const int kHeaderSize = 148;
     char headerData[kHeaderSize] = {
         68, 68, 83, 32, 124, 0, 0, 0, 7, 16, 10, 0,  0,  8, 0, 0, -112, 9, 0, 0, 0, -128, 76, 0, 1,
         0,  0,  0,  1,  0,   0, 0, 0, 0, 0,  0,  0,  0,  0, 0, 0, 0,    0, 0, 0, 0, 0,    0,  0, 0,
@@ -91,10 +176,86 @@ void compressBC7(
     // write width, height, data size in header
     writeDDSHeaderField(headerData, 3, h);
     writeDDSHeaderField(headerData, 4, w);
-    writeDDSHeaderField(headerData, 5, bc7data.size());
-    outFile.write(headerData, kHeaderSize);
+    writeDDSHeaderField(headerData, 5, dataSize);
+    std::copy(headerData, headerData + kHeaderSize, result.begin());
   }
 
+  return result;
+}
+
+// ASTC block sizes the compressor supports with square blocks, in pixels
+bool isValidASTCBlockSize(const int blockSize) {
+  return blockSize == 4 || blockSize == 5 || blockSize == 6 || blockSize == 8;
+}
+
+// Size of an ASTC image, every blockSize x blockSize block compresses to 16 bytes
+size_t getASTCSize(const int width, const int height, const int blockSize) {
+  const size_t blocksX = (width + blockSize - 1) / blockSize;
+  const size_t blocksY = (height + blockSize - 1) / blockSize;
+  return blocksX * blocksY * 16;
+}
+
+// Returns the image as raw ASTC blocks, for gpus without BC7, e.g. mobile and standalone headsets
+// 4x4 blocks are the same 1 byte per pixel as BC7, larger blocks trade quality for bandwidth
+// Images that are not a multiple of the block size are padded by replicating their edges
+// Same band parallelism as compressBC7ToBuffer, so the result does not depend on numThreads
+std::vector<uint8_t> compressASTCToBuffer(
+    const cv::Mat& image,
+    const float gammaCorrection = 2.2 / 1.8,
+    const int blockSize = 4,
+    const int numThreads = -1) {
+  CHECK(isValidASTCBlockSize(blockSize)) << "Invalid ASTC block size: " << blockSize;
+  const cv::Mat_<cv::Vec3f> srcImg = cv_util::convertImage<cv::Vec3f>(image);
+  const GammaLut gammaLut(gammaCorrection);
+
+  // Alpha is always opaque
+  astc_enc_settings settings;
+  GetProfile_astc_fast(&settings, blockSize, blockSize);
+
+  const int blocksX = (srcImg.cols + blockSize - 1) / blockSize;
+  const int blocksY = (srcImg.rows + blockSize - 1) / blockSize;
+  const int w = blocksX * blockSize;
+  const int bytesPerPixel = 4;
+  std::vector<uint8_t> uncompressedImage(w * blocksY * blockSize * bytesPerPixel);
+  std::vector<uint8_t> result(getASTCSize(srcImg.cols, srcImg.rows, blockSize));
+
+  static const int kBlockBytes = 16;
+  const int numBands = (blocksY + kBlockRowsPerTask - 1) / kBlockRowsPerTask;
+  parallelFor(
+      0,
+      numBands,
+      1,
+      [&](const int band) {
+        const int blockBegin = band * kBlockRowsPerTask;
+        const int blockEnd = std::min(blockBegin + kBlockRowsPerTask, blocksY);
+        const int yBegin = blockBegin * blockSize;
+        const int yEnd = blockEnd * blockSize;
+        packRgbaRows(uncompressedImage.data(), srcImg, gammaLut, yBegin, yEnd, w);
+
+        rgba_surface surface;
+        surface.width = w;
+        surface.height = yEnd - yBegin;
+        surface.stride = w * bytesPerPixel;
+        surface.ptr = &uncompressedImage[yBegin * w * bytesPerPixel];
+        astc_enc_settings bandSettings = settings;
+        CompressBlocksASTC(
+            &surface, result.data() + blockBegin * blocksX * kBlockBytes, &bandSettings);
+      },
+      numThreads);
+
+  return result;
+}
+
+void compressBC7(
+    const cv::Mat& image,
+    const filesystem::path& destFilename,
+    const float gammaCorrection = 2.2 / 1.8,
+    const bool writeDDSHeader = true,
+    const std::string& profile = "veryfast",
+    const int numThreads = -1) {
+  const std::vector<uint8_t> bc7data =
+      compressBC7ToBuffer(image, gammaCorrection, writeDDSHeader, profile, numThreads);
+  std::ofstream outFile(destFilename.string(), std::ios::binary);
   outFile.write((char*)bc7data.data(), bc7data.size());
 }
 
@@ -61,12 +61,18 @@ int main(int argc, char** argv) {
 
   // Generate set of vertexes and faces
   LOG(INFO) << "Generating vertexes...";
-  Eigen::MatrixXd vertexes = mesh_util::getVertexesEquirect(disp, FLAGS_max_depth);
+  Eigen::MatrixXd vertexes = mesh_util::getVertexesEquirect(disp, FLAGS_max_depth, FLAGS_threads);
   LOG(INFO) << "Generating faces...";
   const bool wrapHorizontally = true;
   const bool isRigCoordinates = true;
   Eigen::MatrixXi faces = mesh_util::getFaces(
-      vertexes, disp.cols, disp.rows, wrapHorizontally, isRigCoordinates, FLAGS_tear_ratio);
+      vertexes,
+      disp.cols,
+      disp.rows,
+      wrapHorizontally,
+      isRigCoordinates,
+      FLAGS_tear_ratio,
+      FLAGS_threads);
 
   // Simplify
   if (FLAGS_strictness > 0) {
@@ -16,6 +16,12 @@ const char* kUsage = R"(
   The format can be imported as a .txt into meshlab with File -> Import Mesh
   set Separator to "SPACE" and set Point format to "X Y Z Reflectance R G B"
 
+  If the output filename ends in .ply or .pcd, a binary ply or pcd point cloud is written instead
+
+  Points are written as each camera is processed, so memory use is bounded by a single camera.
+  With --voxel_size, only the first point in each voxel of that size is written, which removes
+  the copies of a point seen by overlapping cameras
+
   - Example:
     ./ExportPointCloud \
     --output=/path/to/video/output \
@@ -25,9 +31,14 @@ const char* kUsage = R"(
     --frame=000000
 )";
 
+#include <cstdio>
+#include <limits>
+#include <unordered_set>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "source/render/MeshUtil.h"
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
@@ -47,6 +58,7 @@ DEFINE_string(output, "", "output filename (required)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_int32(subsample, 1, "how often we sample (>= 1)");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
+DEFINE_double(voxel_size, 0, "keep one point per voxel of this size (m) (0 = keep all)");
 
 // World coordinate (xyz) and corresponding color (rgb)
 using WorldColor = Eigen::Array<float, 6, 1>;
@@ -56,6 +68,7 @@ void verifyInputs(const Camera::Rig& rig) {
   CHECK_NE(FLAGS_color, "");
   CHECK_NE(FLAGS_disparity, "");
   CHECK_NE(FLAGS_output, "");
+  CHECK_GE(FLAGS_voxel_size, 0);
 
   verifyImagePaths(FLAGS_color, rig, FLAGS_frame, FLAGS_frame);
   verifyImagePaths(FLAGS_disparity, rig, FLAGS_frame, FLAGS_frame, ".pfm");
@@ -79,49 +92,45 @@ std::vector<WorldColor> getPoints(const Camera& cam) {
 
   // Transform each pixel to world coordinates and append to result
   std::vector<WorldColor> points(w * h);
-  std::vector<bool> idxToDelete(w * h, false);
-
-  ThreadPool threadPool(FLAGS_threads);
-  const int edgeX = w;
-  const int edgeY = 1;
-  for (int yBegin = 0; yBegin < h; yBegin += edgeY) {
-    for (int xBegin = 0; xBegin < w; xBegin += edgeX) {
-      const int xEnd = std::min(xBegin + edgeX, w);
-      const int yEnd = std::min(yBegin + edgeY, h);
-      threadPool.spawn([&, xBegin, yBegin, xEnd, yEnd] {
-        for (int y = yBegin; y < yEnd; ++y) {
-          for (int x = xBegin; x < xEnd; ++x) {
-            const int idx = w * y + x;
-            if (FLAGS_subsample > 1 && rand() % FLAGS_subsample != 0) {
-              idxToDelete[idx] = true;
-              continue; // only retain 1 in subsample points
-            }
-            Camera::Vector2 pixel = {x + 0.5, y + 0.5};
-            if (camRescale.isOutsideImageCircle(pixel)) {
+
+  // std::vector<bool> packs bits, so rows written concurrently must not share a word
+  std::vector<char> idxToDelete(w * h, false);
+
+  const int kRowsPerTask = 8;
+  parallelFor(
+      0,
+      h,
+      kRowsPerTask,
+      [&](const int y) {
+        for (int x = 0; x < w; ++x) {
+          const int idx = w * y + x;
+          if (FLAGS_subsample > 1 && rand() % FLAGS_subsample != 0) {
+            idxToDelete[idx] = true;
+            continue; // only retain 1 in subsample points
+          }
+          Camera::Vector2 pixel = {x + 0.5, y + 0.5};
+          if (camRescale.isOutsideImageCircle(pixel)) {
+            idxToDelete[idx] = true;
+            continue;
+          }
+          WorldColor worldColor;
+          const double m = 1 / disparity(y, x);
+          Camera::Vector3 world = camRescale.rig(pixel, m);
+          const Camera::Real depth = world.norm();
+          if (depth > FLAGS_max_depth) {
+            if (FLAGS_clip) {
               idxToDelete[idx] = true;
               continue;
             }
-            WorldColor worldColor;
-            const double m = 1 / disparity(y, x);
-            Camera::Vector3 world = camRescale.rig(pixel, m);
-            const Camera::Real depth = world.norm();
-            if (depth > FLAGS_max_depth) {
-              if (FLAGS_clip) {
-                idxToDelete[idx] = true;
-                continue;
-              }
-              world *= FLAGS_max_depth / depth;
-            }
-            worldColor.head<3>() = world.cast<float>();
-            const cv::Vec3f c = color(y, x);
-            worldColor.tail<3>() = Eigen::Array3f(c[2], c[1], c[0]);
-            points[y * w + x] = worldColor;
+            world *= FLAGS_max_depth / depth;
           }
+          worldColor.head<3>() = world.cast<float>();
+          const cv::Vec3f c = color(y, x);
+          worldColor.tail<3>() = Eigen::Array3f(c[2], c[1], c[0]);
+          points[y * w + x] = worldColor;
         }
-      });
-    }
-  }
-  threadPool.join();
+      },
+      FLAGS_threads);
 
   std::vector<WorldColor> pointsFiltered;
   for (ssize_t i = 0; i < ssize(points); ++i) {
@@ -133,48 +142,203 @@ std::vector<WorldColor> getPoints(const Camera& cam) {
   return pointsFiltered;
 }
 
-void writePoints(
-    std::ofstream& file,
-    const std::vector<std::vector<WorldColor>>& pointClouds,
-    const int lines) {
-  LOG(INFO) << folly::format("Writing {} points to file...", lines);
-
-  // Merge all points
-  std::vector<WorldColor> pointsAll;
-  pointsAll.reserve(lines); // preallocate memory
-  for (const std::vector<WorldColor>& points : pointClouds) {
-    pointsAll.insert(pointsAll.end(), points.begin(), points.end());
+// Index of the voxel of side FLAGS_voxel_size containing point, 21 bits per axis. Voxels past
+// +/-2^20 along an axis share the outermost ones
+uint64_t getVoxelKey(const WorldColor& point) {
+  const int kBits = 21;
+  const double lo = -(1 << (kBits - 1));
+  const double hi = (1 << (kBits - 1)) - 1;
+  uint64_t key = 0;
+  for (int i = 0; i < 3; ++i) {
+    const double cell = std::floor(point[i] / FLAGS_voxel_size);
+    const int64_t clamped = std::isnan(cell) ? 0 : math_util::clamp(cell, lo, hi);
+    key = key << kBits | uint64_t(clamped - int64_t(lo));
   }
+  return key;
+}
 
-  ThreadPool threadPool(FLAGS_threads);
-  const int threads = threadPool.getMaxThreads();
-  const int pointsPerThread = std::ceil((float)pointsAll.size() / threads);
-
-  std::vector<std::stringstream> filestreams(threads);
-  for (int i = 0; i < threads; ++i) {
-    const int start = i * pointsPerThread;
-    const int end = std::min((i + 1) * pointsPerThread - 1, int(pointsAll.size()) - 1);
-    threadPool.spawn([&, i, start, end] {
-      std::stringstream fileI;
-      for (int j = start; j <= end; ++j) {
-        // A line in a pts file represents x y z "intensity" r g b
-        // x y z are in meters, we arbitrarily set "intensity" to 1, and rgb is between 0 and 255
-        const WorldColor& point = pointsAll[j];
-        fileI << folly::format("{} {} {} 1 ", point[0], point[1], point[2]);
-        fileI << folly::format(
-            "{:.0f} {:.0f} {:.0f}\n", 255 * point[3], 255 * point[4], 255 * point[5]);
-      }
-      filestreams[i] = std::move(fileI);
-    });
+// Drops points in voxels that earlier points, of this or earlier cameras, already occupy
+void removeDuplicates(std::vector<WorldColor>& points, std::unordered_set<uint64_t>& occupied) {
+  std::vector<uint64_t> keys(points.size());
+  const int kPointsPerTask = 1 << 14;
+  parallelFor(
+      0,
+      points.size(),
+      kPointsPerTask,
+      [&](const int i) { keys[i] = getVoxelKey(points[i]); },
+      FLAGS_threads);
+
+  ssize_t kept = 0;
+  for (ssize_t i = 0; i < ssize(points); ++i) {
+    if (occupied.insert(keys[i]).second) {
+      points[kept++] = points[i];
+    }
   }
-  threadPool.join();
+  points.resize(kept);
+}
 
-  LOG(INFO) << "Merging files...";
-  for (const auto& filestream : filestreams) {
-    file << filestream.rdbuf();
+enum class Format { TEXT, PLY, PCD };
+
+// Header for count points, padded to size bytes with a comment (a space in text) so that it can be
+// rewritten in place once the count is known
+std::string getHeader(const Format format, const uint64_t count, const size_t size = 0) {
+  std::string head;
+  std::string tail;
+  std::string comment;
+  std::string newline = "\n";
+  if (format == Format::PLY) {
+    // Binary little endian ply with float xyz and uchar rgb per point
+    head = folly::sformat(
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "element vertex {}\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "property uchar red\n"
+        "property uchar green\n"
+        "property uchar blue\n",
+        count);
+    tail = "end_header\n";
+    comment = "comment ";
+  } else if (format == Format::PCD) {
+    // Binary pcd with float xyz and rgb packed as 0x00RRGGBB per point
+    head = folly::sformat(
+        "# .PCD v0.7 - Point Cloud Data file format\n"
+        "VERSION 0.7\n"
+        "FIELDS x y z rgb\n"
+        "SIZE 4 4 4 4\n"
+        "TYPE F F F U\n"
+        "COUNT 1 1 1 1\n"
+        "WIDTH {}\n"
+        "HEIGHT 1\n"
+        "VIEWPOINT 0 0 0 1 0 0 0\n"
+        "POINTS {}\n",
+        count,
+        count);
+    tail = "DATA binary\n";
+    comment = "#";
+  } else {
+    if (!FLAGS_header_count) {
+      return "";
+    }
+    head = std::to_string(count);
+    tail = "\n";
+    newline = "";
   }
+  const size_t used = head.size() + comment.size() + newline.size() + tail.size();
+  return head + comment + std::string(std::max(size, used) - used, ' ') + newline + tail;
 }
 
+uint8_t toByte(const float value) {
+  return math_util::clamp(std::round(255 * value), 0.0f, 255.0f);
+}
+
+// Appends points to a file as they come. Binary formats reserve room for the largest header and
+// rewrite it with the final count on close. Text would need padding in the count line, so its
+// points go to a temporary file that is copied after the header instead
+class PointWriter {
+ public:
+  explicit PointWriter(const filesystem::path& path) : path(path) {
+    if (path.extension() == ".ply") {
+      format = Format::PLY;
+    } else if (path.extension() == ".pcd") {
+      format = Format::PCD;
+    }
+    filePath = format == Format::TEXT ? filesystem::path(path.string() + ".tmp") : path;
+    fp = fopen(filePath.c_str(), "wb");
+    CHECK(fp) << folly::sformat("Cannot open file for writing: {}", filePath.string());
+    if (format != Format::TEXT) {
+      headerSize = getHeader(format, std::numeric_limits<uint64_t>::max()).size();
+      write(getHeader(format, 0, headerSize));
+    }
+  }
+
+  void write(const std::vector<WorldColor>& points) {
+    count += points.size();
+    if (format == Format::TEXT) {
+      mesh_util::writeLines(
+          fp,
+          points.size(),
+          [&](std::string& buffer, const int i) {
+            // A line in a pts file represents x y z "intensity" r g b
+            // x y z are in meters, "intensity" is arbitrarily 1, and rgb is between 0 and 255
+            const WorldColor& point = points[i];
+            mesh_util::appendFormat(
+                buffer,
+                "%g %g %g 1 %.0f %.0f %.0f\n",
+                point[0],
+                point[1],
+                point[2],
+                255 * point[3],
+                255 * point[4],
+                255 * point[5]);
+          },
+          FLAGS_threads);
+      return;
+    }
+
+    const size_t kPointSize = format == Format::PLY ? 3 * sizeof(float) + 3 : 4 * sizeof(float);
+    std::vector<char> data(points.size() * kPointSize);
+    const int kPointsPerTask = 1 << 14;
+    parallelFor(
+        0,
+        points.size(),
+        kPointsPerTask,
+        [&](const int i) {
+          const WorldColor& point = points[i];
+          char* dst = &data[i * kPointSize];
+          std::memcpy(dst, point.data(), 3 * sizeof(float));
+          dst += 3 * sizeof(float);
+          if (format == Format::PLY) {
+            for (int c = 0; c < 3; ++c) {
+              dst[c] = toByte(point[3 + c]);
+            }
+          } else {
+            const uint32_t rgb =
+                toByte(point[3]) << 16 | toByte(point[4]) << 8 | toByte(point[5]);
+            std::memcpy(dst, &rgb, sizeof(rgb));
+          }
+        },
+        FLAGS_threads);
+    write(std::string(data.begin(), data.end()));
+  }
+
+  uint64_t close() {
+    if (format != Format::TEXT) {
+      CHECK_EQ(fseek(fp, 0, SEEK_SET), 0) << folly::sformat("Cannot seek: {}", path.string());
+      write(getHeader(format, count, headerSize));
+      CHECK_EQ(fclose(fp), 0) << folly::sformat("Cannot write file: {}", path.string());
+      return count;
+    }
+    CHECK_EQ(fclose(fp), 0) << folly::sformat("Cannot write file: {}", filePath.string());
+    {
+      std::ofstream file(path.string(), std::ios::binary);
+      file << getHeader(format, count);
+      std::ifstream points(filePath.string(), std::ios::binary);
+      if (count > 0) {
+        file << points.rdbuf();
+      }
+      CHECK(file) << folly::sformat("Cannot write file: {}", path.string());
+    }
+    filesystem::remove(filePath);
+    return count;
+  }
+
+ private:
+  void write(const std::string& data) {
+    CHECK_EQ(fwrite(data.data(), 1, data.size(), fp), data.size())
+        << folly::sformat("Cannot write file: {}", filePath.string());
+  }
+
+  const filesystem::path path;
+  filesystem::path filePath; // where points are written
+  Format format = Format::TEXT;
+  FILE* fp;
+  size_t headerSize;
+  uint64_t count = 0;
+};
+
 int main(int argc, char** argv) {
   gflags::SetUsageMessage(kUsage);
   system_util::initDep(argc, argv);
@@ -184,28 +348,21 @@ int main(int argc, char** argv) {
 
   verifyInputs(rig);
 
-  std::vector<std::vector<WorldColor>> pointClouds;
-  for (const Camera& cam : rig) {
-    pointClouds.push_back(getPoints(cam));
-  }
-
   const filesystem::path fnOut = filesystem::path(FLAGS_output);
   filesystem::create_directories(fnOut.parent_path());
-  std::ofstream file(fnOut.string());
-  CHECK(file.is_open()) << folly::sformat("Cannot open file for writing: {}", fnOut.string());
 
-  int lines = 0;
-  for (const std::vector<WorldColor>& pointCloud : pointClouds) {
-    lines += pointCloud.size();
-  }
-
-  if (FLAGS_header_count) {
-    file << folly::format("{}\n", lines);
+  PointWriter writer(fnOut);
+  std::unordered_set<uint64_t> occupied;
+  for (const Camera& cam : rig) {
+    std::vector<WorldColor> points = getPoints(cam);
+    if (FLAGS_voxel_size > 0) {
+      removeDuplicates(points, occupied);
+    }
+    LOG(INFO) << folly::format("Writing {} points of camera {}...", points.size(), cam.id);
+    writer.write(points);
   }
 
-  writePoints(file, pointClouds, lines);
-
-  LOG(INFO) << folly::format("{} lines written", lines);
+  LOG(INFO) << folly::format("{} points written", writer.close());
 
   return EXIT_SUCCESS;
 }
@@ -6,12 +6,12 @@
  */
 
 const char* kUsage = R"(
-  - Reads a point cloud as an ASCII file with a single point per line and generates a disparity
-  image per camera.
+  - Reads a point cloud and generates a disparity image per camera.
 
-  Supports multiple point cloud formats, but only extracts the xyz coordinates.
+  Supports .pcd and .ply files, ascii or binary, and ASCII files with a single point per line
+  (x y z intensity r g b). Only the xyz coordinates and colors are extracted.
 
-  The input file can have a single line header with a point count.
+  ASCII files can have a single line header with a point count.
 
   - Example:
     ./ImportPointCloud \
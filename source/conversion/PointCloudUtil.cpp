@@ -7,11 +7,29 @@
 
 #include "source/conversion/PointCloudUtil.h"
 
-#include <regex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <unordered_map>
 
-#include <boost/algorithm/string/predicate.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <folly/Format.h>
+#include <folly/Portability.h>
+
+#include "source/util/FilesystemUtil.h"
+#include "source/util/MathUtil.h"
 #include "source/util/ThreadPool.h"
 
 using Image = cv::Mat_<cv::Vec3b>;
@@ -21,168 +39,839 @@ using CoordinateImage = cv::Mat_<cv::Point3f>;
 namespace fb360_dep {
 namespace point_cloud_util {
 
+PointCloudIndex buildIndex(const PointCloud& pointCloud) {
+  // Size voxels for kPointsPerVoxel points if the bounding box were evenly filled. Scans are
+  // mostly surfaces, so occupied voxels end up with more
+  static const double kPointsPerVoxel = 256;
+  Camera::Vector3 lo = Camera::Vector3::Constant(std::numeric_limits<double>::infinity());
+  Camera::Vector3 hi = -lo;
+  for (const BGRPoint& point : pointCloud) {
+    if (point.coords.allFinite()) {
+      lo = lo.cwiseMin(point.coords);
+      hi = hi.cwiseMax(point.coords);
+    }
+  }
+  PointCloudIndex index;
+  if (!(lo.array() <= hi.array()).all()) {
+    return index; // no finite points
+  }
+  const Camera::Vector3 extent = (hi - lo).cwiseMax(Camera::Vector3::Constant(1e-6));
+  const double voxelCount = std::max(1.0, pointCloud.size() / kPointsPerVoxel);
+  const double side = std::cbrt(extent.prod() / voxelCount);
+  const Eigen::Vector3i dims =
+      (extent / side).array().ceil().max(1).min(1 << 20).cast<int>().matrix();
+
+  const Camera::Vector3 cellsPerUnit = dims.cast<double>().cwiseQuotient(extent);
+  std::unordered_map<int64_t, int> voxelIdxs;
+  for (int i = 0; i < int(pointCloud.size()); ++i) {
+    const Camera::Vector3& coords = pointCloud[i].coords;
+    if (!coords.allFinite()) {
+      continue; // nobody sees these
+    }
+    const Eigen::Vector3i cell =
+        (coords - lo).cwiseProduct(cellsPerUnit).array().floor().cast<int>().min(dims.array() - 1);
+    const int64_t key = (int64_t(cell.z()) * dims.y() + cell.y()) * dims.x() + cell.x();
+    const auto inserted = voxelIdxs.emplace(key, index.voxels.size());
+    if (inserted.second) {
+      index.voxels.emplace_back();
+    }
+    index.voxels[inserted.first->second].points.push_back(i);
+  }
+
+  // Tight spheres around the points rather than around the cells
+  parallelFor(
+      0,
+      index.voxels.size(),
+      64,
+      [&](const int v) {
+        PointCloudIndex::Voxel& voxel = index.voxels[v];
+        Camera::Vector3 voxelLo = pointCloud[voxel.points[0]].coords;
+        Camera::Vector3 voxelHi = voxelLo;
+        for (const int i : voxel.points) {
+          voxelLo = voxelLo.cwiseMin(pointCloud[i].coords);
+          voxelHi = voxelHi.cwiseMax(pointCloud[i].coords);
+        }
+        voxel.center = (voxelLo + voxelHi) / 2;
+        voxel.radius = (voxelHi - voxelLo).norm() / 2 * (1 + 1e-6) + 1e-9; // round up
+      });
+  return index;
+}
+
+// True if no point in voxel can be in camera's fov, conservative version of isOutsideFov()
+bool isOutsideFov(const Camera& camera, const PointCloudIndex::Voxel& voxel) {
+  if (camera.cosFov == -1) {
+    return false;
+  }
+  const Camera::Vector3 v = voxel.center - camera.position;
+  const Camera::Real dot = camera.forward().dot(v);
+  if (camera.cosFov == 0) {
+    return dot + voxel.radius <= 0;
+  }
+  const Camera::Real distance = v.norm();
+  if (distance <= voxel.radius) {
+    return false;
+  }
+  // Angle from the optical axis to the center, minus the angle the sphere subtends
+  const Camera::Real angle = std::acos(math_util::clamp(dot / distance, -1.0, 1.0));
+  return angle - std::asin(voxel.radius / distance) > std::acos(camera.cosFov);
+}
+
+std::vector<int> getVisiblePoints(
+    const PointCloud& pointCloud,
+    const PointCloudIndex& index,
+    const Camera& camera) {
+  std::vector<int> visible;
+  for (const PointCloudIndex::Voxel& voxel : index.voxels) {
+    if (isOutsideFov(camera, voxel)) {
+      continue;
+    }
+    for (const int i : voxel.points) {
+      if (camera.sees(pointCloud[i].coords)) {
+        visible.push_back(i);
+      }
+    }
+  }
+  // Same order as the point cloud, so ties in generateProjectedImages go to the first point
+  std::sort(visible.begin(), visible.end());
+  return visible;
+}
+
+// Depth test key of point p at disparity, the largest key in a pixel wins. Disparities are
+// positive, so their bits sort like them; on ties the lower index, i.e. the first point, wins
+uint64_t packSplat(const float disparity, const int p) {
+  uint32_t bits;
+  std::memcpy(&bits, &disparity, sizeof(bits));
+  return uint64_t(bits) << 32 | ~uint32_t(p);
+}
+
+int unpackSplatIndex(const uint64_t key) {
+  return ~uint32_t(key);
+}
+
+void atomicMax(std::atomic<uint64_t>& dst, const uint64_t value) {
+  uint64_t current = dst.load(std::memory_order_relaxed);
+  while (current < value &&
+         !dst.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+  }
+}
+
 std::vector<PointCloudProjection> generateProjectedImages(
     const PointCloud& pointCloud,
-    const Camera::Rig& rig) {
-  std::vector<PointCloudProjection> projections;
-  for (const auto& camera : rig) {
-    PointCloudProjection projection;
-    projection.image =
-        cv::Mat(camera.resolution[1], camera.resolution[0], CV_8UC3, cv::Scalar(0, 0, 0));
-    projection.disparityImage =
-        cv::Mat(camera.resolution[1], camera.resolution[0], CV_32F, cv::Scalar(0));
-    projection.coordinateImage =
-        cv::Mat(camera.resolution[1], camera.resolution[0], CV_32FC3, cv::Scalar(0, 0, 0));
-    projections.emplace_back(projection);
-  }
-
-  for (const auto& point : pointCloud) {
-    for (int i = 0; i < int(rig.size()); ++i) {
-      if (rig[i].sees(point.coords)) {
-        const Camera::Vector2& projectedCoors = rig[i].pixel(point.coords);
-        PointCloudProjection& projection = projections[i];
-        const float depth = (point.coords - rig[i].position).norm();
-        const float disparity = 1.0f / depth;
-        if (projection.disparityImage(projectedCoors.y(), projectedCoors.x()) < disparity) {
-          projection.disparityImage(projectedCoors.y(), projectedCoors.x()) = disparity;
-          projection.image(projectedCoors.y(), projectedCoors.x()) = point.bgrColor;
-          projection.coordinateImage(projectedCoors.y(), projectedCoors.x()).x = point.coords.x();
-          projection.coordinateImage(projectedCoors.y(), projectedCoors.x()).y = point.coords.y();
-          projection.coordinateImage(projectedCoors.y(), projectedCoors.x()).z = point.coords.z();
-        }
+    const PointCloudIndex& index,
+    const Camera::Rig& rig,
+    const int maxThreads) {
+  CHECK_LE(pointCloud.size(), size_t(std::numeric_limits<int>::max()));
+  std::vector<PointCloudProjection> projections(rig.size());
+  std::vector<std::atomic<uint64_t>> zBuffer;
+
+  // One camera at a time, so the z-buffer is only ever as large as one image. Voxels are the bins
+  // of the splat: their points land in a small patch of the image, so threads splatting different
+  // voxels rarely contend for a pixel
+  for (int i = 0; i < int(rig.size()); ++i) {
+    const Camera& camera = rig[i];
+    const int width = camera.resolution[0];
+    const int height = camera.resolution[1];
+    if (zBuffer.size() < size_t(width) * height) {
+      zBuffer = std::vector<std::atomic<uint64_t>>(size_t(width) * height);
+    }
+
+    std::vector<int> voxels;
+    for (int v = 0; v < int(index.voxels.size()); ++v) {
+      if (!isOutsideFov(camera, index.voxels[v])) {
+        voxels.push_back(v);
       }
     }
+
+    parallelFor(
+        0,
+        height,
+        64,
+        [&](const int y) {
+          for (int x = 0; x < width; ++x) {
+            zBuffer[size_t(y) * width + x].store(0, std::memory_order_relaxed);
+          }
+        },
+        maxThreads);
+
+    // First pass: depth test only, 8 bytes per splat
+    parallelFor(
+        0,
+        voxels.size(),
+        16,
+        [&](const int v) {
+          for (const int p : index.voxels[voxels[v]].points) {
+            const BGRPoint& point = pointCloud[p];
+            Camera::Vector2 pixel;
+            if (!camera.sees(point.coords, pixel)) {
+              continue;
+            }
+            const float disparity = 1.0f / (point.coords - camera.position).norm();
+            const size_t offset = size_t(int(pixel.y())) * width + int(pixel.x());
+            atomicMax(zBuffer[offset], packSplat(disparity, p));
+          }
+        },
+        maxThreads);
+
+    // Second pass: fill in the winners
+    PointCloudProjection& projection = projections[i];
+    projection.image = cv::Mat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
+    projection.disparityImage = cv::Mat(height, width, CV_32F, cv::Scalar(0));
+    projection.coordinateImage = cv::Mat(height, width, CV_32FC3, cv::Scalar(0, 0, 0));
+    parallelFor(
+        0,
+        height,
+        64,
+        [&](const int y) {
+          for (int x = 0; x < width; ++x) {
+            const uint64_t key = zBuffer[size_t(y) * width + x].load(std::memory_order_relaxed);
+            if (key == 0) {
+              continue;
+            }
+            const BGRPoint& point = pointCloud[unpackSplatIndex(key)];
+            const uint32_t bits = key >> 32;
+            std::memcpy(&projection.disparityImage(y, x), &bits, sizeof(bits));
+            projection.image(y, x) = point.bgrColor;
+            projection.coordinateImage(y, x) =
+                cv::Point3f(point.coords.x(), point.coords.y(), point.coords.z());
+          }
+        },
+        maxThreads);
   }
   return projections;
 }
 
-void goToLine(std::ifstream& file, const int lineNumber) {
-  file.seekg(0, std::ios::beg);
-  for (int i = 1; i < lineNumber; ++i) {
-    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-  }
-}
-
-// PCL header entries must be specified in the following order
-// Comment
-// VERSION
-// FIELDS
-// SIZE
-// TYPE
-// COUNT
-// WIDTH
-// HEIGHT
-// VIEWPOINT
-// POINTS
-// DATA
-void verifyPCLHeader(std::ifstream& file) {
-  std::string line;
-
-  // Make sure FIELDS starts with x y z
-  const int lineFields = 3;
-  goToLine(file, lineFields);
-  std::getline(file, line);
-  CHECK(boost::starts_with(line, "FIELDS x y z")) << "PCL header: FIELDS must start with x y z";
-
-  // Make DATA is ascii
-  const int lineData = 11;
-  goToLine(file, lineData);
-  std::getline(file, line);
-  CHECK_EQ(line, "DATA ascii") << "PCL header: DATA must be ascii";
-}
-
-int extractPCLPointCount(std::ifstream& file) {
-  goToLine(file, 0);
-
-  std::string line;
-  const int linePoints = 10;
-  goToLine(file, linePoints);
-  std::getline(file, line);
-  CHECK(boost::starts_with(line, "POINTS"))
-      << folly::sformat("PCL header: expected point count in line {}, got {}", linePoints, line);
-
-  std::regex rgx("POINTS (\\w+)");
-  std::smatch match;
-  const std::string lineConst = line;
-  CHECK(std::regex_search(lineConst.begin(), lineConst.end(), match, rgx))
-      << "Could not parse point count from line " << line;
-  const std::string pointCountStr = match[1];
-  try {
-    return boost::lexical_cast<int>(pointCountStr);
-  } catch (boost::bad_lexical_cast&) {
-    CHECK(false) << folly::sformat("PCL header: invalid point count {}", pointCountStr);
+std::vector<PointCloudProjection> generateProjectedImages(
+    const PointCloud& pointCloud,
+    const Camera::Rig& rig,
+    const int maxThreads) {
+  return generateProjectedImages(pointCloud, buildIndex(pointCloud), rig, maxThreads);
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& filename) {
+    fd = open(filename.c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "File does not exist: " << filename;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0) << "Could not stat " << filename;
+    size = st.st_size;
+    if (size > 0) {
+      void* const p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      CHECK_NE(p, MAP_FAILED) << "Could not map " << filename;
+      madvise(p, size, MADV_WILLNEED);
+      data = static_cast<const char*>(p);
+    }
+  }
+
+  ~MappedFile() {
+    if (data) {
+      munmap(const_cast<char*>(data), size);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* begin() const {
+    return data;
+  }
+
+  const char* end() const {
+    return data + size;
+  }
+
+ private:
+  int fd = -1;
+  size_t size = 0;
+  const char* data = nullptr;
+};
+
+enum class DataFormat { ASCII, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN };
+
+enum class FieldType { INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64 };
+
+int getFieldSize(const FieldType type) {
+  switch (type) {
+    case FieldType::INT8:
+    case FieldType::UINT8:
+      return 1;
+    case FieldType::INT16:
+    case FieldType::UINT16:
+      return 2;
+    case FieldType::INT32:
+    case FieldType::UINT32:
+    case FieldType::FLOAT32:
+      return 4;
+    case FieldType::FLOAT64:
+      return 8;
+  }
+  return 0;
+}
+
+// Where a field is in a point: byte offset in binary records, column in ascii lines
+struct Field {
+  int position = -1; // -1 = not in the file
+  FieldType type = FieldType::FLOAT32;
+
+  bool isPresent() const {
+    return position >= 0;
+  }
+};
+
+// What the header says about the points that follow it
+struct PointLayout {
+  DataFormat format = DataFormat::ASCII;
+  int64_t pointCount = -1; // -1 = not in the header, one point per non-blank line
+  size_t dataOffset = 0; // bytes from the start of the file to the first point
+  int recordSize = 0; // bytes per binary point
+  Field x, y, z;
+  Field r, g, b; // separate color channels...
+  Field rgb; // ...or packed as 0x00RRGGBB in 4 bytes (PCD)
+
+  bool hasChannels() const {
+    return r.isPresent() && g.isPresent() && b.isPresent();
   }
+};
+
+// Returns the line starting at p, without the line break, and moves p to the next line
+std::string nextLine(const char*& p, const char* end) {
+  const char* const newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+  const char* const lineEnd = newline ? newline : end;
+  std::string line(p, lineEnd);
+  if (!line.empty() && line.back() == '\r') {
+    line.pop_back();
+  }
+  p = newline ? newline + 1 : end;
+  return line;
 }
 
-int extractASCIIPointCount(std::ifstream& file) {
-  goToLine(file, 0);
+std::vector<std::string> splitWords(const std::string& line) {
+  std::vector<std::string> words;
+  std::istringstream stream(line);
+  std::string word;
+  while (stream >> word) {
+    words.push_back(word);
+  }
+  return words;
+}
 
-  std::string line;
-  file >> line;
+int64_t parseCount(const std::string& word, const std::string& what) {
   try {
-    return boost::lexical_cast<int>(line);
+    return boost::lexical_cast<int64_t>(word);
   } catch (boost::bad_lexical_cast&) {
-    CHECK(false) << "First line should contain point count: " << line;
+    LOG(FATAL) << folly::sformat("{}: invalid count {}", what, word);
   }
+  return 0;
 }
 
-int getPointCount(const std::string& pointCloudFile) {
-  // Check if first line is point counter
-  std::ifstream srcFile(pointCloudFile);
-  CHECK(srcFile.good()) << "File does not exist: " << pointCloudFile;
+// Points an xyz, rgb field name to its slot in layout, nullptr for fields we ignore
+Field* getField(PointLayout& layout, const std::string& name) {
+  if (name == "x") {
+    return &layout.x;
+  } else if (name == "y") {
+    return &layout.y;
+  } else if (name == "z") {
+    return &layout.z;
+  } else if (name == "r" || name == "red") {
+    return &layout.r;
+  } else if (name == "g" || name == "green") {
+    return &layout.g;
+  } else if (name == "b" || name == "blue") {
+    return &layout.b;
+  } else if (name == "rgb" || name == "rgba") {
+    return &layout.rgb;
+  }
+  return nullptr;
+}
+
+// PCD header (http://pointclouds.org/documentation/tutorials/pcd_file_format.php), entries are
+// VERSION, FIELDS, SIZE, TYPE, COUNT, WIDTH, HEIGHT, VIEWPOINT, POINTS and DATA, in order
+PointLayout parsePcdHeader(const char* begin, const char* end) {
+  PointLayout layout;
+  std::vector<std::string> names;
+  std::vector<std::string> sizes;
+  std::vector<std::string> types;
+  std::vector<std::string> counts;
+  const char* p = begin;
+  while (true) {
+    CHECK(p < end) << "PCD header: no DATA entry";
+    const std::vector<std::string> words = splitWords(nextLine(p, end));
+    if (words.empty() || words[0][0] == '#') {
+      continue;
+    }
+    const std::vector<std::string> values(words.begin() + 1, words.end());
+    if (words[0] == "FIELDS") {
+      names = values;
+    } else if (words[0] == "SIZE") {
+      sizes = values;
+    } else if (words[0] == "TYPE") {
+      types = values;
+    } else if (words[0] == "COUNT") {
+      counts = values;
+    } else if (words[0] == "POINTS") {
+      CHECK_EQ(values.size(), 1) << "PCD header: invalid POINTS";
+      layout.pointCount = parseCount(values[0], "PCD header POINTS");
+    } else if (words[0] == "DATA") {
+      CHECK_EQ(values.size(), 1) << "PCD header: invalid DATA";
+      CHECK_NE(values[0], "binary_compressed") << "PCD header: binary_compressed is not supported";
+      CHECK(values[0] == "ascii" || values[0] == "binary")
+          << "PCD header: unknown DATA " << values[0];
+      layout.format = values[0] == "ascii" ? DataFormat::ASCII : DataFormat::BINARY_LITTLE_ENDIAN;
+      break;
+    }
+  }
+  layout.dataOffset = p - begin;
+  CHECK_GE(layout.pointCount, 0) << "PCD header: no POINTS entry";
+  CHECK_EQ(sizes.size(), names.size()) << "PCD header: SIZE does not match FIELDS";
+  CHECK_EQ(types.size(), names.size()) << "PCD header: TYPE does not match FIELDS";
+  CHECK(counts.empty() || counts.size() == names.size())
+      << "PCD header: COUNT does not match FIELDS";
 
+  int offset = 0;
+  int column = 0;
+  for (int i = 0; i < int(names.size()); ++i) {
+    const int size = parseCount(sizes[i], "PCD header SIZE");
+    const int count = counts.empty() ? 1 : parseCount(counts[i], "PCD header COUNT");
+    const std::string typeSize = types[i] + sizes[i];
+    static const std::map<std::string, FieldType> kTypes = {
+        {"I1", FieldType::INT8},
+        {"U1", FieldType::UINT8},
+        {"I2", FieldType::INT16},
+        {"U2", FieldType::UINT16},
+        {"I4", FieldType::INT32},
+        {"U4", FieldType::UINT32},
+        {"F4", FieldType::FLOAT32},
+        {"F8", FieldType::FLOAT64},
+    };
+    const auto type = kTypes.find(typeSize);
+    CHECK(type != kTypes.end()) << "PCD header: unsupported field type " << typeSize;
+    if (Field* const field = getField(layout, names[i])) {
+      field->position = layout.format == DataFormat::ASCII ? column : offset;
+      field->type = type->second;
+    }
+    offset += size * count;
+    column += count;
+  }
+  layout.recordSize = offset;
+
+  // Legacy files: x y z intensity r g b, with any field names
+  const bool hasColor = layout.rgb.isPresent() || layout.hasChannels();
+  if (!hasColor && layout.format == DataFormat::ASCII && column >= 7) {
+    layout.r.position = 4;
+    layout.g.position = 5;
+    layout.b.position = 6;
+    layout.r.type = layout.g.type = layout.b.type = FieldType::UINT8;
+  }
+  return layout;
+}
+
+// PLY header (http://paulbourke.net/dataformats/ply/), points are the vertex element, which must
+// come first
+PointLayout parsePlyHeader(const char* begin, const char* end) {
+  static const std::map<std::string, FieldType> kTypes = {
+      {"char", FieldType::INT8},      {"int8", FieldType::INT8},
+      {"uchar", FieldType::UINT8},    {"uint8", FieldType::UINT8},
+      {"short", FieldType::INT16},    {"int16", FieldType::INT16},
+      {"ushort", FieldType::UINT16},  {"uint16", FieldType::UINT16},
+      {"int", FieldType::INT32},      {"int32", FieldType::INT32},
+      {"uint", FieldType::UINT32},    {"uint32", FieldType::UINT32},
+      {"float", FieldType::FLOAT32},  {"float32", FieldType::FLOAT32},
+      {"double", FieldType::FLOAT64}, {"float64", FieldType::FLOAT64},
+  };
+
+  PointLayout layout;
+  const char* p = begin;
+  CHECK_EQ(nextLine(p, end), "ply") << "PLY header: missing magic number";
+  bool isVertex = false;
+  bool sawElement = false;
+  int offset = 0;
+  int column = 0;
+  while (true) {
+    CHECK(p < end) << "PLY header: no end_header";
+    const std::vector<std::string> words = splitWords(nextLine(p, end));
+    if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+      continue;
+    }
+    if (words[0] == "end_header") {
+      break;
+    } else if (words[0] == "format") {
+      CHECK_GE(words.size(), 2) << "PLY header: invalid format";
+      if (words[1] == "ascii") {
+        layout.format = DataFormat::ASCII;
+      } else if (words[1] == "binary_little_endian") {
+        layout.format = DataFormat::BINARY_LITTLE_ENDIAN;
+      } else {
+        CHECK_EQ(words[1], "binary_big_endian") << "PLY header: unknown format";
+        layout.format = DataFormat::BINARY_BIG_ENDIAN;
+      }
+    } else if (words[0] == "element") {
+      CHECK_EQ(words.size(), 3) << "PLY header: invalid element";
+      isVertex = words[1] == "vertex";
+      CHECK(!isVertex || !sawElement) << "PLY header: vertex must be the first element";
+      if (isVertex) {
+        layout.pointCount = parseCount(words[2], "PLY header vertex");
+      }
+      sawElement = true;
+    } else if (words[0] == "property" && isVertex) {
+      CHECK_EQ(words.size(), 3) << "PLY header: list properties are not supported in vertex";
+      const auto type = kTypes.find(words[1]);
+      CHECK(type != kTypes.end()) << "PLY header: unsupported property type " << words[1];
+      if (Field* const field = getField(layout, words[2])) {
+        field->position = layout.format == DataFormat::ASCII ? column : offset;
+        field->type = type->second;
+      }
+      offset += getFieldSize(type->second);
+      ++column;
+    }
+  }
+  CHECK_GE(layout.pointCount, 0) << "PLY header: no vertex element";
+  layout.dataOffset = p - begin;
+  layout.recordSize = offset;
+  return layout;
+}
+
+// One point per line: x y z intensity r g b, optionally after a line with the point count
+PointLayout parseAsciiHeader(const char* begin, const char* end) {
+  PointLayout layout;
+  layout.x.position = 0;
+  layout.y.position = 1;
+  layout.z.position = 2;
+  layout.r.position = 4;
+  layout.g.position = 5;
+  layout.b.position = 6;
+  layout.r.type = layout.g.type = layout.b.type = FieldType::UINT8;
+
+  const char* p = begin;
+  const std::vector<std::string> words = splitWords(nextLine(p, end));
+  if (words.size() == 1) {
+    layout.pointCount = parseCount(words[0], "Point count line");
+    layout.dataOffset = p - begin;
+  }
+  return layout;
+}
+
+PointLayout parseHeader(const MappedFile& file, const std::string& pointCloudFile) {
   const std::string pcExt = filesystem::path(pointCloudFile).extension().string();
   if (pcExt == ".pcd") {
-    verifyPCLHeader(srcFile);
-    return extractPCLPointCount(srcFile);
+    return parsePcdHeader(file.begin(), file.end());
+  } else if (pcExt == ".ply") {
+    return parsePlyHeader(file.begin(), file.end());
   } else {
-    return extractASCIIPointCount(srcFile);
+    return parseAsciiHeader(file.begin(), file.end());
   }
 }
 
-PointCloud
-extractPoints(const std::string& pointCloudFile, const int pointCount, const int maxThreads) {
-  LOG(INFO) << folly::sformat("Extracting {} points from {}...", pointCount, pointCloudFile);
+// Parses a decimal number (e.g. -1.5e-3, nan, inf) at p and moves p past it
+// Much faster than streams or strtod, and exact for up to 15 significant digits with small
+// exponents, which covers point cloud coordinates
+double parseNumber(const char*& p, const char* end) {
+  const char* const start = p;
+  const bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    ++p;
+  }
+  if (p < end && (*p == 'n' || *p == 'N' || *p == 'i' || *p == 'I')) {
+    const bool isNan = *p == 'n' || *p == 'N';
+    while (p < end && std::isalpha(*p)) {
+      ++p;
+    }
+    const double special = isNan ? std::numeric_limits<double>::quiet_NaN()
+                                 : std::numeric_limits<double>::infinity();
+    return negative ? -special : special;
+  }
+
+  static const int kMaxDigits = 19; // fit in uint64_t
+  uint64_t mantissa = 0;
+  int digits = 0; // significant digits in mantissa
+  int exponent = 0;
+  bool sawDigit = false;
+  for (; p < end && std::isdigit(*p); ++p) {
+    sawDigit = true;
+    if (digits < kMaxDigits) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += mantissa != 0;
+    } else {
+      ++exponent;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && std::isdigit(*p); ++p) {
+      sawDigit = true;
+      if (digits < kMaxDigits) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+        --exponent;
+      }
+    }
+  }
+  CHECK(sawDigit) << "Invalid number: " << std::string(start, std::min(p + 16, end));
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    const bool negativeExponent = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+      ++p;
+    }
+    int e = 0;
+    for (; p < end && std::isdigit(*p); ++p) {
+      e = std::min(e * 10 + (*p - '0'), 100000);
+    }
+    exponent += negativeExponent ? -e : e;
+  }
 
-  ThreadPool threadPool(maxThreads);
-  const int threads = threadPool.getMaxThreads();
+  // Powers of ten that are exact in a double
+  static const double kPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  double value = mantissa;
+  if (0 <= exponent && exponent <= 22) {
+    value *= kPowers[exponent];
+  } else if (-22 <= exponent && exponent < 0) {
+    value /= kPowers[-exponent];
+  } else {
+    value *= std::pow(10.0, exponent);
+  }
+  return negative ? -value : value;
+}
 
-  // Evenly distribute lines across threads
-  const int pointsPerThread = float(pointCount) / threads;
-  const int remain = pointCount % threads;
+uint8_t toColor(const double value, const FieldType type) {
+  // Floating point colors are in [0, 1]
+  const bool isFloat = type == FieldType::FLOAT32 || type == FieldType::FLOAT64;
+  return math_util::clamp(std::round(isFloat ? value * 255 : value), 0.0, 255.0);
+}
 
-  const std::string pcExt = filesystem::path(pointCloudFile).extension().string();
-  const int headerNumLines = pcExt == ".pcd" ? 11 : 1;
-
-  PointCloud points(pointCount);
-  for (int i = 0; i < threads; ++i) {
-    threadPool.spawn([&, i] {
-      const int begin = headerNumLines + 1 + // skip header
-          (i < remain ? i * (pointsPerThread + 1) : pointCount - (threads - i) * pointsPerThread);
-      const int end = begin + pointsPerThread + (i < remain);
-
-      // Lines may not have the same length in characters, we have to loop our way to the start
-      // line
-      std::ifstream file(pointCloudFile);
-      goToLine(file, begin);
-
-      for (int j = begin; j < end; ++j) {
-        // Read XYZ coordinates and discard the rest of the line
-        BGRPoint& point = points[j];
-        int ignored, r, g, b;
-        file >> point.coords.x() >> point.coords.y() >> point.coords.z() >> ignored >> r >> g >> b;
-        point.bgrColor[0] = b;
-        point.bgrColor[1] = g;
-        point.bgrColor[2] = r;
-        file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-      }
-    });
+void unpackColor(BGRPoint& point, const uint32_t rgb) {
+  point.bgrColor[0] = rgb & 0xff;
+  point.bgrColor[1] = (rgb >> 8) & 0xff;
+  point.bgrColor[2] = (rgb >> 16) & 0xff;
+}
+
+// Calls fn(lineBegin, lineEnd) for every non-blank line in [begin, end)
+template <typename Fn>
+void forEachLine(const char* begin, const char* end, Fn&& fn) {
+  for (const char* p = begin; p < end;) {
+    const char* const newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    const char* const lineEnd = newline ? newline : end;
+    const char* q = p;
+    while (q < lineEnd && std::isspace(*q)) {
+      ++q;
+    }
+    if (q < lineEnd) {
+      fn(p, lineEnd);
+    }
+    p = lineEnd + 1;
   }
-  threadPool.join();
+}
+
+void parseAsciiPoint(BGRPoint& point, const PointLayout& layout, const char* p, const char* end) {
+  static const int kMaxColumns = 64;
+  const int columns = 1 +
+      std::max({layout.x.position,
+                layout.y.position,
+                layout.z.position,
+                layout.r.position,
+                layout.g.position,
+                layout.b.position,
+                layout.rgb.position});
+  CHECK_LE(columns, kMaxColumns) << "Too many columns before the point fields";
+  double values[kMaxColumns] = {};
+  int column = 0;
+  for (; column < columns; ++column) {
+    while (p < end && std::isspace(*p)) {
+      ++p;
+    }
+    if (p == end) {
+      break; // e.g. no color
+    }
+    values[column] = parseNumber(p, end);
+  }
+  CHECK_GT(column, layout.z.position) << "Missing coordinates in line";
+  point.coords = Camera::Vector3(
+      values[layout.x.position], values[layout.y.position], values[layout.z.position]);
+  if (layout.rgb.isPresent() && layout.rgb.position < column) {
+    // Packed colors are written as the float or integer with the same bits
+    const double packed = values[layout.rgb.position];
+    uint32_t rgb = packed;
+    if (layout.rgb.type == FieldType::FLOAT32) {
+      const float f = packed;
+      std::memcpy(&rgb, &f, sizeof(rgb));
+    }
+    unpackColor(point, rgb);
+  } else if (
+      layout.hasChannels() &&
+      std::max({layout.r.position, layout.g.position, layout.b.position}) < column) {
+    point.bgrColor[0] = toColor(values[layout.b.position], layout.b.type);
+    point.bgrColor[1] = toColor(values[layout.g.position], layout.g.type);
+    point.bgrColor[2] = toColor(values[layout.r.position], layout.r.type);
+  }
+}
+
+template <typename T>
+T readBinary(const char* p, const bool swap) {
+  T value;
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, p, sizeof(T));
+  if (swap) {
+    std::reverse(bytes, bytes + sizeof(T));
+  }
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+double readBinaryField(const char* record, const Field& field, const bool swap) {
+  const char* const p = record + field.position;
+  switch (field.type) {
+    case FieldType::INT8:
+      return readBinary<int8_t>(p, swap);
+    case FieldType::UINT8:
+      return readBinary<uint8_t>(p, swap);
+    case FieldType::INT16:
+      return readBinary<int16_t>(p, swap);
+    case FieldType::UINT16:
+      return readBinary<uint16_t>(p, swap);
+    case FieldType::INT32:
+      return readBinary<int32_t>(p, swap);
+    case FieldType::UINT32:
+      return readBinary<uint32_t>(p, swap);
+    case FieldType::FLOAT32:
+      return readBinary<float>(p, swap);
+    case FieldType::FLOAT64:
+      return readBinary<double>(p, swap);
+  }
+  return 0;
+}
+
+void parseBinaryPoint(BGRPoint& point, const PointLayout& layout, const char* record) {
+  const bool swap = (layout.format == DataFormat::BINARY_BIG_ENDIAN) == folly::kIsLittleEndian;
+  point.coords = Camera::Vector3(
+      readBinaryField(record, layout.x, swap),
+      readBinaryField(record, layout.y, swap),
+      readBinaryField(record, layout.z, swap));
+  if (layout.rgb.isPresent()) {
+    unpackColor(point, readBinary<uint32_t>(record + layout.rgb.position, swap));
+  } else if (layout.hasChannels()) {
+    point.bgrColor[0] = toColor(readBinaryField(record, layout.b, swap), layout.b.type);
+    point.bgrColor[1] = toColor(readBinaryField(record, layout.g, swap), layout.g.type);
+    point.bgrColor[2] = toColor(readBinaryField(record, layout.r, swap), layout.r.type);
+  }
+}
+
+// Splits [begin, end) in chunks that start at line boundaries
+std::vector<const char*> getLineChunks(const char* begin, const char* end, const int count) {
+  std::vector<const char*> bounds(count + 1);
+  for (int i = 0; i <= count; ++i) {
+    const char* p = begin + (end - begin) * i / count;
+    if (0 < i && i < count) {
+      const char* const newline = static_cast<const char*>(std::memchr(p - 1, '\n', end - p + 1));
+      p = newline ? newline + 1 : end;
+    }
+    bounds[i] = p;
+  }
+  return bounds;
+}
+
+PointCloud parseAsciiPoints(
+    const char* begin,
+    const char* end,
+    const PointLayout& layout,
+    const int maxThreads) {
+  // Count the lines of every chunk in parallel, so chunks know where their points go
+  static const int64_t kMinChunkBytes = 1 << 20;
+  const int threads = std::max(1, ThreadPool::getThreadCountFromFlag(maxThreads));
+  const int chunkCount =
+      std::max<int64_t>(1, std::min<int64_t>(4 * threads, (end - begin) / kMinChunkBytes));
+  const std::vector<const char*> bounds = getLineChunks(begin, end, chunkCount);
+  std::vector<int64_t> firstPoints(chunkCount + 1, 0);
+  parallelFor(
+      0,
+      chunkCount,
+      1,
+      [&](const int chunk) {
+        forEachLine(bounds[chunk], bounds[chunk + 1], [&](const char*, const char*) {
+          ++firstPoints[chunk + 1];
+        });
+      },
+      maxThreads);
+  for (int chunk = 0; chunk < chunkCount; ++chunk) {
+    firstPoints[chunk + 1] += firstPoints[chunk];
+  }
+  if (layout.pointCount >= 0) {
+    CHECK_EQ(layout.pointCount, firstPoints.back()) << folly::sformat(
+        "Point count in header ({}) does not match number of points ({})",
+        layout.pointCount,
+        firstPoints.back());
+  }
+
+  PointCloud points(firstPoints.back());
+  parallelFor(
+      0,
+      chunkCount,
+      1,
+      [&](const int chunk) {
+        int64_t i = firstPoints[chunk];
+        forEachLine(bounds[chunk], bounds[chunk + 1], [&](const char* line, const char* lineEnd) {
+          parseAsciiPoint(points[i++], layout, line, lineEnd);
+        });
+      },
+      maxThreads);
+  return points;
+}
+
+PointCloud parseBinaryPoints(
+    const char* begin,
+    const char* end,
+    const PointLayout& layout,
+    const int maxThreads) {
+  CHECK_GE(end - begin, layout.pointCount * layout.recordSize) << folly::sformat(
+      "File too short for {} points of {} bytes", layout.pointCount, layout.recordSize);
+  static const int kPointsPerTask = 1 << 16;
+  PointCloud points(layout.pointCount);
+  const int taskCount = (layout.pointCount + kPointsPerTask - 1) / kPointsPerTask;
+  parallelFor(
+      0,
+      taskCount,
+      1,
+      [&](const int task) {
+        const int64_t first = int64_t(task) * kPointsPerTask;
+        const int64_t last = std::min<int64_t>(first + kPointsPerTask, layout.pointCount);
+        for (int64_t i = first; i < last; ++i) {
+          parseBinaryPoint(points[i], layout, begin + i * layout.recordSize);
+        }
+      },
+      maxThreads);
+  return points;
+}
+
+int getPointCount(const std::string& pointCloudFile) {
+  const MappedFile file(pointCloudFile);
+  const PointLayout layout = parseHeader(file, pointCloudFile);
+  if (layout.pointCount >= 0) {
+    return layout.pointCount;
+  }
+  int64_t count = 0;
+  forEachLine(file.begin() + layout.dataOffset, file.end(), [&](const char*, const char*) {
+    ++count;
+  });
+  return count;
+}
+
+PointCloud
+extractPoints(const std::string& pointCloudFile, const int pointCount, const int maxThreads) {
+  LOG(INFO) << folly::sformat("Extracting {} points from {}...", pointCount, pointCloudFile);
+
+  const MappedFile file(pointCloudFile);
+  const PointLayout layout = parseHeader(file, pointCloudFile);
+  CHECK(layout.x.isPresent() && layout.y.isPresent() && layout.z.isPresent())
+      << "Point cloud must have x, y and z fields";
+  const char* const data = file.begin() + layout.dataOffset;
+  const PointCloud points = layout.format == DataFormat::ASCII
+      ? parseAsciiPoints(data, file.end(), layout, maxThreads)
+      : parseBinaryPoints(data, file.end(), layout, maxThreads);
 
   LOG(INFO) << folly::sformat("Extracted {} points.", points.size());
   if (pointCount > 0) {
-    CHECK_EQ(pointCount, points.size()) << folly::sformat(
+    CHECK_EQ(pointCount, int(points.size())) << folly::sformat(
         "Point count in header ({}) does not match number of extracted points ({})",
         pointCount,
         points.size());
@@ -27,9 +27,33 @@ struct PointCloudProjection {
   cv::Mat_<cv::Point3f> coordinateImage;
 };
 
+// Points bucketed by voxel, so cameras can skip whole voxels outside their fov
+struct PointCloudIndex {
+  struct Voxel {
+    Camera::Vector3 center; // bounding sphere of the points in the voxel
+    Camera::Real radius;
+    std::vector<int> points; // indexes in the point cloud, ascending
+  };
+  std::vector<Voxel> voxels;
+};
+
+PointCloudIndex buildIndex(const PointCloud& pointCloud);
+
+// Indexes of the points camera sees, ascending
+std::vector<int> getVisiblePoints(
+    const PointCloud& pointCloud,
+    const PointCloudIndex& index,
+    const Camera& camera);
+
+std::vector<PointCloudProjection> generateProjectedImages(
+    const PointCloud& pointCloud,
+    const PointCloudIndex& index,
+    const Camera::Rig& rig,
+    const int maxThreads = -1);
 std::vector<PointCloudProjection> generateProjectedImages(
     const PointCloud& pointCloud,
-    const Camera::Rig& rig);
+    const Camera::Rig& rig,
+    const int maxThreads = -1);
 int getPointCount(const std::string& pointCloudFile);
 PointCloud
 extractPoints(const std::string& pointCloudFile, const int pointCount, const int maxThreads);
@@ -20,12 +20,11 @@ const char* kUsage = R"(
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
-#include "source/gpu/GlUtil.h"
-#include "source/gpu/GlfwUtil.h"
-#include "source/render/CanopyScene.h"
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/RemapUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::image_util;
@@ -38,7 +37,9 @@ DEFINE_string(file_type, "png", "Supports any image type allowed in OpenCV");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_string(output, "", "output directory (required)");
+DEFINE_string(remap_cache_dir, "", "directory to cache remap tables in (empty = no cache)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 
 void verifyInputs(const Camera::Rig& rig) {
   CHECK_NE(FLAGS_color, "");
@@ -66,59 +67,78 @@ void save(const filesystem::path& path, const cv::Mat_<cv::Vec4f>& result) {
   cv_util::imwriteExceptionOnFail(path, out);
 }
 
-class GlOffscreenWindow : GlWindow {
-  const Camera::Rig& rig;
-
- public:
-  GlOffscreenWindow(const Camera::Rig& rig) : rig(rig) {}
-
-  void display() override {
-    // Generate disparities with constant depth
-    std::vector<cv::Mat_<float>> disparities;
-    for (const Camera& cam : rig) {
-      disparities.emplace_back(cam.resolution.y(), cam.resolution.x(), 1.0f / FLAGS_depth);
-    }
-
-    const int first = std::stoi(FLAGS_first);
-    const int last = std::stoi(FLAGS_last);
-    for (int iFrame = first; iFrame <= last; ++iFrame) {
-      const std::string frameName = image_util::intToStringZeroPad(iFrame, 6);
-      LOG(INFO) << folly::sformat("Frame {}: Loading colors...", frameName);
-      const std::vector<cv::Mat_<cv::Vec4f>> colors =
-          loadImages<cv::Vec4f>(FLAGS_color, rig, frameName);
-      CHECK_EQ(ssize(colors), ssize(rig));
-
-      for (ssize_t i = 0; i < ssize(rig); ++i) {
-        LOG(INFO) << folly::sformat("-- Frame {}: Projecting {}...", frameName, rig[i].id);
-
-        // Create scene with just this camera
-        const CanopyScene sceneColor({rig[i]}, {disparities[i]}, {colors[i]});
-        const Eigen::Vector3f& pos = {0, 0, 0};
-        const float ipd = 0.0f;
-        const bool alphaBlend = false;
-        const int height = FLAGS_eqr_width / 2.0f;
-        const cv::Mat_<cv::Vec4f> eqr = sceneColor.equirect(height, pos, ipd, alphaBlend);
-        const filesystem::path filename =
-            filesystem::path(FLAGS_output) / rig[i].id / (frameName + "." + FLAGS_file_type);
-        save(filename, eqr);
-      }
-    }
-  }
-};
+// For each equirect pixel, where the camera sees the point at FLAGS_depth in that direction
+// Same equirect convention as image_util::worldToEquirect, seen from the rig origin
+remap_util::RemapTable getEquirectToCameraTable(const Camera& cam, const cv::Size& eqrSize) {
+  const std::string key = remap_util::getKey(
+      folly::sformat("eqr_to_cam {}x{} {}", eqrSize.width, eqrSize.height, FLAGS_depth),
+      cam,
+      cv::Size(cam.resolution.x(), cam.resolution.y()));
+  return remap_util::getOrCompute(FLAGS_remap_cache_dir, key, [&] {
+    LOG(INFO) << folly::sformat("Computing remap table for {}...", cam.id);
+    cv::Mat_<cv::Vec2f> map(eqrSize);
+    parallelFor(
+        0,
+        map.rows,
+        1,
+        [&](const int y) {
+          const double phi = M_PI * (y + 0.5) / eqrSize.height;
+          for (int x = 0; x < map.cols; ++x) {
+            const double theta = -2 * M_PI * (x + 0.5) / eqrSize.width;
+            const Camera::Vector3 world = FLAGS_depth *
+                Camera::Vector3(sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi));
+            Camera::Vector2 pixel;
+            if (cam.sees(world, pixel)) {
+              // cv::remap has pixel centers at integer coordinates
+              map(y, x) = cv::Vec2f(pixel.x() - 0.5, pixel.y() - 0.5);
+            } else {
+              map(y, x) = cv::Vec2f(NAN, NAN);
+            }
+          }
+        },
+        FLAGS_threads);
+    const bool kIsNearest = false;
+    return remap_util::makeTable(map, kIsNearest);
+  });
+}
 
 int main(int argc, char** argv) {
   gflags::SetUsageMessage(kUsage);
   system_util::initDep(argc, argv);
 
   CHECK_NE(FLAGS_rig, "");
-  const Camera::Rig rig = filterDestinations(Camera::loadRig(FLAGS_rig), FLAGS_cameras);
+  Camera::Rig rig = filterDestinations(Camera::loadRig(FLAGS_rig), FLAGS_cameras);
 
   verifyInputs(rig);
 
-  // Setup offscreen rendering
-  GlOffscreenWindow context(rig);
-
-  context.display();
+  // Tables are computed on the first frame, for cameras scaled to the size of the color images
+  const cv::Size eqrSize(FLAGS_eqr_width, FLAGS_eqr_width / 2);
+  std::vector<remap_util::RemapTable> tables(rig.size());
+  const int first = std::stoi(FLAGS_first);
+  const int last = std::stoi(FLAGS_last);
+  for (int iFrame = first; iFrame <= last; ++iFrame) {
+    const std::string frameName = image_util::intToStringZeroPad(iFrame, 6);
+    LOG(INFO) << folly::sformat("Frame {}: Loading colors...", frameName);
+    const std::vector<cv::Mat_<cv::Vec4f>> colors =
+        loadImages<cv::Vec4f>(FLAGS_color, rig, frameName, FLAGS_threads);
+    CHECK_EQ(ssize(colors), ssize(rig));
+
+    for (ssize_t i = 0; i < ssize(rig); ++i) {
+      LOG(INFO) << folly::sformat("-- Frame {}: Projecting {}...", frameName, rig[i].id);
+      if (tables[i].map1.empty()) {
+        rig[i] = rig[i].rescale({colors[i].cols, colors[i].rows});
+        tables[i] = getEquirectToCameraTable(rig[i], eqrSize);
+      }
+      CHECK_EQ(colors[i].cols, rig[i].resolution.x()) << "color images must have the same size";
+      CHECK_EQ(colors[i].rows, rig[i].resolution.y()) << "color images must have the same size";
+
+      // Transparent where the camera doesn't see
+      const cv::Mat_<cv::Vec4f> eqr = remap_util::remap(colors[i], tables[i]);
+      const filesystem::path filename =
+          filesystem::path(FLAGS_output) / rig[i].id / (frameName + "." + FLAGS_file_type);
+      save(filename, eqr);
+    }
+  }
 
   return EXIT_SUCCESS;
 }
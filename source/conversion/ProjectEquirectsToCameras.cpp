@@ -22,6 +22,7 @@ const char* kUsage = R"(
 
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/RemapUtil.h"
 #include "source/util/SystemUtil.h"
 #include "source/util/ThreadPool.h"
 
@@ -35,6 +36,7 @@ DEFINE_string(file_type, "png", "Supports any image type allowed in OpenCV");
 DEFINE_string(first, "000000", "first frame to process (lexical) (required)");
 DEFINE_string(last, "000000", "last frame to process (lexical) (required)");
 DEFINE_string(output, "", "output directory (required)");
+DEFINE_string(remap_cache_dir, "", "directory to cache remap tables in (empty = no cache)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_int32(width, 0, "width of projected camera images (0 = size from rig file)");
@@ -67,6 +69,38 @@ void rescaleCameras(Camera::Rig& rig) {
   }
 }
 
+// For each pixel in the camera, the equirect pixel we land in at FLAGS_depth
+remap_util::RemapTable getCameraToEquirectTable(const Camera& cam, const cv::Size& eqrSize) {
+  const std::string key = remap_util::getKey(
+      folly::sformat("cam_to_eqr {}x{} {}", eqrSize.width, eqrSize.height, FLAGS_depth),
+      cam,
+      cv::Size(cam.resolution.x(), cam.resolution.y()));
+  return remap_util::getOrCompute(FLAGS_remap_cache_dir, key, [&] {
+    LOG(INFO) << folly::sformat("Computing remap table for {}...", cam.id);
+    cv::Mat_<cv::Vec2f> map(cam.resolution.y(), cam.resolution.x());
+    parallelFor(
+        0,
+        map.rows,
+        1,
+        [&](const int y) {
+          for (int x = 0; x < map.cols; ++x) {
+            const Camera::Vector3 world = cam.rig({x + 0.5, y + 0.5}, FLAGS_depth);
+            const Camera::Vector2 pEqr =
+                image_util::worldToEquirect(world, eqrSize.width, eqrSize.height);
+            if (pEqr.x() < 0 || pEqr.y() < 0 || pEqr.x() >= eqrSize.width ||
+                pEqr.y() >= eqrSize.height) {
+              map(y, x) = cv::Vec2f(NAN, NAN); // rounding can put us at image edge. Ignore these
+            } else {
+              map(y, x) = cv::Vec2f(int(pEqr.x()), int(pEqr.y()));
+            }
+          }
+        },
+        FLAGS_threads);
+    const bool kIsNearest = true;
+    return remap_util::makeTable(map, kIsNearest);
+  });
+}
+
 int main(int argc, char** argv) {
   gflags::SetUsageMessage(kUsage);
   system_util::initDep(argc, argv);
@@ -77,6 +111,9 @@ int main(int argc, char** argv) {
   verifyInputs(rig);
   rescaleCameras(rig);
 
+  // Tables are computed on the first frame, when the equirect size is known
+  std::vector<remap_util::RemapTable> tables(rig.size());
+  std::vector<cv::Size> eqrSizes(rig.size());
   const int first = std::stoi(FLAGS_first);
   const int last = std::stoi(FLAGS_last);
   for (int iFrame = first; iFrame <= last; ++iFrame) {
@@ -88,39 +125,13 @@ int main(int argc, char** argv) {
     for (ssize_t i = 0; i < ssize(rig); ++i) {
       const Camera& cam = rig[i];
       LOG(INFO) << folly::sformat("-- Frame {}: Projecting to {}...", frameName, cam.id);
-
-      // For each pixel in the current camera find out where in equirect space we land
-      ThreadPool threadPool(FLAGS_threads);
-      cv::Mat_<bool> camMask(cam.resolution.y(), cam.resolution.x(), false);
       const cv::Mat_<bool>& eqrMask = eqrMasks[i];
-
-      int h = camMask.rows;
-      int w = camMask.cols;
-      const int edgeX = w;
-      const int edgeY = 1;
-      for (int yBegin = 0; yBegin < h; yBegin += edgeY) {
-        for (int xBegin = 0; xBegin < w; xBegin += edgeX) {
-          const int xEnd = std::min(xBegin + edgeX, w);
-          const int yEnd = std::min(yBegin + edgeY, h);
-          threadPool.spawn([&, xBegin, yBegin, xEnd, yEnd] {
-            for (int y = yBegin; y < yEnd; ++y) {
-              for (int x = xBegin; x < xEnd; ++x) {
-                const Camera::Vector3 world = cam.rig({x + 0.5, y + 0.5}, FLAGS_depth);
-                const Camera::Vector2 pEqr =
-                    image_util::worldToEquirect(world, eqrMask.cols, eqrMask.rows);
-                if (pEqr.x() < 0 || pEqr.y() < 0 || pEqr.x() >= eqrMask.cols ||
-                    pEqr.y() >= eqrMask.rows) {
-                  continue; // rounding can put us at image edge. Ignore these cases
-                }
-                if (eqrMask(pEqr.y(), pEqr.x())) {
-                  camMask(y, x) = true;
-                }
-              }
-            }
-          });
-        }
+      if (tables[i].map1.empty()) {
+        eqrSizes[i] = eqrMask.size();
+        tables[i] = getCameraToEquirectTable(cam, eqrSizes[i]);
       }
-      threadPool.join();
+      CHECK_EQ(eqrMask.size(), eqrSizes[i]) << "equirect masks must have the same size";
+      const cv::Mat_<bool> camMask = remap_util::remap(eqrMask, tables[i]);
 
       const filesystem::path filename =
           filesystem::path(FLAGS_output) / cam.id / (frameName + "." + FLAGS_file_type);
@@ -0,0 +1,334 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/depth_estimation/BilateralFilterGpu.h"
+
+#include <cmath>
+#include <string>
+
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/gpu/GlUtil.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+namespace {
+
+// Range weight of RangeWeightLut, flushed to zero at the same distance
+const std::string kRangeWeightShader = R"(
+  #version 330 core
+
+  uniform vec3 weights;
+  uniform float invSigmaSq;
+  uniform float maxDiff;
+
+  float rangeWeight(vec3 a, vec3 b) {
+    vec3 d = a - b;
+    float diff = dot(weights, d * d);
+    return diff < maxDiff ? exp(-diff * invSigmaSq) : 0.0;
+  }
+)";
+
+// generalizedJointBilateralFilterTile
+const std::string kJointShader = R"(
+  uniform sampler2D image;
+  uniform sampler2D guide;
+  uniform sampler2D neighborGuide;
+  uniform sampler2D mask;
+  uniform int radius;
+
+  out float result;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(image, 0);
+    float value = texelFetch(image, p, 0).r;
+    if (texelFetch(mask, p, 0).r == 0.0) {
+      result = value;
+      return;
+    }
+    vec3 ref = texelFetch(guide, p, 0).rgb;
+    float sumWeight = 0.0;
+    float weightedAvg = 0.0;
+    for (int v = -radius; v <= radius; ++v) {
+      for (int u = -radius; u <= radius; ++u) {
+        ivec2 q = clamp(p + ivec2(u, v), ivec2(0), size - 1);
+        if (texelFetch(mask, q, 0).r == 0.0) {
+          continue;
+        }
+        float weight = rangeWeight(ref, texelFetch(neighborGuide, q, 0).rgb);
+        sumWeight += weight;
+        weightedAvg += weight * texelFetch(image, q, 0).r;
+      }
+    }
+    result = sumWeight != 0.0 ? weightedAvg / sumWeight : value;
+  }
+)";
+
+// temporalJointBilateralFilterTile, one layer per frame of the window
+const std::string kTemporalShader = R"(
+  uniform sampler2DArray guides;
+  uniform sampler2DArray images;
+  uniform sampler2DArray masks;
+  uniform int frameOffset;
+  uniform int radius;
+
+  out float result;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec3 size = textureSize(guides, 0);
+    if (texelFetch(masks, ivec3(p, frameOffset), 0).r == 0.0) {
+      result = texelFetch(images, ivec3(p, frameOffset), 0).r;
+      return;
+    }
+    vec3 ref = texelFetch(guides, ivec3(p, frameOffset), 0).rgb;
+    float weightedSumPix = 0.0;
+    float sumWeight = 0.0;
+    for (int t = 0; t < size.z; ++t) {
+      float frameWeight = 0.0;
+      for (int v = -radius; v <= radius; ++v) {
+        for (int u = -radius; u <= radius; ++u) {
+          ivec3 q = ivec3(clamp(p + ivec2(u, v), ivec2(0), size.xy - 1), t);
+          if (texelFetch(masks, q, 0).r != 0.0) {
+            frameWeight += rangeWeight(ref, texelFetch(guides, q, 0).rgb);
+          }
+        }
+      }
+
+      // Weights are from the neighbors, values from the pixel itself in each frame
+      weightedSumPix += texelFetch(images, ivec3(p, t), 0).r * frameWeight;
+      sumWeight += frameWeight;
+    }
+    result = weightedSumPix / sumWeight;
+  }
+)";
+
+// GL type of the elements of a mat
+void getFormat(const cv::Mat& mat, GLenum& internalFormat, GLenum& format, GLenum& type) {
+  switch (mat.type()) {
+    case CV_8UC1:
+      internalFormat = GL_R8;
+      format = GL_RED;
+      type = GL_UNSIGNED_BYTE;
+      return;
+    case CV_32FC1:
+      internalFormat = GL_R32F;
+      format = GL_RED;
+      type = GL_FLOAT;
+      return;
+    case CV_32FC3:
+      internalFormat = GL_RGB32F;
+      format = GL_RGB;
+      type = GL_FLOAT;
+      return;
+  }
+  LOG(FATAL) << "unexpected mat type " << mat.type();
+}
+
+void setSamplingParameters(const GLenum target) {
+  glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+// One layer per mat, all mats must have the same size and type
+GLuint createArrayTexture(const std::vector<cv::Mat>& mats) {
+  GLenum internalFormat, format, type;
+  getFormat(mats[0], internalFormat, format, type);
+  const cv::Size size = mats[0].size();
+  GLuint texture = createTexture(GL_TEXTURE_2D_ARRAY);
+  glTexImage3D(
+      GL_TEXTURE_2D_ARRAY,
+      0, // level
+      internalFormat,
+      size.width,
+      size.height,
+      mats.size(),
+      0, // border
+      format,
+      type,
+      nullptr);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int layer = 0; layer < int(mats.size()); ++layer) {
+    CHECK_EQ(mats[layer].size(), size);
+    CHECK_EQ(mats[layer].type(), mats[0].type());
+    const cv::Mat continuous = mats[layer].isContinuous() ? mats[layer] : mats[layer].clone();
+    glTexSubImage3D(
+        GL_TEXTURE_2D_ARRAY,
+        0,
+        0,
+        0,
+        layer,
+        size.width,
+        size.height,
+        1,
+        format,
+        type,
+        continuous.data);
+  }
+  setSamplingParameters(GL_TEXTURE_2D_ARRAY);
+  return texture;
+}
+
+GLuint createMatTexture(const cv::Mat& mat) {
+  GLenum internalFormat, format, type;
+  getFormat(mat, internalFormat, format, type);
+  const cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  GLuint texture = createTexture(GL_TEXTURE_2D);
+  glTexImage2D(
+      GL_TEXTURE_2D,
+      0, // level
+      internalFormat,
+      continuous.cols,
+      continuous.rows,
+      0, // border
+      format,
+      type,
+      continuous.data);
+  setSamplingParameters(GL_TEXTURE_2D);
+  return texture;
+}
+
+void bindTexture(
+    const GLuint program,
+    const char* name,
+    const GLuint unit,
+    const GLenum target,
+    const GLuint texture) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(target, texture);
+  setUniform(program, name, GLint(unit));
+}
+
+void setRangeWeightUniforms(
+    const GLuint program,
+    const float sigma,
+    const float weight0,
+    const float weight1,
+    const float weight2) {
+  const float sigmaSq = math_util::square(sigma);
+  glUniform3f(getUniformLocation(program, "weights"), weight0, weight1, weight2);
+  setUniform(program, "invSigmaSq", 1 / sigmaSq);
+  setUniform(program, "maxDiff", RangeWeightLut::kMaxExponent * sigmaSq);
+}
+
+} // namespace
+
+struct BilateralFilterGpu::Programs {
+  Programs() {
+    joint = createProgram(fullscreenVertexShader(), kRangeWeightShader + kJointShader);
+    temporal = createProgram(fullscreenVertexShader(), kRangeWeightShader + kTemporalShader);
+    glGenFramebuffers(1, &fbo);
+  }
+
+  ~Programs() {
+    glDeleteProgram(joint);
+    glDeleteProgram(temporal);
+    glDeleteFramebuffers(1, &fbo);
+  }
+
+  // Render a fullscreen pass of program and read back its float result
+  cv::Mat_<float> render(const GLuint program, const cv::Size& size) const {
+    GLuint target = createTexture(GL_TEXTURE_2D);
+    glTexImage2D(
+        GL_TEXTURE_2D, 0, GL_R32F, size.width, size.height, 0, GL_RED, GL_FLOAT, nullptr);
+    setSamplingParameters(GL_TEXTURE_2D);
+
+    GLint prevFbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    glViewport(0, 0, size.width, size.height);
+    glUseProgram(program);
+    fullscreen(program);
+
+    cv::Mat_<float> result(size);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, size.width, size.height, GL_RED, GL_FLOAT, result.data);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+    glDeleteTextures(1, &target);
+    return result;
+  }
+
+  GLuint joint;
+  GLuint temporal;
+  GLuint fbo;
+};
+
+BilateralFilterGpu::BilateralFilterGpu() : programs(std::make_unique<Programs>()) {
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+}
+
+BilateralFilterGpu::~BilateralFilterGpu() {}
+
+cv::Mat_<float> BilateralFilterGpu::jointFilter(
+    const cv::Mat_<float>& image,
+    const cv::Mat_<cv::Vec3f>& guide,
+    const cv::Mat_<cv::Vec3f>& neighborGuide,
+    const cv::Mat_<bool>& mask,
+    const int radius,
+    const float sigma,
+    const float weight0,
+    const float weight1,
+    const float weight2) const {
+  const GLuint program = programs->joint;
+  glUseProgram(program);
+  const GLuint textures[] = {
+      createMatTexture(image),
+      createMatTexture(guide),
+      createMatTexture(neighborGuide),
+      createMatTexture(mask),
+  };
+  bindTexture(program, "image", 0, GL_TEXTURE_2D, textures[0]);
+  bindTexture(program, "guide", 1, GL_TEXTURE_2D, textures[1]);
+  bindTexture(program, "neighborGuide", 2, GL_TEXTURE_2D, textures[2]);
+  bindTexture(program, "mask", 3, GL_TEXTURE_2D, textures[3]);
+  setUniform(program, "radius", radius);
+
+  // Same sigma as generalizedJointBilateralFilter
+  setRangeWeightUniforms(program, sigma * std::sqrt(6.0f), weight0, weight1, weight2);
+
+  const cv::Mat_<float> result = programs->render(program, image.size());
+  glDeleteTextures(4, textures);
+  return result;
+}
+
+cv::Mat_<float> BilateralFilterGpu::temporalFilter(
+    const std::vector<cv::Mat_<cv::Vec3f>>& guides,
+    const std::vector<cv::Mat_<float>>& images,
+    const std::vector<cv::Mat_<bool>>& masks,
+    const int frameOffset,
+    const float sigma,
+    const int spatialRadius,
+    const float weight0,
+    const float weight1,
+    const float weight2) const {
+  const GLuint program = programs->temporal;
+  glUseProgram(program);
+  const GLuint textures[] = {
+      createArrayTexture(std::vector<cv::Mat>(guides.begin(), guides.end())),
+      createArrayTexture(std::vector<cv::Mat>(images.begin(), images.end())),
+      createArrayTexture(std::vector<cv::Mat>(masks.begin(), masks.end())),
+  };
+  bindTexture(program, "guides", 0, GL_TEXTURE_2D_ARRAY, textures[0]);
+  bindTexture(program, "images", 1, GL_TEXTURE_2D_ARRAY, textures[1]);
+  bindTexture(program, "masks", 2, GL_TEXTURE_2D_ARRAY, textures[2]);
+  setUniform(program, "frameOffset", frameOffset);
+  setUniform(program, "radius", spatialRadius);
+  setRangeWeightUniforms(program, sigma, weight0, weight1, weight2);
+
+  const cv::Mat_<float> result = programs->render(program, images[frameOffset].size());
+  glDeleteTextures(3, textures);
+  return result;
+}
+
+} // namespace depth_estimation
+} // namespace fb360_dep
@@ -0,0 +1,118 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+#include "source/util/CvUtil.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+// generalizedJointBilateralFilter and temporalJointBilateralFilter (see TemporalBilateralFilter.h)
+// as OpenGL fragment passes, one fragment per output pixel. Guides are normalized on the CPU and
+// uploaded as float textures, the frames of a temporal window as layers of array textures
+//
+// Requires a current OpenGL 3.3 context (e.g. an offscreen GlWindow) on the calling thread
+// Range weights come from exp() rather than the CPU's table, so results match the CPU to the
+// table's interpolation error
+class BilateralFilterGpu {
+ public:
+  BilateralFilterGpu();
+  ~BilateralFilterGpu();
+
+  template <typename TGuide>
+  cv::Mat_<float> generalizedJointBilateralFilter(
+      const cv::Mat_<float>& image,
+      const cv::Mat_<TGuide>& guide,
+      const cv::Mat_<TGuide>& neighborGuide,
+      const cv::Mat_<bool>& mask,
+      const int radius,
+      const float sigma,
+      const float weight0 = 1.0f,
+      const float weight1 = 1.0f,
+      const float weight2 = 1.0f) const {
+    CHECK_EQ(guide.size(), neighborGuide.size());
+    CHECK_EQ(image.size(), guide.size());
+    CHECK_EQ(guide.size(), mask.size());
+    return jointFilter(
+        image,
+        normalize(guide, 1 / cv_util::maxPixelValue(guide)),
+        normalize(neighborGuide, 1 / cv_util::maxPixelValue(neighborGuide)),
+        mask,
+        radius,
+        sigma,
+        weight0,
+        weight1,
+        weight2);
+  }
+
+  template <typename T>
+  cv::Mat_<float> temporalJointBilateralFilter(
+      const std::vector<cv::Mat_<T>>& guides,
+      const std::vector<cv::Mat_<float>>& images,
+      const std::vector<cv::Mat_<bool>>& masks,
+      const int frameOffset,
+      const float sigma,
+      const int spatialRadius,
+      const float weight0,
+      const float weight1,
+      const float weight2) const {
+    CHECK_EQ(guides.size(), images.size());
+    CHECK_EQ(guides.size(), masks.size());
+    const float norm = 1 / cv_util::maxPixelValue(guides[frameOffset]);
+    std::vector<cv::Mat_<cv::Vec3f>> normalized;
+    for (const cv::Mat_<T>& guide : guides) {
+      normalized.push_back(normalize(guide, norm));
+    }
+    return temporalFilter(
+        normalized, images, masks, frameOffset, sigma, spatialRadius, weight0, weight1, weight2);
+  }
+
+ private:
+  struct Programs;
+
+  template <typename T>
+  static cv::Mat_<cv::Vec3f> normalize(const cv::Mat_<T>& guide, const float norm) {
+    CHECK_EQ(guide.channels(), 3);
+    cv::Mat_<cv::Vec3f> result;
+    guide.convertTo(result, CV_32FC3, norm);
+    return result;
+  }
+
+  cv::Mat_<float> jointFilter(
+      const cv::Mat_<float>& image,
+      const cv::Mat_<cv::Vec3f>& guide,
+      const cv::Mat_<cv::Vec3f>& neighborGuide,
+      const cv::Mat_<bool>& mask,
+      const int radius,
+      const float sigma,
+      const float weight0,
+      const float weight1,
+      const float weight2) const;
+
+  cv::Mat_<float> temporalFilter(
+      const std::vector<cv::Mat_<cv::Vec3f>>& guides,
+      const std::vector<cv::Mat_<float>>& images,
+      const std::vector<cv::Mat_<bool>>& masks,
+      const int frameOffset,
+      const float sigma,
+      const int spatialRadius,
+      const float weight0,
+      const float weight1,
+      const float weight2) const;
+
+  std::unique_ptr<Programs> programs;
+};
+
+} // namespace depth_estimation
+} // namespace fb360_dep
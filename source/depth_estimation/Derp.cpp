@@ -7,15 +7,26 @@
 
 #include "source/depth_estimation/Derp.h"
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <random>
 
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
 
 #include "source/depth_estimation/TemporalBilateralFilter.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/Numa.h"
+#include "source/util/Profiler.h"
 #include "source/util/ThreadPool.h"
 
 using namespace fb360_dep::cv_util;
@@ -88,6 +99,11 @@ void getPyramidLevelSizes(std::map<int, cv::Size>& sizes, const filesystem::path
       continue;
     }
     const std::string levelStr = filename.substr(filename.find(levelDelim) + levelDelim.size());
+    const std::shared_ptr<const ImageManifest> manifest = getManifest(p);
+    if (manifest && !manifest->empty() && !manifest->begin()->second.size.empty()) {
+      sizes[std::stoi(levelStr)] = manifest->begin()->second.size;
+      continue;
+    }
     const filesystem::path imageFn = filesystem::getFirstFile(p, includeHidden, false, "", ".tar");
     if (imageFn.empty()) {
       continue;
@@ -100,12 +116,22 @@ void getPyramidLevelSizes(std::map<int, cv::Size>& sizes, const filesystem::path
 // equivalent to TYPE NAME[SIZE] but sized at runtime
 #define STACK_ARRAY(TYPE, NAME, SIZE) TYPE* const NAME = (TYPE*)alloca(sizeof(TYPE) * (SIZE))
 
-std::tuple<float, float> computeCost(
+// Most disparities computeCostsBatch() takes at once, what randomProposal() asks for
+const int kMaxCostBatch = kRandomPropBatchSize + 1;
+
+// computeCosts() for at most kMaxCostBatch disparities and kMaxSrcs srcs, or any number of srcs if
+// kMaxSrcs is 0. Scratch space is then sized at compile time, with a constant stride per disparity
+// The rig sizes we run are instantiated, see computeCosts()
+template <int kMaxSrcs>
+static void computeCostsBatch(
     const PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx,
-    const float disparity,
+    const float* const disparities,
+    const int count,
     const int x,
-    const int y) {
+    const int y,
+    std::tuple<float, float>* const costs,
+    const float bound) {
   // For a given (x, y, depth) in dst, we find the corresponding (x, y) in src,
   // and then its reprojection into dst where src and dst are aligned up to
   // translation. There we can extract a square patch from src and projected dst
@@ -136,97 +162,218 @@ std::tuple<float, float> computeCost(
   //  |______________|       |______________|
   //        dst                    src
 
-  // (1) pDst = (x, y)
-  // (2) get pWorld
+  // (1) pDst = (x, y), the dst patch is the same at every disparity
   const cv::Mat_<PixelType>& dstColor = pyramidLevel.dstProjColor(dstIdx);
+  const cv::Mat_<PixelType>& dstColorBias = pyramidLevel.dstProjColorBias(dstIdx);
+  const DstPatch dstPatch(dstColor, x, y, dstColorBias(y, x), kSearchWindowRadius);
+
+  // (2) get pWorld at each disparity
   const Camera& camDst = pyramidLevel.rigDst[dstIdx];
-  const Camera::Vector3 pWorld =
-      dstToWorldPoint(camDst, x, y, disparity, dstColor.cols, dstColor.rows);
+  const cv::Mat_<cv::Vec3f>& dstRays = pyramidLevel.dstRays(dstIdx);
+  DCHECK_LE(count, kMaxCostBatch);
+  Camera::Vector3 pWorlds[kMaxCostBatch];
+  for (int k = 0; k < count; ++k) {
+    pWorlds[k] = dstRays.empty()
+        ? dstToWorldPoint(camDst, x, y, disparities[k], dstColor.cols, dstColor.rows)
+        : dstToWorldPoint(camDst, dstRays, x, y, disparities[k]);
+  }
 
-  // Compute SSD between dst and projected src for each src
+  // Compute SSD between dst and projected src for each src and disparity
+  // SSDs of disparity k start at SSDs + k * stride
   using SSDPair = std::pair<float, float>;
-  STACK_ARRAY(SSDPair, SSDs, pyramidLevel.rigSrc.size());
-  int ssdCount = 0;
-  const cv::Mat_<PixelType>& dstColorBias = pyramidLevel.dstProjColorBias(dstIdx);
-  for (ssize_t srcIdx = 0; srcIdx < ssize(pyramidLevel.rigSrc); ++srcIdx) {
-    // No SSD if src = dst
-    if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx]) {
+  const int numSrcs = pyramidLevel.rigSrc.size();
+  DCHECK(kMaxSrcs == 0 || numSrcs <= kMaxSrcs);
+  const int stride = kMaxSrcs > 0 ? kMaxSrcs : numSrcs;
+  SSDPair fixedSSDs[kMaxCostBatch * std::max(kMaxSrcs, 1)];
+  STACK_ARRAY(SSDPair, anySSDs, kMaxSrcs > 0 ? 0 : count * numSrcs);
+  SSDPair* const SSDs = kMaxSrcs > 0 ? fixedSSDs : anySSDs;
+  int ssdCounts[kMaxCostBatch] = {};
+  const uint64_t tileSrcs = pyramidLevel.dstTileSrcs(dstIdx, x, y);
+  auto isVisible = [&](const int srcIdx) {
+    // No SSD if src = dst, nor for srcs that cannot see this part of dst
+    return srcIdx != pyramidLevel.dst2srcIdxs[dstIdx] &&
+        (srcIdx >= 64 || ((tileSrcs >> srcIdx) & 1));
+  };
+
+  // Bounded: after each src, drop the disparities whose cost cannot come in under bound whatever
+  // the srcs left add. The final cost is the sum of all but (at most) two of the unbiased SSDs,
+  // divided by keep^2 and the confidence, and keep grows with the SSD count. So the SSDs so far,
+  // less their two largest, over the largest keep the srcs left allow, are a lower bound
+  const bool isBounded = bound < FLT_MAX;
+  const float confidence = std::max(pyramidLevel.dstVariance(dstIdx)(y, x), kMinVar);
+  int numSrcsLeft = 0;
+  if (isBounded) {
+    for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+      numSrcsLeft += isVisible(srcIdx);
+    }
+  }
+  bool isDropped[kMaxCostBatch] = {};
+  int numDropped = 0;
+  float sums[kMaxCostBatch] = {};
+  float largest[kMaxCostBatch][2] = {};
+
+  for (int srcIdx = 0; srcIdx < numSrcs && numDropped < count; ++srcIdx) {
+    if (!isVisible(srcIdx)) {
       continue;
     }
+    --numSrcsLeft;
 
-    // (3) get pSrc
     const Camera& camSrc = pyramidLevel.rigSrc[srcIdx];
     const cv::Size& srcSize = pyramidLevel.srcColor(srcIdx).size();
-    Camera::Vector2 pSrc;
-    if (!worldToSrcPoint(pSrc, pWorld, camSrc, srcSize.width, srcSize.height)) {
-      continue;
-    }
+    const cv::Mat_<cv::Vec2f>& dstProjWarp = pyramidLevel.dstProjWarp(dstIdx, srcIdx);
+    const bool isCompact = pyramidLevel.isCompactProj(dstIdx, srcIdx);
+    for (int k = 0; k < count; ++k) {
+      if (isDropped[k]) {
+        continue;
+      }
 
-    // Exclude a half-texel band to simulate proper clamp-to-border semantics
-    const bool kExcludeHalfTexel = false;
-    if (kExcludeHalfTexel) {
-      if (pSrc.x() < 0.5 || srcSize.width - 0.5 < pSrc.x() || pSrc.y() < 0.5 ||
-          srcSize.height - 0.5 < pSrc.y()) {
+      // (3) get pSrc
+      Camera::Vector2 pSrc;
+      if (!worldToSrcPoint(pSrc, pWorlds[k], camSrc, srcSize.width, srcSize.height)) {
         continue;
       }
+
+      // Exclude a half-texel band to simulate proper clamp-to-border semantics
+      const bool kExcludeHalfTexel = false;
+      if (kExcludeHalfTexel) {
+        if (pSrc.x() < 0.5 || srcSize.width - 0.5 < pSrc.x() || pSrc.y() < 0.5 ||
+            srcSize.height - 0.5 < pSrc.y()) {
+          continue;
+        }
+      }
+
+      // (3) -> (4) -> (5) mapping from pre-computed projection warp
+      const cv::Vec2f pDstSrc = cv_util::getPixelBilinear(dstProjWarp, pSrc.x(), pSrc.y());
+
+      // Check if pDstSrc is within bounds
+      const float xDstSrc = pDstSrc[0] + 0.5; // pDstSrc uses opencv coordinate convention
+      const float yDstSrc = pDstSrc[1] + 0.5;
+      if (std::isnan(xDstSrc) || std::isnan(yDstSrc)) {
+        continue;
+      }
+
+      // NOTE: bias of src projected into dst (srcBias) is the average of its
+      // patch values, which are bilinearly interpolated from floating point
+      // projected coordinates (pDstSrc). This is mathematically different than
+      // bilinearly interpolating the pre-computed projected bias around pDstSrc,
+      // because we are grabbing biases from neighboring footprints, but it seems
+      // to produce very similar results
+      std::pair<float, float> ssd;
+      if (isCompact) {
+        const PixelTypeFloat dstSrcBias = kCompactPixelScale *
+            cv_util::getPixelBilinear<CompactPixelType, PixelTypeFloat>(
+                pyramidLevel.dstProjColorBiasCompact(dstIdx, srcIdx), xDstSrc, yDstSrc);
+        ssd = computeSSD(
+            dstPatch,
+            pyramidLevel.dstProjColorCompact(dstIdx, srcIdx),
+            xDstSrc,
+            yDstSrc,
+            dstSrcBias);
+      } else {
+        const PixelType dstSrcBias = cv_util::getPixelBilinear(
+            pyramidLevel.dstProjColorBias(dstIdx, srcIdx), xDstSrc, yDstSrc);
+        ssd = computeSSD(
+            dstPatch, pyramidLevel.dstProjColor(dstIdx, srcIdx), xDstSrc, yDstSrc, dstSrcBias);
+      }
+      SSDs[k * stride + ssdCounts[k]] = ssd;
+      ++ssdCounts[k];
+      if (isBounded) {
+        sums[k] += ssd.second;
+        if (ssd.second > largest[k][0]) {
+          largest[k][1] = largest[k][0];
+          largest[k][0] = ssd.second;
+        } else if (ssd.second > largest[k][1]) {
+          largest[k][1] = ssd.second;
+        }
+      }
     }
 
-    // (3) -> (4) -> (5) mapping from pre-computed projection warp
-    const cv::Mat_<cv::Vec2f>& dstProjWarp = pyramidLevel.dstProjWarp(dstIdx, srcIdx);
-    const cv::Vec2f pDstSrc = cv_util::getPixelBilinear(dstProjWarp, pSrc.x(), pSrc.y());
+    if (isBounded) {
+      for (int k = 0; k < count; ++k) {
+        if (isDropped[k]) {
+          continue;
+        }
+        const int maxSsdCount = ssdCounts[k] + numSrcsLeft;
+        const int maxKeep = std::max(kMinOverlappingCams - 1, maxSsdCount - 2);
+        const float minCost = (sums[k] - largest[k][0] - largest[k][1]) /
+            (float(maxKeep) * float(maxKeep) * confidence);
+        // Margin for the rounding of a sum in a different order
+        if (maxSsdCount < kMinOverlappingCams - 1 || minCost * (1.0f - 1e-4f) >= bound) {
+          isDropped[k] = true;
+          ++numDropped;
+        }
+      }
+    }
+  }
 
-    // Check if pDstSrc is within bounds
-    const float xDstSrc = pDstSrc[0] + 0.5; // pDstSrc uses opencv coordinate convention
-    const float yDstSrc = pDstSrc[1] + 0.5;
-    if (std::isnan(xDstSrc) || std::isnan(yDstSrc)) {
+  for (int k = 0; k < count; ++k) {
+    if (isDropped[k]) {
+      costs[k] = std::make_tuple(FLT_MAX, confidence);
+      continue;
+    }
+    SSDPair* const ssds = SSDs + k * stride;
+    const int ssdCount = ssdCounts[k];
+    int keep = kMinOverlappingCams - 1;
+    if (ssdCount < keep) {
+      costs[k] = std::make_tuple(FLT_MAX, 0.0f); // not enough cameras see this disparity, skip
       continue;
     }
 
-    // NOTE: bias of src projected into dst (srcBias) is the average of its
-    // patch values, which are bilinearly interpolated from floating point
-    // projected coordinates (pDstSrc). This is mathematically different than
-    // bilinearly interpolating the pre-computed projected bias around pDstSrc,
-    // because we are grabbing biases from neighboring footprints, but it seems
-    // to produce very similar results
-    const cv::Mat_<PixelType>& dstSrcColorBias = pyramidLevel.dstProjColorBias(dstIdx, srcIdx);
-    const PixelType dstSrcBias = cv_util::getPixelBilinear(dstSrcColorBias, xDstSrc, yDstSrc);
-    const PixelType& dstBias = dstColorBias(y, x);
-
-    const cv::Mat_<PixelType>& dstSrcColor = pyramidLevel.dstProjColor(dstIdx, srcIdx);
-    std::pair<float, float> ssd = computeSSD(
-        dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, kSearchWindowRadius);
-    SSDs[ssdCount] = ssd;
-    ++ssdCount;
-  }
+    // Add up unbiased SSDs for all but the two patches with the worst biased SSDs
+    keep = std::max<int>(keep, ssdCount - 2);
+    std::nth_element(ssds, ssds + keep, ssds + ssdCount);
+    float cost = 0;
+    for (int i = 0; i < keep; ++i) {
+      cost += ssds[i].second;
+    }
+    cost /= keep;
 
-  int keep = kMinOverlappingCams - 1;
-  if (ssdCount < keep) {
-    return std::make_tuple(FLT_MAX, 0.0f); // not enough cameras see this disparity, skip
-  }
+    // Trust costs when more cameras are involved
+    // This also means that we penalize closeup proposals (closer to camera rig
+    // means fewer cameras see that point)
+    const float trustCoef = 1.0f / keep;
 
-  // Add up unbiased SSDs for all but the two patches with the worst biased SSDs
-  keep = std::max<int>(keep, ssdCount - 2);
-  std::nth_element(SSDs, SSDs + keep, SSDs + ssdCount);
-  float cost = 0;
-  for (int i = 0; i < keep; ++i) {
-    cost += SSDs[i].second;
+    const float costFinal = cost * trustCoef / confidence;
+    costs[k] = std::make_tuple(costFinal, confidence);
   }
-  cost /= keep;
+}
 
-  // Trust costs when more cameras are involved
-  // This also means that we penalize closeup proposals (closer to camera rig
-  // means fewer cameras see that point)
-  const float trustCoef = 1.0f / keep;
+void computeCosts(
+    const PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const float* const disparities,
+    const int count,
+    const int x,
+    const int y,
+    std::tuple<float, float>* const costs,
+    const float bound) {
+  // Common rig sizes have their own instantiation, larger rigs take the generic one
+  const int numSrcs = pyramidLevel.rigSrc.size();
+  const auto batch = numSrcs <= 6
+      ? &computeCostsBatch<6>
+      : numSrcs <= 14 ? &computeCostsBatch<14>
+                      : numSrcs <= 24 ? &computeCostsBatch<24> : &computeCostsBatch<0>;
+  for (int k = 0; k < count; k += kMaxCostBatch) {
+    const int n = std::min(count - k, kMaxCostBatch);
+    batch(pyramidLevel, dstIdx, disparities + k, n, x, y, costs + k, bound);
+  }
+}
 
-  const float dstVariance = pyramidLevel.dstVariance(dstIdx)(y, x);
-  const float confidence = std::max(dstVariance, kMinVar);
-  const float costFinal = cost * trustCoef / confidence;
-  return std::make_tuple(costFinal, confidence);
+std::tuple<float, float> computeCost(
+    const PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const float disparity,
+    const int x,
+    const int y,
+    const float bound) {
+  std::tuple<float, float> cost;
+  computeCosts(pyramidLevel, dstIdx, &disparity, 1, x, y, &cost, bound);
+  return cost;
 }
 
 // Creates a cost map where each (x, y) has a cost calculated from all the
 // source cameras
-void computeBruteForceCosts(
+int computeBruteForceCosts(
     PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx,
     const float disparity,
@@ -242,20 +389,24 @@ void computeBruteForceCosts(
 
   // Ignore margins if dst = src (won't be able to get entire patch)
   const int radius = kSearchWindowRadius;
+  int numEvaluations = 0;
   for (int y = radius; y < costMap.rows - radius; ++y) {
     for (int x = radius; x < costMap.cols - radius; ++x) {
       // Ignore if outside FOV or background pixel or foreground is farther than background
       const bool ignore = !pyramidLevel.dstFovMask(dstIdx)(y, x) ||
           !pyramidLevel.dstForegroundMask(dstIdx)(y, x) || !closerMask(y, x);
-      if (ignore) {
+      if (ignore || pyramidLevel.isDstWarmStarted(dstIdx, x, y) ||
+          pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) {
         costMap(y, x) = NAN;
         confidenceMap(y, x) = NAN;
       } else {
         std::tie(costMap(y, x), confidenceMap(y, x)) =
             computeCost(pyramidLevel, dstIdx, disparity, x, y);
+        ++numEvaluations;
       }
     }
   }
+  return numEvaluations;
 }
 
 // Brute force: find disparity with lowest cost at each location, typically at
@@ -274,6 +425,8 @@ void computeBruteForceDisparity(
 
   LOG(INFO) << "Computing initial costs at " << pyramidLevel.sizeLevel
             << folly::sformat(" ({})", pyramidLevel.rigDst[dstIdx].id);
+  profiler::ScopedStage stage(
+      &pyramidLevel.profile, "preprocessLevel", pyramidLevel.level, pyramidLevel.rigDst[dstIdx].id);
 
   std::vector<float> disparities(kNumDepths);
   const float minDisparity = 1.0f / maxDepthMeters;
@@ -292,15 +445,18 @@ void computeBruteForceDisparity(
     costs[iDisparity].setTo(NAN);
     confidences[iDisparity].create(pyramidLevel.sizeLevel);
     confidences[iDisparity].setTo(NAN);
-    threadPool.spawn(
-        &computeBruteForceCosts,
-        std::ref(pyramidLevel),
-        dstIdx,
-        disparities[iDisparity],
-        std::ref(costs[iDisparity]),
-        std::ref(confidences[iDisparity]));
+    threadPool.spawn([&, iDisparity] {
+      stage.addCostEvaluations(computeBruteForceCosts(
+          pyramidLevel,
+          dstIdx,
+          disparities[iDisparity],
+          costs[iDisparity],
+          confidences[iDisparity]));
+    });
   }
   threadPool.join();
+  stage.addPixels(dstDisparity.total());
+  stage.addBytes(2 * disparities.size() * pyramidLevel.sizeLevel.area() * sizeof(float));
 
   // Get best cost on each location
   // We have one cost per disparity at each location
@@ -313,12 +469,25 @@ void computeBruteForceDisparity(
         continue;
       }
 
+      // Kept from a previous run
+      if (pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) {
+        continue;
+      }
+
       // Use background value if we're outside the foreground mask
       if (!pyramidLevel.dstForegroundMask(dstIdx)(y, x)) {
         dstDisparity(y, x) = pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x);
         continue;
       }
 
+      // Keep the previous frame's disparity where the scene didn't change
+      if (pyramidLevel.isDstWarmStarted(dstIdx, x, y)) {
+        std::tie(dstCosts(y, x), dstConfidences(y, x)) =
+            computeCost(pyramidLevel, dstIdx, dstDisparity(y, x), x, y);
+        stage.addCostEvaluations(1);
+        continue;
+      }
+
       float minCost = FLT_MAX;
       float minCostConfidence = 0;
       int bestDisparityIdx = -1;
@@ -387,165 +556,258 @@ void computeBruteForceDisparities(
     const bool partialCoverage,
     const bool useForegroundMasks,
     const int numThreads) {
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    computeBruteForceDisparity(
-        pyramidLevel,
-        dstIdx,
-        minDepthMeters,
-        maxDepthMeters,
-        partialCoverage,
-        useForegroundMasks,
-        numThreads);
-  }
+  forEachByNode(
+      pyramidLevel.rigDst.size(),
+      [&](const int dstIdx) {
+        computeBruteForceDisparity(
+            pyramidLevel,
+            dstIdx,
+            minDepthMeters,
+            maxDepthMeters,
+            partialCoverage,
+            useForegroundMasks,
+            numThreads);
+      },
+      numThreads);
 }
 
-void pingPongRectangle(
-    cv::Mat_<float>& dispRes,
-    cv::Mat_<float>& costsRes,
-    cv::Mat_<float>& confidencesRes,
-    const cv::Mat_<bool>& changed,
+// Updates the disparities of the given pixels in place
+// Pixels that change are stamped with the iteration in lastChanged and appended to changedPixels
+// Returns the number of costs evaluated
+int pingPongPixels(
+    cv::Mat_<float>& costs,
+    cv::Mat_<int>& lastChanged,
+    std::vector<cv::Point>& changedPixels,
+    const std::vector<cv::Point>& pixels,
+    const int iteration,
     const cv::Mat_<cv::Vec3b>& labImage,
-    const PyramidLevel<PixelType>& pyramidLevel,
-    const int dstIdx,
-    const int xBegin,
-    const int yBegin,
-    const int xEnd,
-    const int yEnd) {
-  const cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
-  const cv::Mat_<float>& confidences = pyramidLevel.dstConfidence(dstIdx);
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx) {
+  cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
   const cv::Mat_<bool>& maskFov = pyramidLevel.dstFovMask(dstIdx);
   const cv::Mat_<float>& dispBackground = pyramidLevel.dstBackgroundDisparity(dstIdx);
   const cv::Mat_<float>& variance = pyramidLevel.dstVariance(dstIdx);
 
-  for (int y = yBegin; y < yEnd; ++y) {
-    for (int x = xBegin; x < xEnd; ++x) {
-      if (!maskFov(y, x)) {
-        // Keep value from previous frame
-        continue;
-      }
+  auto update = [&](const int x, const int y, const float d) {
+    if (disp(y, x) != d) {
+      disp(y, x) = d;
+      lastChanged(y, x) = iteration;
+      changedPixels.emplace_back(x, y);
+    }
+  };
 
-      // Use background value if we're outside the foreground mask
-      if (!pyramidLevel.dstForegroundMask(dstIdx)(y, x)) {
-        dispRes(y, x) = dispBackground(y, x);
-        continue;
-      }
+  int numEvaluations = 0;
+  for (const cv::Point& p : pixels) {
+    const int x = p.x;
+    const int y = p.y;
+    if (!maskFov(y, x)) {
+      // Keep value from previous frame
+      continue;
+    }
 
-      // Ignore locations with low variance
-      if (variance(y, x) < pyramidLevel.varNoiseFloor) {
-        continue;
-      }
+    // Use background value if we're outside the foreground mask
+    if (!pyramidLevel.dstForegroundMask(dstIdx)(y, x)) {
+      update(x, y, dispBackground(y, x));
+      continue;
+    }
 
-      float bestCost = INFINITY;
-      float bestDisparity = disp(y, x);
-      float bestConfidence = confidences(y, x);
+    // Ignore locations with low variance
+    if (variance(y, x) < pyramidLevel.varNoiseFloor) {
+      continue;
+    }
 
-      std::vector<std::array<int, 2>> candidateNeighborOffsets;
-      if (kDoColorPruning) {
-        const std::array<int, 2>& startPoint = {{x, y}};
-        candidateNeighborOffsets = prunePingPongCandidates(
-            candidateTemplateOriginal, labImage, startPoint, kColorPruningNumNeighbors);
-      } else {
-        candidateNeighborOffsets = candidateTemplateOriginal;
-      }
+    float bestCost = INFINITY;
+    float bestDisparity = disp(y, x);
 
-      const float backgroundDisparity =
-          pyramidLevel.hasForegroundMasks ? pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x) : 0;
-
-      for (const auto& candidateNeighborOffset : candidateNeighborOffsets) {
-        const int xx = math_util::clamp(x + candidateNeighborOffset[0], 0, disp.cols - 1);
-        const int yy = math_util::clamp(y + candidateNeighborOffset[1], 0, disp.rows - 1);
-        if (maskFov(yy, xx)) { // inside FOV
-          const float d = disp(yy, xx);
-
-          // When using background disparity, foreground pixels must be closer than background
-          if (d >= backgroundDisparity && changed(yy, xx)) {
-            const auto costValues = computeCost(pyramidLevel, dstIdx, d, x, y);
-            const float cost = std::get<0>(costValues);
-            if (cost < bestCost) {
-              bestCost = cost;
-              bestDisparity = d;
-              bestConfidence = std::get<1>(costValues);
-            }
+    const std::array<int, 2>* candidateNeighborOffsets = candidateTemplateOriginal.data();
+    int numCandidates = candidateTemplateOriginal.size();
+    std::array<std::array<int, 2>, kColorPruningNumNeighbors> prunedOffsets;
+    if (kDoColorPruning) {
+      numCandidates =
+          selectColorCandidates(prunedOffsets, candidateTemplateOriginal, labImage, x, y);
+      candidateNeighborOffsets = prunedOffsets.data();
+    }
+
+    const float backgroundDisparity =
+        pyramidLevel.hasForegroundMasks ? pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x) : 0;
+
+    for (int i = 0; i < numCandidates; ++i) {
+      const std::array<int, 2>& candidateNeighborOffset = candidateNeighborOffsets[i];
+      const int xx = math_util::clamp(x + candidateNeighborOffset[0], 0, disp.cols - 1);
+      const int yy = math_util::clamp(y + candidateNeighborOffset[1], 0, disp.rows - 1);
+      if (maskFov(yy, xx)) { // inside FOV
+        const float d = disp(yy, xx);
+
+        // Only neighbors that changed since we last looked at them can improve the cost
+        // When using background disparity, foreground pixels must be closer than background
+        if (d >= backgroundDisparity && lastChanged(yy, xx) >= iteration - 1) {
+          const float cost = std::get<0>(computeCost(pyramidLevel, dstIdx, d, x, y, bestCost));
+          ++numEvaluations;
+          if (cost < bestCost) {
+            bestCost = cost;
+            bestDisparity = d;
           }
         }
       }
-      dispRes(y, x) = bestDisparity;
-      costsRes(y, x) = bestCost;
-      confidencesRes(y, x) = bestConfidence;
     }
+    update(x, y, bestDisparity);
+    costs(y, x) = bestCost;
   }
+  return numEvaluations;
 }
 
-void pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterations, const int numThreads) {
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
-    cv::Mat_<float>& costs = pyramidLevel.dstCost(dstIdx);
-    cv::Mat_<float> dispRes(disp.size());
-    disp.copyTo(dispRes);
-    cv::Mat_<float> costsRes(disp.size(), INFINITY);
-    cv::Mat_<float> confidencesRes(disp.size(), 0);
-    cv::Mat_<bool> changed(disp.size(), true);
-
-    cv::Mat_<cv::Vec3b> labImage;
-    if (kDoColorPruning) {
-      const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
-      cv::Mat_<cv::Vec4b> imageScaled;
-      cv::Mat_<cv::Vec3b> bgrImage;
-      color.convertTo(imageScaled, CV_8UC4, 255);
-      cv::cvtColor(imageScaled, bgrImage, cv::COLOR_BGRA2BGR);
-      cv::cvtColor(bgrImage, labImage, cv::COLOR_BGR2Lab);
-    }
+// Disparities are updated in place, one tile per task
+// Tiles run in four phases given by the parity of their tile coordinates, so concurrent tiles are
+// a whole tile apart and never read a disparity another task is writing (candidates are at most
+// two pixels away)
+// After the first iteration, each tile only visits its worklist: the pixels that have a candidate
+// that changed in the previous iteration. Nothing else can improve, so extra iterations cost in
+// proportion to what changed
+void pingPongDst(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const int iterations,
+    const int numThreads) {
+  static_assert(kPingPongTileSize > 2, "tiles must be larger than the candidate template reach");
+  profiler::ScopedStage stage(
+      &pyramidLevel.profile, "pingPong", pyramidLevel.level, pyramidLevel.rigDst[dstIdx].id);
+  const cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
+  cv::Mat_<float>& costs = pyramidLevel.dstCost(dstIdx);
+  costs.setTo(INFINITY, pyramidLevel.dstRoiMask(dstIdx)); // empty = everywhere
+  cv::Mat_<int> lastChanged(disp.size(), 0); // everything changed before the first iteration
+  stage.addBytes(2 * lastChanged.total() * sizeof(int)); // lastChanged and lastQueued
 
-    for (int it = 1; it <= iterations; ++it) {
-      LOG(INFO) << folly::sformat(
-          "-- ping pong: iter {}/{}, {}", it, iterations, pyramidLevel.rigDst[dstIdx].id);
-      const int radius = kSearchWindowRadius;
-      ThreadPool threadPool(numThreads);
-
-      const int edgeX = dispRes.cols;
-      const int edgeY = 1;
-      for (int y = radius; y < dispRes.rows - radius; y += edgeY) {
-        for (int x = radius; x < dispRes.cols - radius; x += edgeX) {
-          threadPool.spawn(
-              &pingPongRectangle,
-              std::ref(dispRes),
-              std::ref(costsRes),
-              std::ref(confidencesRes),
-              std::cref(changed),
-              std::cref(labImage),
-              std::cref(pyramidLevel),
-              dstIdx,
-              x,
-              y,
-              std::min(x + edgeX, dispRes.cols - radius),
-              std::min(y + edgeY, dispRes.rows - radius));
+  // Shares the buffer the level keeps, see PyramidLevel::dstLabColor()
+  const cv::Mat_<cv::Vec3b> labImage =
+      kDoColorPruning ? pyramidLevel.dstLabColor(dstIdx) : cv::Mat_<cv::Vec3b>();
+
+  const int radius = kSearchWindowRadius;
+  const cv::Rect region(radius, radius, disp.cols - 2 * radius, disp.rows - 2 * radius);
+  const int tilesX = (region.width + kPingPongTileSize - 1) / kPingPongTileSize;
+  const int tilesY = (region.height + kPingPongTileSize - 1) / kPingPongTileSize;
+  auto tileOf = [&](const cv::Point& p) {
+    return ((p.y - region.y) / kPingPongTileSize) * tilesX +
+        (p.x - region.x) / kPingPongTileSize;
+  };
+
+  // First iteration visits every pixel in the region of interest, but for the tiles with nothing
+  // to solve (see PyramidLevel::updateDstTiles)
+  using Level = PyramidLevel<PixelType>;
+  std::vector<std::vector<cv::Point>> worklists(tilesX * tilesY);
+  for (int y = region.y; y < region.y + region.height; ++y) {
+    for (int x = region.x; x < region.x + region.width; ++x) {
+      if (!pyramidLevel.isDstTile(dstIdx, x, y, Level::kTileActive)) {
+        x = (x / Level::kTileSize + 1) * Level::kTileSize - 1;
+        continue;
+      }
+      if (!pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) {
+        worklists[tileOf({x, y})].emplace_back(x, y);
+      }
+    }
+  }
+  std::vector<std::vector<cv::Point>> changedPixels(tilesX * tilesY);
+  cv::Mat_<int> lastQueued(disp.size(), 0);
+
+  const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
+  const int countFov = cv::countNonZero(fovMask);
+  for (int it = 1; it <= iterations; ++it) {
+    size_t worklistSize = 0;
+    for (const std::vector<cv::Point>& worklist : worklists) {
+      worklistSize += worklist.size();
+    }
+    LOG(INFO) << folly::sformat(
+        "-- ping pong: iter {}/{}, {}, {} pixels",
+        it,
+        iterations,
+        pyramidLevel.rigDst[dstIdx].id,
+        worklistSize);
+    stage.addPixels(worklistSize);
+
+    for (int phase = 0; phase < 4; ++phase) {
+      std::vector<int> tiles;
+      for (int ty = phase / 2; ty < tilesY; ty += 2) {
+        for (int tx = phase % 2; tx < tilesX; tx += 2) {
+          if (!worklists[ty * tilesX + tx].empty()) {
+            tiles.push_back(ty * tilesX + tx);
+          }
         }
       }
-      threadPool.join();
-
-      changed = disp != dispRes;
-      dispRes.copyTo(disp);
-      costsRes.copyTo(costs);
+      parallelFor(
+          0,
+          int(tiles.size()),
+          1,
+          [&](const int i) {
+            const int tile = tiles[i];
+            changedPixels[tile].clear();
+            stage.addCostEvaluations(pingPongPixels(
+                costs,
+                lastChanged,
+                changedPixels[tile],
+                worklists[tile],
+                it,
+                labImage,
+                pyramidLevel,
+                dstIdx));
+          },
+          numThreads);
+    }
 
-      const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
-      const int countFov = cv::countNonZero(fovMask);
-      const int count = cv::countNonZero(changed);
-      const float changedPct = 100.0f * count / countFov;
-      LOG(INFO) << std::fixed << std::setprecision(2) << folly::sformat("changed: {}%", changedPct);
+    // Next worklist: every pixel that has a pixel that changed among its candidates
+    // Kept in raster order within each tile, as in the first iteration
+    size_t count = 0;
+    for (std::vector<cv::Point>& worklist : worklists) {
+      worklist.clear();
+    }
+    for (std::vector<cv::Point>& changed : changedPixels) {
+      count += changed.size();
+      for (const cv::Point& q : changed) {
+        for (const auto& candidateNeighborOffset : candidateTemplateOriginal) {
+          const cv::Point p(q.x - candidateNeighborOffset[0], q.y - candidateNeighborOffset[1]);
+          if (region.contains(p) && lastQueued(p) != it &&
+              !pyramidLevel.isDstOutsideRoi(dstIdx, p.x, p.y)) {
+            lastQueued(p) = it;
+            worklists[tileOf(p)].push_back(p);
+          }
+        }
+      }
+      changed.clear();
     }
+    for (std::vector<cv::Point>& worklist : worklists) {
+      std::sort(worklist.begin(), worklist.end(), [](const cv::Point& a, const cv::Point& b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+      });
+    }
+
+    const float changedPct = 100.0f * count / countFov;
+    LOG(INFO) << std::fixed << std::setprecision(2) << folly::sformat("changed: {}%", changedPct);
   }
 }
 
+void pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterations, const int numThreads) {
+  forEachByNode(
+      pyramidLevel.rigDst.size(),
+      [&](const int dstIdx) { pingPongDst(pyramidLevel, dstIdx, iterations, numThreads); },
+      numThreads);
+}
+
 void pingPongPropagation(
     PyramidLevel<PixelType>& pyramidLevel,
     const int iterations,
     const int numThreads,
-    const filesystem::path& debugDir) {
+    const filesystem::path& debugDir,
+    ProposalBackend* backend) {
   if (pyramidLevel.level == pyramidLevel.numLevels - 1) {
     return;
   }
 
-  pingPong(pyramidLevel, iterations, numThreads);
+  if (backend) {
+    backend->pingPong(pyramidLevel, iterations);
+    if (pyramidLevel.level == kDebugPlotMatchLevel) {
+      backend->endLevel(pyramidLevel);
+    }
+  } else {
+    pingPong(pyramidLevel, iterations, numThreads);
+  }
   plotMatches(pyramidLevel, "ping_pong", debugDir);
 }
 
@@ -566,7 +828,19 @@ void getSrcMismatches(
   // Compute world point
   const cv::Mat_<float>& dstDisp = pyramidLevel.dstDisparity(dstIdx);
   const Camera& camDst = pyramidLevel.rigDst[dstIdx];
-  const auto ptWorld = dstToWorldPoint(camDst, x, y, dstDisp(y, x), dstDisp.cols, dstDisp.rows);
+  const cv::Mat_<cv::Vec3f>& dstRays = pyramidLevel.dstRays(dstIdx);
+  const auto ptWorld = dstRays.empty()
+      ? dstToWorldPoint(camDst, x, y, dstDisp(y, x), dstDisp.cols, dstDisp.rows)
+      : dstToWorldPoint(camDst, dstRays, x, y, dstDisp(y, x));
+
+  // Check if disparity in src is within 10% of dst
+  // NOTE: Technically we should be using distances from the rig origin, not from each camera
+  // origin, but the mismatch unlock is an approximation, and this approach is faster and less
+  // complex. This works well because the distance between the cameras is at least an order of
+  // magnitude smaller than any mismatches
+  static const float kFractionChange = 0.1f;
+  const float dDstMin = (1.0f - kFractionChange) * dstDisp(y, x);
+  const float dDstMax = (1.0f + kFractionChange) * dstDisp(y, x);
 
   for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
     if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx]) { // ignore itself
@@ -584,15 +858,6 @@ void getSrcMismatches(
 
     const float dSrc =
         cv_util::getPixelBilinear(pyramidLevel.dstDisparity(srcIdx), ptSrc.x(), ptSrc.y());
-
-    // Check if disparity in src is within 10% of dst
-    // NOTE: Technically we should be using distances from the rig origin, not from each camera
-    // origin, but the mismatch unlock is an approximation, and this approach is faster and less
-    // complex. This works well because the distance between the cameras is at least an order of
-    // magnitude smaller than any mismatches
-    static const float kFractionChange = 0.1f;
-    const float dDstMin = (1.0f - kFractionChange) * dstDisp(y, x);
-    const float dDstMax = (1.0f + kFractionChange) * dstDisp(y, x);
     if (dDstMin <= dSrc && dSrc <= dDstMax) {
       dispMatches.push_back(dSrc);
     } else {
@@ -681,28 +946,46 @@ void updateDstDisparityAndMismatchMask(
 //
 // Note that the closer we are to the cameras, the farther apart can (1) and
 // (2) potentially be. It'll depend on how far objects behind (0) are
+//
+// The new disparities go to dstDispNew, as the other dsts still read the current ones
 void handleDisparityMismatch(
-    std::unordered_map<std::string, cv::Mat_<float>>& mapDstDisp,
+    cv::Mat_<float>& dstDispNew,
     PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx) {
   CHECK_EQ(pyramidLevel.rigDst.size(), pyramidLevel.rigSrc.size())
       << "Mismatches only valid when considering all cameras";
 
   const std::string& dstId = pyramidLevel.rigDst[dstIdx].id;
+  profiler::ScopedStage stage(&pyramidLevel.profile, "mismatches", pyramidLevel.level, dstId);
   const cv::Mat_<float>& dstDisp = pyramidLevel.dstDisparity(dstIdx);
   cv::Mat_<bool>& dstMask = pyramidLevel.dstMismatchedDisparityMask(dstIdx);
-  cv::Mat_<float> dstDispNew(dstDisp.size(), NAN);
+  dstDispNew.create(dstDisp.size());
+  dstDispNew.setTo(NAN);
+  stage.addPixels(dstDisp.total());
+  stage.addBytes(dstDispNew.total() * sizeof(float));
 
   // For every (x, y, d) in current dst, find (x', y', d') in all src cameras
   // and check if d' is similar to d
   const cv::Mat_<float>& dstVar = pyramidLevel.dstVariance(dstIdx);
+  using Level = PyramidLevel<PixelType>;
+  std::vector<float> dispMatches;
+  std::vector<float> dispMismatches;
   for (int y = 0; y < dstDisp.rows; ++y) {
     for (int x = 0; x < dstDisp.cols; ++x) {
+      if (!pyramidLevel.isDstTile(dstIdx, x, y, Level::kTileInFov)) { // whole tile outside FOV
+        x = (x / Level::kTileSize + 1) * Level::kTileSize - 1;
+        continue;
+      }
       if (!pyramidLevel.dstFovMask(dstIdx)(y, x)) { // outside FOV
         continue;
       }
-      std::vector<float> dispMatches;
-      std::vector<float> dispMismatches;
+      if (pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) { // kept from a previous run
+        dstMask(y, x) = false;
+        dstDispNew(y, x) = dstDisp(y, x);
+        continue;
+      }
+      dispMatches.clear();
+      dispMismatches.clear();
       getSrcMismatches(dispMatches, dispMismatches, pyramidLevel, dstIdx, x, y);
       updateDstDisparityAndMismatchMask(
           dstMask(y, x),
@@ -715,7 +998,6 @@ void handleDisparityMismatch(
           pyramidLevel.varHighThresh);
     }
   }
-  mapDstDisp[dstId] = dstDispNew;
 }
 
 void handleDisparityMismatches(
@@ -729,24 +1011,21 @@ void handleDisparityMismatches(
   LOG(INFO) << "Handling source mismatches...";
   CHECK_EQ(pyramidLevel.rigDst.size(), pyramidLevel.rigSrc.size())
       << "Mismatches only valid when considering all cameras";
-  ThreadPool threadPool(numThreads);
-  std::unordered_map<std::string, cv::Mat_<float>> mapDstDisp;
-  for (const Camera& camDst : pyramidLevel.rigDst) {
-    // Preallocate buckets to avoid double-free errors when multithreading
-    mapDstDisp[camDst.id] = cv::Mat_<float>();
-  }
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    threadPool.spawn(
-        &handleDisparityMismatch, std::ref(mapDstDisp), std::ref(pyramidLevel), dstIdx);
-  }
-  threadPool.join();
-
+  // Back buffers, swapped in once every dst is done
+  std::vector<cv::Mat_<float>> dstDispsNew(pyramidLevel.rigDst.size());
+  forEachByNode(
+      pyramidLevel.rigDst.size(),
+      [&](const int dstIdx) {
+        handleDisparityMismatch(dstDispsNew[dstIdx], pyramidLevel, dstIdx);
+      },
+      numThreads);
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    mapDstDisp.at(pyramidLevel.rigDst[dstIdx].id).copyTo(pyramidLevel.dstDisparity(dstIdx));
+    std::swap(pyramidLevel.dstDisparity(dstIdx), dstDispsNew[dstIdx]);
   }
 }
 
-void randomProposal(
+// Returns the number of costs evaluated
+int randomProposal(
     PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx,
     const int y,
@@ -759,19 +1038,37 @@ void randomProposal(
   cv::Mat_<float>& dstCosts = pyramidLevel.dstCost(dstIdx);
   cv::Mat_<float>& dstConfidence = pyramidLevel.dstConfidence(dstIdx);
   const cv::Mat_<float>& variance = pyramidLevel.dstVariance(dstIdx);
+  int numEvaluations = 0;
+  using Level = PyramidLevel<PixelType>;
   for (int x = kSearchWindowRadius; x < dstDisparity.cols - kSearchWindowRadius; ++x) {
+    // Nothing to solve in the whole tile, see PyramidLevel::updateDstTiles()
+    if (!pyramidLevel.isDstTile(dstIdx, x, y, Level::kTileActive)) {
+      x = (x / Level::kTileSize + 1) * Level::kTileSize - 1;
+      continue;
+    }
+
     if (!pyramidLevel.dstFovMask(dstIdx)(y, x)) { // outside FOV
       // Keep value from previous frame
       continue;
     }
     float currDisp = dstDisparity(y, x); // upscaled disparity
 
+    // Kept from a previous run
+    if (pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) {
+      continue;
+    }
+
     // Use background value if we're outside the foreground mask
     if (!pyramidLevel.dstForegroundMask(dstIdx)(y, x)) {
       dstDisparity(y, x) = pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x);
       continue;
     }
 
+    // Seeded from the previous frame, ping pong is enough to track small changes
+    if (pyramidLevel.isDstWarmStarted(dstIdx, x, y)) {
+      continue;
+    }
+
     // Ignore locations with low variance
     // Threshold is a little lower than our high variance threshold
     // High variance locations include:
@@ -787,12 +1084,16 @@ void randomProposal(
       continue;
     }
 
-    float currCost;
-    float currConfidence;
-    std::tie(currCost, currConfidence) = computeCost(pyramidLevel, dstIdx, currDisp, x, y);
-
-    // We will refine only if we're getting much better cost
-    const float costThresh = std::fmin(0.5f * currCost, kRandomPropMaxCost);
+    // Proposals are drawn from a copy of the engine and evaluated in batches, together with the
+    // current disparity in the first one, so the dst patch is loaded once per batch. Accepting a
+    // proposal shrinks the range, so the rest of its batch is dropped and drawn again from the
+    // new range. Results are the same as evaluating one proposal at a time
+    float disps[kRandomPropBatchSize + 1];
+    std::tuple<float, float> costs[kRandomPropBatchSize + 1];
+    float currCost = 0;
+    float currConfidence = 0;
+    float costThresh = 0;
+    bool isCurrEvaluated = false;
 
     // When using background, foreground pixels must be closer than background
     const float minDisp = pyramidLevel.hasForegroundMasks
@@ -801,18 +1102,45 @@ void randomProposal(
     const float maxDisp = 1.0f / minDepthMeters;
 
     float amplitude = (maxDisp - minDisp) / 2.0f;
-    for (int i = 0; i < numProposals; ++i) {
-      float propDisp = std::uniform_real_distribution<float>(
+    for (int i = 0; !isCurrEvaluated || i < numProposals;) {
+      std::uniform_real_distribution<float> range(
           std::max(float(minDisp), currDisp - amplitude),
-          std::min(float(maxDisp), currDisp + amplitude))(engine);
-      float propCost;
-      float propConfidence;
-      std::tie(propCost, propConfidence) = computeCost(pyramidLevel, dstIdx, propDisp, x, y);
-      if (propCost < currCost && propCost < costThresh) {
-        currCost = propCost;
-        currDisp = propDisp;
-        currConfidence = propConfidence;
-        amplitude /= 2.0f;
+          std::min(float(maxDisp), currDisp + amplitude));
+      int count = 0;
+      if (!isCurrEvaluated) {
+        disps[count++] = currDisp;
+      }
+      std::default_random_engine speculative = engine;
+      const int batchSize = std::min(kRandomPropBatchSize, numProposals - i);
+      for (int j = 0; j < batchSize; ++j) {
+        disps[count++] = range(speculative);
+      }
+      // Proposals only matter if they beat both, see below
+      const float bound = isCurrEvaluated ? std::fmin(currCost, costThresh) : FLT_MAX;
+      computeCosts(pyramidLevel, dstIdx, disps, count, x, y, costs, bound);
+      numEvaluations += count;
+
+      int k = 0;
+      if (!isCurrEvaluated) {
+        std::tie(currCost, currConfidence) = costs[k++];
+        isCurrEvaluated = true;
+
+        // We will refine only if we're getting much better cost
+        costThresh = std::fmin(0.5f * currCost, kRandomPropMaxCost);
+      }
+      for (; k < count; ++k) {
+        const float propDisp = range(engine); // same draw as the speculative one
+        ++i;
+        float propCost;
+        float propConfidence;
+        std::tie(propCost, propConfidence) = costs[k];
+        if (propCost < currCost && propCost < costThresh) {
+          currCost = propCost;
+          currDisp = propDisp;
+          currConfidence = propConfidence;
+          amplitude /= 2.0f;
+          break;
+        }
       }
     }
 
@@ -820,6 +1148,287 @@ void randomProposal(
     dstCosts(y, x) = currCost;
     dstConfidence(y, x) = currConfidence;
   }
+  return numEvaluations;
+}
+
+void seedFromPreviousFrame(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<float>>& prevDisparities,
+    const std::vector<cv::Mat_<PixelType>>& prevColors,
+    const int numThreads) {
+  CHECK_EQ(prevDisparities.size(), pyramidLevel.rigDst.size());
+  CHECK_EQ(prevColors.size(), pyramidLevel.rigDst.size());
+  const float motionThresh = kWarmStartMotionThresh * std::numeric_limits<uint16_t>::max();
+
+  int numSeeded = 0;
+  int numPixels = 0;
+  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+    const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
+    const cv::Mat_<float>& prevDisparity = prevDisparities[dstIdx];
+    const cv::Mat_<PixelType>& prevColor = prevColors[dstIdx];
+    CHECK_EQ(prevDisparity.size(), color.size());
+    CHECK_EQ(prevColor.size(), color.size());
+
+    // A pixel is moving if its color changed or it had no disparity in the previous frame
+    cv::Mat_<bool> moving(color.size());
+    parallelFor(
+        0,
+        color.rows,
+        kRowsPerTask,
+        [&](const int y) {
+          for (int x = 0; x < color.cols; ++x) {
+            float diff = 0;
+            for (int c = 0; c < int(PixelType::channels); ++c) {
+              diff = std::max(diff, std::fabs(float(color(y, x)[c]) - float(prevColor(y, x)[c])));
+            }
+            moving(y, x) = diff > motionThresh || std::isnan(prevDisparity(y, x));
+          }
+        },
+        numThreads);
+    moving = cv_util::dilate(moving, kWarmStartMotionDilation);
+
+    cv::Mat_<float>& dstDisparity = pyramidLevel.dstDisparity(dstIdx);
+    cv::Mat_<bool>& seeded = pyramidLevel.dstWarmStartMask(dstIdx);
+    seeded.create(color.size());
+    for (int y = 0; y < color.rows; ++y) {
+      for (int x = 0; x < color.cols; ++x) {
+        seeded(y, x) = !moving(y, x);
+        if (seeded(y, x)) {
+          dstDisparity(y, x) = prevDisparity(y, x);
+          ++numSeeded;
+        }
+      }
+    }
+    numPixels += color.total();
+  }
+
+  LOG(INFO) << folly::sformat(
+      "Seeded {:.1f}% of the pixels from the previous frame", 100.0f * numSeeded / numPixels);
+}
+
+void restrictToRegionOfInterest(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<float>>& prevDisparities,
+    const std::vector<cv::Mat_<bool>>& roiMasks,
+    const int numThreads) {
+  CHECK_EQ(prevDisparities.size(), pyramidLevel.rigDst.size());
+  CHECK_EQ(roiMasks.size(), pyramidLevel.rigDst.size());
+  const cv::Size& size = pyramidLevel.sizeLevel;
+  const cv::Size tiles(
+      (size.width + kRoiTileSize - 1) / kRoiTileSize,
+      (size.height + kRoiTileSize - 1) / kRoiTileSize);
+
+  std::atomic<int> numRoi(0);
+  ThreadPool threadPool(numThreads);
+  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+    threadPool.spawn([&, dstIdx] {
+      const cv::Mat_<float>& prevDisparity = prevDisparities[dstIdx];
+      CHECK_EQ(prevDisparity.size(), size);
+
+      // A tile is in the region if any of its pixels is, then the region grows by whole tiles
+      cv::Mat_<bool> roi;
+      cv::resize(roiMasks[dstIdx], roi, size, 0, 0, cv::INTER_NEAREST);
+      cv::Mat_<bool> roiTiles(tiles, false);
+      for (int y = 0; y < size.height; ++y) {
+        for (int x = 0; x < size.width; ++x) {
+          if (roi(y, x)) {
+            roiTiles(y / kRoiTileSize, x / kRoiTileSize) = true;
+          }
+        }
+      }
+      roiTiles = cv_util::dilate(roiTiles, kRoiTileDilation);
+
+      cv::Mat_<bool>& roiMask = pyramidLevel.dstRoiMask(dstIdx);
+      cv::Mat_<float>& dstDisparity = pyramidLevel.dstDisparity(dstIdx);
+      roiMask.create(size);
+      int count = 0;
+      for (int y = 0; y < size.height; ++y) {
+        for (int x = 0; x < size.width; ++x) {
+          roiMask(y, x) = roiTiles(y / kRoiTileSize, x / kRoiTileSize);
+          if (roiMask(y, x)) {
+            ++count;
+          } else {
+            dstDisparity(y, x) = prevDisparity(y, x);
+          }
+        }
+      }
+      numRoi += count;
+    });
+  }
+  threadPool.join();
+
+  LOG(INFO) << folly::sformat(
+      "Re-solving {:.1f}% of the pixels",
+      100.0f * numRoi / (size.area() * pyramidLevel.rigDst.size()));
+}
+
+void restrictToUnverifiedTiles(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const float maxCost,
+    const int numThreads) {
+  const cv::Size& size = pyramidLevel.sizeLevel;
+  const cv::Size tiles(
+      (size.width + kRoiTileSize - 1) / kRoiTileSize,
+      (size.height + kRoiTileSize - 1) / kRoiTileSize);
+  const int radius = kSearchWindowRadius;
+
+  std::atomic<int> numRoi(0);
+  forEachByNode(
+      pyramidLevel.rigDst.size(),
+      [&](const int dstIdx) {
+        profiler::ScopedStage stage(
+            &pyramidLevel.profile, "verify", pyramidLevel.level, pyramidLevel.rigDst[dstIdx].id);
+        const cv::Mat_<float>& disparity = pyramidLevel.dstDisparity(dstIdx);
+        const cv::Mat_<bool>& fov = pyramidLevel.dstFovMask(dstIdx);
+        const cv::Mat_<bool>& foreground = pyramidLevel.dstForegroundMask(dstIdx);
+        const cv::Mat_<float>& variance = pyramidLevel.dstVariance(dstIdx);
+        cv::Mat_<float>& costs = pyramidLevel.dstCost(dstIdx);
+        cv::Mat_<float>& confidences = pyramidLevel.dstConfidence(dstIdx);
+
+        // A tile is unverified as soon as one of its pixels is, the rest of it is not evaluated
+        cv::Mat_<bool> unverified(tiles, false);
+        parallelFor(
+            0,
+            tiles.height,
+            1,
+            [&](const int ty) {
+              int numEvaluations = 0;
+              const int yBegin = std::max(ty * kRoiTileSize, radius);
+              const int yEnd = std::min((ty + 1) * kRoiTileSize, size.height - radius);
+              for (int tx = 0; tx < tiles.width; ++tx) {
+                const int xBegin = std::max(tx * kRoiTileSize, radius);
+                const int xEnd = std::min((tx + 1) * kRoiTileSize, size.width - radius);
+                float dispMin = FLT_MAX;
+                float dispMax = 0;
+                bool isUnverified = false;
+                for (int y = yBegin; y < yEnd && !isUnverified; ++y) {
+                  for (int x = xBegin; x < xEnd && !isUnverified; ++x) {
+                    if (!fov(y, x) || pyramidLevel.isDstOutsideRoi(dstIdx, x, y)) {
+                      continue;
+                    }
+                    dispMin = std::fmin(dispMin, disparity(y, x));
+                    dispMax = std::fmax(dispMax, disparity(y, x));
+
+                    // Same pixels as ping pong solves
+                    if (!foreground(y, x) || variance(y, x) < pyramidLevel.varNoiseFloor) {
+                      continue;
+                    }
+                    std::tie(costs(y, x), confidences(y, x)) =
+                        computeCost(pyramidLevel, dstIdx, disparity(y, x), x, y, maxCost);
+                    ++numEvaluations;
+                    isUnverified = costs(y, x) > maxCost;
+                  }
+                }
+                unverified(ty, tx) = isUnverified || dispMax > (1 + kAdaptiveEdgeRatio) * dispMin;
+              }
+              stage.addCostEvaluations(numEvaluations);
+            },
+            numThreads);
+        stage.addPixels(disparity.total());
+        unverified = cv_util::dilate(unverified, kRoiTileDilation);
+
+        // Within the region of interest, if any
+        cv::Mat_<bool>& roiMask = pyramidLevel.dstRoiMask(dstIdx);
+        if (roiMask.empty()) {
+          roiMask = cv::Mat_<bool>(size, true);
+        }
+        int count = 0;
+        for (int y = 0; y < size.height; ++y) {
+          for (int x = 0; x < size.width; ++x) {
+            roiMask(y, x) = roiMask(y, x) && unverified(y / kRoiTileSize, x / kRoiTileSize);
+            count += roiMask(y, x);
+          }
+        }
+        numRoi += count;
+      },
+      numThreads);
+
+  LOG(INFO) << folly::sformat(
+      "Refining {:.1f}% of the pixels, the rest passed verification",
+      100.0f * numRoi / (size.area() * pyramidLevel.rigDst.size()));
+}
+
+// Same as Camera::sees, with a margin of margin normalized coordinates around the sensor
+static bool seesWithMargin(const Camera& cam, const Camera::Vector3& p, const double margin) {
+  if (cam.isOutsideFov(p)) {
+    return false;
+  }
+  const Camera::Vector2 pix = cam.pixel(p);
+  const Camera::Vector2 m = margin * cam.resolution;
+  return -m.x() <= pix.x() && pix.x() < cam.resolution.x() + m.x() && -m.y() <= pix.y() &&
+      pix.y() < cam.resolution.y() + m.y();
+}
+
+void computeTileSrcs(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const float minDepthMeters,
+    const float maxDepthMeters,
+    const int numThreads) {
+  const int numSrcs = pyramidLevel.rigSrc.size();
+  const int kTileSize = PyramidLevel<PixelType>::kSrcTileSize;
+  const int kDisparitySamples = 16;
+  const cv::Size& size = pyramidLevel.sizeLevel;
+  const int tilesX = (size.width + kTileSize - 1) / kTileSize;
+  const int tilesY = (size.height + kTileSize - 1) / kTileSize;
+  const float minDisparity = 1.0f / maxDepthMeters;
+  const float maxDisparity = 1.0f / minDepthMeters;
+  for (PyramidLevel<PixelType>::Dst& dst : pyramidLevel.dsts) {
+    dst.tileSrcs.clear();
+  }
+  if (numSrcs > 64) {
+    return; // would not fit in the bit masks, computeCost() visits every src
+  }
+
+  ThreadPool threadPool(numThreads);
+  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+    threadPool.spawn([&, dstIdx] {
+      const Camera& camDst = pyramidLevel.rigDst[dstIdx];
+      const cv::Mat_<cv::Vec3f>& dstRays = pyramidLevel.dstRays(dstIdx);
+
+      // Margin of one tile of a src the size of dst
+      const double margin = double(kTileSize) / size.width;
+
+      // Srcs that see the points at tile corners, at any of the sample disparities
+      std::vector<uint64_t> corners((tilesX + 1) * (tilesY + 1), 0);
+      for (int cy = 0; cy <= tilesY; ++cy) {
+        for (int cx = 0; cx <= tilesX; ++cx) {
+          const int x = std::min(cx * kTileSize, size.width - 1);
+          const int y = std::min(cy * kTileSize, size.height - 1);
+          const Camera::Vector3 pUnit = dstRays.empty()
+              ? dstToWorldPoint(camDst, x, y, 1.0f, size.width, size.height)
+              : dstToWorldPoint(camDst, dstRays, x, y, 1.0f);
+          const Camera::Vector3 ray = pUnit - camDst.position;
+          uint64_t& bits = corners[cy * (tilesX + 1) + cx];
+          for (int i = 0; i < kDisparitySamples; ++i) {
+            const float disparity =
+                minDisparity + (maxDisparity - minDisparity) * i / (kDisparitySamples - 1);
+            const Camera::Vector3 pWorld = camDst.position + ray / disparity;
+            for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+              if (!((bits >> srcIdx) & 1) &&
+                  seesWithMargin(pyramidLevel.rigSrc[srcIdx], pWorld, margin)) {
+                bits |= uint64_t(1) << srcIdx;
+              }
+            }
+          }
+        }
+      }
+
+      // Each tile takes the corners of its 3x3 neighborhood of tiles
+      std::vector<uint64_t>& tileSrcs = pyramidLevel.dsts[dstIdx].tileSrcs;
+      tileSrcs.assign(tilesX * tilesY, 0);
+      for (int ty = 0; ty < tilesY; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+          uint64_t& bits = tileSrcs[ty * tilesX + tx];
+          for (int cy = std::max(ty - 1, 0); cy <= std::min(ty + 2, tilesY); ++cy) {
+            for (int cx = std::max(tx - 1, 0); cx <= std::min(tx + 2, tilesX); ++cx) {
+              bits |= corners[cy * (tilesX + 1) + cx];
+            }
+          }
+        }
+      }
+    });
+  }
+  threadPool.join();
 }
 
 void preprocessLevel(
@@ -846,28 +1455,52 @@ void randomProposals(
     const float minDepthMeters,
     const float maxDepthMeters,
     const int numThreads,
-    const filesystem::path& debugDir) {
+    const filesystem::path& debugDir,
+    ProposalBackend* backend) {
   if (numProposals <= 0 || pyramidLevel.level == pyramidLevel.numLevels - 1) {
     return;
   }
 
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    LOG(INFO) << folly::sformat("-- random proposals: {}", pyramidLevel.rigDst[dstIdx].id);
-    ThreadPool threadPool(numThreads);
-    const cv::Size size = pyramidLevel.dstDisparity(dstIdx).size();
-    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
-      threadPool.spawn(
-          &randomProposal,
-          std::ref(pyramidLevel),
-          dstIdx,
-          y,
-          numProposals,
-          minDepthMeters,
-          maxDepthMeters);
+  if (backend) {
+    backend->randomProposals(pyramidLevel, numProposals, minDepthMeters, maxDepthMeters);
+    if (pyramidLevel.level == kDebugPlotMatchLevel) {
+      backend->endLevel(pyramidLevel);
+      plotMatches(pyramidLevel, "random_prop", debugDir);
     }
-    threadPool.join();
+    return;
   }
 
+  forEachByNode(
+      pyramidLevel.rigDst.size(),
+      [&](const int dstIdx) {
+        LOG(INFO) << folly::sformat("-- random proposals: {}", pyramidLevel.rigDst[dstIdx].id);
+        profiler::ScopedStage stage(
+            &pyramidLevel.profile,
+            "randomProposals",
+            pyramidLevel.level,
+            pyramidLevel.rigDst[dstIdx].id);
+        const cv::Size size = pyramidLevel.dstDisparity(dstIdx).size();
+
+        // Rows crossing a tile with something to solve, see PyramidLevel::updateDstTiles()
+        std::vector<int> rows;
+        for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+          if (pyramidLevel.isDstTileInRow(dstIdx, y, PyramidLevel<PixelType>::kTileActive)) {
+            rows.push_back(y);
+          }
+        }
+        parallelFor(
+            0,
+            int(rows.size()),
+            kRowsPerTask,
+            [&](const int i) {
+              stage.addCostEvaluations(randomProposal(
+                  pyramidLevel, dstIdx, rows[i], numProposals, minDepthMeters, maxDepthMeters));
+            },
+            numThreads);
+        stage.addPixels(rows.size() * size.width);
+      },
+      numThreads);
+
   plotMatches(pyramidLevel, "random_prop", debugDir);
 }
 
@@ -877,6 +1510,8 @@ void bilateralFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads
       std::max(std::ceil(kBilateralSpaceRadiusMax * scale), float(kBilateralSpaceRadiusMin));
 
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+    profiler::ScopedStage stage(
+        &pyramidLevel.profile, "bilateral", pyramidLevel.level, pyramidLevel.rigDst[dstIdx].id);
     cv::Mat_<float>& disparity = pyramidLevel.dstDisparity(dstIdx);
     const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
     const cv::Mat_<bool>& maskFov = pyramidLevel.dstFovMask(dstIdx);
@@ -895,8 +1530,12 @@ void bilateralFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads
             kBilateralWeightR,
             numThreads);
 
-    // Only use filtered version on foreground pixels
-    disparityFiltered.copyTo(disparity, pyramidLevel.dstForegroundMask(dstIdx));
+    // Only use filtered version on foreground pixels, in the region of interest if any
+    const cv::Mat_<bool>& maskRoi = pyramidLevel.dstRoiMask(dstIdx);
+    const cv::Mat_<bool> maskCopy = maskRoi.empty() ? maskFg : cv::Mat_<bool>(maskFg & maskRoi);
+    disparityFiltered.copyTo(disparity, maskCopy);
+    stage.addPixels(disparity.total());
+    stage.addBytes(disparity.total() * (sizeof(float) + sizeof(bool)));
   }
 }
 
@@ -904,14 +1543,19 @@ void medianFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
   ThreadPool threadPool(numThreads);
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
     threadPool.spawn([&, dstIdx] {
+      profiler::ScopedStage stage(
+          &pyramidLevel.profile, "median", pyramidLevel.level, pyramidLevel.rigDst[dstIdx].id);
       cv::Mat_<float>& disparity = pyramidLevel.dstDisparity(dstIdx);
       const cv::Mat_<float>& bgDisparity = pyramidLevel.dstBackgroundDisparity(dstIdx);
       const cv::Mat_<bool>& maskFov = pyramidLevel.dstFovMask(dstIdx);
       const cv::Mat_<bool>& maskFg = pyramidLevel.dstForegroundMask(dstIdx);
       const cv::Mat_<bool> mask = maskFov & maskFg;
-      cv::Mat_<float> disparityFiltered =
-          cv_util::maskedMedianBlur(disparity, bgDisparity, mask, kMedianFilterRadius);
-      disparityFiltered.copyTo(disparity);
+      static const bool kIgnoreNan = true;
+      cv::Mat_<float> disparityFiltered = cv_util::maskedMedianBlur(
+          disparity, bgDisparity, mask, kMedianFilterRadius, kIgnoreNan, numThreads);
+      disparityFiltered.copyTo(disparity, pyramidLevel.dstRoiMask(dstIdx)); // empty = everywhere
+      stage.addPixels(disparity.total());
+      stage.addBytes(disparity.total() * (sizeof(float) + sizeof(bool)));
     });
   }
 
@@ -922,6 +1566,10 @@ void saveResults(
     PyramidLevel<PixelType>& pyramidLevel,
     const bool saveDebugImages,
     const std::string& outputFormatsIn) {
+  profiler::ScopedStage stage(&pyramidLevel.profile, "saveResults", pyramidLevel.level);
+  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+    stage.addPixels(pyramidLevel.dstDisparity(dstIdx).total());
+  }
   if (saveDebugImages) {
     LOG(INFO) << folly::sformat("Saving debug images for pyramid level {}...", pyramidLevel.level);
     pyramidLevel.saveDebugImages();
@@ -959,9 +1607,11 @@ void precomputeProjections(PyramidLevel<PixelType>& pyramidLevel, const int thre
     const cv::Size& dstSize = pyramidLevel.dstColor(dstIdx).size();
     Camera camDst = pyramidLevel.rigDst[dstIdx].rescale({dstSize.width, dstSize.height});
 
-    // Project every src to current dst
+    // Project every src to current dst, on the numa node the dst is processed on, so that is where
+    // the projections are first touched
+    const int node = numa::nodeOf(dstIdx, pyramidLevel.rigDst.size());
     for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
-      threadPool.spawn([&, srcIdx] {
+      threadPool.spawnOnNode(node, [&, srcIdx] {
         // Project from current level src size
         const cv::Size& srcSize = pyramidLevel.srcs[srcIdx].color.size();
         Camera camSrc = pyramidLevel.rigSrc[srcIdx].rescale({srcSize.width, srcSize.height});
@@ -974,27 +1624,222 @@ void precomputeProjections(PyramidLevel<PixelType>& pyramidLevel, const int thre
   }
 }
 
+namespace {
+
+// Warp cache file: WarpCacheHeader, then numPairs warps, then numPairs inverse warps
+const uint32_t kWarpCacheMagic = 0x50525744; // "DWRP"
+
+struct WarpCacheHeader {
+  uint32_t magic;
+  uint32_t numPairs;
+  int32_t warpRows;
+  int32_t warpCols;
+  int32_t warpInvRows;
+  int32_t warpInvCols;
+};
+
+struct MappedFile {
+  explicit MappedFile(const filesystem::path& path)
+      : file(path.string().c_str(), boost::interprocess::read_only),
+        region(file, boost::interprocess::read_only) {}
+
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+};
+
+std::string warpCacheKey(const PyramidLevel<PixelType>& pyramidLevel) {
+  std::string key;
+  for (const Camera& cam : pyramidLevel.rigSrc) {
+    key += folly::toJson(cam.serialize());
+  }
+  for (const Camera& cam : pyramidLevel.rigDst) {
+    key += folly::toJson(cam.serialize());
+  }
+  const cv::Size& srcSize = pyramidLevel.srcColor(0).size();
+  const cv::Size& dstSize = pyramidLevel.dstColor(0).size();
+  key += folly::sformat(
+      "{}x{} {}x{}", srcSize.width, srcSize.height, dstSize.width, dstSize.height);
+  return folly::sformat("{:016x}", folly::hash::fnv64(key));
+}
+
+} // namespace
+
+bool LevelProjections::loadCachedWarps(const filesystem::path& path, const int numPairs) {
+  if (!filesystem::exists(path)) {
+    return false;
+  }
+  std::shared_ptr<MappedFile> mapped;
+  try {
+    mapped = std::make_shared<MappedFile>(path);
+  } catch (const boost::interprocess::interprocess_exception& e) {
+    LOG(WARNING) << folly::sformat("Cannot map warp cache {}: {}", path.string(), e.what());
+    return false;
+  }
+  const size_t size = mapped->region.get_size();
+  char* data = static_cast<char*>(mapped->region.get_address());
+  if (size < sizeof(WarpCacheHeader)) {
+    return false;
+  }
+  const WarpCacheHeader& header = *reinterpret_cast<const WarpCacheHeader*>(data);
+  const size_t warpBytes = size_t(header.warpRows) * header.warpCols * sizeof(cv::Vec2f);
+  const size_t warpInvBytes = size_t(header.warpInvRows) * header.warpInvCols * sizeof(cv::Vec2f);
+  if (header.magic != kWarpCacheMagic || int(header.numPairs) != numPairs ||
+      size != sizeof(header) + numPairs * (warpBytes + warpInvBytes)) {
+    LOG(WARNING) << folly::sformat("Ignoring stale warp cache {}", path.string());
+    return false;
+  }
+
+  // Mats point straight into the read-only mapping
+  char* p = data + sizeof(header);
+  for (int i = 0; i < numPairs; ++i, p += warpBytes) {
+    warps.emplace_back(header.warpRows, header.warpCols, reinterpret_cast<cv::Vec2f*>(p));
+  }
+  for (int i = 0; i < numPairs; ++i, p += warpInvBytes) {
+    warpsInv.emplace_back(header.warpInvRows, header.warpInvCols, reinterpret_cast<cv::Vec2f*>(p));
+  }
+  mappedWarps = mapped;
+  return true;
+}
+
+void LevelProjections::saveCachedWarps(const filesystem::path& path) const {
+  CHECK(!warps.empty());
+  WarpCacheHeader header;
+  header.magic = kWarpCacheMagic;
+  header.numPairs = warps.size();
+  header.warpRows = warps[0].rows;
+  header.warpCols = warps[0].cols;
+  header.warpInvRows = warpsInv[0].rows;
+  header.warpInvCols = warpsInv[0].cols;
+
+  // Write to a temporary file and rename, so concurrent readers never see a partial file
+  filesystem::create_directories(path.parent_path());
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  std::ofstream file(tmpPath.string(), std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const std::vector<cv::Mat_<cv::Vec2f>>* mats : {&warps, &warpsInv}) {
+    for (const cv::Mat_<cv::Vec2f>& mat : *mats) {
+      for (int y = 0; y < mat.rows; ++y) {
+        file.write(reinterpret_cast<const char*>(mat.ptr(y)), mat.cols * sizeof(cv::Vec2f));
+      }
+    }
+  }
+  file.close();
+  if (!file) {
+    LOG(WARNING) << folly::sformat("Cannot write warp cache {}", tmpPath.string());
+    filesystem::remove(tmpPath);
+    return;
+  }
+  filesystem::rename(tmpPath, path);
+}
+
+void LevelProjections::acquire(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int slot,
+    const int numThreads) {
+  std::vector<PyramidLevel<PixelType>::Proj>& slotProjs = recycled[slot];
+  if (!slotProjs.empty()) {
+    CHECK_EQ(slotProjs.size(), pyramidLevel.projs.size());
+    pyramidLevel.projs.swap(slotProjs);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (warps.empty()) {
+    const filesystem::path cachePath = cacheDir.empty()
+        ? filesystem::path()
+        : cacheDir / folly::sformat("{}.warps", warpCacheKey(pyramidLevel));
+    if (!cachePath.empty() && loadCachedWarps(cachePath, pyramidLevel.projs.size())) {
+      LOG(INFO) << folly::sformat("Using cached projections {}", cachePath.string());
+    } else {
+      precomputeProjections(pyramidLevel, numThreads);
+      for (const PyramidLevel<PixelType>::Proj& proj : pyramidLevel.projs) {
+        warps.push_back(proj.projWarp);
+        warpsInv.push_back(proj.projWarpInv);
+      }
+      if (!cachePath.empty()) {
+        saveCachedWarps(cachePath);
+      }
+      return;
+    }
+  }
+  CHECK_EQ(warps.size(), pyramidLevel.projs.size());
+  for (int i = 0; i < int(warps.size()); ++i) {
+    pyramidLevel.projs[i].projWarp = warps[i];
+    pyramidLevel.projs[i].projWarpInv = warpsInv[i];
+  }
+}
+
+void LevelProjections::release(PyramidLevel<PixelType>& pyramidLevel, const int slot) {
+  recycled[slot].swap(pyramidLevel.projs);
+}
+
 void reprojectColors(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
   LOG(INFO) << "Reprojecting colors...";
   ThreadPool threadPool(numThreads);
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    // Project every src to current dst
+    profiler::ScopedStage stage(
+        &pyramidLevel.profile,
+        "reprojectColors",
+        pyramidLevel.level,
+        pyramidLevel.rigDst[dstIdx].id);
+
+    // Project every src to current dst, on the numa node the dst is processed on, so that is where
+    // the projections are first touched
+    const int node = numa::nodeOf(dstIdx, pyramidLevel.rigDst.size());
     for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
-      threadPool.spawn([&, srcIdx] {
+      threadPool.spawnOnNode(node, [&, srcIdx] {
         // Project from current level src size
+        // Outputs reuse the buffers left by a previous frame, if any (see recycleProjections)
         const cv::Mat_<PixelType>& srcColor = pyramidLevel.srcColor(srcIdx);
         cv::Mat_<PixelType>& srcProjColor = pyramidLevel.dstProjColor(dstIdx, srcIdx);
-        if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx]) {
+        cv::Mat_<PixelType>& srcProjColorBias = pyramidLevel.dstProjColorBias(dstIdx, srcIdx);
+        const bool isSelf = srcIdx == pyramidLevel.dst2srcIdxs[dstIdx];
+        if (pyramidLevel.compactProjColors && !isSelf) {
+          // Projected at full precision, stored in 8 bits
+          cv::Mat_<CompactPixelType>& colorCompact =
+              pyramidLevel.dstProjColorCompact(dstIdx, srcIdx);
+          cv::Mat_<CompactPixelType>& biasCompact =
+              pyramidLevel.dstProjColorBiasCompact(dstIdx, srcIdx);
+          const uchar* const compactData = colorCompact.data;
+          const cv::Mat_<PixelType> projColor =
+              project(srcColor, pyramidLevel.dstProjWarpInv(dstIdx, srcIdx));
+          compactColor(colorCompact, projColor);
+          cv::Mat_<PixelType> bias;
+          colorBiasAndVariance(&bias, nullptr, projColor, kSearchWindowRadius, numThreads);
+          compactColor(biasCompact, bias);
+          srcProjColor.release();
+          srcProjColorBias.release();
+
+          stage.addPixels(colorCompact.total());
+          if (colorCompact.data != compactData) {
+            stage.addBytes(2 * colorCompact.total() * colorCompact.elemSize());
+          }
+          return;
+        }
+        pyramidLevel.dstProjColorCompact(dstIdx, srcIdx).release();
+        pyramidLevel.dstProjColorBiasCompact(dstIdx, srcIdx).release();
+
+        const uchar* const projData = srcProjColor.data;
+        const uchar* const biasData = srcProjColorBias.data;
+        if (isSelf) {
           // No projection needed if src = dst
           srcProjColor = srcColor;
         } else {
           const cv::Mat_<cv::Vec2f>& warpDstToSrc = pyramidLevel.dstProjWarpInv(dstIdx, srcIdx);
-          srcProjColor = project(srcColor, warpDstToSrc);
+          project(srcProjColor, srcColor, warpDstToSrc);
         }
 
         // Color bias is just the average over a given area around each pixel
-        pyramidLevel.dstProjColorBias(dstIdx, srcIdx) =
-            colorBias(srcProjColor, kSearchWindowRadius);
+        colorBiasAndVariance(
+            &srcProjColorBias, nullptr, srcProjColor, kSearchWindowRadius, numThreads);
+
+        stage.addPixels(srcProjColor.total());
+        if (srcProjColor.data != projData && srcProjColor.data != srcColor.data) {
+          stage.addBytes(srcProjColor.total() * srcProjColor.elemSize());
+        }
+        if (srcProjColorBias.data != biasData) {
+          stage.addBytes(srcProjColorBias.total() * srcProjColorBias.elemSize());
+        }
       });
     }
     threadPool.join();
@@ -1015,21 +1860,60 @@ void processLevel(
     const int pingPongIterations,
     const int mismatchesStartLevel,
     const bool doBilateralFilter,
-    const int threads) {
+    const int threads,
+    ProposalBackend* backend,
+    const bool saveOutputs,
+    const float adaptiveMaxCost) {
   LOG(INFO) << folly::sformat("Processing {} level {}", pyramidLevel.frameName, pyramidLevel.level);
-  reprojectColors(pyramidLevel, threads);
-  preprocessLevel(pyramidLevel, minDepthM, maxDepthM, partialCoverage, useForegroundMasks, threads);
-  randomProposals(pyramidLevel, numRandomProposals, minDepthM, maxDepthM, threads, outputRoot);
-  pingPongPropagation(pyramidLevel, pingPongIterations, threads, outputRoot);
-  handleDisparityMismatches(pyramidLevel, mismatchesStartLevel, threads);
+
+  // Profile entries with an empty dst time a whole stage, stages report per dst counters
+  auto runStage = [&](const std::string& name, const std::function<void()>& fn) {
+    profiler::ScopedStage stage(&pyramidLevel.profile, name, pyramidLevel.level);
+    fn();
+    pyramidLevel.updatePeakMatBytes();
+  };
+  runStage("reprojectColors", [&] { reprojectColors(pyramidLevel, threads); });
+  runStage("tileSrcs", [&] { computeTileSrcs(pyramidLevel, minDepthM, maxDepthM, threads); });
+  runStage("preprocessLevel", [&] {
+    preprocessLevel(
+        pyramidLevel, minDepthM, maxDepthM, partialCoverage, useForegroundMasks, threads);
+  });
+  if (pyramidLevel.level < pyramidLevel.numLevels - 1 && !backend) {
+    if (adaptiveMaxCost > 0) {
+      runStage("verify", [&] {
+        restrictToUnverifiedTiles(pyramidLevel, adaptiveMaxCost, threads);
+      });
+    }
+    runStage("tiles", [&] {
+      for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+        pyramidLevel.updateDstTiles(dstIdx);
+      }
+    });
+  }
+  runStage("randomProposals", [&] {
+    randomProposals(
+        pyramidLevel, numRandomProposals, minDepthM, maxDepthM, threads, outputRoot, backend);
+  });
+  runStage("pingPong", [&] {
+    pingPongPropagation(pyramidLevel, pingPongIterations, threads, outputRoot, backend);
+  });
+  if (backend) {
+    runStage("backend", [&] { backend->endLevel(pyramidLevel); });
+  }
+  runStage("mismatches", [&] {
+    handleDisparityMismatches(pyramidLevel, mismatchesStartLevel, threads);
+  });
   if (doBilateralFilter) {
-    bilateralFilter(pyramidLevel, threads);
+    runStage("bilateral", [&] { bilateralFilter(pyramidLevel, threads); });
   }
   if (doMedianFilter) {
-    medianFilter(pyramidLevel, threads);
+    runStage("median", [&] { medianFilter(pyramidLevel, threads); });
   }
   maskFov(pyramidLevel, threads);
-  saveResults(pyramidLevel, saveDebugImages, outputFormats);
+  if (saveOutputs) {
+    saveResults(pyramidLevel, saveDebugImages, outputFormats);
+  }
+  pyramidLevel.saveProfile();
 }
 
 } // namespace depth_estimation
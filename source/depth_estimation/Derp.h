@@ -9,6 +9,8 @@
 
 #include "source/depth_estimation/DerpUtil.h"
 
+#include <cfloat>
+#include <mutex>
 #include <random>
 
 #include <gflags/gflags.h>
@@ -29,12 +31,28 @@ static const int kMinOverlappingCams = 2;
 static const int kDoColorPruning = false; // only use perceptually similar color neighbors for cost
 static const int kColorPruningNumNeighbors = 25;
 
+// Parallelism: number of consecutive rows handled by each task in per-row stages
+static const int kRowsPerTask = 4;
+static const int kPingPongTileSize = 64; // square tiles, small enough to stay in L2
+
 // Brute force
 static const int kNumDepths = 150; // for brute-force step
 
 // Random proposals
 static const float kRandomPropMaxCost = 5.0;
 static const float kRandomPropHighVarDeviation = 0.1;
+static const int kRandomPropBatchSize = 8; // proposals whose costs are computed together
+
+// Region of interest
+static const int kRoiTileSize = 16; // regions of interest are re-solved in whole tiles
+static const int kRoiTileDilation = 1; // tiles around the region of interest are re-solved too
+
+// Adaptive refinement
+static const float kAdaptiveEdgeRatio = 0.1; // tiles whose disparities differ more are refined
+
+// Temporal warm start
+static const float kWarmStartMotionThresh = 0.02; // max channel difference, color range is [0, 1]
+static const int kWarmStartMotionDilation = 2; // pixels around a change are treated as moving
 
 // Median filter
 static const int kMedianFilterRadius = 1; // must be 1 or 2
@@ -54,6 +72,25 @@ static const std::string kDebugPlotMatchDst = "";
 static const int kDebugPlotMatchX = -1;
 static const int kDebugPlotMatchY = -1;
 
+// Optional accelerator for the two cost-heavy stages of a level (random proposals and ping pong
+// propagation). Results must end up in the level's disparity, cost and confidence mats by the time
+// endLevel() returns; in between, a backend is free to keep them elsewhere (e.g. on the GPU)
+class ProposalBackend {
+ public:
+  virtual ~ProposalBackend() {}
+
+  virtual void randomProposals(
+      PyramidLevel<PixelType>& pyramidLevel,
+      const int numProposals,
+      const float minDepthMeters,
+      const float maxDepthMeters) = 0;
+
+  virtual void pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterations) = 0;
+
+  // Write any pending results back to pyramidLevel and release per-level resources
+  virtual void endLevel(PyramidLevel<PixelType>& pyramidLevel) = 0;
+};
+
 void plotMatches(
     const PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const std::string& caller,
@@ -61,7 +98,8 @@ void plotMatches(
 
 void getPyramidLevelSizes(std::map<int, cv::Size>& sizes, const filesystem::path& imageDir);
 
-void computeBruteForceCosts(
+// Returns the number of costs evaluated
+int computeBruteForceCosts(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int dstIdx,
     const float disparity,
@@ -89,7 +127,8 @@ void pingPongPropagation(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int iterations,
     const int numThreads = -1,
-    const filesystem::path& debugDir = "");
+    const filesystem::path& debugDir = "",
+    ProposalBackend* backend = nullptr);
 
 void handleDisparityMismatches(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
@@ -100,6 +139,81 @@ void precomputeProjections(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int numThreads = -1);
 
+// Projection buffers shared by the frames of a level
+// Warps only depend on the cameras and the level size, so they are computed for the first frame
+// and linked (read-only) into the others. Projected colors change every frame, but each frame slot
+// recycles the buffers of the last frame it processed instead of allocating new ones
+// If cacheDir is not empty, warps are also saved there, keyed by a hash of the rig and the level
+// sizes. Later runs (and other processes on the same node) memory-map the file instead of
+// computing the warps, so they share a single copy through the page cache
+class LevelProjections {
+ public:
+  explicit LevelProjections(const int numSlots, const filesystem::path& cacheDir = "")
+      : recycled(numSlots), cacheDir(cacheDir) {}
+
+  // Sets up the projections of a new frame. Slots can call this concurrently
+  void acquire(PyramidLevel<PixelType>& pyramidLevel, const int slot, const int numThreads = -1);
+
+  // Takes back the buffers of a finished frame
+  void release(PyramidLevel<PixelType>& pyramidLevel, const int slot);
+
+ private:
+  std::mutex mutex;
+  std::vector<cv::Mat_<cv::Vec2f>> warps;
+  std::vector<cv::Mat_<cv::Vec2f>> warpsInv;
+  std::vector<std::vector<PyramidLevel<PixelType>::Proj>> recycled;
+
+  bool loadCachedWarps(const filesystem::path& path, const int numPairs);
+  void saveCachedWarps(const filesystem::path& path) const;
+
+  const filesystem::path cacheDir;
+  std::shared_ptr<void> mappedWarps; // keeps the memory behind warps/warpsInv mapped
+};
+
+// Seeds the level from the same level of the previous frame
+// Pixels whose dst color barely changed since the previous frame take the previous disparity and
+// are marked in dstWarmStartMask: brute force and random proposals skip them, ping pong and the
+// filters still refine them. Everything else is computed as usual
+void seedFromPreviousFrame(
+    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<float>>& prevDisparities,
+    const std::vector<cv::Mat_<depth_estimation::PixelType>>& prevColors,
+    const int numThreads = -1);
+
+// Restricts the level to a region of interest, e.g. after touching up a mask
+// roiMasks has a mask per dst, of any size, non-zero where disparity has to be re-solved. The
+// region is grown to whole tiles plus kRoiTileDilation tiles around it, and marked in dstRoiMask.
+// Everything outside takes prevDisparities (a previous run's output at this level) and is left
+// untouched by every stage, so that it can be a seam for propagation and filters
+void restrictToRegionOfInterest(
+    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<float>>& prevDisparities,
+    const std::vector<cv::Mat_<bool>>& roiMasks,
+    const int numThreads = -1);
+
+// Adaptive refinement: restricts a level to the tiles its upsampled disparities do not explain
+// The cost and confidence of every pixel at its upsampled disparity are computed once, and stored
+// in dstCost and dstConfidence. Tiles of kRoiTileSize where some pixel costs more than maxCost, or
+// whose disparities span more than kAdaptiveEdgeRatio (an edge), are grown by kRoiTileDilation
+// tiles and marked in dstRoiMask, within the region of interest if there is one. Everything else
+// keeps its upsampled disparity, so proposals, ping pong and the filters only run where needed
+// Costs are normalized by confidence (dst variance), so weakly textured tiles fail first
+// Needs reprojected colors and tile srcs, see processLevel
+void restrictToUnverifiedTiles(
+    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const float maxCost,
+    const int numThreads = -1);
+
+// Finds the srcs that may see each dst tile at depths in [minDepthMeters, maxDepthMeters], so
+// that computeCost() only visits those (see PyramidLevel::dstTileSrcs)
+// Visibility is sampled at tile corners and disparities, and every tile also takes the srcs of its
+// neighbors, so that thin slivers of overlap are not missed
+void computeTileSrcs(
+    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const float minDepthMeters,
+    const float maxDepthMeters,
+    const int numThreads = -1);
+
 void preprocessLevel(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const float minDepthMeters,
@@ -118,7 +232,8 @@ void randomProposals(
     const float minDepthM,
     const float maxDepthM,
     const int numThreads = -1,
-    const filesystem::path& outputDir = "");
+    const filesystem::path& outputDir = "",
+    ProposalBackend* backend = nullptr);
 
 // Note: If this doesn't link, then an explicit template instantiation entry
 // needs to be added in Derp.cpp
@@ -146,19 +261,38 @@ void processLevel(
     const int pingPongIterations,
     const int mismatchesStartLevel,
     const bool doBilateralFilter,
-    const int threads);
+    const int threads,
+    ProposalBackend* backend = nullptr,
+    const bool saveOutputs = true, // false leaves the results in pyramidLevel only
+    const float adaptiveMaxCost = 0); // see restrictToUnverifiedTiles (0 = refine everything)
 
 void saveResults(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const bool saveDebugImages,
     const std::string& outputFormatsIn);
 
+// (cost, confidence) of disparity at (x, y) in dst
+// Callers that only care whether the cost is below bound can pass it: srcs stop being visited once
+// the cost provably is not, and FLT_MAX comes back instead. Costs below bound are exact
 std::tuple<float, float> computeCost(
     const PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int dstIdx,
     const float disparity,
     const int x,
-    const int y);
+    const int y,
+    const float bound = FLT_MAX);
+
+// Same as computeCost at count disparities of the same pixel, into costs[0 .. count)
+// The dst patch and the per src data are looked up once for all of them
+void computeCosts(
+    const PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const int dstIdx,
+    const float* const disparities,
+    const int count,
+    const int x,
+    const int y,
+    std::tuple<float, float>* const costs,
+    const float bound = FLT_MAX);
 
 } // namespace depth_estimation
 } // namespace fb360_dep
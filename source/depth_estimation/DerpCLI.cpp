@@ -5,7 +5,12 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
 #include <random>
+#include <thread>
 
 #include <boost/timer/timer.hpp>
 #include <glog/logging.h>
@@ -14,7 +19,15 @@
 #include <folly/String.h>
 
 #include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/DerpGpu.h"
 #include "source/depth_estimation/UpsampleDisparityLib.h"
+#include "source/gpu/GlfwUtil.h"
+#include "source/util/AsyncWriter.h"
+#include "source/util/BenchTrace.h"
+#include "source/util/BoundedQueue.h"
+#include "source/util/Fingerprint.h"
+#include "source/util/RayMapCache.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::cv_util;
@@ -33,36 +46,73 @@ const std::string kUsageMessage = R"(
    --rig=/path/to/rigs/rig.json \
    --first=000000 \
    --last=000000
+
+ - A frame can be split over N processes, e.g. machines of a farm sharing --output_root, by running
+ each with --num_shards=N, its own --shard and the same --shard_run_id. Each shard solves and
+ saves a contiguous run of the destinations, then waits for the others at the end of every level,
+ so the next level starts from all of them. Mismatch handling compares with the other shards'
+ destinations as they were upsampled from the coarser level
+
+ - With --adaptive_max_cost, each level below the coarsest first checks the disparities upsampled
+ from the coarser level. Tiles where every pixel costs at most that much and there are no edges
+ keep them, proposals, ping pong and the filters only run on the rest
  )";
 
+DEFINE_double(adaptive_max_cost, 0, "only refine tiles costlier than this, upsampled (0 = all)");
+DEFINE_string(backend, "cpu", "where to run random proposals and ping pong (cpu, gpu)");
 DEFINE_string(background_disp, "", "path to background disparities");
 DEFINE_string(background_frame, "000000", "background frame (lexical)");
+DEFINE_bool(cache_ray_maps, false, "reuse camera ray maps saved next to the rig");
 DEFINE_string(cameras, "", "comma-separated destinations to render (empty for all)");
 DEFINE_string(color, "", "path to input color images");
+DEFINE_bool(compact_proj_colors, false, "store projected colors in 8 bits (cpu backend only)");
 DEFINE_bool(do_bilateral_filter, true, "apply bilateral filter at each level");
 DEFINE_bool(do_median_filter, true, "apply median filter to disparity at each level");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
+DEFINE_int32(frames_in_flight, 1, "number of frames processed concurrently at each level");
 DEFINE_string(foreground_masks, "", "path to foreground masks");
 DEFINE_string(input_root, "", "path to input data (required)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_int32(level_end, -1, "level to end at (-1 = finest)");
 DEFINE_int32(level_start, -1, "level to start at (-1 = coarsest)");
 DEFINE_double(max_depth_m, 1e4, "max depth (m)");
+DEFINE_double(
+    memory_budget_gb,
+    0,
+    "memory for the frames in flight at each level, so coarse levels run more frames at a time "
+    "than fine ones (0 = --frames_in_flight at every level)");
 DEFINE_double(min_depth_m, .50, "min depth (m)");
 DEFINE_int32(mismatches_start_level, -1, "(-1 = no mismatch handling)");
 DEFINE_int32(num_levels, -1, "number of levels in the pyramid (-1 = uses highest level)");
-DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm supported)");
+DEFINE_int32(num_shards, 1, "processes the destinations are split over, see usage");
+DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm, dmat supported)");
 DEFINE_string(output_root, "", "path to output directory (required)");
+DEFINE_int32(prefetch_depth, 1, "frames whose inputs are loaded ahead of time (0 = no prefetch)");
+DEFINE_int32(prefetch_threads, 2, "threads decoding prefetched inputs");
 DEFINE_bool(partial_coverage, false, "set to true if no 360 coverage");
 DEFINE_int32(ping_pong_iterations, 1, "number of spatial propagation iterations");
 DEFINE_int32(random_proposals, 2, "number of proposed random disparities before propagation");
+DEFINE_string(roi_disparity, "", "previous output root kept outside the roi (empty = output_root)");
+DEFINE_string(roi_masks, "", "path to masks of the regions to re-solve, per camera (empty = all)");
+DEFINE_string(
+    reprojection_cache_dir,
+    "",
+    "directory to cache gpu reprojection tables in (empty = no cache)");
 DEFINE_int32(resolution, 2048, "Output resolution (width in pixels)");
 DEFINE_string(rig, "", "path to camera rig .json");
 DEFINE_bool(save_debug_images, false, "if true, save debugging output images");
+DEFINE_int32(shard, 0, "shard of the destinations solved by this process, in [0, num_shards)");
+DEFINE_bool(skip_unchanged, false, "skip frames whose inputs and flags match their last run's");
+DEFINE_string(shard_run_id, "", "same for all shards of a run, unique across runs (e.g. job id)");
+DEFINE_int32(shard_timeout_s, 3600, "seconds to wait for the other shards at the end of a level");
+DEFINE_bool(temporal_warm_start, false, "seed static pixels from the previous frame");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_bool(use_foreground_masks, false, "use pre-computed foreground masks");
 DEFINE_double(var_high_thresh, 1e-3, "ignore variances higher than this threshold");
 DEFINE_double(var_noise_floor, 4e-5, "noise variance floor on original, full-size images");
+DEFINE_string(warp_cache_dir, "", "directory to cache projection warps in (empty = no cache)");
+DEFINE_int32(writer_queue_size, 32, "outputs waiting to be written before processing stalls");
+DEFINE_int32(writer_threads, 1, "threads writing outputs in the background (0 = none)");
 
 void verifyInputs() {
   CHECK_NE(FLAGS_input_root, "");
@@ -81,14 +131,51 @@ void verifyInputs() {
     FLAGS_background_disp =
         getImageDir(FLAGS_input_root, ImageType::background_disp_levels).string();
   }
+  if (FLAGS_roi_disparity.empty()) {
+    FLAGS_roi_disparity = FLAGS_output_root;
+  }
   if (FLAGS_foreground_masks.empty()) {
     FLAGS_foreground_masks =
         getImageDir(FLAGS_input_root, ImageType::foreground_masks_levels).string();
   }
 
   // Check flag values
+  CHECK(FLAGS_backend == "cpu" || FLAGS_backend == "gpu") << "Invalid backend: " << FLAGS_backend;
   CHECK_GE(FLAGS_random_proposals, 0);
+  CHECK_GE(FLAGS_adaptive_max_cost, 0);
+  CHECK(FLAGS_adaptive_max_cost == 0 || FLAGS_backend == "cpu")
+      << "GPU backend refines whole images";
+  CHECK_GE(FLAGS_frames_in_flight, 1);
+  CHECK(FLAGS_frames_in_flight == 1 || FLAGS_backend == "cpu")
+      << "GPU backend processes one frame at a time";
+  CHECK(!FLAGS_temporal_warm_start || FLAGS_frames_in_flight == 1)
+      << "Temporal warm start needs the previous frame to be done";
+  CHECK(!FLAGS_compact_proj_colors || FLAGS_backend == "cpu")
+      << "GPU backend needs full precision projections";
+  CHECK_GE(FLAGS_memory_budget_gb, 0);
+  CHECK_GE(FLAGS_prefetch_depth, 0);
+  CHECK_GT(FLAGS_prefetch_threads, 0);
+  CHECK_GE(FLAGS_writer_threads, 0);
+  CHECK_GT(FLAGS_writer_queue_size, 0);
+  CHECK(FLAGS_memory_budget_gb == 0 || FLAGS_backend == "cpu")
+      << "GPU backend processes one frame at a time";
+  CHECK(FLAGS_memory_budget_gb == 0 || !FLAGS_temporal_warm_start)
+      << "Temporal warm start needs the previous frame to be done";
+  CHECK(FLAGS_roi_masks.empty() || FLAGS_backend == "cpu")
+      << "GPU backend re-solves whole images";
+  CHECK(FLAGS_roi_masks.empty() || !FLAGS_temporal_warm_start)
+      << "Region of interest and temporal warm start both keep previous disparities";
   CHECK_LE(FLAGS_first, FLAGS_last);
+  CHECK_GE(FLAGS_num_shards, 1);
+  CHECK(0 <= FLAGS_shard && FLAGS_shard < FLAGS_num_shards) << "Invalid shard: " << FLAGS_shard;
+  CHECK(FLAGS_num_shards == 1 || !FLAGS_shard_run_id.empty())
+      << "Shards need a run id to tell this run's levels from a previous one's";
+  CHECK(FLAGS_num_shards == 1 || !FLAGS_temporal_warm_start)
+      << "Temporal warm start needs all of the previous frame";
+  CHECK(FLAGS_num_shards == 1 || FLAGS_backend == "cpu")
+      << "GPU backend solves all destinations";
+  CHECK(!FLAGS_skip_unchanged || !FLAGS_temporal_warm_start)
+      << "Temporal warm start makes every frame depend on the previous one's output";
 
   const bool hasColorImages = filesystem::is_directory(FLAGS_color);
   CHECK(hasColorImages) << "No images in " << FLAGS_color;
@@ -110,7 +197,7 @@ void verifyInputs() {
     // We allow size 0 inputs to ensure stray commas are ignored, i.e. exr,,png is fine
     CHECK(
         outputFormat.size() == 0 || outputFormat == "exr" || outputFormat == "png" ||
-        outputFormat == "pfm")
+        outputFormat == "pfm" || outputFormat == "dmat")
         << "Invalid output format specified: " << outputFormat;
   }
 }
@@ -131,6 +218,11 @@ filesystem::path getLevelBackgroundDisparityDir(const int level) {
   return folly::sformat("{}/level_{}", FLAGS_background_disp, std::to_string(level));
 }
 
+// Name of the iFrame-th frame processed
+std::string getFrameName(const int iFrame) {
+  return image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
+}
+
 // Verifies that we have all the frames we are asking for
 void verifyInputImagePaths(
     const Camera::Rig& rigSrc,
@@ -174,9 +266,227 @@ int getLevelEnd(const std::map<int, cv::Size>& pyramidLevelSizes) {
   return levelEnd;
 }
 
-int main(int argc, char* argv[]) {
-  system_util::initDep(argc, argv, kUsageMessage);
+// Destinations solved by this process: contiguous runs of the rig per shard
+bool isShardDst(const int dstIdx, const int numDsts) {
+  return int(int64_t(dstIdx) * FLAGS_num_shards / numDsts) == FLAGS_shard;
+}
+
+// Marks this shard done with a level, then waits until all shards are, through files next to the
+// level's disparities on the storage the shards share
+void waitForShards(const int level) {
+  if (FLAGS_num_shards == 1) {
+    return;
+  }
+  const filesystem::path dir = getLevelDisparityDir(level);
+  auto markerPath = [&](const int shard) { return dir / folly::sformat(".shard_{}", shard); };
+
+  // Written then renamed, so no shard reads half a marker
+  const filesystem::path marker = markerPath(FLAGS_shard);
+  const filesystem::path markerTmp = marker.string() + ".tmp";
+  {
+    std::ofstream file(markerTmp.string());
+    file << FLAGS_shard_run_id << std::endl;
+    CHECK(file) << "Cannot write " << markerTmp;
+  }
+  filesystem::rename(markerTmp, marker);
+
+  // Markers of a previous run hold another run id
+  static const int kPollMs = 100;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(FLAGS_shard_timeout_s);
+  for (int shard = 0; shard < FLAGS_num_shards; ++shard) {
+    while (true) {
+      std::ifstream file(markerPath(shard).string());
+      std::string runId;
+      if (std::getline(file, runId) && runId == FLAGS_shard_run_id) {
+        break;
+      }
+      CHECK(std::chrono::steady_clock::now() < deadline)
+          << folly::sformat("Timed out waiting for shard {} at level {}", shard, level);
+      std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+    }
+  }
+}
+
+// Fingerprint of the disparities of a frame at a level: every file they are computed from and the
+// flags that change them, see --skip_unchanged
+Fingerprint getFrameFingerprint(
+    const int level,
+    const int numLevels,
+    const std::string& frameName,
+    const Camera::Rig& rigSrc,
+    const Camera::Rig& rigDst) {
+  Fingerprint fingerprint("DerpCLI");
+  fingerprint.addFlags(
+      __FILE__,
+      {"background_disp", "background_frame", "cache_ray_maps", "color", "first",
+       "foreground_masks", "frames_in_flight", "input_root", "last", "level_end",
+       "level_start", "memory_budget_gb", "output_root", "prefetch_depth", "prefetch_threads",
+       "reprojection_cache_dir", "resolution", "rig", "roi_disparity", "roi_masks",
+       "save_debug_images", "shard", "shard_run_id", "shard_timeout_s", "skip_unchanged",
+       "threads", "warp_cache_dir", "writer_queue_size", "writer_threads"});
+  fingerprint.add(folly::sformat("level {} of {}", level, numLevels));
+  fingerprint.addFile(FLAGS_rig);
+  for (const Camera& cam : rigSrc) {
+    fingerprint.addFile(imagePath(getLevelColorDir(level), cam.id, frameName));
+    if (FLAGS_use_foreground_masks) {
+      fingerprint.addFile(imagePath(getLevelForegroundMasksDir(level), cam.id, frameName));
+    }
+  }
+  for (const Camera& cam : rigDst) {
+    if (level < numLevels - 1) {
+      fingerprint.addFile(imagePath(getLevelDisparityDir(level + 1), cam.id, frameName));
+      if (FLAGS_use_foreground_masks) {
+        fingerprint.addFile(imagePath(getLevelForegroundMasksDir(level + 1), cam.id, frameName));
+      }
+    }
+    if (FLAGS_use_foreground_masks) {
+      fingerprint.addFile(
+          imagePath(getLevelBackgroundDisparityDir(level), cam.id, FLAGS_background_frame));
+    }
+    if (!FLAGS_roi_masks.empty()) {
+      const filesystem::path roiDisparityDir =
+          getImageDir(FLAGS_roi_disparity, ImageType::disparity_levels, level);
+      fingerprint.addFile(imagePath(FLAGS_roi_masks, cam.id, frameName));
+      fingerprint.addFile(imagePath(roiDisparityDir, cam.id, frameName));
+    }
+  }
+  return fingerprint;
+}
+
+// Disparity of a dst the fingerprint of its frame is saved next to
+filesystem::path getFingerprintedOutput(
+    const int level,
+    const std::string& dstId,
+    const std::string& frameName) {
+  return genFilename(
+      FLAGS_output_root, ImageType::disparity_levels, level, dstId, frameName, "pfm");
+}
+
+// Inputs of a frame at a level, everything that is read from disk before processing it
+struct FrameInputs {
+  int iFrame;
+  std::string frameName;
+  std::vector<cv::Mat_<PixelType>> colors; // per src
+  std::vector<cv::Mat_<bool>> srcForegroundMasks;
+  std::vector<cv::Mat_<bool>> dstForegroundMasksCoarse; // empty at the coarsest level
+  std::vector<cv::Mat_<float>> dstDisparitiesCoarse; // empty at the coarsest level
+  std::vector<cv::Mat_<bool>> dstRoiMasks; // empty if re-solving everything
+  std::vector<cv::Mat_<float>> dstRoiDisparities; // previous results, kept outside the roi
+};
+
+FrameInputs loadFrameInputs(
+    const int iFrame,
+    const int level,
+    const int numLevels,
+    const cv::Size& sizeLevel,
+    const Camera::Rig& rigSrc,
+    const Camera::Rig& rigDst,
+    const int threads) {
+  FrameInputs inputs;
+  inputs.iFrame = iFrame;
+  inputs.frameName = getFrameName(iFrame);
+  const std::string& frameName = inputs.frameName;
+  inputs.colors = loadLevelImages<PixelType>(FLAGS_color, level, rigSrc, frameName, threads);
+  inputs.srcForegroundMasks = FLAGS_use_foreground_masks
+      ? loadLevelImages<bool>(FLAGS_foreground_masks, level, rigSrc, frameName, threads)
+      : cv_util::generateAllPassMasks(sizeLevel, rigSrc.size());
+  if (level < numLevels - 1) {
+    // Allocate masks but only populate them if needed
+    inputs.dstForegroundMasksCoarse.resize(rigDst.size());
+    if (FLAGS_use_foreground_masks) {
+      inputs.dstForegroundMasksCoarse = loadLevelImages<bool>(
+          FLAGS_foreground_masks, level + 1, rigDst, frameName, threads);
+    }
+    inputs.dstDisparitiesCoarse =
+        loadImages<float>(getLevelDisparityDir(level + 1), rigDst, frameName, threads);
+  }
+  if (!FLAGS_roi_masks.empty()) {
+    inputs.dstRoiMasks = loadImages<bool>(FLAGS_roi_masks, rigDst, frameName, threads);
+    inputs.dstRoiDisparities = loadImages<float>(
+        getImageDir(FLAGS_roi_disparity, ImageType::disparity_levels, level),
+        rigDst,
+        frameName,
+        threads);
+  }
+  return inputs;
+}
+
+// Number of frames processed concurrently at a level
+// With a memory budget, as many frames as fit in it, but no more than there are threads: coarse
+// levels have too little work per frame to keep all cores busy, fine levels run one frame at a
+// time and parallelize within it
+int getFramesInFlight(
+    const cv::Size& sizeLevel,
+    const int numSrcs,
+    const int numDsts,
+    const int numFrames) {
+  if (FLAGS_memory_budget_gb == 0) {
+    return FLAGS_frames_in_flight;
+  }
+  const size_t frameBytes = PyramidLevel<PixelType>::estimateFrameBytes(
+      sizeLevel, numSrcs, numDsts, FLAGS_compact_proj_colors);
+  const double budgetBytes = FLAGS_memory_budget_gb * (size_t(1) << 30);
+  const int maxFrames = std::min(numFrames, ThreadPool::getThreadCountFromFlag(FLAGS_threads));
+  return std::max(1, int(std::min(budgetBytes / frameBytes, double(maxFrames))));
+}
+
+// GPU backend needs an OpenGL context, but nothing is ever displayed
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+// State that outlives a job, so that in --serve mode later jobs find it warm
+struct Resident {
+  std::unique_ptr<OffscreenContext> glContext;
+  std::map<filesystem::path, std::unique_ptr<RayMapCache>> rayMaps; // by cache directory
+
+  RayMapCache& getRayMaps(const filesystem::path& dir) {
+    std::unique_ptr<RayMapCache>& cache = rayMaps[dir];
+    if (!cache) {
+      cache = std::make_unique<RayMapCache>(dir);
+    }
+    return *cache;
+  }
+
+  // Background disparities by file, with the time they were read, see getBackgroundDisparities()
+  using Time = decltype(filesystem::last_write_time(filesystem::path()));
+  std::map<filesystem::path, std::pair<Time, cv::Mat_<float>>> backgroundDisparities;
+  std::mutex backgroundDisparitiesMutex;
+
+  // Background disparities of --background_frame at a level, per dst
+  // They are the same for every frame, so they are only read the first time, or again if the file
+  // changed. Frames share them read-only
+  std::vector<cv::Mat_<float>>
+  getBackgroundDisparities(const int level, const Camera::Rig& rigDst, const int numThreads) {
+    const filesystem::path dir = getLevelBackgroundDisparityDir(level);
+    std::vector<cv::Mat_<float>> disparities(rigDst.size());
+    ThreadPool threadPool(numThreads);
+    for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
+      threadPool.spawn([&, dstIdx] {
+        const filesystem::path path =
+            image_util::imagePath(dir, rigDst[dstIdx].id, FLAGS_background_frame);
+        const Time modified = filesystem::last_write_time(path);
+        {
+          std::lock_guard<std::mutex> lock(backgroundDisparitiesMutex);
+          const auto it = backgroundDisparities.find(path);
+          if (it != backgroundDisparities.end() && it->second.first == modified) {
+            disparities[dstIdx] = it->second.second;
+            return;
+          }
+        }
+        disparities[dstIdx] = cv_util::loadImage<float>(path);
+        std::lock_guard<std::mutex> lock(backgroundDisparitiesMutex);
+        backgroundDisparities[path] = std::make_pair(modified, disparities[dstIdx]);
+      });
+    }
+    threadPool.join();
+    return disparities;
+  }
+};
 
+int runJob(Resident& resident) {
   boost::timer::cpu_timer matchTimer;
   verifyInputs();
 
@@ -215,6 +525,19 @@ int main(int argc, char* argv[]) {
   Camera::normalizeRig(rigSrc);
   Camera::normalizeRig(rigDst);
 
+  std::unique_ptr<ProposalBackend> backend;
+  if (FLAGS_backend == "gpu") {
+    if (!resident.glContext) {
+      resident.glContext = std::make_unique<OffscreenContext>();
+    }
+    backend = std::make_unique<GpuProposalBackend>(FLAGS_reprojection_cache_dir);
+  }
+
+  RayMapCache& rayMaps =
+      resident.getRayMaps(FLAGS_cache_ray_maps ? RayMapCache::getDefaultDir(FLAGS_rig) : "");
+
+  // Outputs are written while the next frames are processed
+  AsyncWriter writer(FLAGS_writer_threads, FLAGS_writer_queue_size);
   for (int level = levelStart; level >= levelEnd; --level) {
     // Create level output directories
     createLevelOutputDirs(FLAGS_output_root, level, rigDst, FLAGS_save_debug_images);
@@ -222,29 +545,25 @@ int main(int argc, char* argv[]) {
     // Create dst FOV masks for current level size
     const cv::Size& sizeLevel = pyramidLevelSizes.at(level);
     const std::vector<cv::Mat_<bool>> dstFovMasks =
-        generateFovMasks(rigDst, sizeLevel, FLAGS_threads);
-
-    for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
-      // Load current level data
-      const std::string frameName =
-          image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
-
-      // Color
-      std::vector<cv::Mat_<PixelType>> colorImagesLevel =
-          loadLevelImages<PixelType>(FLAGS_color, level, rigSrc, frameName, FLAGS_threads);
-
-      // Foreground masks
-      std::vector<cv::Mat_<bool>> srcForegroundMasksLevel = FLAGS_use_foreground_masks
-          ? loadLevelImages<bool>(FLAGS_foreground_masks, level, rigSrc, frameName, FLAGS_threads)
-          : cv_util::generateAllPassMasks(sizeLevel, numSrcs);
-
-      // Background disparities
-      std::vector<cv::Mat_<float>> dstBackgroundDisparitiesLevel(rigDst.size());
-      if (FLAGS_use_foreground_masks) {
-        dstBackgroundDisparitiesLevel = loadLevelImages<float>(
-            FLAGS_background_disp, level, rigDst, FLAGS_background_frame, FLAGS_threads);
-      }
+        generateFovMasks(rigDst, sizeLevel, FLAGS_threads, &rayMaps);
+
+    // Frames of a level are independent, framesInFlight of them are processed at a time so that
+    // memory use stays bounded
+    const int framesInFlight = getFramesInFlight(sizeLevel, numSrcs, numDsts, numFrames);
+    LOG(INFO) << folly::sformat("Level {}: {} frames in flight", level, framesInFlight);
+    LevelProjections levelProjections(framesInFlight, FLAGS_warp_cache_dir);
+
+    // Background disparities, the same for all frames
+    std::vector<cv::Mat_<float>> dstBackgroundDisparitiesLevel(rigDst.size());
+    if (FLAGS_use_foreground_masks) {
+      dstBackgroundDisparitiesLevel =
+          resident.getBackgroundDisparities(level, rigDst, FLAGS_threads);
+    }
 
+    auto processFrame = [&](const FrameInputs& inputs, const int slot) {
+      const int iFrame = inputs.iFrame;
+      const std::string& frameName = inputs.frameName;
+      bench_trace::ScopedRecord record(folly::sformat("level{}", level), frameName, numDsts);
       PyramidLevel<PixelType> framePyramidLevel(
           iFrame,
           frameName,
@@ -255,8 +574,8 @@ int main(int argc, char* argv[]) {
           rigSrc,
           rigDst,
           dst2srcIdxs,
-          colorImagesLevel,
-          srcForegroundMasksLevel,
+          inputs.colors,
+          inputs.srcForegroundMasks,
           dstFovMasks,
           dstBackgroundDisparitiesLevel,
           widthFullSize,
@@ -267,39 +586,66 @@ int main(int argc, char* argv[]) {
           FLAGS_use_foreground_masks,
           FLAGS_output_root,
           FLAGS_threads);
+      for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+        framePyramidLevel.dstRays(dstIdx) = rayMaps.get(rigDst[dstIdx], sizeLevel).rays;
+      }
+      framePyramidLevel.compactProjColors = FLAGS_compact_proj_colors;
+      framePyramidLevel.writer = &writer;
+      framePyramidLevel.layerBackground = FLAGS_use_foreground_masks && level == levelEnd;
 
       // Generate/link reprojections
-      precomputeProjections(framePyramidLevel, FLAGS_threads);
+      levelProjections.acquire(framePyramidLevel, slot, FLAGS_threads);
 
       if (level < numLevels - 1) {
-        // Allocate masks but only populate them if needed
+        // Dst masks are the masks of the matching srcs, only populated if needed
         std::vector<cv::Mat_<bool>> dstForegroundMasksLevel(numDsts);
-        std::vector<cv::Mat_<bool>> dstForegroundMasksCoarse(numDsts);
         if (FLAGS_use_foreground_masks) {
-          dstForegroundMasksLevel = loadLevelImages<bool>(
-              FLAGS_foreground_masks, level, rigDst, frameName, FLAGS_threads);
-          dstForegroundMasksCoarse = loadLevelImages<bool>(
-              FLAGS_foreground_masks, level + 1, rigDst, frameName, FLAGS_threads);
+          for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+            dstForegroundMasksLevel[dstIdx] = inputs.srcForegroundMasks[dst2srcIdxs[dstIdx]];
+          }
         }
 
-        const std::vector<cv::Mat_<float>> dstDispsCoarse =
-            loadImages<float>(getLevelDisparityDir(level + 1), rigDst, frameName, FLAGS_threads);
-
         const std::vector<cv::Mat_<float>> dstDispsNextLevel = upsampleDisparities(
             rigDst,
-            dstDispsCoarse,
+            inputs.dstDisparitiesCoarse,
             dstBackgroundDisparitiesLevel,
-            dstForegroundMasksCoarse,
+            inputs.dstForegroundMasksCoarse,
             dstForegroundMasksLevel,
             sizeLevel,
             FLAGS_use_foreground_masks,
-            FLAGS_threads);
+            FLAGS_threads,
+            &rayMaps);
 
         for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
           framePyramidLevel.dsts[dstIdx].disparity = dstDispsNextLevel[dstIdx];
         }
       }
 
+      // Static pixels start from the previous frame's result at this level
+      if (FLAGS_temporal_warm_start && iFrame > 0) {
+        writer.flush();
+        const std::string prevFrameName = getFrameName(iFrame - 1);
+        const std::vector<cv::Mat_<float>> prevDisparities =
+            loadImages<float>(getLevelDisparityDir(level), rigDst, prevFrameName, FLAGS_threads);
+        const std::vector<cv::Mat_<PixelType>> prevColors =
+            loadLevelImages<PixelType>(FLAGS_color, level, rigDst, prevFrameName, FLAGS_threads);
+        seedFromPreviousFrame(framePyramidLevel, prevDisparities, prevColors, FLAGS_threads);
+      }
+
+      // Only the region of interest is re-solved, the rest comes from a previous run
+      if (!inputs.dstRoiMasks.empty()) {
+        restrictToRegionOfInterest(
+            framePyramidLevel, inputs.dstRoiDisparities, inputs.dstRoiMasks, FLAGS_threads);
+      }
+
+      // Destinations of other shards are kept as upsampled, for mismatch handling to compare with
+      for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+        if (!isShardDst(dstIdx, numDsts)) {
+          framePyramidLevel.dstRoiMask(dstIdx) = cv::Mat_<bool>(sizeLevel, false);
+          framePyramidLevel.dsts[dstIdx].remote = true;
+        }
+      }
+
       processLevel(
           framePyramidLevel,
           FLAGS_output_formats,
@@ -314,8 +660,109 @@ int main(int argc, char* argv[]) {
           FLAGS_ping_pong_iterations,
           FLAGS_mismatches_start_level,
           FLAGS_do_bilateral_filter,
+          FLAGS_threads,
+          backend.get(),
+          true, // saveOutputs
+          FLAGS_adaptive_max_cost);
+      levelProjections.release(framePyramidLevel, slot);
+    };
+
+    // Frames to compute, all of them unless their outputs have a matching fingerprint
+    std::vector<int> frames;
+    std::vector<Fingerprint> fingerprints;
+    if (FLAGS_skip_unchanged) {
+      fingerprints.resize(numFrames, Fingerprint("DerpCLI"));
+      parallelFor(
+          0,
+          numFrames,
+          1,
+          [&](const int iFrame) {
+            fingerprints[iFrame] = getFrameFingerprint(
+                level, numLevels, getFrameName(iFrame), rigSrc, rigDst);
+          },
           FLAGS_threads);
     }
+    for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
+      bool unchanged = FLAGS_skip_unchanged;
+      for (int dstIdx = 0; unchanged && dstIdx < numDsts; ++dstIdx) {
+        unchanged = !isShardDst(dstIdx, numDsts) ||
+            hasFingerprint(
+                getFingerprintedOutput(level, rigDst[dstIdx].id, getFrameName(iFrame)),
+                fingerprints[iFrame]);
+      }
+      if (!unchanged) {
+        frames.push_back(iFrame);
+      }
+    }
+    if (FLAGS_skip_unchanged) {
+      LOG(INFO) << folly::sformat(
+          "Level {}: {} of {} frames unchanged", level, numFrames - frames.size(), numFrames);
+    }
+
+    // Each slot takes the next frame as soon as it is done with its last one, so frames that
+    // take longer do not hold up the others
+    // With prefetching, a loader thread decodes the inputs of the next prefetch_depth frames while
+    // the slots compute, and the slots take frames from its queue in order
+    std::atomic<int> nextFrame(0);
+    std::unique_ptr<BoundedQueue<FrameInputs>> prefetched;
+    std::thread loader;
+    if (FLAGS_prefetch_depth > 0) {
+      prefetched = std::make_unique<BoundedQueue<FrameInputs>>(FLAGS_prefetch_depth);
+      loader = std::thread([&] {
+        for (const int iFrame : frames) {
+          prefetched->push(
+              loadFrameInputs(
+                  iFrame, level, numLevels, sizeLevel, rigSrc, rigDst, FLAGS_prefetch_threads));
+        }
+        prefetched->close();
+      });
+    }
+    auto takeFrame = [&](FrameInputs& inputs) {
+      if (prefetched) {
+        return prefetched->pop(inputs);
+      }
+      const int i = nextFrame++;
+      if (i >= int(frames.size())) {
+        return false;
+      }
+      const int iFrame = frames[i];
+      inputs =
+          loadFrameInputs(iFrame, level, numLevels, sizeLevel, rigSrc, rigDst, FLAGS_threads);
+      return true;
+    };
+
+    ThreadPool framePool(framesInFlight > 1 ? framesInFlight : 0);
+    for (int slot = 0; slot < framesInFlight; ++slot) {
+      framePool.spawn([&, slot] {
+        FrameInputs inputs;
+        while (takeFrame(inputs)) {
+          processFrame(inputs, slot);
+        }
+      });
+    }
+    framePool.join();
+    if (loader.joinable()) {
+      loader.join();
+    }
+
+    // The next level reads this level's disparities, from all shards
+    writer.flush();
+    if (FLAGS_skip_unchanged) {
+      // Only now that the outputs are on disk
+      for (const int iFrame : frames) {
+        for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+          if (isShardDst(dstIdx, numDsts)) {
+            writeFingerprint(
+                getFingerprintedOutput(level, rigDst[dstIdx].id, getFrameName(iFrame)),
+                fingerprints[iFrame]);
+          }
+        }
+      }
+    }
+    waitForShards(level);
+    if (FLAGS_shard == 0) {
+      writeManifest(getLevelDisparityDir(level));
+    }
 
     LOG(INFO) << folly::sformat("-- Elapsed time: {}", matchTimer.format());
   }
@@ -324,3 +771,10 @@ int main(int argc, char* argv[]) {
 
   return EXIT_SUCCESS;
 }
+
+int main(int argc, char* argv[]) {
+  system_util::initDep(argc, argv, kUsageMessage);
+
+  Resident resident;
+  return system_util::runJobs([&] { return runJob(resident); });
+}
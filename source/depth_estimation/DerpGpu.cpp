@@ -0,0 +1,778 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/depth_estimation/DerpGpu.h"
+
+#include <array>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+#include "source/gpu/GlUtil.h"
+#include "source/render/ReprojectionTexture.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+namespace {
+
+// Size of the per fragment SSD arrays in the combine shader
+const int kMaxSrcs = 64;
+
+// Which disparity each pass evaluates
+enum Mode {
+  kCurrent, // disparity in the state, used to initialize random proposals
+  kRandom, // random disparity around the state
+  kPingPong, // disparity of a neighbor at the start of the iteration
+  kNumModes,
+};
+
+const std::string kPrelude = R"(
+  #version 330 core
+
+  // (disparity, cost, confidence, random proposal amplitude or ping pong changed flag)
+  uniform sampler2D state;
+  uniform sampler2D iterStart;
+
+  uniform sampler2D fovMask;
+  uniform sampler2D foregroundMask;
+  uniform sampler2D backgroundDisparity;
+  uniform sampler2D variance;
+  uniform bool hasForegroundMasks;
+  uniform ivec2 dstSize;
+  uniform float varThresh;
+
+  uniform float minDisparity;
+  uniform float maxDisparity;
+  uniform int proposalIdx;
+  uniform int seed;
+  uniform ivec2 offset;
+
+  const int kMode = $MODE$;
+  const int kRadius = $RADIUS$;
+  const float kNotSeen = -1.0;
+
+  float nan() {
+    return uintBitsToFloat(0x7fc00000u);
+  }
+
+  float inf() {
+    return uintBitsToFloat(0x7f800000u);
+  }
+
+  bool inFov(ivec2 p) {
+    return texelFetch(fovMask, p, 0).x > 0.0;
+  }
+
+  bool isForeground(ivec2 p) {
+    return texelFetch(foregroundMask, p, 0).x > 0.0;
+  }
+
+  float background(ivec2 p) {
+    return texelFetch(backgroundDisparity, p, 0).x;
+  }
+
+  bool inMargins(ivec2 p) {
+    return all(greaterThanEqual(p, ivec2(kRadius))) && all(lessThan(p, dstSize - kRadius));
+  }
+
+  // Same conditions as the CPU loops for a pixel to be refined
+  bool isActive(ivec2 p) {
+    return inMargins(p) && inFov(p) && isForeground(p) && texelFetch(variance, p, 0).x >= varThresh;
+  }
+
+  // Uniform random number in [0, 1)
+  float random(ivec2 p) {
+    uint h = uint(p.x) * 1973u + uint(p.y) * 9277u + uint(proposalIdx) * 26699u + uint(seed);
+    h = (h ^ 61u) ^ (h >> 16);
+    h *= 9u;
+    h ^= h >> 4;
+    h *= 0x27d4eb2du;
+    h ^= h >> 15;
+    return float(h >> 8) / 16777216.0;
+  }
+
+  float minProposal(ivec2 p) {
+    // When using background, foreground pixels must be closer than background
+    return hasForegroundMasks ? background(p) : minDisparity;
+  }
+
+  // NaN if there is nothing to evaluate at p
+  float proposal(ivec2 p) {
+    if (!isActive(p)) {
+      return nan();
+    }
+    if (kMode == $CURRENT$) {
+      return texelFetch(state, p, 0).x;
+    }
+    if (kMode == $RANDOM$) {
+      vec4 s = texelFetch(state, p, 0);
+      float lo = max(minProposal(p), s.x - s.w);
+      float hi = min(maxDisparity, s.x + s.w);
+      return mix(lo, hi, random(p));
+    }
+    ivec2 q = clamp(p + offset, ivec2(0), dstSize - 1);
+    if (!inFov(q)) {
+      return nan();
+    }
+    vec4 neighbor = texelFetch(iterStart, q, 0);
+    float minDisp = hasForegroundMasks ? background(p) : 0.0;
+    if (neighbor.x < minDisp || neighbor.w == 0.0) {
+      return nan();
+    }
+    return neighbor.x;
+  }
+)";
+
+// (biased SSD, unbiased SSD) of the proposal against one src, kNotSeen if src doesn't see it
+const std::string kSsdShader = R"(
+  uniform sampler3D reprojection;
+  uniform vec3 reprojectionScale;
+  uniform vec3 reprojectionOffset;
+  uniform sampler2D projWarp;
+  uniform sampler2DArray projColor;
+  uniform sampler2DArray projColorBias;
+  uniform int srcLayer;
+  uniform int dstLayer;
+
+  out vec2 result;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    result = vec2(kNotSeen);
+    float disparity = proposal(p);
+    if (isnan(disparity)) {
+      return;
+    }
+
+    // dst -> world -> src, normalized coordinates
+    vec2 pDst = gl_FragCoord.xy / vec2(dstSize);
+    vec3 coor = vec3(pDst, disparity) * reprojectionScale + reprojectionOffset;
+    vec2 pSrc = texture(reprojection, coor).xy;
+    if (any(lessThan(pSrc, vec2(0))) || any(greaterThan(pSrc, vec2(1)))) {
+      return;
+    }
+
+    // src -> infinity -> dst, dst pixels
+    vec2 pDstSrc = texture(projWarp, pSrc).xy + 0.5;
+    if (any(isnan(pDstSrc))) {
+      return;
+    }
+
+    vec3 dstBias = texelFetch(projColorBias, ivec3(p, dstLayer), 0).rgb;
+    vec3 srcBias = texture(projColorBias, vec3(pDstSrc / vec2(dstSize), srcLayer)).rgb;
+    vec3 bias = dstBias - srcBias;
+    result = vec2(0);
+    for (int dy = -kRadius; dy <= kRadius; ++dy) {
+      for (int dx = -kRadius; dx <= kRadius; ++dx) {
+        vec3 cDst = texelFetch(projColor, ivec3(p + ivec2(dx, dy), dstLayer), 0).rgb;
+        vec2 q = (pDstSrc + vec2(dx, dy)) / vec2(dstSize);
+        vec3 cSrc = texture(projColor, vec3(q, srcLayer)).rgb;
+        vec3 diffBias = cDst - cSrc;
+        vec3 diffNoBias = diffBias - bias;
+        result += vec2(dot(diffBias, diffBias), dot(diffNoBias, diffNoBias));
+      }
+    }
+  }
+)";
+
+// (cost, confidence) from the SSDs of all the srcs, same as computeCost()
+const std::string kCombineShader = R"(
+  uniform sampler2DArray ssds;
+  uniform int numSrcs;
+  uniform int dstLayer;
+
+  const int kMaxSrcs = $MAX_SRCS$;
+
+  out vec2 result;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float biased[kMaxSrcs];
+    float unbiased[kMaxSrcs];
+    int count = 0;
+    for (int s = 0; s < numSrcs; ++s) {
+      if (s == dstLayer) {
+        continue;
+      }
+      vec2 ssd = texelFetch(ssds, ivec3(p, s), 0).xy;
+      if (ssd.x == kNotSeen) {
+        continue;
+      }
+      biased[count] = ssd.x;
+      unbiased[count] = ssd.y;
+      ++count;
+    }
+
+    int keep = $MIN_OVERLAPPING_CAMS$ - 1;
+    if (count < keep) {
+      result = vec2($FLT_MAX$, 0); // not enough cameras see this disparity, skip
+      return;
+    }
+
+    // Add up unbiased SSDs for all but the two patches with the worst biased SSDs
+    keep = max(keep, count - 2);
+    float cost = 0;
+    for (int i = 0; i < count; ++i) {
+      int rank = 0;
+      for (int j = 0; j < count; ++j) {
+        if (biased[j] < biased[i] ||
+            (biased[j] == biased[i] &&
+              (unbiased[j] < unbiased[i] || (unbiased[j] == unbiased[i] && j < i)))) {
+          ++rank;
+        }
+      }
+      if (rank < keep) {
+        cost += unbiased[i];
+      }
+    }
+    cost /= keep;
+
+    // Trust costs when more cameras are involved
+    float trustCoef = 1.0 / keep;
+    float confidence = max(texelFetch(variance, p, 0).x, $MIN_VAR$);
+    result = vec2(cost * trustCoef / confidence, confidence);
+  }
+)";
+
+// Accept or reject the proposal
+const std::string kUpdateShader = R"(
+  uniform sampler2D costs;
+  uniform sampler2D threshold;
+  const float kRandomPropMaxCost = $RANDOM_PROP_MAX_COST$;
+
+  layout(location = 0) out vec4 result;
+  layout(location = 1) out float thresholdResult;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec4 s = texelFetch(state, p, 0);
+    result = s;
+    thresholdResult = 0;
+    if (kMode == $CURRENT$ && inMargins(p) && inFov(p) && !isForeground(p)) {
+      // Use background value if we're outside the foreground mask
+      result.x = background(p);
+      return;
+    }
+    float disparity = proposal(p);
+    if (isnan(disparity)) {
+      return;
+    }
+    vec2 cost = texelFetch(costs, p, 0).xy;
+    if (kMode == $CURRENT$) {
+      // We will refine only if we're getting much better cost
+      result = vec4(disparity, cost, (maxDisparity - minProposal(p)) / 2.0);
+      thresholdResult = min(0.5 * cost.x, kRandomPropMaxCost);
+    } else if (kMode == $RANDOM$) {
+      if (cost.x < s.y && cost.x < texelFetch(threshold, p, 0).x) {
+        result = vec4(disparity, cost, s.w / 2.0);
+      }
+    } else if (cost.x < s.y) {
+      // Ping pong only updates disparity and cost
+      result.xy = vec2(disparity, cost.x);
+    }
+  }
+)";
+
+// begin: state -> best at the start of a ping pong iteration
+// end: best -> state, flagging the pixels that changed in this iteration
+const std::string kPingPongShader = R"(
+  uniform bool begin;
+  uniform bool resetChanged;
+
+  out vec4 result;
+
+  void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec4 s = texelFetch(state, p, 0);
+    if (begin) {
+      result = vec4(s.x, inf(), s.zw);
+      if (inMargins(p) && inFov(p) && !isForeground(p)) {
+        result.x = background(p); // use background value if we're outside the foreground mask
+      }
+    } else {
+      bool changed = resetChanged || s.x != texelFetch(iterStart, p, 0).x;
+      result = vec4(s.xyz, changed ? 1.0 : 0.0);
+    }
+  }
+)";
+
+GLuint createDerpProgram(const std::string& shader, const Mode mode) {
+  std::string fs = kPrelude + shader;
+  replaceAll(fs, "$MODE$", std::to_string(mode));
+  replaceAll(fs, "$CURRENT$", std::to_string(kCurrent));
+  replaceAll(fs, "$RANDOM$", std::to_string(kRandom));
+  replaceAll(fs, "$RADIUS$", std::to_string(kSearchWindowRadius));
+  replaceAll(fs, "$MAX_SRCS$", std::to_string(kMaxSrcs));
+  replaceAll(fs, "$MIN_OVERLAPPING_CAMS$", std::to_string(kMinOverlappingCams));
+  replaceAll(fs, "$FLT_MAX$", folly::sformat("{:.9e}", FLT_MAX));
+  replaceAll(fs, "$MIN_VAR$", folly::sformat("{:.9e}", kMinVar));
+  replaceAll(fs, "$RANDOM_PROP_MAX_COST$", folly::sformat("{:.9e}", kRandomPropMaxCost));
+  return createProgram(fullscreenVertexShader(), fs);
+}
+
+// Unlike setUniform(), these don't complain about uniforms the compiler optimized away
+void setUniformIfUsed(const GLuint program, const char* name, const GLint value) {
+  glUniform1i(glGetUniformLocation(program, name), value);
+}
+
+void setUniformIfUsed(const GLuint program, const char* name, const float value) {
+  glUniform1f(glGetUniformLocation(program, name), value);
+}
+
+void setUniformIfUsed(const GLuint program, const char* name, const GLint x, const GLint y) {
+  glUniform2i(glGetUniformLocation(program, name), x, y);
+}
+
+void bindTextureIfUsed(
+    const GLuint program,
+    const char* name,
+    const GLuint unit,
+    const GLenum target,
+    const GLuint texture) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(target, texture);
+  glUniform1i(glGetUniformLocation(program, name), unit);
+}
+
+void setSamplingParameters(const GLenum target, const GLenum filter) {
+  glTexParameteri(target, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(target, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+GLuint createMatTexture(
+    const cv::Mat& mat,
+    const GLenum internalFormat,
+    const GLenum format,
+    const GLenum type,
+    const GLenum filter = GL_NEAREST) {
+  const cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  GLuint texture = createTexture(GL_TEXTURE_2D);
+  glTexImage2D(
+      GL_TEXTURE_2D,
+      0, // level
+      internalFormat,
+      continuous.cols,
+      continuous.rows,
+      0, // border
+      format,
+      type,
+      continuous.data);
+  setSamplingParameters(GL_TEXTURE_2D, filter);
+  return texture;
+}
+
+GLuint createTargetTexture(const cv::Size& size, const GLenum internalFormat, const GLenum format) {
+  GLuint texture = createTexture(GL_TEXTURE_2D);
+  glTexImage2D(
+      GL_TEXTURE_2D, 0, internalFormat, size.width, size.height, 0, format, GL_FLOAT, nullptr);
+  setSamplingParameters(GL_TEXTURE_2D, GL_NEAREST);
+  return texture;
+}
+
+// One layer per mat, all mats must have the same size
+GLuint createArrayTexture(
+    const std::vector<const cv::Mat*>& mats,
+    const cv::Size& size,
+    const GLenum internalFormat,
+    const GLenum format,
+    const GLenum type,
+    const GLenum filter) {
+  GLuint texture = createTexture(GL_TEXTURE_2D_ARRAY);
+  glTexImage3D(
+      GL_TEXTURE_2D_ARRAY,
+      0, // level
+      internalFormat,
+      size.width,
+      size.height,
+      mats.size(),
+      0, // border
+      format,
+      type,
+      nullptr);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int layer = 0; layer < int(mats.size()); ++layer) {
+    if (!mats[layer]) {
+      continue;
+    }
+    CHECK_EQ(mats[layer]->size(), size);
+    const cv::Mat continuous = mats[layer]->isContinuous() ? *mats[layer] : mats[layer]->clone();
+    glTexSubImage3D(
+        GL_TEXTURE_2D_ARRAY,
+        0,
+        0,
+        0,
+        layer,
+        size.width,
+        size.height,
+        1,
+        format,
+        type,
+        continuous.data);
+  }
+  setSamplingParameters(GL_TEXTURE_2D_ARRAY, filter);
+  return texture;
+}
+
+} // namespace
+
+struct GpuProposalBackend::Programs {
+  Programs() {
+    for (int mode = 0; mode < kNumModes; ++mode) {
+      ssd[mode] = createDerpProgram(kSsdShader, Mode(mode));
+      update[mode] = createDerpProgram(kUpdateShader, Mode(mode));
+    }
+    combine = createDerpProgram(kCombineShader, kCurrent);
+    pingPong = createDerpProgram(kPingPongShader, kPingPong);
+    glGenFramebuffers(1, &fbo);
+  }
+
+  ~Programs() {
+    for (int mode = 0; mode < kNumModes; ++mode) {
+      glDeleteProgram(ssd[mode]);
+      glDeleteProgram(update[mode]);
+    }
+    glDeleteProgram(combine);
+    glDeleteProgram(pingPong);
+    glDeleteFramebuffers(1, &fbo);
+  }
+
+  // Render a fullscreen pass into the given targets: 2D textures or, if layer >= 0, one layer of
+  // an array texture
+  void render(
+      const GLuint program,
+      const cv::Size& size,
+      const std::vector<GLuint>& targets,
+      const int layer = -1) const {
+    GLint prevFbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    std::vector<GLenum> drawBuffers;
+    for (int i = 0; i < kMaxTargets; ++i) {
+      // Detach unused attachments so we never sample a texture that's still attached
+      const GLuint target = i < int(targets.size()) ? targets[i] : 0;
+      if (layer >= 0) {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, target, 0, layer);
+      } else {
+        glFramebufferTexture2D(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, target, 0);
+      }
+      if (target) {
+        drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+      }
+    }
+    glDrawBuffers(drawBuffers.size(), drawBuffers.data());
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    glViewport(0, 0, size.width, size.height);
+    glUseProgram(program);
+    fullscreen(program);
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+  }
+
+  static const int kMaxTargets = 2;
+
+  std::array<GLuint, kNumModes> ssd;
+  std::array<GLuint, kNumModes> update;
+  GLuint combine;
+  GLuint pingPong;
+  GLuint fbo;
+};
+
+// Everything a dst needs on the GPU during a level
+struct GpuProposalBackend::DstTextures {
+  DstTextures(
+      const PyramidLevel<PixelType>& pyramidLevel,
+      const int dstIdx,
+      const filesystem::path& reprojectionCacheDir)
+      : size(pyramidLevel.dstDisparity(dstIdx).size()),
+        numSrcs(pyramidLevel.rigSrc.size()),
+        dstLayer(pyramidLevel.dst2srcIdxs[dstIdx]) {
+    CHECK_LE(numSrcs, kMaxSrcs) << "too many cameras for the GPU backend";
+    CHECK(!pyramidLevel.compactProjColors) << "GPU backend needs full precision projections";
+
+    fovMask = createMatTexture(pyramidLevel.dstFovMask(dstIdx), GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+    const cv::Mat_<bool>& fg = pyramidLevel.dstForegroundMask(dstIdx);
+    foregroundMask = createMatTexture(
+        fg.empty() ? cv::Mat_<bool>(size, true) : fg, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+    const cv::Mat_<float>& bg = pyramidLevel.dstBackgroundDisparity(dstIdx);
+    backgroundDisparity =
+        createMatTexture(bg.empty() ? cv::Mat_<float>(size, 0) : bg, GL_R32F, GL_RED, GL_FLOAT);
+    variance = createMatTexture(pyramidLevel.dstVariance(dstIdx), GL_R32F, GL_RED, GL_FLOAT);
+
+    std::vector<const cv::Mat*> colors(numSrcs);
+    std::vector<const cv::Mat*> biases(numSrcs);
+    for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+      colors[srcIdx] = &pyramidLevel.dstProjColor(dstIdx, srcIdx);
+      biases[srcIdx] = &pyramidLevel.dstProjColorBias(dstIdx, srcIdx);
+    }
+    projColor = createArrayTexture(colors, size, GL_RGB16, GL_RGB, GL_UNSIGNED_SHORT, GL_LINEAR);
+    projColorBias =
+        createArrayTexture(biases, size, GL_RGB16, GL_RGB, GL_UNSIGNED_SHORT, GL_LINEAR);
+
+    projWarps.resize(numSrcs, 0);
+    reprojections.resize(numSrcs);
+    for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+      if (srcIdx == dstLayer) {
+        continue;
+      }
+      projWarps[srcIdx] = createMatTexture(
+          pyramidLevel.dstProjWarp(dstIdx, srcIdx), GL_RG32F, GL_RG, GL_FLOAT, GL_LINEAR);
+      const cv::Size& srcSize = pyramidLevel.srcColor(srcIdx).size();
+      const Camera::Vector2 srcResolution(srcSize.width, srcSize.height);
+      reprojections[srcIdx] = std::make_unique<ReprojectionTexture>(
+          pyramidLevel.rigDst[dstIdx],
+          pyramidLevel.rigSrc[srcIdx].rescale(srcResolution),
+          reprojectionCacheDir);
+    }
+
+    // Scratch space for the passes
+    ssds = createArrayTexture(
+        std::vector<const cv::Mat*>(numSrcs), size, GL_RG32F, GL_RG, GL_FLOAT, GL_NEAREST);
+    costs = createTargetTexture(size, GL_RG32F, GL_RG);
+    threshold = createTargetTexture(size, GL_R32F, GL_RED);
+
+    // Initial state from the CPU
+    cv::Mat_<cv::Vec4f> initialState(size);
+    for (int y = 0; y < size.height; ++y) {
+      for (int x = 0; x < size.width; ++x) {
+        initialState(y, x) = cv::Vec4f(
+            pyramidLevel.dstDisparity(dstIdx)(y, x),
+            pyramidLevel.dstCost(dstIdx)(y, x),
+            pyramidLevel.dstConfidence(dstIdx)(y, x),
+            0);
+      }
+    }
+    for (GLuint& state : states) {
+      state = createTargetTexture(size, GL_RGBA32F, GL_RGBA);
+    }
+    glBindTexture(GL_TEXTURE_2D, states[0]);
+    glTexSubImage2D(
+        GL_TEXTURE_2D, 0, 0, 0, size.width, size.height, GL_RGBA, GL_FLOAT, initialState.data);
+  }
+
+  ~DstTextures() {
+    for (const GLuint texture : {fovMask, foregroundMask, backgroundDisparity, variance}) {
+      glDeleteTextures(1, &texture);
+    }
+    for (const GLuint texture : {projColor, projColorBias, ssds, costs, threshold}) {
+      glDeleteTextures(1, &texture);
+    }
+    glDeleteTextures(projWarps.size(), projWarps.data());
+    glDeleteTextures(states.size(), states.data());
+  }
+
+  // Bind the inputs shared by every program
+  void bind(const GLuint program, const GLuint state, const GLuint iterStart) const {
+    glUseProgram(program);
+    bindTextureIfUsed(program, "state", 0, GL_TEXTURE_2D, state);
+    bindTextureIfUsed(program, "iterStart", 1, GL_TEXTURE_2D, iterStart);
+    bindTextureIfUsed(program, "fovMask", 2, GL_TEXTURE_2D, fovMask);
+    bindTextureIfUsed(program, "foregroundMask", 3, GL_TEXTURE_2D, foregroundMask);
+    bindTextureIfUsed(program, "backgroundDisparity", 4, GL_TEXTURE_2D, backgroundDisparity);
+    bindTextureIfUsed(program, "variance", 5, GL_TEXTURE_2D, variance);
+    setUniformIfUsed(program, "dstSize", size.width, size.height);
+    setUniformIfUsed(program, "dstLayer", dstLayer);
+  }
+
+  cv::Mat_<cv::Vec4f> download(const GLuint state) const {
+    cv::Mat_<cv::Vec4f> result(size);
+    glBindTexture(GL_TEXTURE_2D, state);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, result.data);
+    return result;
+  }
+
+  const cv::Size size;
+  const int numSrcs;
+  const int dstLayer;
+
+  GLuint fovMask;
+  GLuint foregroundMask;
+  GLuint backgroundDisparity;
+  GLuint variance;
+  GLuint projColor; // one layer per src
+  GLuint projColorBias; // one layer per src
+  std::vector<GLuint> projWarps; // 0 for dst itself
+  std::vector<std::unique_ptr<ReprojectionTexture>> reprojections; // null for dst itself
+
+  GLuint ssds; // one layer per src
+  GLuint costs;
+  GLuint threshold;
+
+  // Rotated so that no pass reads the texture it writes
+  std::array<GLuint, 3> states;
+  GLuint& state = states[0];
+  GLuint& next = states[1];
+  GLuint& spare = states[2];
+};
+
+GpuProposalBackend::GpuProposalBackend(const filesystem::path& reprojectionCacheDir)
+    : programs(std::make_unique<Programs>()), reprojectionCacheDir(reprojectionCacheDir) {
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+}
+
+GpuProposalBackend::~GpuProposalBackend() {}
+
+void GpuProposalBackend::randomProposals(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int numProposalsIn,
+    const float minDepthMetersIn,
+    const float maxDepthMetersIn) {
+  numProposals = numProposalsIn;
+  minDepthMeters = minDepthMetersIn;
+  maxDepthMeters = maxDepthMetersIn;
+}
+
+void GpuProposalBackend::pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterationsIn) {
+  iterations = iterationsIn;
+}
+
+void GpuProposalBackend::endLevel(PyramidLevel<PixelType>& pyramidLevel) {
+  if (numProposals > 0 || iterations > 0) {
+    for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
+      processDst(pyramidLevel, dstIdx);
+    }
+  }
+  numProposals = 0;
+  iterations = 0;
+}
+
+// SSDs against every src, then (cost, confidence) of the proposal given by the mode
+void GpuProposalBackend::evaluate(DstTextures& dst, const int mode) {
+  const GLuint ssd = programs->ssd[mode];
+  bindTextureIfUsed(ssd, "projColor", 6, GL_TEXTURE_2D_ARRAY, dst.projColor);
+  bindTextureIfUsed(ssd, "projColorBias", 7, GL_TEXTURE_2D_ARRAY, dst.projColorBias);
+  for (int srcIdx = 0; srcIdx < dst.numSrcs; ++srcIdx) {
+    if (srcIdx == dst.dstLayer) {
+      continue;
+    }
+    const ReprojectionTexture& reprojection = *dst.reprojections[srcIdx];
+    bindTextureIfUsed(ssd, "reprojection", 8, GL_TEXTURE_3D, reprojection.texture);
+    bindTextureIfUsed(ssd, "projWarp", 9, GL_TEXTURE_2D, dst.projWarps[srcIdx]);
+    glUniform3fv(glGetUniformLocation(ssd, "reprojectionScale"), 1, reprojection.scale.data());
+    glUniform3fv(glGetUniformLocation(ssd, "reprojectionOffset"), 1, reprojection.offset.data());
+    setUniformIfUsed(ssd, "srcLayer", srcIdx);
+    programs->render(ssd, dst.size, {dst.ssds}, srcIdx);
+  }
+
+  const GLuint combine = programs->combine;
+  dst.bind(combine, dst.state, dst.state);
+  bindTextureIfUsed(combine, "ssds", 6, GL_TEXTURE_2D_ARRAY, dst.ssds);
+  setUniformIfUsed(combine, "numSrcs", dst.numSrcs);
+  programs->render(combine, dst.size, {dst.costs});
+}
+
+void GpuProposalBackend::processDst(PyramidLevel<PixelType>& pyramidLevel, const int dstIdx) {
+  DstTextures dst(pyramidLevel, dstIdx, reprojectionCacheDir);
+
+  // Table lookups clamp to the disparity range of the reprojection table
+  const float maxDisparity = 1.0f / minDepthMeters;
+  if (maxDisparity > ReprojectionTable::maxDisparity()) {
+    LOG_FIRST_N(WARNING, 1) << folly::sformat(
+        "GPU backend limits disparities to {}, depths closer than {}m are clamped",
+        ReprojectionTable::maxDisparity(),
+        1.0f / ReprojectionTable::maxDisparity());
+  }
+
+  auto setCommonUniforms = [&](const GLuint program, const float varThresh) {
+    setUniformIfUsed(program, "hasForegroundMasks", GLint(pyramidLevel.hasForegroundMasks));
+    setUniformIfUsed(program, "varThresh", varThresh);
+    setUniformIfUsed(program, "minDisparity", 1.0f / maxDepthMeters);
+    setUniformIfUsed(
+        program, "maxDisparity", std::min(maxDisparity, ReprojectionTable::maxDisparity()));
+    setUniformIfUsed(program, "seed", pyramidLevel.level);
+  };
+
+  auto setProposalUniforms = [&](const GLuint program,
+                                 const float varThresh,
+                                 const int proposalIdx,
+                                 const std::array<int, 2>& offset) {
+    setCommonUniforms(program, varThresh);
+    setUniformIfUsed(program, "proposalIdx", proposalIdx);
+    setUniformIfUsed(program, "offset", offset[0], offset[1]);
+  };
+
+  auto runPass = [&](const int mode,
+                     const float varThresh,
+                     const GLuint iterStart,
+                     const int proposalIdx = 0,
+                     const std::array<int, 2>& offset = {{0, 0}}) {
+    dst.bind(programs->ssd[mode], dst.state, iterStart);
+    setProposalUniforms(programs->ssd[mode], varThresh, proposalIdx, offset);
+    evaluate(dst, mode);
+
+    const GLuint update = programs->update[mode];
+    dst.bind(update, dst.state, iterStart);
+    setProposalUniforms(update, varThresh, proposalIdx, offset);
+    bindTextureIfUsed(update, "costs", 6, GL_TEXTURE_2D, dst.costs);
+    if (mode == kCurrent) {
+      programs->render(update, dst.size, {dst.next, dst.threshold});
+    } else {
+      bindTextureIfUsed(update, "threshold", 7, GL_TEXTURE_2D, dst.threshold);
+      programs->render(update, dst.size, {dst.next});
+    }
+    std::swap(dst.state, dst.next);
+  };
+
+  if (numProposals > 0) {
+    LOG(INFO) << folly::sformat("-- random proposals (GPU): {}", pyramidLevel.rigDst[dstIdx].id);
+    const float varHighDev = kRandomPropHighVarDeviation * pyramidLevel.varHighThresh;
+    const float varHighThresh = std::max(varHighDev, pyramidLevel.varNoiseFloor);
+    runPass(kCurrent, varHighThresh, dst.state);
+    for (int i = 0; i < numProposals; ++i) {
+      runPass(kRandom, varHighThresh, dst.state, i);
+    }
+  }
+
+  const GLuint pingPong = programs->pingPong;
+  auto runPingPongPass = [&](const bool begin, const bool resetChanged, const GLuint iterStart) {
+    dst.bind(pingPong, dst.state, iterStart);
+    setCommonUniforms(pingPong, pyramidLevel.varNoiseFloor);
+    setUniformIfUsed(pingPong, "begin", GLint(begin));
+    setUniformIfUsed(pingPong, "resetChanged", GLint(resetChanged));
+    programs->render(pingPong, dst.size, {dst.next});
+    std::swap(dst.state, dst.next);
+  };
+
+  if (iterations > 0) {
+    runPingPongPass(false, true, dst.state); // everything changed before the first iteration
+  }
+  for (int it = 1; it <= iterations; ++it) {
+    LOG(INFO) << folly::sformat(
+        "-- ping pong (GPU): iter {}/{}, {}", it, iterations, pyramidLevel.rigDst[dstIdx].id);
+
+    // spare holds the state at the start of the iteration, state/next the best so far
+    std::swap(dst.state, dst.spare);
+    const GLuint iterStart = dst.spare;
+    dst.bind(pingPong, iterStart, iterStart);
+    setCommonUniforms(pingPong, pyramidLevel.varNoiseFloor);
+    setUniformIfUsed(pingPong, "begin", GLint(true));
+    programs->render(pingPong, dst.size, {dst.state});
+
+    for (const auto& candidateNeighborOffset : candidateTemplateOriginal) {
+      runPass(kPingPong, pyramidLevel.varNoiseFloor, iterStart, 0, candidateNeighborOffset);
+    }
+    runPingPongPass(false, false, iterStart);
+  }
+
+  // Read back (disparity, cost, confidence)
+  const cv::Mat_<cv::Vec4f> result = dst.download(dst.state);
+  for (int y = 0; y < dst.size.height; ++y) {
+    for (int x = 0; x < dst.size.width; ++x) {
+      pyramidLevel.dstDisparity(dstIdx)(y, x) = result(y, x)[0];
+      pyramidLevel.dstCost(dstIdx)(y, x) = result(y, x)[1];
+      pyramidLevel.dstConfidence(dstIdx)(y, x) = result(y, x)[2];
+    }
+  }
+}
+
+} // namespace depth_estimation
+} // namespace fb360_dep
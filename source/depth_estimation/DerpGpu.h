@@ -0,0 +1,63 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "source/depth_estimation/Derp.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+// Runs random proposals and ping pong propagation as OpenGL fragment passes
+// Every pass evaluates one proposal for every pixel of a dst: one pass per src computes the SSDs,
+// a second pass keeps the best ones and turns them into a cost, a third one accepts or rejects
+// the proposal. Inputs for a dst are uploaded once per level and stay on the GPU, together with
+// the (disparity, cost, confidence) state, from the first random proposal to the last ping pong
+// iteration. The stages are deferred until endLevel(), which runs them dst by dst and reads the
+// results back
+//
+// Requires a current OpenGL 3.3 context (e.g. an offscreen GlWindow) on the calling thread
+// Random numbers differ from the CPU implementation, so results are similar but not identical
+class GpuProposalBackend : public ProposalBackend {
+ public:
+  // reprojectionCacheDir: see ReprojectionTable::getOrCompute
+  explicit GpuProposalBackend(const filesystem::path& reprojectionCacheDir = "");
+  ~GpuProposalBackend() override;
+
+  void randomProposals(
+      PyramidLevel<PixelType>& pyramidLevel,
+      const int numProposals,
+      const float minDepthMeters,
+      const float maxDepthMeters) override;
+
+  void pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterations) override;
+
+  void endLevel(PyramidLevel<PixelType>& pyramidLevel) override;
+
+ private:
+  struct Programs;
+  struct DstTextures;
+
+  void processDst(PyramidLevel<PixelType>& pyramidLevel, const int dstIdx);
+  void evaluate(DstTextures& dst, const int mode);
+
+  std::unique_ptr<Programs> programs;
+  const filesystem::path reprojectionCacheDir;
+
+  // Work recorded for the current level
+  int numProposals = 0;
+  float minDepthMeters = 0;
+  float maxDepthMeters = 0;
+  int iterations = 0;
+};
+
+} // namespace depth_estimation
+} // namespace fb360_dep
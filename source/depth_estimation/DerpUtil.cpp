@@ -7,30 +7,17 @@
 
 #include "source/depth_estimation/DerpUtil.h"
 
-#include <queue>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 #include <vector>
 
+#include "source/util/ThreadPool.h"
+
 namespace fb360_dep {
 namespace depth_estimation {
 
-class PointDistance {
- public:
-  std::array<int, 2> m_point;
-  double m_distance;
-  PointDistance(std::array<int, 2> point, double distance) {
-    m_point = point;
-    m_distance = distance;
-  }
-};
-
-bool operator>(const PointDistance& ptDist1, const PointDistance& ptDist2) {
-  return ptDist1.m_distance > ptDist2.m_distance;
-}
-
-bool operator<(const PointDistance& ptDist1, const PointDistance& ptDist2) {
-  return ptDist1.m_distance < ptDist2.m_distance;
-}
-
 // Get the world point associated with (x, y, disparity) in the disparity map,
 // at the given level, using normalized camera objects.
 Camera::Vector3 dstToWorldPoint(
@@ -85,43 +72,9 @@ std::vector<int> mapSrcToDstIndexes(const Camera::Rig& rigSrc, const Camera::Rig
   return dst2srcIdxs;
 }
 
-std::vector<std::array<int, 2>> prunePingPongCandidates(
-    const std::vector<std::array<int, 2>>& pingPongCandidateOffsets,
-    const cv::Mat_<cv::Vec3b>& labImage,
-    const std::array<int, 2>& startPoint,
-    const size_t numNeighbors) {
-  std::priority_queue<PointDistance> closestPointDistances;
-  std::vector<std::array<int, 2>> closestPointOffsets(numNeighbors);
-  const cv::Vec3b basePixel = labImage(startPoint[1], startPoint[0]);
-  for (const auto& pingPongCandidateOffset : pingPongCandidateOffsets) {
-    const std::array<int, 2>& curPoint = {
-        {startPoint[0] + pingPongCandidateOffset[0], startPoint[1] + pingPongCandidateOffset[1]}};
-    if (curPoint[0] < 0 || curPoint[0] > labImage.cols - 1 || curPoint[1] < 0 ||
-        curPoint[1] > labImage.rows - 1) {
-      continue;
-    }
-
-    const cv::Vec3b& curPixel = labImage(curPoint[1], curPoint[0]);
-    const PointDistance curPointDistance =
-        PointDistance(pingPongCandidateOffset, cv::norm(basePixel, curPixel, cv::NORM_L2));
-    if (closestPointDistances.size() < numNeighbors) {
-      closestPointDistances.push(curPointDistance);
-    } else if (curPointDistance < closestPointDistances.top()) {
-      closestPointDistances.pop();
-      closestPointDistances.push(curPointDistance);
-    }
-  }
-
-  for (size_t i = 0; i < numNeighbors; ++i) {
-    PointDistance closestPointDistance = closestPointDistances.top();
-    closestPointDistances.pop();
-    closestPointOffsets[i] = closestPointDistance.m_point;
-  }
-  return closestPointOffsets;
-}
-
 // Compute biased and ubiased SSD
-std::pair<float, float> computeSSD(
+// Reference implementation, one bilinear lookup per window pixel
+std::pair<float, float> computeSSDReference(
     const cv::Mat_<PixelType>& dstColor,
     const int x,
     const int y,
@@ -159,6 +112,340 @@ std::pair<float, float> computeSSD(
   return ssd;
 }
 
+// Window rows are flattened into runs of kChannels * (2 * radius + 1) floats, so the kernels only
+// see contiguous arrays:
+//   src = (1 - wy) * ((1 - wx) * g0[i] + wx * g0[i + kChannels]) +
+//         wy * ((1 - wx) * g1[i] + wx * g1[i + kChannels])
+//   ssdBias += (dst - src)^2, ssdNoBias += (dst - src - bias)^2
+// Kernels take the run length kN at compile time, so the loops of a known window are unrolled, or
+// n at runtime if kN is 0
+static const int kChannels = PixelType::channels;
+
+template <int kN>
+static void accumulateSSDScalar(
+    float& ssdBias,
+    float& ssdNoBias,
+    const float* const dst,
+    const float* const g0,
+    const float* const g1,
+    const float* const bias,
+    const float* const w, // (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy
+    const int n) {
+  const int len = kN > 0 ? kN : n;
+  for (int i = 0; i < len; ++i) {
+    const float src =
+        w[0] * g0[i] + w[1] * g0[i + kChannels] + w[2] * g1[i] + w[3] * g1[i + kChannels];
+    const float diffBias = dst[i] - src;
+    const float diffNoBias = diffBias - bias[i];
+    ssdBias += diffBias * diffBias;
+    ssdNoBias += diffNoBias * diffNoBias;
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEP_SSD_X86 1
+
+template <int kN>
+static void accumulateSSDSse(
+    float& ssdBias,
+    float& ssdNoBias,
+    const float* const dst,
+    const float* const g0,
+    const float* const g1,
+    const float* const bias,
+    const float* const w,
+    const int n) {
+  const __m128 w0 = _mm_set1_ps(w[0]);
+  const __m128 w1 = _mm_set1_ps(w[1]);
+  const __m128 w2 = _mm_set1_ps(w[2]);
+  const __m128 w3 = _mm_set1_ps(w[3]);
+  __m128 accBias = _mm_setzero_ps();
+  __m128 accNoBias = _mm_setzero_ps();
+  const int len = kN > 0 ? kN : n;
+  int i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m128 src = _mm_mul_ps(w0, _mm_loadu_ps(g0 + i));
+    src = _mm_add_ps(src, _mm_mul_ps(w1, _mm_loadu_ps(g0 + i + kChannels)));
+    src = _mm_add_ps(src, _mm_mul_ps(w2, _mm_loadu_ps(g1 + i)));
+    src = _mm_add_ps(src, _mm_mul_ps(w3, _mm_loadu_ps(g1 + i + kChannels)));
+    const __m128 diffBias = _mm_sub_ps(_mm_loadu_ps(dst + i), src);
+    const __m128 diffNoBias = _mm_sub_ps(diffBias, _mm_loadu_ps(bias + i));
+    accBias = _mm_add_ps(accBias, _mm_mul_ps(diffBias, diffBias));
+    accNoBias = _mm_add_ps(accNoBias, _mm_mul_ps(diffNoBias, diffNoBias));
+  }
+  alignas(16) float lanes[2][4];
+  _mm_store_ps(lanes[0], accBias);
+  _mm_store_ps(lanes[1], accNoBias);
+  ssdBias += lanes[0][0] + lanes[0][1] + lanes[0][2] + lanes[0][3];
+  ssdNoBias += lanes[1][0] + lanes[1][1] + lanes[1][2] + lanes[1][3];
+  accumulateSSDScalar<kN % 4>(ssdBias, ssdNoBias, dst + i, g0 + i, g1 + i, bias + i, w, len - i);
+}
+
+template <int kN>
+__attribute__((target("avx"))) static void accumulateSSDAvx(
+    float& ssdBias,
+    float& ssdNoBias,
+    const float* const dst,
+    const float* const g0,
+    const float* const g1,
+    const float* const bias,
+    const float* const w,
+    const int n) {
+  const __m256 w0 = _mm256_set1_ps(w[0]);
+  const __m256 w1 = _mm256_set1_ps(w[1]);
+  const __m256 w2 = _mm256_set1_ps(w[2]);
+  const __m256 w3 = _mm256_set1_ps(w[3]);
+  __m256 accBias = _mm256_setzero_ps();
+  __m256 accNoBias = _mm256_setzero_ps();
+  const int len = kN > 0 ? kN : n;
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256 src = _mm256_mul_ps(w0, _mm256_loadu_ps(g0 + i));
+    src = _mm256_add_ps(src, _mm256_mul_ps(w1, _mm256_loadu_ps(g0 + i + kChannels)));
+    src = _mm256_add_ps(src, _mm256_mul_ps(w2, _mm256_loadu_ps(g1 + i)));
+    src = _mm256_add_ps(src, _mm256_mul_ps(w3, _mm256_loadu_ps(g1 + i + kChannels)));
+    const __m256 diffBias = _mm256_sub_ps(_mm256_loadu_ps(dst + i), src);
+    const __m256 diffNoBias = _mm256_sub_ps(diffBias, _mm256_loadu_ps(bias + i));
+    accBias = _mm256_add_ps(accBias, _mm256_mul_ps(diffBias, diffBias));
+    accNoBias = _mm256_add_ps(accNoBias, _mm256_mul_ps(diffNoBias, diffNoBias));
+  }
+  alignas(32) float lanes[2][8];
+  _mm256_store_ps(lanes[0], accBias);
+  _mm256_store_ps(lanes[1], accNoBias);
+  for (int lane = 0; lane < 8; ++lane) {
+    ssdBias += lanes[0][lane];
+    ssdNoBias += lanes[1][lane];
+  }
+  accumulateSSDScalar<kN % 8>(ssdBias, ssdNoBias, dst + i, g0 + i, g1 + i, bias + i, w, len - i);
+}
+#endif
+
+using AccumulateSSDFn = void (*)(
+    float&,
+    float&,
+    const float* const,
+    const float* const,
+    const float* const,
+    const float* const,
+    const float* const,
+    const int);
+
+template <int kN>
+static AccumulateSSDFn getAccumulateSSDFn(const SSDKernel kernel) {
+  switch (kernel) {
+#ifdef DEP_SSD_X86
+    case SSDKernel::AVX:
+      return &accumulateSSDAvx<kN>;
+    case SSDKernel::SSE:
+      return &accumulateSSDSse<kN>;
+#endif
+    default:
+      return &accumulateSSDScalar<kN>;
+  }
+}
+
+SSDKernel getBestSSDKernel() {
+#ifdef DEP_SSD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    return SSDKernel::AVX;
+  }
+  return SSDKernel::SSE;
+#else
+  // Flattened scalar loops are auto-vectorized by the compiler (e.g. NEON)
+  return SSDKernel::Scalar;
+#endif
+}
+
+// Converts w consecutive pixels starting at column x of row y, clamping to edge, to floats
+// multiplied by scale
+template <typename T>
+static void loadRowClamped(
+    float* const out,
+    const cv::Mat_<T>& image,
+    const int x,
+    const int y,
+    const int w,
+    const float scale = 1) {
+  const int yc = math_util::clamp(y, 0, image.rows - 1);
+  const T* const row = image[yc];
+  if (0 <= x && x + w <= image.cols) {
+    const auto* const values = &row[x][0];
+    for (int i = 0; i < w * kChannels; ++i) {
+      out[i] = values[i] * scale;
+    }
+    return;
+  }
+  for (int i = 0; i < w; ++i) {
+    const T& p = row[math_util::clamp(x + i, 0, image.cols - 1)];
+    for (int c = 0; c < kChannels; ++c) {
+      out[i * kChannels + c] = p[c] * scale;
+    }
+  }
+}
+
+DstPatch::DstPatch(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& bias,
+    const int radius)
+    : radius(radius), bias(bias), maxValue(cv_util::maxPixelValue(dstColor)) {
+  CHECK_LE(radius, kMaxRadius);
+  const int diameter = 2 * radius + 1;
+  for (int dy = 0; dy < diameter; ++dy) {
+    float* const row = values + dy * diameter * kChannels;
+    loadRowClamped(row, dstColor, x - radius, y - radius + dy, diameter);
+  }
+}
+
+// Same result as computeSSDReference, up to floating point rounding
+// All window samples share the same sub-pixel offset, so the window is interpolated from a
+// single (2r + 2) x (2r + 2) grid of src pixels instead of four lookups per pixel
+// dstSrcColor values are multiplied by srcScale to bring them to the range of dstColor
+// kRadius is dst.radius, known at compile time, or -1 to take it from dst at runtime
+template <int kRadius, typename TSrc>
+static std::pair<float, float> computeSSDImpl(
+    const SSDKernel kernel,
+    const DstPatch& dst,
+    const cv::Mat_<TSrc>& dstSrcColor,
+    const float srcScale,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias) {
+  static_assert(kRadius <= DstPatch::kMaxRadius, "window too large for DstPatch");
+  DCHECK(kRadius < 0 || kRadius == dst.radius);
+  const int kMaxRadius = kRadius < 0 ? DstPatch::kMaxRadius : kRadius; // sizes the arrays
+  const int kMaxRowLen = (2 * kMaxRadius + 1) * kChannels;
+  const int kRowLen = kRadius < 0 ? 0 : kMaxRowLen;
+  const AccumulateSSDFn accumulate = getAccumulateSSDFn<kRowLen>(kernel);
+  const int radius = kRadius < 0 ? dst.radius : kRadius;
+  const int diameter = 2 * radius + 1;
+  const int rowLen = diameter * kChannels;
+  const int gridLen = rowLen + kChannels;
+
+  // Same rounding convention as cv_util::getPixelBilinear
+  const float xf = std::round(xDstSrc);
+  const float yf = std::round(yDstSrc);
+  const float wx = xDstSrc - xf + 0.5f;
+  const float wy = yDstSrc - yf + 0.5f;
+  const float w[4] = {(1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy};
+  const int xGrid = int(xf) - 1 - radius;
+  const int yGrid = int(yf) - 1 - radius;
+
+  float grid[(kMaxRowLen + kChannels) * (2 * kMaxRadius + 2)];
+  float bias[kMaxRowLen];
+  for (int i = 0; i <= diameter; ++i) {
+    loadRowClamped(grid + i * gridLen, dstSrcColor, xGrid, yGrid + i, diameter + 1, srcScale);
+  }
+  for (int i = 0; i < rowLen; ++i) {
+    bias[i] = float(dst.bias[i % kChannels]) - dstSrcBias[i % kChannels];
+  }
+
+  std::pair<float, float> ssd = {0.0f, 0.0f};
+  for (int dy = 0; dy < diameter; ++dy) {
+    accumulate(
+        ssd.first,
+        ssd.second,
+        dst.values + dy * rowLen,
+        grid + dy * gridLen,
+        grid + (dy + 1) * gridLen,
+        bias,
+        w,
+        rowLen);
+  }
+
+  const float scaleFactor = 1.0f / math_util::square(dst.maxValue);
+  ssd.first *= scaleFactor;
+  ssd.second *= scaleFactor;
+
+  return ssd;
+}
+
+// Runs computeSSDImpl for the radius of dst, at compile time if there is an instantiation for it
+template <typename TSrc>
+static std::pair<float, float> computeSSDForRadius(
+    const SSDKernel kernel,
+    const DstPatch& dst,
+    const cv::Mat_<TSrc>& dstSrcColor,
+    const float srcScale,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias) {
+  switch (dst.radius) {
+    case 1:
+      return computeSSDImpl<1>(kernel, dst, dstSrcColor, srcScale, xDstSrc, yDstSrc, dstSrcBias);
+    case 2:
+      return computeSSDImpl<2>(kernel, dst, dstSrcColor, srcScale, xDstSrc, yDstSrc, dstSrcBias);
+    default:
+      return computeSSDImpl<-1>(kernel, dst, dstSrcColor, srcScale, xDstSrc, yDstSrc, dstSrcBias);
+  }
+}
+
+std::pair<float, float> computeSSD(
+    const SSDKernel kernel,
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias,
+    const int radius) {
+  const DstPatch dst(dstColor, x, y, dstBias, radius);
+  return computeSSDForRadius(kernel, dst, dstSrcColor, 1, xDstSrc, yDstSrc, dstSrcBias);
+}
+
+std::pair<float, float> computeSSD(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias,
+    const int radius) {
+  const DstPatch dst(dstColor, x, y, dstBias, radius);
+  return computeSSD(dst, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias);
+}
+
+std::pair<float, float> computeSSD(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<CompactPixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias,
+    const int radius) {
+  const DstPatch dst(dstColor, x, y, dstBias, radius);
+  return computeSSD(dst, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias);
+}
+
+std::pair<float, float> computeSSD(
+    const DstPatch& dst,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias) {
+  static const SSDKernel kKernel = getBestSSDKernel();
+  return computeSSDForRadius(kKernel, dst, dstSrcColor, 1, xDstSrc, yDstSrc, dstSrcBias);
+}
+
+std::pair<float, float> computeSSD(
+    const DstPatch& dst,
+    const cv::Mat_<CompactPixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias) {
+  static const SSDKernel kKernel = getBestSSDKernel();
+  return computeSSDForRadius(
+      kKernel, dst, dstSrcColor, kCompactPixelScale, xDstSrc, yDstSrc, dstSrcBias);
+}
+
 void plotDstPointInSrc(
     const Camera& camDst,
     const int x,
@@ -197,16 +484,139 @@ void plotDstPointInSrc(
 cv::Mat_<PixelType> project(
     const cv::Mat_<PixelType>& srcColor,
     const cv::Mat_<cv::Vec2f>& warpDstToSrc) {
-  cv::Mat_<PixelType> dstColor(warpDstToSrc.size());
-  cv::remap(srcColor, dstColor, warpDstToSrc, cv::Mat(), cv::INTER_CUBIC, cv::BORDER_CONSTANT);
+  cv::Mat_<PixelType> dstColor;
+  project(dstColor, srcColor, warpDstToSrc);
   return dstColor;
 }
 
+void project(
+    cv::Mat_<PixelType>& dstColor,
+    const cv::Mat_<PixelType>& srcColor,
+    const cv::Mat_<cv::Vec2f>& warpDstToSrc) {
+  CHECK_NE(dstColor.data, srcColor.data) << "cannot project in place";
+  dstColor.create(warpDstToSrc.size());
+  cv::remap(srcColor, dstColor, warpDstToSrc, cv::Mat(), cv::INTER_CUBIC, cv::BORDER_CONSTANT);
+}
+
 // Color bias is just the average over a given area around each pixel
 cv::Mat_<PixelType> colorBias(const cv::Mat_<PixelType>& color, const int blurRadius) {
   return cv_util::blur(color, blurRadius);
 }
 
+void colorBias(cv::Mat_<PixelType>& bias, const cv::Mat_<PixelType>& color, const int blurRadius) {
+  if (blurRadius < 1 || bias.data == color.data) {
+    bias = colorBias(color, blurRadius);
+    return;
+  }
+  const int w = 2 * blurRadius + 1;
+  cv::blur(color, bias, cv::Size(w, w));
+}
+
+// Sliding box sums, vertical then horizontal, over blocks of rows. Sums are kept in integers so
+// adding the entering row/column and removing the leaving one is exact
+void colorBiasAndVariance(
+    cv::Mat_<PixelType>* bias,
+    cv::Mat_<float>* variance,
+    const cv::Mat_<PixelType>& color,
+    const int radius,
+    const int numThreads) {
+  CHECK(bias || variance);
+  CHECK_GE(radius, 0);
+  CHECK_LT(radius, std::min(color.rows, color.cols)) << "window larger than image";
+  CHECK(!bias || bias->data != color.data) << "cannot compute bias in place";
+  const int w = color.cols;
+  const int h = color.rows;
+  if (bias) {
+    bias->create(color.size());
+  }
+  if (variance) {
+    variance->create(color.size());
+  }
+
+  const int kChannels = PixelType::channels;
+  const int kRowsPerBlock = 32;
+  const double kScale = 1.0 / cv_util::maxPixelValue(color);
+  const double count = math_util::square(2 * radius + 1);
+  const auto reflect = [](const int i, const int size) {
+    return cv::borderInterpolate(i, size, cv::BORDER_REFLECT_101); // same as cv::blur
+  };
+
+  const int numBlocks = (h + kRowsPerBlock - 1) / kRowsPerBlock;
+  parallelFor(
+      0,
+      numBlocks,
+      1,
+      [&](const int block) {
+        std::vector<uint32_t> colSum(w * kChannels, 0);
+        std::vector<uint64_t> colSumSq(w * kChannels, 0);
+        const auto accumulateRow = [&](const int y, const bool add) {
+          const PixelType* row = color[reflect(y, h)];
+          for (int x = 0; x < w; ++x) {
+            for (int c = 0; c < kChannels; ++c) {
+              const uint64_t v = row[x][c];
+              if (add) {
+                colSum[x * kChannels + c] += v;
+                colSumSq[x * kChannels + c] += v * v;
+              } else {
+                colSum[x * kChannels + c] -= v;
+                colSumSq[x * kChannels + c] -= v * v;
+              }
+            }
+          }
+        };
+
+        const int yBegin = block * kRowsPerBlock;
+        const int yEnd = std::min(yBegin + kRowsPerBlock, h);
+        for (int y = yBegin - radius; y <= yBegin + radius; ++y) {
+          accumulateRow(y, true);
+        }
+        for (int y = yBegin; y < yEnd; ++y) {
+          if (y > yBegin) {
+            accumulateRow(y + radius, true);
+            accumulateRow(y - radius - 1, false);
+          }
+
+          uint32_t sum[kChannels] = {};
+          uint64_t sumSq[kChannels] = {};
+          for (int x = -radius; x <= radius; ++x) {
+            for (int c = 0; c < kChannels; ++c) {
+              sum[c] += colSum[reflect(x, w) * kChannels + c];
+              sumSq[c] += colSumSq[reflect(x, w) * kChannels + c];
+            }
+          }
+          for (int x = 0; x < w; ++x) {
+            if (x > 0) {
+              const int xIn = reflect(x + radius, w) * kChannels;
+              const int xOut = reflect(x - radius - 1, w) * kChannels;
+              for (int c = 0; c < kChannels; ++c) {
+                sum[c] += colSum[xIn + c] - colSum[xOut + c];
+                sumSq[c] += colSumSq[xIn + c] - colSumSq[xOut + c];
+              }
+            }
+
+            float var = 0;
+            for (int c = 0; c < kChannels; ++c) {
+              const double mean = sum[c] / count;
+              if (bias) {
+                (*bias)(y, x)[c] = cv::saturate_cast<uint16_t>(mean);
+              }
+              // var = E[X^2] - E[X]^2, OpenCV order: BGR
+              const double varChannel = sumSq[c] / count - math_util::square(mean);
+              var += kRgbWeights[kChannels - 1 - c] * varChannel * math_util::square(kScale);
+            }
+            if (variance) {
+              (*variance)(y, x) = var;
+            }
+          }
+        }
+      },
+      numThreads);
+}
+
+void compactColor(cv::Mat_<CompactPixelType>& compact, const cv::Mat_<PixelType>& color) {
+  color.convertTo(compact, compact.type(), 1.0f / kCompactPixelScale);
+}
+
 // Computes per-channel variance [0, 1]
 // var = E[(X - mu)^2] = E[X^2] - E[X]^2
 cv::Mat computeRgbVariance(const cv::Mat& image, const int windowRadius) {
@@ -224,7 +634,6 @@ cv::Mat computeRgbVariance(const cv::Mat& image, const int windowRadius) {
 // Combined RGB variance [0, 1]
 cv::Mat_<float> computeImageVariance(const cv::Mat& image) {
   CHECK(image.channels() == 3 || image.channels() == 4) << "Input image can only be RGB(A)";
-  const int kVarWinRadius = 1;
   const cv::Mat_<cv::Vec3f> varRgb = computeRgbVariance(cv_util::removeAlpha(image), kVarWinRadius);
 
   cv::Mat_<float> varChannels[3];
@@ -254,13 +663,20 @@ isOutsideImageCircle(const Camera& cam, const int x, const int y, const cv::Size
   return isOutsideImageCircle(cam, x, y, size, ignored);
 }
 
-std::vector<cv::Mat_<bool>>
-generateFovMasks(const Camera::Rig& rig, const cv::Size& size, const int threads) {
+std::vector<cv::Mat_<bool>> generateFovMasks(
+    const Camera::Rig& rig,
+    const cv::Size& size,
+    const int threads,
+    RayMapCache* rayMaps) {
   std::vector<cv::Mat_<bool>> masks(rig.size());
   ThreadPool threadPool(threads);
   for (int i = 0; i < int(rig.size()); ++i) {
     threadPool.spawn([&, i] {
       const Camera& cam = rig[i];
+      if (rayMaps) {
+        masks[i] = rayMaps->get(cam, size).fovMask.clone(); // cached masks may be read-only
+        return;
+      }
       masks[i] = cv::Mat_<bool>(size);
       for (int y = 0; y < masks[i].rows; ++y) {
         for (int x = 0; x < masks[i].cols; ++x) {
@@ -273,6 +689,28 @@ generateFovMasks(const Camera::Rig& rig, const cv::Size& size, const int threads
   return masks;
 }
 
+cv::Mat_<float> layerDisparities(
+    const cv::Mat_<float>& foreground,
+    const cv::Mat_<float>& background,
+    const int threads) {
+  CHECK(foreground.size() == background.size())
+      << "Background and foreground images must be of the same size!";
+  const int kRowsPerTask = 16;
+  cv::Mat_<float> layered(foreground.size());
+  parallelFor(
+      0,
+      layered.rows,
+      kRowsPerTask,
+      [&](const int y) {
+        for (int x = 0; x < layered.cols; ++x) {
+          const float value = foreground(y, x);
+          layered(y, x) = value > 0 ? value : background(y, x);
+        }
+      },
+      threads);
+  return layered;
+}
+
 filesystem::path getImageDir(const filesystem::path& dir, const ImageType& imageType) {
   return dir / imageTypes[int(imageType)];
 }
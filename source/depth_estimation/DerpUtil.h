@@ -7,17 +7,23 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <vector>
 
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 #include "source/util/ImageTypes.h"
+#include "source/util/MathUtil.h"
+#include "source/util/RayMapCache.h"
 
 namespace fb360_dep {
 namespace depth_estimation {
 
 using PixelType = cv::Vec3w;
 using PixelTypeFloat = cv::Vec3f; // floating point version of PixelType
+using CompactPixelType = cv::Vec<uint8_t, PixelType::channels>; // 8-bit storage of PixelType
+const float kCompactPixelScale = 257.0f; // PixelType value of one CompactPixelType step
 
 const float kLevelScale = 0.9f;
 const float kScaleDisparityPlot = 255.0f;
@@ -25,13 +31,14 @@ const float kScaleCostPlot = 255.0f / 100.0f;
 const float kScaleConfidencePlot = 255.0f * 100.0f;
 
 const std::vector<float> kRgbWeights = {0.3333f, 0.3334f, 0.3333f};
+const int kVarWinRadius = 1; // window radius of computeImageVariance
 
 // Use variance corresponding to 8 bit rounding error
 // If noise adds 0.5 in [0..255]
 // => var = integral_0.5^0.5 (x/255^2) = 1/12 / 255^2 = 1/12/65025 in [0..1]
 const float kMinVar = 1.0f / 12.0f / 65025.0f;
 
-const std::vector<std::array<int, 2>> candidateTemplateOriginal = {
+const std::array<std::array<int, 2>, 9> candidateTemplateOriginal = {
     {{{0, 0}},
      {{-1, 0}},
      {{1, 0}}, //   []      []
@@ -52,6 +59,17 @@ Camera::Vector3 dstToWorldPoint(
     const double shiftX = 0.5,
     const double shiftY = 0.5);
 
+// Same as above for pixel centers, through the ray map of camDst at the size of the image
+inline Camera::Vector3 dstToWorldPoint(
+    const Camera& camDst,
+    const cv::Mat_<cv::Vec3f>& rays,
+    const int x,
+    const int y,
+    const float disparity) {
+  const cv::Vec3f& ray = rays(y, x);
+  return camDst.position + Camera::Vector3(ray[0], ray[1], ray[2]) * (1.0f / disparity);
+}
+
 bool worldToSrcPoint(
     Camera::Vector2& pSrc,
     const Camera::Vector3& pWorld,
@@ -61,13 +79,84 @@ bool worldToSrcPoint(
 
 std::vector<int> mapSrcToDstIndexes(const Camera::Rig& rigSrc, const Camera::Rig& rigDst);
 
-std::vector<std::array<int, 2>> prunePingPongCandidates(
-    const std::vector<std::array<int, 2>>& pingPongCandidateOffsets,
+// Writes to selected the (at most) kNumNeighbors offsets of candidates whose Lab color is closest
+// to the one at (x, y), nearest first, ties in candidate order. Offsets outside the image are
+// skipped. Returns how many were written
+// Called per pixel, so nothing is allocated: squared distances are integers, and the closest are
+// kept sorted on the stack by insertion
+template <size_t kNumNeighbors, size_t kNumCandidates>
+int selectColorCandidates(
+    std::array<std::array<int, 2>, kNumNeighbors>& selected,
+    const std::array<std::array<int, 2>, kNumCandidates>& candidates,
     const cv::Mat_<cv::Vec3b>& labImage,
-    const std::array<int, 2>& startPoint,
-    const size_t numNeighbors);
+    const int x,
+    const int y) {
+  const cv::Vec3b& base = labImage(y, x);
+  std::array<int, kNumNeighbors> distances;
+  int count = 0;
+  for (const std::array<int, 2>& offset : candidates) {
+    const int xx = x + offset[0];
+    const int yy = y + offset[1];
+    if (xx < 0 || xx >= labImage.cols || yy < 0 || yy >= labImage.rows) {
+      continue;
+    }
+    const cv::Vec3b& lab = labImage(yy, xx);
+    int distance = 0;
+    for (int c = 0; c < 3; ++c) {
+      distance += math_util::square(int(lab[c]) - int(base[c]));
+    }
+    if (count == int(kNumNeighbors) && distance >= distances[count - 1]) {
+      continue;
+    }
+    int i = std::min(count, int(kNumNeighbors) - 1);
+    for (; i > 0 && distances[i - 1] > distance; --i) {
+      distances[i] = distances[i - 1];
+      selected[i] = selected[i - 1];
+    }
+    distances[i] = distance;
+    selected[i] = offset;
+    count = std::min(count + 1, int(kNumNeighbors));
+  }
+  return count;
+}
+
+// SSD kernels, from slowest to fastest. Best one available is picked at runtime
+enum class SSDKernel { Scalar, SSE, AVX };
+
+SSDKernel getBestSSDKernel();
+
+std::pair<float, float> computeSSDReference(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias,
+    const int radius);
+
+// The dst side of computeSSD: the window around (x, y) in dstColor and its bias
+// Loaded once per dst pixel and shared by every src and disparity it is compared against
+struct DstPatch {
+  static const int kMaxRadius = 4;
+
+  DstPatch(
+      const cv::Mat_<PixelType>& dstColor,
+      const int x,
+      const int y,
+      const PixelType& bias,
+      const int radius);
+
+  int radius;
+  PixelType bias;
+  float maxValue; // of dstColor
+  // (2 * radius + 1) rows of 2 * radius + 1 pixels, clamped to edge
+  float values[(2 * kMaxRadius + 1) * (2 * kMaxRadius + 1) * PixelType::channels];
+};
 
 std::pair<float, float> computeSSD(
+    const SSDKernel kernel,
     const cv::Mat_<PixelType>& dstColor,
     const int x,
     const int y,
@@ -78,6 +167,46 @@ std::pair<float, float> computeSSD(
     const PixelType& dstSrcBias,
     const int radius);
 
+// Uses getBestSSDKernel()
+std::pair<float, float> computeSSD(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias,
+    const int radius);
+
+// Same as above, with dstSrcColor stored in 8 bits and scaled to the range of dstColor on the fly
+// dstSrcBias is in the range of dstColor
+std::pair<float, float> computeSSD(
+    const cv::Mat_<PixelType>& dstColor,
+    const int x,
+    const int y,
+    const PixelType& dstBias,
+    const cv::Mat_<CompactPixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias,
+    const int radius);
+
+// Same as above, with the dst window already loaded
+std::pair<float, float> computeSSD(
+    const DstPatch& dst,
+    const cv::Mat_<PixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelType& dstSrcBias);
+
+std::pair<float, float> computeSSD(
+    const DstPatch& dst,
+    const cv::Mat_<CompactPixelType>& dstSrcColor,
+    const float xDstSrc,
+    const float yDstSrc,
+    const PixelTypeFloat& dstSrcBias);
+
 void plotDstPointInSrc(
     const Camera& camDst,
     const int x,
@@ -93,14 +222,46 @@ cv::Mat_<PixelType> project(
     const cv::Mat_<PixelType>& srcColor,
     const cv::Mat_<cv::Vec2f>& warpDstToSrc);
 
+// Same as above, but reuses dstColor's buffer when it already has the right size
+void project(
+    cv::Mat_<PixelType>& dstColor,
+    const cv::Mat_<PixelType>& srcColor,
+    const cv::Mat_<cv::Vec2f>& warpDstToSrc);
+
 cv::Mat_<PixelType> colorBias(const cv::Mat_<PixelType>& color, const int blurRadius);
 
+// Same as above, but reuses bias' buffer when it already has the right size
+void colorBias(cv::Mat_<PixelType>& bias, const cv::Mat_<PixelType>& color, const int blurRadius);
+
+// colorBias and computeImageVariance of color in a single pass, parallelized over rows
+// Either output may be null; buffers are reused when they already have the right size
+void colorBiasAndVariance(
+    cv::Mat_<PixelType>* bias,
+    cv::Mat_<float>* variance,
+    const cv::Mat_<PixelType>& color,
+    const int radius,
+    const int numThreads = -1);
+
+// Rounds color to 8 bits, reusing compact's buffer when it already has the right size
+void compactColor(cv::Mat_<CompactPixelType>& compact, const cv::Mat_<PixelType>& color);
+
 cv::Mat computeRgbVariance(const cv::Mat& image, const int windowRadius);
 
 cv::Mat_<float> computeImageVariance(const cv::Mat& image);
 
-std::vector<cv::Mat_<bool>>
-generateFovMasks(const Camera::Rig& rig, const cv::Size& size, const int threads);
+// Masks come from rayMaps if given
+std::vector<cv::Mat_<bool>> generateFovMasks(
+    const Camera::Rig& rig,
+    const cv::Size& size,
+    const int threads,
+    RayMapCache* rayMaps = nullptr);
+
+// Foreground disparity where it is valid (> 0), background disparity elsewhere, e.g. where the
+// foreground is nan. Rows are layered in parallel
+cv::Mat_<float> layerDisparities(
+    const cv::Mat_<float>& foreground,
+    const cv::Mat_<float>& background,
+    const int threads = -1);
 
 filesystem::path getImageDir(const filesystem::path& dir, const ImageType& imageType);
 
@@ -0,0 +1,615 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/String.h>
+
+#include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/depth_estimation/UpsampleDisparityLib.h"
+#include "source/mesh_stream/MeshConversion.h"
+#include "source/render/BackgroundSubtractionUtil.h"
+#include "source/util/BoundedQueue.h"
+#include "source/util/RayMapCache.h"
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+using namespace fb360_dep::image_util;
+
+const std::string kUsageMessage = R"(
+ - Runs foreground masks, depth estimation, disparity upsampling and binary conversion on a range
+ of frames in a single process. Images pass between the steps in memory: only the full size color
+ images are read, and only the ConvertToBinary outputs are written to <bin>. Steps run as a
+ pipeline, so while one frame is being converted the next ones are in depth estimation.
+
+ - Pyramid levels are resized from the full size color, as scripts/render/resize.py does, and
+ depth estimation stops at the finest level not wider than --resolution.
+
+ - Foreground masks are used if --background_color is given. The background is estimated once
+ per shot, ahead of time: its disparity levels (DerpCLI) and its disparity at --resolution
+ (UpsampleDisparity) are inputs.
+
+ - Fusing the outputs is left to ConvertToBinary --run_conversion=false.
+
+ - Example:
+   ./FramePipeline \
+   --rig=/path/to/rigs/rig_calibrated.json \
+   --color=/path/to/video/color \
+   --output_root=/path/to/output \
+   --bin=/path/to/output/bin \
+   --first=000000 \
+   --last=000099
+ )";
+
+DEFINE_string(background_color, "", "path to full size background color (empty = no masks)");
+DEFINE_string(background_disp, "", "path to background disparity levels (required with masks)");
+DEFINE_string(background_disp_up, "", "path to background disparity at --resolution");
+DEFINE_string(background_frame, "000000", "background frame (lexical)");
+DEFINE_int32(astc_block_size, 4, "ASTC block width and height in pixels (4, 5, 6, 8)");
+DEFINE_string(
+    bc7_profile,
+    "veryfast",
+    "BC7 speed vs quality tradeoff (ultrafast, veryfast, fast, basic, slow)");
+DEFINE_string(bin, "", "output directory containing binary data (required)");
+DEFINE_int32(blur_radius, 1, "foreground masks gaussian blur radius (0 = no blur)");
+DEFINE_bool(cache_ray_maps, false, "reuse camera ray maps saved next to the rig");
+DEFINE_string(cameras, "", "comma-separated destinations to render (empty for all)");
+DEFINE_string(color, "", "path to full size input color images (required)");
+DEFINE_bool(compact_proj_colors, false, "store projected colors in 8 bits");
+DEFINE_bool(do_bilateral_filter, true, "apply bilateral filter at each level");
+DEFINE_bool(do_median_filter, true, "apply median filter to disparity at each level");
+DEFINE_string(first, "000000", "first frame to process (lexical)");
+DEFINE_int32(frames_in_flight, 2, "number of frames in depth estimation at the same time");
+DEFINE_double(gamma_correction, 2.2 / 1.8, "exponent to raise color channels before BC7 encoding");
+DEFINE_string(last, "000000", "last frame to process (lexical)");
+DEFINE_string(
+    level_widths,
+    "2048,1024,512,256,200,128,100,80,60,50",
+    "pyramid level widths, finest first (see scripts/render/config.py)");
+DEFINE_int32(mask_width, 2048, "width foreground masks are computed at");
+DEFINE_double(max_depth_m, 1e4, "max depth (m)");
+DEFINE_double(min_depth_m, .50, "min depth (m)");
+DEFINE_int32(mismatches_start_level, -1, "(-1 = no mismatch handling)");
+DEFINE_int32(morph_closing_size, 4, "foreground masks morphological closing size (0 = none)");
+DEFINE_string(
+    output_formats,
+    "idx,vtx,bc7",
+    "saved formats, comma separated (idx, vtx, bc7, rgba, astc)");
+DEFINE_string(output_root, "", "path to output directory, for per level profiles (required)");
+DEFINE_bool(partial_coverage, false, "set to true if no 360 coverage");
+DEFINE_int32(ping_pong_iterations, 1, "number of spatial propagation iterations");
+DEFINE_int32(random_proposals, 2, "number of proposed random disparities before propagation");
+DEFINE_int32(resolution, 2048, "output disparity resolution (width in pixels)");
+DEFINE_string(rig, "", "path to camera rig .json (required)");
+DEFINE_string(save_disparity, "", "if not empty, also save the output disparities (.pfm) here");
+DEFINE_double(sigma, 0.05, "upsampling bilateral filter color difference sigma");
+DEFINE_string(simplifier, "quadric", "mesh simplification method (quadric, grid = faster)");
+DEFINE_double(tear_ratio, 0.95, "depth ratio that causes mesh to tear");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
+DEFINE_double(threshold, 0.04, "foreground/background RGB L2-norm threshold [0..1]");
+DEFINE_int32(triangles, 150000, "number of triangles per camera mesh (<= 0: no simplification)");
+DEFINE_double(var_high_thresh, 1e-3, "ignore variances higher than this threshold");
+DEFINE_double(var_noise_floor, 4e-5, "noise variance floor on original, full-size images");
+DEFINE_string(warp_cache_dir, "", "directory to cache projection warps in (empty = no cache)");
+
+// Same as UpsampleDisparity
+const float kUpsampleWeightB = 0.5;
+const float kUpsampleWeightG = 0.5;
+const float kUpsampleWeightR = 1.0;
+
+void verifyInputs(const std::vector<std::string>& outputFormats) {
+  CHECK_NE(FLAGS_rig, "");
+  CHECK_NE(FLAGS_color, "");
+  CHECK_NE(FLAGS_bin, "");
+  CHECK_NE(FLAGS_output_root, "");
+  CHECK_LE(FLAGS_first, FLAGS_last);
+  CHECK_GE(FLAGS_frames_in_flight, 1);
+  CHECK_GE(FLAGS_random_proposals, 0);
+  CHECK_GT(FLAGS_resolution, 0);
+  CHECK_GT(FLAGS_mask_width, 0);
+  CHECK(FLAGS_simplifier == "quadric" || FLAGS_simplifier == "grid")
+      << "Invalid simplifier specified: " << FLAGS_simplifier;
+  if (!FLAGS_background_color.empty()) {
+    CHECK_NE(FLAGS_background_disp, "") << "Foreground masks need background disparity levels";
+    CHECK_NE(FLAGS_background_disp_up, "") << "Foreground masks need upsampled background";
+  }
+  for (const std::string& outputFormat : outputFormats) {
+    // We allow size 0 inputs to ensure stray commas are ignored, i.e. idx,,vtx is fine
+    CHECK(
+        outputFormat.empty() || outputFormat == "idx" || outputFormat == "vtx" ||
+        outputFormat == "bc7" || outputFormat == "rgba" || outputFormat == "astc")
+        << "Invalid output format specified: " << outputFormat;
+  }
+  CHECK(bc7_util::isValidASTCBlockSize(FLAGS_astc_block_size))
+      << "Invalid ASTC block size specified: " << FLAGS_astc_block_size;
+}
+
+std::vector<int> getLevelWidths() {
+  std::vector<std::string> values;
+  folly::split(",", FLAGS_level_widths, values, true);
+  std::vector<int> widths;
+  for (const std::string& value : values) {
+    widths.push_back(std::stoi(value));
+    CHECK(widths.size() == 1 || widths.back() < widths[widths.size() - 2])
+        << "--level_widths must be decreasing";
+  }
+  CHECK_GT(widths.size(), 0);
+  return widths;
+}
+
+// Aspect ratio of cam, with an even height, as scripts/render/resize.py and UpsampleDisparity do
+cv::Size getScaledSize(const Camera& cam, const int width) {
+  int height = std::round(float(cam.resolution.y()) / cam.resolution.x() * width);
+  height += height % 2;
+  return cv::Size(width, height);
+}
+
+// Same as resizing a mask image and thresholding it at 127
+cv::Mat_<bool> resizeMask(const cv::Mat_<bool>& mask, const cv::Size& size) {
+  if (mask.size() == size) {
+    return mask;
+  }
+  cv::Mat_<float> resized;
+  mask.convertTo(resized, CV_32F);
+  cv::resize(resized, resized, size, 0, 0, cv::INTER_AREA);
+  return resized > 0.5f;
+}
+
+// Everything that only depends on the rig and the background, set up before the frames
+struct Shot {
+  Camera::Rig rigSrc; // normalized
+  Camera::Rig rigDst; // normalized
+  Camera::Rig rigConvert; // destinations at full size, as ConvertToBinary takes them
+  std::vector<int> dst2srcIdxs;
+  int numFrames;
+  int widthFullSize;
+  int heightFullSize;
+
+  std::map<int, cv::Size> levelSizes;
+  int numLevels;
+  int levelEnd; // finest level estimated
+  cv::Size sizeUp; // output disparity size
+
+  bool useForegroundMasks;
+  cv::Size maskSize;
+  std::vector<cv::Mat_<cv::Vec3f>> backgrounds; // per src, blurred, at maskSize
+  std::map<int, std::vector<cv::Mat_<float>>> backgroundDisparities; // per level, per dst
+  std::vector<cv::Mat_<float>> backgroundDisparitiesUp; // per dst, at sizeUp
+
+  std::unique_ptr<RayMapCache> rayMaps;
+  std::map<int, std::vector<cv::Mat_<bool>>> dstFovMasks; // per level
+  std::map<int, std::unique_ptr<LevelProjections>> projections; // per level, a slot per frame
+
+  mesh_conversion::ColorOptions colorOptions;
+  mesh_conversion::DepthOptions depthOptions;
+  bool saveBc7;
+  bool saveRgba;
+  bool saveAstc;
+  bool saveMesh;
+};
+
+// A frame on its way through the pipeline
+struct Frame {
+  int iFrame; // 0 is --first
+  std::string name;
+  std::vector<cv::Mat> colors; // per src, full size, as decoded
+  std::vector<cv::Mat_<float>> disparities; // per dst, at sizeUp
+};
+
+Shot setUpShot(const std::vector<std::string>& outputFormats) {
+  Shot shot;
+  shot.rigSrc = Camera::loadRig(FLAGS_rig);
+  CHECK_GT(shot.rigSrc.size(), 0) << "no source cameras!";
+  shot.rigDst = filterDestinations(shot.rigSrc, FLAGS_cameras);
+  CHECK_GT(shot.rigDst.size(), 0) << "no destination cameras!";
+  shot.rigConvert = shot.rigDst;
+  shot.dst2srcIdxs = mapSrcToDstIndexes(shot.rigSrc, shot.rigDst);
+  shot.numFrames = std::stoi(FLAGS_last) - std::stoi(FLAGS_first) + 1;
+
+  // Sizes must be computed before normalizing
+  const Camera& camRef = shot.rigDst[0];
+  shot.widthFullSize = camRef.resolution.x();
+  shot.heightFullSize = camRef.resolution.y();
+  const std::vector<int> levelWidths = getLevelWidths();
+  shot.numLevels = levelWidths.size();
+  shot.levelEnd = -1;
+  for (int level = 0; level < shot.numLevels; ++level) {
+    shot.levelSizes[level] = getScaledSize(camRef, levelWidths[level]);
+    if (shot.levelEnd < 0 && levelWidths[level] <= FLAGS_resolution) {
+      shot.levelEnd = level;
+    }
+  }
+  CHECK_GE(shot.levelEnd, 0) << "--resolution is below the coarsest level";
+  shot.sizeUp = getScaledSize(camRef, FLAGS_resolution);
+
+  // Normalize cameras (needed to generate FOV masks and to process frames)
+  Camera::normalizeRig(shot.rigSrc);
+  Camera::normalizeRig(shot.rigDst);
+
+  const int numDsts = shot.rigDst.size();
+  shot.useForegroundMasks = !FLAGS_background_color.empty();
+  if (shot.useForegroundMasks) {
+    const std::vector<cv::Mat_<PixelType>> backgroundColorsFullSize = loadImages<PixelType>(
+        FLAGS_background_color, shot.rigSrc, FLAGS_background_frame, FLAGS_threads);
+    const cv::Size& sizeFullSize = backgroundColorsFullSize[0].size();
+    const int maskWidth = std::min(sizeFullSize.width, FLAGS_mask_width);
+    shot.maskSize =
+        cv::Size(maskWidth, lrint(maskWidth * sizeFullSize.height / float(sizeFullSize.width)));
+    shot.backgrounds = background_subtraction::blurBackgrounds(
+        cv_util::resizeImages<PixelType>(
+            backgroundColorsFullSize, shot.maskSize, cv::INTER_AREA, FLAGS_threads),
+        FLAGS_blur_radius,
+        FLAGS_threads);
+
+    shot.backgroundDisparitiesUp = cv_util::resizeImages<float>(
+        loadImages<float>(
+            FLAGS_background_disp_up, shot.rigDst, FLAGS_background_frame, FLAGS_threads),
+        shot.sizeUp,
+        cv::INTER_NEAREST,
+        FLAGS_threads);
+  } else {
+    shot.backgroundDisparitiesUp.resize(numDsts);
+  }
+
+  shot.rayMaps = std::make_unique<RayMapCache>(
+      FLAGS_cache_ray_maps ? RayMapCache::getDefaultDir(FLAGS_rig) : "");
+  for (int level = shot.levelEnd; level < shot.numLevels; ++level) {
+    const cv::Size& sizeLevel = shot.levelSizes.at(level);
+    shot.dstFovMasks[level] =
+        generateFovMasks(shot.rigDst, sizeLevel, FLAGS_threads, shot.rayMaps.get());
+    shot.projections[level] =
+        std::make_unique<LevelProjections>(FLAGS_frames_in_flight, FLAGS_warp_cache_dir);
+    shot.backgroundDisparities[level] = shot.useForegroundMasks
+        ? loadLevelImages<float>(
+              FLAGS_background_disp, level, shot.rigDst, FLAGS_background_frame, FLAGS_threads)
+        : std::vector<cv::Mat_<float>>(numDsts);
+  }
+
+  shot.colorOptions.astcBlockSize = FLAGS_astc_block_size;
+  shot.colorOptions.bc7Profile = FLAGS_bc7_profile;
+  shot.colorOptions.gammaCorrection = FLAGS_gamma_correction;
+  shot.colorOptions.threads = FLAGS_threads;
+  shot.depthOptions.triangles = FLAGS_triangles;
+  shot.depthOptions.simplifier = FLAGS_simplifier;
+  shot.depthOptions.tearRatio = FLAGS_tear_ratio;
+  shot.depthOptions.bin = FLAGS_bin;
+  shot.depthOptions.threads = FLAGS_threads;
+  shot.saveBc7 = mesh_conversion::containsFormat(outputFormats, "bc7");
+  shot.saveRgba = mesh_conversion::containsFormat(outputFormats, "rgba");
+  shot.saveAstc = mesh_conversion::containsFormat(outputFormats, "astc");
+  shot.saveMesh = mesh_conversion::containsFormat(outputFormats, "idx") ||
+      mesh_conversion::containsFormat(outputFormats, "vtx");
+  return shot;
+}
+
+Frame decodeFrame(const Shot& shot, const int iFrame) {
+  Frame frame;
+  frame.iFrame = iFrame;
+  frame.name = intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
+  LOG(INFO) << folly::sformat("Decoding frame {}...", frame.name);
+  frame.colors.resize(shot.rigSrc.size());
+  parallelFor(
+      0,
+      frame.colors.size(),
+      1,
+      [&](const int srcIdx) {
+        const filesystem::path path = imagePath(FLAGS_color, shot.rigSrc[srcIdx].id, frame.name);
+        frame.colors[srcIdx] = cv_util::loadImageUnchanged(path);
+        CHECK_EQ(frame.colors[srcIdx].cols, shot.widthFullSize)
+            << folly::sformat("{} is not full size", path.string());
+        CHECK_EQ(frame.colors[srcIdx].rows, shot.heightFullSize)
+            << folly::sformat("{} is not full size", path.string());
+      },
+      FLAGS_threads);
+  return frame;
+}
+
+// Per src masks at size, all pass without foreground masks
+std::vector<cv::Mat_<bool>> getSrcMasks(
+    const std::vector<cv::Mat_<bool>>& masks,
+    const cv::Size& size,
+    const int numSrcs) {
+  if (masks.empty()) {
+    return cv_util::generateAllPassMasks(size, numSrcs);
+  }
+  std::vector<cv::Mat_<bool>> masksResized(masks.size());
+  parallelFor(
+      0,
+      masks.size(),
+      1,
+      [&](const int i) { masksResized[i] = resizeMask(masks[i], size); },
+      FLAGS_threads);
+  return masksResized;
+}
+
+std::vector<cv::Mat_<bool>> getDstMasks(
+    const Shot& shot,
+    const std::vector<cv::Mat_<bool>>& srcMasks) {
+  std::vector<cv::Mat_<bool>> dstMasks;
+  for (const int srcIdx : shot.dst2srcIdxs) {
+    dstMasks.push_back(srcMasks[srcIdx]);
+  }
+  return dstMasks;
+}
+
+// Foreground masks, coarse to fine depth estimation and upsampling to sizeUp, all in memory
+void estimateDepth(const Shot& shot, Frame& frame, const int slot) {
+  const int numSrcs = shot.rigSrc.size();
+  const int numDsts = shot.rigDst.size();
+  std::vector<cv::Mat_<PixelType>> colors(numSrcs);
+  parallelFor(
+      0,
+      numSrcs,
+      1,
+      [&](const int srcIdx) {
+        colors[srcIdx] = cv_util::convertImage<PixelType>(frame.colors[srcIdx]);
+      },
+      FLAGS_threads);
+
+  // Computed once, at mask size, levels resize them as if they had been saved and resized
+  std::vector<cv::Mat_<bool>> masks;
+  if (shot.useForegroundMasks) {
+    masks = background_subtraction::generateForegroundMasks<PixelType>(
+        shot.backgrounds,
+        cv_util::resizeImages<PixelType>(colors, shot.maskSize, cv::INTER_AREA, FLAGS_threads),
+        shot.maskSize,
+        FLAGS_blur_radius,
+        FLAGS_threshold,
+        FLAGS_morph_closing_size,
+        FLAGS_threads);
+  }
+
+  std::vector<cv::Mat_<float>> disparities; // coarser level, per dst
+  std::vector<cv::Mat_<bool>> dstMasksCoarse;
+  for (int level = shot.numLevels - 1; level >= shot.levelEnd; --level) {
+    const cv::Size& sizeLevel = shot.levelSizes.at(level);
+    const std::vector<cv::Mat_<bool>> srcMasks = getSrcMasks(masks, sizeLevel, numSrcs);
+    const std::vector<cv::Mat_<bool>> dstMasks = getDstMasks(shot, srcMasks);
+    const std::vector<cv::Mat_<float>>& backgroundDisparities =
+        shot.backgroundDisparities.at(level);
+
+    PyramidLevel<PixelType> framePyramidLevel(
+        frame.iFrame,
+        frame.name,
+        shot.numFrames,
+        level,
+        shot.numLevels,
+        shot.levelSizes,
+        shot.rigSrc,
+        shot.rigDst,
+        shot.dst2srcIdxs,
+        cv_util::resizeImages<PixelType>(colors, sizeLevel, cv::INTER_AREA, FLAGS_threads),
+        srcMasks,
+        shot.dstFovMasks.at(level),
+        backgroundDisparities,
+        shot.widthFullSize,
+        shot.heightFullSize,
+        FLAGS_color,
+        FLAGS_var_noise_floor,
+        FLAGS_var_high_thresh,
+        shot.useForegroundMasks,
+        FLAGS_output_root,
+        FLAGS_threads);
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      framePyramidLevel.dstRays(dstIdx) = shot.rayMaps->get(shot.rigDst[dstIdx], sizeLevel).rays;
+    }
+    framePyramidLevel.compactProjColors = FLAGS_compact_proj_colors;
+    LevelProjections& levelProjections = *shot.projections.at(level);
+    levelProjections.acquire(framePyramidLevel, slot, FLAGS_threads);
+
+    if (!disparities.empty()) {
+      const std::vector<cv::Mat_<float>> dispsNextLevel = upsampleDisparities(
+          shot.rigDst,
+          disparities,
+          backgroundDisparities,
+          dstMasksCoarse,
+          dstMasks,
+          sizeLevel,
+          shot.useForegroundMasks,
+          FLAGS_threads,
+          shot.rayMaps.get());
+      for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+        framePyramidLevel.dsts[dstIdx].disparity = dispsNextLevel[dstIdx];
+      }
+    }
+
+    const bool kSaveDebugImages = false;
+    const bool kSaveOutputs = false;
+    processLevel(
+        framePyramidLevel,
+        "",
+        shot.useForegroundMasks,
+        FLAGS_output_root,
+        FLAGS_random_proposals,
+        FLAGS_partial_coverage,
+        FLAGS_min_depth_m,
+        FLAGS_max_depth_m,
+        FLAGS_do_median_filter,
+        kSaveDebugImages,
+        FLAGS_ping_pong_iterations,
+        FLAGS_mismatches_start_level,
+        FLAGS_do_bilateral_filter,
+        FLAGS_threads,
+        nullptr,
+        kSaveOutputs);
+    levelProjections.release(framePyramidLevel, slot);
+
+    disparities.resize(numDsts);
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      disparities[dstIdx] = framePyramidLevel.dstDisparity(dstIdx);
+    }
+    dstMasksCoarse = dstMasks;
+  }
+
+  if (disparities[0].size() == shot.sizeUp) {
+    frame.disparities = disparities;
+  } else {
+    // Same as UpsampleDisparity, guided by the full size color
+    const std::vector<cv::Mat_<bool>> dstMasksUp =
+        getDstMasks(shot, getSrcMasks(masks, shot.sizeUp, numSrcs));
+    frame.disparities = upsampleDisparities(
+        shot.rigDst,
+        disparities,
+        shot.backgroundDisparitiesUp,
+        dstMasksCoarse,
+        dstMasksUp,
+        shot.sizeUp,
+        shot.useForegroundMasks,
+        FLAGS_threads,
+        shot.rayMaps.get());
+    const int radius = getRadius(disparities[0].size(), shot.sizeUp);
+    ThreadPool threadPool(FLAGS_threads);
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      threadPool.spawn([&, dstIdx] {
+        const cv::Mat_<cv::Vec3f> colorUp = cv_util::resizeImage(
+            cv_util::convertImage<cv::Vec3f>(frame.colors[shot.dst2srcIdxs[dstIdx]]), shot.sizeUp);
+        frame.disparities[dstIdx] = generalizedJointBilateralFilter<float, cv::Vec3f>(
+            frame.disparities[dstIdx],
+            colorUp,
+            colorUp,
+            dstMasksUp[dstIdx],
+            radius,
+            FLAGS_sigma,
+            kUpsampleWeightB,
+            kUpsampleWeightG,
+            kUpsampleWeightR,
+            FLAGS_threads);
+      });
+    }
+    threadPool.join();
+  }
+
+  // Same as LayerDisparities: foreground where it is valid (> 0), background elsewhere
+  if (shot.useForegroundMasks) {
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      cv::Mat_<float>& disparity = frame.disparities[dstIdx];
+      const cv::Mat_<float>& background = shot.backgroundDisparitiesUp[dstIdx];
+      CHECK_EQ(disparity.size(), background.size());
+      for (int y = 0; y < disparity.rows; ++y) {
+        for (int x = 0; x < disparity.cols; ++x) {
+          if (!(disparity(y, x) > 0)) {
+            disparity(y, x) = background(y, x);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Same outputs as ConvertToBinary, saved to <bin>
+void convertFrame(const Shot& shot, const Frame& frame) {
+  const mesh_conversion::EmitFn emit = [](mesh_conversion::OutputFile outputFile) {
+    mesh_conversion::writeOutputFile(FLAGS_bin, outputFile);
+  };
+  ThreadPool threadPool(FLAGS_threads);
+  for (int dstIdx = 0; dstIdx < int(shot.rigConvert.size()); ++dstIdx) {
+    threadPool.spawn([&, dstIdx] {
+      const Camera& cam = shot.rigConvert[dstIdx];
+      if (shot.saveBc7 || shot.saveRgba || shot.saveAstc) {
+        const cv::Mat_<cv::Vec4f> color =
+            cv_util::convertImage<cv::Vec4f>(frame.colors[shot.dst2srcIdxs[dstIdx]]);
+        mesh_conversion::convertColor(
+            cam.id,
+            frame.name,
+            color,
+            shot.saveBc7,
+            shot.saveRgba,
+            shot.saveAstc,
+            shot.colorOptions,
+            emit);
+      }
+      if (shot.saveMesh) {
+        const bool kSaveMesh = true;
+        const bool kSavePfm = false;
+        const bool kSaveObj = false;
+        const bool kSavePly = false;
+        mesh_conversion::convertDepth(
+            cam,
+            frame.name,
+            frame.disparities[dstIdx],
+            cv::Mat_<bool>(),
+            kSaveMesh,
+            kSaveMesh,
+            kSavePfm,
+            kSaveObj,
+            kSavePly,
+            shot.depthOptions,
+            emit);
+      }
+      if (!FLAGS_save_disparity.empty()) {
+        const filesystem::path path = imagePath(FLAGS_save_disparity, cam.id, frame.name, ".pfm");
+        filesystem::create_directories(path.parent_path());
+        cv_util::writeCvMat32FC1ToPFM(path, frame.disparities[dstIdx]);
+      }
+    });
+  }
+  threadPool.join();
+}
+
+int main(int argc, char* argv[]) {
+  system_util::initDep(argc, argv, kUsageMessage);
+
+  boost::timer::cpu_timer timer;
+  std::vector<std::string> outputFormats;
+  folly::split(",", FLAGS_output_formats, outputFormats);
+  verifyInputs(outputFormats);
+  verifyImagePaths(FLAGS_color, Camera::loadRig(FLAGS_rig), FLAGS_first, FLAGS_last);
+
+  const Shot shot = setUpShot(outputFormats);
+  filesystem::create_directories(FLAGS_bin);
+
+  // decode -> depth estimation (frames_in_flight frames) -> conversion
+  // Stages run on dedicated threads connected by bounded queues, and use the shared thread pool
+  // for their own work, so a stage waiting on a queue leaves its cores to the others
+  BoundedQueue<Frame> decodedQueue(FLAGS_frames_in_flight);
+  BoundedQueue<Frame> estimatedQueue(FLAGS_frames_in_flight);
+  std::thread decoder([&] {
+    for (int iFrame = 0; iFrame < shot.numFrames; ++iFrame) {
+      decodedQueue.push(decodeFrame(shot, iFrame));
+    }
+  });
+  std::vector<std::thread> estimators;
+  for (int slot = 0; slot < FLAGS_frames_in_flight; ++slot) {
+    estimators.emplace_back([&, slot] {
+      Frame frame;
+      while (decodedQueue.pop(frame)) {
+        estimateDepth(shot, frame, slot);
+        estimatedQueue.push(std::move(frame));
+      }
+    });
+  }
+  std::thread converter([&] {
+    Frame frame;
+    while (estimatedQueue.pop(frame)) {
+      convertFrame(shot, frame);
+      LOG(INFO) << folly::sformat("Frame {} done. Elapsed time: {}", frame.name, timer.format());
+    }
+  });
+
+  // Shut down stage by stage, each one drains its queue before the next one is closed
+  decoder.join();
+  decodedQueue.close();
+  for (std::thread& estimator : estimators) {
+    estimator.join();
+  }
+  estimatedQueue.close();
+  converter.join();
+
+  mesh_conversion::saveFusedRig(shot.rigConvert, FLAGS_rig, FLAGS_bin);
+  LOG(INFO) << folly::sformat("-- TOTAL: {}", timer.format());
+  return EXIT_SUCCESS;
+}
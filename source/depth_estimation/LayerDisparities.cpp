@@ -13,6 +13,7 @@
 #include "source/util/Camera.h"
 #include "source/util/ImageTypes.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::image_util;
@@ -21,6 +22,9 @@ const std::string kUsageMessage = R"(
    - Layers foreground disparity atop background disparity assuming nans to correspond to locations
    without valid disparities.
 
+   - DerpCLI (with --use_foreground_masks) and UpsampleDisparity (with --background_disp) already
+   save layered disparities, this is only needed for disparities computed without background.
+
    - Example:
      ./LayerDisparities \
      --rig=/path/to/rigs/rig.json \
@@ -41,18 +45,6 @@ DEFINE_string(output, "", "path to output disparity directory");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 
-void layerDisparities(
-    const cv::Mat_<float>& foregroundImage,
-    const cv::Mat_<float>& backgroundImage,
-    const filesystem::path& outputPath) {
-  CHECK(foregroundImage.size() == backgroundImage.size())
-      << "Background and foreground images must be of the same size!";
-  cv::Mat_<float> mask(foregroundImage.size());
-  cv::threshold(foregroundImage, mask, 0.0, 1.0, cv::THRESH_BINARY);
-  cv::Mat_<float> layerImage = foregroundImage.mul(mask) + backgroundImage.mul(1 - mask);
-  cv_util::imwriteExceptionOnFail(outputPath, layerImage * 255);
-}
-
 int main(int argc, char* argv[]) {
   system_util::initDep(argc, argv, kUsageMessage);
 
@@ -74,13 +66,20 @@ int main(int argc, char* argv[]) {
     const std::vector<cv::Mat_<float>> foregroundDisparities =
         loadImages<float>(FLAGS_foreground_disp, rigDst, frameName, FLAGS_threads);
 
+    ThreadPool threadPool(FLAGS_threads);
     for (ssize_t camIdx = 0; camIdx < ssize(rigDst); ++camIdx) {
-      const filesystem::path outputDir =
-          depth_estimation::getImageDir(FLAGS_output, ImageType::disparity, rigDst[camIdx].id);
-      boost::filesystem::create_directories(outputDir);
-      const filesystem::path outputPath = outputDir / (frameName + ".png");
-      layerDisparities(foregroundDisparities[camIdx], backgroundDisparities[camIdx], outputPath);
+      threadPool.spawn([&, camIdx] {
+        const filesystem::path outputDir =
+            depth_estimation::getImageDir(FLAGS_output, ImageType::disparity, rigDst[camIdx].id);
+        boost::filesystem::create_directories(outputDir);
+        const filesystem::path outputPath = outputDir / (frameName + ".png");
+        // cameras are already layered in parallel, one thread per camera
+        const cv::Mat_<float> layered = depth_estimation::layerDisparities(
+            foregroundDisparities[camIdx], backgroundDisparities[camIdx], 0);
+        cv_util::imwriteExceptionOnFail(outputPath, 255 * layered);
+      });
     }
+    threadPool.join();
   }
 
   return EXIT_SUCCESS;
@@ -7,13 +7,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <set>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <folly/Format.h>
 
+#include "source/util/AsyncWriter.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/ImageTypes.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/Numa.h"
+#include "source/util/Profiler.h"
 #include "source/util/SystemUtil.h"
 #include "source/util/ThreadPool.h"
 
@@ -40,13 +47,26 @@ struct PyramidLevel {
     cv::Mat_<bool> fovMask;
     cv::Mat_<bool> foregroundMask;
     cv::Mat_<float> backgroundDisparity;
+    cv::Mat_<bool> warmStartMask; // seeded from the previous frame, empty if none
+    cv::Mat_<bool> roiMask; // pixels being re-solved, the rest is kept as is, empty if all
+    cv::Mat_<cv::Vec3f> rays; // see RayMap, empty if none
+    cv::Mat_<cv::Vec3b> labColor; // see dstLabColor(), empty until needed
+    cv::Mat_<uint8_t> tiles; // see dstTiles(), empty until updateDstTiles()
+    std::vector<uint64_t> tileSrcs; // see dstTileSrcs(), empty if unknown
+    bool remote = false; // solved and saved by another process, only read here
   };
 
+  using CompactPixel = cv::Vec<uint8_t, PixelType::channels>;
+
+  // Projected colors are either in projColor/projColorBias or, for compact projections, in the
+  // 8-bit projColorCompact/projColorBiasCompact. The other pair is empty
   struct Proj {
     cv::Mat_<cv::Vec2f> projWarp;
     cv::Mat_<cv::Vec2f> projWarpInv;
     cv::Mat_<PixelType> projColor;
     cv::Mat_<PixelType> projColorBias;
+    cv::Mat_<CompactPixel> projColorCompact;
+    cv::Mat_<CompactPixel> projColorBiasCompact;
   };
 
   // if first frame is 000039, frameIdx = 0, frameName = 000039
@@ -85,10 +105,25 @@ struct PyramidLevel {
   float varHighThresh;
   bool hasForegroundMasks;
 
+  // If true, projections of srcs other than the dst itself are stored in 8 bits, which halves
+  // the memory and bandwidth of the cost computation at the price of rounding
+  bool compactProjColors = false;
+
   filesystem::path outputDir;
 
+  // If set, results and debug images are encoded and written in the background. Outputs are only
+  // saved once the level is done modifying them, the writer shares their buffers
+  AsyncWriter* writer = nullptr;
+
+  // If true, results are saved layered atop the background disparity (see layerDisparities), as
+  // the output level of a run with foreground masks is. The disparities in memory are unchanged
+  bool layerBackground = false;
+
   int numThreads;
 
+  profiler::Profile profile; // per stage timings and counters of this frame and level
+  size_t peakMatBytes = 0; // see updatePeakMatBytes()
+
   PyramidLevel(
       const int frameIdxIn,
       const std::string& frameNameIn,
@@ -182,6 +217,24 @@ struct PyramidLevel {
     }
   }
 
+  // Approximate memory a frame holds while it is processed at a level of the given size
+  // Warps are shared by all the frames of a level (see LevelProjections) and are not counted
+  static size_t estimateFrameBytes(
+      const cv::Size& size,
+      const int numSrcs,
+      const int numDsts,
+      const bool compactProjColors = false) {
+    const size_t srcBytes = sizeof(PixelType) + sizeof(float) + 2 * sizeof(bool);
+    // color, disparity, cost, confidence, overlap, background disparity, rays and masks, plus
+    // the coarser disparity and masks that seed the level
+    const size_t dstBytes = sizeof(PixelType) + 5 * sizeof(float) + sizeof(int) +
+        sizeof(cv::Vec3f) + 6 * sizeof(bool);
+    // projected color and its bias
+    const size_t projBytes = 2 * (compactProjColors ? sizeof(CompactPixel) : sizeof(PixelType));
+    return size_t(size.area()) *
+        (numSrcs * srcBytes + numDsts * dstBytes + size_t(numSrcs) * numDsts * projBytes);
+  }
+
   template <typename T>
   void createIfEmpty(cv::Mat_<T>& mat, const cv::Size& size, const T& val) {
     if (mat.empty()) {
@@ -206,22 +259,30 @@ struct PyramidLevel {
   }
 
   // createOrRelease: true = create, false = release
+  // Mats are created and filled on the numa node their camera is processed on (see
+  // forEachByNode), so the pages are first touched there rather than by the calling thread
   void createOrReleaseLevelMats(const bool createOrRelease) {
     const float zeroF = 0.0f;
     const bool zeroM = false;
+    ThreadPool threadPool(numThreads);
     CHECK_EQ(srcs.size(), rigSrc.size());
     for (int srcIdx = 0; srcIdx < int(rigSrc.size()); ++srcIdx) {
-      createOrReleaseMat(srcVariance(srcIdx), createOrRelease, sizeLevel, zeroF);
+      threadPool.spawnOnNode(numa::nodeOf(srcIdx, rigSrc.size()), [&, srcIdx] {
+        createOrReleaseMat(srcVariance(srcIdx), createOrRelease, sizeLevel, zeroF);
+      });
     }
 
     CHECK_EQ(dsts.size(), rigDst.size());
     for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
-      createOrReleaseMat(dstDisparity(dstIdx), createOrRelease, sizeLevel, zeroF);
-      createOrReleaseMat(dstMismatchedDisparityMask(dstIdx), createOrRelease, sizeLevel, zeroM);
-      createOrReleaseMat(dstFovMask(dstIdx), createOrRelease, sizeLevel, zeroM);
-      createOrReleaseMat(dstCost(dstIdx), createOrRelease, sizeLevel, zeroF);
-      createOrReleaseMat(dstConfidence(dstIdx), createOrRelease, sizeLevel, zeroF);
+      threadPool.spawnOnNode(numa::nodeOf(dstIdx, rigDst.size()), [&, dstIdx] {
+        createOrReleaseMat(dstDisparity(dstIdx), createOrRelease, sizeLevel, zeroF);
+        createOrReleaseMat(dstMismatchedDisparityMask(dstIdx), createOrRelease, sizeLevel, zeroM);
+        createOrReleaseMat(dstFovMask(dstIdx), createOrRelease, sizeLevel, zeroM);
+        createOrReleaseMat(dstCost(dstIdx), createOrRelease, sizeLevel, zeroF);
+        createOrReleaseMat(dstConfidence(dstIdx), createOrRelease, sizeLevel, zeroF);
+      });
     }
+    threadPool.join();
   }
 
   void createLevelMats() {
@@ -236,10 +297,11 @@ struct PyramidLevel {
 
     ThreadPool threadPool(numThreads);
     for (int srcIdx = 0; srcIdx < int(rigSrc.size()); ++srcIdx) {
-      threadPool.spawn([&, srcIdx] {
+      threadPool.spawnOnNode(numa::nodeOf(srcIdx, rigSrc.size()), [&, srcIdx] {
         // Variance will be used during cost computation, random proposals and
         // disparity mismatch handling
-        srcVariance(srcIdx) = computeImageVariance(srcColor(srcIdx));
+        colorBiasAndVariance(
+            nullptr, &srcVariance(srcIdx), srcColor(srcIdx), kVarWinRadius, numThreads);
       });
     }
     threadPool.join();
@@ -261,6 +323,18 @@ struct PyramidLevel {
     return const_cast<PyramidLevel<PixelType>*>(this)->dstColor(dstId);
   }
 
+  // 8-bit Lab color of the dst, used to prune ping pong candidates
+  // Converted on first use and kept for the rest of the level. Not thread safe for the same dst
+  const cv::Mat_<cv::Vec3b>& dstLabColor(const int dstId) {
+    cv::Mat_<cv::Vec3b>& lab = dsts[dstId].labColor;
+    if (lab.empty()) {
+      cv::Mat_<cv::Vec3b> bgr;
+      dstColor(dstId).convertTo(bgr, CV_8U, 255.0 / cv_util::maxPixelValue(dstColor(dstId)));
+      cv::cvtColor(bgr, lab, cv::COLOR_BGR2Lab);
+    }
+    return lab;
+  }
+
   cv::Mat_<float>& dstDisparity(const int dstId) {
     return dsts[dstId].disparity;
   }
@@ -325,6 +399,110 @@ struct PyramidLevel {
     return const_cast<PyramidLevel<PixelType>*>(this)->dstForegroundMask(dstId);
   }
 
+  cv::Mat_<bool>& dstWarmStartMask(const int dstId) {
+    return dsts[dstId].warmStartMask;
+  }
+
+  const cv::Mat_<bool>& dstWarmStartMask(const int dstId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstWarmStartMask(dstId);
+  }
+
+  cv::Mat_<cv::Vec3f>& dstRays(const int dstId) {
+    return dsts[dstId].rays;
+  }
+
+  const cv::Mat_<cv::Vec3f>& dstRays(const int dstId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstRays(dstId);
+  }
+
+  bool isDstWarmStarted(const int dstId, const int x, const int y) const {
+    const cv::Mat_<bool>& mask = dstWarmStartMask(dstId);
+    return !mask.empty() && mask(y, x);
+  }
+
+  cv::Mat_<bool>& dstRoiMask(const int dstId) {
+    return dsts[dstId].roiMask;
+  }
+
+  const cv::Mat_<bool>& dstRoiMask(const int dstId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstRoiMask(dstId);
+  }
+
+  bool isDstOutsideRoi(const int dstId, const int x, const int y) const {
+    const cv::Mat_<bool>& mask = dstRoiMask(dstId);
+    return !mask.empty() && !mask(y, x);
+  }
+
+  // Square tiles of a dst, flagged with what their pixels need, so stages can skip whole tiles
+  static const int kTileSize = 16;
+  static const uint8_t kTileInFov = 1; // some pixel is in the fov
+  static const uint8_t kTileActive = 2; // some pixel is one the proposal stages solve, see below
+
+  // One flag byte per tile, from updateDstTiles()
+  const cv::Mat_<uint8_t>& dstTiles(const int dstId) const {
+    return dsts[dstId].tiles;
+  }
+
+  // True if the tile of (x, y) has the given flag, or if tiles are not computed
+  bool isDstTile(const int dstId, const int x, const int y, const uint8_t flag) const {
+    const cv::Mat_<uint8_t>& tiles = dstTiles(dstId);
+    return tiles.empty() || (tiles(y / kTileSize, x / kTileSize) & flag);
+  }
+
+  // True if any tile in the row of tiles of y has the given flag, or if tiles are not computed
+  bool isDstTileInRow(const int dstId, const int y, const uint8_t flag) const {
+    const cv::Mat_<uint8_t>& tiles = dstTiles(dstId);
+    if (tiles.empty()) {
+      return true;
+    }
+    const uint8_t* const row = tiles[y / kTileSize];
+    return std::any_of(row, row + tiles.cols, [flag](const uint8_t t) { return t & flag; });
+  }
+
+  // Flags the tiles of a dst. A pixel is solved by random proposals and ping pong if it is in the
+  // fov, in the roi, in the foreground and above the variance noise floor. Pixels of the fov and
+  // the roi outside the foreground are given their background disparity here, as those stages
+  // would, so they can skip the tiles with nothing to solve
+  void updateDstTiles(const int dstId) {
+    const cv::Mat_<bool>& fov = dstFovMask(dstId);
+    const cv::Mat_<bool>& foreground = dstForegroundMask(dstId);
+    const cv::Mat_<float>& variance = dstVariance(dstId);
+    const cv::Mat_<float>& background = dstBackgroundDisparity(dstId);
+    cv::Mat_<float>& disparity = dstDisparity(dstId);
+    cv::Mat_<uint8_t>& tiles = dsts[dstId].tiles;
+    tiles.create((sizeLevel.height + kTileSize - 1) / kTileSize,
+                 (sizeLevel.width + kTileSize - 1) / kTileSize);
+    parallelFor(
+        0,
+        tiles.rows,
+        1,
+        [&](const int ty) {
+          for (int tx = 0; tx < tiles.cols; ++tx) {
+            uint8_t flags = 0;
+            const int yEnd = std::min((ty + 1) * kTileSize, sizeLevel.height);
+            const int xEnd = std::min((tx + 1) * kTileSize, sizeLevel.width);
+            for (int y = ty * kTileSize; y < yEnd; ++y) {
+              for (int x = tx * kTileSize; x < xEnd; ++x) {
+                if (!fov(y, x)) {
+                  continue;
+                }
+                flags |= kTileInFov;
+                if (isDstOutsideRoi(dstId, x, y)) {
+                  continue;
+                }
+                if (!foreground(y, x)) {
+                  disparity(y, x) = background(y, x);
+                } else if (variance(y, x) >= varNoiseFloor) {
+                  flags |= kTileActive;
+                }
+              }
+            }
+            tiles(ty, tx) = flags;
+          }
+        },
+        numThreads);
+  }
+
   cv::Mat_<float>& srcVariance(const int srcId) {
     return srcs[srcId].variance;
   }
@@ -398,6 +576,38 @@ struct PyramidLevel {
     return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColorBias(dstId, srcId);
   }
 
+  static const int kSrcTileSize = 16; // side of the dst tiles of Dst::tileSrcs, in pixels
+
+  // Bit srcIdx is set if src may see dst pixel (x, y), all bits are set if unknown
+  uint64_t dstTileSrcs(const int dstId, const int x, const int y) const {
+    const std::vector<uint64_t>& tileSrcs = dsts[dstId].tileSrcs;
+    if (tileSrcs.empty()) {
+      return ~uint64_t(0);
+    }
+    const int tilesX = (sizeLevel.width + kSrcTileSize - 1) / kSrcTileSize;
+    return tileSrcs[(y / kSrcTileSize) * tilesX + x / kSrcTileSize];
+  }
+
+  bool isCompactProj(const int dstId, const int srcId) const {
+    return !projs[getDstSrcIdx(dstId, srcId)].projColorCompact.empty();
+  }
+
+  cv::Mat_<CompactPixel>& dstProjColorCompact(const int dstId, const int srcId) {
+    return projs[getDstSrcIdx(dstId, srcId)].projColorCompact;
+  }
+
+  const cv::Mat_<CompactPixel>& dstProjColorCompact(const int dstId, const int srcId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColorCompact(dstId, srcId);
+  }
+
+  cv::Mat_<CompactPixel>& dstProjColorBiasCompact(const int dstId, const int srcId) {
+    return projs[getDstSrcIdx(dstId, srcId)].projColorBiasCompact;
+  }
+
+  const cv::Mat_<CompactPixel>& dstProjColorBiasCompact(const int dstId, const int srcId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColorBiasCompact(dstId, srcId);
+  }
+
   cv::Mat_<PixelType>& dstProjColor(const int dstId) {
     return projs[getDstSrcIdx(dstId)].projColor;
   }
@@ -437,21 +647,34 @@ struct PyramidLevel {
       return;
     }
 
-    cv::Mat scaledDstImage = dstImage * scale;
-    if (imageType == ImageType::disparity_levels) {
-      // note: disparity values will be clamped to the [0,1] range (which get scaled
-      // to [0, 2^16 - 1]) and nans will be converted to zero
-      scaledDstImage = cv_util::convertTo<uint16_t>(scaledDstImage);
-    }
-
     const std::string& dstId = rigDst[dstIdx].id;
     const filesystem::path fn =
         depth_estimation::genFilename(outputDir, imageType, level, dstId, frameName, "png");
-    cv_util::imwriteExceptionOnFail(fn, scaledDstImage);
+    write([fn, dstImage, imageType, scale] {
+      cv::Mat scaledDstImage = dstImage * scale;
+      if (imageType == ImageType::disparity_levels) {
+        // note: disparity values will be clamped to the [0,1] range (which get scaled
+        // to [0, 2^16 - 1]) and nans will be converted to zero
+        scaledDstImage = cv_util::convertTo<uint16_t>(scaledDstImage);
+      }
+      cv_util::imwriteExceptionOnFail(fn, scaledDstImage);
+    });
+  }
+
+  // Runs task on the writer if there is one, right away otherwise
+  void write(std::function<void()> task) const {
+    if (writer) {
+      writer->write(std::move(task));
+    } else {
+      task();
+    }
   }
 
   void saveDebugImages() {
     for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
+      if (dsts[dstIdx].remote) {
+        continue;
+      }
       saveDstImage(dstIdx, ImageType::disparity_levels, 1.0f);
       saveDstImage(dstIdx, ImageType::cost, depth_estimation::kScaleCostPlot);
       saveDstImage(dstIdx, ImageType::confidence, depth_estimation::kScaleConfidencePlot);
@@ -483,6 +706,68 @@ struct PyramidLevel {
     return maskedDisparity;
   }
 
+  // Bytes held by the mats of the level, buffers shared by several mats counted once
+  size_t matBytes() const {
+    std::set<const uchar*> seen;
+    size_t bytes = 0;
+    auto add = [&](const cv::Mat& mat) {
+      if (!mat.empty() && seen.insert(mat.datastart).second) {
+        bytes += mat.dataend - mat.datastart;
+      }
+    };
+    for (const Src& src : srcs) {
+      add(src.color);
+      add(src.variance);
+      add(src.foregroundMask);
+      add(src.foregroundMaskDilated);
+    }
+    for (const Dst& dst : dsts) {
+      add(dst.color);
+      add(dst.disparity);
+      add(dst.mismatchedDisparityMask);
+      add(dst.cost);
+      add(dst.confidence);
+      add(dst.overlap);
+      add(dst.fovMask);
+      add(dst.foregroundMask);
+      add(dst.backgroundDisparity);
+      add(dst.warmStartMask);
+      add(dst.roiMask);
+      add(dst.rays);
+      add(dst.labColor);
+      add(dst.tiles);
+    }
+    for (const Proj& proj : projs) {
+      add(proj.projWarp);
+      add(proj.projWarpInv);
+      add(proj.projColor);
+      add(proj.projColorBias);
+      add(proj.projColorCompact);
+      add(proj.projColorBiasCompact);
+    }
+    return bytes;
+  }
+
+  // Raises peakMatBytes to what the mats hold now, call between stages
+  void updatePeakMatBytes() {
+    peakMatBytes = std::max(peakMatBytes, matBytes());
+  }
+
+  void saveProfile() const {
+    const filesystem::path dir =
+        depth_estimation::getImageDir(outputDir, ImageType::profiles, level);
+    filesystem::create_directories(dir);
+    const int64_t peakRssBytes = system_util::getPeakResidentBytes();
+    LOG(INFO) << folly::sformat(
+        "Memory at level {}: mats {:.1f} MB, process peak {:.1f} MB",
+        level,
+        peakMatBytes / 1e6,
+        peakRssBytes / 1e6);
+    const folly::dynamic header = folly::dynamic::object("frame", frameName)("level", level)(
+        "mat_bytes", int64_t(peakMatBytes))("peak_rss_bytes", peakRssBytes);
+    profile.saveJson(dir / (frameName + ".json"), header);
+  }
+
   void saveResults(const std::string& outputFormatsStr) {
     std::vector<std::string> outputFormatsVec;
     folly::split(",", outputFormatsStr, outputFormatsVec);
@@ -491,29 +776,38 @@ struct PyramidLevel {
     const bool saveExr = (outputFormats.find("exr") != outputFormats.end());
     const bool savePfm = true; // always save PFM
     const bool savePng = (outputFormats.find("png") != outputFormats.end());
+    const bool saveDmat = (outputFormats.find("dmat") != outputFormats.end());
 
-    if (!(saveExr || savePfm || savePng)) {
+    if (!(saveExr || savePfm || savePng || saveDmat)) {
       return;
     }
-    ThreadPool threadPool(numThreads);
+    const std::map<std::string, bool> types = {
+        {"exr", saveExr}, {"pfm", savePfm}, {"png", savePng}, {"dmat", saveDmat}};
+    ThreadPool threadPool(writer ? 0 : numThreads);
     for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
-      threadPool.spawn([&, dstIdx] {
-        const cv::Mat_<float>& disp = dstDisparity(dstIdx);
+      if (dsts[dstIdx].remote) {
+        continue;
+      }
+      const cv::Mat_<float>& dispIn = dstDisparity(dstIdx);
+      const cv::Mat_<float>& background = dstBackgroundDisparity(dstIdx);
+      const bool layer = layerBackground && !background.empty();
+      const std::string& dstId = rigDst[dstIdx].id;
+      const filesystem::path& dir = outputDir;
+      auto task = [types, dispIn, background, layer, dstId, dir, level = level,
+                   frameName = frameName] {
+        const cv::Mat_<float> disp = layer ? layerDisparities(dispIn, background, 0) : dispIn;
         const ImageType imageType = ImageType::disparity_levels;
-
-        std::map<std::string, bool> types = {{"exr", saveExr}, {"pfm", savePfm}, {"png", savePng}};
-        for (std::pair<std::string, bool> type : types) {
+        for (const std::pair<const std::string, bool>& type : types) {
           if (!type.second) {
             continue;
           }
           const std::string& t = type.first;
-          const std::string& dstId = rigDst[dstIdx].id;
           const filesystem::path fn =
-              depth_estimation::genFilename(outputDir, imageType, level, dstId, frameName, t);
+              depth_estimation::genFilename(dir, imageType, level, dstId, frameName, t);
           boost::filesystem::create_directories(fn.parent_path());
           if (t == "exr") {
             cv_util::imwriteExceptionOnFail(fn, disp);
-          } else if (t == "pfm") {
+          } else if (t == "pfm" || t == "dmat") {
             cv_util::writeCvMat32FC1ToPFM(fn, disp);
           } else if (t == "png") {
             const cv::Mat_<uint16_t> disp16 = cv_util::convertTo<uint16_t>(disp);
@@ -522,7 +816,12 @@ struct PyramidLevel {
             CHECK(false) << "Invalid type: " << t;
           }
         }
-      });
+      };
+      if (writer) {
+        writer->write(std::move(task));
+      } else {
+        threadPool.spawn(std::move(task));
+      }
     }
     threadPool.join();
   }
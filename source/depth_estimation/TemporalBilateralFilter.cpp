@@ -7,10 +7,16 @@
 
 #include "source/depth_estimation/TemporalBilateralFilter.h"
 
+#include <map>
+#include <memory>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "source/depth_estimation/BilateralFilterGpu.h"
 #include "source/depth_estimation/Derp.h"
+#include "source/gpu/GlfwUtil.h"
+#include "source/util/BenchTrace.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/ImageUtil.h"
@@ -35,6 +41,7 @@ const std::string kUsageMessage = R"(
     --last=000000
 )";
 
+DEFINE_string(backend, "cpu", "where to run the filter (cpu, gpu)");
 DEFINE_string(color, "", "color directory");
 DEFINE_string(cameras, "", "destination cameras");
 DEFINE_string(disparity, "", "disparity directory");
@@ -43,7 +50,7 @@ DEFINE_string(foreground_masks, "", "foreground masks directory");
 DEFINE_string(input_root, "", "output root directory (required)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_int32(level, 0, "pyramid level being processed");
-DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm supported)");
+DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm, dmat supported)");
 DEFINE_string(output_root, "", "output root directory (required)");
 DEFINE_int32(resolution, 2048, "8192, 4096, 2048, 1024, 512, 256");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
@@ -66,7 +73,8 @@ void saveDisparity(
   folly::split(",", outputFormatsStr, outputFormatsVec);
   std::unordered_set<std::string> outputFormats(outputFormatsVec.begin(), outputFormatsVec.end());
   for (const std::string& outputFormat : outputFormats) {
-    if (outputFormat != "exr" && outputFormat != "pfm" && outputFormat != "png") {
+    if (outputFormat != "exr" && outputFormat != "pfm" && outputFormat != "png" &&
+        outputFormat != "dmat") {
       continue;
     }
 
@@ -82,7 +90,7 @@ void saveDisparity(
     if (!boost::filesystem::exists(fn.parent_path())) {
       boost::filesystem::create_directories(fn.parent_path());
     }
-    if (outputFormat != "pfm") {
+    if (outputFormat != "pfm" && outputFormat != "dmat") {
       const cv::Mat scaledDisparity = cv_util::convertTo<uint16_t>(disparity);
       cv_util::imwriteExceptionOnFail(fn, scaledDisparity);
     } else {
@@ -117,7 +125,79 @@ void populateMinMaxFrame(
   lastFrameIdx = std::min(localLastFrameIdx, lastFrameIdx);
 }
 
-void filterFrame(const int curFrameIdx, const Camera::Rig& rigDst) {
+// Images of one frame, one per dst
+struct FrameImages {
+  std::vector<cv::Mat_<PixelType>> colors;
+  std::vector<cv::Mat_<float>> disparities;
+  std::vector<cv::Mat_<bool>> masks; // foreground & FOV
+};
+
+// Sliding window of loaded frames
+// Consecutive output frames share all but one of their input frames, so each step only loads the
+// frame entering the window and evicts the one leaving it: every frame is decoded once per run
+class FrameCache {
+ public:
+  explicit FrameCache(const Camera::Rig& rigDst) : rigDst(rigDst) {
+    std::map<int, cv::Size> sizes;
+    getPyramidLevelSizes(sizes, FLAGS_color);
+    levelSize = sizes.at(FLAGS_level);
+    fovMasks = generateFovMasks(rigDst, levelSize, FLAGS_threads);
+  }
+
+  // Drops the frames outside [firstFrameIdx, lastFrameIdx] and loads the missing ones
+  void slide(const int firstFrameIdx, const int lastFrameIdx) {
+    frames.erase(frames.begin(), frames.lower_bound(firstFrameIdx));
+    frames.erase(frames.upper_bound(lastFrameIdx), frames.end());
+    for (int frameIdx = firstFrameIdx; frameIdx <= lastFrameIdx; ++frameIdx) {
+      if (frames.find(frameIdx) == frames.end()) {
+        frames[frameIdx] = load(frameIdx);
+      }
+    }
+  }
+
+  const FrameImages& at(const int frameIdx) const {
+    return frames.at(frameIdx);
+  }
+
+ private:
+  FrameImages load(const int frameIdx) const {
+    const std::string frameName = image_util::intToStringZeroPad(frameIdx, 6);
+    LOG(INFO) << folly::sformat("Loading frame {}...", frameName);
+    FrameImages images;
+    images.colors =
+        loadLevelImages<PixelType>(FLAGS_color, FLAGS_level, rigDst, frameName, FLAGS_threads);
+    images.disparities =
+        loadLevelImages<float>(FLAGS_disparity, FLAGS_level, rigDst, frameName, FLAGS_threads);
+    const std::vector<cv::Mat_<bool>> foregroundMaskImages = FLAGS_use_foreground_masks
+        ? loadLevelImages<bool>(
+              FLAGS_foreground_masks, FLAGS_level, rigDst, frameName, FLAGS_threads)
+        : cv_util::generateAllPassMasks(levelSize, rigDst.size());
+    for (size_t camIdx = 0; camIdx < rigDst.size(); ++camIdx) {
+      images.masks.push_back(foregroundMaskImages[camIdx] & fovMasks[camIdx]);
+    }
+    return images;
+  }
+
+  const Camera::Rig& rigDst;
+  cv::Size levelSize;
+  std::vector<cv::Mat_<bool>> fovMasks;
+  std::map<int, FrameImages> frames;
+};
+
+// GPU backend needs an OpenGL context, but nothing is ever displayed
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+// gpuFilter is null with the cpu backend
+void filterFrame(
+    const int curFrameIdx,
+    const Camera::Rig& rigDst,
+    FrameCache& frameCache,
+    const BilateralFilterGpu* gpuFilter) {
+  bench_trace::ScopedRecord record(
+      "filter", image_util::intToStringZeroPad(curFrameIdx, 6), rigDst.size());
   const size_t numDsts = rigDst.size();
 
   std::vector<std::vector<cv::Mat_<depth_estimation::PixelType>>> colorFrames(numDsts);
@@ -135,26 +215,14 @@ void filterFrame(const int curFrameIdx, const Camera::Rig& rigDst) {
         FLAGS_foreground_masks, FLAGS_level, camRef, curFrameIdx, firstFrameIdx, lastFrameIdx);
   }
 
+  // Images are shared with the cache (OpenCV: reference count), nothing is copied
+  frameCache.slide(firstFrameIdx, lastFrameIdx);
   for (int frameIdx = firstFrameIdx; frameIdx <= lastFrameIdx; ++frameIdx) {
-    const std::string frameName = image_util::intToStringZeroPad(frameIdx, 6);
-    const std::vector<cv::Mat_<PixelType>> colorImages =
-        loadLevelImages<PixelType>(FLAGS_color, FLAGS_level, rigDst, frameName, FLAGS_threads);
-    const std::vector<cv::Mat_<float>> disparitiesImages =
-        loadLevelImages<float>(FLAGS_disparity, FLAGS_level, rigDst, frameName, FLAGS_threads);
-
-    std::map<int, cv::Size> sizes;
-    getPyramidLevelSizes(sizes, FLAGS_color);
-    const std::vector<cv::Mat_<bool>> foregroundMaskImages = FLAGS_use_foreground_masks
-        ? loadLevelImages<bool>(
-              FLAGS_foreground_masks, FLAGS_level, rigDst, frameName, FLAGS_threads)
-        : cv_util::generateAllPassMasks(sizes.at(FLAGS_level), numDsts);
-    const std::vector<cv::Mat_<bool>> fovMaskImages =
-        generateFovMasks(rigDst, sizes.at(FLAGS_level), FLAGS_threads);
-
+    const FrameImages& images = frameCache.at(frameIdx);
     for (size_t camIdx = 0; camIdx < numDsts; ++camIdx) {
-      colorFrames[camIdx].push_back(colorImages[camIdx]);
-      disparities[camIdx].push_back(disparitiesImages[camIdx]);
-      masks[camIdx].push_back(foregroundMaskImages[camIdx] & fovMaskImages[camIdx]);
+      colorFrames[camIdx].push_back(images.colors[camIdx]);
+      disparities[camIdx].push_back(images.disparities[camIdx]);
+      masks[camIdx].push_back(images.masks[camIdx]);
     }
   }
 
@@ -165,29 +233,41 @@ void filterFrame(const int curFrameIdx, const Camera::Rig& rigDst) {
     const int spaceRadius = FLAGS_space_radius == -1
         ? std::max(std::ceil(kTemporalSpaceRadiusMax * scale), float(kTemporalSpaceRadiusMin))
         : FLAGS_space_radius;
-    temporalJointBilateralFilter(
-        colorFrames[camIdx],
-        disparities[camIdx],
-        masks[camIdx],
-        curFrameIdx - firstFrameIdx,
-        FLAGS_sigma,
-        spaceRadius,
-        FLAGS_weight_b,
-        FLAGS_weight_g,
-        FLAGS_weight_b,
-        disparity,
-        FLAGS_threads);
+    if (gpuFilter) {
+      disparity = gpuFilter->temporalJointBilateralFilter(
+          colorFrames[camIdx],
+          disparities[camIdx],
+          masks[camIdx],
+          curFrameIdx - firstFrameIdx,
+          FLAGS_sigma,
+          spaceRadius,
+          FLAGS_weight_b,
+          FLAGS_weight_g,
+          FLAGS_weight_b);
+    } else {
+      temporalJointBilateralFilter(
+          colorFrames[camIdx],
+          disparities[camIdx],
+          masks[camIdx],
+          curFrameIdx - firstFrameIdx,
+          FLAGS_sigma,
+          spaceRadius,
+          FLAGS_weight_b,
+          FLAGS_weight_g,
+          FLAGS_weight_b,
+          disparity,
+          FLAGS_threads);
+    }
 
     saveDisparity(FLAGS_output_formats, disparity, rigDst[camIdx].id, curFrameIdx);
   }
 }
 
-int main(int argc, char** argv) {
-  system_util::initDep(argc, argv, kUsageMessage);
-
+int runJob() {
   CHECK_NE(FLAGS_rig, "");
   CHECK_NE(FLAGS_input_root, "");
   CHECK_NE(FLAGS_output_root, "");
+  CHECK(FLAGS_backend == "cpu" || FLAGS_backend == "gpu") << "Invalid backend: " << FLAGS_backend;
 
   if (FLAGS_color.empty()) {
     FLAGS_color = getImageDir(FLAGS_input_root, ImageType::color_levels).string();
@@ -205,7 +285,21 @@ int main(int argc, char** argv) {
 
   // Necessary for generating FOV masks
   Camera::normalizeRig(rigDst);
+  FrameCache frameCache(rigDst);
+  std::unique_ptr<OffscreenContext> glContext;
+  std::unique_ptr<BilateralFilterGpu> gpuFilter;
+  if (FLAGS_backend == "gpu") {
+    glContext = std::make_unique<OffscreenContext>();
+    gpuFilter = std::make_unique<BilateralFilterGpu>();
+  }
   for (int frameIdx = std::stoi(FLAGS_first); frameIdx <= std::stoi(FLAGS_last); ++frameIdx) {
-    filterFrame(frameIdx, rigDst);
+    filterFrame(frameIdx, rigDst, frameCache, gpuFilter.get());
   }
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+  system_util::initDep(argc, argv, kUsageMessage);
+  return system_util::runJobs(runJob);
 }
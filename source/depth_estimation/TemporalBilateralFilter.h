@@ -23,6 +23,124 @@
 namespace fb360_dep {
 namespace depth_estimation {
 
+// Range weights exp(-diff / sigma^2), tabulated and linearly interpolated
+// Weights are flushed to zero beyond diff = kMaxExponent * sigma^2, where they are < 1e-7
+class RangeWeightLut {
+ public:
+  static constexpr float kMaxExponent = 16.0f;
+  static const int kSize = 4096;
+
+  explicit RangeWeightLut(const float sigma)
+      : scale((kSize - 1) / (kMaxExponent * math_util::square(sigma))), table(kSize + 1, 0.0f) {
+    for (int i = 0; i < kSize; ++i) {
+      table[i] = expf(-kMaxExponent * i / (kSize - 1));
+    }
+  }
+
+  float operator()(const float diff) const {
+    const float pos = diff * scale;
+    if (!(pos < kSize - 1)) {
+      return 0.0f;
+    }
+    const int i = int(pos);
+    return table[i] + (pos - i) * (table[i + 1] - table[i]);
+  }
+
+ private:
+  const float scale;
+  std::vector<float> table;
+};
+
+static const int kJointBilateralFilterTileSize = 32;
+
+// Filters one tile of dest, call generalizedJointBilateralFilter instead of this
+// Neighbor colors, values and masks of the tile and its apron are gathered first into planar
+// float buffers, clamped to the edges, the same way as in temporalJointBilateralFilterTile below.
+// Masked out neighbors get a zero weight and a zero value, so that NAN values don't leak in
+template <typename TPixel, typename TGuide>
+static void generalizedJointBilateralFilterTile(
+    const cv::Mat_<TPixel>& image,
+    const cv::Mat_<TGuide>& guide,
+    const cv::Mat_<TGuide>& neighborTGuide,
+    const cv::Mat_<bool>& mask,
+    const int radius,
+    const RangeWeightLut& rangeWeight,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    cv::Mat_<TPixel>& dest,
+    const cv::Rect& tile) {
+  const TPixel zero = 0.0;
+  const int r = radius;
+  const int w = tile.width + 2 * r;
+  const int h = tile.height + 2 * r;
+  const int planeSize = w * h;
+  const float guideFactor = 1 / cv_util::maxPixelValue(guide);
+  const float neighborTGuideFactor = 1 / cv_util::maxPixelValue(neighborTGuide);
+
+  // colors[c * planeSize + i]
+  std::vector<float> colors(3 * planeSize);
+  std::vector<float> valid(planeSize);
+  std::vector<TPixel> values(planeSize);
+  for (int yy = 0; yy < h; ++yy) {
+    const int sampleY = math_util::clamp(tile.y + yy - r, 0, image.rows - 1);
+    for (int xx = 0; xx < w; ++xx) {
+      const int sampleX = math_util::clamp(tile.x + xx - r, 0, image.cols - 1);
+      const TGuide& color = neighborTGuide(sampleY, sampleX);
+      const int i = yy * w + xx;
+      for (int c = 0; c < 3; ++c) {
+        colors[c * planeSize + i] = color[c] * neighborTGuideFactor;
+      }
+      const bool isValid = mask(sampleY, sampleX);
+      valid[i] = isValid ? 1.0f : 0.0f;
+      values[i] = isValid ? image(sampleY, sampleX) : zero;
+    }
+  }
+
+  const int n = 2 * r + 1;
+  std::vector<float> diffs(n);
+  const float* const c0 = &colors[0];
+  const float* const c1 = &colors[planeSize];
+  const float* const c2 = &colors[2 * planeSize];
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    for (int x = tile.x; x < tile.x + tile.width; ++x) {
+      if (!mask(y, x)) {
+        dest(y, x) = image(y, x);
+        continue;
+      }
+
+      const TGuide& guideColor = guide(y, x);
+      const float ref0 = guideColor[0] * guideFactor;
+      const float ref1 = guideColor[1] * guideFactor;
+      const float ref2 = guideColor[2] * guideFactor;
+
+      float sumWeight = 0.0f;
+      TPixel weightedAvg = zero;
+      for (int v = 0; v < n; ++v) {
+        const int row = (y - tile.y + v) * w + (x - tile.x);
+
+        // Distances for the whole row of the neighborhood first, the loop vectorizes
+        for (int u = 0; u < n; ++u) {
+          diffs[u] = weight0 * math_util::square(ref0 - c0[row + u]) +
+              weight1 * math_util::square(ref1 - c1[row + u]) +
+              weight2 * math_util::square(ref2 - c2[row + u]);
+        }
+        for (int u = 0; u < n; ++u) {
+          const float weight = valid[row + u] * rangeWeight(diffs[u]);
+          sumWeight += weight;
+          weightedAvg += weight * values[row + u];
+        }
+      }
+      if (sumWeight != 0.0f) {
+        weightedAvg /= sumWeight;
+        dest(y, x) = weightedAvg;
+      } else {
+        dest(y, x) = image(y, x);
+      }
+    }
+  }
+}
+
 // helper for jointBilateralFilter and jointBilateralUpsampling. call one of
 // those instead of this. when computing the bilateral weight, two colors are
 // compared. the generalization is that the color for the current pixel comes
@@ -35,6 +153,7 @@ namespace depth_estimation {
 // guide and neighborGuide should be cv::Mats of type CV_32FC3, CV_16UC3 or CV_8UC3
 // weightR, weightG, and weightB control how much weight is on each color
 // channel in computing color differences for bilateral weight.
+// Runs one task per kJointBilateralFilterTileSize^2 tile
 template <typename TPixel, typename TGuide>
 cv::Mat_<TPixel> generalizedJointBilateralFilter(
     const cv::Mat_<TPixel>& image, // Either float, Vec2f or Vec3f
@@ -51,79 +170,120 @@ cv::Mat_<TPixel> generalizedJointBilateralFilter(
   CHECK_EQ(image.size(), guide.size());
   CHECK_EQ(guide.size(), mask.size());
 
+  // exp((-diff / 3) / (2 * sigma^2)) is the lut's exp(-diff / sigma'^2) with sigma'^2 = 6 sigma^2
+  const RangeWeightLut rangeWeight(sigma * std::sqrt(6.0f));
+  cv::Mat_<TPixel> dest(image.size());
+  const int tilesX =
+      (image.cols + kJointBilateralFilterTileSize - 1) / kJointBilateralFilterTileSize;
+  const int tilesY =
+      (image.rows + kJointBilateralFilterTileSize - 1) / kJointBilateralFilterTileSize;
+  parallelFor(
+      0,
+      tilesX * tilesY,
+      1,
+      [&](const int i) {
+        const cv::Rect tile = cv::Rect(
+                                  (i % tilesX) * kJointBilateralFilterTileSize,
+                                  (i / tilesX) * kJointBilateralFilterTileSize,
+                                  kJointBilateralFilterTileSize,
+                                  kJointBilateralFilterTileSize) &
+            cv::Rect(0, 0, image.cols, image.rows);
+        generalizedJointBilateralFilterTile(
+            image,
+            guide,
+            neighborTGuide,
+            mask,
+            radius,
+            rangeWeight,
+            weight0,
+            weight1,
+            weight2,
+            dest,
+            tile);
+      },
+      numThreads);
+  return dest;
+}
+
+// Straightforward version of generalizedJointBilateralFilter, one pixel at a time
+// Slow, kept as a reference for testing
+template <typename TPixel, typename TGuide>
+cv::Mat_<TPixel> generalizedJointBilateralFilterReference(
+    const cv::Mat_<TPixel>& image, // Either float, Vec2f or Vec3f
+    const cv::Mat_<TGuide>& guide,
+    const cv::Mat_<TGuide>& neighborTGuide,
+    const cv::Mat_<bool>& mask,
+    const int radius,
+    const float sigma,
+    const float weight0 = 1.0f,
+    const float weight1 = 1.0f,
+    const float weight2 = 1.0f) {
+  CHECK_EQ(guide.size(), neighborTGuide.size());
+  CHECK_EQ(image.size(), guide.size());
+  CHECK_EQ(guide.size(), mask.size());
+
   const TPixel zero = 0.0;
 
   cv::Mat_<TPixel> dest(image.size());
-  ThreadPool threadPool(numThreads);
-  const int edgeX = image.cols;
-  const int edgeY = 1;
-  for (int yBegin = 0; yBegin < image.rows; yBegin += edgeY) {
-    for (int xBegin = 0; xBegin < image.cols; xBegin += edgeX) {
-      const int xEnd = std::min(xBegin + edgeX, image.cols);
-      const int yEnd = std::min(yBegin + edgeY, image.rows);
-      threadPool.spawn([&, xBegin, yBegin, xEnd, yEnd] {
-        for (int y = yBegin; y < yEnd; ++y) {
-          for (int x = xBegin; x < xEnd; ++x) {
-            if (!mask(y, x)) {
-              dest(y, x) = image(y, x);
-              continue;
-            }
-
-            const auto guideColor = guide(y, x);
-            float sumWeight = 0.0f;
-            TPixel weightedAvg = zero;
-
-            const float guideFactor = 1 / cv_util::maxPixelValue(guide);
-            const float neighborTGuideFactor = 1 / cv_util::maxPixelValue(neighborTGuide);
-
-            for (int v = -radius; v <= radius; ++v) {
-              for (int u = -radius; u <= radius; ++u) {
-                const int sampleX = math_util::clamp(x + u, 0, image.cols - 1);
-                const int sampleY = math_util::clamp(y + v, 0, image.rows - 1);
-
-                if (!mask(sampleY, sampleX)) {
-                  continue;
-                }
-
-                const TGuide& neighborTGuideColor = neighborTGuide(sampleY, sampleX);
-
-                const float colorDiffSq = // BGR
-                    weight0 *
-                        math_util::square(
-                            (guideColor[0] * guideFactor) -
-                            (neighborTGuideColor[0] * neighborTGuideFactor)) +
-                    weight1 *
-                        math_util::square(
-                            (guideColor[1] * guideFactor) -
-                            (neighborTGuideColor[1] * neighborTGuideFactor)) +
-                    weight2 *
-                        math_util::square(
-                            (guideColor[2] * guideFactor) -
-                            (neighborTGuideColor[2] * neighborTGuideFactor));
-                const float weight =
-                    expf((-colorDiffSq / 3.0f) / (2.0f * math_util::square(sigma)));
-
-                sumWeight += weight;
-                weightedAvg += weight * image(sampleY, sampleX);
-              }
-            }
-            if (sumWeight != 0.0f) {
-              weightedAvg /= sumWeight;
-              dest(y, x) = weightedAvg;
-            } else {
-              dest(y, x) = image(y, x);
-            }
+  for (int y = 0; y < image.rows; ++y) {
+    for (int x = 0; x < image.cols; ++x) {
+      if (!mask(y, x)) {
+        dest(y, x) = image(y, x);
+        continue;
+      }
+
+      const auto guideColor = guide(y, x);
+      float sumWeight = 0.0f;
+      TPixel weightedAvg = zero;
+
+      const float guideFactor = 1 / cv_util::maxPixelValue(guide);
+      const float neighborTGuideFactor = 1 / cv_util::maxPixelValue(neighborTGuide);
+
+      for (int v = -radius; v <= radius; ++v) {
+        for (int u = -radius; u <= radius; ++u) {
+          const int sampleX = math_util::clamp(x + u, 0, image.cols - 1);
+          const int sampleY = math_util::clamp(y + v, 0, image.rows - 1);
+
+          if (!mask(sampleY, sampleX)) {
+            continue;
           }
+
+          const TGuide& neighborTGuideColor = neighborTGuide(sampleY, sampleX);
+
+          const float colorDiffSq = // BGR
+              weight0 *
+                  math_util::square(
+                      (guideColor[0] * guideFactor) -
+                      (neighborTGuideColor[0] * neighborTGuideFactor)) +
+              weight1 *
+                  math_util::square(
+                      (guideColor[1] * guideFactor) -
+                      (neighborTGuideColor[1] * neighborTGuideFactor)) +
+              weight2 *
+                  math_util::square(
+                      (guideColor[2] * guideFactor) -
+                      (neighborTGuideColor[2] * neighborTGuideFactor));
+          const float weight = expf((-colorDiffSq / 3.0f) / (2.0f * math_util::square(sigma)));
+
+          sumWeight += weight;
+          weightedAvg += weight * image(sampleY, sampleX);
         }
-      });
+      }
+      if (sumWeight != 0.0f) {
+        weightedAvg /= sumWeight;
+        dest(y, x) = weightedAvg;
+      } else {
+        dest(y, x) = image(y, x);
+      }
     }
   }
-  threadPool.join();
   return dest;
 }
 
+// Straightforward version of temporalJointBilateralFilter, one row at a time
+// Slow, kept as a reference for testing
 template <typename T>
-static void temporalJointBilateralFilterCol(
+static void temporalJointBilateralFilterRowReference(
     const std::vector<cv::Mat_<T>>& guides,
     const std::vector<cv::Mat_<float>>& images,
     const std::vector<cv::Mat_<bool>>& masks,
@@ -170,12 +330,104 @@ static void temporalJointBilateralFilterCol(
   }
 }
 
+static const int kTemporalFilterTileSize = 32;
+
+// Filters one tile of result
+// Guide colors and masks of the tile and its apron are first gathered for every frame into
+// planar, normalized float buffers, so the inner loops read contiguous memory that stays in cache
+// across frames, with no clamping and no conversions
+template <typename T>
+static void temporalJointBilateralFilterTile(
+    const std::vector<cv::Mat_<T>>& guides,
+    const std::vector<cv::Mat_<float>>& images,
+    const std::vector<cv::Mat_<bool>>& masks,
+    const int frameOffset,
+    const RangeWeightLut& rangeWeight,
+    const int spatialRadius,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    cv::Mat_<float>& result,
+    const cv::Rect& tile) {
+  const int numFrames = guides.size();
+  const int r = spatialRadius;
+  const int w = tile.width + 2 * r;
+  const int h = tile.height + 2 * r;
+  const int planeSize = w * h;
+  const float norm = 1.0f / cv_util::maxPixelValue(guides[frameOffset]);
+
+  // colors[((t * 3) + c) * planeSize + i], valid[t * planeSize + i]
+  std::vector<float> colors(numFrames * 3 * planeSize);
+  std::vector<float> valid(numFrames * planeSize);
+  for (int t = 0; t < numFrames; ++t) {
+    for (int yy = 0; yy < h; ++yy) {
+      const int sampleY = math_util::clamp(tile.y + yy - r, 0, result.rows - 1);
+      for (int xx = 0; xx < w; ++xx) {
+        const int sampleX = math_util::clamp(tile.x + xx - r, 0, result.cols - 1);
+        const T& color = guides[t](sampleY, sampleX);
+        const int i = yy * w + xx;
+        for (int c = 0; c < 3; ++c) {
+          colors[(t * 3 + c) * planeSize + i] = color[c] * norm;
+        }
+        valid[t * planeSize + i] = masks[t](sampleY, sampleX) ? 1.0f : 0.0f;
+      }
+    }
+  }
+
+  const int n = 2 * r + 1;
+  std::vector<float> diffs(n);
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    for (int x = tile.x; x < tile.x + tile.width; ++x) {
+      if (!masks[frameOffset](y, x)) {
+        result(y, x) = images[frameOffset](y, x);
+        continue;
+      }
+
+      // Reference is the center of the padded neighborhood in frameOffset
+      const int center = (y - tile.y + r) * w + (x - tile.x + r);
+      const float* const ref = &colors[frameOffset * 3 * planeSize];
+      const float ref0 = ref[center];
+      const float ref1 = ref[planeSize + center];
+      const float ref2 = ref[2 * planeSize + center];
+
+      float weightedSumPix = 0.0f;
+      float sumWeight = 0.0f;
+      for (int t = 0; t < numFrames; ++t) {
+        const float* const c0 = &colors[(t * 3 + 0) * planeSize];
+        const float* const c1 = &colors[(t * 3 + 1) * planeSize];
+        const float* const c2 = &colors[(t * 3 + 2) * planeSize];
+        const float* const m = &valid[t * planeSize];
+        float frameWeight = 0.0f;
+        for (int v = 0; v < n; ++v) {
+          const int row = (y - tile.y + v) * w + (x - tile.x);
+
+          // Distances for the whole row of the neighborhood first, the loop vectorizes
+          for (int u = 0; u < n; ++u) {
+            diffs[u] = weight0 * math_util::square(ref0 - c0[row + u]) +
+                weight1 * math_util::square(ref1 - c1[row + u]) +
+                weight2 * math_util::square(ref2 - c2[row + u]);
+          }
+          for (int u = 0; u < n; ++u) {
+            frameWeight += m[row + u] * rangeWeight(diffs[u]);
+          }
+        }
+
+        // Weights are from the neighbors, values from the pixel itself in each frame
+        weightedSumPix += images[t](y, x) * frameWeight;
+        sumWeight += frameWeight;
+      }
+      result(y, x) = weightedSumPix / sumWeight;
+    }
+  }
+}
+
 // temporal joint-bilateral filter: intended for use with time series of depth
 // maps. uses the RGB images as a guide for the depth bilateral weights.
 // returns the filtered depthmap for camera camIdx in frame frameIdx. the
 // spatial support of the filter is 1x1.
 // Assumes frameImages are CV_32F, CV_16U or CV_8U
 // frameOffset is an index of guides/images for which frame to render
+// Runs one task per kTemporalFilterTileSize^2 tile, all frames at once
 template <typename T>
 static void temporalJointBilateralFilter(
     const std::vector<cv::Mat_<T>>& guides,
@@ -194,23 +446,64 @@ static void temporalJointBilateralFilter(
   }
 
   result = cv::Mat(images[frameOffset].size(), CV_32FC1);
-  ThreadPool threadPool(numThreads);
+  const RangeWeightLut rangeWeight(sigma);
+  const int tilesX = (result.cols + kTemporalFilterTileSize - 1) / kTemporalFilterTileSize;
+  const int tilesY = (result.rows + kTemporalFilterTileSize - 1) / kTemporalFilterTileSize;
+  parallelFor(
+      0,
+      tilesX * tilesY,
+      1,
+      [&](const int i) {
+        const cv::Rect tile = cv::Rect(
+                                  (i % tilesX) * kTemporalFilterTileSize,
+                                  (i / tilesX) * kTemporalFilterTileSize,
+                                  kTemporalFilterTileSize,
+                                  kTemporalFilterTileSize) &
+            cv::Rect(0, 0, result.cols, result.rows);
+        temporalJointBilateralFilterTile(
+            guides,
+            images,
+            masks,
+            frameOffset,
+            rangeWeight,
+            spatialRadius,
+            weight0,
+            weight1,
+            weight2,
+            result,
+            tile);
+      },
+      numThreads);
+}
+
+// Same as temporalJointBilateralFilter, using temporalJointBilateralFilterRowReference
+template <typename T>
+static void temporalJointBilateralFilterReference(
+    const std::vector<cv::Mat_<T>>& guides,
+    const std::vector<cv::Mat_<float>>& images,
+    const std::vector<cv::Mat_<bool>>& masks,
+    const int frameOffset,
+    const float sigma,
+    const int spatialRadius,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    cv::Mat_<float>& result) {
+  result = cv::Mat(images[frameOffset].size(), CV_32FC1);
   for (int y = 0; y < result.rows; ++y) {
-    threadPool.spawn(
-        &temporalJointBilateralFilterCol<T>,
-        std::ref(guides),
-        std::ref(images),
-        std::ref(masks),
+    temporalJointBilateralFilterRowReference(
+        guides,
+        images,
+        masks,
         frameOffset,
         sigma,
         spatialRadius,
         weight0,
         weight1,
         weight2,
-        std::ref(result),
+        result,
         y);
   }
-  threadPool.join();
 }
 
 } // namespace depth_estimation
@@ -22,18 +22,25 @@ const char* kUsage = R"(
 
 #include "source/depth_estimation/UpsampleDisparityLib.h"
 
+#include <memory>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
 
+#include "source/depth_estimation/BilateralFilterGpu.h"
+#include "source/depth_estimation/DerpUtil.h"
 #include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/gpu/GlfwUtil.h"
+#include "source/util/BenchTrace.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::depth_estimation;
 
 DEFINE_string(background_disp, "", "background disparity directory (output resolution)");
 DEFINE_string(background_frame, "000000", "background frame (lexical)");
+DEFINE_string(backend, "cpu", "where to run the bilateral filter (cpu, gpu)");
 DEFINE_string(cameras, "", "destination cameras");
 DEFINE_string(color, "", "color directory (output resolution)");
 DEFINE_string(disparity, "", "disparity directory (input resolution) (required)");
@@ -43,7 +50,7 @@ DEFINE_string(foreground_masks_out, "", "(optional) masks directory (output reso
 DEFINE_int32(height, -1, "output image height (aspect ratio maintained if unspecified)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_string(output, "", "output directory (required)");
-DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm supported)");
+DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm, dmat supported)");
 DEFINE_int32(resolution, -1, "output resolution width in pixels (required)");
 DEFINE_string(rig, "", "path to camera rig .json");
 DEFINE_double(sigma, 0.05, "bilateral filter color difference sigma");
@@ -58,9 +65,23 @@ void verifyInputs() {
   CHECK_NE(FLAGS_disparity, "");
   CHECK_NE(FLAGS_output, "");
   CHECK_NE(FLAGS_resolution, -1);
+  CHECK(FLAGS_backend == "cpu" || FLAGS_backend == "gpu") << "Invalid backend: " << FLAGS_backend;
 }
 
-void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const std::string& frame) {
+// GPU backend needs an OpenGL context, but nothing is ever displayed
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+// gpuFilter is null with the cpu backend
+void upsampleFrame(
+    const Camera::Rig& rigSrc,
+    const Camera::Rig& rigDst,
+    const std::string& frame,
+    const BilateralFilterGpu* gpuFilter) {
+  bench_trace::ScopedRecord record("upsample", frame, rigDst.size());
+
   const std::string exts = FLAGS_output_formats.empty() ? "pfm" : FLAGS_output_formats;
   std::vector<std::string> outputFormats;
   folly::split(",", exts, outputFormats);
@@ -113,17 +134,35 @@ void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const s
           sizeUp.height,
           rigDst[i].id);
       const cv::Mat_<PixelType> colorUp = cv_util::resizeImage(colors[i], sizeUp);
-      dispsUp[i] = depth_estimation::generalizedJointBilateralFilter<float, PixelType>(
-          dispsUp[i],
-          colorUp,
-          colorUp,
-          masksUp[i],
-          radius,
-          FLAGS_sigma,
-          FLAGS_weight_b,
-          FLAGS_weight_g,
-          FLAGS_weight_r,
-          FLAGS_threads);
+      if (gpuFilter) {
+        dispsUp[i] = gpuFilter->generalizedJointBilateralFilter<PixelType>(
+            dispsUp[i],
+            colorUp,
+            colorUp,
+            masksUp[i],
+            radius,
+            FLAGS_sigma,
+            FLAGS_weight_b,
+            FLAGS_weight_g,
+            FLAGS_weight_r);
+      } else {
+        dispsUp[i] = depth_estimation::generalizedJointBilateralFilter<float, PixelType>(
+            dispsUp[i],
+            colorUp,
+            colorUp,
+            masksUp[i],
+            radius,
+            FLAGS_sigma,
+            FLAGS_weight_b,
+            FLAGS_weight_g,
+            FLAGS_weight_r,
+            FLAGS_threads);
+      }
+    }
+
+    // Saved layered, so that no separate LayerDisparities pass rereads them
+    if (!FLAGS_background_disp.empty()) {
+      dispsUp[i] = layerDisparities(dispsUp[i], backgroundDispsUp[i], FLAGS_threads);
     }
 
     LOG(INFO) << "Saving output images...";
@@ -132,7 +171,7 @@ void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const s
       const filesystem::path fn = filesystem::path(FLAGS_output) / rigDst[i].id / frameFn;
       boost::filesystem::create_directories(fn.parent_path());
 
-      if (ext != "pfm") {
+      if (!cv_util::isMatFile(fn) && fn.extension() != ".pfm") {
         cv_util::imwriteExceptionOnFail(fn, cv_util::convertTo<uint16_t>(dispsUp[i]));
       } else {
         cv_util::writeCvMat32FC1ToPFM(fn, dispsUp[i]);
@@ -141,10 +180,7 @@ void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const s
   }
 }
 
-int main(int argc, char** argv) {
-  gflags::SetUsageMessage(kUsage);
-  system_util::initDep(argc, argv);
-
+int runJob() {
   verifyInputs();
 
   Camera::Rig rigSrc = Camera::loadRig(FLAGS_rig);
@@ -152,9 +188,21 @@ int main(int argc, char** argv) {
   std::pair<int, int> frameRange =
       image_util::getFrameRange(FLAGS_disparity, rigDst, FLAGS_first, FLAGS_last);
 
+  std::unique_ptr<OffscreenContext> glContext;
+  std::unique_ptr<BilateralFilterGpu> gpuFilter;
+  if (FLAGS_backend == "gpu") {
+    glContext = std::make_unique<OffscreenContext>();
+    gpuFilter = std::make_unique<BilateralFilterGpu>();
+  }
   for (int iFrame = frameRange.first; iFrame <= frameRange.second; ++iFrame) {
-    upsampleFrame(rigSrc, rigDst, image_util::intToStringZeroPad(iFrame, 6));
+    upsampleFrame(rigSrc, rigDst, image_util::intToStringZeroPad(iFrame, 6), gpuFilter.get());
   }
 
   return EXIT_SUCCESS;
 }
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(kUsage);
+  system_util::initDep(argc, argv);
+  return system_util::runJobs(runJob);
+}
@@ -7,6 +7,8 @@
 
 #include "source/depth_estimation/UpsampleDisparityLib.h"
 
+#include <cmath>
+#include <limits>
 #include <utility>
 #include <vector>
 
@@ -16,77 +18,128 @@
 
 #include "DerpUtil.h"
 #include "source/util/Camera.h"
-#include "source/util/MathUtil.h"
 #include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace depth_estimation {
 
-// Clock-wise outward spiral starting at (0, 0) of diameter w
-static std::vector<std::pair<int, int>> spiral(const int w) {
-  int x = 0;
-  int y = 0;
-  int dx = 0; // 1: right, -1: left, 0: don't move
-  int dy = -1;
-  int t = w;
-  int samples = t * t;
-  std::vector<std::pair<int, int>> locs;
-  for (int i = 0; i < samples; ++i) {
-    const bool isValidX = (-w / 2 <= x) && (x <= w / 2);
-    const bool isValidY = (-w / 2 <= y) && (y <= w / 2);
-    if (isValidX && isValidY) {
-      locs.push_back(std::make_pair(x, y));
-    }
-    const bool isCorner = x == y;
-    const bool isEdgeLeftX = (x < 0) && (x == -y);
-    const bool isEdgeRightX = (x > 0) && (x == 1 - y);
-    if (isCorner || isEdgeLeftX || isEdgeRightX) {
-      // Rotate 90 degrees and switch direction of x
-      t = dx;
-      dx = -dy;
-      dy = t;
-    }
-    x += dx;
-    y += dy;
-  }
-  return locs;
-}
-
-static cv::Mat_<float> replaceNans(
-    const cv::Mat_<float>& dispUp,
-    const cv::Mat_<float>& bgDispUp,
+const int kRowsPerTask = 16;
+const int kColumnsPerTask = 64;
+
+// Upsamples disp to maskUp's size using the nearest pixel, NAN outside mask and maskUp, and fills
+// the NANs inside maskUp with the closest valid (> 0) value, if it is no more than radius pixels
+// away on either axis. Anything still NAN or 0 takes its value from bgDispUp, if given
+// The closest valid pixel comes from a separable euclidean distance transform (Felzenszwalb and
+// Huttenlocher) that also tracks where the minimum is: a pass over rows finds the closest valid
+// pixel in each row, then a pass over columns takes the lower envelope of the parabolas
+//   (y - q)^2 + (x - closest x in row q)^2
+// Both passes are linear in the number of pixels and run in parallel, over rows and over columns
+static cv::Mat_<float> upsampleMaskedDisparity(
+    const cv::Mat_<float>& disp,
+    const cv::Mat_<bool>& mask,
     const cv::Mat_<bool>& maskUp,
-    const int radius) {
-  cv::Mat_<bool> maskNan(maskUp.size());
-  maskUp.copyTo(maskNan);
-  maskNan.setTo(false, dispUp > 0); // true = NAN inside mask
-  std::vector<cv::Point> nanLocs;
-  cv::findNonZero(maskNan, nanLocs);
-  cv::Mat_<float> dispOut(dispUp.size());
-  dispUp.copyTo(dispOut);
-  const std::vector<std::pair<int, int>> spiralLocs = spiral(radius * 2 + 1);
-  for (const cv::Point& p : nanLocs) {
-    // Find valid pixel in neighborhood
-    for (const auto& loc : spiralLocs) {
-      const int xx = math_util::clamp(p.x + loc.first, 0, maskNan.cols - 1);
-      const int yy = math_util::clamp(p.y + loc.second, 0, maskNan.rows - 1);
-      const float d = dispUp(yy, xx);
-      if (d > 0) {
-        dispOut(p.y, p.x) = d;
-        break;
-      }
-    }
-  }
+    const cv::Mat_<float>& bgDispUp,
+    const int radius,
+    const int threads) {
+  const int rows = maskUp.rows;
+  const int cols = maskUp.cols;
 
-  for (int y = 0; y < dispOut.rows; ++y) {
-    for (int x = 0; x < dispOut.cols; ++x) {
-      if (std::isnan(dispOut(y, x)) || dispOut(y, x) == 0) {
-        dispOut(y, x) = bgDispUp(y, x);
-      }
-    }
+  // cv::INTER_NEAREST source pixels
+  std::vector<int> srcXs(cols);
+  for (int x = 0; x < cols; ++x) {
+    srcXs[x] = std::min(int(x * double(disp.cols) / cols), disp.cols - 1);
   }
 
-  return dispOut;
+  cv::Mat_<float> dispUp(maskUp.size());
+  cv::Mat_<int> closestXs(maskUp.size()); // closest valid x in the row, -1 if none within radius
+  parallelFor(
+      0,
+      rows,
+      kRowsPerTask,
+      [&](const int y) {
+        const int srcY = std::min(int(y * double(disp.rows) / rows), disp.rows - 1);
+        float* dst = dispUp[y];
+        for (int x = 0; x < cols; ++x) {
+          const bool isMasked = mask(srcY, srcXs[x]) && maskUp(y, x);
+          dst[x] = isMasked ? disp(srcY, srcXs[x]) : NAN;
+        }
+
+        int* closest = closestXs[y];
+        int left = -1;
+        for (int x = 0; x < cols; ++x) {
+          if (dst[x] > 0) {
+            left = x;
+          }
+          closest[x] = left >= 0 && x - left <= radius ? left : -1;
+        }
+        int right = -1;
+        for (int x = cols - 1; x >= 0; --x) {
+          if (dst[x] > 0) {
+            right = x;
+          }
+          if (right >= 0 && right - x <= radius && (closest[x] < 0 || right - x < x - closest[x])) {
+            closest[x] = right;
+          }
+        }
+      },
+      threads);
+
+  const bool hasBackground = !bgDispUp.empty();
+  parallelFor(
+      0,
+      cols,
+      kColumnsPerTask,
+      [&](const int x) {
+        // lower envelope of the parabolas of the rows that have a valid pixel within radius
+        std::vector<int> vertices(rows);
+        std::vector<double> bounds(rows + 1);
+        int count = 0;
+        for (int q = 0; q < rows; ++q) {
+          if (closestXs(q, x) < 0) {
+            continue;
+          }
+          const int dx = closestXs(q, x) - x;
+          const double fq = double(dx) * dx + double(q) * q;
+          double s = -std::numeric_limits<double>::infinity();
+          while (count > 0) {
+            const int v = vertices[count - 1];
+            const int dv = closestXs(v, x) - x;
+            const double fv = double(dv) * dv + double(v) * v;
+            s = (fq - fv) / (2.0 * (q - v));
+            if (s > bounds[count - 1]) {
+              break;
+            }
+            --count;
+            s = -std::numeric_limits<double>::infinity();
+          }
+          vertices[count] = q;
+          bounds[count] = s;
+          ++count;
+        }
+
+        int j = 0;
+        for (int y = 0; y < rows; ++y) {
+          float value = dispUp(y, x);
+          if (maskUp(y, x) && !(value > 0) && count > 0) {
+            while (j + 1 < count && bounds[j + 1] < y) {
+              ++j;
+            }
+            const int q = vertices[j];
+            if (std::abs(q - y) <= radius) {
+              value = dispUp(q, closestXs(q, x));
+            }
+          }
+          if (hasBackground && (std::isnan(value) || value == 0)) {
+            value = bgDispUp(y, x);
+          }
+          // valid pixels, the only ones read across columns, are never written
+          if (!(value == dispUp(y, x))) {
+            dispUp(y, x) = value;
+          }
+        }
+      },
+      threads);
+  return dispUp;
 }
 
 int getRadius(const cv::Size& size, const cv::Size& sizeUp) {
@@ -101,7 +154,8 @@ static void upsampleDisparityInPlace(
     const cv::Mat_<bool>& mask,
     const cv::Mat_<bool>& maskUpIn,
     const cv::Size& sizeUp,
-    const bool useForegroundMasks) {
+    const bool useForegroundMasks,
+    const int threads) {
   // NOTE: This trick is only for foreground disparities
   // The background disparity can be upscaled separately calling this app without a mask,
   // and used to fill the NaNs outside the full-size mask
@@ -115,27 +169,17 @@ static void upsampleDisparityInPlace(
   const int radius = getRadius(mask.size(), sizeUp);
 
   if (useForegroundMasks) {
-    // 1)
-    cv::Mat_<float> dispSmallMasked = disp.clone();
-    dispSmallMasked.setTo(NAN, mask == 0);
-
-    // 2)
-    cv::Mat_<float> dispUpMasked;
-    cv::resize(dispSmallMasked, dispUpMasked, sizeUp, 0, 0, cv::INTER_NEAREST);
-
-    // 3)
     cv::Mat_<bool> maskUp;
     if (maskUpIn.size() != sizeUp) {
       LOG(WARNING) << "Warning: Desired resolution does not match mask resolution: " << sizeUp
                    << " vs. " << maskUpIn.size() << ". Rescaling mask to " << sizeUp;
-      cv::resize(maskUp, maskUpIn, sizeUp, 0, 0, cv::INTER_NEAREST);
+      cv::resize(maskUpIn, maskUp, sizeUp, 0, 0, cv::INTER_NEAREST);
     } else {
       maskUp = maskUpIn;
     }
-    dispUpMasked.setTo(NAN, maskUp == 0);
 
-    // 4)
-    dispUp = replaceNans(dispUpMasked, bgDispUp, maskUp, radius);
+    // 1) - 4)
+    dispUp = upsampleMaskedDisparity(disp, mask, maskUp, bgDispUp, radius, threads);
   } else {
     // OpenCV doesn't handle NaNs when resizing
     const float minDisp = 1e-4;
@@ -153,16 +197,17 @@ std::vector<cv::Mat_<float>> upsampleDisparities(
     const std::vector<cv::Mat_<bool>>& masksUpIn,
     const cv::Size& sizeUp,
     const bool useForegroundMasks,
-    const int threads) {
+    const int threads,
+    RayMapCache* rayMaps) {
   CHECK_EQ(disps.size(), masks.size());
   CHECK_EQ(disps.size(), masksUpIn.size());
 
   Camera::Rig rig = Camera::Rig(rigIn);
   Camera::normalizeRig(rig);
   const std::vector<cv::Mat_<bool>> fovMasks =
-      depth_estimation::generateFovMasks(rig, disps[0].size(), threads);
+      depth_estimation::generateFovMasks(rig, disps[0].size(), threads, rayMaps);
   const std::vector<cv::Mat_<bool>> fovMasksUp =
-      depth_estimation::generateFovMasks(rig, sizeUp, threads);
+      depth_estimation::generateFovMasks(rig, sizeUp, threads, rayMaps);
   std::vector<cv::Mat_<float>> dispsUp(disps.size());
   ThreadPool threadPool(threads);
   for (int i = 0; i < int(disps.size()); ++i) {
@@ -174,7 +219,8 @@ std::vector<cv::Mat_<float>> upsampleDisparities(
         fovMasks[i] & masks[i],
         fovMasksUp[i] & masksUpIn[i],
         std::cref(sizeUp),
-        useForegroundMasks);
+        useForegroundMasks,
+        threads);
   }
   threadPool.join();
   return dispsUp;
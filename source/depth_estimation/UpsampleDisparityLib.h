@@ -12,6 +12,7 @@
 
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/RayMapCache.h"
 
 namespace fb360_dep {
 namespace depth_estimation {
@@ -26,7 +27,8 @@ std::vector<cv::Mat_<float>> upsampleDisparities(
     const std::vector<cv::Mat_<bool>>& masksUpIn,
     const cv::Size& sizeUp,
     const bool useForegroundMasks,
-    const int threads = -1);
+    const int threads = -1,
+    RayMapCache* rayMaps = nullptr); // fov masks come from rayMaps if given
 
 } // namespace depth_estimation
 } // namespace fb360_dep
@@ -124,6 +124,27 @@ inline GLuint createProgram(const std::string& vs, const std::string& fs) {
   return program;
 }
 
+// same with a geometry shader
+inline GLuint createProgram(const std::string& vs, const std::string& gs, const std::string& fs) {
+  GLuint program = glCreateProgram();
+  attachShader(program, GL_VERTEX_SHADER, vs);
+  attachShader(program, GL_GEOMETRY_SHADER, gs);
+  attachShader(program, GL_FRAGMENT_SHADER, fs);
+  glLinkProgram(program);
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+    std::vector<GLchar> log(length);
+    glGetProgramInfoLog(program, length, &length, &log[0]);
+    LOG(FATAL) << folly::sformat("{}\nvs:\n{}\ngs:\n{}\nfs\n{}", log.data(), vs, gs, fs);
+  }
+  glUseProgram(program);
+
+  return program;
+}
+
 inline GLint getUniformLocation(GLuint program, const char* name) {
   GLint result = glGetUniformLocation(program, name);
   CHECK_NE(result, -1) << "can't find uniform '" << name << "'";
@@ -417,6 +438,49 @@ inline GLuint createFramebufferCubemapTexture(int width, int height, GLenum form
   return texture;
 }
 
+// layered attachment, a geometry shader picks the layer with gl_Layer
+inline GLuint createFramebufferTextureArray(int width, int height, int layers, GLenum format) {
+  GLuint texture = createTexture(GL_TEXTURE_2D_ARRAY);
+  glTexImage3D(
+      GL_TEXTURE_2D_ARRAY,
+      0, // level
+      format,
+      width,
+      height,
+      layers,
+      0, // border must be 0
+      GL_RGBA,
+      GL_BYTE,
+      NULL); // no pixel data
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0);
+
+  return texture;
+}
+
+inline GLuint createFramebufferDepthTextureArray(int width, int height, int layers) {
+  GLuint depth = createTexture(GL_TEXTURE_2D_ARRAY);
+  glTexImage3D(
+      GL_TEXTURE_2D_ARRAY,
+      0, // level
+      GL_DEPTH_COMPONENT,
+      width,
+      height,
+      layers,
+      0, // border must be 0
+      GL_DEPTH_COMPONENT,
+      GL_FLOAT,
+      NULL); // no pixel data
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth, 0);
+
+  return depth;
+}
+
 inline GLuint createFramebufferDepthTexture(int width, int height) {
   GLuint depth = createTexture();
   glTexImage2D(
@@ -456,8 +520,10 @@ inline GLuint createFramebufferDepth(int width, int height) {
 // useful when patching shaders: replace all occurrences of needle in haystack
 inline void
 replaceAll(std::string& haystack, const std::string& needle, const std::string& replacement) {
-  for (size_t pos; (pos = haystack.find(needle)) != std::string::npos;) {
+  // resume after the replacement, which may itself contain needle
+  for (size_t pos = 0; (pos = haystack.find(needle, pos)) != std::string::npos;) {
     haystack.replace(pos, needle.size(), replacement);
+    pos += replacement.size();
   }
 }
 
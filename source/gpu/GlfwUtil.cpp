@@ -7,6 +7,12 @@
 
 #include "source/gpu/GlfwUtil.h"
 
+DEFINE_int32(egl_device, -1, "gpu to render offscreen with egl, -1 = the first that works");
+DEFINE_string(
+    offscreen_gl,
+    "auto",
+    "offscreen contexts: egl (gpu, no x server needed), glfw (hidden window) or auto (egl first)");
+
 // Global thread-safe map variable
 std::mutex GlWindow::windowMapMutex;
 std::map<GLFWwindow*, GlWindow*> GlWindow::windows;
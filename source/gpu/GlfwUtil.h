@@ -7,8 +7,10 @@
 
 #pragma once
 
+#include <cstring>
 #include <map>
 #include <mutex>
+#include <vector>
 
 #ifdef __APPLE__
 #define GLFW_INCLUDE_GLCOREARB
@@ -20,6 +22,7 @@
 #include "source/util/MathUtil.h"
 
 #include <GLFW/glfw3.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
@@ -30,6 +33,7 @@
 
 #ifdef USE_EGL
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #undef None /* Avoid name colisions with folly */
 #undef Bool
 
@@ -58,8 +62,21 @@ static const EGLint pbufferAttribs[] = {
     pbufferHeight,
     EGL_NONE,
 };
+
+// same as the glfw windows ask for
+static const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION_KHR,
+    3,
+    EGL_CONTEXT_MINOR_VERSION_KHR,
+    2,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+    EGL_NONE};
 #endif
 
+DECLARE_int32(egl_device);
+DECLARE_string(offscreen_gl);
+
 //!  A multi-window, OS independent opengl window
 /*!
   Abstracts the glfw window across multiple instances and factors out
@@ -131,11 +148,77 @@ class GlWindow {
   int width;
   int height;
 
-  GLFWwindow* window;
+  GLFWwindow* window = nullptr;
   GLuint fbo;
 
 #ifdef USE_EGL
-  EGLDisplay eglDpy;
+  EGLDisplay eglDpy = EGL_NO_DISPLAY; // set if the context is egl's rather than glfw's
+  EGLSurface eglSurf = EGL_NO_SURFACE; // none if the context is surfaceless
+  EGLContext eglCtx = EGL_NO_CONTEXT;
+
+  // Makes current an offscreen context on a gpu, without a window system
+  // Tries the gpus egl enumerates first, as on a node without an x server the default display is
+  // usually missing or a software renderer. Returns false if no display can make a context
+  bool createEglContext() {
+    std::vector<EGLDisplay> displays;
+    const auto queryDevices = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    const auto getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (queryDevices && getPlatformDisplay) {
+      EGLint count = 0;
+      queryDevices(0, nullptr, &count);
+      std::vector<EGLDeviceEXT> devices(count);
+      queryDevices(count, devices.data(), &count);
+      for (int i = 0; i < count; ++i) {
+        if (FLAGS_egl_device < 0 || FLAGS_egl_device == i) {
+          displays.push_back(getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[i], nullptr));
+        }
+      }
+    }
+    if (FLAGS_egl_device < 0) {
+      displays.push_back(eglGetDisplay(EGL_DEFAULT_DISPLAY));
+    }
+    for (const EGLDisplay display : displays) {
+      if (display != EGL_NO_DISPLAY && createEglContext(display)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool createEglContext(const EGLDisplay display) {
+    EGLint major, minor;
+    if (!eglInitialize(display, &major, &minor)) {
+      return false;
+    }
+    EGLint numConfigs = 0;
+    EGLConfig eglCfg;
+    if (!eglChooseConfig(display, configAttribs, &eglCfg, 1, &numConfigs) || numConfigs < 1 ||
+        !eglBindAPI(EGL_OPENGL_API)) {
+      return false;
+    }
+    eglCtx = eglCreateContext(display, eglCfg, EGL_NO_CONTEXT, contextAttribs);
+    if (eglCtx == EGL_NO_CONTEXT) {
+      return false;
+    }
+
+    // Rendering goes to fbo, so a surface is only needed where egl cannot do without one
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!extensions || !std::strstr(extensions, "EGL_KHR_surfaceless_context")) {
+      eglSurf = eglCreatePbufferSurface(display, eglCfg, pbufferAttribs);
+    }
+    if (!eglMakeCurrent(display, eglSurf, eglSurf, eglCtx)) {
+      if (eglSurf != EGL_NO_SURFACE) {
+        eglDestroySurface(display, eglSurf);
+        eglSurf = EGL_NO_SURFACE;
+      }
+      eglDestroyContext(display, eglCtx);
+      eglCtx = EGL_NO_CONTEXT;
+      return false;
+    }
+    eglDpy = display;
+    return true;
+  }
 #endif
 
   virtual void updateTransform() {
@@ -285,41 +368,28 @@ class GlWindow {
         name(name),
         width(width),
         height(height) {
+    CHECK(FLAGS_offscreen_gl == "auto" || FLAGS_offscreen_gl == "egl" ||
+          FLAGS_offscreen_gl == "glfw")
+        << "unknown --offscreen_gl " << FLAGS_offscreen_gl;
 #ifdef USE_EGL
     // Only use EGL for offscreen rendering.
-    if (screenState & OFF_SCREEN) {
-      // 1. Initialize EGL
-      eglDpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-
-      EGLint major, minor;
-      eglInitialize(eglDpy, &major, &minor);
-
-      // 2. Select an appropriate configuration
-      EGLint numConfigs;
-      EGLConfig eglCfg;
-      eglChooseConfig(eglDpy, configAttribs, &eglCfg, 1, &numConfigs);
-
-      // 3. Create a surface
-      EGLSurface eglSurf = eglCreatePbufferSurface(eglDpy, eglCfg, pbufferAttribs);
-
-      // 4. Bind the API
-      eglBindAPI(EGL_OPENGL_API);
-
-      // 5. Create a context and make it current
-      EGLContext eglCtx = eglCreateContext(eglDpy, eglCfg, EGL_NO_CONTEXT, NULL);
-
-      eglMakeCurrent(eglDpy, eglSurf, eglSurf, eglCtx);
+    if (screenState == OFF_SCREEN && FLAGS_offscreen_gl != "glfw") {
+      if (createEglContext()) {
+        // Create a frame buffer to render into
+        fbo = createFramebuffer();
 
-      // Create a frame buffer to render into
-      fbo = createFramebuffer();
-
-      // Message the graphics device info
-      LOG(INFO) << folly::format(
-          "OpenGL off-screen renderer: {}", (char*)(glGetString(GL_RENDERER)));
+        // Message the graphics device info
+        LOG(INFO) << folly::format(
+            "OpenGL off-screen renderer: {}", (char*)(glGetString(GL_RENDERER)));
 
-      // Return early avoiding glfw entirely for offscreen rendering
-      return;
+        // Return early avoiding glfw entirely for offscreen rendering
+        return;
+      }
+      CHECK_EQ(FLAGS_offscreen_gl, "auto") << "no egl display can make a gl context";
+      LOG(WARNING) << "no egl display can make a gl context, using a hidden glfw window";
     }
+#else
+    CHECK_NE(FLAGS_offscreen_gl, "egl") << "egl is only supported on linux";
 #endif
     // Used to report glfw faulures
     const char* lastGlfwErrorMessage;
@@ -402,25 +472,28 @@ class GlWindow {
   }
 
   virtual ~GlWindow() {
-    {
-      std::lock_guard<std::mutex> windowLock(windowMapMutex);
-      windows.erase(window);
-    }
-
-#ifdef USE_EGL
     if (screenState & OFF_SCREEN) {
       // cleanup offscreen rendering
       glDeleteFramebuffers(1, &fbo);
-      eglTerminate(eglDpy);
     }
-#else
-    if (screenState & OFF_SCREEN) {
-      // cleanup offscreen rendering
-      glDeleteFramebuffers(1, &fbo);
+
+#ifdef USE_EGL
+    if (eglDpy != EGL_NO_DISPLAY) {
+      // Not eglTerminate(), other windows may have contexts on the same display
+      eglMakeCurrent(eglDpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+      if (eglSurf != EGL_NO_SURFACE) {
+        eglDestroySurface(eglDpy, eglSurf);
+      }
+      eglDestroyContext(eglDpy, eglCtx);
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> windowLock(windowMapMutex);
+      windows.erase(window);
     }
     glfwDestroyWindow(window);
     glfwTerminate();
-#endif
   }
 
   static void mainLoop() {
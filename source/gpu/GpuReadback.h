@@ -0,0 +1,193 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "source/gpu/GlUtil.h"
+
+namespace fb360_dep {
+
+// Ring of pixel pack buffers for reading images back from gl without stalling
+// A read is queued between begin() and end(): gl read calls (glReadPixels, glGetTexImage) issued
+// in between write into a pack buffer at the offsets given by at() and return right away. pop()
+// waits for the oldest read and copies it out, so a caller that pops a few reads behind keeps the
+// gpu busy while the cpu moves on
+// gl converts to the type of the read on the gpu, e.g. reading a float framebuffer as GL_BGR and
+// GL_UNSIGNED_SHORT clamps to [0, 1], quantizes, drops alpha and moves 3/8 of the bytes
+class GpuReadback {
+ public:
+  // count reads can be in flight
+  explicit GpuReadback(const int count) : slots(count) {
+    CHECK_GT(count, 0);
+    for (Slot& slot : slots) {
+      glGenBuffers(1, &slot.buffer);
+    }
+  }
+
+  ~GpuReadback() {
+    for (Slot& slot : slots) {
+      if (slot.fence) {
+        glDeleteSync(slot.fence);
+      }
+      glDeleteBuffers(1, &slot.buffer);
+    }
+  }
+
+  GpuReadback(const GpuReadback&) = delete;
+  GpuReadback& operator=(const GpuReadback&) = delete;
+
+  // opencv type of gl pixels, e.g. CV_16UC3 for GL_BGR, GL_UNSIGNED_SHORT
+  static int getCvType(const GLenum format, const GLenum type) {
+    int channels = 0;
+    switch (format) {
+      case GL_RED:
+        channels = 1;
+        break;
+      case GL_RGB:
+      case GL_BGR:
+        channels = 3;
+        break;
+      case GL_RGBA:
+      case GL_BGRA:
+        channels = 4;
+        break;
+      default:
+        LOG(FATAL) << "unsupported format " << format;
+    }
+    switch (type) {
+      case GL_UNSIGNED_BYTE:
+        return CV_MAKETYPE(CV_8U, channels);
+      case GL_UNSIGNED_SHORT:
+        return CV_MAKETYPE(CV_16U, channels);
+      case GL_FLOAT:
+        return CV_MAKETYPE(CV_32F, channels);
+      default:
+        LOG(FATAL) << "unsupported type " << type;
+    }
+    return 0;
+  }
+
+  bool empty() const {
+    return pending.empty();
+  }
+
+  // pop() before the next begin()
+  bool isFull() const {
+    return int(pending.size()) == int(slots.size());
+  }
+
+  // start queueing a read of an image of size in gl's format and type. isUpsideDown if the gl rows
+  // are bottom to top, as glReadPixels reads them, pop() flips them
+  void begin(
+      const cv::Size& size,
+      const GLenum format,
+      const GLenum type,
+      const bool isUpsideDown = false) {
+    CHECK(!isFull()) << "pop() a read first";
+    CHECK(!current) << "end() the read first";
+    current = &slots[(first + pending.size()) % slots.size()];
+    current->size = size;
+    current->cvType = getCvType(format, type);
+    current->isUpsideDown = isUpsideDown;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, current->buffer);
+    const GLsizeiptr bytes = getRowBytes(*current) * size.height;
+    if (bytes > current->capacity) {
+      glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+      current->capacity = bytes;
+    }
+    // opencv rows are packed
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  }
+
+  // pixels argument of gl read calls to write at row
+  void* at(const int row) const {
+    CHECK(current) << "begin() a read first";
+    CHECK_LT(row, current->size.height);
+    return reinterpret_cast<void*>(uintptr_t(getRowBytes(*current) * row));
+  }
+
+  void end() {
+    CHECK(current) << "begin() a read first";
+    current->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    pending.push_back(current);
+    current = nullptr;
+  }
+
+  // queue a read of the framebuffer bound for reading, size pixels from the bottom left corner
+  void readPixels(const cv::Size& size, const GLenum format, const GLenum type) {
+    const bool kIsUpsideDown = true;
+    begin(size, format, type, kIsUpsideDown);
+    glReadPixels(0, 0, size.width, size.height, format, type, at(0));
+    end();
+  }
+
+  // wait for the oldest read and return it, top row first
+  cv::Mat pop() {
+    CHECK(!empty());
+    Slot& slot = *pending.front();
+    const GLuint64 kTimeoutNs = 1000000000;
+    GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, kTimeoutNs);
+    while (status == GL_TIMEOUT_EXPIRED) {
+      status = glClientWaitSync(slot.fence, 0, kTimeoutNs);
+    }
+    CHECK_NE(status, GL_WAIT_FAILED);
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+
+    cv::Mat result(slot.size, slot.cvType);
+    const size_t rowBytes = getRowBytes(slot);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    const uint8_t* data = static_cast<const uint8_t*>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rowBytes * result.rows, GL_MAP_READ_BIT));
+    CHECK(data) << "failed to map a pack buffer";
+    if (slot.isUpsideDown) {
+      for (int y = 0; y < result.rows; ++y) {
+        memcpy(result.ptr(result.rows - 1 - y), data + rowBytes * y, rowBytes);
+      }
+    } else {
+      memcpy(result.ptr(), data, rowBytes * result.rows);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pending.pop_front();
+    first = (first + 1) % slots.size();
+    return result;
+  }
+
+ private:
+  struct Slot {
+    GLuint buffer = 0;
+    GLsizeiptr capacity = 0; // bytes
+    GLsync fence = nullptr; // set while the read is pending
+    cv::Size size;
+    int cvType = 0;
+    bool isUpsideDown = false;
+  };
+
+  static size_t getRowBytes(const Slot& slot) {
+    return slot.size.width * CV_ELEM_SIZE(slot.cvType);
+  }
+
+  std::vector<Slot> slots;
+  int first = 0; // slot of the oldest pending read
+  std::deque<Slot*> pending; // oldest first
+  Slot* current = nullptr; // between begin() and end()
+  GLint packAlignment = 4;
+};
+
+} // namespace fb360_dep
@@ -0,0 +1,304 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+#include "source/gpu/GlUtil.h"
+
+namespace fb360_dep {
+
+// Pool of gl textures, buffers and vertex arrays, so playback reuses them instead of creating and
+// deleting a set every frame, which fragments driver memory and hitches
+// Textures are keyed by size and internal format, buffers by size rounded up to one of 8 steps per
+// power of two. release() puts an object on the free list, and acquire returns the most recently
+// released free object with the same key, bound, or creates one. Free objects are deleted, least
+// recently released first, while the bytes in use and free exceed the budget
+// Objects come back with their previous contents and state; a reused texture's storage should be
+// updated with glTexSubImage2D, a reused buffer's with glBufferSubData or an invalidating map
+// An object can be shared, e.g. by consecutive frames that show the same data: retain() adds a
+// reference, and it goes on the free list once it is released as many times as it was acquired
+// and retained
+// Threads with gl contexts that share objects can use the same pool, e.g. a loader thread (see
+// FrameLoader), except for vertex arrays, which contexts do not share: those must be acquired and
+// released on a single thread
+class GpuResourcePool {
+ public:
+  static const uint64_t kUnlimited = std::numeric_limits<uint64_t>::max();
+
+  struct Stats {
+    uint64_t hits = 0; // acquires that reused a free object
+    uint64_t misses = 0; // acquires that created an object
+    uint64_t evictions = 0; // free objects deleted to stay within the budget
+    uint64_t bytesInUse = 0;
+    uint64_t bytesFree = 0;
+
+    std::string toString() const {
+      return folly::sformat(
+          "{} hits, {} misses, {} evictions, {:.1f} MB in use, {:.1f} MB free",
+          hits,
+          misses,
+          evictions,
+          bytesInUse / 1048576.0,
+          bytesFree / 1048576.0);
+    }
+  };
+
+  explicit GpuResourcePool(const uint64_t budget = kUnlimited) : budget(budget) {}
+
+  GpuResourcePool(const GpuResourcePool&) = delete;
+  GpuResourcePool& operator=(const GpuResourcePool&) = delete;
+
+  // gl may be gone by the time a static pool is destroyed, see clear()
+  ~GpuResourcePool() = default;
+
+  void setBudget(const uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    evict();
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  // 2d texture bound to GL_TEXTURE_2D. If isReused, it already has width x height internalFormat
+  // storage, otherwise the caller specifies it, e.g. with glTexImage2D
+  GLuint acquireTexture(
+      const int width,
+      const int height,
+      const GLenum internalFormat,
+      bool& isReused) {
+    const Key key(kTexture, internalFormat, width, height);
+    const GLuint name = acquire(key, textureBytes(width, height, internalFormat), isReused);
+    glBindTexture(GL_TEXTURE_2D, name);
+    return name;
+  }
+
+  // buffer of at least size bytes bound to target. If !isReused, it has fresh storage
+  GLuint acquireBuffer(const GLenum target, const uint64_t size, bool& isReused) {
+    const uint64_t rounded = roundBufferSize(size);
+    const Key key(kBuffer, 0, rounded >> 32, rounded & 0xffffffff);
+    const GLuint name = acquire(key, rounded, isReused);
+    glBindBuffer(target, name);
+    if (!isReused) {
+      glBufferData(target, rounded, nullptr, GL_STREAM_DRAW);
+    }
+    return name;
+  }
+
+  // bound vertex array, its attributes and element buffer should all be set again
+  GLuint acquireVertexArray() {
+    bool isReused;
+    const GLuint name = acquire(Key(kVertexArray, 0, 0, 0), 0, isReused);
+    glBindVertexArray(name);
+    return name;
+  }
+
+  // textures and buffers must have been acquired from the pool and not fully released
+  void retainTexture(const GLuint name) {
+    retain(kTexture, name);
+  }
+
+  void retainBuffer(const GLuint name) {
+    retain(kBuffer, name);
+  }
+
+  // objects that were not acquired from the pool are deleted, except vertex arrays which are kept
+  void releaseTexture(const GLuint name) {
+    release(kTexture, name);
+  }
+
+  void releaseBuffer(const GLuint name) {
+    release(kBuffer, name);
+  }
+
+  void releaseVertexArray(const GLuint name) {
+    release(kVertexArray, name);
+  }
+
+  // deletes every free object, objects in use stay valid and are released as usual
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!freeList.empty()) {
+      destroy(freeList.front());
+      stats.bytesFree -= freeList.front().bytes;
+      freeList.pop_front();
+    }
+  }
+
+  // bytes of a texture, for the formats used in this repo
+  static uint64_t textureBytes(const int width, const int height, const GLenum internalFormat) {
+    // srgb astc, 16 bytes per block of 4x4 pixels or more, i.e. at most 1 byte per pixel
+    if (0x93D0 <= internalFormat && internalFormat <= 0x93DD) {
+      return uint64_t(width) * height;
+    }
+    uint64_t bytesPerPixel;
+    switch (internalFormat) {
+      case GL_COMPRESSED_RGBA_BPTC_UNORM:
+      case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+      case GL_R8:
+        bytesPerPixel = 1;
+        break;
+      case GL_RGBA16:
+      case GL_RGBA16F:
+        bytesPerPixel = 8;
+        break;
+      case GL_RGB32F:
+        bytesPerPixel = 12;
+        break;
+      case GL_RGBA32F:
+        bytesPerPixel = 16;
+        break;
+      default: // GL_SRGB8_ALPHA8, GL_RGBA8, GL_R32F, ...
+        bytesPerPixel = 4;
+    }
+    return uint64_t(width) * height * bytesPerPixel;
+  }
+
+  // size rounded up to a multiple of 1/8 of its power of two, so sizes that vary a little from
+  // frame to frame share buffers, and at most 1/8 of a buffer is wasted
+  static uint64_t roundBufferSize(const uint64_t size) {
+    uint64_t step = 1;
+    while (step * 16 <= size) {
+      step *= 2;
+    }
+    return (size + step - 1) / step * step;
+  }
+
+ private:
+  enum Kind { kTexture, kBuffer, kVertexArray };
+  using Key = std::tuple<Kind, GLenum, uint32_t, uint32_t>; // kind, format, width, height
+
+  struct Object {
+    Key key;
+    GLuint name;
+    uint64_t bytes;
+    int refs = 1; // while in use
+  };
+
+  static uint64_t id(const Kind kind, const GLuint name) {
+    return uint64_t(kind) << 32 | name;
+  }
+
+  GLuint acquire(const Key& key, const uint64_t bytes, bool& isReused) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // most recently released first, it is the likeliest to still be in the gpu's caches
+    for (auto it = freeList.rbegin(); it != freeList.rend(); ++it) {
+      if (it->key == key) {
+        Object object = *it;
+        object.refs = 1;
+        freeList.erase(std::next(it).base());
+        stats.bytesFree -= object.bytes;
+        stats.bytesInUse += object.bytes;
+        inUse[id(std::get<0>(key), object.name)] = object;
+        ++stats.hits;
+        isReused = true;
+        return object.name;
+      }
+    }
+    Object object{key, create(std::get<0>(key)), bytes};
+    inUse[id(std::get<0>(key), object.name)] = object;
+    stats.bytesInUse += bytes;
+    ++stats.misses;
+    isReused = false;
+    evict();
+    return object.name;
+  }
+
+  void retain(const Kind kind, const GLuint name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = inUse.find(id(kind, name));
+    CHECK(it != inUse.end()) << "retained an object that is not in use: " << name;
+    ++it->second.refs;
+  }
+
+  void release(const Kind kind, const GLuint name) {
+    if (name == 0) { // gl silently ignores 0
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = inUse.find(id(kind, name));
+    if (it == inUse.end()) {
+      Object object{Key(kind, 0, 0, 0), name, 0};
+      if (kind == kVertexArray) {
+        freeList.push_back(object);
+      } else {
+        destroy(object);
+      }
+      return;
+    }
+    if (--it->second.refs > 0) {
+      return; // still shared
+    }
+    freeList.push_back(it->second);
+    stats.bytesInUse -= it->second.bytes;
+    stats.bytesFree += it->second.bytes;
+    inUse.erase(it);
+    evict();
+  }
+
+  // with mutex held
+  void evict() {
+    while (!freeList.empty() && stats.bytesInUse + stats.bytesFree > budget) {
+      destroy(freeList.front());
+      stats.bytesFree -= freeList.front().bytes;
+      freeList.pop_front();
+      ++stats.evictions;
+    }
+  }
+
+  static GLuint create(const Kind kind) {
+    GLuint name;
+    switch (kind) {
+      case kTexture:
+        glGenTextures(1, &name);
+        break;
+      case kBuffer:
+        glGenBuffers(1, &name);
+        break;
+      case kVertexArray:
+        glGenVertexArrays(1, &name);
+        break;
+    }
+    return name;
+  }
+
+  static void destroy(const Object& object) {
+    switch (std::get<0>(object.key)) {
+      case kTexture:
+        glDeleteTextures(1, &object.name);
+        break;
+      case kBuffer:
+        glDeleteBuffers(1, &object.name);
+        break;
+      case kVertexArray:
+        glDeleteVertexArrays(1, &object.name);
+        break;
+    }
+  }
+
+  mutable std::mutex mutex;
+  uint64_t budget;
+  Stats stats;
+  std::list<Object> freeList; // least recently released first
+  std::unordered_map<uint64_t, Object> inUse; // by id(kind, name)
+};
+
+} // namespace fb360_dep
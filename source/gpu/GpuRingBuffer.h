@@ -0,0 +1,159 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+
+#include "source/gpu/GlUtil.h"
+
+namespace fb360_dep {
+
+// Persistently mapped gl buffer for streaming uploads, allocated in FIFO order
+// Data is written through the mapping (e.g. read from disk straight into it) and used by gl at
+// offsets into getBuffer(), so uploads create, map and unmap no buffers. When gl is done with an
+// allocation, release() fences the commands issued so far, and the space is reused once the fence
+// has signaled and every allocation before it has been reclaimed
+// Requires buffer storage (gl 4.4 or ARB_buffer_storage), see isSupported()
+class GpuRingBuffer {
+ public:
+  static const uint64_t kFull = ~uint64_t(0);
+
+  static bool isSupported() {
+#ifdef GL_MAP_PERSISTENT_BIT
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major > 4 || (major == 4 && minor >= 4)) {
+      return true;
+    }
+    GLint count;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+      const char* ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+      if (strcmp(ext, "GL_ARB_buffer_storage") == 0) {
+        return true;
+      }
+    }
+#endif
+    return false;
+  }
+
+  explicit GpuRingBuffer(const uint64_t capacity) : capacity(capacity) {
+#ifdef GL_MAP_PERSISTENT_BIT
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(kTarget, buffer);
+    glBufferStorage(kTarget, capacity, nullptr, flags);
+    base = static_cast<uint8_t*>(glMapBufferRange(kTarget, 0, capacity, flags));
+    glBindBuffer(kTarget, 0);
+#endif
+    CHECK(base) << "failed to map a ring buffer of " << capacity << " bytes";
+  }
+
+  ~GpuRingBuffer() {
+    for (const Allocation& allocation : allocations) {
+      if (allocation.fence) {
+        glDeleteSync(allocation.fence);
+      }
+    }
+    glBindBuffer(kTarget, buffer);
+    glUnmapBuffer(kTarget);
+    glBindBuffer(kTarget, 0);
+    // vertex arrays still using the buffer keep it alive
+    glDeleteBuffers(1, &buffer);
+  }
+
+  GpuRingBuffer(const GpuRingBuffer&) = delete;
+  GpuRingBuffer& operator=(const GpuRingBuffer&) = delete;
+
+  GLuint getBuffer() const {
+    return buffer;
+  }
+
+  // mapping of offset 0, writes are visible to gl commands issued after them (coherent mapping)
+  uint8_t* getBase() const {
+    return base;
+  }
+
+  uint64_t getCapacity() const {
+    return capacity;
+  }
+
+  // returns the offset of size contiguous bytes, kFull if there is no room until more
+  // allocations are released and reclaimed. Never blocks
+  uint64_t allocate(const uint64_t size) {
+    CHECK_GT(size, 0);
+    reclaim();
+    uint64_t offset = kFull;
+    if (allocations.empty()) {
+      head = 0;
+      if (size <= capacity) {
+        offset = 0;
+      }
+    } else {
+      const uint64_t tail = allocations.front().begin;
+      if (tail < head) { // free space is [head, capacity) and [0, tail)
+        if (head + size <= capacity) {
+          offset = head;
+        } else if (size <= tail) {
+          offset = 0;
+        }
+      } else if (head + size <= tail) { // wrapped, free space is [head, tail)
+        offset = head;
+      }
+    }
+    if (offset != kFull) {
+      allocations.push_back({offset, nullptr});
+      head = offset + size;
+    }
+    return offset;
+  }
+
+  // gl commands issued so far are the last ones to use the allocation at offset
+  void release(const uint64_t offset) {
+    for (Allocation& allocation : allocations) {
+      if (allocation.begin == offset && !allocation.fence) {
+        allocation.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        return;
+      }
+    }
+    LOG(FATAL) << "no allocation at " << offset;
+  }
+
+ private:
+  static const GLenum kTarget = GL_TEXTURE_BUFFER; // unimportant, pick unused type
+
+  struct Allocation {
+    uint64_t begin;
+    GLsync fence; // nullptr until released
+  };
+
+  // frees released allocations at the front that gl is done with
+  void reclaim() {
+    while (!allocations.empty() && allocations.front().fence) {
+      const GLenum status =
+          glClientWaitSync(allocations.front().fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        return;
+      }
+      glDeleteSync(allocations.front().fence);
+      allocations.pop_front();
+    }
+  }
+
+  const uint64_t capacity;
+  GLuint buffer = 0;
+  uint8_t* base = nullptr;
+  uint64_t head = 0; // end of the newest allocation
+  std::deque<Allocation> allocations; // oldest first
+};
+
+} // namespace fb360_dep
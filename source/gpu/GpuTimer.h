@@ -0,0 +1,86 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "source/gpu/GlUtil.h"
+
+namespace fb360_dep {
+
+// Times gl commands on the gpu without stalling the cpu
+// begin() and end() bracket the commands with a GL_TIME_ELAPSED query from a small ring, and
+// getMs() returns the newest result the gpu has finished, usually a couple of frames old. If the
+// gpu is so far behind that every query is still in flight, begin() and end() skip timing
+// Elapsed time queries cannot nest, so timers cannot overlap either
+class GpuTimer {
+ public:
+  explicit GpuTimer(const int count = 4) : queries(count), isIssued(count, false) {
+    CHECK_GT(count, 0);
+    glGenQueries(count, queries.data());
+  }
+
+  ~GpuTimer() {
+    glDeleteQueries(queries.size(), queries.data());
+  }
+
+  GpuTimer(const GpuTimer&) = delete;
+  GpuTimer& operator=(const GpuTimer&) = delete;
+
+  void begin() {
+    collect();
+    isTiming = !isIssued[next];
+    if (isTiming) {
+      glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    }
+  }
+
+  void end() {
+    if (isTiming) {
+      glEndQuery(GL_TIME_ELAPSED);
+      isIssued[next] = true;
+      next = (next + 1) % queries.size();
+      isTiming = false;
+    }
+  }
+
+  // NAN until the first result is in
+  float getMs() {
+    collect();
+    return ms;
+  }
+
+ private:
+  // reads the finished queries, oldest first
+  void collect() {
+    for (int i = 0; i < int(queries.size()); ++i) {
+      const int query = (next + i) % queries.size();
+      if (!isIssued[query]) {
+        continue;
+      }
+      GLint isAvailable = 0;
+      glGetQueryObjectiv(queries[query], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+      if (!isAvailable) {
+        return; // newer queries are not either
+      }
+      GLuint64 ns;
+      glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &ns);
+      ms = ns / 1e6f;
+      isIssued[query] = false;
+    }
+  }
+
+  std::vector<GLuint> queries;
+  std::vector<bool> isIssued; // waiting for the result
+  int next = 0; // query to begin next, the oldest
+  bool isTiming = false;
+  float ms = NAN;
+};
+
+} // namespace fb360_dep
@@ -83,6 +83,108 @@ struct ReprojectionScene {
   }
 };
 
+// plane sweep of a source camera into a dst camera, one buffer per disparity
+
+// each source is rendered into all the buffers at once, disparities go through the draw buffers
+// a few at a time (see GpuBuffers::render). results are meant to be summed over the sources with
+// additive blending: texels outside the source are transparent black, so rgb is the sum of the
+// colors that the sources see and alpha how many sources see them
+// example usage (see GenerateCameraOverlaps):
+//  GpuBuffers buffers(GL_RGBA32F, area, disparities.size());
+//  ... clear buffers, glEnable(GL_BLEND), glBlendFunc(GL_ONE, GL_ONE) ...
+//  PlaneSweepScene scene(disparities.size());
+//  scene.setDisparities(disparities);
+//  for each src:
+//    scene.setSource(reprojection[src], srcTexture[src]);
+//    buffers.subdivide(scene);
+//  buffers.read(&mat(0, 0), GL_RGBA, GL_FLOAT, index of the disparity);
+struct PlaneSweepScene {
+  explicit PlaneSweepScene(const int maxDisparityCount)
+      : maxDisparityCount(maxDisparityCount), program(createProgram(maxDisparityCount)) {}
+
+  ~PlaneSweepScene() {
+    glDeleteProgram(program);
+  }
+
+  using Coor = GpuBuffers::Coor;
+
+  bool render(GpuBuffers& dst, const Coor& begin, const Coor& size) const {
+    CHECK_LE(dst.size(), disparityCount) << "more buffers than disparities";
+    glUseProgram(program);
+    dst.render(program);
+    return true; // success
+  }
+
+  // disparity of each buffer
+  void setDisparities(const std::vector<float>& disparities) {
+    CHECK_LE(int(disparities.size()), maxDisparityCount);
+    glUseProgram(program);
+    const GLint location = getUniformLocation(program, "disparities");
+    glUniform1fv(location, disparities.size(), disparities.data());
+    disparityCount = disparities.size();
+  }
+
+  void setSource(const ReprojectionTexture& reprojection, const GLuint srcTexture) {
+    glUseProgram(program);
+    connectUnitWithTextureAndUniform(
+        0, GL_TEXTURE_3D, reprojection.texture, program, "reprojectionTexture");
+    connectUnitWithTextureAndUniform(1, GL_TEXTURE_2D, srcTexture, program, "srcTexture");
+    glUniform3fv(getUniformLocation(program, "reprojectionScale"), 1, reprojection.scale.data());
+    glUniform3fv(getUniformLocation(program, "reprojectionOffset"), 1, reprojection.offset.data());
+  }
+
+  const int maxDisparityCount;
+  const GLuint program;
+
+ private:
+  size_t disparityCount = 0;
+
+  static GLuint createProgram(const int maxDisparityCount) {
+    std::string fragmentShader = R"(
+      #version 330 core
+
+      uniform vec3 reprojectionScale;
+      uniform vec3 reprojectionOffset;
+
+      uniform sampler3D reprojectionTexture;
+      uniform sampler2D srcTexture;
+
+      uniform float disparities[$DISPARITY_COUNT$];
+      uniform int bufferBegin;
+      uniform int bufferCount;
+      uniform int bufferTotal;
+
+      in vec2 dstCoor;
+      layout(location = 0) out vec4 results[$OUTPUT_COUNT$];
+
+      vec4 sweep(int i) {
+        if (i >= bufferCount || bufferBegin + i >= bufferTotal) {
+          return vec4(0);
+        }
+        vec2 srcCoor = texture(
+          reprojectionTexture,
+          vec3(dstCoor, disparities[bufferBegin + i]) * reprojectionScale + reprojectionOffset).xy;
+        return texture(srcTexture, srcCoor);
+      }
+
+      void main() {
+        $OUTPUTS$
+      }
+    )";
+
+    // outputs are indexed with constants, one per draw buffer
+    const int outputCount = std::min(int(GpuBuffers::maxDrawBufferCount()), maxDisparityCount);
+    std::string outputs;
+    for (int i = 0; i < outputCount; ++i) {
+      outputs += "results[" + std::to_string(i) + "] = sweep(" + std::to_string(i) + ");\n";
+    }
+    replaceAll(fragmentShader, "$DISPARITY_COUNT$", std::to_string(maxDisparityCount));
+    replaceAll(fragmentShader, "$OUTPUT_COUNT$", std::to_string(outputCount));
+    replaceAll(fragmentShader, "$OUTPUTS$", outputs);
+    return ::createProgram(fullscreenVertexShader("tex", "dstCoor"), fragmentShader);
+  }
+};
+
 // This is convenient, but note: It blocks until GPU is done
 template <typename T>
 cv::Mat_<T> reproject(
@@ -25,6 +25,7 @@
 #include "source/util/CvUtil.h"
 #include "source/util/MathUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 
@@ -37,6 +38,8 @@ enum class DemosaicFilter : unsigned int {
 };
 
 const int kToneCurveLutSize = 4096;
+const int kIspRowsPerTask = 16;
+const float kFixedPointOne = 65535; // 16 bit fixed point pixels are in [0, 1]
 
 class CameraIsp {
  protected:
@@ -74,14 +77,22 @@ class CameraIsp {
   bool redBayerPixel[2][2];
   bool greenBayerPixel[2][2];
   cv::Mat_<cv::Vec3f> demosaicedImage;
+  // The fixed point pipeline's images, used instead of the ones above when set, see setFixedPoint
+  cv::Mat_<uint16_t> rawImage16;
+  cv::Mat_<cv::Vec3w> demosaicedImage16;
+  bool fixedPoint = false;
   uint32_t filters;
   DemosaicFilter demosaicFilter;
   int resize;
+  int numThreads = -1;
   bool disableToneCurve;
   bool toneCurveEnabled;
   std::vector<cv::Vec3f> toneCurveLut;
   math_util::BezierCurve<float, cv::Vec3f> vignetteCurveH;
   math_util::BezierCurve<float, cv::Vec3f> vignetteCurveV;
+  // Curves at every column and row, built for the first image of a size and kept for the next
+  std::vector<cv::Vec3f> vignetteTableH;
+  std::vector<cv::Vec3f> vignetteTableV;
 
   const int width;
   const int height;
@@ -90,39 +101,44 @@ class CameraIsp {
   const float sqrtMaxD; // max diagonal distance
 
   void demosaicBilinearFilter(cv::Mat_<float>& r, cv::Mat_<float>& g, cv::Mat_<float>& b) const {
-    for (int i = 0; i < height; ++i) {
-      const int i_1 = math_util::reflect(i - 1, height);
-      const int i1 = math_util::reflect(i + 1, height);
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const int i_1 = math_util::reflect(i - 1, height);
+          const int i1 = math_util::reflect(i + 1, height);
 
-      const bool redGreenRow =
-          (redPixel(i, 0) && greenPixel(i, 1)) || (redPixel(i, 1) && greenPixel(i, 0));
+          const bool redGreenRow =
+              (redPixel(i, 0) && greenPixel(i, 1)) || (redPixel(i, 1) && greenPixel(i, 0));
 
-      for (int j = 0; j < width; ++j) {
-        const int j_1 = math_util::reflect(j - 1, width);
-        const int j1 = math_util::reflect(j + 1, width);
+          for (int j = 0; j < width; ++j) {
+            const int j_1 = math_util::reflect(j - 1, width);
+            const int j1 = math_util::reflect(j + 1, width);
 
-        if (redPixel(i, j)) {
-          g(i, j) = cv_util::bilerp(g(i_1, j), g(i1, j), g(i, j_1), g(i, j1), 0.5f, 0.5f);
+            if (redPixel(i, j)) {
+              g(i, j) = cv_util::bilerp(g(i_1, j), g(i1, j), g(i, j_1), g(i, j1), 0.5f, 0.5f);
 
-          b(i, j) = cv_util::bilerp(b(i_1, j_1), b(i1, j_1), b(i_1, j1), b(i1, j1), 0.5f, 0.5f);
+              b(i, j) = cv_util::bilerp(b(i_1, j_1), b(i1, j_1), b(i_1, j1), b(i1, j1), 0.5f, 0.5f);
 
-        } else if (greenPixel(i, j)) {
-          if (redGreenRow) {
-            b(i, j) = (b(i_1, j) + b(i1, j)) / 2.0f;
+            } else if (greenPixel(i, j)) {
+              if (redGreenRow) {
+                b(i, j) = (b(i_1, j) + b(i1, j)) / 2.0f;
 
-            r(i, j) = (r(i, j_1) + r(i, j1)) / 2.0f;
-          } else {
-            r(i, j) = (r(i_1, j) + r(i1, j)) / 2.0f;
+                r(i, j) = (r(i, j_1) + r(i, j1)) / 2.0f;
+              } else {
+                r(i, j) = (r(i_1, j) + r(i1, j)) / 2.0f;
 
-            b(i, j) = (b(i, j_1) + b(i, j1)) / 2.0f;
-          }
-        } else {
-          g(i, j) = cv_util::bilerp(g(i_1, j), g(i1, j), g(i, j_1), g(i, j1), 0.5f, 0.5f);
+                b(i, j) = (b(i, j_1) + b(i, j1)) / 2.0f;
+              }
+            } else {
+              g(i, j) = cv_util::bilerp(g(i_1, j), g(i1, j), g(i, j_1), g(i, j1), 0.5f, 0.5f);
 
-          r(i, j) = cv_util::bilerp(r(i_1, j_1), r(i1, j_1), r(i_1, j1), r(i1, j1), 0.5f, 0.5f);
-        }
-      }
-    }
+              r(i, j) = cv_util::bilerp(r(i_1, j_1), r(i1, j_1), r(i_1, j1), r(i1, j1), 0.5f, 0.5f);
+            }
+          }
+        },
+        numThreads);
   }
 
   void demosaicFrequencyFilter(cv::Mat_<float>& r, cv::Mat_<float>& g, cv::Mat_<float>& b) const {
@@ -134,27 +150,32 @@ class CameraIsp {
     //  Do a per pixel filtering in DCT space
     const int h2 = r.rows;
     const int w2 = r.cols;
-    for (int i = 0; i < h2; ++i) {
-      const float y = float(i) / float(h2 - 1);
-      for (int j = 0; j < w2; ++j) {
-        const float x = float(j) / float(w2 - 1);
-        // Diagonal distance and half
-        static const float kDScale = 1.2f;
-        const float d = (x + y) * kDScale;
-        const float kSharpen = d / 2.5f + 1.0f;
-        const float gGain = 2.0f * dFilter(d) * kSharpen;
-        const float rbGain = 4.0f * dFilter(d);
-        g(i, j) *= gGain;
-
-        const float kCrossoverCutoff = 3.0f;
-        const float d2 = d * 2 * kCrossoverCutoff;
-
-        // Cross over blend value
-        const float alpha = dcFilter(d2);
-        r(i, j) = math_util::lerp(g(i, j), r(i, j) * rbGain, alpha);
-        b(i, j) = math_util::lerp(g(i, j), b(i, j) * rbGain, alpha);
-      }
-    }
+    parallelFor(
+        0,
+        h2,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const float y = float(i) / float(h2 - 1);
+          for (int j = 0; j < w2; ++j) {
+            const float x = float(j) / float(w2 - 1);
+            // Diagonal distance and half
+            static const float kDScale = 1.2f;
+            const float d = (x + y) * kDScale;
+            const float kSharpen = d / 2.5f + 1.0f;
+            const float gGain = 2.0f * dFilter(d) * kSharpen;
+            const float rbGain = 4.0f * dFilter(d);
+            g(i, j) *= gGain;
+
+            const float kCrossoverCutoff = 3.0f;
+            const float d2 = d * 2 * kCrossoverCutoff;
+
+            // Cross over blend value
+            const float alpha = dcFilter(d2);
+            r(i, j) = math_util::lerp(g(i, j), r(i, j) * rbGain, alpha);
+            b(i, j) = math_util::lerp(g(i, j), b(i, j) * rbGain, alpha);
+          }
+        },
+        numThreads);
   }
 
   void demosaicEdgeAware(cv::Mat_<float>& red, cv::Mat_<float>& green, cv::Mat_<float>& blue)
@@ -168,81 +189,96 @@ class CameraIsp {
     cv::Mat_<float> dH(height, width);
 
     // Compute green gradients
-    for (int i = 0; i < height; ++i) {
-      const int i_1 = math_util::reflect(i - 1, height);
-      const int i1 = math_util::reflect(i + 1, height);
-      const int i_2 = math_util::reflect(i - 2, height);
-      const int i2 = math_util::reflect(i + 2, height);
-
-      for (int j = 0; j < width; ++j) {
-        const int j_1 = math_util::reflect(j - 1, width);
-        const int j1 = math_util::reflect(j + 1, width);
-        const int j_2 = math_util::reflect(j - 2, width);
-        const int j2 = math_util::reflect(j + 2, width);
-        if (greenPixel(i, j)) {
-          gV(i, j) = green(i, j);
-          gH(i, j) = green(i, j);
-
-          dV(i, j) =
-              (fabsf(green(i2, j) - green(i, j)) + fabsf(green(i, j) - green(i_2, j))) / 2.0f;
-
-          dH(i, j) =
-              (fabsf(green(i, j2) - green(i, j)) + fabsf(green(i, j) - green(i, j_2))) / 2.0f;
-        } else {
-          gV(i, j) = (green(i_1, j) + green(i1, j)) / 2.0f;
-          gH(i, j) = (green(i, j_1) + green(i, j1)) / 2.0f;
-          dV(i, j) = (fabsf(green(i_1, j) - green(i1, j))) / 2.0f;
-          dH(i, j) = (fabsf(green(i, j_1) - green(i, j1))) / 2.0f;
-
-          cv::Mat_<float>& ch = redPixel(i, j) ? red : blue;
-          gV(i, j) += (2.0f * ch(i, j) - ch(i_2, j) - ch(i2, j)) / 4.0f;
-          gH(i, j) += (2.0f * ch(i, j) - ch(i, j_2) - ch(i, j2)) / 4.0f;
-          dV(i, j) += fabsf(-2.0f * ch(i, j) + ch(i_2, j) + ch(i2, j)) / 2.0f;
-          dH(i, j) += fabsf(-2.0f * ch(i, j) + ch(i, j_2) + ch(i, j2)) / 2.0f;
-        }
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const int i_1 = math_util::reflect(i - 1, height);
+          const int i1 = math_util::reflect(i + 1, height);
+          const int i_2 = math_util::reflect(i - 2, height);
+          const int i2 = math_util::reflect(i + 2, height);
+
+          for (int j = 0; j < width; ++j) {
+            const int j_1 = math_util::reflect(j - 1, width);
+            const int j1 = math_util::reflect(j + 1, width);
+            const int j_2 = math_util::reflect(j - 2, width);
+            const int j2 = math_util::reflect(j + 2, width);
+            if (greenPixel(i, j)) {
+              gV(i, j) = green(i, j);
+              gH(i, j) = green(i, j);
+
+              dV(i, j) =
+                  (fabsf(green(i2, j) - green(i, j)) + fabsf(green(i, j) - green(i_2, j))) / 2.0f;
+
+              dH(i, j) =
+                  (fabsf(green(i, j2) - green(i, j)) + fabsf(green(i, j) - green(i, j_2))) / 2.0f;
+            } else {
+              gV(i, j) = (green(i_1, j) + green(i1, j)) / 2.0f;
+              gH(i, j) = (green(i, j_1) + green(i, j1)) / 2.0f;
+              dV(i, j) = (fabsf(green(i_1, j) - green(i1, j))) / 2.0f;
+              dH(i, j) = (fabsf(green(i, j_1) - green(i, j1))) / 2.0f;
+
+              cv::Mat_<float>& ch = redPixel(i, j) ? red : blue;
+              gV(i, j) += (2.0f * ch(i, j) - ch(i_2, j) - ch(i2, j)) / 4.0f;
+              gH(i, j) += (2.0f * ch(i, j) - ch(i, j_2) - ch(i, j2)) / 4.0f;
+              dV(i, j) += fabsf(-2.0f * ch(i, j) + ch(i_2, j) + ch(i2, j)) / 2.0f;
+              dH(i, j) += fabsf(-2.0f * ch(i, j) + ch(i, j_2) + ch(i, j2)) / 2.0f;
+            }
+          }
+        },
+        numThreads);
     const int w = 4;
     const int diameter = 2 * w + 1;
     const int diameterSquared = math_util::square(diameter);
 
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; ++j) {
-        // Homogenity test
-        int hCount = 0;
-        for (int l = -w; l <= w; ++l) {
-          const int il = math_util::reflect(i + l, height);
-          for (int k = -w; k <= w; ++k) {
-            const int jk = math_util::reflect(j + k, width);
-            hCount += (dH(il, jk) <= dV(il, jk));
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; ++j) {
+            // Homogenity test
+            int hCount = 0;
+            for (int l = -w; l <= w; ++l) {
+              const int il = math_util::reflect(i + l, height);
+              for (int k = -w; k <= w; ++k) {
+                const int jk = math_util::reflect(j + k, width);
+                hCount += (dH(il, jk) <= dV(il, jk));
+              }
+            }
+            green(i, j) = math_util::lerp(gV(i, j), gH(i, j), float(hCount) / diameterSquared);
           }
-        }
-        green(i, j) = math_util::lerp(gV(i, j), gH(i, j), float(hCount) / diameterSquared);
-      }
-    }
+        },
+        numThreads);
     demosaicChromaSuppressed(red, green, blue);
   }
 
   void demosaicGreenBilinear(cv::Mat_<float>& red, cv::Mat_<float>& green, cv::Mat_<float>& blue)
       const {
-    for (int i = 0; i < height; ++i) {
-      const int i_1 = math_util::reflect(i - 1, height);
-      const int i1 = math_util::reflect(i + 1, height);
-
-      for (int j = 0; j < width; ++j) {
-        const int j_1 = math_util::reflect(j - 1, width);
-        const int j1 = math_util::reflect(j + 1, width);
-
-        if (redPixel(i, j)) {
-          green(i, j) =
-              cv_util::bilerp(green(i_1, j), green(i1, j), green(i, j_1), green(i, j1), 0.5f, 0.5f);
-
-        } else if (!greenPixel(i, j)) {
-          green(i, j) =
-              cv_util::bilerp(green(i_1, j), green(i1, j), green(i, j_1), green(i, j1), 0.5f, 0.5f);
-        }
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const int i_1 = math_util::reflect(i - 1, height);
+          const int i1 = math_util::reflect(i + 1, height);
+
+          for (int j = 0; j < width; ++j) {
+            const int j_1 = math_util::reflect(j - 1, width);
+            const int j1 = math_util::reflect(j + 1, width);
+
+            if (redPixel(i, j)) {
+              green(i, j) = cv_util::bilerp(
+                  green(i_1, j), green(i1, j), green(i, j_1), green(i, j1), 0.5f, 0.5f);
+
+            } else if (!greenPixel(i, j)) {
+              green(i, j) = cv_util::bilerp(
+                  green(i_1, j), green(i1, j), green(i, j_1), green(i, j1), 0.5f, 0.5f);
+            }
+          }
+        },
+        numThreads);
     demosaicChromaSuppressed(red, green, blue);
   }
 
@@ -252,94 +288,110 @@ class CameraIsp {
     cv::Mat_<float> redMinusGreen(height, width);
     cv::Mat_<float> blueMinusGreen(height, width);
 
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; ++j) {
-        if (redPixel(i, j)) {
-          redMinusGreen(i, j) = red(i, j) - green(i, j);
-        } else if (!greenPixel(i, j)) {
-          blueMinusGreen(i, j) = blue(i, j) - green(i, j);
-        }
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; ++j) {
+            if (redPixel(i, j)) {
+              redMinusGreen(i, j) = red(i, j) - green(i, j);
+            } else if (!greenPixel(i, j)) {
+              blueMinusGreen(i, j) = blue(i, j) - green(i, j);
+            }
+          }
+        },
+        numThreads);
     // Now use a constant hue based red/blue bilinear interpolation
-    for (int i = 0; i < height; ++i) {
-      const int i_1 = math_util::reflect(i - 1, height);
-      const int i1 = math_util::reflect(i + 1, height);
-      const int i_2 = math_util::reflect(i - 2, height);
-      const int i2 = math_util::reflect(i + 2, height);
-
-      const bool redGreenRow =
-          (redPixel(i, 0) && greenPixel(i, 1)) || (redPixel(i, 1) && greenPixel(i, 0));
-
-      for (int j = 0; j < width; ++j) {
-        const int j_1 = math_util::reflect(j - 1, width);
-        const int j1 = math_util::reflect(j + 1, width);
-        const int j_2 = math_util::reflect(j - 2, width);
-        const int j2 = math_util::reflect(j + 2, width);
-
-        if (redPixel(i, j)) {
-          blue(i, j) = (blueMinusGreen(i_1, j_1) + blueMinusGreen(i1, j_1) +
-                        blueMinusGreen(i_1, j1) + blueMinusGreen(i1, j1)) /
-                  4.0f +
-              green(i, j);
-
-          red(i, j) = (redMinusGreen(i, j) + redMinusGreen(i_2, j) + redMinusGreen(i2, j) +
-                       redMinusGreen(i, j_2) + redMinusGreen(i, j2)) /
-                  5.0f +
-              green(i, j);
-        } else if (greenPixel(i, j)) {
-          cv::Mat_<float>& diffCh1 = redGreenRow ? blueMinusGreen : redMinusGreen;
-          cv::Mat_<float>& diffCh2 = redGreenRow ? redMinusGreen : blueMinusGreen;
-
-          cv::Mat_<float>& ch1 = redGreenRow ? blue : red;
-          cv::Mat_<float>& ch2 = redGreenRow ? red : blue;
-
-          ch1(i, j) = (diffCh1(i_1, j_2) + diffCh1(i_1, j) + diffCh1(i_1, j2) + diffCh1(i1, j_2) +
-                       diffCh1(i1, j2) + diffCh1(i1, j2)) /
-                  6.0f +
-              green(i, j);
-
-          ch2(i, j) = (diffCh2(i_2, j_1) + diffCh2(i, j_1) + diffCh2(i2, j_1) + diffCh2(i_2, j1) +
-                       diffCh2(i, j1) + diffCh2(i2, j1)) /
-                  6.0f +
-              green(i, j);
-        } else {
-          red(i, j) = (redMinusGreen(i_1, j_1) + redMinusGreen(i1, j_1) + redMinusGreen(i_1, j1) +
-                       redMinusGreen(i1, j1)) /
-                  4.0f +
-              green(i, j);
-
-          blue(i, j) = (blueMinusGreen(i, j) + blueMinusGreen(i_2, j) + blueMinusGreen(i2, j) +
-                        blueMinusGreen(i, j_2) + blueMinusGreen(i, j2)) /
-                  5.0f +
-              green(i, j);
-        }
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const int i_1 = math_util::reflect(i - 1, height);
+          const int i1 = math_util::reflect(i + 1, height);
+          const int i_2 = math_util::reflect(i - 2, height);
+          const int i2 = math_util::reflect(i + 2, height);
+
+          const bool redGreenRow =
+              (redPixel(i, 0) && greenPixel(i, 1)) || (redPixel(i, 1) && greenPixel(i, 0));
+
+          for (int j = 0; j < width; ++j) {
+            const int j_1 = math_util::reflect(j - 1, width);
+            const int j1 = math_util::reflect(j + 1, width);
+            const int j_2 = math_util::reflect(j - 2, width);
+            const int j2 = math_util::reflect(j + 2, width);
+
+            if (redPixel(i, j)) {
+              blue(i, j) = (blueMinusGreen(i_1, j_1) + blueMinusGreen(i1, j_1) +
+                            blueMinusGreen(i_1, j1) + blueMinusGreen(i1, j1)) /
+                      4.0f +
+                  green(i, j);
+
+              red(i, j) = (redMinusGreen(i, j) + redMinusGreen(i_2, j) + redMinusGreen(i2, j) +
+                           redMinusGreen(i, j_2) + redMinusGreen(i, j2)) /
+                      5.0f +
+                  green(i, j);
+            } else if (greenPixel(i, j)) {
+              cv::Mat_<float>& diffCh1 = redGreenRow ? blueMinusGreen : redMinusGreen;
+              cv::Mat_<float>& diffCh2 = redGreenRow ? redMinusGreen : blueMinusGreen;
+
+              cv::Mat_<float>& ch1 = redGreenRow ? blue : red;
+              cv::Mat_<float>& ch2 = redGreenRow ? red : blue;
+
+              ch1(i, j) = (diffCh1(i_1, j_2) + diffCh1(i_1, j) + diffCh1(i_1, j2) +
+                           diffCh1(i1, j_2) + diffCh1(i1, j2) + diffCh1(i1, j2)) /
+                      6.0f +
+                  green(i, j);
+
+              ch2(i, j) = (diffCh2(i_2, j_1) + diffCh2(i, j_1) + diffCh2(i2, j_1) +
+                           diffCh2(i_2, j1) + diffCh2(i, j1) + diffCh2(i2, j1)) /
+                      6.0f +
+                  green(i, j);
+            } else {
+              red(i, j) = (redMinusGreen(i_1, j_1) + redMinusGreen(i1, j_1) +
+                           redMinusGreen(i_1, j1) + redMinusGreen(i1, j1)) /
+                      4.0f +
+                  green(i, j);
+
+              blue(i, j) = (blueMinusGreen(i, j) + blueMinusGreen(i_2, j) + blueMinusGreen(i2, j) +
+                            blueMinusGreen(i, j_2) + blueMinusGreen(i, j2)) /
+                      5.0f +
+                  green(i, j);
+            }
+          }
+        },
+        numThreads);
   }
 
-  template <class T>
-  void resizeInput(const cv::Mat_<T>& inputImage) {
+  // Scales the input to [0, outputOne] in outputImage
+  template <class T, class R>
+  void resizeInput(const cv::Mat_<T>& inputImage, cv::Mat_<R>& outputImage, const float outputOne) {
     int bitsPerPixel = 8 * sizeof(T);
     int maxPixelValue = (1 << bitsPerPixel) - 1;
-    const float areaRecip = 1.0f / (maxPixelValue * float(math_util::square(resize)));
+    const float areaRecip = outputOne / (maxPixelValue * float(math_util::square(resize)));
     const int r = resize > 1 ? 2 : 1;
 
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; ++j) {
-        float sum = 0.0f;
-        for (int k = 0; k < resize; ++k) {
-          const int ip = i * resize + k * 2;
-          const int ipp = math_util::reflect(ip + (i % r), inputImage.rows);
-          for (int l = 0; l < resize; ++l) {
-            const int jp = j * resize + l * 2;
-            const int jpp = math_util::reflect(jp + (j % r), inputImage.cols);
-            sum += float(inputImage(ipp, jpp));
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; ++j) {
+            float sum = 0.0f;
+            for (int k = 0; k < resize; ++k) {
+              const int ip = i * resize + k * 2;
+              const int ipp = math_util::reflect(ip + (i % r), inputImage.rows);
+              for (int l = 0; l < resize; ++l) {
+                const int jp = j * resize + l * 2;
+                const int jpp = math_util::reflect(jp + (j % r), inputImage.cols);
+                sum += float(inputImage(ipp, jpp));
+              }
+            }
+            outputImage(i, j) = cv::saturate_cast<R>(sum * areaRecip);
           }
-        }
-        rawImage(i, j) = sum * areaRecip;
-      }
-    }
+        },
+        numThreads);
   }
 
   std::array<int, 4> getPlaneOrderToBayerOrder() const {
@@ -625,6 +677,8 @@ class CameraIsp {
     for (auto p : vignetteRollOffV) {
       vignetteCurveV.addPoint(p);
     }
+    vignetteTableH.clear();
+    vignetteTableV.clear();
 
     // If saturation is unit this satMat will be the identity matrix.
     cv::Mat_<float> satMat = cv::Mat::zeros(3, 3, CV_32F);
@@ -672,6 +726,21 @@ class CameraIsp {
     return vignetteCurveV(float(x) / float(maxDimension));
   }
 
+  // Rebuilds the vignetting tables if the image size changed
+  void updateVignetteTables() {
+    if (int(vignetteTableH.size()) == width && int(vignetteTableV.size()) == height) {
+      return;
+    }
+    vignetteTableH.resize(width);
+    for (int j = 0; j < width; ++j) {
+      vignetteTableH[j] = curveHAtPixel(j);
+    }
+    vignetteTableV.resize(height);
+    for (int i = 0; i < height; ++i) {
+      vignetteTableV[i] = curveVAtPixel(i);
+    }
+  }
+
   void dumpConfigFile(const std::string configFileName) {
     std::ofstream ofs(configFileName.c_str(), std::ios::out);
     if (ofs) {
@@ -836,15 +905,27 @@ class CameraIsp {
   /* Load a native byte order, interleaved, and arbitrarily sized OpenCV raw image */
   virtual void loadImage(const cv::Mat& inputImage) {
     setDimensions(inputImage.cols, inputImage.rows);
-    rawImage = cv::Mat::zeros(height, width, CV_32F);
+    if (isFixedPoint()) {
+      rawImage.release();
+      demosaicedImage.release();
+      rawImage16 = cv::Mat::zeros(height, width, CV_16U);
+      loadRawImage(inputImage, rawImage16, kFixedPointOne);
+    } else {
+      rawImage16.release();
+      demosaicedImage16.release();
+      rawImage = cv::Mat::zeros(height, width, CV_32F);
+      loadRawImage(inputImage, rawImage, 1.0f);
+    }
+  }
 
-    // Copy and convert to float
-    uint8_t depth = inputImage.type() & CV_MAT_DEPTH_MASK;
+  template <typename R>
+  void loadRawImage(const cv::Mat& inputImage, cv::Mat_<R>& outputImage, const float outputOne) {
     // Match the input bits per pixel overriding what is in the config file.
+    uint8_t depth = inputImage.type() & CV_MAT_DEPTH_MASK;
     if (depth == CV_8U) {
-      resizeInput<uint8_t>(inputImage);
+      resizeInput(cv::Mat_<uint8_t>(inputImage), outputImage, outputOne);
     } else if (depth == CV_16U) {
-      resizeInput<uint16_t>(inputImage);
+      resizeInput(cv::Mat_<uint16_t>(inputImage), outputImage, outputOne);
     } else {
       CHECK(false) << "input is larger that 16 bits per pixel";
     }
@@ -852,6 +933,9 @@ class CameraIsp {
 
   template <typename T>
   cv::Mat_<T> getRawImage() const {
+    if (!rawImage16.empty()) {
+      return cv_util::convertTo<T>(rawImage16);
+    }
     CHECK(!rawImage.empty());
     return cv_util::convertTo<T>(rawImage);
   }
@@ -951,6 +1035,26 @@ class CameraIsp {
     this->demosaicFilter = demosaicFilter;
   }
 
+  // -1 = all cores, 0 = run on the calling thread
+  void setNumThreads(const int numThreads) {
+    this->numThreads = numThreads;
+  }
+
+  // Images loaded from now on go through a 16 bit fixed point pipeline, about half the memory
+  // traffic of the float one and vectorizes better, for batch conversions that do not need float
+  // precision. Only the bilinear demosaic without sharpening has one, other settings stay in float
+  void setFixedPoint(const bool fixedPoint) {
+    this->fixedPoint = fixedPoint;
+  }
+
+  bool isFixedPoint() const {
+    return fixedPoint && demosaicFilter == DemosaicFilter::BILINEAR && !isSharpening();
+  }
+
+  bool isSharpening() const {
+    return sharpening.x != 0.0 && sharpening.y != 0.0 && sharpening.z != 0.0;
+  }
+
   void setResize(const int resize) {
     CHECK(resize == 1 || resize == 2 || resize == 4 || resize == 8)
         << "expecting a resize value of 1, 2, 4, or 8. got " << resize;
@@ -976,82 +1080,76 @@ class CameraIsp {
     }
   }
 
+  // A dark pixel among the stuckPixelThreshold brightest of the same color within
+  // stuckPixelRadius is replaced with their median. Each of the 4 bayer planes is processed on its
+  // own, rows in parallel, reading from a copy of the plane: the window mean comes from a box
+  // filter, and only dark pixels are ranked against their window, with no allocation per pixel
   void removeStuckPixels() {
-    if (stuckPixelRadius > 0) {
-      struct Pval {
-        float val;
-        int i;
-        int j;
-
-        Pval(float v) : val(v) {}
-
-        bool operator<(const Pval& p) const {
-          return val < p.val;
-        }
+    if (!rawImage16.empty()) {
+      removeStuckPixels(
+          rawImage16, cv::saturate_cast<uint16_t>(stuckPixelDarknessThreshold * kFixedPointOne));
+    } else {
+      removeStuckPixels(rawImage, stuckPixelDarknessThreshold);
+    }
+  }
 
-        Pval& operator=(const Pval& p) {
-          val = p.val;
-          i = p.i;
-          j = p.j;
-          return *this;
+  template <typename T>
+  void removeStuckPixels(cv::Mat_<T>& image, const T darknessThreshold) {
+    const int r = stuckPixelRadius / 2; // same color pixels are every other row and column
+    if (r == 0 || stuckPixelThreshold == 0) {
+      return;
+    }
+    const int diameter = 2 * r + 1;
+    const int count = math_util::square(diameter);
+    for (int pi = 0; pi < 2; ++pi) {
+      for (int pj = 0; pj < 2; ++pj) {
+        const int planeHeight = (height - pi + 1) / 2;
+        const int planeWidth = (width - pj + 1) / 2;
+        if (planeHeight <= r || planeWidth <= r) {
+          continue; // too small to reflect the window
         }
-      };
-
-      std::vector<Pval> region;
-
-      for (int i = 0; i < height; ++i) {
-        // Traverse boustrophedonically
-        const bool evenScanLine = (i % 2) == 0;
-        const int jStart = evenScanLine ? 0 : width - 1;
-        const int jEnd = evenScanLine ? width - 1 : 0;
-        const int jStep = evenScanLine ? 1 : -1;
-
-        for (int j = jStart; j != jEnd; j += jStep) {
-          const bool thisPixelRed = redPixel(i, j);
-          const bool thisPixelGreen = greenPixel(i, j);
-          const bool thisPixelBlue = bluePixel(i, j);
-
-          region.clear();
-
-          float mean = 0.0f;
-          for (int y = -stuckPixelRadius; y <= stuckPixelRadius; y++) {
-            const int ip = math_util::reflect(i + y, height);
-            for (int x = -stuckPixelRadius; x <= stuckPixelRadius; x++) {
-              const int jp = math_util::reflect(j + x, width);
-              Pval p(rawImage(ip, jp));
-              p.i = ip;
-              p.j = jp;
-              if (redPixel(ip, jp) && thisPixelRed) {
-                mean += p.val;
-                region.push_back(p);
-              } else if (greenPixel(ip, jp) && thisPixelGreen) {
-                mean += p.val;
-                region.push_back(p);
-              } else if (bluePixel(ip, jp) && thisPixelBlue) {
-                mean += p.val;
-                region.push_back(p);
-              }
-            }
-          }
-          mean /= float(region.size());
-
-          // Only deal with dark regions
-          if (mean < stuckPixelDarknessThreshold) {
-            sort(region.begin(), region.end());
-
-            // See if the middle pixel is an outlier
-            for (int k = int(region.size()) - 1; k >= int(region.size()) - stuckPixelThreshold;
-                 --k) {
-              if (region[k].i == i && region[k].j == j) {
-                // Replace the pixel pixel with the median of the region.
-                rawImage(i, j) = region[region.size() / 2].val;
-                goto l0;
-              }
-            }
+        cv::Mat_<T> plane(planeHeight, planeWidth);
+        for (int i = 0; i < planeHeight; ++i) {
+          for (int j = 0; j < planeWidth; ++j) {
+            plane(i, j) = image(2 * i + pi, 2 * j + pj);
           }
-        l0:
-          continue;
         }
+        cv::Mat_<T> mean;
+        const cv::Size size(diameter, diameter);
+        cv::blur(plane, mean, size, cv::Point(-1, -1), cv::BORDER_REFLECT_101);
+        cv::Mat_<T> padded;
+        cv::copyMakeBorder(plane, padded, r, r, r, r, cv::BORDER_REFLECT_101);
+
+        parallelFor(
+            0,
+            planeHeight,
+            kIspRowsPerTask,
+            [&](const int i) {
+              std::vector<T> window(count);
+              for (int j = 0; j < planeWidth; ++j) {
+                if (mean(i, j) >= darknessThreshold) {
+                  continue; // only deal with dark regions
+                }
+                const T center = plane(i, j);
+                int brighter = 0;
+                for (int y = 0; y < diameter && brighter < stuckPixelThreshold; ++y) {
+                  const T* const row = padded.template ptr<T>(i + y) + j;
+                  for (int x = 0; x < diameter; ++x) {
+                    brighter += row[x] > center;
+                  }
+                }
+                if (brighter >= stuckPixelThreshold) {
+                  continue; // not an outlier
+                }
+                for (int y = 0; y < diameter; ++y) {
+                  const T* const row = padded.template ptr<T>(i + y) + j;
+                  std::copy(row, row + diameter, window.begin() + y * diameter);
+                }
+                std::nth_element(window.begin(), window.begin() + count / 2, window.end());
+                image(2 * i + pi, 2 * j + pj) = window[count / 2];
+              }
+            },
+            numThreads);
       }
     }
   }
@@ -1092,67 +1190,218 @@ class CameraIsp {
   }
 
   void antiVignette() {
+    updateVignetteTables();
     for (int i = 0; i < height; ++i) {
-      const cv::Vec3f vV = curveVAtPixel(i);
+      const cv::Vec3f vV = vignetteTableV[i];
       for (int j = 0; j < width; j++) {
-        const cv::Vec3f vH = curveHAtPixel(j);
+        const cv::Vec3f vH = vignetteTableH[j];
         int ch = getChannelNumber(i, j);
         rawImage(i, j) *= vH[ch] * vV[ch];
       }
     }
   }
 
-  uint32_t nextPowerOf2(const uint32_t i) {
-    uint32_t p = 1;
-    while (i > p) {
-      p <<= 1;
+  // blackLevelAdjust(), antiVignette(), whiteBalance() and clampAndStretch() in a single pass
+  // over rawImage, same results
+  void correctRawImage() {
+    const cv::Vec3f black(blackLevel.x, blackLevel.y, blackLevel.z);
+    const cv::Vec3f blackScale(
+        1.0f / (1.0f - blackLevel.x), 1.0f / (1.0f - blackLevel.y), 1.0f / (1.0f - blackLevel.z));
+    const cv::Vec3f gain(whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z);
+    const cv::Vec3f lo(clampMin.x, clampMin.y, clampMin.z);
+    const cv::Vec3f hi(clampMax.x, clampMax.y, clampMax.z);
+    updateVignetteTables();
+    const std::vector<cv::Vec3f>& vignetteH = vignetteTableH;
+    const std::vector<cv::Vec3f>& vignetteV = vignetteTableV;
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          // The bayer pattern repeats every other column
+          const int channels[2] = {getChannelNumber(i, 0), getChannelNumber(i, 1)};
+          const cv::Vec3f& vV = vignetteV[i];
+          float* const row = rawImage.ptr<float>(i);
+          for (int j = 0; j < width; ++j) {
+            const int ch = channels[j % 2];
+            float v = row[j];
+            if (v < 1.0f) {
+              v = (v - black[ch]) * blackScale[ch];
+            }
+            v *= vignetteH[j][ch] * vV[ch];
+            v = math_util::clamp(v * gain[ch], 0.0f, 1.0f);
+            v = math_util::clamp(v, lo[ch], hi[ch]);
+            row[j] = (v - lo[ch]) / (hi[ch] - lo[ch]);
+          }
+        },
+        numThreads);
+  }
+
+  // correctRawImage() on rawImage16, gains in 12 bit fixed point
+  void correctRawImage16() {
+    const int kGainBits = 12;
+    const float kGainOne = 1 << kGainBits;
+    auto toFixed = [](const float v) {
+      return int(math_util::clamp(std::round(v * kFixedPointOne), 0.0f, kFixedPointOne));
+    };
+    const int black[3] = {toFixed(blackLevel.x), toFixed(blackLevel.y), toFixed(blackLevel.z)};
+    const cv::Vec3f blackScale(
+        1.0f / (1.0f - blackLevel.x), 1.0f / (1.0f - blackLevel.y), 1.0f / (1.0f - blackLevel.z));
+    const cv::Vec3f gain(whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z);
+    const int lo[3] = {toFixed(clampMin.x), toFixed(clampMin.y), toFixed(clampMin.z)};
+    const int hi[3] = {toFixed(clampMax.x), toFixed(clampMax.y), toFixed(clampMax.z)};
+    uint64_t stretch[3]; // 65535 / (hi - lo) in 16 bit fixed point
+    for (int ch = 0; ch < 3; ++ch) {
+      stretch[ch] = std::llround(kFixedPointOne * 65536.0 / std::max(hi[ch] - lo[ch], 1));
+    }
+    updateVignetteTables();
+    std::vector<cv::Vec<uint32_t, 3>> vignetteH(width);
+    for (int j = 0; j < width; ++j) {
+      for (int ch = 0; ch < 3; ++ch) {
+        vignetteH[j][ch] = std::lround(vignetteTableH[j][ch] * kGainOne);
+      }
+    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const int channels[2] = {getChannelNumber(i, 0), getChannelNumber(i, 1)};
+          // Saturated pixels skip the black level, as in the float pipeline
+          uint64_t rowGain[3];
+          uint64_t rowGainSaturated[3];
+          for (int ch = 0; ch < 3; ++ch) {
+            const float g = vignetteTableV[i][ch] * gain[ch] * kGainOne;
+            rowGain[ch] = std::llround(g * blackScale[ch]);
+            rowGainSaturated[ch] = std::llround(g);
+          }
+          uint16_t* const row = rawImage16.ptr<uint16_t>(i);
+          for (int j = 0; j < width; ++j) {
+            const int ch = channels[j % 2];
+            const bool isSaturated = row[j] == uint16_t(kFixedPointOne);
+            const uint64_t x = isSaturated ? row[j] : std::max(row[j] - black[ch], 0);
+            const uint64_t g = isSaturated ? rowGainSaturated[ch] : rowGain[ch];
+            const int v = int(std::min<uint64_t>(
+                (x * vignetteH[j][ch] * g) >> (2 * kGainBits), uint64_t(kFixedPointOne)));
+            const uint64_t clamped = math_util::clamp(v, lo[ch], hi[ch]) - lo[ch];
+            row[j] = uint16_t((clamped * stretch[ch]) >> 16);
+          }
+        },
+        numThreads);
+  }
+
+  // The bilinear demosaic of rawImage16 into demosaicedImage16
+  void demosaicBilinear16() {
+    demosaicedImage16.create(height, width);
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          const uint16_t* const above = rawImage16.ptr<uint16_t>(math_util::reflect(i - 1, height));
+          const uint16_t* const row = rawImage16.ptr<uint16_t>(i);
+          const uint16_t* const below = rawImage16.ptr<uint16_t>(math_util::reflect(i + 1, height));
+          const bool redGreenRow =
+              (redPixel(i, 0) && greenPixel(i, 1)) || (redPixel(i, 1) && greenPixel(i, 0));
+          cv::Vec3w* const out = demosaicedImage16.ptr<cv::Vec3w>(i);
+          for (int j = 0; j < width; ++j) {
+            const int j_1 = math_util::reflect(j - 1, width);
+            const int j1 = math_util::reflect(j + 1, width);
+            const uint16_t cross = (above[j] + below[j] + row[j_1] + row[j1] + 2) >> 2;
+            const uint16_t diagonal = (above[j_1] + above[j1] + below[j_1] + below[j1] + 2) >> 2;
+            const uint16_t vertical = (above[j] + below[j] + 1) >> 1;
+            const uint16_t horizontal = (row[j_1] + row[j1] + 1) >> 1;
+            if (redPixel(i, j)) {
+              out[j] = cv::Vec3w(row[j], cross, diagonal);
+            } else if (greenPixel(i, j)) {
+              out[j] = redGreenRow ? cv::Vec3w(horizontal, row[j], vertical)
+                                   : cv::Vec3w(vertical, row[j], horizontal);
+            } else {
+              out[j] = cv::Vec3w(diagonal, cross, row[j]);
+            }
+          }
+        },
+        numThreads);
+  }
+
+  // colorCorrect() on demosaicedImage16, the matrix in 28 bit fixed point
+  void colorCorrect16() {
+    const int kMatrixBits = 28;
+    const int64_t kLutMax = kToneCurveLutSize - 1;
+    int64_t m[3][3]; // compositeCCM takes [0, 1] to tone curve indexes, here [0, 65535]
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        m[r][c] = std::llround(compositeCCM(r, c) * double(1 << kMatrixBits) / kFixedPointOne);
+      }
     }
-    return p;
+    std::vector<cv::Vec3w> lut(kToneCurveLutSize);
+    for (int k = 0; k < kToneCurveLutSize; ++k) {
+      for (int c = 0; c < 3; ++c) {
+        lut[k][c] = cv::saturate_cast<uint16_t>(toneCurveLut[k][c] * kFixedPointOne);
+      }
+    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          cv::Vec3w* const row = demosaicedImage16.ptr<cv::Vec3w>(i);
+          for (int j = 0; j < width; ++j) {
+            const int64_t r = row[j][0];
+            const int64_t g = row[j][1];
+            const int64_t b = row[j][2];
+            for (int c = 0; c < 3; ++c) {
+              const int64_t index = (m[c][0] * r + m[c][1] * g + m[c][2] * b) >> kMatrixBits;
+              row[j][c] = lut[math_util::clamp(index, int64_t(0), kLutMax)][c];
+            }
+          }
+        },
+        numThreads);
   }
 
   void demosaic() {
-    uint32_t h2 = demosaicFilter == DemosaicFilter::FREQUENCY ? nextPowerOf2(height) : height;
-    uint32_t w2 = demosaicFilter == DemosaicFilter::FREQUENCY ? nextPowerOf2(width) : width;
+    // The frequency filter only needs sizes cv::dct() takes and is fast at, a few pixels more at
+    // most, the zeros past the image are cropped out again
+    const bool isFrequency = demosaicFilter == DemosaicFilter::FREQUENCY;
+    const int h2 = isFrequency ? isp::getOptimalDctSize(height) : height;
+    const int w2 = isFrequency ? isp::getOptimalDctSize(width) : width;
     cv::Mat_<float> r(h2, w2, 0.0f);
     cv::Mat_<float> g(h2, w2, 0.0f);
     cv::Mat_<float> b(h2, w2, 0.0f);
 
     // Break out each plane into a separate image so we can demosaicFilter
     // them separately and then recombine them.
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; j++) {
-        if (redPixel(i, j)) {
-          r(i, j) = rawImage(i, j);
-        } else if (greenPixel(i, j)) {
-          g(i, j) = rawImage(i, j);
-        } else {
-          b(i, j) = rawImage(i, j);
-        }
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; j++) {
+            if (redPixel(i, j)) {
+              r(i, j) = rawImage(i, j);
+            } else if (greenPixel(i, j)) {
+              g(i, j) = rawImage(i, j);
+            } else {
+              b(i, j) = rawImage(i, j);
+            }
+          }
+        },
+        numThreads);
 
-    if (demosaicFilter == DemosaicFilter::FREQUENCY) {
+    if (isFrequency) {
       // Move into the frequency domain
-      std::thread t1([&] { dct(r, r); });
-      std::thread t2([&] { dct(g, g); });
-      std::thread t3([&] { dct(b, b); });
-
-      t1.join();
-      t2.join();
-      t3.join();
+      for (cv::Mat_<float>* plane : {&r, &g, &b}) {
+        isp::parallelDct(*plane, false, numThreads);
+      }
 
       // Filter including sharpnning in the DCT domain
       demosaicFrequencyFilter(r, g, b);
 #undef DEBUG_DCT
 #ifndef DEBUG_DCT
       // Move back into the spatial domain
-      std::thread t4([&] { idct(r, r); });
-      std::thread t5([&] { idct(g, g); });
-      std::thread t6([&] { idct(b, b); });
-
-      t4.join();
-      t5.join();
-      t6.join();
+      for (cv::Mat_<float>* plane : {&r, &g, &b}) {
+        isp::parallelDct(*plane, true, numThreads);
+      }
 #endif
     } else if (demosaicFilter == DemosaicFilter::BILINEAR) {
       demosaicBilinearFilter(r, g, b);
@@ -1163,52 +1412,83 @@ class CameraIsp {
     }
 
     demosaicedImage = cv::Mat::zeros(height, width, CV_32F);
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; j++) {
-        demosaicedImage(i, j)[0] = r(i, j);
-        demosaicedImage(i, j)[1] = g(i, j);
-        demosaicedImage(i, j)[2] = b(i, j);
-      }
-    }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; j++) {
+            demosaicedImage(i, j)[0] = r(i, j);
+            demosaicedImage(i, j)[1] = g(i, j);
+            demosaicedImage(i, j)[2] = b(i, j);
+          }
+        },
+        numThreads);
   }
 
   void colorCorrect() {
-    const float kToneCurveLutRange = kToneCurveLutSize - 1;
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; j++) {
-        cv::Vec3f p = demosaicedImage(i, j);
 #ifdef DEBUG_DCT
-        cv::Vec3f v(
-            logf(math_util::square(p[0]) + 1.0f) * 255.0f,
-            logf(math_util::square(p[1]) + 1.0f) * 255.0f,
-            logf(math_util::square(p[2]) + 1.0f) * 255.0f);
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; j++) {
+            const cv::Vec3f p = demosaicedImage(i, j);
+            demosaicedImage(i, j) = cv::Vec3f(
+                logf(math_util::square(p[0]) + 1.0f) * 255.0f,
+                logf(math_util::square(p[1]) + 1.0f) * 255.0f,
+                logf(math_util::square(p[2]) + 1.0f) * 255.0f);
+          }
+        },
+        numThreads);
 #else
-        cv::Vec3f v(
-            toneCurveLut[math_util::clamp(
-                compositeCCM(0, 0) * p[0] + compositeCCM(0, 1) * p[1] + compositeCCM(0, 2) * p[2],
-                0.0f,
-                kToneCurveLutRange)][0],
-            toneCurveLut[math_util::clamp(
-                compositeCCM(1, 0) * p[0] + compositeCCM(1, 1) * p[1] + compositeCCM(1, 2) * p[2],
-                0.0f,
-                kToneCurveLutRange)][1],
-            toneCurveLut[math_util::clamp(
-                compositeCCM(2, 0) * p[0] + compositeCCM(2, 1) * p[1] + compositeCCM(2, 2) * p[2],
-                0.0f,
-                kToneCurveLutRange)][2]);
-#endif
-        demosaicedImage(i, j) = v;
+    const float kToneCurveLutRange = kToneCurveLutSize - 1;
+    // Out of cv::Mat, so the matrix stays in registers
+    float m[3][3];
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        m[r][c] = compositeCCM(r, c);
       }
     }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          float* const row = demosaicedImage.ptr<float>(i); // rgb interleaved
+          const int count = 3 * width;
+          // Matrix and clamp over the whole row first, a branch free loop that vectorizes, then
+          // the tone curve lookups
+          std::vector<int> indexes(count);
+          for (int j = 0; j < count; j += 3) {
+            const float r = row[j];
+            const float g = row[j + 1];
+            const float b = row[j + 2];
+            indexes[j] = int(math_util::clamp(
+                m[0][0] * r + m[0][1] * g + m[0][2] * b, 0.0f, kToneCurveLutRange));
+            indexes[j + 1] = int(math_util::clamp(
+                m[1][0] * r + m[1][1] * g + m[1][2] * b, 0.0f, kToneCurveLutRange));
+            indexes[j + 2] = int(math_util::clamp(
+                m[2][0] * r + m[2][1] * g + m[2][2] * b, 0.0f, kToneCurveLutRange));
+          }
+          for (int j = 0; j < count; j += 3) {
+            row[j] = toneCurveLut[indexes[j]][0];
+            row[j + 1] = toneCurveLut[indexes[j + 1]][1];
+            row[j + 2] = toneCurveLut[indexes[j + 2]][2];
+          }
+        },
+        numThreads);
+#endif
   }
 
   void sharpen() {
-    if (sharpening.x != 0.0 && sharpening.y != 0.0 && sharpening.z != 0.0) {
+    if (isSharpening()) {
       cv::Mat_<cv::Vec3f> lowPass(height, width);
       const isp::ReflectBoundary<int> reflectB;
       const float maxVal = 1.0f;
       isp::iirLowPass<isp::ReflectBoundary<int>, isp::ReflectBoundary<int>, cv::Vec3f>(
-          demosaicedImage, sharpeningSupport, lowPass, reflectB, reflectB, maxVal);
+          demosaicedImage, sharpeningSupport, lowPass, reflectB, reflectB, maxVal, numThreads);
       isp::sharpenWithIirLowPass<cv::Vec3f>(
           demosaicedImage,
           lowPass,
@@ -1216,18 +1496,24 @@ class CameraIsp {
           1.0f + sharpening.y,
           1.0f + sharpening.z,
           noiseCore,
-          maxVal);
+          maxVal,
+          numThreads);
     }
   }
 
  protected:
   // Replacable pipeline
   virtual void executePipeline(const bool swizzle) {
+    if (!rawImage16.empty()) { // see setFixedPoint
+      correctRawImage16();
+      removeStuckPixels();
+      demosaicBilinear16();
+      colorCorrect16();
+      return;
+    }
+
     // Apply the pipeline
-    blackLevelAdjust();
-    antiVignette();
-    whiteBalance();
-    clampAndStretch();
+    correctRawImage(); // blackLevelAdjust, antiVignette, whiteBalance, clampAndStretch
     removeStuckPixels();
     demosaic();
     colorCorrect();
@@ -1284,14 +1570,36 @@ class CameraIsp {
     const int c0 = swizzle ? 2 : 0;
     const int c1 = swizzle ? 1 : 1;
     const int c2 = swizzle ? 0 : 2;
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; j++) {
-        cv::Vec3f dp = scale * demosaicedImage(i, j);
-        outputImage(i, j)[c0] = dp[0];
-        outputImage(i, j)[c1] = dp[1];
-        outputImage(i, j)[c2] = dp[2];
-      }
+    if (!demosaicedImage16.empty()) {
+      const float scale16 = scale / kFixedPointOne;
+      parallelFor(
+          0,
+          height,
+          kIspRowsPerTask,
+          [&](const int i) {
+            for (int j = 0; j < width; j++) {
+              const cv::Vec3w& p = demosaicedImage16(i, j);
+              outputImage(i, j)[c0] = cv::saturate_cast<T>(p[0] * scale16);
+              outputImage(i, j)[c1] = cv::saturate_cast<T>(p[1] * scale16);
+              outputImage(i, j)[c2] = cv::saturate_cast<T>(p[2] * scale16);
+            }
+          },
+          numThreads);
+      return;
     }
+    parallelFor(
+        0,
+        height,
+        kIspRowsPerTask,
+        [&](const int i) {
+          for (int j = 0; j < width; j++) {
+            cv::Vec3f dp = scale * demosaicedImage(i, j);
+            outputImage(i, j)[c0] = dp[0];
+            outputImage(i, j)[c1] = dp[1];
+            outputImage(i, j)[c2] = dp[2];
+          }
+        },
+        numThreads);
   }
 }; // class CameraIsp
 }; // namespace fb360_dep
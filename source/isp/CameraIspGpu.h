@@ -0,0 +1,244 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "source/gpu/GlUtil.h"
+#include "source/isp/CameraIsp.h"
+
+namespace fb360_dep {
+
+// CameraIsp whose float pipeline runs as a single OpenGL fragment pass, for previews of many
+// cameras at interactive rates. Each fragment corrects the raw pixels around it (black level,
+// vignetting, white balance, clamp and stretch), demosaics them bilinearly, and applies the color
+// correction matrix and the tone curve. The raw image, the vignetting tables and the tone curve
+// are uploaded as float textures, the result is read back into demosaicedImage
+//
+// Requires a current OpenGL 3.3 context (e.g. an offscreen GlWindow) on the calling thread
+// Matches the CPU pipeline to float rounding, except on the last row and column where the CPU
+// demosaic reads values it already interpolated. Sharpening stays on the CPU, stuck pixels are
+// removed on the CPU before the pass, other demosaic filters and the fixed point pipeline run
+// entirely on the CPU
+class CameraIspGpu : public CameraIsp {
+ public:
+  explicit CameraIspGpu(const std::string& jsonInput) : CameraIsp(jsonInput) {}
+
+  ~CameraIspGpu() {
+    if (program) {
+      glDeleteProgram(program);
+      glDeleteFramebuffers(1, &fbo);
+    }
+  }
+
+  CameraIspGpu(const CameraIspGpu&) = delete;
+  CameraIspGpu& operator=(const CameraIspGpu&) = delete;
+
+ protected:
+  void executePipeline(const bool swizzle) override {
+    if (!rawImage16.empty() || demosaicFilter != DemosaicFilter::BILINEAR) {
+      CameraIsp::executePipeline(swizzle);
+      return;
+    }
+
+    const bool isCorrected = stuckPixelRadius / 2 > 0 && stuckPixelThreshold > 0;
+    if (isCorrected) {
+      correctRawImage();
+      removeStuckPixels();
+    }
+    render(isCorrected);
+    sharpen();
+  }
+
+ private:
+  static GLuint createFloatTexture(
+      const int width,
+      const int height,
+      const void* data,
+      const GLenum internalFormat,
+      const GLenum format) {
+    GLuint texture = createTexture(GL_TEXTURE_2D);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, data);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return texture;
+  }
+
+  static GLuint createTableTexture(const std::vector<cv::Vec3f>& table) {
+    return createFloatTexture(table.size(), 1, table.data(), GL_RGB32F, GL_RGB);
+  }
+
+  void initialize() {
+    const std::string fs = R"(
+      #version 330 core
+
+      uniform sampler2D raw;
+      uniform sampler2D vignetteH; // vignetteTableH, width x 1
+      uniform sampler2D vignetteV; // vignetteTableV, height x 1
+      uniform sampler2D toneCurve; // toneCurveLut, kToneCurveLutSize x 1
+      uniform bool isCorrected; // raw already went through correctRawImage()
+      uniform int bayer[4]; // channel of (i % 2, j % 2)
+      uniform ivec2 size;
+      uniform vec3 black;
+      uniform vec3 blackScale;
+      uniform vec3 gain;
+      uniform vec3 lo;
+      uniform vec3 hi;
+      uniform mat3 ccm; // compositeCCM
+      uniform float toneCurveRange;
+
+      out vec4 color;
+
+      int channel(ivec2 p) {
+        return bayer[(p.y % 2) * 2 + p.x % 2];
+      }
+
+      int reflectIndex(int x, int r) {
+        return x < 0 ? -x : x >= r ? 2 * r - x - 1 : x;
+      }
+
+      // correctRawImage()
+      float corrected(ivec2 p) {
+        float v = texelFetch(raw, p, 0).r;
+        if (isCorrected) {
+          return v;
+        }
+        int ch = channel(p);
+        if (v < 1.0) {
+          v = (v - black[ch]) * blackScale[ch];
+        }
+        v *= texelFetch(vignetteH, ivec2(p.x, 0), 0)[ch] *
+             texelFetch(vignetteV, ivec2(p.y, 0), 0)[ch];
+        v = clamp(v * gain[ch], 0.0, 1.0);
+        v = clamp(v, lo[ch], hi[ch]);
+        return (v - lo[ch]) / (hi[ch] - lo[ch]);
+      }
+
+      // Plane ch of demosaic() at (i, j) reflected, zero where another color was sensed
+      float plane(int ch, int i, int j) {
+        ivec2 p = ivec2(reflectIndex(j, size.x), reflectIndex(i, size.y));
+        return channel(p) == ch ? corrected(p) : 0.0;
+      }
+
+      // demosaicBilinearFilter()
+      float crossAverage(int ch, int i, int j) {
+        return 0.25 * (plane(ch, i - 1, j) + plane(ch, i + 1, j) +
+                       plane(ch, i, j - 1) + plane(ch, i, j + 1));
+      }
+
+      float diagonalAverage(int ch, int i, int j) {
+        return 0.25 * (plane(ch, i - 1, j - 1) + plane(ch, i + 1, j - 1) +
+                       plane(ch, i - 1, j + 1) + plane(ch, i + 1, j + 1));
+      }
+
+      float verticalAverage(int ch, int i, int j) {
+        return (plane(ch, i - 1, j) + plane(ch, i + 1, j)) / 2.0;
+      }
+
+      float horizontalAverage(int ch, int i, int j) {
+        return (plane(ch, i, j - 1) + plane(ch, i, j + 1)) / 2.0;
+      }
+
+      void main() {
+        int i = int(gl_FragCoord.y);
+        int j = int(gl_FragCoord.x);
+        float v = corrected(ivec2(j, i));
+        vec3 rgb;
+        int ch = channel(ivec2(j, i));
+        if (ch == 0) {
+          rgb = vec3(v, crossAverage(1, i, j), diagonalAverage(2, i, j));
+        } else if (ch == 2) {
+          rgb = vec3(diagonalAverage(0, i, j), crossAverage(1, i, j), v);
+        } else if (channel(ivec2(0, i)) == 0 || channel(ivec2(1, i)) == 0) {
+          rgb = vec3(horizontalAverage(0, i, j), v, verticalAverage(2, i, j));
+        } else {
+          rgb = vec3(verticalAverage(0, i, j), v, horizontalAverage(2, i, j));
+        }
+
+        // colorCorrect()
+        ivec3 index = ivec3(clamp(ccm * rgb, 0.0, toneCurveRange));
+        color = vec4(
+            texelFetch(toneCurve, ivec2(index.r, 0), 0).r,
+            texelFetch(toneCurve, ivec2(index.g, 0), 0).g,
+            texelFetch(toneCurve, ivec2(index.b, 0), 0).b,
+            1);
+      }
+    )";
+    program = fb360_dep::createProgram(fullscreenVertexShader(), fs);
+    GLint prevFbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    fbo = createFramebuffer();
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+  }
+
+  void render(const bool isCorrected) {
+    if (!program) {
+      initialize();
+    }
+    updateVignetteTables();
+    const GLuint raw = createFloatTexture(width, height, rawImage.data, GL_R32F, GL_RED);
+    const GLuint vignetteH = createTableTexture(vignetteTableH);
+    const GLuint vignetteV = createTableTexture(vignetteTableV);
+    const GLuint toneCurve = createTableTexture(toneCurveLut);
+    const GLuint target = createFloatTexture(width, height, nullptr, GL_RGBA32F, GL_RGBA);
+
+    glUseProgram(program);
+    connectUnitWith2DTextureAndUniform(0, raw, program, "raw");
+    connectUnitWith2DTextureAndUniform(1, vignetteH, program, "vignetteH");
+    connectUnitWith2DTextureAndUniform(2, vignetteV, program, "vignetteV");
+    connectUnitWith2DTextureAndUniform(3, toneCurve, program, "toneCurve");
+    setUniform(program, "isCorrected", isCorrected);
+    GLint bayer[4];
+    for (int i = 0; i < 2; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        bayer[i * 2 + j] = getChannelNumber(i, j);
+      }
+    }
+    glUniform1iv(getUniformLocation(program, "bayer"), 4, bayer);
+    glUniform2i(getUniformLocation(program, "size"), width, height);
+    const cv::Point3f blackScale(
+        1.0f / (1.0f - blackLevel.x), 1.0f / (1.0f - blackLevel.y), 1.0f / (1.0f - blackLevel.z));
+    for (const auto& uniform : {std::make_pair("black", blackLevel),
+                                std::make_pair("blackScale", blackScale),
+                                std::make_pair("gain", whiteBalanceGain),
+                                std::make_pair("lo", clampMin),
+                                std::make_pair("hi", clampMax)}) {
+      const cv::Point3f& p = uniform.second;
+      glUniform3f(getUniformLocation(program, uniform.first), p.x, p.y, p.z);
+    }
+    const cv::Mat_<float> ccm = compositeCCM.isContinuous() ? compositeCCM : compositeCCM.clone();
+    glUniformMatrix3fv(getUniformLocation(program, "ccm"), 1, GL_TRUE, ccm.ptr<float>());
+    setUniform(program, "toneCurveRange", float(kToneCurveLutSize - 1));
+
+    GLint prevFbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    glViewport(0, 0, width, height);
+    fullscreen(program);
+
+    demosaicedImage.create(height, width);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, demosaicedImage.data);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+
+    for (const GLuint texture : {raw, vignetteH, vignetteV, toneCurve, target}) {
+      glDeleteTextures(1, &texture);
+    }
+  }
+
+  GLuint program = 0;
+  GLuint fbo = 0;
+};
+
+} // namespace fb360_dep
@@ -5,16 +5,24 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <map>
+#include <utility>
+#include <vector>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "source/util/AsyncWriter.h"
 #include "source/util/CvUtil.h"
+#include "source/util/FilesystemUtil.h"
+#include "source/util/MathUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 
 const std::string kUsageMessage = R"(
-   - Correct vignetting in a single image.
+   - Correct vignetting in a single image, or in every image of a directory.
 
    - Example:
      ./CorrectVignetting \
@@ -26,60 +34,23 @@ const std::string kUsageMessage = R"(
      --vignetting_y="1.5,1.0,1.0,1.0,1.0,1.5"
  )";
 
-DEFINE_string(out, "", "path to output image");
+DEFINE_string(out, "", "path to output image, or output directory if raw is a directory");
 DEFINE_double(principal_x, -1, "principal x-coord (< 0 = width / 2)");
 DEFINE_double(principal_y, -1, "principal y-coord (< 0 = height / 2)");
-DEFINE_string(raw, "", "path to raw image");
+DEFINE_string(raw, "", "path to raw image, or a directory of raw images");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_string(vignetting_x, "", "x-axis comma-separated vignetting values");
 DEFINE_string(vignetting_y, "", "y-axis comma-separated vignetting values");
+DEFINE_int32(writer_threads, 2, "threads writing the output images (0 = none)");
 
-float* vignettingTableX = 0;
-float* vignettingTableY = 0;
-
-template <typename T>
-inline T clamp(const T& x, const T& a, const T& b) {
-  return x < a ? a : x > b ? b : x;
-}
-
-template <typename V, typename T>
-inline V lerp(const V x0, const V x1, const T alpha) {
-  return x0 * (T(1) - alpha) + x1 * alpha;
-}
-
-template <typename T>
-inline T lerp(const T x0, const T x1, const T alpha) {
-  return x0 * (T(1) - alpha) + x1 * alpha;
-}
-
-template <typename T, typename V>
-class BezierCurve {
- protected:
-  std::vector<V> points_;
-
- public:
-  BezierCurve() {}
-
-  BezierCurve(std::vector<V> points) {
-    for (auto p : points) {
-      points_.push_back(p);
-    }
-  }
+const int kRowsPerTask = 16;
+const int kWriteQueueSize = 4; // images
 
-  void addPoint(const V p) {
-    points_.push_back(p);
-  }
-
-  void clearPoints() {
-    points_.clear();
-  }
-
-  inline V operator()(const int i, const int j, const T t) const {
-    return (i == j) ? points_[i] : lerp((*this)(i, j - 1, t), (*this)(i + 1, j, t), t);
-  }
-
-  inline V operator()(const T t) const {
-    return (*this)(0, points_.size() - 1, t);
-  }
+// Gain of every column and row, the principal point shift included, so correcting a pixel is a
+// single multiply by its column's and its row's gain
+struct VignettingTables {
+  std::vector<float> x;
+  std::vector<float> y;
 };
 
 void initGflags(int& argc, char**& argv) {
@@ -118,19 +89,16 @@ void getBezierCenterShift(int& bezierShiftX, int& bezierShiftY, const int width,
   bezierShiftY = principalY - height / 2;
 }
 
-void buildVignettingTables(const int width, const int height) {
-  LOG(INFO) << "Pre-computing vignetting tables...";
-
-  // NOTE: These tables only need to be computed once, and can then be applied
-  // to all input images
-  vignettingTableX = new float[width];
-  vignettingTableY = new float[height];
+// NOTE: These tables only need to be computed once per image size, and can then be applied to
+// all input images of that size
+VignettingTables buildVignettingTables(const int width, const int height) {
+  LOG(INFO) << "Pre-computing vignetting tables for " << width << "x" << height << "...";
 
   // Build Bezier X and Y curves
   // NOTE: The more anchor points the Bezier curve has the slower it will be,
   // since it has to interpolate between anchor points
-  BezierCurve<float, float> vignetteCurveX(splitString(FLAGS_vignetting_x));
-  BezierCurve<float, float> vignetteCurveY(splitString(FLAGS_vignetting_y));
+  const math_util::BezierCurve<float, float> vignetteCurveX(splitString(FLAGS_vignetting_x));
+  const math_util::BezierCurve<float, float> vignetteCurveY(splitString(FLAGS_vignetting_y));
 
   // Bezier template is circular and centered at the center of the image, so we
   // need to shift smallest dimension by (max dimension - min dimension) / 2
@@ -145,21 +113,50 @@ void buildVignettingTables(const int width, const int height) {
     maxDimension = height;
   }
 
+  // Center of Bezier is shifted by the distance of the principal to the image
+  // center
+  int bezierShiftX;
+  int bezierShiftY;
+  getBezierCenterShift(bezierShiftX, bezierShiftY, width, height);
+
+  VignettingTables tables;
+  for (int x = 0; x < width; ++x) {
+    const int xx = math_util::clamp(x + bezierShiftX, 0, width - 1);
+    tables.x.push_back(vignetteCurveX((xx + dX) / float(maxDimension)));
+  }
   for (int y = 0; y < height; ++y) {
-    vignettingTableY[y] = vignetteCurveY((y + dY) / float(maxDimension));
-    for (int x = 0; x < width; ++x) {
-      vignettingTableX[x] = vignetteCurveX((x + dX) / float(maxDimension));
-    }
+    const int yy = math_util::clamp(y + bezierShiftY, 0, height - 1);
+    tables.y.push_back(vignetteCurveY((yy + dY) / float(maxDimension)));
   }
+  return tables;
+}
+
+// Rows in parallel bands, each row a multiply by the column gains the compiler vectorizes
+void correctVignetting(cv::Mat_<float>& image, const VignettingTables& tables) {
+  parallelFor(
+      0,
+      image.rows,
+      kRowsPerTask,
+      [&](const int y) {
+        float* const row = image.ptr<float>(y);
+        const float* const gainX = tables.x.data();
+        const float gainY = tables.y[y];
+        for (int x = 0; x < image.cols; ++x) {
+          row[x] *= gainX[x] * gainY;
+        }
+      },
+      FLAGS_threads);
 }
 
 // Load raw image
 // NOTE: loading grayscale to simulate one of the color channels
 // NOTE: the exact same process would be applied to all the channels (same
 // vignetting curve)
-cv::Mat_<float> loadImage(const std::string& fn) {
-  cv::Mat raw = cv::imread(fn, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
-  CHECK(!raw.empty()) << "Failed to load image";
+cv::Mat_<float> loadImage(const filesystem::path& fn) {
+  cv::Mat raw = cv::imread(fn.string(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+  if (raw.empty()) {
+    return cv::Mat_<float>();
+  }
 
   // Convert 16-bit to 32-bit floating point in range [0..1]
   cv::Mat_<float> output;
@@ -170,31 +167,47 @@ cv::Mat_<float> loadImage(const std::string& fn) {
 int main(int argc, char** argv) {
   system_util::initDep(argc, argv, kUsageMessage);
 
-  cv::Mat_<float> image = loadImage(FLAGS_raw);
-  const int width = image.cols;
-  const int height = image.rows;
-
-  // Pre-compute vignetting tables
-  buildVignettingTables(width, height);
-
-  // Center of Bezier is shifted by the distance of the principal to the image
-  // center
-  int bezierShiftX;
-  int bezierShiftY;
-  getBezierCenterShift(bezierShiftX, bezierShiftY, width, height);
+  CHECK_NE(FLAGS_raw, "");
+  CHECK_NE(FLAGS_out, "");
 
-  // Apply vignetting correction
-  LOG(INFO) << "Applying vignetting correction...";
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      const int xx = clamp(x + bezierShiftX, 0, width - 1);
-      const int yy = clamp(y + bezierShiftY, 0, height - 1);
-      image(y, x) *= vignettingTableX[xx] * vignettingTableY[yy];
+  // Input and output paths
+  std::vector<std::pair<filesystem::path, filesystem::path>> jobs;
+  const bool isDirectory = filesystem::is_directory(FLAGS_raw);
+  if (isDirectory) {
+    filesystem::create_directories(FLAGS_out);
+    for (const filesystem::path& raw : filesystem::getVisibleFilesSorted(FLAGS_raw)) {
+      jobs.emplace_back(raw, filesystem::path(FLAGS_out) / raw.filename());
     }
+  } else {
+    jobs.emplace_back(FLAGS_raw, FLAGS_out);
   }
 
-  // Save corrected image
-  cv::imwrite(FLAGS_out, 255.0f * image);
+  // Images are loaded and corrected while the previous ones are written
+  std::map<std::pair<int, int>, VignettingTables> tablesBySize;
+  AsyncWriter writer(FLAGS_writer_threads, kWriteQueueSize);
+  for (const auto& job : jobs) {
+    cv::Mat_<float> image = loadImage(job.first);
+    if (image.empty()) {
+      CHECK(isDirectory) << "Failed to load image";
+      LOG(WARNING) << "Skipping " << job.first << ", not an image";
+      continue;
+    }
+    const std::pair<int, int> size(image.cols, image.rows);
+    auto tables = tablesBySize.find(size);
+    if (tables == tablesBySize.end()) {
+      tables = tablesBySize.emplace(size, buildVignettingTables(size.first, size.second)).first;
+    }
+
+    // Apply vignetting correction
+    LOG(INFO) << "Applying vignetting correction to " << job.first << "...";
+    correctVignetting(image, tables->second);
+
+    // Save corrected image
+    const cv::Mat output = 255.0f * image;
+    const filesystem::path out = job.second;
+    writer.write([out, output] { cv_util::imwriteExceptionOnFail(out, output); });
+  }
+  writer.flush();
 
   return EXIT_SUCCESS;
 }
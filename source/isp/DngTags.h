@@ -29,6 +29,10 @@ const uint16_t kTiffTypeSRATIONAL = 10;
 const uint16_t kTiffTypeFLOAT = 11;
 const uint16_t kTiffTypeDOUBLE = 12;
 
+// Compression values
+const uint16_t kTiffCompressionNone = 1;
+const uint16_t kTiffCompressionJpeg = 7; // lossless jpeg in a dng
+
 // Tag values
 const uint16_t kTiffTagNewSubFileType = 254;
 const uint16_t kTiffTagImageWidth = 256;
@@ -47,6 +51,10 @@ const uint16_t kTiffTagPlanarConfiguration = 284;
 const uint16_t kTiffTagResolutionUnit = 296;
 const uint16_t kTiffTagSoftware = 305;
 const uint16_t kTiffTagDateTime = 306;
+const uint16_t kTiffTagTileWidth = 322;
+const uint16_t kTiffTagTileLength = 323;
+const uint16_t kTiffTagTileOffsets = 324;
+const uint16_t kTiffTagTileByteCounts = 325;
 
 const uint16_t kTiffEpTagCFARepeatPatternDim = 33421;
 const uint16_t kTiffEpTagCFAPattern = 33422;
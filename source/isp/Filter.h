@@ -7,7 +7,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
 #include "source/util/MathUtil.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace isp {
@@ -29,9 +37,13 @@ struct ReflectBoundary {
   }
 };
 
+const int kIirRowsPerTask = 16;
+const int kIirColumnsPerBlock = 16;
+
 // Implements a two-tap IIR low pass filter
+// Reference implementation, one pixel at a time
 template <typename H, typename V, typename P>
-void iirLowPass(
+void iirLowPassReference(
     const cv::Mat_<P>& inputImage,
     const float amount,
     cv::Mat_<P>& lpImage,
@@ -50,11 +62,17 @@ void iirLowPass(
       v = math_util::lerp(ip, v, alpha);
       buffer(hBoundary(j - 1, lpImage.cols), 0) = v;
     }
+    // Samples are stored one index early, so unless the boundary wraps the first one to the last
+    // index, nothing is stored there. Use the last sample rather than what the buffer held before
+    if (hBoundary(-1, lpImage.cols) != lpImage.cols - 1) {
+      buffer(lpImage.cols - 1, 0) = v;
+    }
 
     // Anticausal pass
     v = buffer(0, 0);
-    for (int j = lpImage.cols - 1; j >= 0; --j) {
-      cv::Vec3f ip(buffer(math_util::wrap(j, lpImage.cols), 0));
+    // Down to -1 like the vertical pass, or the first column is never written
+    for (int j = lpImage.cols - 1; j >= -1; --j) {
+      cv::Vec3f ip(buffer(math_util::reflect(j, lpImage.cols), 0));
       v = math_util::lerp(ip, v, alpha);
       lpImage(i, hBoundary(j + 1, lpImage.cols))[0] = math_util::clamp(v[0], 0.0f, maxVal);
       lpImage(i, hBoundary(j + 1, lpImage.cols))[1] = math_util::clamp(v[1], 0.0f, maxVal);
@@ -71,6 +89,9 @@ void iirLowPass(
       v = math_util::lerp(ip, v, alpha);
       buffer(vBoundary(i - 1, lpImage.rows), 0) = v;
     }
+    if (vBoundary(-1, lpImage.rows) != lpImage.rows - 1) {
+      buffer(lpImage.rows - 1, 0) = v;
+    }
     // Anticausal pass
     v = buffer(lpImage.rows - 2, 0);
     for (int i = lpImage.rows - 1; i >= -1; --i) {
@@ -83,6 +104,96 @@ void iirLowPass(
   }
 }
 
+// Same as iirLowPassReference, for pixels of floats
+// The horizontal pass filters rows in parallel. The vertical pass filters blocks of columns in
+// parallel, stepping all the columns of a block through the image a row at a time, so each step
+// is a run of contiguous floats the compiler vectorizes rather than a single pixel
+template <typename H, typename V, typename P>
+void iirLowPass(
+    const cv::Mat_<P>& inputImage,
+    const float amount,
+    cv::Mat_<P>& lpImage,
+    const H& hBoundary,
+    const V& vBoundary,
+    const float maxVal = 255.0f,
+    const int numThreads = -1) {
+  static_assert(std::is_same<typename P::value_type, float>::value, "pixels must be floats");
+  constexpr int kChannels = P::channels;
+  const float alpha = powf(amount, 1.0f / 4.0f);
+  const int rows = lpImage.rows;
+  const int cols = lpImage.cols;
+
+  // Horizontal pass
+  parallelFor(
+      0,
+      rows,
+      kIirRowsPerTask,
+      [&](const int i) {
+        std::vector<P> buffer(cols);
+
+        // Causal pass
+        P v(inputImage(i, cols - 1));
+        for (int j = 0; j < cols; ++j) {
+          v = math_util::lerp(inputImage(i, j), v, alpha);
+          buffer[hBoundary(j - 1, cols)] = v;
+        }
+        if (hBoundary(-1, cols) != cols - 1) {
+          buffer[cols - 1] = v; // as in iirLowPassReference
+        }
+
+        // Anticausal pass
+        v = buffer[0];
+        for (int j = cols - 1; j >= -1; --j) {
+          v = math_util::lerp(buffer[math_util::reflect(j, cols)], v, alpha);
+          P& lp = lpImage(i, hBoundary(j + 1, cols));
+          for (int c = 0; c < kChannels; ++c) {
+            lp[c] = math_util::clamp(v[c], 0.0f, maxVal);
+          }
+        }
+      },
+      numThreads);
+
+  // Vertical pass
+  const int numBlocks = (cols + kIirColumnsPerBlock - 1) / kIirColumnsPerBlock;
+  parallelFor(
+      0,
+      numBlocks,
+      1,
+      [&, alpha, maxVal](const int block) { // copies, or every store could alias them
+        const int begin = block * kIirColumnsPerBlock;
+        const int n = (std::min(begin + kIirColumnsPerBlock, cols) - begin) * kChannels;
+        auto row = [&](const int i) { return reinterpret_cast<float*>(&lpImage(i, begin)); };
+        std::vector<float> buffer(rows * n);
+        float v[kIirColumnsPerBlock * kChannels]; // on the stack, so it cannot alias the images
+        std::copy_n(row(1), n, v);
+
+        // Causal pass
+        for (int i = 0; i < rows; ++i) {
+          const float* const ip = row(i);
+          float* const out = &buffer[vBoundary(i - 1, rows) * n];
+          for (int k = 0; k < n; ++k) {
+            v[k] = math_util::lerp(ip[k], v[k], alpha);
+            out[k] = v[k];
+          }
+        }
+        if (vBoundary(-1, rows) != rows - 1) {
+          std::copy_n(v, n, &buffer[(rows - 1) * n]);
+        }
+
+        // Anticausal pass
+        std::copy_n(&buffer[(rows - 2) * n], n, v);
+        for (int i = rows - 1; i >= -1; --i) {
+          const float* const ip = &buffer[math_util::reflect(i, rows) * n];
+          float* const out = row(vBoundary(i + 1, rows));
+          for (int k = 0; k < n; ++k) {
+            v[k] = math_util::lerp(ip[k], v[k], alpha);
+            out[k] = std::min(std::max(v[k], 0.0f), maxVal); // math_util::clamp won't vectorize
+          }
+        }
+      },
+      numThreads);
+}
+
 template <typename T>
 void sharpenWithIirLowPass(
     cv::Mat_<T>& inputImage,
@@ -91,29 +202,85 @@ void sharpenWithIirLowPass(
     const float gAmount,
     const float bAmount,
     const float noiseCore = 100.0f,
-    const float maxVal = 255.0f) {
-  // Iir unsharp mask with noise coring
-  for (int i = 0; i < inputImage.rows; ++i) {
-    for (int j = 0; j < inputImage.cols; ++j) {
-      const cv::Vec3f lp = lpImage(i, j);
-      T& p = inputImage(i, j);
-
-      // High pass signal - just the residual of the low pass
-      // subtracted from the original signal.
-      const cv::Vec3f hp(p[0] - lp[0], p[1] - lp[1], p[2] - lp[2]);
-
-      // Noise coring
-      const cv::Vec3f ng(
-          1.0f - expf(-(math_util::square(hp[0]) * noiseCore)),
-          1.0f - expf(-(math_util::square(hp[1]) * noiseCore)),
-          1.0f - expf(-(math_util::square(hp[2]) * noiseCore)));
-
-      // Unsharp mask with coring
-      p[0] = math_util::clamp(lp[0] + hp[0] * ng[0] * rAmount, 0.0f, maxVal);
-      p[1] = math_util::clamp(lp[1] + hp[1] * ng[1] * gAmount, 0.0f, maxVal);
-      p[2] = math_util::clamp(lp[2] + hp[2] * ng[2] * bAmount, 0.0f, maxVal);
-    }
-  }
+    const float maxVal = 255.0f,
+    const int numThreads = -1) {
+  // Iir unsharp mask with noise coring, rows in parallel
+  parallelFor(
+      0,
+      inputImage.rows,
+      kIirRowsPerTask,
+      [&](const int i) {
+        for (int j = 0; j < inputImage.cols; ++j) {
+          const cv::Vec3f lp = lpImage(i, j);
+          T& p = inputImage(i, j);
+
+          // High pass signal - just the residual of the low pass
+          // subtracted from the original signal.
+          const cv::Vec3f hp(p[0] - lp[0], p[1] - lp[1], p[2] - lp[2]);
+
+          // Noise coring
+          const cv::Vec3f ng(
+              1.0f - expf(-(math_util::square(hp[0]) * noiseCore)),
+              1.0f - expf(-(math_util::square(hp[1]) * noiseCore)),
+              1.0f - expf(-(math_util::square(hp[2]) * noiseCore)));
+
+          // Unsharp mask with coring
+          p[0] = math_util::clamp(lp[0] + hp[0] * ng[0] * rAmount, 0.0f, maxVal);
+          p[1] = math_util::clamp(lp[1] + hp[1] * ng[1] * gAmount, 0.0f, maxVal);
+          p[2] = math_util::clamp(lp[2] + hp[2] * ng[2] * bAmount, 0.0f, maxVal);
+        }
+      },
+      numThreads);
+}
+
+const int kDctRowsPerTask = 64;
+
+// Smallest size >= n cv::dct() is fast at. It only takes even sizes, and computes a dct of size n
+// from a dft of size n / 2
+inline int getOptimalDctSize(const int n) {
+  return 2 * cv::getOptimalDFTSize((n + 1) / 2);
+}
+
+// Same as cv::dct(plane, plane, inverse ? cv::DCT_INVERSE : 0), on all the threads
+// The 2D dct is separable: transform the rows in parallel blocks of kDctRowsPerTask, then the
+// columns as the rows of the transpose. Every block fits in cache, unlike the column pass of
+// cv::dct(), which walks down the whole plane. Sizes must be even, see getOptimalDctSize()
+inline void parallelDct(cv::Mat_<float>& plane, const bool inverse, const int numThreads = -1) {
+  const int flags = cv::DCT_ROWS | (inverse ? cv::DCT_INVERSE : 0);
+  auto blockRows = [](const int block, const int rows) {
+    return cv::Range(block * kDctRowsPerTask, std::min((block + 1) * kDctRowsPerTask, rows));
+  };
+  auto blockCount = [](const int rows) {
+    return (rows + kDctRowsPerTask - 1) / kDctRowsPerTask;
+  };
+  auto dctRows = [&](cv::Mat_<float>& m) {
+    parallelFor(
+        0,
+        blockCount(m.rows),
+        1,
+        [&](const int block) {
+          cv::Mat rows = m.rowRange(blockRows(block, m.rows));
+          cv::dct(rows, rows, flags);
+        },
+        numThreads);
+  };
+  auto transpose = [&](const cv::Mat_<float>& src, cv::Mat_<float>& dst) {
+    parallelFor(
+        0,
+        blockCount(src.rows),
+        1,
+        [&](const int block) {
+          const cv::Range range = blockRows(block, src.rows);
+          cv::Mat cols = dst.colRange(range); // right size already, written in place
+          cv::transpose(src.rowRange(range), cols);
+        },
+        numThreads);
+  };
+  cv::Mat_<float> transposed(plane.cols, plane.rows);
+  dctRows(plane);
+  transpose(plane, transposed);
+  dctRows(transposed);
+  transpose(transposed, plane);
 }
 
 } // namespace isp
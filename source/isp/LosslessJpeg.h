@@ -0,0 +1,248 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace fb360_dep {
+namespace isp {
+
+// Lossless jpeg (ITU T.81 annex H), the lossless compression of dng raw images
+// A bayer tile of width x height is coded as width / 2 columns of two interleaved components, as
+// the dng sdk does, so every pixel is predicted from the pixel of the same color to its left, or
+// above it at the start of a row. Each tile gets the optimal huffman table for its differences
+class LosslessJpegEncoder {
+ public:
+  // pixels are height rows of width, stride elements apart. width must be even
+  template <typename T>
+  static std::vector<uint8_t> encode(
+      const T* const pixels,
+      const int width,
+      const int height,
+      const int stride,
+      const int precision) {
+    CHECK_EQ(width % 2, 0);
+    CHECK(2 <= precision && precision <= 16) << "bad precision " << precision;
+    const int kComponents = 2;
+
+    // Differences to their predictions, and their counts by category for the huffman table
+    std::vector<int> diffs(width * height);
+    std::array<int, kCategories + 1> counts = {}; // plus the reserved code, see huffmanTable()
+    for (int i = 0; i < height; ++i) {
+      const T* const row = pixels + i * stride;
+      for (int j = 0; j < width; ++j) {
+        const int prediction = j >= kComponents
+            ? row[j - kComponents]
+            : i > 0 ? row[j - stride] : 1 << (precision - 1);
+        // Modulo 2^16, in [-32768, 32767]
+        const int diff = int16_t(uint16_t(row[j] - prediction));
+        diffs[i * width + j] = diff;
+        ++counts[category(diff)];
+      }
+    }
+    counts[kCategories] = 1;
+    std::array<uint8_t, 16> lengthCounts;
+    std::vector<uint8_t> symbols;
+    huffmanTable(counts, lengthCounts, symbols);
+
+    std::vector<uint8_t> out;
+    putMarker(out, 0xd8); // start of image
+
+    putMarker(out, 0xc3); // lossless frame
+    putShort(out, 8 + 3 * kComponents);
+    out.push_back(precision);
+    putShort(out, height);
+    putShort(out, width / kComponents);
+    out.push_back(kComponents);
+    for (int c = 0; c < kComponents; ++c) {
+      out.push_back(c); // id
+      out.push_back(0x11); // sampling factors
+      out.push_back(0); // no quantization table
+    }
+
+    putMarker(out, 0xc4); // huffman table
+    putShort(out, 2 + 1 + 16 + symbols.size());
+    out.push_back(0); // dc table 0
+    out.insert(out.end(), lengthCounts.begin(), lengthCounts.end());
+    out.insert(out.end(), symbols.begin(), symbols.end());
+
+    putMarker(out, 0xda); // start of scan
+    putShort(out, 6 + 2 * kComponents);
+    out.push_back(kComponents);
+    for (int c = 0; c < kComponents; ++c) {
+      out.push_back(c);
+      out.push_back(0); // huffman table 0
+    }
+    out.push_back(1); // predictor: left
+    out.push_back(0);
+    out.push_back(0); // no point transform
+
+    // Canonical codes, T.81 annex C
+    std::array<uint16_t, kCategories> codes = {};
+    std::array<uint8_t, kCategories> lengths = {};
+    uint16_t code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; ++length, code <<= 1) {
+      for (int n = 0; n < lengthCounts[length - 1]; ++n, ++k, ++code) {
+        codes[symbols[k]] = code;
+        lengths[symbols[k]] = length;
+      }
+    }
+
+    BitWriter bits(out);
+    for (const int diff : diffs) {
+      const int c = category(diff);
+      bits.put(codes[c], lengths[c]);
+      if (0 < c && c < 16) { // category 16 is 32768, with no extra bits
+        bits.put(diff < 0 ? diff - 1 : diff, c);
+      }
+    }
+    bits.flush();
+
+    putMarker(out, 0xd9); // end of image
+    return out;
+  }
+
+ private:
+  static const int kCategories = 17; // differences of 0 to 16 bits
+
+  static int category(const int diff) {
+    int magnitude = diff < 0 ? -diff : diff;
+    int bits = 0;
+    while (magnitude) {
+      magnitude >>= 1;
+      ++bits;
+    }
+    return bits;
+  }
+
+  // Code lengths of at most 16 bits from the counts of the categories, T.81 annex K.2
+  // counts has one more entry, a reserved code that keeps every other code from being all ones
+  static void huffmanTable(
+      std::array<int, kCategories + 1> counts,
+      std::array<uint8_t, 16>& lengthCounts,
+      std::vector<uint8_t>& symbols) {
+    const int kSymbols = kCategories + 1;
+    std::array<int, kSymbols> codeSize = {};
+    std::array<int, kSymbols> others;
+    others.fill(-1);
+    while (true) {
+      // The two least frequent, the higher symbol first on ties so the reserved one is deepest
+      int v1 = -1;
+      int v2 = -1;
+      for (int v = 0; v < kSymbols; ++v) {
+        if (counts[v] > 0 && (v1 < 0 || counts[v] <= counts[v1])) {
+          v1 = v;
+        }
+      }
+      for (int v = 0; v < kSymbols; ++v) {
+        if (v != v1 && counts[v] > 0 && (v2 < 0 || counts[v] <= counts[v2])) {
+          v2 = v;
+        }
+      }
+      if (v2 < 0) {
+        break;
+      }
+      counts[v1] += counts[v2];
+      counts[v2] = 0;
+      for (++codeSize[v1]; others[v1] >= 0; ++codeSize[v1]) {
+        v1 = others[v1];
+      }
+      others[v1] = v2;
+      for (++codeSize[v2]; others[v2] >= 0; ++codeSize[v2]) {
+        v2 = others[v2];
+      }
+    }
+
+    std::array<int, kSymbols + 1> bits = {}; // codes by length, a tree of 18 can be 17 deep
+    for (int v = 0; v < kSymbols; ++v) {
+      ++bits[codeSize[v]];
+    }
+    bits[0] = 0;
+    for (int i = kSymbols; i > 16; --i) {
+      while (bits[i] > 0) {
+        int j = i - 2;
+        while (bits[j] == 0) {
+          --j;
+        }
+        bits[i] -= 2;
+        ++bits[i - 1];
+        bits[j + 1] += 2;
+        --bits[j];
+      }
+    }
+    int longest = 16;
+    while (bits[longest] == 0) {
+      --longest;
+    }
+    --bits[longest]; // the reserved code
+    for (int i = 0; i < 16; ++i) {
+      lengthCounts[i] = bits[i + 1];
+    }
+
+    symbols.clear();
+    for (int size = 1; size <= kSymbols; ++size) {
+      for (int v = 0; v < kCategories; ++v) {
+        if (codeSize[v] == size) {
+          symbols.push_back(v);
+        }
+      }
+    }
+  }
+
+  static void putMarker(std::vector<uint8_t>& out, const uint8_t marker) {
+    out.push_back(0xff);
+    out.push_back(marker);
+  }
+
+  static void putShort(std::vector<uint8_t>& out, const int value) {
+    out.push_back(value >> 8);
+    out.push_back(value & 0xff);
+  }
+
+  // Entropy coded bits, msb first, with a zero byte stuffed after every 0xff
+  class BitWriter {
+   public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void put(const uint32_t value, const int count) {
+      buffer = (buffer << count) | (value & ((1u << count) - 1));
+      bitCount += count;
+      while (bitCount >= 8) {
+        bitCount -= 8;
+        putByte(buffer >> bitCount);
+      }
+    }
+
+    // pads the last byte with ones
+    void flush() {
+      if (bitCount > 0) {
+        put(0xff, 8 - bitCount);
+      }
+    }
+
+   private:
+    void putByte(const uint8_t byte) {
+      out.push_back(byte);
+      if (byte == 0xff) {
+        out.push_back(0);
+      }
+    }
+
+    std::vector<uint8_t>& out;
+    uint64_t buffer = 0;
+    int bitCount = 0;
+  };
+};
+
+} // namespace isp
+} // namespace fb360_dep
@@ -5,7 +5,12 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <boost/timer/timer.hpp>
 #include <gflags/gflags.h>
@@ -14,6 +19,8 @@
 #include <folly/Format.h>
 
 #include "source/isp/CameraIsp.h"
+#include "source/util/AsyncWriter.h"
+#include "source/util/BoundedQueue.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/RawUtil.h"
 
@@ -24,74 +31,255 @@ using namespace fb360_dep::system_util;
 const std::string kUsageMessage = R"(
    - Converts a RAW image to RGB using a given ISP configuration.
 
+   - Given a directory, converts all the RAW images under it, optionally only the frames between
+     --first and --last. Each ISP configuration is loaded once, and raw images are read, processed
+     and written at the same time.
+
    - Example:
      ./RawToRgb \
      --input_image_path=/path/to/video/color/000000.raw \
      --output_image_path=/path/to/video/color/000000.png \
      --isp_config_path=/path/to/video/isp.json
+
+     ./RawToRgb \
+     --input_image_path=/path/to/video/color \
+     --first=000000 \
+     --last=000099
  )";
 
 DEFINE_bool(apply_tone_curve, true, "Apply tone curve to image");
+DEFINE_bool(compress_dng, false, "losslessly compress the DNG output");
 DEFINE_uint32(
     demosaic_filter,
     static_cast<unsigned int>(DemosaicFilter::BILINEAR),
     "Demosaic filter type: 0=Bilinear(fast), 1=Frequency, 2=Edge aware, 3=Chroma supressed bilinear");
-DEFINE_string(input_image_path, "", "input image path (required)");
+DEFINE_string(first, "", "first frame to convert in a directory (lexical, empty = all)");
+DEFINE_bool(
+    fixed_point,
+    false,
+    "faster 16 bit fixed point ISP (bilinear demosaic without sharpening only, else float)");
+DEFINE_int32(frames_in_flight, 4, "raw images in the ISP at the same time");
+DEFINE_string(input_image_path, "", "input image path or directory (required)");
 DEFINE_string(isp_config_path, "", "ISP config file path. Defaults to <input_image_path>/isp.json");
+DEFINE_string(last, "", "last frame to convert in a directory (lexical, empty = all)");
 DEFINE_string(output_dng_path, "", "optional path to output a DNG version of the raw file.");
 DEFINE_string(output_image_path, "", "output image path (required)");
 DEFINE_int32(
     pow2_downscale_factor,
     1,
     "Amount to \"bin-down\" the input. Legal values are 1, 2, 4, and 8");
+DEFINE_int32(queue_size, 8, "max raw images read ahead, and images waiting to be written");
+DEFINE_int32(writer_threads, 2, "threads writing the output images (0 = none)");
 
-int main(int argc, char* argv[]) {
-  initDep(argc, argv, kUsageMessage);
+struct Job {
+  filesystem::path input;
+  filesystem::path output;
+  filesystem::path dng; // empty for none
+  filesystem::path ispConfig;
+};
 
-  CHECK_NE(FLAGS_input_image_path, "");
+struct RawImage {
+  int job;
+  std::vector<uint8_t> data8; // only one is set, as the sensor's bits per pixel
+  std::vector<uint16_t> data16;
+};
 
-  std::vector<std::string> inputFiles;
-  std::vector<std::string> outputFiles;
-  std::vector<std::string> dngFiles;
+// ISPs built once per config and reused for all its images
+// A CameraIsp holds the image it is processing, so images of a camera in the ISP at the same
+// time each need their own. acquire() hands out an idle one and only builds another if there is
+// none. The first one built for a config is never handed out, readers and writers only use its
+// settings
+class IspCache {
+ public:
+  explicit IspCache(const int pow2DownscaleFactor) : pow2DownscaleFactor(pow2DownscaleFactor) {}
 
-  if (filesystem::is_directory(FLAGS_input_image_path)) {
-    for (filesystem::recursive_directory_iterator itr(FLAGS_input_image_path);
-         itr != filesystem::recursive_directory_iterator();
-         ++itr) {
-      if (filesystem::is_regular_file(*itr) && itr->path().extension() == ".raw") {
-        filesystem::path inputFile = itr->path();
-        inputFiles.emplace_back(inputFile.c_str());
-        outputFiles.emplace_back(inputFile.replace_extension(".png").c_str());
-
-        if (!FLAGS_output_dng_path.empty()) {
-          dngFiles.emplace_back(inputFile.replace_extension(".dng").c_str());
-        }
-      }
+  const CameraIsp& getSettings(const filesystem::path& ispConfig) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry& entry = entries[ispConfig.string()];
+    if (!entry.settings) {
+      entry.settings = create(ispConfig);
     }
-  } else {
-    CHECK_NE(FLAGS_output_image_path, "");
-    inputFiles.emplace_back(FLAGS_input_image_path);
-    outputFiles.emplace_back(FLAGS_output_image_path);
-    if (!FLAGS_output_dng_path.empty()) {
-      dngFiles.emplace_back(FLAGS_output_dng_path);
+    return *entry.settings;
+  }
+
+  std::unique_ptr<CameraIsp> acquire(const filesystem::path& ispConfig) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<std::unique_ptr<CameraIsp>>& idle = entries[ispConfig.string()].idle;
+      if (!idle.empty()) {
+        std::unique_ptr<CameraIsp> cameraIsp = std::move(idle.back());
+        idle.pop_back();
+        return cameraIsp;
+      }
     }
+    return create(ispConfig);
+  }
+
+  void release(const filesystem::path& ispConfig, std::unique_ptr<CameraIsp> cameraIsp) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[ispConfig.string()].idle.push_back(std::move(cameraIsp));
   }
 
-  for (ssize_t i = 0; i < ssize(inputFiles); i++) {
-    boost::timer::cpu_timer timer;
-    cv::Mat outputImage = rawToRgb(
-        inputFiles[i],
-        FLAGS_isp_config_path,
-        FLAGS_pow2_downscale_factor,
+ private:
+  struct Entry {
+    std::unique_ptr<const CameraIsp> settings;
+    std::vector<std::unique_ptr<CameraIsp>> idle;
+  };
+
+  std::unique_ptr<CameraIsp> create(const filesystem::path& ispConfig) const {
+    std::unique_ptr<CameraIsp> cameraIsp = cameraIspFromConfigFileWithOptions(
+        ispConfig,
+        pow2DownscaleFactor,
         (DemosaicFilter)FLAGS_demosaic_filter,
         FLAGS_apply_tone_curve);
-    LOG(INFO) << folly::sformat("Runtime = {}", timer.format());
-    imwriteExceptionOnFail(outputFiles[i], outputImage);
+    cameraIsp->setFixedPoint(FLAGS_fixed_point);
+    return cameraIsp;
+  }
+
+  const int pow2DownscaleFactor;
+  std::mutex mutex;
+  std::map<std::string, Entry> entries;
+};
 
+filesystem::path getIspConfig(const filesystem::path& input) {
+  return FLAGS_isp_config_path.empty() ? input.parent_path() / kDefaultIspConfigFilename
+                                       : filesystem::path(FLAGS_isp_config_path);
+}
+
+// Raw images under the input directory, frame major so the cameras of a frame are converted
+// together, and their ISPs are reused frame after frame
+std::vector<Job> getDirectoryJobs() {
+  std::vector<Job> jobs;
+  for (filesystem::recursive_directory_iterator itr(FLAGS_input_image_path);
+       itr != filesystem::recursive_directory_iterator();
+       ++itr) {
+    const filesystem::path& input = itr->path();
+    if (!filesystem::is_regular_file(input) || input.extension() != ".raw") {
+      continue;
+    }
+    const std::string frameName = input.stem().string();
+    if ((!FLAGS_first.empty() && frameName < FLAGS_first) ||
+        (!FLAGS_last.empty() && frameName > FLAGS_last)) {
+      continue;
+    }
+    Job job;
+    job.input = input;
+    job.output = filesystem::path(input).replace_extension(".png");
     if (!FLAGS_output_dng_path.empty()) {
-      writeDng(inputFiles[i], dngFiles[i], FLAGS_isp_config_path);
+      job.dng = filesystem::path(input).replace_extension(".dng");
+    }
+    job.ispConfig = getIspConfig(input);
+    jobs.push_back(job);
+  }
+  std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+    return std::make_pair(a.input.stem(), a.input) < std::make_pair(b.input.stem(), b.input);
+  });
+  return jobs;
+}
+
+template <typename T>
+void convert(
+    const Job& job,
+    const std::vector<T>& rawImage,
+    IspCache& cache,
+    IspCache& dngCache,
+    AsyncWriter& writer) {
+  std::unique_ptr<CameraIsp> cameraIsp = cache.acquire(job.ispConfig);
+  cameraIsp->loadImageFromSensor(rawImage);
+  const cv::Mat outputImage = cameraIsp->getImage<T>();
+  cache.release(job.ispConfig, std::move(cameraIsp));
+
+  // DNGs are full size, whatever the downscale of the output
+  cv::Mat_<T> dngImage;
+  const CameraIsp* dngSettings = nullptr;
+  if (!job.dng.empty()) {
+    std::unique_ptr<CameraIsp> dngIsp = dngCache.acquire(job.ispConfig);
+    dngIsp->loadImageFromSensor(rawImage);
+    dngImage = dngIsp->getRawImage<T>();
+    dngCache.release(job.ispConfig, std::move(dngIsp));
+    dngSettings = &dngCache.getSettings(job.ispConfig);
+  }
+
+  writer.write([&job, outputImage, dngImage, dngSettings] {
+    imwriteExceptionOnFail(job.output, outputImage);
+    if (dngSettings) {
+      writeDng(dngImage, job.dng, *dngSettings, FLAGS_compress_dng);
     }
+  });
+}
+
+// Converts the raw images as a pipeline: read -> ISP -> write
+// Reading and writing are mostly I/O, so they run on their own threads while images go through
+// the ISP, which also spreads each image over the thread pool. The queue caps the raw images read
+// ahead, and the writer the images waiting to be written
+void convertPipelined(const std::vector<Job>& jobs) {
+  IspCache cache(FLAGS_pow2_downscale_factor);
+  IspCache dngCache(1);
+  BoundedQueue<RawImage> rawQueue(FLAGS_queue_size);
+  std::thread reader([&] {
+    for (int i = 0; i < int(jobs.size()); ++i) {
+      const CameraIsp& settings = cache.getSettings(jobs[i].ispConfig);
+      const int bitsPerPixel = settings.getSensorBitsPerPixel();
+      CHECK(bitsPerPixel == 8 || bitsPerPixel == 16) << "Unsupported precision" << std::endl;
+      RawImage rawImage;
+      rawImage.job = i;
+      if (bitsPerPixel == 8) {
+        rawImage.data8 = readRawImage<uint8_t>(jobs[i].input, settings);
+      } else { // bitsPerPixel == 16
+        rawImage.data16 = readRawImage<uint16_t>(jobs[i].input, settings);
+      }
+      rawQueue.push(std::move(rawImage));
+    }
+    rawQueue.close();
+  });
+
+  AsyncWriter writer(FLAGS_writer_threads, FLAGS_queue_size);
+  std::vector<std::thread> converters;
+  for (int i = 0; i < std::max(1, FLAGS_frames_in_flight); ++i) {
+    converters.emplace_back([&] {
+      RawImage rawImage;
+      while (rawQueue.pop(rawImage)) {
+        boost::timer::cpu_timer timer;
+        const Job& job = jobs[rawImage.job];
+        if (!rawImage.data8.empty()) {
+          convert(job, rawImage.data8, cache, dngCache, writer);
+        } else {
+          convert(job, rawImage.data16, cache, dngCache, writer);
+        }
+        LOG(INFO) << folly::sformat("{}: runtime = {}", job.input.string(), timer.format());
+      }
+    });
+  }
+
+  reader.join();
+  for (std::thread& converter : converters) {
+    converter.join();
   }
+  writer.flush();
+}
+
+int main(int argc, char* argv[]) {
+  initDep(argc, argv, kUsageMessage);
+
+  CHECK_NE(FLAGS_input_image_path, "");
+
+  std::vector<Job> jobs;
+  if (filesystem::is_directory(FLAGS_input_image_path)) {
+    jobs = getDirectoryJobs();
+  } else {
+    CHECK_NE(FLAGS_output_image_path, "");
+    CHECK_EQ(filesystem::path(FLAGS_input_image_path).extension(), ".raw");
+    Job job;
+    job.input = FLAGS_input_image_path;
+    job.output = FLAGS_output_image_path;
+    job.dng = FLAGS_output_dng_path;
+    job.ispConfig = getIspConfig(job.input);
+    jobs.push_back(job);
+  }
+
+  boost::timer::cpu_timer timer;
+  convertPipelined(jobs);
+  LOG(INFO) << folly::sformat("Converted {} images, runtime = {}", jobs.size(), timer.format());
 
   return 0;
 }
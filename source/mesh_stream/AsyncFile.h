@@ -23,12 +23,21 @@
 #include <unistd.h>
 #include <future>
 #include <mutex>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING 1
+#endif
+#endif
 #endif
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <iomanip>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -38,6 +47,10 @@
 #endif
 #include <glog/logging.h>
 
+#ifdef HAS_IO_URING
+#include "source/mesh_stream/IoUring.h"
+#endif
+
 namespace fb360_dep {
 
 const uint64_t kPageSize = 4096;
@@ -120,21 +133,29 @@ struct AsyncFile {
     if (!ok) {
       CHECK_EQ(GetLastError(), ERROR_IO_PENDING);
     }
-    activityLog().event(handle, offset, 0);
+    activityLog().event(handle, offset, ActivityLog::kBegin);
   }
 
   static uint64_t readEnd(PendingRead& pending) {
     uint64_t offset = pending.overlapped.OffsetHigh;
     offset = offset << 32 | pending.overlapped.Offset;
-    activityLog().event(pending.handle, offset, 1);
+    activityLog().event(pending.handle, offset, ActivityLog::kGet);
     DWORD transferred;
     const BOOL ok = GetOverlappedResult(pending.handle, &pending.overlapped, &transferred, TRUE);
     CHECK(ok) << "file read error = " << GetLastError();
     CloseHandle(pending.overlapped.hEvent);
-    activityLog().event(pending.handle, offset, 2);
+    activityLog().event(pending.handle, offset, ActivityLog::kDone);
+    bytesRead().fetch_add(transferred, std::memory_order_relaxed);
     return transferred;
   }
 
+  // Reads start in readBegin
+  static void submit() {}
+
+  static bool registerBuffers(const std::vector<Segment>& buffers) {
+    return false;
+  }
+
 #else // METHOD == 0
 
   using HANDLE = int;
@@ -142,11 +163,19 @@ struct AsyncFile {
 
   using Segment = iovec;
 
-  using PendingRead = std::future<ssize_t>;
+  struct PendingRead {
+    HANDLE handle;
+    uint64_t offset;
+    std::future<ssize_t> future;
+#ifdef HAS_IO_URING
+    std::unique_ptr<IoUring::Request> request; // set if the read went through io_uring
+#endif
+  };
 
   AsyncFile(const std::string& filename) {
     handle = open(filename.c_str(), O_RDONLY);
     CHECK_NE(handle, -1) << "error opening " << filename;
+    activityLog().addFile(handle, filename);
   }
 
   void close() const {
@@ -163,43 +192,110 @@ struct AsyncFile {
     return total;
   }
 
+  // On linux, reads are queued on the shared io_uring and only handed to the kernel by submit()
+  // (or by the first readEnd), so reads from several files can be submitted in one batch
+  // Elsewhere, or if the kernel has no io_uring, every read runs on its own thread
   void readBegin(PendingRead& pending, const std::vector<Segment>& segments, uint64_t offset)
       const {
+    pending.handle = handle;
+    pending.offset = offset;
+    activityLog().event(handle, offset, ActivityLog::kBegin);
+#ifdef HAS_IO_URING
+    if (IoUring* ring = IoUring::getInstance()) {
+      pending.request.reset(new IoUring::Request);
+      pending.request->segments = segments;
+      ring->prepareRead(pending.request.get(), handle, offset);
+      return;
+    }
+#endif
 #if defined(__APPLE__) || defined(__linux__)
     // apple doesn't support preadv and linux crashes
-    pending = std::async(&AsyncFile::readSegments, this, segments, offset);
+    pending.future = std::async(&AsyncFile::readSegments, this, segments, offset);
 #else // __APPLE__
-    pending = std::async(preadv, handle, segments.data(), segments.size(), offset);
+    pending.future = std::async(preadv, handle, segments.data(), segments.size(), offset);
 #endif
   }
 
   static uint64_t readEnd(PendingRead& pending) {
+    activityLog().event(pending.handle, pending.offset, ActivityLog::kGet);
+#ifdef HAS_IO_URING
+    if (pending.request) {
+      const int64_t result = IoUring::getInstance()->wait(pending.request.get());
+      pending.request.reset();
+      activityLog().event(pending.handle, pending.offset, ActivityLog::kDone);
+      bytesRead().fetch_add(result, std::memory_order_relaxed);
+      return result;
+    }
+#endif
     ssize_t result;
-    result = pending.get();
+    result = pending.future.get();
     CHECK_NE(result, -1) << "file read error = " << errno;
+    activityLog().event(pending.handle, pending.offset, ActivityLog::kDone);
+    bytesRead().fetch_add(result, std::memory_order_relaxed);
     return result;
   }
 
+  // Starts the reads queued by readBegin
+  static void submit() {
+#ifdef HAS_IO_URING
+    if (IoUring* ring = IoUring::getInstance()) {
+      ring->submit();
+    }
+#endif
+  }
+
+  // Registers long lived destination buffers, reads into them skip page pinning
+  // Can be called once. Returns false if not supported
+  static bool registerBuffers(const std::vector<Segment>& buffers) {
+#ifdef HAS_IO_URING
+    if (IoUring* ring = IoUring::getInstance()) {
+      return ring->registerBuffers(buffers);
+    }
+#endif
+    return false;
+  }
+
 #endif // METHOD == 0
 
+  // Timeline of reads, and of other spans worth seeing next to them (e.g. frames), to diagnose
+  // disk throughput. Off unless enabled, then events go to a preallocated ring per thread, without
+  // locks or allocations, and the oldest events of a ring are overwritten once it is full
+  // The log can be dumped at any time, also while reads are in flight
   struct ActivityLog {
+    using Clock = std::chrono::steady_clock;
+    enum Kind : uint32_t {
+      kBegin, // read started
+      kGet, // started waiting for the read
+      kDone, // read completed
+      kSpan, // named span, e.g. a frame
+    };
+    struct Event {
+      Kind kind;
+      HANDLE handle; // reads
+      uint64_t offset; // reads
+      const char* name; // spans, must outlive the log, e.g. a string literal
+      Clock::time_point time;
+      Clock::time_point end; // spans
+    };
+    static const uint64_t kRingSize = 1 << 14; // events per thread
+
     ~ActivityLog() {
-      dump("activitylog.tsv");
+      if (!tracePath.empty()) {
+        dumpChromeTrace(tracePath);
+      }
     }
 
-    // keep a decoder ring to map filehandles to filenames
-    std::map<HANDLE, std::string> filenames;
-    // a request is identified by filehandle, offset
-    using Request = std::pair<HANDLE, uint64_t>;
-    // the events associated with a request are just 3 timestamps
-    static const size_t kEventCount = 3; // begin, get, done
-    using Clock = std::chrono::high_resolution_clock;
-    using Events = std::array<Clock::time_point, kEventCount>;
-    // live requests are stored in a map, completed requests in a vector
-    std::map<Request, Events> live;
-    std::vector<std::pair<Request, Events>> completed;
-    // protect updates with a mutex
-    std::mutex mutex;
+    // starts logging, and saves a chrome trace (see dumpChromeTrace) of the log to path when it
+    // is destroyed. An empty path stops logging
+    void enable(const std::string& path) {
+      std::lock_guard<std::mutex> guard(mutex);
+      tracePath = path;
+      enabled.store(!path.empty(), std::memory_order_relaxed);
+    }
+
+    bool isEnabled() const {
+      return enabled.load(std::memory_order_relaxed);
+    }
 
     // call to populate filehandle -> filename decoder ring
     void addFile(HANDLE filehandle, const std::string& filename) {
@@ -207,33 +303,182 @@ struct AsyncFile {
       filenames[filehandle] = filename;
     }
 
-    // call when event occurs
-    void event(HANDLE filehandle, uint64_t offset, size_t index) {
-      CHECK_LT(index, kEventCount);
-      Request request(filehandle, offset);
-      Clock::time_point now = Clock::now();
+    // call when event occurs, a read is identified by filehandle, offset
+    void event(HANDLE filehandle, uint64_t offset, Kind kind) {
+      if (isEnabled()) {
+        record({kind, filehandle, offset, nullptr, Clock::now(), Clock::time_point()});
+      }
+    }
+
+    void span(const char* name, Clock::time_point begin, Clock::time_point end) {
+      if (isEnabled()) {
+        record({kSpan, HANDLE(), 0, name, begin, end});
+      }
+    }
+
+    // events of every thread, oldest first
+    std::vector<Event> snapshot() {
+      std::vector<Event> result;
       std::lock_guard<std::mutex> guard(mutex);
-      live[request][index] = now;
-      if (index + 1 == kEventCount) { // last event, transfer from live to log
-        completed.emplace_back(request, live[request]);
-        live.erase(request);
+      for (const std::unique_ptr<Ring>& ring : rings) {
+        const uint64_t end = ring->count.load(std::memory_order_acquire);
+        const uint64_t begin = end > kRingSize ? end - kRingSize : 0;
+        const size_t size = result.size();
+        for (uint64_t i = begin; i < end; ++i) {
+          result.push_back(ring->events[i % kRingSize]);
+        }
+        // drop the events the thread may have overwritten while they were copied
+        const uint64_t after = ring->count.load(std::memory_order_acquire);
+        const uint64_t overwritten = after > kRingSize + begin ? after - kRingSize - begin : 0;
+        result.erase(
+            result.begin() + size,
+            result.begin() + size + std::min(overwritten, end - begin));
       }
+      std::stable_sort(result.begin(), result.end(), [](const Event& a, const Event& b) {
+        return a.time < b.time;
+      });
+      return result;
     }
 
+    // one line per completed read: "filename", offset, then the begin, get and done timestamps in
+    // seconds from the first event
     void dump(const std::string& filename) {
       std::ofstream file(filename);
-      for (const auto& entry : completed) {
-        file << "\"" << filenames[entry.first.first] << "\"";
-        file << "\t" << entry.first.second;
-        for (const auto& timestamp : entry.second) {
-          // offset timestamps from first timestamp
-          static Clock::time_point offset = timestamp;
-          std::chrono::duration<double> elapsed = timestamp - offset;
+      for (const Read& read : getReads()) {
+        file << "\"" << read.filename << "\"";
+        file << "\t" << read.offset;
+        for (const Clock::time_point& timestamp : read.times) {
+          std::chrono::duration<double> elapsed = timestamp - read.origin;
           file << "\t" << elapsed.count();
         }
         file << std::endl;
       }
     }
+
+    // chrome trace event format json, for chrome://tracing or ui.perfetto.dev: reads are async
+    // slices, one track per file, and spans are slices of the thread "spans"
+    void dumpChromeTrace(const std::string& filename) {
+      const std::vector<Event> events = snapshot();
+      const Clock::time_point origin = events.empty() ? Clock::now() : events.front().time;
+      auto us = [&](const Clock::time_point& time) {
+        return std::chrono::duration<double, std::micro>(time - origin).count();
+      };
+      std::ofstream file(filename);
+      file << std::fixed << std::setprecision(3);
+      file << "{\"traceEvents\":[\n";
+      file << R"({"name":"thread_name","ph":"M","pid":0,"tid":0,"args":{"name":"spans"}})";
+      for (const Event& event : events) {
+        if (event.kind == kSpan) {
+          file << ",\n" << R"({"name":")" << escape(event.name) << R"(","cat":"span","ph":"X")";
+          file << R"(,"pid":0,"tid":0,"ts":)" << us(event.time);
+          file << R"(,"dur":)" << us(event.end) - us(event.time) << "}";
+        }
+      }
+      uint64_t id = 0;
+      for (const Read& read : getReads(origin)) {
+        const std::string name = escape(read.filename);
+        for (const int i : {0, 2}) {
+          file << ",\n" << R"({"name":")" << name << R"(","cat":"read","ph":")";
+          file << (i == 0 ? "b" : "e") << R"(","id":)" << id << R"(,"pid":0,"tid":0,"ts":)";
+          file << us(read.times[i]);
+          if (i == 0) {
+            file << R"(,"args":{"offset":)" << read.offset;
+            file << R"(,"wait_us":)" << us(read.times[2]) - us(read.times[1]) << "}";
+          }
+          file << "}";
+        }
+        ++id;
+      }
+      file << "\n]}\n";
+    }
+
+   private:
+    // single writer, the thread that owns it
+    struct Ring {
+      std::vector<Event> events = std::vector<Event>(kRingSize);
+      std::atomic<uint64_t> count{0};
+    };
+
+    struct Read {
+      std::string filename;
+      uint64_t offset;
+      std::array<Clock::time_point, 3> times; // begin, get, done
+      Clock::time_point origin; // first event of the log
+    };
+
+    void record(const Event& event) {
+      thread_local Ring* ring = nullptr;
+      if (!ring) {
+        std::lock_guard<std::mutex> guard(mutex);
+        rings.emplace_back(new Ring);
+        ring = rings.back().get();
+      }
+      const uint64_t i = ring->count.load(std::memory_order_relaxed);
+      ring->events[i % kRingSize] = event;
+      ring->count.store(i + 1, std::memory_order_release);
+    }
+
+    // completed reads, in the order they began
+    std::vector<Read> getReads(Clock::time_point origin = Clock::time_point()) {
+      const std::vector<Event> events = snapshot();
+      if (origin == Clock::time_point() && !events.empty()) {
+        origin = events.front().time;
+      }
+      std::map<std::pair<HANDLE, uint64_t>, size_t> live; // index in result
+      std::vector<Read> result;
+      std::vector<bool> isDone;
+      for (const Event& event : events) {
+        if (event.kind == kSpan) {
+          continue;
+        }
+        const auto key = std::make_pair(event.handle, event.offset);
+        if (event.kind == kBegin) {
+          live[key] = result.size();
+          result.push_back({getFilename(event.handle), event.offset, {}, origin});
+          isDone.push_back(false);
+        }
+        const auto it = live.find(key);
+        if (it == live.end()) {
+          continue; // began before the oldest event in the log
+        }
+        result[it->second].times[event.kind] = event.time;
+        if (event.kind == kDone) {
+          isDone[it->second] = true;
+          live.erase(it);
+        }
+      }
+      std::vector<Read> completed;
+      for (size_t i = 0; i < result.size(); ++i) {
+        if (isDone[i]) {
+          completed.push_back(result[i]);
+        }
+      }
+      return completed;
+    }
+
+    std::string getFilename(HANDLE filehandle) {
+      std::lock_guard<std::mutex> guard(mutex);
+      return filenames[filehandle];
+    }
+
+    static std::string escape(const std::string& s) {
+      std::string result;
+      for (const char c : s) {
+        if (c == '"' || c == '\\') {
+          result += '\\';
+        }
+        result += c;
+      }
+      return result;
+    }
+
+    std::atomic<bool> enabled{false};
+    std::string tracePath;
+    // keep a decoder ring to map filehandles to filenames
+    std::map<HANDLE, std::string> filenames;
+    std::vector<std::unique_ptr<Ring>> rings; // one per thread that logged
+    // protects filenames, rings and tracePath, the rings' events are not
+    std::mutex mutex;
   };
 
   // stick all asyncfile activity into the same activity log
@@ -241,6 +486,12 @@ struct AsyncFile {
     static ActivityLog singleton;
     return singleton;
   }
+
+  // bytes read by all files so far, e.g. to measure throughput
+  static std::atomic<uint64_t>& bytesRead() {
+    static std::atomic<uint64_t> bytes{0};
+    return bytes;
+  }
 };
 
 } // namespace fb360_dep
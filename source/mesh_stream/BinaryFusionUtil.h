@@ -7,12 +7,25 @@
 
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <folly/FileUtil.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "source/mesh_stream/MeshCodec.h"
 #include "source/mesh_stream/StripedFile.h"
 #include "source/render/VideoFile.h"
 #include "source/util/Camera.h"
@@ -22,9 +35,15 @@
 namespace fb360_dep {
 namespace binary_fusion {
 
-void addFile(std::vector<FILE*>& disks, uint64_t& offset, const filesystem::path& filename) {
-  uint64_t aligned = align(offset, kStripeSize);
-  uint64_t end = offset == aligned ? offset + kStripeSize : aligned;
+// stripeSize is the layout of the fused file (see StripedFile), the caller records it in the
+// catalog metadata
+void addFile(
+    std::vector<FILE*>& disks,
+    uint64_t& offset,
+    const filesystem::path& filename,
+    const uint64_t stripeSize) {
+  uint64_t aligned = align(offset, stripeSize);
+  uint64_t end = offset == aligned ? offset + stripeSize : aligned;
   uint64_t size = filesystem::file_size(filename);
   FILE* file = fopen(filename.c_str(), "rb");
   LOG(INFO) << folly::sformat("Fusing {}...", filename.string());
@@ -33,27 +52,82 @@ void addFile(std::vector<FILE*>& disks, uint64_t& offset, const filesystem::path
     CHECK_EQ(fread(buffer.data(), 1, buffer.size(), file), buffer.size())
         << "Error reading buffer data";
     uint64_t local, disk;
-    StripedFile::calcStripe(local, disk, offset, disks.size());
+    StripedFile::calcStripe(local, disk, offset, disks.size(), stripeSize);
     fwrite(buffer.data(), 1, buffer.size(), disks[disk]);
     offset += buffer.size();
-    end = offset + kStripeSize;
+    end = offset + stripeSize;
     size -= buffer.size();
   }
   fclose(file);
 }
 
-void pad(std::vector<FILE*>& disks, uint64_t& offset) {
-  uint64_t aligned = align(offset, kStripeSize);
+void addBuffer(
+    std::vector<FILE*>& disks,
+    uint64_t& offset,
+    const std::vector<uint8_t>& buffer,
+    const uint64_t stripeSize) {
+  uint64_t aligned = align(offset, stripeSize);
+  uint64_t end = offset == aligned ? offset + stripeSize : aligned;
+  uint64_t begin = 0;
+  while (begin < buffer.size()) {
+    const uint64_t size = std::min(buffer.size() - begin, end - offset);
+    uint64_t local, disk;
+    StripedFile::calcStripe(local, disk, offset, disks.size(), stripeSize);
+    fwrite(buffer.data() + begin, 1, size, disks[disk]);
+    offset += size;
+    end = offset + stripeSize;
+    begin += size;
+  }
+}
+
+void pad(std::vector<FILE*>& disks, uint64_t& offset, const uint64_t stripeSize) {
+  uint64_t aligned = align(offset, stripeSize);
   if (offset == aligned) {
     return; // our work here is done
   }
   std::vector<uint8_t> buffer(aligned - offset, 0x5A);
   uint64_t local, disk;
-  StripedFile::calcStripe(local, disk, offset, disks.size());
+  StripedFile::calcStripe(local, disk, offset, disks.size(), stripeSize);
   fwrite(buffer.data(), 1, buffer.size(), disks[disk]);
   offset += buffer.size();
 }
 
+// Cameras that are byte for byte the same as in the previous frame, e.g. static background, are
+// stored once: the catalog entry of a repeat is a copy of the previous frame's, pointing at the
+// same data, so playback reads it as any other camera and can keep what it uploaded for the
+// previous frame instead (see VideoFile)
+class CameraRepeats {
+ public:
+  using Data = std::vector<std::vector<uint8_t>>; // one buffer per extension, as fused
+
+  // Catalog entry of a camera. Unless it repeats the previous frame, data is fused with
+  // write(data), which returns the entry
+  template <typename WriteFn>
+  folly::dynamic fuse(const std::string& camId, Data data, WriteFn write) {
+    Previous& previous = cameras[camId];
+    if (previous.entry.isNull() || previous.data != data) {
+      previous.entry = write(data);
+      previous.data = std::move(data);
+    } else {
+      ++repeatCount;
+    }
+    return previous.entry;
+  }
+
+  int getRepeatCount() const {
+    return repeatCount;
+  }
+
+ private:
+  struct Previous {
+    Data data;
+    folly::dynamic entry;
+  };
+
+  std::map<std::string, Previous> cameras;
+  int repeatCount = 0;
+};
+
 void fuseFrame(
     folly::dynamic& catalog,
     std::vector<FILE*>& disks,
@@ -61,26 +135,307 @@ void fuseFrame(
     const filesystem::path& dirBin,
     const std::string& frameName,
     const Camera::Rig& rig,
-    const std::vector<std::string>& extensions) {
+    const std::vector<std::string>& extensions,
+    const uint64_t stripeSize,
+    CameraRepeats& repeats,
+    const std::string& compression = "") { // "" = store .vtx and .idx as is
   // Fuse each camera in the frame
   folly::dynamic& frame = catalog["frames"][frameName];
   frame = folly::dynamic::object;
   for (const Camera& cam : rig) {
-    uint64_t begin = offset;
-
-    // Fuse each extension in the camera
-    folly::dynamic& camera = frame[cam.id];
-    camera = folly::dynamic::object;
+    // Read, and encode if compressing, each extension in the camera
+    CameraRepeats::Data data;
+    folly::dynamic entries = folly::dynamic::object;
     for (const std::string& extension : extensions) {
-      uint64_t begin = offset;
-      addFile(disks, offset, dirBin / cam.id / (frameName + extension));
-      camera[extension] = folly::dynamic::object("offset", begin)("size", offset - begin);
+      const filesystem::path filename = dirBin / cam.id / (frameName + extension);
+      std::string contents;
+      CHECK(folly::readFile(filename.c_str(), contents)) << "Error reading " << filename;
+      data.emplace_back(contents.begin(), contents.end());
+      if (compression.empty() || mesh_codec::getEncoding(extension).empty()) {
+        LOG(INFO) << folly::sformat("Fusing {}...", filename.string());
+        entries[extension] = folly::dynamic::object;
+      } else {
+        LOG(INFO) << folly::sformat("Fusing {} ({})...", filename.string(), compression);
+        entries[extension] = mesh_codec::encode(data.back(), extension, compression);
+      }
     }
-    camera["offset"] = begin;
-    camera["size"] = offset - begin;
-    pad(disks, offset);
+
+    frame[cam.id] = repeats.fuse(cam.id, std::move(data), [&](const CameraRepeats::Data& buffers) {
+      folly::dynamic camera = entries;
+      const uint64_t begin = offset;
+      for (int i = 0; i < int(extensions.size()); ++i) {
+        camera[extensions[i]]["offset"] = offset;
+        addBuffer(disks, offset, buffers[i], stripeSize);
+        camera[extensions[i]]["size"] = uint64_t(buffers[i].size());
+      }
+      camera["offset"] = begin;
+      camera["size"] = offset - begin;
+      pad(disks, offset, stripeSize);
+      return camera;
+    });
   }
 }
 
+// Writes a striped file (see StripedFile) sequentially, in a single pass
+// Data is staged in a page-aligned buffer holding kStripesPerWrite stripes for every disk, and
+// each full buffer is written with one pwritev per disk. Disks are opened with O_DIRECT where the
+// filesystem supports it, so the output does not go through (and evict) the page cache
+// The resulting disks are byte for byte the same as the ones written by addFile() and pad()
+class StripedWriter {
+ public:
+  static const int kStripesPerWrite = 8;
+
+  StripedWriter(const std::vector<std::string>& diskNames, const uint64_t stripeSize)
+      : stripeSize(stripeSize),
+        rowSize(stripeSize * kStripesPerWrite * diskNames.size()),
+        storage(rowSize + kPageSize),
+        row(align(storage.data(), kPageSize)),
+        diskSizes(diskNames.size(), 0) {
+    CHECK(!diskNames.empty());
+    for (const std::string& diskName : diskNames) {
+      static const int kFlags = O_WRONLY | O_CREAT | O_TRUNC;
+      int fd = -1;
+#ifdef O_DIRECT
+      fd = open(diskName.c_str(), kFlags | O_DIRECT, 0644);
+#endif
+      if (fd < 0) {
+        // e.g. tmpfs does not support O_DIRECT
+        fd = open(diskName.c_str(), kFlags, 0644);
+      }
+      CHECK_GE(fd, 0) << folly::sformat("Failed to open {}", diskName);
+      disks.push_back(fd);
+    }
+  }
+
+  ~StripedWriter() {
+    close();
+  }
+
+  StripedWriter(const StripedWriter&) = delete;
+  StripedWriter& operator=(const StripedWriter&) = delete;
+
+  uint64_t getOffset() const {
+    return offset;
+  }
+
+  void append(const uint8_t* data, const uint64_t size) {
+    fill(size, [&](uint8_t* dst, const uint64_t begin, const uint64_t count) {
+      std::memcpy(dst, data + begin, count);
+    });
+  }
+
+  // Same padding as binary_fusion::pad()
+  void pad() {
+    fill(align(offset, stripeSize) - offset, [](uint8_t* dst, uint64_t, const uint64_t count) {
+      std::memset(dst, 0x5A, count);
+    });
+  }
+
+  // Writes what is left in the buffer and closes the disks
+  void close() {
+    if (disks.empty()) {
+      return;
+    }
+    flushRow();
+    for (int disk = 0; disk < int(disks.size()); ++disk) {
+      // The last write may have been rounded up to a page
+      CHECK_EQ(ftruncate(disks[disk], diskSizes[disk]), 0);
+      ::close(disks[disk]);
+    }
+    disks.clear();
+  }
+
+ private:
+  // Copies size bytes into the buffer with copy(dst, begin, count), flushing it whenever full
+  template <typename CopyFn>
+  void fill(uint64_t size, CopyFn copy) {
+    uint64_t begin = 0;
+    while (size) {
+      const uint64_t used = offset - rowBegin;
+      const uint64_t count = std::min(size, rowSize - used);
+      copy(row + used, begin, count);
+      offset += count;
+      begin += count;
+      size -= count;
+      if (offset - rowBegin == rowSize) {
+        flushRow();
+      }
+    }
+  }
+
+  void flushRow() {
+    const uint64_t used = offset - rowBegin;
+    if (used == 0) {
+      return;
+    }
+    const uint64_t diskCount = disks.size();
+    const uint64_t stripeCount = align(used, stripeSize) / stripeSize;
+    for (uint64_t disk = 0; disk < diskCount; ++disk) {
+      // Stripes of a disk are consecutive on that disk
+      std::vector<iovec> segments;
+      uint64_t local, firstDisk;
+      StripedFile::calcStripe(local, firstDisk, rowBegin, diskCount, stripeSize);
+      CHECK_EQ(firstDisk, 0);
+      uint64_t total = 0;
+      for (uint64_t stripe = disk; stripe < stripeCount; stripe += diskCount) {
+        const uint64_t size = std::min(stripeSize, used - stripe * stripeSize);
+        segments.push_back({row + stripe * stripeSize, align(size, kPageSize)});
+        total += segments.back().iov_len;
+        diskSizes[disk] = local + (stripe / diskCount) * stripeSize + size;
+      }
+      if (segments.empty()) {
+        continue;
+      }
+      const ssize_t written = pwritev(disks[disk], segments.data(), segments.size(), local);
+      CHECK_EQ(written, ssize_t(total)) << "Error writing striped file";
+    }
+    rowBegin = offset;
+  }
+
+  const uint64_t stripeSize;
+  const uint64_t rowSize;
+  std::vector<uint8_t> storage;
+  uint8_t* const row; // page-aligned, rowSize bytes
+  std::vector<int> disks;
+  std::vector<uint64_t> diskSizes;
+  uint64_t offset = 0; // logical offset of the next byte
+  uint64_t rowBegin = 0; // logical offset of row[0]
+};
+
+// Fuses conversion outputs as they are produced, without going through intermediate files
+// Outputs can be added in any order. A camera is fused as soon as it has all its extensions and
+// all the cameras before it, in (frame, rig) order, are, so the disks and the catalog are the same
+// as the ones fuseFrame() produces from the files
+class StreamingFuser {
+ public:
+  StreamingFuser(
+      const std::vector<std::string>& diskNames,
+      const Camera::Rig& rig,
+      const std::vector<std::string>& frameNames,
+      const std::vector<std::string>& extensions,
+      const int maxPendingCameras,
+      const uint64_t stripeSize,
+      const std::string& compression = "") // "" = store .vtx and .idx as is
+      : writer(diskNames, stripeSize),
+        rig(rig),
+        frameNames(frameNames),
+        extensions(extensions),
+        maxPendingCameras(std::max(1, maxPendingCameras)),
+        compression(compression) {
+    for (int i = 0; i < int(frameNames.size()); ++i) {
+      frameIdxs[frameNames[i]] = i;
+    }
+    for (int i = 0; i < int(rig.size()); ++i) {
+      camIdxs[rig[i].id] = i;
+    }
+    catalog["metadata"] = folly::dynamic::object;
+    catalog["frames"] = folly::dynamic::object;
+    catalog["metadata"]["isLittleEndian"] = folly::kIsLittleEndian;
+    catalog["metadata"][kStripeSizeKey] = stripeSize;
+  }
+
+  // Cameras are numbered in (frame, rig) order
+  int getCameraNumber(const std::string& frameName, const std::string& camId) const {
+    return frameIdxs.at(frameName) * rig.size() + camIdxs.at(camId);
+  }
+
+  // Blocks until fewer than maxPendingCameras cameras before cameraNumber are waiting to be fused
+  // Call it before producing the outputs of a camera, to bound the outputs held in memory
+  void waitForRoom(const int cameraNumber) {
+    std::unique_lock<std::mutex> lock(mutex);
+    fused.wait(lock, [&] { return cameraNumber < nextCamera + maxPendingCameras; });
+  }
+
+  void add(
+      const std::string& frameName,
+      const std::string& camId,
+      const std::string& extension,
+      std::vector<uint8_t> data) {
+    if (std::find(extensions.begin(), extensions.end(), extension) == extensions.end()) {
+      return; // not fused
+    }
+    // Encode before taking the lock, so the other producers are not held up
+    Output output;
+    output.entry = compression.empty() ? folly::dynamic(folly::dynamic::object)
+                                       : mesh_codec::encode(data, extension, compression);
+    output.data = std::move(data);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const int cameraNumber = getCameraNumber(frameName, camId);
+      CHECK_GE(cameraNumber, nextCamera) << "camera was already fused";
+      pending[cameraNumber][extension] = std::move(output);
+      while (!pending.empty() && pending.begin()->first == nextCamera &&
+             pending.begin()->second.size() == extensions.size()) {
+        fuseCamera(nextCamera, pending.begin()->second);
+        pending.erase(pending.begin());
+        ++nextCamera;
+      }
+    }
+    fused.notify_all();
+  }
+
+  // Returns the catalog, once every camera of every frame is fused
+  folly::dynamic finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(pending.empty()) << "missing outputs for " << pending.size() << " cameras";
+    CHECK_EQ(nextCamera, int(frameNames.size() * rig.size())) << "missing cameras";
+    writer.close();
+    LOG(INFO) << folly::sformat(
+        "{} cameras repeat the previous frame and were stored once", repeats.getRepeatCount());
+    return catalog;
+  }
+
+ private:
+  struct Output {
+    std::vector<uint8_t> data; // as written to the disks
+    folly::dynamic entry; // catalog entry, but for offset and size
+  };
+  using Files = std::map<std::string, Output>; // keyed by extension
+
+  void fuseCamera(const int cameraNumber, Files& files) {
+    const std::string& frameName = frameNames[cameraNumber / rig.size()];
+    const Camera& cam = rig[cameraNumber % rig.size()];
+    if (cameraNumber % rig.size() == 0) {
+      LOG(INFO) << folly::sformat("Fusing frame {}...", frameName);
+      catalog["frames"][frameName] = folly::dynamic::object;
+    }
+    CameraRepeats::Data data;
+    for (const std::string& extension : extensions) {
+      data.push_back(std::move(files.at(extension).data));
+    }
+    catalog["frames"][frameName][cam.id] =
+        repeats.fuse(cam.id, std::move(data), [&](const CameraRepeats::Data& buffers) {
+          folly::dynamic camera = folly::dynamic::object;
+          const uint64_t begin = writer.getOffset();
+          for (int i = 0; i < int(extensions.size()); ++i) {
+            camera[extensions[i]] = files.at(extensions[i]).entry;
+            camera[extensions[i]]["offset"] = writer.getOffset();
+            camera[extensions[i]]["size"] = uint64_t(buffers[i].size());
+            writer.append(buffers[i].data(), buffers[i].size());
+          }
+          camera["offset"] = begin;
+          camera["size"] = writer.getOffset() - begin;
+          writer.pad();
+          return camera;
+        });
+  }
+
+  StripedWriter writer;
+  CameraRepeats repeats;
+  const Camera::Rig rig;
+  const std::vector<std::string> frameNames;
+  const std::vector<std::string> extensions;
+  const int maxPendingCameras;
+  const std::string compression;
+  std::map<std::string, int> frameIdxs;
+  std::map<std::string, int> camIdxs;
+
+  std::mutex mutex;
+  std::condition_variable fused;
+  std::map<int, Files> pending; // keyed by camera number
+  int nextCamera = 0;
+  folly::dynamic catalog = folly::dynamic::object;
+};
+
 } // namespace binary_fusion
 } // namespace fb360_dep
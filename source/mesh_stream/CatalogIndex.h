@@ -0,0 +1,230 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/dynamic.h>
+
+#include "source/mesh_stream/MeshCodec.h"
+#include "source/mesh_stream/StripedFile.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+
+// The fused catalog as a flat array of extents, indexed by frame, camera and extension, so
+// playback finds what to read without parsing json or looking up strings
+// File: CatalogIndex::Header, which also holds the stripe size of the fused file, then the frame
+// names, camera ids and extensions, kNameSize bytes each, null padded, then for every frame, for
+// every camera, the extent of the camera followed by the extent of each extension, {0, 0} if the
+// camera or extension is missing
+// Frames are sorted by name. Catalogs with encoded extensions (see mesh_codec) are not indexed,
+// playback decodes them from the json catalog
+class CatalogIndex {
+ public:
+  static const int kNameSize = 64;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t frameCount;
+    uint32_t cameraCount;
+    uint32_t extensionCount;
+    uint64_t stripeSize; // see StripedFile::getStripeSize
+  };
+
+  struct Extent {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  // fused.index next to fused.json
+  static filesystem::path getPath(const filesystem::path& catalogPath) {
+    return filesystem::path(catalogPath).replace_extension(".index");
+  }
+
+  // Returns false, and writes nothing, if the catalog has encoded extensions
+  static bool write(const folly::dynamic& catalog, const filesystem::path& path) {
+    std::vector<std::string> frames;
+    std::vector<std::string> cameras;
+    std::vector<std::string> extensions;
+    for (const auto& frame : catalog["frames"].items()) {
+      frames.push_back(frame.first.getString());
+      for (const auto& camera : frame.second.items()) {
+        addName(cameras, camera.first.getString());
+        for (const auto& entry : camera.second.items()) {
+          if (!entry.second.isObject()) {
+            continue;
+          }
+          if (mesh_codec::isEncoded(entry.second)) {
+            return false;
+          }
+          addName(extensions, entry.first.getString());
+        }
+      }
+    }
+    std::sort(frames.begin(), frames.end());
+
+    const Header header = {
+        kMagic,
+        uint32_t(frames.size()),
+        uint32_t(cameras.size()),
+        uint32_t(extensions.size()),
+        StripedFile::getStripeSize(catalog)};
+    std::ofstream file(path.string(), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const std::vector<std::string>* names : {&frames, &cameras, &extensions}) {
+      for (const std::string& name : *names) {
+        char padded[kNameSize] = {};
+        CHECK_LT(name.size(), kNameSize) << "Name too long for catalog index: " << name;
+        std::copy(name.begin(), name.end(), padded);
+        file.write(padded, kNameSize);
+      }
+    }
+    std::vector<Extent> extents;
+    for (const std::string& frameName : frames) {
+      const folly::dynamic& frame = catalog["frames"][frameName];
+      for (const std::string& cameraId : cameras) {
+        const folly::dynamic* camera = frame.get_ptr(cameraId);
+        extents.push_back(toExtent(camera));
+        for (const std::string& extension : extensions) {
+          extents.push_back(toExtent(camera ? camera->get_ptr(extension) : nullptr));
+        }
+      }
+    }
+    file.write(reinterpret_cast<const char*>(extents.data()), extents.size() * sizeof(Extent));
+    CHECK(file) << folly::sformat("Failed to write {}", path.string());
+    return true;
+  }
+
+  // nullptr if path is missing or is not a catalog index
+  static std::unique_ptr<CatalogIndex> load(const filesystem::path& path) {
+    if (!filesystem::exists(path)) {
+      return nullptr;
+    }
+    std::unique_ptr<CatalogIndex> result(new CatalogIndex);
+    try {
+      result->file = boost::interprocess::file_mapping(
+          path.string().c_str(), boost::interprocess::read_only);
+      result->region =
+          boost::interprocess::mapped_region(result->file, boost::interprocess::read_only);
+    } catch (const boost::interprocess::interprocess_exception& e) {
+      LOG(WARNING) << folly::sformat("Cannot map catalog index {}: {}", path.string(), e.what());
+      return nullptr;
+    }
+    const size_t fileSize = result->region.get_size();
+    const char* data = static_cast<const char*>(result->region.get_address());
+    if (fileSize < sizeof(Header) || result->header().magic != kMagic) {
+      LOG(WARNING) << folly::sformat("Ignoring invalid catalog index {}", path.string());
+      return nullptr;
+    }
+    const Header& header = result->header();
+    const size_t nameCount = header.frameCount + header.cameraCount + header.extensionCount;
+    const size_t extentCount =
+        size_t(header.frameCount) * header.cameraCount * (1 + header.extensionCount);
+    if (fileSize != sizeof(Header) + nameCount * kNameSize + extentCount * sizeof(Extent)) {
+      LOG(WARNING) << folly::sformat("Ignoring invalid catalog index {}", path.string());
+      return nullptr;
+    }
+    result->names = data + sizeof(Header);
+    result->extents = reinterpret_cast<const Extent*>(result->names + nameCount * kNameSize);
+    return result;
+  }
+
+  int getFrameCount() const {
+    return header().frameCount;
+  }
+
+  int getCameraCount() const {
+    return header().cameraCount;
+  }
+
+  int getExtensionCount() const {
+    return header().extensionCount;
+  }
+
+  uint64_t getStripeSize() const {
+    return header().stripeSize;
+  }
+
+  std::string getFrameName(const int frame) const {
+    return getName(frame);
+  }
+
+  // index of camera id or extension, -1 if there is none
+  int findCamera(const std::string& id) const {
+    return findName(header().frameCount, header().cameraCount, id);
+  }
+
+  int findExtension(const std::string& extension) const {
+    const int begin = header().frameCount + header().cameraCount;
+    return findName(begin, header().extensionCount, extension);
+  }
+
+  const Extent& getCamera(const int frame, const int camera) const {
+    return getExtent(frame, camera, -1);
+  }
+
+  // extension -1 is the camera
+  const Extent& getExtent(const int frame, const int camera, const int extension) const {
+    const int stride = 1 + header().extensionCount;
+    return extents[(size_t(frame) * header().cameraCount + camera) * stride + 1 + extension];
+  }
+
+ private:
+  static const uint32_t kMagic = 0x32584449; // "IDX2", "INDX" indexes had no stripe size
+
+  CatalogIndex() = default;
+
+  static void addName(std::vector<std::string>& names, const std::string& name) {
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      names.push_back(name);
+    }
+  }
+
+  static Extent toExtent(const folly::dynamic* entry) {
+    if (!entry) {
+      return {0, 0};
+    }
+    return {uint64_t((*entry)["offset"].getInt()), uint64_t((*entry)["size"].getInt())};
+  }
+
+  const Header& header() const {
+    return *static_cast<const Header*>(region.get_address());
+  }
+
+  std::string getName(const int i) const {
+    const char* name = names + size_t(i) * kNameSize;
+    return std::string(name, strnlen(name, kNameSize));
+  }
+
+  int findName(const int begin, const int count, const std::string& name) const {
+    for (int i = 0; i < count; ++i) {
+      if (getName(begin + i) == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+  const char* names;
+  const Extent* extents;
+};
+
+} // namespace fb360_dep
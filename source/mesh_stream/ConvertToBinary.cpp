@@ -5,22 +5,31 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <atomic>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
 
-#include "source/conversion/BC7Util.h"
+#include <opencv2/videoio.hpp>
+
 #include "source/mesh_stream/BinaryFusionUtil.h"
-#include "source/render/MeshSimplifier.h"
-#include "source/render/MeshUtil.h"
+#include "source/mesh_stream/CatalogIndex.h"
+#include "source/mesh_stream/MeshConversion.h"
+#include "source/util/BoundedQueue.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::bc7_util;
@@ -44,8 +53,29 @@ const std::string kUsageMessage = R"(
        If <rgba> is specified:
        - Convert color image into an RGBA binary stream
 
-       If <obj> is specified:
-       - Read .vtx and .idx files from <bin> and save .obj files to <obj> folder
+       If <astc> is specified:
+       - Convert color image into raw ASTC blocks, for gpus without BC7 (e.g. standalone headsets)
+
+       If <obj> or <ply> is specified:
+       - Also save each camera mesh as a text .obj or a binary .ply file in <bin> folder
+
+       If <fuse_direct> is specified:
+       - Append bc7, rgba, astc, vtx and idx outputs straight to the <fused> files, skipping <bin>
+
+       If <lod_triangles> is specified:
+       - Also save coarser vtx and idx for each level of detail, playback picks one per camera
+
+       If <fuse_compression> is specified:
+       - Quantize, delta code and compress the fused vtx and idx, playback decodes them
+       - gpu instead quantizes them to fixed width 16 bit values and skips the compressor, so
+         playback reads them encoded and expands them on the gpu when it can
+
+       If <color_video> is specified:
+       - Also encode each camera's color as a video in <fused>/color_video, playback decodes it
+         (in hardware when it can) instead of reading color from the fused files
+
+       If <keyframe_interval> is specified:
+       - Cameras that barely change from their keyframe reuse its outputs, fusion stores them once
 
        - Example:
          ./ConvertToBinary \
@@ -58,10 +88,19 @@ const std::string kUsageMessage = R"(
          --fused=/path/to/output/fused
      )";
 
+DEFINE_int32(astc_block_size, 4, "ASTC block width and height in pixels (4, 5, 6, 8)");
+DEFINE_string(
+    bc7_profile,
+    "veryfast",
+    "BC7 speed vs quality tradeoff (ultrafast, veryfast, fast, basic, slow)");
 DEFINE_string(bin, "bin", "output directory containing binary data");
 DEFINE_string(cameras, "", "cameras to render (comma-separated)");
 DEFINE_string(color, "", "path to input color images");
 DEFINE_double(color_scale, 1, "optional color scale before compression & fusion (>= 1 = no scale)");
+DEFINE_string(
+    color_video,
+    "",
+    "also encode color as one video per camera in --fused, played back instead (h264, hevc)");
 DEFINE_double(depth_scale, 1, "optional depthmap scale before simplification (>= 1 = no scale)");
 DEFINE_string(disparity, "", "path to disparity images (pfm)");
 DEFINE_string(first, "", "first frame to process (lexical) (required)");
@@ -69,34 +108,89 @@ DEFINE_string(
     foreground_masks,
     "",
     "path to foreground masks specifying regions to include in per-frame geometry");
+DEFINE_string(
+    fuse_compression,
+    "",
+    "compress fused vtx and idx, quantized (lz4, zstd, gpu; empty = raw)");
 DEFINE_int32(fuse_strip, 1, "number of strip files");
+DEFINE_int32(
+    fuse_stripe_kb,
+    512,
+    "stripe size of the strip files in KB, a power of two >= 4 (e.g. 1024-4096 for nvme arrays)");
 DEFINE_string(fused, "", "output directory containing fused binary data, ready for playback");
+DEFINE_bool(
+    fuse_direct,
+    false,
+    "convert straight into --fused, without writing --bin (bc7, rgba, astc, idx and vtx only)");
 DEFINE_double(gamma_correction, 2.2 / 1.8, "exponent to raise color channels before BC7 encoding");
+DEFINE_int32(
+    keyframe_interval,
+    0,
+    "frames between keyframes, cameras within --static_*_tolerance of theirs snap to it (0 = off)");
 DEFINE_string(last, "", "last frame to process (lexical) (required)");
+DEFINE_string(
+    lod_triangles,
+    "",
+    "triangles per camera mesh of each coarser level of detail, comma separated, decreasing");
+DEFINE_int32(queue_size, 8, "max images or outputs waiting between conversion stages");
 DEFINE_string(
     output_formats,
     "idx,vtx,bc7",
-    "saved formats, comma separated (idx, vtx, bc7 default; rgba, pfm, obj also supported)");
+    "saved formats, comma separated (idx, vtx, bc7 default; rgba, astc, pfm, obj, ply supported)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_bool(run_conversion, true, "whether or not to run binary conversion");
+DEFINE_string(simplifier, "quadric", "mesh simplification method (quadric, grid = faster)");
+DEFINE_double(
+    static_color_tolerance,
+    0.01,
+    "max mean color difference from the keyframe in any tile, in [0, 1], to snap to it");
+DEFINE_double(
+    static_disparity_tolerance,
+    0.001,
+    "max mean disparity difference from the keyframe in any tile, in 1/m, to snap to it");
 DEFINE_double(tear_ratio, 0.95, "depth ratio that causes mesh to tear");
 DEFINE_int32(threads, -1, "number of threads (-1 = max allowed, 0 = no threading)");
 DEFINE_int32(triangles, 150000, "number of triangles per camera mesh (<= 0: no simplification)");
 
+// Levels of detail past the first one, at --triangles
+std::vector<int> getLodTriangles() {
+  std::vector<std::string> values;
+  folly::split(",", FLAGS_lod_triangles, values, true);
+  std::vector<int> lodTriangles;
+  for (const std::string& value : values) {
+    lodTriangles.push_back(std::stoi(value));
+  }
+  return lodTriangles;
+}
+
 void verifyInputs(const Camera::Rig& rig, const std::vector<std::string>& outputFormats) {
   CHECK_NE(FLAGS_rig, "");
   CHECK_NE(FLAGS_first, "");
   CHECK_NE(FLAGS_last, "");
+  CHECK(FLAGS_simplifier == "quadric" || FLAGS_simplifier == "grid")
+      << "Invalid simplifier specified: " << FLAGS_simplifier;
+  int previousTriangles = FLAGS_triangles;
+  for (const int lodTriangles : getLodTriangles()) {
+    CHECK_GT(FLAGS_triangles, 0) << "--lod_triangles requires simplification (--triangles > 0)";
+    CHECK_GT(lodTriangles, 0);
+    CHECK_LT(lodTriangles, previousTriangles) << "--lod_triangles must be decreasing";
+    previousTriangles = lodTriangles;
+  }
 
-  const std::set<std::string> supportedFormats = {"idx", "vtx", "bc7", "obj", "pfm", "rgba"};
+  CHECK(isValidASTCBlockSize(FLAGS_astc_block_size))
+      << "Invalid ASTC block size specified: " << FLAGS_astc_block_size;
+
+  const std::set<std::string> supportedFormats = {
+      "idx", "vtx", "bc7", "obj", "ply", "pfm", "rgba", "astc"};
   for (const std::string& outputFormat : outputFormats) {
     // We allow size 0 inputs to ensure stray commas are ignored, i.e. exr,,png is fine
     CHECK(outputFormat.size() == 0 || supportedFormats.find(outputFormat) != supportedFormats.end())
         << "Invalid output format specified: " << outputFormat;
 
-    const bool isColor = outputFormat == "bc7" || outputFormat == "rgba";
+    const bool isColor =
+        outputFormat == "bc7" || outputFormat == "rgba" || outputFormat == "astc";
     const bool isDisparity = outputFormat == "idx" || outputFormat == "vtx" ||
-        outputFormat == "pfm" || outputFormat == "obj";
+        outputFormat == "pfm" || outputFormat == "obj" || outputFormat == "ply";
     if (!FLAGS_color.empty() && isColor) {
       verifyImagePaths(FLAGS_color, rig, FLAGS_first, FLAGS_last);
     } else {
@@ -113,154 +207,402 @@ void verifyInputs(const Camera::Rig& rig, const std::vector<std::string>& output
   }
 }
 
-void convertColor(
-    const std::string& camId,
-    const std::string& frameName,
-    const bool saveBc7,
-    const bool saveRgba) {
-  if (!saveRgba && !saveBc7) {
-    return;
-  }
+using mesh_conversion::EmitFn;
+using mesh_conversion::OutputFile;
 
-  LOG(INFO) << folly::sformat("Converting color: frame {}, camera {}...", frameName, camId);
+// Where outputs end up: files in <bin>, or appended straight to the fused disks
+EmitFn getOutputSink(binary_fusion::StreamingFuser* fuser) {
+  if (!fuser) {
+    return [](OutputFile outputFile) { mesh_conversion::writeOutputFile(FLAGS_bin, outputFile); };
+  }
+  return [fuser](OutputFile outputFile) {
+    fuser->add(
+        outputFile.frameName, outputFile.camId, outputFile.extension, std::move(outputFile.data));
+  };
+}
 
-  Image image = image_util::loadScaledImage<PixelType>(
+// A decoded image, waiting for conversion
+template <typename T>
+struct DecodedImage {
+  int camIdx;
+  std::string frameName;
+  std::string sourceFrame; // see CameraInputs
+  cv::Mat_<T> image;
+};
+
+Image loadColor(const std::string& camId, const std::string& frameName) {
+  return image_util::loadScaledImage<PixelType>(
       FLAGS_color, camId, frameName, FLAGS_color_scale, cv::INTER_AREA);
+}
+
+mesh_conversion::ColorOptions getColorOptions() {
+  mesh_conversion::ColorOptions options;
+  options.astcBlockSize = FLAGS_astc_block_size;
+  options.bc7Profile = FLAGS_bc7_profile;
+  options.gammaCorrection = FLAGS_gamma_correction;
+  options.threads = FLAGS_threads;
+  return options;
+}
+
+mesh_conversion::DepthOptions getDepthOptions() {
+  mesh_conversion::DepthOptions options;
+  options.depthScale = FLAGS_depth_scale;
+  options.triangles = FLAGS_triangles;
+  options.lodTriangles = getLodTriangles();
+  options.simplifier = FLAGS_simplifier;
+  options.tearRatio = FLAGS_tear_ratio;
+  options.bin = FLAGS_bin;
+  options.threads = FLAGS_threads;
+  return options;
+}
 
-  if (saveBc7) {
-    const filesystem::path bc7Path = image_util::imagePath(FLAGS_bin, camId, frameName, ".bc7");
-    filesystem::create_directories(bc7Path.parent_path());
-    const bool writeDDSHeader = false;
-    bc7_util::compressBC7(image, bc7Path, FLAGS_gamma_correction, writeDDSHeader);
+struct Conversion {
+  explicit Conversion(const std::vector<std::string>& outputFormats)
+      : saveBc7(mesh_conversion::containsFormat(outputFormats, "bc7")),
+        saveRgba(mesh_conversion::containsFormat(outputFormats, "rgba")),
+        saveAstc(mesh_conversion::containsFormat(outputFormats, "astc")),
+        saveIdx(mesh_conversion::containsFormat(outputFormats, "idx")),
+        saveVtx(mesh_conversion::containsFormat(outputFormats, "vtx")),
+        savePfm(mesh_conversion::containsFormat(outputFormats, "pfm")),
+        saveObj(mesh_conversion::containsFormat(outputFormats, "obj")),
+        savePly(mesh_conversion::containsFormat(outputFormats, "ply")),
+        colorOptions(getColorOptions()),
+        depthOptions(getDepthOptions()) {}
+
+  bool hasColor() const {
+    return !FLAGS_color.empty() && (saveBc7 || saveRgba || saveAstc);
   }
 
-  if (saveRgba) {
-    // .rgba is just uncompressed 8-bit color
-    cv::Mat_<cv::Vec4b> image = image_util::loadScaledImage<cv::Vec4b>(
-        FLAGS_color, camId, frameName, FLAGS_color_scale, cv::INTER_AREA);
-    cv::cvtColor(image, image, cv::COLOR_BGRA2RGBA, 4);
-    const filesystem::path rgbaPath = image_util::imagePath(FLAGS_bin, camId, frameName, ".rgba");
-    std::ofstream dstFile(rgbaPath.string(), std::ios::binary);
-    dstFile.write(image.ptr<char>(), image.total() * image.elemSize());
+  bool hasDepth() const {
+    return !FLAGS_disparity.empty() && (saveIdx || saveVtx || savePfm || saveObj || savePly);
   }
-}
 
-void convertDepth(
-    const Camera& cam,
-    const std::string& frameName,
-    const bool saveIdx,
-    const bool saveVtx,
-    const bool savePfm,
-    const bool saveObj) {
-  if (!saveIdx && !saveVtx && !savePfm && !saveObj) {
-    return;
+  void color(
+      const Camera& cam,
+      const std::string& frameName,
+      const Image& image,
+      const EmitFn& emit) const {
+    mesh_conversion::convertColor(
+        cam.id, frameName, image, saveBc7, saveRgba, saveAstc, colorOptions, emit);
   }
 
-  const std::string& camId = cam.id;
-  LOG(INFO) << folly::sformat("Converting depth: frame {}, camera {}...", frameName, camId);
+  // The foreground mask goes with the disparity, it is loaded from sourceFrame
+  void depth(
+      const Camera& cam,
+      const std::string& frameName,
+      const std::string& sourceFrame,
+      const cv::Mat_<float>& disparity,
+      const EmitFn& emit) const {
+    const cv::Mat_<bool> foregroundMask = FLAGS_foreground_masks.empty()
+        ? cv::Mat_<bool>()
+        : image_util::loadImage<bool>(FLAGS_foreground_masks, cam.id, sourceFrame);
+    mesh_conversion::convertDepth(
+        cam,
+        frameName,
+        disparity,
+        foregroundMask,
+        saveIdx,
+        saveVtx,
+        savePfm,
+        saveObj,
+        savePly,
+        depthOptions,
+        emit);
+  }
 
-  cv::Mat_<float> disparity = image_util::loadPfmImage(FLAGS_disparity, camId, frameName);
-  cv::Mat_<float> depth = 1.0f / disparity;
-  if (FLAGS_depth_scale < 1) {
-    // nearest neighbor resize filter since we don't want to do any averaging of depths here
-    cv::resize(depth, depth, cv::Size(), FLAGS_depth_scale, FLAGS_depth_scale, cv::INTER_NEAREST);
+  const bool saveBc7;
+  const bool saveRgba;
+  const bool saveAstc;
+  const bool saveIdx;
+  const bool saveVtx;
+  const bool savePfm;
+  const bool saveObj;
+  const bool savePly;
+  const mesh_conversion::ColorOptions colorOptions;
+  const mesh_conversion::DepthOptions depthOptions;
+};
+
+std::vector<std::string> getFrameNames() {
+  std::vector<std::string> frameNames;
+  for (int iFrame = std::stoi(FLAGS_first); iFrame <= std::stoi(FLAGS_last); ++iFrame) {
+    frameNames.push_back(image_util::intToStringZeroPad(iFrame, 6));
+  }
+  return frameNames;
+}
+
+// Inputs of a camera in a frame. sourceFrame is the frame they were loaded from: the frame itself,
+// or its keyframe if the camera snapped to it (see Keyframes)
+struct CameraInputs {
+  std::string sourceFrame;
+  Image color;
+  cv::Mat_<float> disparity;
+};
+
+CameraInputs
+loadInputs(const Conversion& conversion, const std::string& camId, const std::string& frameName) {
+  CameraInputs inputs;
+  inputs.sourceFrame = frameName;
+  if (conversion.hasColor()) {
+    inputs.color = loadColor(camId, frameName);
+  }
+  if (conversion.hasDepth()) {
+    inputs.disparity = image_util::loadPfmImage(FLAGS_disparity, camId, frameName);
   }
-  Eigen::MatrixXd vertexes = mesh_util::getVertexesEquiError(depth, cam);
-  static const bool kWrapHorizontally = false;
-  static const bool kIsSpherical = false;
-  Eigen::MatrixXi faces = mesh_util::getFaces(
-      vertexes, depth.cols, depth.rows, kWrapHorizontally, kIsSpherical, FLAGS_tear_ratio);
+  return inputs;
+}
 
-  // Remove geometry where we don't have valid depth data
-  cv::Mat_<bool> vertexMask(depth.size());
-  for (int i = 0; i < depth.rows; ++i) {
-    for (int j = 0; j < depth.cols; ++j) {
-      vertexMask(i, j) = !std::isnan(depth(i, j));
+// With --keyframe_interval, a camera whose inputs are within tolerance of its keyframe's in every
+// tile is converted from the keyframe's inputs instead. Its outputs are then the same as the
+// keyframe's, and as those of the frames in between that snapped too, so fusion stores them once
+// (see binary_fusion::CameraRepeats). Comparing tiles rather than whole images keeps a small
+// moving object from being averaged out by a static background
+class Keyframes {
+ public:
+  static const int kTileSize = 32;
+
+  explicit Keyframes(const Conversion& conversion) : conversion(conversion) {}
+
+  // Thread safe
+  CameraInputs load(const std::string& camId, const std::string& frameName) {
+    CameraInputs inputs = loadInputs(conversion, camId, frameName);
+    if (FLAGS_keyframe_interval <= 1) {
+      return inputs;
+    }
+    const int first = std::stoi(FLAGS_first);
+    const int keyframe = first +
+        (std::stoi(frameName) - first) / FLAGS_keyframe_interval * FLAGS_keyframe_interval;
+    const std::string keyframeName = image_util::intToStringZeroPad(keyframe, 6);
+    if (keyframeName == frameName) {
+      return inputs;
     }
+    const CameraInputs keyframeInputs = getKeyframe(camId, keyframeName);
+    if (isWithin(inputs.color, keyframeInputs.color, FLAGS_static_color_tolerance) &&
+        isWithin(inputs.disparity, keyframeInputs.disparity, FLAGS_static_disparity_tolerance)) {
+      ++snapCount;
+      return keyframeInputs;
+    }
+    return inputs;
   }
 
-  if (!FLAGS_foreground_masks.empty()) {
-    cv::Mat_<bool> foregroundMask =
-        image_util::loadImage<bool>(FLAGS_foreground_masks, camId, frameName);
-    cv::resize(foregroundMask, foregroundMask, depth.size(), 0, 0, cv::INTER_NEAREST);
-    vertexMask = vertexMask & foregroundMask;
+  int getSnapCount() const {
+    return snapCount;
   }
 
-  const int originalFaceCount = faces.rows();
-  mesh_util::applyMaskToVertexesAndFaces(vertexes, faces, vertexMask);
-  const int numFacesRemoved = originalFaceCount - faces.rows();
-  LOG(INFO) << folly::sformat(
-      "Removed {} of {} faces ({:.2f}%) corresponding to invalid depths and masked vertexes",
-      numFacesRemoved,
-      originalFaceCount,
-      100.f * numFacesRemoved / (float)originalFaceCount);
-
-  if (FLAGS_triangles > 0) {
-    LOG(INFO) << folly::sformat("Target number of faces: {}", FLAGS_triangles);
-    static const bool kIsEquierror = true;
-    static const int kThreads = 1;
-    render::MeshSimplifier ms(vertexes, faces, kIsEquierror, kThreads);
-    static const float kStrictness = 0.2;
-    static const bool kRemoveBoundaryEdges = false;
-    ms.simplify(FLAGS_triangles, kStrictness, kRemoveBoundaryEdges);
-    vertexes = ms.getVertexes();
-    faces = ms.getFaces();
-
-    // If depth is slightly negative, the viewer will take it to -infinity (it
-    // does the inverse). We force this values to the minimum positive value
-    for (int i = 0; i < vertexes.rows(); ++i) {
-      if (vertexes.row(i).z() < 0) {
-        vertexes.row(i).z() = FLT_MIN;
+ private:
+  CameraInputs getKeyframe(const std::string& camId, const std::string& keyframeName) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const auto it = cache.find(camId);
+      if (it != cache.end() && it->second.sourceFrame == keyframeName) {
+        return it->second;
       }
     }
+    const CameraInputs result = loadInputs(conversion, camId, keyframeName);
+    std::lock_guard<std::mutex> lock(mutex);
+    cache[camId] = result;
+    return result;
   }
 
-  const filesystem::path vertexFilename =
-      image_util::imagePath(FLAGS_bin, camId, frameName, ".vtx");
-  filesystem::create_directories(vertexFilename.parent_path());
+  // True if the mean absolute difference of a and b, per channel, is within tolerance in every tile
+  static bool isWithin(const cv::Mat& a, const cv::Mat& b, const double tolerance) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    if (a.empty()) {
+      return true; // not converted
+    }
+    cv::Mat diff;
+    cv::absdiff(a, b, diff);
+    cv::patchNaNs(diff, 0); // no disparity in either
+    for (int y = 0; y < diff.rows; y += kTileSize) {
+      for (int x = 0; x < diff.cols; x += kTileSize) {
+        const cv::Rect tile = cv::Rect(x, y, kTileSize, kTileSize) & cv::Rect(0, 0, a.cols, a.rows);
+        const cv::Scalar mean = cv::mean(diff(tile));
+        for (int c = 0; c < diff.channels(); ++c) {
+          if (mean[c] > tolerance) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
 
-  const filesystem::path indexFilename = image_util::imagePath(FLAGS_bin, camId, frameName, ".idx");
-  filesystem::create_directories(indexFilename.parent_path());
+  const Conversion& conversion;
+  std::mutex mutex;
+  std::map<std::string, CameraInputs> cache; // last keyframe loaded, by camera id
+  std::atomic<int> snapCount{0};
+};
 
-  if (saveIdx || saveVtx) {
-    mesh_util::writeDepth(vertexes, faces, vertexFilename, indexFilename);
+void logSnapCount(const Keyframes& keyframes) {
+  if (FLAGS_keyframe_interval > 1) {
+    LOG(INFO) << folly::sformat("{} cameras snapped to their keyframe", keyframes.getSnapCount());
   }
+}
+
+template <typename Fn>
+std::vector<std::thread> startStage(const int numThreads, Fn fn) {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numThreads; ++i) {
+    threads.emplace_back(fn);
+  }
+  return threads;
+}
+
+void joinStage(std::vector<std::thread>& threads) {
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// Converts all the (frame, camera) pairs as a pipeline:
+//   decode -> color (bc7, rgba, astc) -> write
+//          -> depth (mesh, simplification) -> write
+// Every stage has its own threads, connected by bounded queues that cap the number of decoded
+// images and converted outputs in memory. Stages run on dedicated threads rather than on the
+// shared thread pool because they block on the queues
+// If fuser is set, the writer appends the outputs to it, and decoding waits for the fuser to
+// catch up, so out of order outputs do not pile up in memory
+void convertPipelined(
+    const Camera::Rig& rig,
+    const std::vector<std::string>& outputFormats,
+    const int numThreads,
+    binary_fusion::StreamingFuser* fuser) {
+  const Conversion conversion(outputFormats);
+  const std::vector<std::string> frameNames = getFrameNames();
+  const int numJobs = frameNames.size() * rig.size();
+
+  BoundedQueue<DecodedImage<PixelType>> colorQueue(FLAGS_queue_size);
+  BoundedQueue<DecodedImage<float>> depthQueue(FLAGS_queue_size);
+  BoundedQueue<OutputFile> outputQueue(FLAGS_queue_size);
+  const EmitFn emit = [&](OutputFile outputFile) { outputQueue.push(std::move(outputFile)); };
+
+  // Decoding is mostly I/O and png/pfm parsing, conversion is where the time goes
+  Keyframes keyframes(conversion);
+  std::atomic<int> nextJob(0);
+  std::vector<std::thread> decoders = startStage(std::max(1, numThreads / 4), [&] {
+    for (int job = nextJob++; job < numJobs; job = nextJob++) {
+      // Frame major, so frames are completed in order
+      const std::string& frameName = frameNames[job / rig.size()];
+      const int camIdx = job % rig.size();
+      const std::string& camId = rig[camIdx].id;
+      if (fuser) {
+        fuser->waitForRoom(job);
+      }
+      const CameraInputs inputs = keyframes.load(camId, frameName);
+      if (conversion.hasColor()) {
+        colorQueue.push({camIdx, frameName, inputs.sourceFrame, inputs.color});
+      }
+      if (conversion.hasDepth()) {
+        depthQueue.push({camIdx, frameName, inputs.sourceFrame, inputs.disparity});
+      }
+    }
+  });
+
+  const int numConverters = std::max(1, numThreads / 2);
+  std::vector<std::thread> colorConverters = startStage(numConverters, [&] {
+    DecodedImage<PixelType> decoded;
+    while (colorQueue.pop(decoded)) {
+      conversion.color(rig[decoded.camIdx], decoded.frameName, decoded.image, emit);
+    }
+  });
+  std::vector<std::thread> depthConverters = startStage(numConverters, [&] {
+    DecodedImage<float> decoded;
+    while (depthQueue.pop(decoded)) {
+      conversion.depth(
+          rig[decoded.camIdx], decoded.frameName, decoded.sourceFrame, decoded.image, emit);
+    }
+  });
+
+  const EmitFn sink = getOutputSink(fuser);
+  std::vector<std::thread> writers = startStage(1, [&] {
+    OutputFile outputFile;
+    while (outputQueue.pop(outputFile)) {
+      sink(std::move(outputFile));
+    }
+  });
+
+  // Shut down stage by stage, each one drains its queue before the next one is closed
+  joinStage(decoders);
+  colorQueue.close();
+  depthQueue.close();
+  joinStage(colorConverters);
+  joinStage(depthConverters);
+  outputQueue.close();
+  joinStage(writers);
+  logSnapCount(keyframes);
+}
 
-  if (savePfm) {
-    const filesystem::path depthFilename =
-        image_util::imagePath(FLAGS_bin, camId, frameName, ".pfm");
-    filesystem::create_directories(depthFilename.parent_path());
-    mesh_util::writePfm(depth, cam.resolution, vertexes, faces, depthFilename);
+// Same as convertPipelined, one (frame, camera) at a time on the calling thread
+void convertSerial(
+    const Camera::Rig& rig,
+    const std::vector<std::string>& outputFormats,
+    binary_fusion::StreamingFuser* fuser) {
+  const Conversion conversion(outputFormats);
+  const EmitFn sink = getOutputSink(fuser);
+  Keyframes keyframes(conversion);
+  for (const std::string& frameName : getFrameNames()) {
+    for (const Camera& cam : rig) {
+      const CameraInputs inputs = keyframes.load(cam.id, frameName);
+      if (conversion.hasColor()) {
+        conversion.color(cam, frameName, inputs.color, sink);
+      }
+      if (conversion.hasDepth()) {
+        conversion.depth(cam, frameName, inputs.sourceFrame, inputs.disparity, sink);
+      }
+    }
   }
+  logSnapCount(keyframes);
+}
 
-  if (saveObj) {
-    LOG(INFO) << folly::sformat("Exporting obj: frame {}, camera {}...", frameName, camId);
-    const filesystem::path objFilename = image_util::imagePath(FLAGS_bin, camId, frameName, ".obj");
-    filesystem::create_directories(objFilename.parent_path());
-    mesh_util::writeObj(
-        mesh_util::readVertexes(vertexFilename), mesh_util::readFaces(indexFilename), objFilename);
+std::vector<std::string> getFusedDiskNames() {
+  std::vector<std::string> diskNames;
+  for (int i = 0; i < FLAGS_fuse_strip; ++i) {
+    diskNames.push_back(folly::sformat("{}/fused_{}.bin", FLAGS_fused, std::to_string(i)));
   }
+  return diskNames;
 }
 
-bool containsFormat(const std::vector<std::string>& formats, const std::string& format) {
-  return std::find(formats.begin(), formats.end(), format) != formats.end();
+// Recorded in the catalog metadata, playback reads the strip files with it (see StripedFile)
+uint64_t getFusedStripeSize() {
+  return uint64_t(FLAGS_fuse_stripe_kb) * 1024;
 }
 
-void convertFrame(
-    const Camera& cam,
-    const std::string& frameName,
-    const std::vector<std::string>& outputFormats) {
-  if (!FLAGS_color.empty()) {
-    const bool saveBc7 = containsFormat(outputFormats, "bc7");
-    const bool saveRgba = containsFormat(outputFormats, "rgba");
-    convertColor(cam.id, frameName, saveBc7, saveRgba);
+// Levels of detail go after the other extensions, from coarsest to finest, so playback reads a
+// coarse level without the finer ones (see VideoFile::selectLod)
+std::vector<std::string> getFusedExtensions(const std::vector<std::string>& outputFormats) {
+  const int numLods = getLodTriangles().size() + 1;
+  std::vector<std::string> extensions;
+  std::vector<std::string> meshExtensions;
+  for (const std::string& outputFormat : outputFormats) {
+    if (outputFormat.empty()) {
+      continue;
+    }
+    const std::string extension = "." + outputFormat;
+    const bool isMesh = extension == ".idx" || extension == ".vtx";
+    if (isMesh && numLods > 1) {
+      meshExtensions.push_back(extension);
+    } else {
+      extensions.push_back(extension);
+    }
   }
-  if (!FLAGS_disparity.empty()) {
-    const bool saveIdx = containsFormat(outputFormats, "idx");
-    const bool saveVtx = containsFormat(outputFormats, "vtx");
-    const bool savePfm = containsFormat(outputFormats, "pfm");
-    const bool saveObj = containsFormat(outputFormats, "obj");
-    convertDepth(cam, frameName, saveIdx, saveVtx, savePfm, saveObj);
+  for (int lod = numLods - 1; lod >= 0; --lod) {
+    for (const std::string& extension : meshExtensions) {
+      extensions.push_back(VideoFile::getLodExtension(extension, lod));
+    }
+  }
+  return extensions;
+}
+
+// Saves the json catalog and, unless it has encoded extensions, its flat index for playback
+void saveCatalog(const folly::dynamic& catalog) {
+  const std::string catalogFn = FLAGS_fused + "/fused.json";
+  std::ofstream ostream(catalogFn, std::ios::binary);
+  folly::PrintTo(catalog, &ostream); // PrintTo instead of toPrettyJson for sorted keys
+
+  const filesystem::path indexFn = CatalogIndex::getPath(catalogFn);
+  if (!CatalogIndex::write(catalog, indexFn)) {
+    filesystem::remove(indexFn); // left over from an earlier fusion
   }
 }
 
@@ -268,8 +610,7 @@ void fuse(const Camera::Rig& rig, const std::vector<std::string>& outputFormats)
   // Open disks
   std::vector<FILE*> disks;
   boost::filesystem::create_directories(FLAGS_fused);
-  for (int i = 0; i < FLAGS_fuse_strip; ++i) {
-    const std::string diskName = folly::sformat("{}/fused_{}.bin", FLAGS_fused, std::to_string(i));
+  for (const std::string& diskName : getFusedDiskNames()) {
     FILE* disk = fopen(diskName.c_str(), "wb");
     CHECK(disk) << folly::sformat("Failed to open {}", diskName);
     disks.push_back(disk);
@@ -280,23 +621,28 @@ void fuse(const Camera::Rig& rig, const std::vector<std::string>& outputFormats)
   catalog["metadata"] = folly::dynamic::object;
   catalog["frames"] = folly::dynamic::object;
   catalog["metadata"]["isLittleEndian"] = folly::kIsLittleEndian;
+  catalog["metadata"][kStripeSizeKey] = getFusedStripeSize();
 
-  std::vector<std::string> extensions;
-  for (const std::string& outputFormat : outputFormats) {
-    extensions.push_back("." + outputFormat);
-  }
-
-  const int numFrames = std::stoi(FLAGS_last) - std::stoi(FLAGS_first) + 1;
-  for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
-    const std::string frameName =
-        image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
+  const std::vector<std::string> extensions = getFusedExtensions(outputFormats);
+  binary_fusion::CameraRepeats repeats;
+  for (const std::string& frameName : getFrameNames()) {
     LOG(INFO) << folly::sformat("Fusing frame {}...", frameName);
-    binary_fusion::fuseFrame(catalog, disks, offset, FLAGS_bin, frameName, rig, extensions);
+    binary_fusion::fuseFrame(
+        catalog,
+        disks,
+        offset,
+        FLAGS_bin,
+        frameName,
+        rig,
+        extensions,
+        getFusedStripeSize(),
+        repeats,
+        FLAGS_fuse_compression);
   }
+  LOG(INFO) << folly::sformat(
+      "{} cameras repeat the previous frame and were stored once", repeats.getRepeatCount());
 
-  const std::string catalogFn = FLAGS_fused + "/fused.json";
-  std::ofstream ostream(catalogFn, std::ios::binary);
-  folly::PrintTo(catalog, &ostream); // PrintTo instead of toPrettyJson for sorted keys
+  saveCatalog(catalog);
 
   // Close disks
   for (FILE* disk : disks) {
@@ -309,6 +655,42 @@ void fuse(const Camera::Rig& rig, const std::vector<std::string>& outputFormats)
   filesystem::copy_file(jsonSrc, jsonDst, filesystem::copy_option::overwrite_if_exists);
 }
 
+// Converts and fuses in one pass, conversion outputs go straight to the fused disks
+void fuseDirect(
+    const Camera::Rig& rig,
+    const std::vector<std::string>& outputFormats,
+    const int numThreads) {
+  CHECK(FLAGS_run_conversion) << "--fuse_direct converts and fuses at the same time";
+  CHECK_NE(FLAGS_fused, "") << "--fuse_direct requires --fused";
+  const std::vector<std::string> extensions = getFusedExtensions(outputFormats);
+  for (const std::string& extension : extensions) {
+    const bool isColor = extension == ".bc7" || extension == ".rgba" || extension == ".astc";
+    const bool isDepth = !mesh_codec::getEncoding(extension).empty(); // .idx, .vtx and their lods
+    CHECK(isColor || isDepth) << folly::sformat("{} cannot be fused directly", extension);
+    CHECK(!isColor || !FLAGS_color.empty()) << folly::sformat("{} requires --color", extension);
+    CHECK(!isDepth || !FLAGS_disparity.empty())
+        << folly::sformat("{} requires --disparity", extension);
+  }
+
+  filesystem::create_directories(FLAGS_fused);
+  const int maxPendingCameras = numThreads + FLAGS_queue_size;
+  binary_fusion::StreamingFuser fuser(
+      getFusedDiskNames(),
+      rig,
+      getFrameNames(),
+      extensions,
+      maxPendingCameras,
+      getFusedStripeSize(),
+      FLAGS_fuse_compression);
+  if (numThreads == 0) {
+    convertSerial(rig, outputFormats, &fuser);
+  } else {
+    convertPipelined(rig, outputFormats, numThreads, &fuser);
+  }
+  saveCatalog(fuser.finish());
+  mesh_conversion::saveFusedRig(rig, FLAGS_rig, FLAGS_fused);
+}
+
 void resizeRig(Camera::Rig& rig) {
   for (Camera& camera : rig) {
     const Image image = image_util::loadScaledImage<PixelType>(
@@ -333,9 +715,39 @@ void resizeRig(Camera::Rig& rig) {
   }
 }
 
-int main(int argc, char** argv) {
-  system_util::initDep(argc, argv, kUsageMessage);
+// One video per camera in <fused>/color_video, at the resolution fused color has, so playback can
+// decode color by frame index while meshes still come from the fused files
+void encodeColorVideos(const Camera::Rig& rig) {
+  const filesystem::path dir = filesystem::path(FLAGS_fused) / "color_video";
+  if (FLAGS_color_video.empty()) {
+    filesystem::remove_all(dir); // stale videos would override the fused color
+    return;
+  }
+  filesystem::create_directories(dir);
+  const int fourcc = FLAGS_color_video == "hevc" ? cv::VideoWriter::fourcc('h', 'v', 'c', '1')
+                                                 : cv::VideoWriter::fourcc('a', 'v', 'c', '1');
+  const double kFps = 30; // playback goes by frame index, not time
+  const std::vector<std::string> frameNames = getFrameNames();
+  ThreadPool threadPool(FLAGS_threads);
+  for (const Camera& camera : rig) {
+    threadPool.spawn([&, camera] {
+      const filesystem::path path = dir / (camera.id + ".mp4");
+      cv::VideoWriter writer;
+      for (const std::string& frameName : frameNames) {
+        const cv::Mat_<cv::Vec3b> image = convertImage<cv::Vec3b>(loadColor(camera.id, frameName));
+        if (!writer.isOpened()) {
+          CHECK(writer.open(path.string(), fourcc, kFps, image.size()))
+              << folly::sformat("cannot encode {} video {}", FLAGS_color_video, path.string());
+        }
+        writer.write(image);
+      }
+    });
+  }
+  threadPool.join();
+  LOG(INFO) << folly::sformat("Color videos saved to {}", dir.string());
+}
 
+int runJob() {
   CHECK_LE(FLAGS_color_scale, 1.);
   CHECK_LE(FLAGS_depth_scale, 1.);
 
@@ -351,29 +763,40 @@ int main(int argc, char** argv) {
   std::vector<std::string> outputFormats;
   folly::split(",", FLAGS_output_formats, outputFormats);
   verifyInputs(rig, outputFormats);
+  CHECK(FLAGS_fuse_compression.empty() || mesh_codec::isSupported(FLAGS_fuse_compression))
+      << folly::sformat("Unsupported --fuse_compression {}", FLAGS_fuse_compression);
+  CHECK_GT(FLAGS_fuse_stripe_kb, 0);
+  StripedFile::checkStripeSize(getFusedStripeSize());
+  CHECK(FLAGS_color_video.empty() || FLAGS_color_video == "h264" || FLAGS_color_video == "hevc")
+      << folly::sformat("Unsupported --color_video {}", FLAGS_color_video);
+  CHECK(FLAGS_color_video.empty() || (!FLAGS_color.empty() && !FLAGS_fused.empty()))
+      << "--color_video requires --color and --fused";
+
+  const int numThreads = ThreadPool::getThreadCountFromFlag(FLAGS_threads);
+  if (FLAGS_fuse_direct) {
+    fuseDirect(rig, outputFormats, numThreads);
+    encodeColorVideos(rig);
+    return EXIT_SUCCESS;
+  }
 
   if (FLAGS_run_conversion) {
-    ThreadPool threadPool(FLAGS_threads);
-    const int numFrames = std::stoi(FLAGS_last) - std::stoi(FLAGS_first) + 1;
-    for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
-      const std::string frameName =
-          image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
-      for (const Camera& cam : rig) {
-        threadPool.spawn([&, frameName, cam] { convertFrame(cam, frameName, outputFormats); });
-      }
+    if (numThreads == 0) {
+      convertSerial(rig, outputFormats, nullptr);
+    } else {
+      convertPipelined(rig, outputFormats, numThreads, nullptr);
     }
-    threadPool.join();
-
-    const std::string stem = filesystem::path(FLAGS_rig).stem().string();
-    const std::string rigFn = folly::sformat("{}/{}_fused.json", FLAGS_bin, stem);
-    const std::vector<std::string> comments = {};
-    const int doubleNumDigits = 10;
-    Camera::saveRig(rigFn, rig, comments, doubleNumDigits);
+    mesh_conversion::saveFusedRig(rig, FLAGS_rig, FLAGS_bin);
   }
 
   if (!FLAGS_fused.empty()) {
     fuse(rig, outputFormats);
+    encodeColorVideos(rig);
   }
 
   return EXIT_SUCCESS;
 }
+
+int main(int argc, char** argv) {
+  system_util::initDep(argc, argv, kUsageMessage);
+  return system_util::runJobs(runJob);
+}
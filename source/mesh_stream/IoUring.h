@@ -0,0 +1,317 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifndef GLOG_NO_ABBREVIATED_SEVERITIES
+#define GLOG_NO_ABBREVIATED_SEVERITIES
+#endif
+#include <glog/logging.h>
+
+namespace fb360_dep {
+
+// Minimal io_uring wrapper for batched reads, on top of the raw system calls (no liburing)
+// Reads are queued with prepareRead() and handed to the kernel together by submit(), so all the
+// segments of a striped read cost one system call. Destinations inside buffers registered with
+// registerBuffers() are read with IORING_OP_READ_FIXED, which skips pinning pages on every read
+// Thread safe. At most one thread blocks in the kernel waiting for completions, and reaps them
+// on behalf of everybody
+class IoUring {
+ public:
+  // One read, possibly made of several kernel operations
+  struct Request {
+    std::vector<iovec> segments; // owned here, the kernel reads them after readBegin returns
+    int remaining = 0; // operations not completed yet
+    int64_t total = 0; // bytes read
+    int error = 0; // first errno, if any
+  };
+
+  // Shared ring, nullptr if the kernel does not support io_uring (or it is disabled, e.g. by
+  // seccomp in a container)
+  static IoUring* getInstance() {
+    static std::unique_ptr<IoUring> ring = create(kEntries);
+    return ring.get();
+  }
+
+  ~IoUring() {
+    if (sqes) {
+      munmap(sqes, numSqEntries * sizeof(io_uring_sqe));
+    }
+    if (cqRing && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Registers buffers for fixed reads. The set can be registered once per process, and the
+  // buffers must outlive the ring
+  // Returns false if registration failed, in which case reads into them are still regular reads
+  bool registerBuffers(const std::vector<iovec>& buffers) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!registered.empty() || buffers.empty()) {
+      return false;
+    }
+    const int result = syscall(
+        __NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size());
+    if (result < 0) {
+      LOG(WARNING) << "io_uring buffer registration failed, errno " << errno;
+      return false;
+    }
+    registered = buffers;
+    return true;
+  }
+
+  // Queues request->segments for reading at offset in file, without submitting them
+  void prepareRead(Request* request, const int file, const uint64_t offset) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<int> fixed(request->segments.size());
+    bool allFixed = true;
+    for (int i = 0; i < int(fixed.size()); ++i) {
+      fixed[i] = findRegistered(request->segments[i]);
+      allFixed &= fixed[i] >= 0;
+    }
+    allFixed &= int(fixed.size()) <= kMaxFixedOps;
+    const int numOps = allFixed ? fixed.size() : 1;
+
+    // Room in the completion queue for everything in flight
+    waitUntil(lock, [&] { return inFlight + numOps <= int(numCqEntries); });
+    request->remaining = numOps;
+    inFlight += numOps;
+    if (!allFixed) {
+      io_uring_sqe* sqe = getSqe(lock);
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = file;
+      sqe->off = offset;
+      sqe->addr = reinterpret_cast<uint64_t>(request->segments.data());
+      sqe->len = request->segments.size();
+      sqe->user_data = reinterpret_cast<uint64_t>(request);
+      return;
+    }
+    uint64_t segmentOffset = offset;
+    for (int i = 0; i < int(fixed.size()); ++i) {
+      const iovec& segment = request->segments[i];
+      io_uring_sqe* sqe = getSqe(lock);
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = file;
+      sqe->off = segmentOffset;
+      sqe->addr = reinterpret_cast<uint64_t>(segment.iov_base);
+      sqe->len = segment.iov_len;
+      sqe->buf_index = fixed[i];
+      sqe->user_data = reinterpret_cast<uint64_t>(request);
+      segmentOffset += segment.iov_len;
+    }
+  }
+
+  // Hands all the queued reads to the kernel
+  void submit() {
+    std::lock_guard<std::mutex> lock(mutex);
+    submitQueued();
+  }
+
+  // Blocks until request is complete, returns the number of bytes read
+  int64_t wait(Request* request) {
+    std::unique_lock<std::mutex> lock(mutex);
+    waitUntil(lock, [&] { return request->remaining == 0; });
+    CHECK_EQ(request->error, 0) << "file read error " << request->error;
+    return request->total;
+  }
+
+ private:
+  static const unsigned kEntries = 256;
+  static const int kMaxFixedOps = 64; // fixed reads are one operation per segment
+
+  static std::unique_ptr<IoUring> create(const unsigned entries) {
+    std::unique_ptr<IoUring> ring(new IoUring(entries));
+    if (ring->fd < 0) {
+      LOG(INFO) << "io_uring not available, errno " << errno;
+      return nullptr;
+    }
+    return ring;
+  }
+
+  explicit IoUring(const unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+      return;
+    }
+    numSqEntries = params.sq_entries;
+    numCqEntries = params.cq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+    cqRing = singleMmap ? sqRing : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+    void* const sqesMap = mmap(
+        nullptr,
+        numSqEntries * sizeof(io_uring_sqe),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQES);
+    CHECK_NE(sqesMap, MAP_FAILED) << "io_uring mmap failed, errno " << errno;
+    sqes = static_cast<io_uring_sqe*>(sqesMap);
+
+    uint8_t* const sq = static_cast<uint8_t*>(sqRing);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uint8_t* const cq = static_cast<uint8_t*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  void* mapRing(const size_t size, const off_t offset) {
+    void* const result =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    CHECK_NE(result, MAP_FAILED) << "io_uring mmap failed, errno " << errno;
+    return result;
+  }
+
+  // Index of the registered buffer that contains segment, -1 if none
+  int findRegistered(const iovec& segment) const {
+    const uint8_t* const begin = static_cast<const uint8_t*>(segment.iov_base);
+    for (int i = 0; i < int(registered.size()); ++i) {
+      const uint8_t* const buffer = static_cast<const uint8_t*>(registered[i].iov_base);
+      if (buffer <= begin && begin + segment.iov_len <= buffer + registered[i].iov_len) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Next free submission entry, cleared
+  io_uring_sqe* getSqe(std::unique_lock<std::mutex>&) {
+    if (queued == numSqEntries) {
+      submitQueued();
+    }
+    const unsigned tail = *sqTail + queued;
+    const unsigned index = tail & sqMask;
+    io_uring_sqe* const sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    ++queued;
+    return sqe;
+  }
+
+  void submitQueued() {
+    if (queued == 0) {
+      return;
+    }
+    // Publish the entries, then tell the kernel
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    unsigned toSubmit = queued;
+    queued = 0;
+    while (toSubmit > 0) {
+      const int result = syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, nullptr, 0);
+      if (result < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+        continue;
+      }
+      CHECK_GE(result, 0) << "io_uring submit failed, errno " << errno;
+      toSubmit -= result;
+    }
+  }
+
+  // Blocks until pred() holds, reaping completions
+  template <typename Pred>
+  void waitUntil(std::unique_lock<std::mutex>& lock, Pred pred) {
+    submitQueued();
+    while (!pred()) {
+      if (reaping) {
+        reaped.wait(lock);
+        continue;
+      }
+      // Become the reaper: wait in the kernel without holding the lock, so other threads can
+      // keep queueing reads
+      reaping = true;
+      lock.unlock();
+      if (!hasCompletions()) {
+        const int result =
+            syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        CHECK(result >= 0 || errno == EINTR) << "io_uring wait failed, errno " << errno;
+      }
+      lock.lock();
+      reapCompletions();
+      reaping = false;
+      reaped.notify_all();
+      submitQueued();
+    }
+  }
+
+  bool hasCompletions() const {
+    return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  }
+
+  void reapCompletions() {
+    unsigned head = *cqHead;
+    const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes[head & cqMask];
+      Request* const request = reinterpret_cast<Request*>(cqe.user_data);
+      if (cqe.res < 0 && request->error == 0) {
+        request->error = -cqe.res;
+      } else if (cqe.res > 0) {
+        request->total += cqe.res;
+      }
+      --request->remaining;
+      --inFlight;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  int fd = -1;
+  unsigned numSqEntries = 0;
+  unsigned numCqEntries = 0;
+  size_t sqRingSize = 0;
+  size_t cqRingSize = 0;
+  void* sqRing = nullptr;
+  void* cqRing = nullptr;
+  io_uring_sqe* sqes = nullptr;
+  unsigned* sqTail = nullptr;
+  unsigned sqMask = 0;
+  unsigned* sqArray = nullptr;
+  unsigned* cqHead = nullptr;
+  unsigned* cqTail = nullptr;
+  unsigned cqMask = 0;
+  io_uring_cqe* cqes = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable reaped;
+  bool reaping = false;
+  unsigned queued = 0; // entries written but not submitted
+  int inFlight = 0; // operations submitted or queued, not reaped
+  std::vector<iovec> registered;
+};
+
+} // namespace fb360_dep
@@ -0,0 +1,432 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/compression/Compression.h>
+#include <folly/dynamic.h>
+#include <glog/logging.h>
+
+namespace fb360_dep {
+namespace mesh_codec {
+
+// Compact encoding of the .vtx and .idx arrays of a fused stream
+// Vertexes (float x, y, z) are quantized to 16 bits per axis within their bounding box and
+// replaced by the difference to the previous vertex. Indexes (uint32 triangle lists) are replaced
+// by the zigzagged difference to the previous index. Both are then byte-shuffled, so the mostly
+// zero high bytes end up together, and go through a general purpose compressor (lz4 or zstd)
+// Decoding gives back the arrays the renderer expects, .vtx as floats and .idx as uint32, with
+// vertexes off by at most half a quantization step (bounding box / 65535)
+// Compression kGpu instead keeps every element at a fixed width and skips the compressor, so each
+// one decodes on its own and the gpu can expand the arrays at playback (see MeshCodecGpu)
+
+const std::string kQuantized16 = "quantized16"; // .vtx
+const std::string kDelta32 = "delta32"; // .idx
+const std::string kUnorm16 = "unorm16"; // .vtx, kGpu
+const std::string kBlock16 = "block16"; // .idx, kGpu
+
+const std::string kGpu = "gpu";
+
+// Indexes per kBlock16 block, which holds them as 16 bit offsets from the smallest one
+static const uint64_t kIndexBlockSize = 64;
+
+// Encoding applied to files with extension, empty if none
+// Levels of detail (e.g. .lod1.vtx, see VideoFile::getLodExtension) are encoded like their mesh
+inline std::string getEncoding(const std::string& extension) {
+  const size_t dot = extension.rfind('.');
+  const std::string base = dot == std::string::npos ? extension : extension.substr(dot);
+  if (base == ".vtx") {
+    return kQuantized16;
+  }
+  if (base == ".idx") {
+    return kDelta32;
+  }
+  return "";
+}
+
+// Encoding applied to files with extension when fusing with compression
+inline std::string getEncoding(const std::string& extension, const std::string& compression) {
+  const std::string encoding = getEncoding(extension);
+  if (compression != kGpu || encoding.empty()) {
+    return encoding;
+  }
+  return encoding == kQuantized16 ? kUnorm16 : kBlock16;
+}
+
+// Both codecs record the uncompressed size, so decoding does not need it
+inline folly::io::CodecType getCodecType(const std::string& compression) {
+  static const std::map<std::string, folly::io::CodecType> kCodecTypes = {
+      {"lz4", folly::io::CodecType::LZ4_VARINT_SIZE},
+      {"zstd", folly::io::CodecType::ZSTD},
+  };
+  const auto it = kCodecTypes.find(compression);
+  CHECK(it != kCodecTypes.end()) << "unknown compression " << compression;
+  return it->second;
+}
+
+// Whether this build of folly has the codec, kGpu needs none
+inline bool isSupported(const std::string& compression) {
+  if (compression == kGpu) {
+    return true;
+  }
+  return (compression == "lz4" || compression == "zstd") &&
+      folly::io::hasCodec(getCodecType(compression));
+}
+
+inline std::vector<uint8_t> compress(
+    const std::vector<uint8_t>& data,
+    const std::string& compression) {
+  // Codecs are not thread safe, get one per call
+  const std::unique_ptr<folly::io::Codec> codec = folly::io::getCodec(getCodecType(compression));
+  const std::string compressed = codec->compress(
+      folly::StringPiece(reinterpret_cast<const char*>(data.data()), data.size()));
+  return std::vector<uint8_t>(compressed.begin(), compressed.end());
+}
+
+inline std::string
+uncompress(const uint8_t* data, const uint64_t size, const std::string& compression) {
+  const std::unique_ptr<folly::io::Codec> codec = folly::io::getCodec(getCodecType(compression));
+  return codec->uncompress(folly::StringPiece(reinterpret_cast<const char*>(data), size));
+}
+
+// Byte b of element i goes to dst[b * count + i]
+template <typename T>
+void shuffleBytes(uint8_t* dst, const T* src, const uint64_t count) {
+  const uint8_t* const bytes = reinterpret_cast<const uint8_t*>(src);
+  for (uint64_t i = 0; i < count; ++i) {
+    for (uint64_t b = 0; b < sizeof(T); ++b) {
+      dst[b * count + i] = bytes[i * sizeof(T) + b];
+    }
+  }
+}
+
+template <typename T>
+void unshuffleBytes(T* dst, const uint8_t* src, const uint64_t count) {
+  uint8_t* const bytes = reinterpret_cast<uint8_t*>(dst);
+  for (uint64_t i = 0; i < count; ++i) {
+    for (uint64_t b = 0; b < sizeof(T); ++b) {
+      bytes[i * sizeof(T) + b] = src[b * count + i];
+    }
+  }
+}
+
+// Layout of an encoded vertex array, before compression:
+//   uint32 count, float min[3], float max[3], then per axis count shuffled uint16 deltas
+struct VertexHeader {
+  uint32_t count;
+  float lo[3];
+  float hi[3];
+};
+
+// Bounding box of vertexes, x, y, z floats
+inline VertexHeader getVertexHeader(const std::vector<float>& vertexes) {
+  static const int kDims = 3;
+  VertexHeader header;
+  header.count = vertexes.size() / kDims;
+  for (int axis = 0; axis < kDims; ++axis) {
+    header.lo[axis] = header.count ? vertexes[axis] : 0;
+    header.hi[axis] = header.lo[axis];
+  }
+  for (uint64_t i = 0; i < header.count; ++i) {
+    for (int axis = 0; axis < kDims; ++axis) {
+      header.lo[axis] = std::min(header.lo[axis], vertexes[i * kDims + axis]);
+      header.hi[axis] = std::max(header.hi[axis], vertexes[i * kDims + axis]);
+    }
+  }
+  return header;
+}
+
+inline uint16_t quantize(const VertexHeader& header, const int axis, const float v) {
+  const float range = header.hi[axis] - header.lo[axis];
+  const float scale = range > 0 ? 65535 / range : 0;
+  return std::min(65535L, std::lround((v - header.lo[axis]) * scale));
+}
+
+inline float dequantize(const VertexHeader& header, const int axis, const uint16_t q) {
+  const float step = (header.hi[axis] - header.lo[axis]) / 65535;
+  return header.lo[axis] + q * step;
+}
+
+inline std::vector<uint8_t>
+encodeVertexes(const uint8_t* data, const uint64_t size, const std::string& compression) {
+  static const int kDims = 3;
+  CHECK_EQ(size % (kDims * sizeof(float)), 0) << "malformed .vtx";
+  const uint64_t count = size / (kDims * sizeof(float));
+  std::vector<float> vertexes(count * kDims);
+  std::memcpy(vertexes.data(), data, size);
+
+  const VertexHeader header = getVertexHeader(vertexes);
+  std::vector<uint8_t> encoded(sizeof(header) + kDims * count * sizeof(uint16_t));
+  std::memcpy(encoded.data(), &header, sizeof(header));
+  std::vector<uint16_t> deltas(count);
+  for (int axis = 0; axis < kDims; ++axis) {
+    uint16_t prev = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      const uint16_t q = quantize(header, axis, vertexes[i * kDims + axis]);
+      deltas[i] = q - prev; // wraps around, undone by the wrap around in decodeVertexes()
+      prev = q;
+    }
+    uint8_t* const plane = encoded.data() + sizeof(header) + axis * count * sizeof(uint16_t);
+    shuffleBytes(plane, deltas.data(), count);
+  }
+  return compress(encoded, compression);
+}
+
+// Decodes to dst, which must hold dstSize bytes, the size of the original .vtx
+inline void decodeVertexes(
+    uint8_t* dst,
+    const uint64_t dstSize,
+    const uint8_t* data,
+    const uint64_t size,
+    const std::string& compression) {
+  static const int kDims = 3;
+  const std::string encoded = uncompress(data, size, compression);
+  VertexHeader header;
+  CHECK_GE(encoded.size(), sizeof(header)) << "malformed encoded .vtx";
+  std::memcpy(&header, encoded.data(), sizeof(header));
+  const uint64_t count = header.count;
+  CHECK_EQ(encoded.size(), sizeof(header) + kDims * count * sizeof(uint16_t));
+  CHECK_EQ(dstSize, kDims * count * sizeof(float));
+
+  std::vector<float> vertexes(count * kDims);
+  std::vector<uint16_t> deltas(count);
+  for (int axis = 0; axis < kDims; ++axis) {
+    const uint8_t* const plane = reinterpret_cast<const uint8_t*>(encoded.data()) +
+        sizeof(header) + axis * count * sizeof(uint16_t);
+    unshuffleBytes(deltas.data(), plane, count);
+    uint16_t q = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      q += deltas[i];
+      vertexes[i * kDims + axis] = dequantize(header, axis, q);
+    }
+  }
+  std::memcpy(dst, vertexes.data(), dstSize);
+}
+
+// Layout of an encoded index array, before compression:
+//   uint32 count, then count shuffled zigzagged int32 deltas
+inline std::vector<uint8_t>
+encodeIndexes(const uint8_t* data, const uint64_t size, const std::string& compression) {
+  CHECK_EQ(size % sizeof(uint32_t), 0) << "malformed .idx";
+  const uint64_t count = size / sizeof(uint32_t);
+  std::vector<uint32_t> indexes(count);
+  std::memcpy(indexes.data(), data, size);
+
+  std::vector<uint32_t> deltas(count);
+  uint32_t prev = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    const int32_t delta = indexes[i] - prev;
+    deltas[i] = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31); // small magnitudes stay small
+    prev = indexes[i];
+  }
+  std::vector<uint8_t> encoded(sizeof(uint32_t) + count * sizeof(uint32_t));
+  const uint32_t count32 = count;
+  std::memcpy(encoded.data(), &count32, sizeof(count32));
+  shuffleBytes(encoded.data() + sizeof(count32), deltas.data(), count);
+  return compress(encoded, compression);
+}
+
+inline void decodeIndexes(
+    uint8_t* dst,
+    const uint64_t dstSize,
+    const uint8_t* data,
+    const uint64_t size,
+    const std::string& compression) {
+  const std::string encoded = uncompress(data, size, compression);
+  uint32_t count;
+  CHECK_GE(encoded.size(), sizeof(count)) << "malformed encoded .idx";
+  std::memcpy(&count, encoded.data(), sizeof(count));
+  CHECK_EQ(encoded.size(), sizeof(count) + count * sizeof(uint32_t));
+  CHECK_EQ(dstSize, count * sizeof(uint32_t));
+
+  std::vector<uint32_t> indexes(count);
+  unshuffleBytes(
+      indexes.data(), reinterpret_cast<const uint8_t*>(encoded.data()) + sizeof(count), count);
+  uint32_t index = 0;
+  for (uint32_t& value : indexes) {
+    const uint32_t zigzag = value;
+    index += (zigzag >> 1) ^ -(zigzag & 1);
+    value = index;
+  }
+  std::memcpy(dst, indexes.data(), dstSize);
+}
+
+// kGpu arrays are padded to whole 32 bit words, the unit gpu buffers are read in
+inline uint64_t alignToWord(const uint64_t size) {
+  return (size + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+}
+
+// Layout of a kUnorm16 vertex array:
+//   VertexHeader, then count interleaved uint16 x, y, z
+inline std::vector<uint8_t> encodeVertexesUnorm16(const uint8_t* data, const uint64_t size) {
+  static const int kDims = 3;
+  CHECK_EQ(size % (kDims * sizeof(float)), 0) << "malformed .vtx";
+  const uint64_t count = size / (kDims * sizeof(float));
+  std::vector<float> vertexes(count * kDims);
+  std::memcpy(vertexes.data(), data, size);
+
+  const VertexHeader header = getVertexHeader(vertexes);
+  std::vector<uint16_t> quantized(count * kDims);
+  for (uint64_t i = 0; i < count * kDims; ++i) {
+    quantized[i] = quantize(header, i % kDims, vertexes[i]);
+  }
+  const uint64_t quantizedSize = quantized.size() * sizeof(uint16_t);
+  std::vector<uint8_t> encoded(alignToWord(sizeof(header) + quantizedSize));
+  std::memcpy(encoded.data(), &header, sizeof(header));
+  std::memcpy(encoded.data() + sizeof(header), quantized.data(), quantizedSize);
+  return encoded;
+}
+
+inline void decodeVertexesUnorm16(
+    uint8_t* dst,
+    const uint64_t dstSize,
+    const uint8_t* data,
+    const uint64_t size) {
+  static const int kDims = 3;
+  VertexHeader header;
+  CHECK_GE(size, sizeof(header)) << "malformed encoded .vtx";
+  std::memcpy(&header, data, sizeof(header));
+  const uint64_t count = header.count;
+  CHECK_EQ(size, alignToWord(sizeof(header) + kDims * count * sizeof(uint16_t)));
+  CHECK_EQ(dstSize, kDims * count * sizeof(float));
+
+  std::vector<uint16_t> quantized(count * kDims);
+  std::memcpy(quantized.data(), data + sizeof(header), quantized.size() * sizeof(uint16_t));
+  std::vector<float> vertexes(count * kDims);
+  for (uint64_t i = 0; i < count * kDims; ++i) {
+    vertexes[i] = dequantize(header, i % kDims, quantized[i]);
+  }
+  std::memcpy(dst, vertexes.data(), dstSize);
+}
+
+// Layout of a kBlock16 index array:
+//   uint32 count, then the uint32 smallest index of every kIndexBlockSize indexes, then count
+//   uint16 offsets from the smallest index of their block
+// Returns an empty array if the indexes of a block span more than 16 bits
+inline std::vector<uint8_t> encodeIndexesBlock16(const uint8_t* data, const uint64_t size) {
+  CHECK_EQ(size % sizeof(uint32_t), 0) << "malformed .idx";
+  const uint64_t count = size / sizeof(uint32_t);
+  std::vector<uint32_t> indexes(count);
+  std::memcpy(indexes.data(), data, size);
+
+  const uint64_t blockCount = (count + kIndexBlockSize - 1) / kIndexBlockSize;
+  std::vector<uint32_t> header(1 + blockCount);
+  header[0] = count;
+  std::vector<uint16_t> offsets(count);
+  for (uint64_t block = 0; block < blockCount; ++block) {
+    const auto begin = indexes.begin() + block * kIndexBlockSize;
+    const auto end = indexes.begin() + std::min(count, (block + 1) * kIndexBlockSize);
+    const auto minmax = std::minmax_element(begin, end);
+    if (*minmax.second - *minmax.first > 65535) {
+      return {};
+    }
+    header[1 + block] = *minmax.first;
+    for (auto it = begin; it != end; ++it) {
+      offsets[it - indexes.begin()] = *it - *minmax.first;
+    }
+  }
+  const uint64_t headerSize = header.size() * sizeof(uint32_t);
+  std::vector<uint8_t> encoded(alignToWord(headerSize + count * sizeof(uint16_t)));
+  std::memcpy(encoded.data(), header.data(), headerSize);
+  std::memcpy(encoded.data() + headerSize, offsets.data(), count * sizeof(uint16_t));
+  return encoded;
+}
+
+inline void decodeIndexesBlock16(
+    uint8_t* dst,
+    const uint64_t dstSize,
+    const uint8_t* data,
+    const uint64_t size) {
+  uint32_t count;
+  CHECK_GE(size, sizeof(count)) << "malformed encoded .idx";
+  std::memcpy(&count, data, sizeof(count));
+  const uint64_t blockCount = (count + kIndexBlockSize - 1) / kIndexBlockSize;
+  const uint64_t headerSize = (1 + blockCount) * sizeof(uint32_t);
+  CHECK_EQ(size, alignToWord(headerSize + count * sizeof(uint16_t)));
+  CHECK_EQ(dstSize, count * sizeof(uint32_t));
+
+  std::vector<uint32_t> bases(blockCount);
+  std::memcpy(bases.data(), data + sizeof(count), blockCount * sizeof(uint32_t));
+  std::vector<uint16_t> offsets(count);
+  std::memcpy(offsets.data(), data + headerSize, count * sizeof(uint16_t));
+  std::vector<uint32_t> indexes(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    indexes[i] = bases[i / kIndexBlockSize] + offsets[i];
+  }
+  std::memcpy(dst, indexes.data(), dstSize);
+}
+
+// Encodes data, a file with extension, in place
+// Returns the catalog fields that decode() needs, an empty object if extension is not encoded
+// (kGpu leaves .idx as is if it does not fit kBlock16)
+inline folly::dynamic
+encode(std::vector<uint8_t>& data, const std::string& extension, const std::string& compression) {
+  const std::string encoding = getEncoding(extension, compression);
+  if (encoding.empty()) {
+    return folly::dynamic::object;
+  }
+  const uint64_t decodedSize = data.size();
+  std::vector<uint8_t> encoded;
+  if (encoding == kQuantized16) {
+    encoded = encodeVertexes(data.data(), data.size(), compression);
+  } else if (encoding == kDelta32) {
+    encoded = encodeIndexes(data.data(), data.size(), compression);
+  } else if (encoding == kUnorm16) {
+    encoded = encodeVertexesUnorm16(data.data(), data.size());
+  } else {
+    encoded = encodeIndexesBlock16(data.data(), data.size());
+    if (encoded.empty()) {
+      return folly::dynamic::object;
+    }
+  }
+  data = std::move(encoded);
+  return folly::dynamic::object("encoding", encoding)("compression", compression)(
+      "decodedSize", decodedSize);
+}
+
+inline bool isEncoded(const folly::dynamic& entry) {
+  return entry.count("encoding") > 0;
+}
+
+// Size of the file described by a catalog entry, once decoded
+inline uint64_t getDecodedSize(const folly::dynamic& entry) {
+  return isEncoded(entry) ? entry["decodedSize"].getInt() : entry["size"].getInt();
+}
+
+// Decodes the entry.size bytes in data to dst, which must hold getDecodedSize(entry) bytes
+inline void decode(uint8_t* dst, const uint8_t* data, const folly::dynamic& entry) {
+  const uint64_t size = entry["size"].getInt();
+  if (!isEncoded(entry)) {
+    std::memcpy(dst, data, size);
+    return;
+  }
+  const std::string encoding = entry["encoding"].getString();
+  const std::string compression = entry["compression"].getString();
+  if (encoding == kQuantized16) {
+    decodeVertexes(dst, getDecodedSize(entry), data, size, compression);
+  } else if (encoding == kDelta32) {
+    decodeIndexes(dst, getDecodedSize(entry), data, size, compression);
+  } else if (encoding == kUnorm16) {
+    decodeVertexesUnorm16(dst, getDecodedSize(entry), data, size);
+  } else {
+    CHECK_EQ(encoding, kBlock16) << "unknown encoding";
+    decodeIndexesBlock16(dst, getDecodedSize(entry), data, size);
+  }
+}
+
+} // namespace mesh_codec
+} // namespace fb360_dep
@@ -0,0 +1,292 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+#include "source/conversion/BC7Util.h"
+#include "source/render/GridSimplifier.h"
+#include "source/render/MeshSimplifier.h"
+#include "source/render/MeshUtil.h"
+#include "source/render/VideoFile.h"
+#include "source/util/Camera.h"
+#include "source/util/CvUtil.h"
+#include "source/util/FilesystemUtil.h"
+#include "source/util/ImageUtil.h"
+
+namespace fb360_dep {
+namespace mesh_conversion {
+
+// Per camera conversion of color and disparity into the binary files playback reads
+// ConvertToBinary and FramePipeline share it, the former on decoded files, the latter on images
+// that never left memory
+
+// Contents of one output file, produced by the conversion stages and saved by the writer stage
+struct OutputFile {
+  std::string camId;
+  std::string frameName;
+  std::string extension;
+  std::vector<uint8_t> data;
+};
+
+using EmitFn = std::function<void(OutputFile)>;
+
+// Saves to <bin>/<camera>/<frame>.extension
+inline void writeOutputFile(const filesystem::path& bin, const OutputFile& outputFile) {
+  const filesystem::path path = image_util::imagePath(
+      bin, outputFile.camId, outputFile.frameName, outputFile.extension);
+  filesystem::create_directories(path.parent_path());
+  std::ofstream file(path.string(), std::ios::binary);
+  file.write(reinterpret_cast<const char*>(outputFile.data.data()), outputFile.data.size());
+  CHECK(file) << folly::sformat("Failed to write {}", path.string());
+}
+
+struct ColorOptions {
+  int astcBlockSize = 4; // 4, 5, 6 or 8 pixels, bigger = smaller and lower quality
+  std::string bc7Profile = "veryfast"; // ultrafast, veryfast, fast, basic, slow
+  double gammaCorrection = 2.2 / 1.8; // exponent to raise color channels before encoding
+  int threads = -1;
+};
+
+struct DepthOptions {
+  double depthScale = 1; // scale before simplification (>= 1 = no scale)
+  int triangles = 150000; // per camera mesh (<= 0: no simplification)
+  std::vector<int> lodTriangles; // coarser levels of detail past the first one, decreasing
+  std::string simplifier = "quadric"; // quadric, grid = faster
+  double tearRatio = 0.95; // depth ratio that causes mesh to tear
+  filesystem::path bin; // where pfm and obj outputs are saved
+  int threads = -1;
+};
+
+// image is decoded once and shared by all the color formats
+inline void convertColor(
+    const std::string& camId,
+    const std::string& frameName,
+    const cv::Mat_<cv::Vec4f>& image,
+    const bool saveBc7,
+    const bool saveRgba,
+    const bool saveAstc,
+    const ColorOptions& options,
+    const EmitFn& emit) {
+  LOG(INFO) << folly::sformat("Converting color: frame {}, camera {}...", frameName, camId);
+
+  if (saveBc7) {
+    const bool writeDDSHeader = false;
+    emit({camId,
+          frameName,
+          ".bc7",
+          bc7_util::compressBC7ToBuffer(
+              image,
+              options.gammaCorrection,
+              writeDDSHeader,
+              options.bc7Profile,
+              options.threads)});
+  }
+
+  if (saveRgba) {
+    // .rgba is just uncompressed 8-bit color
+    cv::Mat_<cv::Vec4b> rgba = cv_util::convertImage<cv::Vec4b>(image);
+    cv::cvtColor(rgba, rgba, cv::COLOR_BGRA2RGBA, 4);
+    const uint8_t* data = rgba.ptr<uint8_t>();
+    emit({camId,
+          frameName,
+          ".rgba",
+          std::vector<uint8_t>(data, data + rgba.total() * rgba.elemSize())});
+  }
+
+  if (saveAstc) {
+    // .astc is raw blocks, the block size follows from the size of the image and the data
+    emit({camId,
+          frameName,
+          ".astc",
+          bc7_util::compressASTCToBuffer(
+              image, options.gammaCorrection, options.astcBlockSize, options.threads)});
+  }
+}
+
+struct Mesh {
+  Eigen::MatrixXd vertexes;
+  Eigen::MatrixXi faces;
+};
+
+// If depth is slightly negative, the viewer will take it to -infinity (it
+// does the inverse). We force this values to the minimum positive value
+inline void clampNegativeDepths(Eigen::MatrixXd& vertexes) {
+  for (int i = 0; i < vertexes.rows(); ++i) {
+    if (vertexes.row(i).z() < 0) {
+      vertexes.row(i).z() = FLT_MIN;
+    }
+  }
+}
+
+// foregroundMask, if not empty, removes geometry outside of it
+inline void convertDepth(
+    const Camera& cam,
+    const std::string& frameName,
+    const cv::Mat_<float>& disparity,
+    const cv::Mat_<bool>& foregroundMask,
+    const bool saveIdx,
+    const bool saveVtx,
+    const bool savePfm,
+    const bool saveObj,
+    const bool savePly,
+    const DepthOptions& options,
+    const EmitFn& emit) {
+  const std::string& camId = cam.id;
+  LOG(INFO) << folly::sformat("Converting depth: frame {}, camera {}...", frameName, camId);
+
+  cv::Mat_<float> depth = 1.0f / disparity;
+  if (options.depthScale < 1) {
+    // nearest neighbor resize filter since we don't want to do any averaging of depths here
+    cv::resize(
+        depth, depth, cv::Size(), options.depthScale, options.depthScale, cv::INTER_NEAREST);
+  }
+  Eigen::MatrixXd vertexes = mesh_util::getVertexesEquiError(depth, cam, options.threads);
+
+  // Remove geometry where we don't have valid depth data
+  cv::Mat_<bool> vertexMask(depth.size());
+  for (int i = 0; i < depth.rows; ++i) {
+    for (int j = 0; j < depth.cols; ++j) {
+      vertexMask(i, j) = !std::isnan(depth(i, j));
+    }
+  }
+
+  if (!foregroundMask.empty()) {
+    cv::Mat_<bool> foregroundMaskResized;
+    cv::resize(foregroundMask, foregroundMaskResized, depth.size(), 0, 0, cv::INTER_NEAREST);
+    vertexMask = vertexMask & foregroundMaskResized;
+  }
+
+  Eigen::MatrixXi faces;
+  std::vector<Mesh> lods; // coarser levels of detail, finest first
+  if (options.triangles > 0 && options.simplifier == "grid") {
+    // Triangulates the depth map directly, masks and tears included, and never moves vertexes
+    LOG(INFO) << folly::sformat("Target number of faces: {}", options.triangles);
+    render::GridSimplifier gs(vertexes, vertexMask, options.tearRatio);
+    for (const int lodTriangles : options.lodTriangles) {
+      gs.simplify(lodTriangles);
+      lods.push_back({gs.getVertexes(), gs.getFaces()});
+    }
+    gs.simplify(options.triangles);
+    faces = gs.getFaces();
+    vertexes = gs.getVertexes();
+  } else {
+    static const bool kWrapHorizontally = false;
+    static const bool kIsSpherical = false;
+    faces = mesh_util::getFaces(
+        vertexes,
+        depth.cols,
+        depth.rows,
+        kWrapHorizontally,
+        kIsSpherical,
+        options.tearRatio,
+        options.threads);
+
+    const int originalFaceCount = faces.rows();
+    mesh_util::applyMaskToVertexesAndFaces(vertexes, faces, vertexMask, options.threads);
+    const int numFacesRemoved = originalFaceCount - faces.rows();
+    LOG(INFO) << folly::sformat(
+        "Removed {} of {} faces ({:.2f}%) corresponding to invalid depths and masked vertexes",
+        numFacesRemoved,
+        originalFaceCount,
+        100.f * numFacesRemoved / (float)originalFaceCount);
+  }
+
+  if (options.triangles > 0 && options.simplifier == "quadric") {
+    LOG(INFO) << folly::sformat("Target number of faces: {}", options.triangles);
+    static const bool kIsEquierror = true;
+
+    // Runs on the shared thread pool, idle workers pick up other cameras' simplifications
+    render::MeshSimplifier ms(vertexes, faces, kIsEquierror, options.threads);
+    static const float kStrictness = 0.2;
+    static const bool kRemoveBoundaryEdges = false;
+    ms.simplify(options.triangles, kStrictness, kRemoveBoundaryEdges);
+    vertexes = ms.getVertexes();
+    faces = ms.getFaces();
+    clampNegativeDepths(vertexes);
+
+    // Each level of detail is simplified from the previous one
+    for (const int lodTriangles : options.lodTriangles) {
+      const Eigen::MatrixXd& previousVertexes = lods.empty() ? vertexes : lods.back().vertexes;
+      const Eigen::MatrixXi& previousFaces = lods.empty() ? faces : lods.back().faces;
+      render::MeshSimplifier lodMs(previousVertexes, previousFaces, kIsEquierror, options.threads);
+      lodMs.simplify(lodTriangles, kStrictness, kRemoveBoundaryEdges);
+      lods.push_back({lodMs.getVertexes(), lodMs.getFaces()});
+      clampNegativeDepths(lods.back().vertexes);
+    }
+  }
+
+  if (saveIdx || saveVtx) {
+    emit({camId, frameName, ".vtx", mesh_util::serializeVertexes(vertexes)});
+    emit({camId, frameName, ".idx", mesh_util::serializeFaces(faces)});
+    for (int lod = 1; lod <= int(lods.size()); ++lod) {
+      const Mesh& mesh = lods[lod - 1];
+      emit({camId,
+            frameName,
+            VideoFile::getLodExtension(".vtx", lod),
+            mesh_util::serializeVertexes(mesh.vertexes)});
+      emit({camId,
+            frameName,
+            VideoFile::getLodExtension(".idx", lod),
+            mesh_util::serializeFaces(mesh.faces)});
+    }
+  }
+
+  if (savePfm) {
+    const filesystem::path depthFilename =
+        image_util::imagePath(options.bin, camId, frameName, ".pfm");
+    filesystem::create_directories(depthFilename.parent_path());
+    mesh_util::writePfm(depth, cam.resolution, vertexes, faces, depthFilename);
+  }
+
+  if (saveObj) {
+    LOG(INFO) << folly::sformat("Exporting obj: frame {}, camera {}...", frameName, camId);
+    const filesystem::path objFilename =
+        image_util::imagePath(options.bin, camId, frameName, ".obj");
+    filesystem::create_directories(objFilename.parent_path());
+
+    // Same precision as the .vtx file
+    const Eigen::MatrixXd vertexesVtx = vertexes.cast<float>().cast<double>();
+    mesh_util::writeObj(vertexesVtx, faces, objFilename, "", options.threads);
+  }
+
+  if (savePly) {
+    LOG(INFO) << folly::sformat("Exporting ply: frame {}, camera {}...", frameName, camId);
+    const filesystem::path plyFilename =
+        image_util::imagePath(options.bin, camId, frameName, ".ply");
+    filesystem::create_directories(plyFilename.parent_path());
+    mesh_util::writePly(vertexes, faces, plyFilename, options.threads);
+  }
+}
+
+inline bool containsFormat(const std::vector<std::string>& formats, const std::string& format) {
+  return std::find(formats.begin(), formats.end(), format) != formats.end();
+}
+
+// Saves rig as <dir>/<stem of rigPath>_fused.json, the rig fusion and playback expect
+inline void saveFusedRig(
+    const Camera::Rig& rig,
+    const filesystem::path& rigPath,
+    const filesystem::path& dir) {
+  const std::string rigFn =
+      folly::sformat("{}/{}_fused.json", dir.string(), rigPath.stem().string());
+  const std::vector<std::string> comments = {};
+  const int doubleNumDigits = 10;
+  Camera::saveRig(rigFn, rig, comments, doubleNumDigits);
+}
+
+} // namespace mesh_conversion
+} // namespace fb360_dep
@@ -11,22 +11,30 @@
 #endif
 #include <vector>
 
+#include <folly/dynamic.h>
 #include <glog/logging.h>
 
 #include "source/mesh_stream/AsyncFile.h"
 
 namespace fb360_dep {
 
-static const uint64_t kStripeSize = 512 * 1024;
+// stripe size of catalogs that do not record one
+static const uint64_t kDefaultStripeSize = 512 * 1024;
+
+// catalog metadata key of the stripe size
+static const char* const kStripeSizeKey = "stripeSize";
 
 // a StripedFile is N files ("disks") posing as a single, logical file
 // each sub-file holds every N "stripe" of the logical file
-// and each stripe is 512kB
+// the stripe size is a property of the fused file, fusion records it in the catalog metadata
+// (see getStripeSize), it is a power of two multiple of kPageSize
 
 // to initiate a read from a striped file, you might:
 //   PendingRead* request = stripedFile.readBegin(dst.data(), offset, size);
 // note: offset must be stripe-aligned, dst and size must be page-aligned
 
+// reads into buffers registered with AsyncFile::registerBuffers avoid per-read page pinning
+
 // to complete a read, you must then:
 //   stripedFile.readEnd(request);
 // note: this operation is blocking
@@ -34,7 +42,16 @@ static const uint64_t kStripeSize = 512 * 1024;
 struct StripedFile {
   StripedFile() {}
 
-  StripedFile(const std::vector<std::string>& diskNames) {
+  // queueDepth is the max reads each disk gets per request, the stripes of a disk are split
+  // evenly among them. 1 suits spinning disks, which prefer one long read, flash arrays want
+  // several in flight
+  StripedFile(
+      const std::vector<std::string>& diskNames,
+      const uint64_t stripeSize = kDefaultStripeSize,
+      const int queueDepth = 1)
+      : stripeSize(stripeSize), queueDepth(queueDepth) {
+    checkStripeSize(stripeSize);
+    CHECK_GE(queueDepth, 1);
     // open the disks
     for (const std::string& diskName : diskNames) {
       disks.emplace_back(diskName);
@@ -50,39 +67,57 @@ struct StripedFile {
 
   using PendingRead = std::vector<AsyncFile::PendingRead>;
 
+  static void checkStripeSize(const uint64_t stripeSize) {
+    CHECK(stripeSize >= kPageSize && (stripeSize & (stripeSize - 1)) == 0)
+        << "stripe size must be a power of two multiple of " << kPageSize << ": " << stripeSize;
+  }
+
+  // stripe size recorded in the metadata of a fused catalog, kDefaultStripeSize if there is none
+  static uint64_t getStripeSize(const folly::dynamic& catalog) {
+    const folly::dynamic* metadata = catalog.get_ptr("metadata");
+    const folly::dynamic* stripeSize = metadata ? metadata->get_ptr(kStripeSizeKey) : nullptr;
+    return stripeSize ? uint64_t(stripeSize->getInt()) : kDefaultStripeSize;
+  }
+
   PendingRead* readBegin(uint8_t* dst, uint64_t offset, uint64_t size) const {
     // check alignment constraints
-    CHECK(align(offset, kStripeSize) == offset);
-    // create vector to store PendingReads
-    const uint64_t stripeCount = align(size, kStripeSize) / kStripeSize;
-    const bool kPerStripe = false; // one read per stripe or one read per disk?
-    const uint64_t readCount = kPerStripe ? stripeCount : disks.size();
-    PendingRead* result = new PendingRead(readCount);
+    CHECK(align(offset, stripeSize) == offset);
     // for each disk, compute local disk offset and memory segments
+    const uint64_t stripeCount = align(size, stripeSize) / stripeSize;
     std::vector<uint64_t> offsets(disks.size(), UINT64_MAX);
     std::vector<std::vector<AsyncFile::Segment>> segments(disks.size());
     for (int stripe = 0; stripe < int(stripeCount); ++stripe) {
       uint64_t local, disk;
       calcStripe(local, disk, offset);
-      AsyncFile::Segment segment = {dst, std::min(size, kStripeSize)};
-      if (kPerStripe) {
-        // kick off a separate read for every stripe, don't coalesce per disk
-        disks[disk].readBegin((*result)[stripe], {segment}, local);
-      } else {
-        offsets[disk] = std::min(local, offsets[disk]);
-        segments[disk].push_back(segment);
-      }
-      dst += kStripeSize;
-      offset += kStripeSize;
-      size -= kStripeSize;
+      offsets[disk] = std::min(local, offsets[disk]);
+      segments[disk].push_back({dst, std::min(size, stripeSize)});
+      dst += stripeSize;
+      offset += stripeSize;
+      size -= stripeSize;
     }
-    if (!kPerStripe) {
-      // kick off one read per disk
-      for (int read = 0; read < int(disks.size()); ++read) {
-        CHECK_NE(offsets[read], UINT64_MAX);
-        disks[read].readBegin((*result)[read], segments[read], offsets[read]);
+    // the stripes of a disk are consecutive on that disk, split them into up to queueDepth reads
+    // the PendingReads are allocated up front, the kernel holds on to them until readEnd
+    uint64_t readCount = 0;
+    for (const std::vector<AsyncFile::Segment>& diskSegments : segments) {
+      readCount += std::min<uint64_t>(diskSegments.size(), queueDepth);
+    }
+    PendingRead* result = new PendingRead(readCount);
+    int read = 0;
+    for (int disk = 0; disk < int(disks.size()); ++disk) {
+      const std::vector<AsyncFile::Segment>& diskSegments = segments[disk];
+      const int count = diskSegments.size();
+      const int reads = std::min(count, queueDepth);
+      for (int i = 0; i < reads; ++i) {
+        const int begin = count * i / reads;
+        const int end = count * (i + 1) / reads;
+        disks[disk].readBegin(
+            (*result)[read++],
+            {diskSegments.begin() + begin, diskSegments.begin() + end},
+            offsets[disk] + begin * stripeSize);
       }
     }
+    // all the disks' reads go to the kernel together
+    AsyncFile::submit();
     return result;
   }
 
@@ -94,18 +129,24 @@ struct StripedFile {
   }
 
   // compute the disk and local offset from global offset
-  static void
-  calcStripe(uint64_t& local, uint64_t& disk, const uint64_t global, const uint64_t diskCount) {
-    uint64_t stripe = global / kStripeSize;
-    local = (stripe / diskCount) * kStripeSize;
+  static void calcStripe(
+      uint64_t& local,
+      uint64_t& disk,
+      const uint64_t global,
+      const uint64_t diskCount,
+      const uint64_t stripeSize) {
+    uint64_t stripe = global / stripeSize;
+    local = (stripe / diskCount) * stripeSize;
     disk = stripe % diskCount;
   }
 
   void calcStripe(uint64_t& local, uint64_t& disk, const uint64_t global) const {
-    calcStripe(local, disk, global, disks.size());
+    calcStripe(local, disk, global, disks.size(), stripeSize);
   }
 
   std::vector<AsyncFile> disks;
+  uint64_t stripeSize = kDefaultStripeSize;
+  int queueDepth = 1;
 };
 
 } // namespace fb360_dep
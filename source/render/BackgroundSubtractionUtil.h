@@ -15,41 +15,75 @@
 namespace fb360_dep {
 namespace background_subtraction {
 
-template <typename T, typename U>
-cv::Mat_<bool> generateForegroundMask(
-    const cv::Mat_<T>& templateColor,
-    const cv::Mat_<T>& frameColor,
-    const int blurRadius,
-    const float threshold,
-    const int morphClosingRadius) {
-  CHECK_EQ(templateColor.size(), frameColor.size());
+const int kForegroundBandRows = 32; // rows per band of the fused kernel
 
-  // Blur images to reduce noise
+// Blurred template in float, without alpha, as generateForegroundMask() compares frames to it
+// The template does not change from frame to frame, so callers compute this once per camera
+template <typename T>
+cv::Mat_<cv::Vec3f> blurBackground(const cv::Mat_<T>& templateColor, const int blurRadius) {
   const cv::Mat_<T> templateBlurred =
       blurRadius > 0 ? cv_util::gaussianBlur(templateColor, blurRadius) : templateColor;
-  const cv::Mat_<T> frameBlurred =
-      blurRadius > 0 ? cv_util::gaussianBlur(frameColor, blurRadius) : frameColor;
-
-  const cv::Mat_<U> templateFloat = cv_util::convertTo<float>(templateBlurred);
-  const cv::Mat_<U> frameFloat = cv_util::convertTo<float>(frameBlurred);
-
-  // mask = ||template - frame||^2 > threshold
-  cv::Mat_<U> imageDiff;
-  cv::absdiff(templateFloat, frameFloat, imageDiff);
-  cv::Mat_<cv::Vec3f> imageDiffNoAlpha = cv_util::removeAlpha(imageDiff);
-  cv::Mat_<bool> foregroundMask(imageDiff.size(), false);
-  for (int y = 0; y < imageDiffNoAlpha.rows; ++y) {
-    for (int x = 0; x < imageDiffNoAlpha.cols; ++x) {
-      foregroundMask(y, x) = cv::norm(imageDiffNoAlpha(y, x)) > threshold;
-    }
-  }
+  return cv_util::removeAlpha(cv_util::convertTo<float>(templateBlurred));
+}
 
-  // Fill holes
+// Fills holes in a foreground mask
+inline void closeForegroundMask(cv::Mat_<bool>& foregroundMask, const int morphClosingRadius) {
   if (morphClosingRadius > 0) {
     const cv::Size kElementSize = cv::Size(morphClosingRadius, morphClosingRadius);
     cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, kElementSize);
     cv::morphologyEx(foregroundMask, foregroundMask, cv::MORPH_CLOSE, element);
   }
+}
+
+// mask = ||background - blurred frame|| > threshold, then closed to fill holes
+// Blur, conversion, difference and threshold run in one pass over bands of rows, in parallel, so
+// the frame is only ever blurred a band at a time and no full size float image is made. Gaussian
+// blur of a band reads the neighboring rows of the frame, so bands match blurring the whole frame
+template <typename T>
+cv::Mat_<bool> generateForegroundMask(
+    const cv::Mat_<cv::Vec3f>& background,
+    const cv::Mat_<T>& frameColor,
+    const int blurRadius,
+    const float threshold,
+    const int morphClosingRadius,
+    const int numThreads = -1) {
+  CHECK_EQ(background.size(), frameColor.size());
+  const int channels = std::min(cv::DataType<T>::channels, 3);
+  const float scale = 1.0f / cv_util::maxPixelValue(frameColor);
+  const float thresholdSq = threshold * threshold;
+
+  cv::Mat_<bool> foregroundMask(frameColor.size());
+  const int bands = (frameColor.rows + kForegroundBandRows - 1) / kForegroundBandRows;
+  parallelFor(
+      0,
+      bands,
+      1,
+      [&](const int band) {
+        const int begin = band * kForegroundBandRows;
+        const int end = std::min(begin + kForegroundBandRows, frameColor.rows);
+        const cv::Mat_<T> frameBand = frameColor.rowRange(begin, end);
+        cv::Mat_<T> frameBlurred = frameBand;
+        if (blurRadius > 0) {
+          const int w = 2 * blurRadius + 1;
+          cv::GaussianBlur(frameBand, frameBlurred, cv::Size(w, w), 0, 0);
+        }
+        for (int y = begin; y < end; ++y) {
+          const T* frame = frameBlurred[y - begin];
+          const cv::Vec3f* bg = background[y];
+          bool* mask = foregroundMask[y];
+          for (int x = 0; x < frameColor.cols; ++x) {
+            float normSq = 0;
+            for (int c = 0; c < channels; ++c) {
+              const float diff = frame[x][c] * scale - bg[x][c];
+              normSq += diff * diff;
+            }
+            mask[x] = normSq > thresholdSq;
+          }
+        }
+      },
+      numThreads);
+
+  closeForegroundMask(foregroundMask, morphClosingRadius);
 
   const int count = cv::countNonZero(foregroundMask);
   const float fgPct = 100.0f * count / (foregroundMask.cols * foregroundMask.rows);
@@ -58,9 +92,46 @@ cv::Mat_<bool> generateForegroundMask(
   return foregroundMask;
 }
 
+// U is kept for callers that spell out the float type, the comparison is always in cv::Vec3f
 template <typename T, typename U>
-std::vector<cv::Mat_<bool>> generateForegroundMasks(
+cv::Mat_<bool> generateForegroundMask(
+    const cv::Mat_<T>& templateColor,
+    const cv::Mat_<T>& frameColor,
+    const int blurRadius,
+    const float threshold,
+    const int morphClosingRadius) {
+  CHECK_EQ(templateColor.size(), frameColor.size());
+  return generateForegroundMask<T>(
+      blurBackground(templateColor, blurRadius),
+      frameColor,
+      blurRadius,
+      threshold,
+      morphClosingRadius);
+}
+
+template <typename T>
+std::vector<cv::Mat_<cv::Vec3f>> blurBackgrounds(
     const std::vector<cv::Mat_<T>>& templateColors,
+    const int blurRadius,
+    const int numThreads = -1) {
+  std::vector<cv::Mat_<cv::Vec3f>> backgrounds(templateColors.size());
+  parallelFor(
+      0,
+      templateColors.size(),
+      1,
+      [&](const int i) {
+        if (!templateColors[i].empty()) {
+          backgrounds[i] = blurBackground(templateColors[i], blurRadius);
+        }
+      },
+      numThreads);
+  return backgrounds;
+}
+
+// backgrounds from blurBackgrounds(). Cameras without a background pass everything
+template <typename T>
+std::vector<cv::Mat_<bool>> generateForegroundMasks(
+    const std::vector<cv::Mat_<cv::Vec3f>>& backgrounds,
     const std::vector<cv::Mat_<T>>& frameColors,
     const cv::Size& size,
     const int blurRadius,
@@ -69,15 +140,20 @@ std::vector<cv::Mat_<bool>> generateForegroundMasks(
     const int numThreads = -1) {
   CHECK_GT(frameColors.size(), 0);
   const cv::Mat_<bool> allPass(size, true);
-  std::vector<cv::Mat_<bool>> masks(templateColors.size());
+  std::vector<cv::Mat_<bool>> masks(backgrounds.size());
   ThreadPool threadPool(numThreads);
-  for (int i = 0; i < int(templateColors.size()); ++i) {
+  for (int i = 0; i < int(backgrounds.size()); ++i) {
     threadPool.spawn([&, i] {
-      LOG(INFO) << folly::sformat("{} of {}...", i + 1, templateColors.size());
-      masks[i] = templateColors[i].empty()
+      LOG(INFO) << folly::sformat("{} of {}...", i + 1, backgrounds.size());
+      masks[i] = backgrounds[i].empty()
           ? allPass
-          : generateForegroundMask<T, U>(
-                templateColors[i], frameColors[i], blurRadius, threshold, morphClosingRadius);
+          : generateForegroundMask<T>(
+                backgrounds[i],
+                frameColors[i],
+                blurRadius,
+                threshold,
+                morphClosingRadius,
+                numThreads);
     });
   }
   threadPool.join();
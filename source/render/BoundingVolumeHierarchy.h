@@ -7,111 +7,464 @@
 
 #pragma once
 
-#include <set>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
 #include <vector>
 
-#include <opencv2/calib3d.hpp>
-#include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
-#include <opencv2/imgproc.hpp>
+#if defined(__SSE__) || defined(__x86_64__)
+#include <xmmintrin.h>
+#define DEP_BVH_SSE 1
+#endif
+
+#include <glog/logging.h>
 
 #include "source/render/RaytracingPrimitives.h"
 
 namespace fb360_dep {
 namespace render {
 
-// a randomized sphere-tree bounding volume hierarchy for accelerating
-// ray-triangle tests
-struct BoundingVolumeHierarchy {
-  bool isLeaf;
-  Sphere sphere;
-  std::vector<BoundingVolumeHierarchy> children;
-  std::vector<Triangle> leafTriangles;
-
-  static BoundingVolumeHierarchy makeBVH(
-      const std::vector<Triangle>& triangles,
-      const int thresholdNumTrisForLeaf,
-      const int splitK,
-      const int currDepth,
-      const int maxDepth) {
-    BoundingVolumeHierarchy bvh;
-
-    // construct a sphere that contains all of the triangles we have. first,
-    // find the center of mass of their vertices. then find a sufficient radius
-    cv::Vec3f cm(0.0f, 0.0f, 0.0f);
-    for (const Triangle& t : triangles) {
-      cm += t.v0 + t.v1 + t.v2;
-    }
-    cm /= float(triangles.size() * 3);
-    bvh.sphere.center = cm;
-
-    bvh.sphere.radius = 0.0f;
-    for (const Triangle& t : triangles) {
-      bvh.sphere.radius = std::max(bvh.sphere.radius, float(norm(cm - t.v0)));
-      bvh.sphere.radius = std::max(bvh.sphere.radius, float(norm(cm - t.v1)));
-      bvh.sphere.radius = std::max(bvh.sphere.radius, float(norm(cm - t.v2)));
-    }
-
-    // if we hit one of the termination criteria, stop:
-    // 1. reached max depth
-    // 2. not enough triangles to go further
-    if (currDepth >= maxDepth || int(triangles.size()) < splitK ||
-        int(triangles.size()) < thresholdNumTrisForLeaf) {
-      bvh.isLeaf = true;
-      bvh.leafTriangles = triangles;
-      return bvh;
-    }
-
-    // at this point we know it's not going to be a leaf. we will pick splitK
-    // triangles at random to be "cluster centers", assign each triangle to
-    // its closest cluster center, and make a child volume around each center.
-    // this is similar to doing 1 iteration of k-means clustering with random
-    // initialization.
-    bvh.isLeaf = false;
-
-    // pick splitK unique triangles
-    std::vector<int> centerTriangleIndices;
-    std::set<int> centerTriangleSet;
-    while (int(centerTriangleIndices.size()) < splitK) {
-      int r = rand() % triangles.size();
-      if (centerTriangleSet.count(r) == 0) {
-        centerTriangleIndices.push_back(r);
-        centerTriangleSet.insert(r);
+// 4 lanes of floats and of lane masks, sse when available
+#ifdef DEP_BVH_SSE
+struct Mask4 {
+  __m128 v;
+  Mask4 operator&(const Mask4& o) const {
+    return {_mm_and_ps(v, o.v)};
+  }
+  int bits() const {
+    return _mm_movemask_ps(v);
+  }
+};
+
+struct Float4 {
+  __m128 v;
+  static Float4 broadcast(const float f) {
+    return {_mm_set1_ps(f)};
+  }
+  static Float4 load(const float* p) {
+    return {_mm_loadu_ps(p)};
+  }
+  void store(float* p) const {
+    _mm_storeu_ps(p, v);
+  }
+  Float4 operator+(const Float4& o) const {
+    return {_mm_add_ps(v, o.v)};
+  }
+  Float4 operator-(const Float4& o) const {
+    return {_mm_sub_ps(v, o.v)};
+  }
+  Float4 operator*(const Float4& o) const {
+    return {_mm_mul_ps(v, o.v)};
+  }
+  Float4 operator/(const Float4& o) const {
+    return {_mm_div_ps(v, o.v)};
+  }
+  Mask4 operator<(const Float4& o) const {
+    return {_mm_cmplt_ps(v, o.v)};
+  }
+  Mask4 operator<=(const Float4& o) const {
+    return {_mm_cmple_ps(v, o.v)};
+  }
+  Mask4 operator>=(const Float4& o) const {
+    return {_mm_cmpge_ps(v, o.v)};
+  }
+  friend Float4 min(const Float4& a, const Float4& b) {
+    return {_mm_min_ps(a.v, b.v)};
+  }
+  friend Float4 max(const Float4& a, const Float4& b) {
+    return {_mm_max_ps(a.v, b.v)};
+  }
+};
+#else
+struct Mask4 {
+  bool v[4];
+  Mask4 operator&(const Mask4& o) const {
+    return {{v[0] && o.v[0], v[1] && o.v[1], v[2] && o.v[2], v[3] && o.v[3]}};
+  }
+  int bits() const {
+    return v[0] | v[1] << 1 | v[2] << 2 | v[3] << 3;
+  }
+};
+
+struct Float4 {
+  float v[4];
+  static Float4 broadcast(const float f) {
+    return {{f, f, f, f}};
+  }
+  static Float4 load(const float* p) {
+    return {{p[0], p[1], p[2], p[3]}};
+  }
+  void store(float* p) const {
+    std::copy(v, v + 4, p);
+  }
+#define DEP_FLOAT4_OP(op, Result, fn)                                                 \
+  Result operator op(const Float4& o) const {                                         \
+    return {{fn(v[0], o.v[0]), fn(v[1], o.v[1]), fn(v[2], o.v[2]), fn(v[3], o.v[3])}}; \
+  }
+#define DEP_FLOAT4_FN(op) [](const float a, const float b) { return a op b; }
+  DEP_FLOAT4_OP(+, Float4, DEP_FLOAT4_FN(+))
+  DEP_FLOAT4_OP(-, Float4, DEP_FLOAT4_FN(-))
+  DEP_FLOAT4_OP(*, Float4, DEP_FLOAT4_FN(*))
+  DEP_FLOAT4_OP(/, Float4, DEP_FLOAT4_FN(/))
+  DEP_FLOAT4_OP(<, Mask4, DEP_FLOAT4_FN(<))
+  DEP_FLOAT4_OP(<=, Mask4, DEP_FLOAT4_FN(<=))
+  DEP_FLOAT4_OP(>=, Mask4, DEP_FLOAT4_FN(>=))
+#undef DEP_FLOAT4_FN
+#undef DEP_FLOAT4_OP
+  // same as sse for nans: the second argument
+  friend Float4 min(const Float4& a, const Float4& b) {
+    return {{a.v[0] < b.v[0] ? a.v[0] : b.v[0],
+             a.v[1] < b.v[1] ? a.v[1] : b.v[1],
+             a.v[2] < b.v[2] ? a.v[2] : b.v[2],
+             a.v[3] < b.v[3] ? a.v[3] : b.v[3]}};
+  }
+  friend Float4 max(const Float4& a, const Float4& b) {
+    return {{a.v[0] > b.v[0] ? a.v[0] : b.v[0],
+             a.v[1] > b.v[1] ? a.v[1] : b.v[1],
+             a.v[2] > b.v[2] ? a.v[2] : b.v[2],
+             a.v[3] > b.v[3] ? a.v[3] : b.v[3]}};
+  }
+};
+#endif
+
+// bounding volume hierarchy of axis aligned boxes for accelerating ray-triangle tests
+// Built top-down with the surface area heuristic: each node is split at the bin boundary of
+// triangle centroids that minimizes the expected cost of tracing a ray through its children,
+// which is proportional to their surface area times their number of triangles. Nodes live in one
+// array in depth-first order, an inner node's first child right after it, and the leaves index a
+// copy of the triangles sorted to match
+// Rays are traced in packets of up to kPacketSize that share the walk down the tree, with box and
+// triangle tests done for all of the packet's rays at once. Coherent rays, e.g. from neighboring
+// pixels, visit almost the same nodes
+class BoundingVolumeHierarchy {
+ public:
+  static const int kPacketSize = 4;
+
+  explicit BoundingVolumeHierarchy(
+      const std::vector<Triangle>& trianglesIn,
+      const int maxTrianglesInLeaf = 4)
+      : maxTrianglesInLeaf(maxTrianglesInLeaf) {
+    CHECK_GT(maxTrianglesInLeaf, 0);
+    std::vector<Primitive> primitives;
+    primitives.reserve(trianglesIn.size());
+    for (int i = 0; i < int(trianglesIn.size()); ++i) {
+      Primitive primitive;
+      primitive.bounds.add(trianglesIn[i].v0);
+      primitive.bounds.add(trianglesIn[i].v1);
+      primitive.bounds.add(trianglesIn[i].v2);
+      primitive.centroid = primitive.bounds.center();
+      primitive.index = i;
+      primitives.push_back(primitive);
+    }
+    nodes.reserve(2 * primitives.size() / maxTrianglesInLeaf + 1);
+    nodes.emplace_back();
+    build(0, primitives, 0, primitives.size());
+    triangles.reserve(primitives.size());
+    for (const Primitive& primitive : primitives) {
+      triangles.push_back(trianglesIn[primitive.index]);
+    }
+  }
+
+  int getNodeCount() const {
+    return nodes.size();
+  }
+
+  // closest intersection of each ray, count <= kPacketSize
+  void intersect(const Ray* rays, const int count, RayIntersectionResult* results) const {
+    CHECK_GT(count, 0);
+    CHECK_LE(count, int(kPacketSize));
+    float lanes[3][3][kPacketSize]; // origin, direction, 1 / direction
+    float best[kPacketSize];
+    for (int lane = 0; lane < kPacketSize; ++lane) {
+      const Ray& ray = rays[std::min(lane, count - 1)]; // unused lanes repeat the last ray
+      for (int axis = 0; axis < 3; ++axis) {
+        lanes[0][axis][lane] = ray.origin[axis];
+        lanes[1][axis][lane] = ray.dir[axis];
+        lanes[2][axis][lane] = 1 / ray.dir[axis];
+      }
+      best[lane] = FLT_MAX;
+      results[std::min(lane, count - 1)] = RayIntersectionResult(false, FLT_MAX, -1);
+    }
+    Float4 origin[3];
+    Float4 dir[3];
+    Float4 invDir[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      origin[axis] = Float4::load(lanes[0][axis]);
+      dir[axis] = Float4::load(lanes[1][axis]);
+      invDir[axis] = Float4::load(lanes[2][axis]);
+    }
+    const int activeBits = (1 << count) - 1;
+    const Float4 zero = Float4::broadcast(0);
+
+    // visit the near child first, as seen by the first ray
+    int stack[kMaxDepth];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+      const Node& node = nodes[stack[--stackSize]];
+
+      // slab test, hits closer than the best hit so far
+      Float4 tMin = zero;
+      Float4 tMax = Float4::load(best);
+      for (int axis = 0; axis < 3; ++axis) {
+        const Float4 t0 = (Float4::broadcast(node.lower[axis]) - origin[axis]) * invDir[axis];
+        const Float4 t1 = (Float4::broadcast(node.upper[axis]) - origin[axis]) * invDir[axis];
+        tMin = max(tMin, min(t0, t1));
+        tMax = min(tMax, max(t0, t1));
+      }
+      const int hitBits = (tMin <= tMax).bits() & activeBits;
+      if (!hitBits) {
+        continue;
+      }
+
+      if (node.count == 0) {
+        const int first = &node - nodes.data() + 1;
+        if (lanes[1][node.axis][0] < 0) {
+          stack[stackSize++] = first;
+          stack[stackSize++] = node.offset;
+        } else {
+          stack[stackSize++] = node.offset;
+          stack[stackSize++] = first;
+        }
+        continue;
+      }
+
+      for (int i = node.offset; i < node.offset + node.count; ++i) {
+        int bits = intersectTriangle(origin, dir, best, triangles[i]) & hitBits;
+        for (int lane = 0; bits; ++lane, bits >>= 1) {
+          if (bits & 1) {
+            results[lane] = RayIntersectionResult(true, best[lane], triangles[i].selfIdx);
+          }
+        }
+      }
+    }
+  }
+
+  // closest intersection of ray
+  RayIntersectionResult intersect(const Ray& ray) const {
+    RayIntersectionResult result = RayIntersectionResult::miss();
+    intersect(&ray, 1, &result);
+    return result;
+  }
+
+ private:
+  static const int kBinCount = 16;
+  static const int kMaxDepth = 64; // stack entries, the tree is at most kMaxDepth - 1 deep
+
+  struct Bounds {
+    float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    void add(const cv::Vec3f& p) {
+      for (int axis = 0; axis < 3; ++axis) {
+        lower[axis] = std::min(lower[axis], p[axis]);
+        upper[axis] = std::max(upper[axis], p[axis]);
       }
     }
 
-    // for each triangle, assign it to its closest cluster center.
-    // closeness will be determined by distance from the first vertex.
-    // this could work badly if there are really unevenly sized triangles.
-    std::vector<int> clusterAssignment(triangles.size());
-    for (int i = 0; i < int(triangles.size()); ++i) {
-      float minDist = FLT_MAX;
-      for (int j = 0; j < splitK; ++j) {
-        const cv::Vec3f clusterJCenter = triangles[centerTriangleIndices[j]].v0;
-        const cv::Vec3f diff = triangles[i].v0 - clusterJCenter;
-        const float dist2 = diff[0] * diff[0] + diff[1] * diff[1] + diff[2] * diff[2];
-        if (dist2 < minDist) {
-          minDist = dist2;
-          clusterAssignment[i] = j;
+    void add(const Bounds& b) {
+      for (int axis = 0; axis < 3; ++axis) {
+        lower[axis] = std::min(lower[axis], b.lower[axis]);
+        upper[axis] = std::max(upper[axis], b.upper[axis]);
+      }
+    }
+
+    cv::Vec3f center() const {
+      return cv::Vec3f(
+          (lower[0] + upper[0]) / 2, (lower[1] + upper[1]) / 2, (lower[2] + upper[2]) / 2);
+    }
+
+    // half the area, 0 if empty
+    float getArea() const {
+      const float x = upper[0] - lower[0];
+      const float y = upper[1] - lower[1];
+      const float z = upper[2] - lower[2];
+      return x < 0 ? 0 : x * y + y * z + z * x;
+    }
+  };
+
+  struct Primitive {
+    Bounds bounds;
+    cv::Vec3f centroid;
+    int index;
+  };
+
+  struct Node {
+    float lower[3];
+    float upper[3];
+    int32_t offset; // leaf: first triangle, inner: second child
+    int16_t count; // triangles, 0 for inner nodes
+    int16_t axis; // inner: split axis
+  };
+
+  // fills nodes[index] with primitives [begin, end), sorting them in place
+  void build(
+      const int index,
+      std::vector<Primitive>& primitives,
+      const int begin,
+      const int end,
+      const int depth = 1) {
+    Bounds bounds;
+    Bounds centroids;
+    for (int i = begin; i < end; ++i) {
+      bounds.add(primitives[i].bounds);
+      centroids.add(primitives[i].centroid);
+    }
+    std::copy(bounds.lower, bounds.lower + 3, nodes[index].lower);
+    std::copy(bounds.upper, bounds.upper + 3, nodes[index].upper);
+    nodes[index].offset = begin;
+    nodes[index].count = end - begin;
+    nodes[index].axis = 0;
+
+    const int count = end - begin;
+    if (count <= maxTrianglesInLeaf || depth + 1 >= kMaxDepth) {
+      CHECK_LE(count, INT16_MAX) << "too many triangles in a leaf";
+      return;
+    }
+
+    // bin the centroids along each axis and find the cheapest split
+    // cost = area(left) * count(left) + area(right) * count(right), in units of area(bounds)
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = FLT_MAX;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float lower = centroids.lower[axis];
+      const float extent = centroids.upper[axis] - lower;
+      if (extent <= 0) {
+        continue;
+      }
+      Bounds bins[kBinCount];
+      int binCounts[kBinCount] = {};
+      for (int i = begin; i < end; ++i) {
+        const int bin = getBin(primitives[i].centroid[axis], lower, extent);
+        bins[bin].add(primitives[i].bounds);
+        ++binCounts[bin];
+      }
+      float rightCosts[kBinCount];
+      Bounds right;
+      int rightCount = 0;
+      for (int bin = kBinCount - 1; bin > 0; --bin) {
+        right.add(bins[bin]);
+        rightCount += binCounts[bin];
+        rightCosts[bin] = right.getArea() * rightCount;
+      }
+      Bounds left;
+      int leftCount = 0;
+      for (int split = 1; split < kBinCount; ++split) {
+        left.add(bins[split - 1]);
+        leftCount += binCounts[split - 1];
+        const float cost = left.getArea() * leftCount + rightCosts[split];
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = split;
         }
       }
     }
 
-    // for each cluster, recursively make a child bvh containing the triangles
-    // that were assigned to that cluster.
-    std::vector<std::vector<Triangle>> trianglesInCluster(splitK);
-    for (int i = 0; i < int(triangles.size()); ++i) {
-      trianglesInCluster[clusterAssignment[i]].push_back(triangles[i]);
+    // a leaf costs area(bounds) * count, an inner node area(bounds) for the box test on top
+    const float area = bounds.getArea();
+    const bool isLeafCheaper = bestCost >= area * (count - 1);
+    if (bestAxis < 0 || (isLeafCheaper && count <= kMaxTrianglesInCheapLeaf)) {
+      CHECK_LE(count, INT16_MAX) << "too many triangles in a leaf";
+      return;
+    }
+
+    const float lower = centroids.lower[bestAxis];
+    const float extent = centroids.upper[bestAxis] - lower;
+    const auto middle = std::partition(
+        primitives.begin() + begin, primitives.begin() + end, [&](const Primitive& p) {
+          return getBin(p.centroid[bestAxis], lower, extent) < bestSplit;
+        });
+    int split = middle - primitives.begin();
+    if (split == begin || split == end) { // all centroids in one bin, split in the middle
+      split = begin + count / 2;
+      std::nth_element(
+          primitives.begin() + begin,
+          primitives.begin() + split,
+          primitives.begin() + end,
+          [&](const Primitive& a, const Primitive& b) {
+            return a.centroid[bestAxis] < b.centroid[bestAxis];
+          });
+    }
+
+    nodes[index].count = 0;
+    nodes[index].axis = bestAxis;
+    nodes.emplace_back();
+    build(index + 1, primitives, begin, split, depth + 1);
+    nodes[index].offset = nodes.size();
+    nodes.emplace_back();
+    build(nodes[index].offset, primitives, split, end, depth + 1);
+  }
+
+  static int getBin(const float value, const float lower, const float extent) {
+    return std::min(kBinCount - 1, int(kBinCount * (value - lower) / extent));
+  }
+
+  // rayIntersectTriangle for 4 rays, updates best where a lane hits closer and returns those lanes
+  static int intersectTriangle(
+      const Float4 (&origin)[3],
+      const Float4 (&dir)[3],
+      float (&best)[kPacketSize],
+      const Triangle& tri) {
+    Float4 e1[3];
+    Float4 e2[3];
+    Float4 v0[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      e1[axis] = Float4::broadcast(tri.e1[axis]);
+      e2[axis] = Float4::broadcast(tri.e2[axis]);
+      v0[axis] = Float4::broadcast(tri.v0[axis]);
+    }
+    Float4 q[3];
+    cross(dir, e2, q);
+    const Float4 a = dot(e1, q);
+    Float4 s[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      s[axis] = (origin[axis] - v0[axis]) / a;
     }
+    Float4 r[3];
+    cross(s, e1, r);
 
-    for (int j = 0; j < splitK; ++j) {
-      bvh.children.push_back(
-          makeBVH(trianglesInCluster[j], thresholdNumTrisForLeaf, splitK, currDepth + 1, maxDepth));
+    // barycentric coordinates
+    const Float4 zero = Float4::broadcast(0);
+    const Float4 b0 = dot(s, q);
+    const Float4 b1 = dot(r, dir);
+    const Float4 b2 = Float4::broadcast(1) - b0 - b1;
+    const Float4 dist = dot(e2, r);
+    const Float4 bestIn = Float4::load(best);
+
+    // avoid near-parallel rays (for numerical reasons), as rayIntersectTriangle
+    const Mask4 hit = (Float4::broadcast(0.0001f) <= a * a) & (zero <= b0) & (zero <= b1) &
+        (zero <= b2) & (zero <= dist) & (dist < bestIn);
+    const int bits = hit.bits();
+    if (bits) {
+      float dists[kPacketSize];
+      dist.store(dists);
+      for (int lane = 0; lane < kPacketSize; ++lane) {
+        if (bits & (1 << lane)) {
+          best[lane] = dists[lane];
+        }
+      }
     }
+    return bits;
+  }
+
+  static Float4 dot(const Float4 (&a)[3], const Float4 (&b)[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  }
 
-    return bvh;
+  static void cross(const Float4 (&a)[3], const Float4 (&b)[3], Float4 (&result)[3]) {
+    result[0] = a[1] * b[2] - a[2] * b[1];
+    result[1] = a[2] * b[0] - a[0] * b[2];
+    result[2] = a[0] * b[1] - a[1] * b[0];
   }
+
+  static const int kMaxTrianglesInCheapLeaf = 16;
+
+  const int maxTrianglesInLeaf;
+  std::vector<Node> nodes;
+  std::vector<Triangle> triangles; // in leaf order
 };
 
-}; // end namespace render
-}; // end namespace fb360_dep
+} // namespace render
+} // namespace fb360_dep
@@ -7,6 +7,9 @@
 
 #include "source/render/CanopyScene.h"
 
+#include <map>
+#include <utility>
+
 #include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
@@ -23,38 +26,86 @@ Canopy::Canopy(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<cv::Vec3f>& mesh
   positionBuffer = createVertexAttributes(
       program, "position", mesh.ptr<std::array<float, 3>>(), mesh.cols * mesh.rows);
   indexBuffer = createBuffer(GL_ELEMENT_ARRAY_BUFFER, stripify(mesh.cols, mesh.rows));
+  colorSize = color.size();
+  meshSize = mesh.size();
   modulo = mesh.cols;
   scale = {1.0 / mesh.cols, 1.0 / mesh.rows};
 }
 
+Canopy::Canopy(
+    const cv::Mat_<cv::Vec4f>& color,
+    const cv::Mat_<float>& disparity,
+    const cv::Mat_<cv::Vec3f>& directions,
+    const Eigen::Vector3f& origin,
+    GLuint indexGrid)
+    : origin(origin) {
+  // tell gl about color
+  const bool kBuildMipmaps = true;
+  colorTexture = createTexture(
+      color.cols, color.rows, color.ptr(), GL_RGBA16, GL_BGRA, GL_FLOAT, kBuildMipmaps);
+  setTextureAniso();
+
+  // tell gl about disparity and directions, the vertex shader computes the mesh from them
+  disparityTexture =
+      createTexture(disparity.cols, disparity.rows, disparity.ptr(), GL_R32F, GL_RED, GL_FLOAT);
+  directionTexture = createTexture(
+      directions.cols, directions.rows, directions.ptr(), GL_RGB32F, GL_RGB, GL_FLOAT);
+  setTextureWrap(GL_CLAMP_TO_EDGE);
+
+  // the vertex array only holds the shared index grid
+  vertexArray = createVertexArray();
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexGrid);
+  colorSize = color.size();
+  meshSize = disparity.size();
+  modulo = disparity.cols;
+  scale = {1.0 / disparity.cols, 1.0 / disparity.rows};
+}
+
+void Canopy::updateColor(const cv::Mat_<cv::Vec4f>& color) {
+  CHECK_EQ(color.size(), colorSize);
+  glBindTexture(GL_TEXTURE_2D, colorTexture);
+  glTexSubImage2D(
+      GL_TEXTURE_2D, 0, 0, 0, color.cols, color.rows, GL_BGRA, GL_FLOAT, color.ptr());
+  glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+void Canopy::update(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<cv::Vec3f>& mesh) {
+  CHECK_NE(positionBuffer, 0) << "mesh is displaced on the gpu";
+  CHECK_EQ(mesh.size(), meshSize);
+  updateColor(color);
+  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, mesh.total() * sizeof(cv::Vec3f), mesh.ptr());
+}
+
+void Canopy::update(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<float>& disparity) {
+  CHECK_NE(disparityTexture, 0) << "mesh is not displaced on the gpu";
+  CHECK_EQ(disparity.size(), meshSize);
+  updateColor(color);
+  glBindTexture(GL_TEXTURE_2D, disparityTexture);
+  glTexSubImage2D(
+      GL_TEXTURE_2D, 0, 0, 0, disparity.cols, disparity.rows, GL_RED, GL_FLOAT, disparity.ptr());
+}
+
 void Canopy::destroy() {
+  glDeleteTextures(1, &directionTexture);
+  glDeleteTextures(1, &disparityTexture);
   glDeleteBuffers(1, &indexBuffer);
   glDeleteBuffers(1, &positionBuffer);
   glDeleteTextures(1, &colorTexture);
   glDeleteVertexArrays(1, &vertexArray);
 }
 
-void Canopy::render(
-    GLuint framebuffer,
-    const Eigen::Projective3f& transform,
-    const GLuint program,
-    const float ipd) const {
-  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-  CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
-
-  glClearColor(0.0, 0.4, 0.0, 0.0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  glEnable(GL_DEPTH_TEST);
-  glDepthFunc(GL_LEQUAL); // use <= so we never see clear depth
-
-  glUseProgram(program);
-
-  // tell vertex shader uniforms
-  glUniformMatrix4fv(glGetUniformLocation(program, "transform"), 1, GL_FALSE, transform.data());
+void Canopy::render(const GLuint program) const {
   setUniform(program, "modulo", modulo);
   setUniform(program, "scale", scale.x(), scale.y());
-  setUniform(program, "ipdm", ipd);
+  if (disparityTexture != 0) {
+    glUniform3fv(getUniformLocation(program, "origin"), 1, origin.data());
+    const int kDisparityUnit = 1;
+    const int kDirectionUnit = 2;
+    connectUnitWith2DTextureAndUniform(kDisparityUnit, disparityTexture, program, "disparities");
+    connectUnitWith2DTextureAndUniform(kDirectionUnit, directionTexture, program, "directions");
+    glActiveTexture(GL_TEXTURE0);
+  }
 
   // tell fragment shader which texture to use
   glBindTexture(GL_TEXTURE_2D, colorTexture);
@@ -62,23 +113,11 @@ void Canopy::render(
   // draw stuff
   glBindVertexArray(vertexArray);
   drawElements<GLuint>(GL_TRIANGLE_STRIP);
-
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glDisable(GL_DEPTH_TEST);
 }
 
-// compute texVar from vertex id
-// transform rig space position from vertex array into clip space
-std::string canopyVS = R"(
-  #version 330 core
-
-  uniform int modulo; // number of vertexes per row
+// ipd model of the canopy vertex shaders: eye(p) is where the eye that sees rig point p is
+std::string canopyEye = R"(
   uniform float ipdm; // positive for left eye, negative for right eye (in meters)
-  uniform vec2 scale; // transfrom from 2D index to color texture coordinates
-  uniform mat4 transform; // transfrom to clip-space
-
-  in vec3 position;
-  out vec2 texVar;
 
   const float kPi = 3.1415926535897932384626433832795;
 
@@ -128,10 +167,25 @@ std::string canopyVS = R"(
     mat2 A = mat2(1.0, k, -k, 1.0); // column major!
     return vec3(inverse(A) * p.xy, 0);
   }
+)";
 
+// compute texVar from vertex id
+// transform rig space position from vertex array into clip space
+std::string canopyVS = R"(
+  #version 330 core
+
+  uniform int modulo; // number of vertexes per row
+  uniform vec2 scale; // transfrom from 2D index to color texture coordinates
+  uniform mat4 transform; // transfrom to clip-space
+
+  in vec3 position;
+  out vec2 texVar;
+  out vec3 positionVar;
+)" + canopyEye + R"(
   void main() {
     // compute the color texture coordinates from the vertex id
     texVar = scale * vec2(gl_VertexID % modulo + 0.5, gl_VertexID / modulo + 0.5);
+    positionVar = position;
 
     vec3 pos = position;
     if (ipdm != 0) { // adjust position when rendering stereo
@@ -143,14 +197,132 @@ std::string canopyVS = R"(
   }
 )";
 
+// same as canopyVS, but the rig space position is computed from the vertex id too: it is
+// origin + direction / disparity, with the direction interpolated from the camera's table
+std::string canopyDisplaceVS = R"(
+  #version 330 core
+
+  uniform int modulo; // number of vertexes per row
+  uniform vec2 scale; // transfrom from 2D index to color texture coordinates
+  uniform mat4 transform; // transfrom to clip-space
+  uniform sampler2D disparities; // one per vertex
+  uniform sampler2D directions; // unit rays, first and last texels at the image edges
+  uniform vec3 origin; // camera position
+
+  out vec2 texVarGS;
+  out vec3 positionVarGS;
+  out float disparityGS;
+)" + canopyEye + R"(
+  void main() {
+    ivec2 index = ivec2(gl_VertexID % modulo, gl_VertexID / modulo);
+    texVarGS = scale * (vec2(index) + 0.5);
+
+    // the table has a texel at each end of the image, like RigScene's direction textures
+    vec2 size = vec2(textureSize(directions, 0));
+    vec2 directionVar = (0.5 + texVarGS * (size - 1)) / size;
+    vec3 direction = normalize(texture(directions, directionVar).xyz);
+    disparityGS = texelFetch(disparities, index, 0).r;
+    positionVarGS = origin + direction / disparityGS;
+
+    vec3 pos = positionVarGS;
+    if (ipdm != 0) { // adjust position when rendering stereo
+      pos -= eye(pos);
+    }
+
+    // apply transform
+    gl_Position = transform * vec4(pos, 1);
+  }
+)";
+
+// drop the triangles of canopyDisplaceVS that span a depth discontinuity
+std::string canopyTearGS = R"(
+  #version 330 core
+
+  layout(triangles) in;
+  layout(triangle_strip, max_vertices = 3) out;
+
+  uniform float tearRatio; // smallest / largest disparity of a kept triangle (0 = keep all)
+
+  in vec2 texVarGS[];
+  in vec3 positionVarGS[];
+  in float disparityGS[];
+  out vec2 texVar;
+  out vec3 positionVar;
+
+  void main() {
+    float near = max(disparityGS[0], max(disparityGS[1], disparityGS[2]));
+    float far = min(disparityGS[0], min(disparityGS[1], disparityGS[2]));
+    if (far < tearRatio * near) {
+      return;
+    }
+    for (int i = 0; i < 3; ++i) {
+      texVar = texVarGS[i];
+      positionVar = positionVarGS[i];
+      gl_Position = gl_in[i].gl_Position;
+      EmitVertex();
+    }
+    EndPrimitive();
+  }
+)";
+
+// sends each triangle of a canopy to the layer of every cube face it is on, one invocation per
+// face, and drops the triangles canopyTearGS would
+std::string canopyLayeredGS = R"(
+  #version 400 core
+
+  layout(triangles, invocations = 6) in; // one per cube face
+  layout(triangle_strip, max_vertices = 3) out;
+
+  uniform mat4 transforms[6]; // rig space to each face's clip space
+  uniform float tearRatio; // smallest / largest disparity of a kept triangle (0 = keep all)
+
+  in vec2 vsTexVar[];
+  in vec3 vsPositionVar[];
+  in float vsDisparity[];
+  out vec2 texVar;
+  out vec3 positionVar;
+
+  void main() {
+    float near = max(vsDisparity[0], max(vsDisparity[1], vsDisparity[2]));
+    float far = min(vsDisparity[0], min(vsDisparity[1], vsDisparity[2]));
+    if (far < tearRatio * near) {
+      return;
+    }
+    vec4 clip[3];
+    for (int i = 0; i < 3; ++i) {
+      clip[i] = transforms[gl_InvocationID] * gl_in[i].gl_Position;
+    }
+    // skip the face if the whole triangle is beyond one of its sides
+    for (int axis = 0; axis < 2; ++axis) {
+      if ((clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w) ||
+          (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w &&
+           clip[2][axis] < -clip[2].w)) {
+        return;
+      }
+    }
+    for (int i = 0; i < 3; ++i) {
+      gl_Layer = gl_InvocationID;
+      gl_Position = clip[i];
+      texVar = vsTexVar[i];
+      positionVar = vsPositionVar[i];
+      EmitVertex();
+    }
+    EndPrimitive();
+  }
+)";
+
 // read color from sampler
 // modulate by how much mesh has been stretched
 std::string canopyFS = R"(
   #version 330 core
 
   uniform sampler2D sampler;
+  uniform bool isDisparity; // color by 1 / distance from disparityOrigin instead of sampler
+  uniform vec3 disparityOrigin;
+  uniform bool alphaBlend; // alpha is a soft max weight
 
   in vec2 texVar;
+  in vec3 positionVar;
   out vec4 color;
 
   void main() {
@@ -158,6 +330,10 @@ std::string canopyFS = R"(
     if (color.a == 0) {
       discard;
     }
+    if (isDisparity) {
+      // clamped as if it came from the GL_RGBA16 color texture
+      color.rgb = vec3(min(1, 1 / distance(positionVar, disparityOrigin)));
+    }
     // call a = dtexVar/dx and b = dtexVar/dy. a and b describe a parallelogram
     // in the camera image corresponding to your screen space pixel. if you
     // move one pixel in x, you move a in the camera image, and if you move one
@@ -188,6 +364,12 @@ std::string canopyFS = R"(
     const float eps = 1.0f / 255.0f;  // max granularity
     float cone = max(eps, 1 - 2 * length(texVar - 0.5));
     color.a *= cone;
+
+    if (alphaBlend) {
+      // we want weight, w = k^a - 1 = e^(log(k) * a) - 1
+      const float kLogK = 30;
+      color.a = exp(kLogK * color.a) - 1;
+    }
   }
 )";
 
@@ -195,8 +377,12 @@ std::string canopyFS_SVD = R"(
   #version 330 core
 
   uniform sampler2D sampler;
+  uniform bool isDisparity; // color by 1 / distance from disparityOrigin instead of sampler
+  uniform vec3 disparityOrigin;
+  uniform bool alphaBlend; // alpha is a soft max weight
 
   in vec2 texVar;
+  in vec3 positionVar;
   out vec4 color;
 
   void main() {
@@ -204,6 +390,10 @@ std::string canopyFS_SVD = R"(
     if (color.a == 0) {
       discard;
     }
+    if (isDisparity) {
+      // clamped as if it came from the GL_RGBA16 color texture
+      color.rgb = vec3(min(1, 1 / distance(positionVar, disparityOrigin)));
+    }
     // call a = dtexVar/dx and b = dtexVar/dy. a and b describe a parallelogram
     // in the camera image corresponding to your screen space pixel as before but a more complete
     // method is to compute an area invariant version of this using the ratio of the singular values
@@ -225,21 +415,6 @@ std::string canopyFS_SVD = R"(
     const float eps = 1.0f / 255.0f;  // max granularity
     float cone = max(eps, 1 - 2 * length(texVar - 0.5));
     color.a *= cone;
-  }
-)";
-
-// read color from sampler and apply soft max
-std::string accumulateFS = R"(
-  #version 330 core
-
-  uniform sampler2D sampler;
-  uniform bool alphaBlend;
-
-  in vec2 texVar;
-  out vec4 color;
-
-  void main() {
-    color = texture(sampler, texVar);
 
     if (alphaBlend) {
       // we want weight, w = k^a - 1 = e^(log(k) * a) - 1
@@ -249,39 +424,98 @@ std::string accumulateFS = R"(
   }
 )";
 
-// read color from sampler, converting from pre-multiplied alpha
+// read color from a layer of sampler, converting from pre-multiplied alpha
 std::string unpremulFS = R"(
   #version 330 core
 
-  uniform sampler2D sampler;
+  uniform sampler2DArray sampler;
+  uniform int layer;
 
   in vec2 texVar;
   out vec4 color;
 
   void main() {
-    color = texture(sampler, texVar);
+    color = texture(sampler, vec3(texVar, layer));
     color /= color.a;
   }
 )";
 
-// merge a texture into the accumulate buffer
-static void
-accumulate(GLuint framebuffer, GLuint texture, const GLuint program, const bool alphaBlend) {
-  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+bool CanopyScene::isLayeredSupported() {
+  // geometry shader instancing
+  GLint major = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  return major >= 4;
+}
+
+void CanopyScene::setUniforms(const GLuint program, const float ipd, const bool alphaBlend) const {
+  setUniform(program, "ipdm", ipd);
+  setUniform(program, "isDisparity", GLint(isDisparity));
+  glUniform3fv(getUniformLocation(program, "disparityOrigin"), 1, disparityOrigin.data());
+  setUniform(program, "alphaBlend", GLint(alphaBlend));
+  // only when displaced on the gpu or layered, no-op otherwise
+  glUniform1f(glGetUniformLocation(program, "tearRatio"), tearRatio);
+}
+
+void CanopyScene::bindAccumulation(const int width, const int height, const int layers) const {
+  const Eigen::Vector3i size(width, height, layers);
+  if (accumulateBuffer != 0 && accumulateSize != size) {
+    destroyAccumulation();
+  }
+  if (accumulateBuffer == 0) {
+    accumulateBuffer = createFramebuffer();
+    accumulateTexture = createFramebufferTextureArray(width, height, layers, GL_RGBA32F);
+    accumulateDepth = createFramebufferDepthTextureArray(width, height, layers);
+    accumulateSize = size;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, accumulateBuffer);
   CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+}
+
+void CanopyScene::destroyAccumulation() const {
+  glDeleteTextures(1, &accumulateDepth);
+  glDeleteTextures(1, &accumulateTexture);
+  glDeleteFramebuffers(1, &accumulateBuffer);
+  accumulateBuffer = 0; // flag as destroyed
+}
 
-  // set up blend equations to accumulate premultiplied alpha
+void CanopyScene::accumulate(const GLuint program) const {
+  // set up blend equations to accumulate premultiplied alpha, the shader computes the weight
   //    dst.rgb += src.a * src.rgb <=> dst.rgb = src.a * src.rgb + 1 * dst.rgb
   //    dst.a += src.a <=> dst.a = 1 * src.a + 1 * dst.a
-  glEnable(GL_BLEND);
   glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE, GL_ONE, GL_ONE);
+  glEnable(GL_DEPTH_TEST);
+  for (ssize_t i = 0; i < ssize(canopies); ++i) {
+    if (!enabled[i]) {
+      continue;
+    }
+    // find the canopy's nearest surface
+    glDepthMask(GL_TRUE);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthFunc(GL_LEQUAL); // use <= so we never see clear depth
+    canopies[i].render(program);
+
+    // and add only that surface
+    glDepthMask(GL_FALSE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthFunc(GL_EQUAL);
+    glEnable(GL_BLEND);
+    canopies[i].render(program);
+    glDisable(GL_BLEND);
+  }
+  glDepthMask(GL_TRUE);
+  glDepthFunc(GL_LESS);
+  glDisable(GL_DEPTH_TEST);
+}
 
-  glUseProgram(program);
-  setUniform(program, "alphaBlend", alphaBlend);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  fullscreen(program, "tex");
-
-  glDisable(GL_BLEND);
+void CanopyScene::unpremul(const GLuint framebuffer, const int layer) const {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glUseProgram(unpremulProgram);
+  setUniform(unpremulProgram, "layer", layer);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, accumulateTexture);
+  fullscreen(unpremulProgram, "tex");
 }
 
 void CanopyScene::render(
@@ -289,48 +523,23 @@ void CanopyScene::render(
     const Eigen::Projective3f& transform,
     const float ipd,
     const bool alphaBlend) const {
-  // framebuffer used to accumulate all the cameras
+  // accumulate all the enabled canopies, then un-premultiply into framebuffer
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
-  GLuint accumulateBuffer = createFramebuffer();
-  GLuint accumulateTexture = createFramebufferTexture(viewport[2], viewport[3], GL_RGBA32F);
-  glClearColor(0.0, 0.0, 0.0, 0.0);
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  // framebuffer used to render a single canopy
-  GLuint canopyBuffer = createFramebuffer();
-  GLuint canopyTexture = createFramebufferTexture(viewport[2], viewport[3], GL_RGBA32F);
-  GLuint canopyDepth = createFramebufferDepth(viewport[2], viewport[3]);
-
-  // accumulate all the canopies into the accumulateBuffer
-  for (auto& canopy : canopies) {
-    canopy.render(canopyBuffer, transform, canopyProgram, ipd);
-    accumulate(accumulateBuffer, canopyTexture, accumulateProgram, alphaBlend);
-  }
-
-  // clean up canopy framebuffer
-  glDeleteRenderbuffers(1, &canopyDepth);
-  glDeleteTextures(1, &canopyTexture);
-  glDeleteFramebuffers(1, &canopyBuffer);
-
-  // un-premultiply out of the accumulation buffer into framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-  glUseProgram(unpremulProgram);
-  glBindTexture(GL_TEXTURE_2D, accumulateTexture);
-  fullscreen(unpremulProgram, "tex");
-
-  // clean up
-  glDeleteTextures(1, &accumulateTexture);
-  glDeleteFramebuffers(1, &accumulateBuffer);
+  bindAccumulation(viewport[2], viewport[3], 1);
+  glUseProgram(canopyProgram);
+  glUniformMatrix4fv(
+      getUniformLocation(canopyProgram, "transform"), 1, GL_FALSE, transform.data());
+  setUniforms(canopyProgram, ipd, alphaBlend);
+  accumulate(canopyProgram);
+  unpremul(framebuffer, 0);
 }
 
-template <typename T>
-GLuint createCubemapTexture(
-    const T& scene,
+GLuint CanopyScene::createCubemapTexture(
     const int edge,
     const Eigen::Vector3f& position,
     const float ipd,
-    const bool alphaBlend) {
+    const bool alphaBlend) const {
   // create cubemap framebuffer
   GLuint framebuffer = createFramebuffer();
   GLuint cubemap = createFramebufferCubemapTexture(edge, edge, GL_RGBA32F);
@@ -340,18 +549,10 @@ GLuint createCubemapTexture(
   const float kNearZ = 0.1f; // meters
   Eigen::Projective3f projection = frustum(-kNearZ, kNearZ, -kNearZ, kNearZ, kNearZ);
 
-  // render each cube face
+  // transform of each cube face
   const int kFaceCount = 6;
+  std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>> transforms;
   for (int face = 0; face < kFaceCount; ++face) {
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    glFramebufferTexture2D(
-        GL_DRAW_FRAMEBUFFER,
-        GL_COLOR_ATTACHMENT0,
-        GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
-        cubemap,
-        0);
-    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
-
     // from https://www.khronos.org/registry/OpenGL/extensions/EXT/EXT_texture_cube_map.txt
     // major axis
     // direction     target                             sc     tc    ma
@@ -375,7 +576,37 @@ GLuint createCubemapTexture(
     transform.linear().row(2) = -table[face][0]; // -major axis direction from table
     transform.translation().setZero();
     transform.translate(-position);
-    scene.render(framebuffer, projection * transform, ipd, alphaBlend);
+    transforms.push_back((projection * transform).matrix());
+  }
+
+  // accumulate all the faces at once, each in its own layer
+  if (canopyLayeredProgram) {
+    bindAccumulation(edge, edge, kFaceCount);
+    glUseProgram(canopyLayeredProgram);
+    glUniformMatrix4fv(
+        getUniformLocation(canopyLayeredProgram, "transforms"),
+        kFaceCount,
+        GL_FALSE,
+        transforms[0].data());
+    setUniforms(canopyLayeredProgram, ipd, alphaBlend);
+    accumulate(canopyLayeredProgram);
+  }
+
+  // write each cube face
+  for (int face = 0; face < kFaceCount; ++face) {
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(
+        GL_DRAW_FRAMEBUFFER,
+        GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
+        cubemap,
+        0);
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    if (canopyLayeredProgram) {
+      unpremul(framebuffer, face);
+    } else {
+      render(framebuffer, Eigen::Projective3f(transforms[face]), ipd, alphaBlend);
+    }
   }
 
   // clean up
@@ -393,22 +624,69 @@ cv::Mat_<cv::Vec4f> CanopyScene::cubemap(
     const Eigen::Vector3f& position,
     const float ipd,
     const bool alphaBlend) const {
-  GLuint cubemap = createCubemapTexture(*this, edge, position, ipd, alphaBlend);
+  GpuReadback readback(1);
+  cubemap(readback, GL_BGRA, GL_FLOAT, edge, position, ipd, alphaBlend);
+  return readback.pop();
+}
+
+void CanopyScene::cubemap(
+    GpuReadback& readback,
+    const GLenum format,
+    const GLenum type,
+    int edge,
+    const Eigen::Vector3f& position,
+    const float ipd,
+    const bool alphaBlend) const {
+  GLuint cubemap = createCubemapTexture(edge, position, ipd, alphaBlend);
 
   // opengl's origin is bottom-left whereas opencv uses top-left
   // so stick faces into result from bottom to top, then flip the whole thing upside-down
   const int kFaceCount = 6;
-  cv::Mat_<cv::Vec4f> result(kFaceCount * edge, edge);
+  const bool kIsUpsideDown = true;
+  readback.begin({edge, kFaceCount * edge}, format, type, kIsUpsideDown);
   for (int face = 0; face < kFaceCount; ++face) {
-    cv::Vec4f* dst = &result((kFaceCount - 1 - face) * edge, 0);
-    glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_BGRA, GL_FLOAT, dst);
+    glGetTexImage(
+        GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
+        0,
+        format,
+        type,
+        readback.at((kFaceCount - 1 - face) * edge));
   }
-  const int kUpsideDownCode = 0;
-  cv::flip(result, result, kUpsideDownCode);
+  readback.end();
 
-  // clean up and return
+  // clean up, gl keeps the texture around until the read is done
   glDeleteTextures(1, &cubemap);
-  return result;
+}
+
+void CanopyScene::cubemap(
+    const GLuint framebuffer,
+    int edge,
+    const Eigen::Vector3f& position,
+    const float ipd,
+    const bool alphaBlend) const {
+  GLuint cubemap = createCubemapTexture(edge, position, ipd, alphaBlend);
+
+  // copy the faces into framebuffer from bottom to top, as cubemap(readback, ...) reads them
+  const int kFaceCount = 6;
+  GLuint faceBuffer = createFramebuffer(GL_READ_FRAMEBUFFER);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+  for (int face = 0; face < kFaceCount; ++face) {
+    glFramebufferTexture2D(
+        GL_READ_FRAMEBUFFER,
+        GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
+        cubemap,
+        0);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    const int y = (kFaceCount - 1 - face) * edge;
+    glBlitFramebuffer(0, 0, edge, edge, 0, y, edge, y + edge, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
+
+  // clean up
+  glDeleteFramebuffers(1, &faceBuffer);
+  glDeleteTextures(1, &cubemap);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(0, 0, edge, kFaceCount * edge);
 }
 
 // render equirect from cubemap
@@ -441,17 +719,46 @@ cv::Mat_<cv::Vec4f> CanopyScene::equirect(
     const Eigen::Vector3f& position,
     const float ipd,
     const bool alphaBlend) const {
-  // use the equirect height for the cube edge to provide plenty of resolution
-  GLuint cubemap = createCubemapTexture(*this, height, position, ipd, alphaBlend);
+  GpuReadback readback(1);
+  equirect(readback, GL_BGRA, GL_FLOAT, height, position, ipd, alphaBlend);
+  return readback.pop();
+}
 
+void CanopyScene::equirect(
+    GpuReadback& readback,
+    const GLenum format,
+    const GLenum type,
+    int height,
+    const Eigen::Vector3f& position,
+    const float ipd,
+    const bool alphaBlend) const {
   // create the framebuffer
   int width = 2 * height;
   GLuint fbo = createFramebuffer();
   GLuint color = createFramebufferColor(width, height, GL_RGBA32F);
-  glViewport(0, 0, width, height);
 
-  // set up the program
-  GLuint program = createProgram(fullscreenVertexShader(), equirectFS);
+  // render and queue the read, equirectFS already flipped the image
+  equirect(fbo, height, position, ipd, alphaBlend);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  const bool kIsUpsideDown = false;
+  readback.begin({width, height}, format, type, kIsUpsideDown);
+  glReadPixels(0, 0, width, height, format, type, readback.at(0));
+  readback.end();
+
+  // clean up, gl keeps the framebuffer around until the read is done
+  glDeleteRenderbuffers(1, &color);
+  glDeleteFramebuffers(1, &fbo);
+}
+
+void CanopyScene::equirect(
+    const GLuint framebuffer,
+    int height,
+    const Eigen::Vector3f& position,
+    const float ipd,
+    const bool alphaBlend) const {
+  // use the equirect height for the cube edge to provide plenty of resolution
+  GLuint cubemap = createCubemapTexture(height, position, ipd, alphaBlend);
+
 #ifdef GL_TEXTURE_CUBE_MAP_SEAMLESS
   glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 #endif
@@ -459,18 +766,13 @@ cv::Mat_<cv::Vec4f> CanopyScene::equirect(
   setLinearFiltering<GL_TEXTURE_CUBE_MAP>();
   setTextureAniso<GL_TEXTURE_CUBE_MAP>();
 
-  // render and read the result
-  fullscreen(program);
-  glReadBuffer(GL_COLOR_ATTACHMENT0);
-  cv::Mat_<cv::Vec4f> equirect(height, width);
-  glReadPixels(0, 0, equirect.cols, equirect.rows, GL_BGRA, GL_FLOAT, equirect.ptr());
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(0, 0, 2 * height, height);
+  glUseProgram(equirectProgram);
+  fullscreen(equirectProgram);
 
-  // clean up and return
-  glDeleteProgram(program);
-  glDeleteRenderbuffers(1, &color);
-  glDeleteFramebuffers(1, &fbo);
+  // clean up
   glDeleteTextures(1, &cubemap);
-  return equirect;
 }
 
 static cv::Mat_<cv::Vec3f> disparityMesh(const cv::Mat_<float>& disparity, Camera camera) {
@@ -487,6 +789,21 @@ static cv::Mat_<cv::Vec3f> disparityMesh(const cv::Mat_<float>& disparity, Camer
   return mesh;
 }
 
+// the camera's unit rays at kDirections x kDirections points, from edge to edge of its image
+static cv::Mat_<cv::Vec3f> directionTable(const Camera& camera) {
+  const int kDirections = 128;
+  cv::Mat_<cv::Vec3f> directions(kDirections, kDirections);
+  for (int y = 0; y < kDirections; ++y) {
+    for (int x = 0; x < kDirections; ++x) {
+      const Camera::Vector2 pixel =
+          Camera::Vector2(x, y).cwiseProduct(camera.resolution) / (kDirections - 1);
+      const Camera::Vector3 direction = camera.rig(pixel).direction();
+      directions(y, x) = cv::Vec3f(direction[0], direction[1], direction[2]);
+    }
+  }
+  return directions;
+}
+
 cv::Mat_<cv::Vec4f> alphaFov(const cv::Mat_<cv::Vec4f>& color, Camera camera) {
   // knock out pixels outside fov
   cv::Mat_<cv::Vec4f> result(color.rows, color.cols);
@@ -504,27 +821,111 @@ CanopyScene::CanopyScene(
     const Camera::Rig& cameras,
     const std::vector<cv::Mat_<float>>& disparities,
     const std::vector<cv::Mat_<cv::Vec4f>>& colors,
-    const bool onScreen) {
+    const bool onScreen,
+    const bool displaceOnGpu,
+    const float tearRatio)
+    : cameras(cameras), displaceOnGpu(displaceOnGpu), tearRatio(tearRatio) {
   // create the programs
-  canopyProgram = createProgram(canopyVS, onScreen ? canopyFS : canopyFS_SVD);
-  accumulateProgram = createProgram(fullscreenVertexShader(), accumulateFS);
+  const std::string& canopyFSOut = onScreen ? canopyFS : canopyFS_SVD;
+  canopyProgram = displaceOnGpu ? createProgram(canopyDisplaceVS, canopyTearGS, canopyFSOut)
+                                : createProgram(canopyVS, canopyFSOut);
   unpremulProgram = createProgram(fullscreenVertexShader(), unpremulFS);
+  equirectProgram = createProgram(fullscreenVertexShader(), equirectFS);
+  if (isLayeredSupported()) {
+    // the canopy vertex shader with the transform left to canopyLayeredGS
+    std::string layeredVS = displaceOnGpu ? canopyDisplaceVS : canopyVS;
+    const std::string transformUniform = "uniform mat4 transform; // transfrom to clip-space";
+    if (displaceOnGpu) {
+      replaceAll(layeredVS, "texVarGS", "vsTexVar");
+      replaceAll(layeredVS, "positionVarGS", "vsPositionVar");
+      replaceAll(layeredVS, "disparityGS", "vsDisparity");
+      replaceAll(layeredVS, transformUniform, "");
+    } else {
+      replaceAll(layeredVS, "texVar", "vsTexVar");
+      replaceAll(layeredVS, "positionVar", "vsPositionVar");
+      replaceAll(layeredVS, transformUniform, "out float vsDisparity;");
+      replaceAll(layeredVS, "void main() {", "void main() {\n    vsDisparity = 1; // never torn");
+    }
+    replaceAll(layeredVS, "transform * ", "");
+    canopyLayeredProgram = createProgram(layeredVS, canopyLayeredGS, canopyFSOut);
+    if (!displaceOnGpu) {
+      // vertex arrays are set up with canopyProgram's location
+      CHECK_EQ(
+          getAttribLocation(canopyLayeredProgram, "position"),
+          getAttribLocation(canopyProgram, "position"));
+    }
+  }
 
-  // prepare images and meshes for canopies in parallel
+  // prepare images and meshes (or direction tables) for canopies in parallel
   std::vector<cv::Mat_<cv::Vec4f>> images(ssize(cameras));
   std::vector<cv::Mat_<cv::Vec3f>> meshes(ssize(cameras));
   ThreadPool threads;
   for (ssize_t i = 0; i < ssize(cameras); ++i) {
     threads.spawn([&, i] {
       images[i] = alphaFov(colors[i], cameras[i]);
-      meshes[i] = disparityMesh(disparities[i], cameras[i]);
+      meshes[i] = displaceOnGpu ? directionTable(cameras[i])
+                                : disparityMesh(disparities[i], cameras[i]);
     });
   }
   threads.join();
 
   // create the canopies
+  std::map<std::pair<int, int>, GLuint> sizeToIndexGrid;
   for (ssize_t i = 0; i < ssize(images); ++i) {
-    canopies.emplace_back(images[i], meshes[i], canopyProgram);
+    if (!displaceOnGpu) {
+      canopies.emplace_back(images[i], meshes[i], canopyProgram);
+      continue;
+    }
+    const cv::Mat_<float>& disparity = disparities[i];
+    GLuint& indexGrid = sizeToIndexGrid[std::make_pair(disparity.cols, disparity.rows)];
+    if (indexGrid == 0) {
+      // created as an array buffer, an element array binding would change the bound vertex array
+      indexGrid = createBuffer(GL_ARRAY_BUFFER, stripify(disparity.cols, disparity.rows));
+      indexGrids.push_back(indexGrid);
+    }
+    const Eigen::Vector3f origin = cameras[i].position.cast<float>();
+    canopies.emplace_back(images[i], disparity, meshes[i], origin, indexGrid);
+  }
+  enabled.assign(canopies.size(), true);
+}
+
+void CanopyScene::setEnabled(const std::vector<bool>& enabledIn) {
+  CHECK_EQ(enabledIn.size(), canopies.size());
+  enabled = enabledIn;
+}
+
+void CanopyScene::setDisparity(const bool isDisparityIn, const Eigen::Vector3f& origin) {
+  isDisparity = isDisparityIn;
+  disparityOrigin = origin;
+}
+
+void CanopyScene::update(
+    const std::vector<cv::Mat_<float>>& disparities,
+    const std::vector<cv::Mat_<cv::Vec4f>>& colors) {
+  CHECK_EQ(ssize(disparities), ssize(canopies));
+  CHECK_EQ(ssize(colors), ssize(canopies));
+
+  // prepare images and meshes in parallel, direction tables do not change
+  std::vector<cv::Mat_<cv::Vec4f>> images(ssize(cameras));
+  std::vector<cv::Mat_<cv::Vec3f>> meshes(ssize(cameras));
+  ThreadPool threads;
+  for (ssize_t i = 0; i < ssize(cameras); ++i) {
+    threads.spawn([&, i] {
+      images[i] = alphaFov(colors[i], cameras[i]);
+      if (!displaceOnGpu) {
+        meshes[i] = disparityMesh(disparities[i], cameras[i]);
+      }
+    });
+  }
+  threads.join();
+
+  // upload them into the canopies' textures and buffers
+  for (ssize_t i = 0; i < ssize(canopies); ++i) {
+    if (displaceOnGpu) {
+      canopies[i].update(images[i], disparities[i]);
+    } else {
+      canopies[i].update(images[i], meshes[i]);
+    }
   }
 }
 
@@ -532,8 +933,15 @@ CanopyScene::~CanopyScene() {
   for (Canopy& canopy : canopies) {
     canopy.destroy();
   }
+  glDeleteBuffers(indexGrids.size(), indexGrids.data());
+  if (accumulateBuffer) {
+    destroyAccumulation();
+  }
+  if (canopyLayeredProgram) {
+    glDeleteProgram(canopyLayeredProgram);
+  }
+  glDeleteProgram(equirectProgram);
   glDeleteProgram(unpremulProgram);
-  glDeleteProgram(accumulateProgram);
   glDeleteProgram(canopyProgram);
 }
 
@@ -10,6 +10,7 @@
 #include <opencv2/core/core.hpp>
 
 #include "source/gpu/GlUtil.h"
+#include "source/gpu/GpuReadback.h"
 #include "source/util/Camera.h"
 
 namespace fb360_dep {
@@ -17,21 +18,41 @@ namespace fb360_dep {
 // a canopy is the bumpy half-dome described by a camera's disparity and color images
 struct Canopy {
   Canopy(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<cv::Vec3f>& mesh, GLuint program);
+
+  // mesh is displaced on the gpu: only disparity is uploaded, vertexes are computed from it and
+  // from directions, a table of the camera's unit rays from corner to corner of its image. The
+  // index grid is shared between canopies, and must cover disparity's size
+  Canopy(
+      const cv::Mat_<cv::Vec4f>& color,
+      const cv::Mat_<float>& disparity,
+      const cv::Mat_<cv::Vec3f>& directions,
+      const Eigen::Vector3f& origin,
+      GLuint indexGrid);
   void destroy();
 
-  void render(
-      GLuint framebuffer,
-      const Eigen::Projective3f& transform,
-      const GLuint program,
-      const float ipd = 0.0f) const;
+  // replace the images with ones of the same sizes, reusing the gl objects
+  void update(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<cv::Vec3f>& mesh);
+  void update(const cv::Mat_<cv::Vec4f>& color, const cv::Mat_<float>& disparity);
+
+  // draws into the bound framebuffer with program, whose scene-wide uniforms are already set
+  void render(const GLuint program) const;
 
  private:
+  void updateColor(const cv::Mat_<cv::Vec4f>& color);
+
+  cv::Size colorSize;
+  cv::Size meshSize; // or disparity's size
   int modulo;
   Eigen::Vector2f scale;
   GLuint vertexArray;
   GLuint colorTexture;
-  GLuint positionBuffer;
-  GLuint indexBuffer;
+  GLuint positionBuffer = 0;
+  GLuint indexBuffer = 0; // owned by the scene if the mesh is displaced on the gpu
+
+  // only if the mesh is displaced on the gpu
+  GLuint disparityTexture = 0;
+  GLuint directionTexture = 0;
+  Eigen::Vector3f origin;
 };
 
 struct CanopyScene {
@@ -39,10 +60,21 @@ struct CanopyScene {
       const Camera::Rig& cameras,
       const std::vector<cv::Mat_<float>>& disparities,
       const std::vector<cv::Mat_<cv::Vec4f>>& colors,
-      const bool onScreen = true);
+      const bool onScreen = true,
+      const bool displaceOnGpu = false,
+      const float tearRatio = 0);
   ~CanopyScene();
 
+  // replace the frame with disparities and colors of the same sizes as the constructor's, e.g. the
+  // next frame of a video. Programs, buffers and textures are reused, only the images are uploaded
+  void update(
+      const std::vector<cv::Mat_<float>>& disparities,
+      const std::vector<cv::Mat_<cv::Vec4f>>& colors);
+
   // render scene to the specified opengl framebuffer
+  // Canopies are blended straight into an accumulation buffer: a depth-only draw finds the
+  // nearest surface of a canopy, then a draw that only passes at that depth adds its weighted
+  // color. Accumulation buffers are kept for the next render of the same size
   void render(
       const GLuint framebuffer,
       const Eigen::Projective3f& transform,
@@ -50,6 +82,8 @@ struct CanopyScene {
       const bool alphaBlend = true) const;
 
   // render scene from position as a cubemap with edge x edge pixel faces, stacked vertically
+  // With gl 4.0, the 6 faces are rendered at once, a geometry shader sends each triangle to the
+  // layer of every face it is on
   cv::Mat_<cv::Vec4f> cubemap(
       int edge,
       const Eigen::Vector3f& position = {0, 0, 0},
@@ -63,13 +97,95 @@ struct CanopyScene {
       const float ipd = 0.0f,
       const bool alphaBlend = true) const;
 
+  // as cubemap() and equirect(), but the result is queued in readback in gl's format and type,
+  // e.g. GL_BGR, GL_UNSIGNED_SHORT to convert on the gpu, and comes out of readback.pop()
+  void cubemap(
+      GpuReadback& readback,
+      const GLenum format,
+      const GLenum type,
+      int edge,
+      const Eigen::Vector3f& position = {0, 0, 0},
+      const float ipd = 0.0f,
+      const bool alphaBlend = true) const;
+
+  void equirect(
+      GpuReadback& readback,
+      const GLenum format,
+      const GLenum type,
+      int height,
+      const Eigen::Vector3f& position = {0, 0, 0},
+      const float ipd = 0.0f,
+      const bool alphaBlend = true) const;
+
+  // as equirect() and cubemap(), but the result is left in framebuffer, from its bottom left
+  // corner, for the caller to post-process or read. The viewport is set to the result. equirect's
+  // rows are top to bottom, cubemap's faces are stacked bottom to top, each the way gl stores it
+  void equirect(
+      const GLuint framebuffer,
+      int height,
+      const Eigen::Vector3f& position = {0, 0, 0},
+      const float ipd = 0.0f,
+      const bool alphaBlend = true) const;
+
+  void cubemap(
+      const GLuint framebuffer,
+      int edge,
+      const Eigen::Vector3f& position = {0, 0, 0},
+      const float ipd = 0.0f,
+      const bool alphaBlend = true) const;
+
+  // only enabled canopies are rendered, all of them are after construction. Lets one scene
+  // render subsets of its cameras, e.g. all but one, without uploading them again
+  void setEnabled(const std::vector<bool>& enabled);
+
+  // if isDisparity, canopies are colored by 1 / distance from origin, in meters, instead of by
+  // their color images, as disparityColors(..., origin, metersToGrayscale) would
+  void setDisparity(const bool isDisparity, const Eigen::Vector3f& origin = {0, 0, 0});
+
  private:
+  static bool isLayeredSupported();
+
+  // sets the uniforms shared by all canopies, once program is in use
+  void setUniforms(const GLuint program, const float ipd, const bool alphaBlend) const;
+
+  // binds and clears the accumulation, layers images of width x height
+  void bindAccumulation(const int width, const int height, const int layers) const;
+  void destroyAccumulation() const;
+
+  // blends the enabled canopies into the bound accumulation
+  void accumulate(const GLuint program) const;
+
+  // un-premultiplies layer of the accumulation into framebuffer
+  void unpremul(const GLuint framebuffer, const int layer) const;
+
+  GLuint createCubemapTexture(
+      const int edge,
+      const Eigen::Vector3f& position,
+      const float ipd,
+      const bool alphaBlend) const;
+
+  const Camera::Rig cameras;
+  const bool displaceOnGpu;
   std::vector<Canopy> canopies;
+  std::vector<bool> enabled;
+  bool isDisparity = false;
+  Eigen::Vector3f disparityOrigin = {0, 0, 0};
+
+  // if displaceOnGpu, triangles whose smallest / largest disparity is below tearRatio are dropped
+  float tearRatio;
+  std::vector<GLuint> indexGrids; // one per disparity size
 
   // programs
   GLuint canopyProgram;
-  GLuint accumulateProgram;
+  GLuint canopyLayeredProgram = 0; // 0 if not supported
   GLuint unpremulProgram;
+  GLuint equirectProgram;
+
+  // premultiplied sum of the canopies, a layer per view, created lazily
+  mutable GLuint accumulateBuffer = 0;
+  mutable GLuint accumulateTexture;
+  mutable GLuint accumulateDepth;
+  mutable Eigen::Vector3i accumulateSize; // width, height, layers
 };
 
 } // namespace fb360_dep
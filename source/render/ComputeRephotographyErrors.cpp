@@ -13,12 +13,14 @@
 
 #include "source/gpu/GlUtil.h"
 #include "source/gpu/GlfwUtil.h"
+#include "source/gpu/GpuReadback.h"
 #include "source/render/CanopyScene.h"
 #include "source/render/DisparityColor.h"
 #include "source/render/RephotographyUtil.h"
 #include "source/util/CvUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::image_util;
@@ -50,14 +52,7 @@ DEFINE_string(method, "MSSIM", "MSSIM or NCC");
 DEFINE_string(output, "", "path to output directory (required)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_int32(stat_radius, 1, "local statistics window radius");
-
-template <typename T>
-std::vector<T> removeOne(int skip, const std::vector<T>& v) {
-  CHECK_LT(skip, v.size());
-  std::vector<T> result = v;
-  result.erase(result.begin() + skip);
-  return result;
-}
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 
 template <typename T>
 cv::Mat_<T> zeroOutNans(const cv::Mat_<T>& imageIn) {
@@ -72,26 +67,60 @@ cv::Mat_<T> zeroOutNans(const cv::Mat_<T>& imageIn) {
   return imageOut;
 }
 
-std::vector<cv::Mat_<PixelType>> generateCubemaps(
-    const Camera::Rig& rig,
-    const std::vector<cv::Mat_<PixelType>>& colors,
-    const std::vector<cv::Mat_<float>>& disparities,
+// queue color and disparity cubemaps of the cameras enabled in scene, as seen from center
+void queueCubemaps(
+    GpuReadback& readback,
+    CanopyScene& scene,
+    const std::vector<bool>& enabled,
     const int cubeHeight,
     const Eigen::Vector3f& center) {
-  CHECK_EQ(colors.size(), disparities.size());
-  std::vector<cv::Mat_<PixelType>> cubemaps;
-
-  const CanopyScene sceneColor(rig, disparities, colors);
-  cubemaps.push_back(zeroOutNans(sceneColor.cubemap(cubeHeight, center)));
-
-  const std::vector<cv::Mat_<PixelType>> dispColors =
-      disparityColors(rig, disparities, center, metersToGrayscale);
-  const CanopyScene sceneDisparity(rig, disparities, dispColors);
-  cubemaps.push_back(zeroOutNans(sceneDisparity.cubemap(cubeHeight, center)));
+  scene.setEnabled(enabled);
+  scene.setDisparity(false);
+  scene.cubemap(readback, GL_BGRA, GL_FLOAT, cubeHeight, center);
+  scene.setDisparity(true, center);
+  scene.cubemap(readback, GL_BGRA, GL_FLOAT, cubeHeight, center);
+}
 
+std::vector<cv::Mat_<PixelType>> popCubemaps(GpuReadback& readback) {
+  std::vector<cv::Mat_<PixelType>> cubemaps;
+  cubemaps.push_back(zeroOutNans(cv::Mat_<PixelType>(readback.pop()))); // color
+  cubemaps.push_back(zeroOutNans(cv::Mat_<PixelType>(readback.pop()))); // disparity
   return cubemaps;
 }
 
+// compares, plots and saves the cubemaps of camera camId, returns its score
+cv::Scalar scoreCubemaps(
+    const std::string& frameName,
+    const std::string& camId,
+    const std::vector<cv::Mat_<PixelType>>& cubesRef,
+    const std::vector<cv::Mat_<PixelType>>& cubesRender) {
+  // Create mask
+  const int kColor = 0;
+  const cv::Mat_<float> alpha = cv_util::extractAlpha(cubesRef[kColor]);
+  const cv::Mat_<uint8_t> mask = 255 * (alpha > 0);
+
+  // Remove color alphas
+  cv::Mat_<PixelTypeNoAlpha> cubesRefColorNoAlpha = cv_util::removeAlpha(cubesRef[kColor]);
+  cv::Mat_<PixelTypeNoAlpha> cubesRenderColorNoAlpha = cv_util::removeAlpha(cubesRender[kColor]);
+
+  // Compute scores
+  const cv::Mat_<PixelTypeNoAlpha> scoreMap = rephoto_util::computeScoreMap(
+      FLAGS_method, cubesRefColorNoAlpha, cubesRenderColorNoAlpha, FLAGS_stat_radius);
+
+  const cv::Scalar avgScore = rephoto_util::averageScore(scoreMap, mask);
+  LOG(INFO) << folly::sformat(
+      "{} {}: {}", camId, FLAGS_method, rephoto_util::formatResults(avgScore));
+
+  // Plot results
+  const cv::Mat_<cv::Vec3b> plot =
+      rephoto_util::stackResults(cubesRef, cubesRender, scoreMap, avgScore, mask);
+  const filesystem::path rephotoDir = filesystem::path(FLAGS_output) / "rephoto";
+  const std::string filename =
+      folly::sformat("{}/{}/{}.png", rephotoDir.string(), camId, frameName);
+  cv_util::imwriteExceptionOnFail(filename, plot);
+  return avgScore;
+}
+
 class OffscreenWindow : public GlWindow {
  protected:
   Camera::Rig& rig;
@@ -125,12 +154,20 @@ class OffscreenWindow : public GlWindow {
           FLAGS_color, rig, frameName, disps[0].size(), cv::INTER_AREA);
       CHECK_EQ(colors.size(), disps.size());
 
+      // one scene per frame, each camera is held out by disabling it
+      CanopyScene scene(rig, disps, colors);
+
       const int cubeHeight = colors[0].rows;
-      cv::Scalar frameScore = cv::Scalar::all(0);
       std::vector<std::string> cameras;
       if (!FLAGS_cameras.empty()) {
         boost::split(cameras, FLAGS_cameras, [](char c) { return c == ','; });
       }
+
+      // render on this thread, score in batches of threads cameras in the background
+      std::vector<cv::Scalar> scores(rig.size(), cv::Scalar::all(0));
+      const int batchSize = std::max(1, ThreadPool::getThreadCountFromFlag(FLAGS_threads));
+      ThreadPool threadPool(FLAGS_threads);
+      int inFlight = 0;
       for (ssize_t i = 0; i < ssize(rig); ++i) {
         const std::string camId = rig[i].id;
         if (cameras.size() > 0) {
@@ -142,36 +179,29 @@ class OffscreenWindow : public GlWindow {
         LOG(INFO) << folly::sformat("Processing {} - {}...", frameName, camId);
         const Eigen::Vector3f center = rig[i].position.cast<float>();
 
-        std::vector<cv::Mat_<PixelType>> cubesRef =
-            generateCubemaps({rig[i]}, {colors[i]}, {disps[i]}, cubeHeight, center);
-        std::vector<cv::Mat_<PixelType>> cubesRender = generateCubemaps(
-            removeOne(i, rig), removeOne(i, colors), removeOne(i, disps), cubeHeight, center);
-
-        // Create mask
-        const int kColor = 0;
-        const cv::Mat_<float> alpha = cv_util::extractAlpha(cubesRef[kColor]);
-        const cv::Mat_<uint8_t> mask = 255 * (alpha > 0);
-
-        // Remove color alphas
-        cv::Mat_<PixelTypeNoAlpha> cubesRefColorNoAlpha = cv_util::removeAlpha(cubesRef[kColor]);
-        cv::Mat_<PixelTypeNoAlpha> cubesRenderColorNoAlpha =
-            cv_util::removeAlpha(cubesRender[kColor]);
-
-        // Compute scores
-        const cv::Mat_<PixelTypeNoAlpha> scoreMap = rephoto_util::computeScoreMap(
-            FLAGS_method, cubesRefColorNoAlpha, cubesRenderColorNoAlpha, FLAGS_stat_radius);
-
-        const cv::Scalar avgScore = rephoto_util::averageScore(scoreMap, mask);
-        LOG(INFO) << folly::sformat(
-            "{} {}: {}", camId, FLAGS_method, rephoto_util::formatResults(avgScore));
-        frameScore += avgScore;
-
-        // Plot results
-        const cv::Mat_<cv::Vec3b> plot =
-            rephoto_util::stackResults(cubesRef, cubesRender, scoreMap, avgScore, mask);
-        const std::string filename =
-            folly::sformat("{}/{}/{}.png", rephotoDir.string(), camId, frameName);
-        cv_util::imwriteExceptionOnFail(filename, plot);
+        std::vector<bool> isHeldOut(rig.size(), false);
+        isHeldOut[i] = true;
+        std::vector<bool> isRendered(rig.size(), true);
+        isRendered[i] = false;
+        GpuReadback readback(4);
+        queueCubemaps(readback, scene, isHeldOut, cubeHeight, center);
+        queueCubemaps(readback, scene, isRendered, cubeHeight, center);
+        std::vector<cv::Mat_<PixelType>> cubesRef = popCubemaps(readback);
+        std::vector<cv::Mat_<PixelType>> cubesRender = popCubemaps(readback);
+
+        threadPool.spawn([&scores, &frameName, camId, i, cubesRef, cubesRender] {
+          scores[i] = scoreCubemaps(frameName, camId, cubesRef, cubesRender);
+        });
+        if (++inFlight == batchSize) {
+          threadPool.join();
+          inFlight = 0;
+        }
+      }
+      threadPool.join();
+
+      cv::Scalar frameScore = cv::Scalar::all(0);
+      for (const cv::Scalar& score : scores) {
+        frameScore += score;
       }
 
       const int n = cameras.size() > 0 ? cameras.size() : rig.size();
@@ -0,0 +1,211 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "source/render/RigScene.h"
+#include "source/render/VideoFile.h"
+#include "source/util/Mailbox.h"
+
+namespace fb360_dep {
+
+// Plays a video on a loader thread, so late disk reads never stall rendering
+// The loader thread has its own gl context, sharing objects with the render thread's. It runs
+// videoFile.advance(), which waits for the reads, unmaps the buffers and uploads the textures of
+// the next frame, and hands the frame to the render thread through a lock-free mailbox. The
+// render thread only binds the frame's vertex arrays, which contexts do not share, and takes a
+// frame only once the gpu has it, so when there is none it keeps rendering the last one instead
+// of waiting. Frames the render thread is done with go back through another mailbox, and the
+// loader thread recycles them once the gpu is done drawing them
+class FrameLoader {
+ public:
+  // makeCurrent and doneCurrent are called on the loader thread, to make current a context that
+  // shares objects with the render thread's, and to release it when the loader stops
+  // Up to capacity loaded frames wait for the render thread, on top of videoFile's readahead
+  FrameLoader(
+      VideoFile& videoFile,
+      const RigScene& scene,
+      const std::function<void()>& makeCurrent,
+      const std::function<void()>& doneCurrent,
+      const int capacity = 2,
+      const bool cull = true)
+      : videoFile(videoFile),
+        scene(scene),
+        frameCount(videoFile.frames.size()),
+        cull(cull),
+        ready(capacity),
+        retired(capacity + 1) { // plus the one on display
+    updateView();
+    videoFile.setDeferred(true);
+    thread = std::thread([this, makeCurrent, doneCurrent] {
+      makeCurrent();
+      run();
+      doneCurrent();
+    });
+  }
+
+  // the frame on display should be retired first
+  ~FrameLoader() {
+    stopping = true;
+    thread.join();
+    videoFile.setDeferred(false);
+  }
+
+  FrameLoader(const FrameLoader&) = delete;
+  FrameLoader& operator=(const FrameLoader&) = delete;
+
+  // render thread: if the next frame is ready, retires subframes and replaces them with it
+  // Returns false right away otherwise
+  bool next(std::vector<RigScene::Subframe>& subframes) {
+    Frame* const front = ready.front();
+    if (!front || !isSignaled(front->fence)) {
+      return false;
+    }
+    Frame frame;
+    ready.tryPop(frame);
+    glDeleteSync(frame.fence);
+    retire(subframes);
+    scene.bindFrame(frame.subframes);
+    subframes = std::move(frame.subframes);
+    displayed = frame.index;
+    stats = frame.stats;
+    stats.pendingFrames += ready.size();
+    return true;
+  }
+
+  // render thread: hands a frame returned by next() back to the loader thread, and clears it
+  void retire(std::vector<RigScene::Subframe>& subframes) {
+    if (subframes.empty()) {
+      return;
+    }
+    scene.releaseVertexArrays(subframes);
+    Frame frame;
+    frame.subframes = std::move(subframes);
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush(); // or the fence may never signal for the loader thread
+    const bool isPushed = retired.tryPush(frame);
+    CHECK(isPushed) << "more frames retired than loaded";
+    subframes.clear();
+  }
+
+  // render thread: the frames read from now on are culled as the scene is now, e.g. after
+  // PredictiveCuller::update()
+  void updateView() {
+    std::lock_guard<std::mutex> lock(viewMutex);
+    culled = scene.culled;
+    visibility = scene.visibility;
+  }
+
+  // index in videoFile.frames of the frame next() returns, as VideoFile::getFront()
+  int getFront() const {
+    return (displayed + 1) % frameCount;
+  }
+
+  // frames between the disk and the display: the loaded ones plus videoFile's readahead
+  int getReadahead() const {
+    return int(ready.size()) + readahead;
+  }
+
+  // how the loader thread spent its time on the frame last returned by next(), pendingFrames
+  // includes the loaded frames waiting for the render thread
+  const VideoFile::AdvanceStats& getStats() const {
+    return stats;
+  }
+
+ private:
+  struct Frame {
+    int index = -1; // in videoFile.frames
+    std::vector<RigScene::Subframe> subframes;
+    GLsync fence = nullptr; // gl is done with the frame in the context that made the fence
+    VideoFile::AdvanceStats stats;
+  };
+
+  void run() {
+    loadView();
+    videoFile.fillReadahead(scene, cull);
+    while (!stopping) {
+      recycle();
+      if (ready.isFull()) {
+        // the render thread takes a frame every few ms at most
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      loadView();
+      Frame frame;
+      frame.index = videoFile.getFront();
+      const auto begin = AsyncFile::ActivityLog::Clock::now();
+      frame.subframes = videoFile.advance(scene, cull);
+      AsyncFile::activityLog().span("advance", begin, AsyncFile::ActivityLog::Clock::now());
+      readahead = videoFile.getReadahead();
+      frame.stats = videoFile.getAdvanceStats();
+      frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      glFlush(); // start the uploads now rather than when the render thread needs the frame
+      const bool isPushed = ready.tryPush(frame);
+      CHECK(isPushed);
+    }
+    // retired frames are older than the ready ones, release their ring allocations first
+    const bool kWait = true;
+    recycle(kWait);
+    Frame frame;
+    while (ready.tryPop(frame)) {
+      glDeleteSync(frame.fence);
+      scene.destroyFrame(frame.subframes);
+      videoFile.releaseFrame();
+    }
+  }
+
+  // destroys the retired frames the gpu is done with, oldest first
+  void recycle(const bool wait = false) {
+    while (Frame* const front = retired.front()) {
+      if (!isSignaled(front->fence, wait ? kForever : 0)) {
+        return;
+      }
+      Frame frame;
+      retired.tryPop(frame);
+      glDeleteSync(frame.fence);
+      scene.destroyFrame(frame.subframes);
+      videoFile.releaseFrame();
+    }
+  }
+
+  void loadView() {
+    std::lock_guard<std::mutex> lock(viewMutex);
+    videoFile.setView(culled, visibility);
+  }
+
+  static bool isSignaled(const GLsync fence, const GLuint64 timeout = 0) {
+    const GLenum status = glClientWaitSync(fence, 0, timeout);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+  }
+
+  static const GLuint64 kForever = ~GLuint64(0);
+
+  VideoFile& videoFile;
+  const RigScene& scene;
+  const int frameCount;
+  const bool cull;
+  Mailbox<Frame> ready; // loader to render thread
+  Mailbox<Frame> retired; // render to loader thread
+  std::thread thread;
+  std::atomic<bool> stopping{false};
+  std::atomic<int> readahead{0};
+  int displayed = -1; // index of the frame on display
+  VideoFile::AdvanceStats stats; // of the frame on display
+
+  std::mutex viewMutex; // protects culled and visibility
+  std::vector<bool> culled;
+  std::vector<float> visibility;
+};
+
+} // namespace fb360_dep
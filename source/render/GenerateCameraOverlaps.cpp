@@ -5,13 +5,18 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <memory>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
 
+#include "source/gpu/GlfwUtil.h"
+#include "source/gpu/ReprojectionGpuUtil.h"
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/OverlapMatrix.h"
 #include "source/util/SystemUtil.h"
 #include "source/util/ThreadPool.h"
 
@@ -36,25 +41,44 @@ const std::string kUsageMessage = R"(
      -vf "scale=trunc(iw/2)*2:trunc(ih/2)*2" /path/to/output/overlaps/cam0.mp4 -y
  )";
 
+DEFINE_bool(cache_overlaps, false, "reuse camera overlaps saved next to the rig");
 DEFINE_string(cameras, "", "cameras to render (comma-separated)");
 DEFINE_string(color, "", "path to input color images (required)");
 DEFINE_string(frame, "000000", "frame to process (lexical)");
+DEFINE_bool(gpu, false, "sweep all depths on the gpu");
 DEFINE_uint64(max_depth_m, 10, "max depth in cm");
 DEFINE_uint64(min_depth_m, 1, "min depth in cm");
 DEFINE_uint64(num_depths, 50, "num depths");
 DEFINE_string(output, "", "path to output directory (required)");
+DEFINE_string(reprojection_cache_dir, "", "directory to cache reprojection tables (empty = none)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_double(scale, 0.5, "image scale factor");
 
 using PixelType = cv::Vec4f;
 using Image = cv::Mat_<PixelType>;
 
+// Srcs of rigSrc that see some of camDst
+std::vector<int> getVisibleSrcs(
+    const Camera& camDst,
+    const Camera::Rig& rigSrc,
+    const OverlapMatrix& overlapMatrix) {
+  std::vector<int> visible;
+  for (int iSrc = 0; iSrc < int(rigSrc.size()); ++iSrc) {
+    if (overlapMatrix.isVisible(camDst.id, rigSrc[iSrc].id)) {
+      visible.push_back(iSrc);
+    }
+  }
+  return visible;
+}
+
 Image projectSrcsToDst(
     const Camera& camDst,
     const Camera::Rig& rigSrc,
     const std::vector<Image>& imagesSrc,
+    const OverlapMatrix& overlapMatrix,
     const float disparity) {
   Image colorDst(camDst.resolution.y(), camDst.resolution.x(), cv::Scalar(0));
+  const std::vector<int> visibleSrcs = getVisibleSrcs(camDst, rigSrc, overlapMatrix);
 
   for (int y = 0; y < colorDst.rows; ++y) {
     for (int x = 0; x < colorDst.cols; ++x) {
@@ -66,7 +90,7 @@ Image projectSrcsToDst(
       const Camera::Vector3 world = camDst.rig(dstPixel, 1.0f / disparity);
       int count = 0;
       PixelType sum = cv_util::createBGRA<PixelType>(0, 0, 0, 0);
-      for (int iSrc = 0; iSrc < int(rigSrc.size()); ++iSrc) {
+      for (const int iSrc : visibleSrcs) {
         Camera::Vector2 srcPixel;
         if (rigSrc[iSrc].sees(world, srcPixel)) {
           sum += cv_util::getPixelBilinear(imagesSrc[iSrc], srcPixel.x(), srcPixel.y());
@@ -80,10 +104,93 @@ Image projectSrcsToDst(
   return colorDst;
 }
 
+// Same as projectSrcsToDst at each disparity, swept on the gpu
+// Each src is rendered once per GpuBuffers::maxDrawBufferCount() disparities, summing colors
+// and how many srcs see them, which are divided on the way back
+std::vector<Image> projectSrcsToDstGpu(
+    const Camera& camDst,
+    const Camera::Rig& rigSrc,
+    const std::vector<GLuint>& srcTextures,
+    const OverlapMatrix& overlapMatrix,
+    const std::vector<float>& disparities) {
+  const cv::Size size(camDst.resolution.x(), camDst.resolution.y());
+  const std::vector<int> visibleSrcs = getVisibleSrcs(camDst, rigSrc, overlapMatrix);
+  std::vector<std::unique_ptr<ReprojectionTexture>> reprojections;
+  for (const int iSrc : visibleSrcs) {
+    reprojections.push_back(std::make_unique<ReprojectionTexture>(
+        camDst, rigSrc[iSrc], FLAGS_reprojection_cache_dir));
+  }
+
+  const int numDisps = disparities.size();
+  const int batchSize = std::min(int(GpuBuffers::maxDrawBufferCount()), numDisps);
+  PlaneSweepScene scene(batchSize);
+  std::vector<Image> colorsDst;
+  for (int begin = 0; begin < numDisps; begin += batchSize) {
+    const int end = std::min(begin + batchSize, numDisps);
+    const std::vector<float> batch(disparities.begin() + begin, disparities.begin() + end);
+    GpuBuffers buffers(GL_RGBA32F, {size.width, size.height}, batch.size());
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0, 0, 0, 0);
+    for (const GLuint buffer : buffers) {
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, buffer);
+      glDrawBuffer(GL_COLOR_ATTACHMENT0);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    scene.setDisparities(batch);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    for (int i = 0; i < int(visibleSrcs.size()); ++i) {
+      scene.setSource(*reprojections[i], srcTextures[visibleSrcs[i]]);
+      buffers.subdivide(scene);
+    }
+    glDisable(GL_BLEND);
+
+    for (int i = 0; i < int(batch.size()); ++i) {
+      Image sum(size);
+      buffers.read(&sum(0, 0), GL_RGBA, GL_FLOAT, i);
+      Image colorDst(size, cv::Scalar(0));
+      for (int y = 0; y < size.height; ++y) {
+        for (int x = 0; x < size.width; ++x) {
+          const float count = sum(y, x)[3];
+          if (count > 0 && !camDst.isOutsideImageCircle({x + 0.5, y + 0.5})) {
+            colorDst(y, x) = cv_util::createBGRA<PixelType>(
+                sum(y, x)[0] / count, sum(y, x)[1] / count, sum(y, x)[2] / count, 1);
+          }
+        }
+      }
+      colorsDst.push_back(colorDst);
+    }
+  }
+  return colorsDst;
+}
+
+void saveOverlap(
+    const filesystem::path& outputDir,
+    const Camera& camDst,
+    Image& colorDst,
+    const float disparity) {
+  // Add text to image showing current depth
+  const float depth = 1.0f / disparity;
+  const float depthCm = depth * 100;
+  const std::string depthStr = std::to_string(int(depthCm));
+  const cv::Point2f textPos((80.0f / 100.0f) * colorDst.cols, (6.0f / 100.0f) * colorDst.rows);
+  const int textFont = cv::FONT_HERSHEY_PLAIN;
+  const double textScale = 2;
+  const cv::Scalar textColor(0, 1, 0, 1); // green
+  cv::putText(colorDst, depthStr + " cm", textPos, textFont, textScale, textColor);
+
+  // Pad filename with zeros so they are saved in lexicographical order
+  const std::string filename =
+      folly::sformat("{}/{}/{:05}_cm.png", outputDir.string(), camDst.id, int(depthCm));
+  cv_util::imwriteExceptionOnFail(filename, 255.0f * colorDst);
+}
+
 void dumpOverlaps(
     const Camera::Rig& rigSrc,
     const Camera::Rig& rigDst,
     const std::vector<Image>& imagesSrc,
+    const OverlapMatrix& overlapMatrix,
     const int numDisps,
     const float minDisparity,
     const float maxDisparity,
@@ -100,29 +207,59 @@ void dumpOverlaps(
     threadPool.spawn([&, d] {
       const float disparity = probeDisparity(d, numDisps, minDisparity, maxDisparity);
       for (const Camera& camDst : rigDst) {
-        const Image colorDst = projectSrcsToDst(camDst, rigSrc, imagesSrc, disparity);
-
-        // Add text to image showing current depth
-        const float depth = 1.0f / disparity;
-        const float depthCm = depth * 100;
-        const std::string depthStr = std::to_string(int(depthCm));
-        const cv::Point2f textPos(
-            (80.0f / 100.0f) * colorDst.cols, (6.0f / 100.0f) * colorDst.rows);
-        const int textFont = cv::FONT_HERSHEY_PLAIN;
-        const double textScale = 2;
-        const cv::Scalar textColor(0, 1, 0, 1); // green
-        cv::putText(colorDst, depthStr + " cm", textPos, textFont, textScale, textColor);
-
-        // Pad filename with zeros so they are saved in lexicographical order
-        const std::string filename =
-            folly::sformat("{}/{}/{:05}_cm.png", outputDir.string(), camDst.id, int(depthCm));
-        cv_util::imwriteExceptionOnFail(filename, 255.0f * colorDst);
+        Image colorDst = projectSrcsToDst(camDst, rigSrc, imagesSrc, overlapMatrix, disparity);
+        saveOverlap(outputDir, camDst, colorDst, disparity);
       }
     });
   }
   threadPool.join();
 }
 
+// Sweep needs an OpenGL context, but nothing is ever displayed
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+void dumpOverlapsGpu(
+    const Camera::Rig& rigSrc,
+    const Camera::Rig& rigDst,
+    const std::vector<Image>& imagesSrc,
+    const OverlapMatrix& overlapMatrix,
+    const int numDisps,
+    const float minDisparity,
+    const float maxDisparity,
+    const filesystem::path& outputDir) {
+  OffscreenContext context;
+
+  // Transparent black outside the srcs, so they don't count there
+  std::vector<GLuint> srcTextures;
+  for (const Image& imageSrc : imagesSrc) {
+    srcTextures.push_back(createTexture(
+        imageSrc.cols, imageSrc.rows, imageSrc.ptr(), GL_RGBA32F, GL_RGBA, GL_FLOAT));
+    setTextureWrap(GL_CLAMP_TO_BORDER);
+  }
+
+  std::vector<float> disparities;
+  for (int d = 0; d < numDisps; ++d) {
+    disparities.push_back(probeDisparity(d, numDisps, minDisparity, maxDisparity));
+  }
+
+  for (const Camera& camDst : rigDst) {
+    LOG(INFO) << folly::sformat("Sweeping {} depths for {}...", numDisps, camDst.id);
+    filesystem::create_directories(outputDir / camDst.id);
+    std::vector<Image> colorsDst =
+        projectSrcsToDstGpu(camDst, rigSrc, srcTextures, overlapMatrix, disparities);
+    for (int d = 0; d < numDisps; ++d) {
+      saveOverlap(outputDir, camDst, colorsDst[d], disparities[d]);
+    }
+  }
+
+  for (const GLuint texture : srcTextures) {
+    glDeleteTextures(1, &texture);
+  }
+}
+
 int main(int argc, char* argv[]) {
   system_util::initDep(argc, argv, kUsageMessage);
 
@@ -142,11 +279,16 @@ int main(int argc, char* argv[]) {
       loadScaledImages<PixelType>(FLAGS_color, rigSrc, FLAGS_frame, FLAGS_scale);
   CHECK_EQ(imagesSrc.size(), rigSrc.size());
 
+  // Srcs that don't overlap a dst are skipped
+  const OverlapMatrix overlapMatrix = OverlapMatrix::getOrCompute(
+      FLAGS_cache_overlaps ? OverlapMatrix::getDefaultDir(FLAGS_rig) : "", rigSrc);
+
   const filesystem::path overlapsDir = filesystem::path(FLAGS_output) / "overlaps";
-  dumpOverlaps(
+  (FLAGS_gpu ? dumpOverlapsGpu : dumpOverlaps)(
       rigSrc,
       rigDst,
       imagesSrc,
+      overlapMatrix,
       FLAGS_num_depths,
       1.0f / FLAGS_min_depth_m,
       1.0f / FLAGS_max_depth_m,
@@ -7,6 +7,7 @@
 
 #include <math.h>
 #include <algorithm>
+#include <memory>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -14,6 +15,8 @@
 
 #include <folly/Format.h>
 
+#include "source/gpu/GlfwUtil.h"
+#include "source/gpu/ReprojectionGpuUtil.h"
 #include "source/rig/RigTransform.h"
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
@@ -44,6 +47,7 @@ DEFINE_bool(crop_equirect, false, "crop the equirect to only include visible ima
 DEFINE_double(depth_max, 10.0, "max depth in m");
 DEFINE_double(depth_min, 1.0, "min depth in m");
 DEFINE_string(frame, "000000", "frame to process (lexical)");
+DEFINE_bool(gpu, false, "sweep all depths on the gpu");
 DEFINE_uint64(height, 512, "equirect height in pixels");
 DEFINE_uint64(num_depths, 50, "num depths");
 DEFINE_string(output, "", "path to output directory (required)");
@@ -172,6 +176,120 @@ Image createCroppedEquirect(
   return equirectImage;
 }
 
+// The equirect seen as a dst camera in normalized coordinates, for ReprojectionTable
+struct EquirectDst {
+  bool isOutsideImageCircle(const Camera::Vector2& xy) const {
+    return false;
+  }
+
+  Camera::Vector3 rig(const Camera::Vector2& xy, const Camera::Real depth) const {
+    return getEquirectPoint(xy.x() - 0.5, xy.y() - 0.5, depth, 1, 1);
+  }
+};
+
+// Sweep needs an OpenGL context, but nothing is ever displayed
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+// Same as createEquirect at each depth, swept on the gpu
+// Each camera is rendered once per GpuBuffers::maxDrawBufferCount() depths, summing colors and
+// how many cameras see them, which are divided on the way back
+std::vector<Image> createEquirectsGpu(
+    const Camera::Rig& rig,
+    const std::vector<Image>& images,
+    const size_t height,
+    const size_t width,
+    const std::vector<float>& depths) {
+  OffscreenContext context;
+
+  // Transparent black outside the cameras, so they don't count there
+  std::vector<GLuint> textures;
+  std::vector<std::unique_ptr<ReprojectionTexture>> reprojections;
+  for (int i = 0; i < int(rig.size()); ++i) {
+    textures.push_back(createTexture(
+        images[i].cols, images[i].rows, images[i].ptr(), GL_RGBA32F, GL_RGBA, GL_FLOAT));
+    setTextureWrap(GL_CLAMP_TO_BORDER);
+    reprojections.push_back(std::make_unique<ReprojectionTexture>(EquirectDst(), rig[i]));
+  }
+
+  const int numDepths = depths.size();
+  const int batchSize = std::min(int(GpuBuffers::maxDrawBufferCount()), numDepths);
+  PlaneSweepScene scene(batchSize);
+  std::vector<Image> equirects;
+  for (int begin = 0; begin < numDepths; begin += batchSize) {
+    const int end = std::min(begin + batchSize, numDepths);
+    std::vector<float> batch;
+    for (int d = begin; d < end; ++d) {
+      batch.push_back(1.0f / depths[d]);
+    }
+    GpuBuffers buffers(GL_RGBA32F, {int(width), int(height)}, batch.size());
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0, 0, 0, 0);
+    for (const GLuint buffer : buffers) {
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, buffer);
+      glDrawBuffer(GL_COLOR_ATTACHMENT0);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    scene.setDisparities(batch);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    for (int i = 0; i < int(rig.size()); ++i) {
+      scene.setSource(*reprojections[i], textures[i]);
+      buffers.subdivide(scene);
+    }
+    glDisable(GL_BLEND);
+
+    for (int i = 0; i < int(batch.size()); ++i) {
+      Image sum(height, width);
+      buffers.read(&sum(0, 0), GL_RGBA, GL_FLOAT, i);
+      equirects.push_back(sum);
+    }
+  }
+
+  for (const GLuint texture : textures) {
+    glDeleteTextures(1, &texture);
+  }
+  return equirects;
+}
+
+// Turn sums of colors and counts into averages, cropped to the pixels that any camera sees if
+// --crop_equirect
+Image averageEquirect(const Image& sum) {
+  cv::Rect crop(0, 0, sum.cols, sum.rows);
+  if (FLAGS_crop_equirect) {
+    cv::Mat_<uint8_t> seen(sum.size());
+    for (int y = 0; y < sum.rows; ++y) {
+      for (int x = 0; x < sum.cols; ++x) {
+        seen(y, x) = sum(y, x)[3] > 0;
+      }
+    }
+    crop = cv::boundingRect(seen);
+    CHECK(!crop.empty()) << "no camera sees the equirect";
+  }
+
+  Image equirectImage(crop.size());
+  for (int y = 0; y < crop.height; ++y) {
+    for (int x = 0; x < crop.width; ++x) {
+      const cv::Vec4f& s = sum(crop.y + y, crop.x + x);
+      if (s[3] > 0) {
+        equirectImage(y, x) = cv::Vec4f(s[0] / s[3], s[1] / s[3], s[2] / s[3], 1);
+      } else {
+        equirectImage(y, x) = FLAGS_black_bg ? cv::Vec4f(0, 0, 0, 1) : cv::Vec4f(0, 0, 1, 1);
+      }
+    }
+  }
+
+  if (FLAGS_crop_equirect) {
+    // Same size as createCroppedEquirect
+    const int newWidth = FLAGS_height * crop.width / crop.height;
+    cv::resize(equirectImage, equirectImage, cv::Size(newWidth, FLAGS_height));
+  }
+  return equirectImage;
+}
+
 // Returns angle between two 3-vectors
 double getRotationAngle(Camera::Vector3 v1, Camera::Vector3 v2, int signFactor) {
   double dotprod = v1.transpose() * v2;
@@ -261,13 +379,31 @@ int main(int argc, char* argv[]) {
 
   const float dispMin = 1.0f / FLAGS_depth_max;
   const float dispMax = 1.0f / FLAGS_depth_min;
+  std::vector<float> depths(FLAGS_num_depths);
+  for (int i = 0; i < int(FLAGS_num_depths); ++i) {
+    const float fraction = float(i) / float(FLAGS_num_depths - 1);
+    const float disp =
+        FLAGS_num_depths == 1 ? dispMin : fraction * dispMin + (1 - fraction) * dispMax;
+    depths[i] = 1.0f / disp;
+  }
+
+  if (FLAGS_gpu) {
+    // ReprojectionTable only covers disparities up to 1 / m
+    CHECK_GE(FLAGS_depth_min, 1.0) << "--gpu needs --depth_min >= 1";
+    LOG(INFO) << folly::sformat("Sweeping {} depths...", FLAGS_num_depths);
+    const std::vector<Image> sums = createEquirectsGpu(rig, images, height, width, depths);
+    ThreadPool threadPool(FLAGS_threads);
+    for (int i = 0; i < int(FLAGS_num_depths); ++i) {
+      threadPool.spawn([&, i] { saveImage(averageEquirect(sums[i]), depths[i]); });
+    }
+    threadPool.join();
+    return EXIT_SUCCESS;
+  }
+
   ThreadPool threadPool(FLAGS_threads);
   for (int i = FLAGS_num_depths - 1; i >= 0; --i) {
     threadPool.spawn([&, i] {
-      const float fraction = float(i) / float(FLAGS_num_depths - 1);
-      const float disp =
-          FLAGS_num_depths == 1 ? dispMin : fraction * dispMin + (1 - fraction) * dispMax;
-      const float depth = 1.0f / disp;
+      const float depth = depths[i];
       LOG(INFO) << folly::sformat("Depth {} of {}...", (FLAGS_num_depths - i), FLAGS_num_depths);
 
       Image equirectImage;
@@ -11,6 +11,7 @@
 #include <folly/Format.h>
 
 #include "source/render/BackgroundSubtractionUtil.h"
+#include "source/util/BenchTrace.h"
 #include "source/util/CvUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
@@ -20,7 +21,6 @@ using namespace fb360_dep;
 using namespace fb360_dep::image_util;
 
 using PixelType = cv::Vec3w;
-using PixelTypeFloat = cv::Vec3f;
 
 const std::string kUsageMessage = R"(
    - Generates foreground masks for a series of frames assuming a fixed background. Various
@@ -87,6 +87,10 @@ int main(int argc, char* argv[]) {
   // not needed anymore
   backgroundColorsFullSize.clear();
 
+  // The background is the same for every frame, blur it once
+  const std::vector<cv::Mat_<cv::Vec3f>> backgrounds =
+      background_subtraction::blurBackgrounds(backgroundColors, FLAGS_blur_radius, FLAGS_threads);
+
   verifyImagePaths(FLAGS_color, rig, FLAGS_first, FLAGS_last);
   for (const Camera& cam : rig) {
     filesystem::create_directories(filesystem::path(FLAGS_foreground_masks) / cam.id);
@@ -99,6 +103,7 @@ int main(int argc, char* argv[]) {
       const std::string frameName =
           image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
       LOG(INFO) << folly::sformat("Processing frame {}...", frameName);
+      bench_trace::ScopedRecord record("foreground_masks", frameName, rig.size());
 
       const int numThreads = 0; // we're multithreading already
       const std::vector<cv::Mat_<PixelType>> frameColors = loadResizedImages<PixelType>(
@@ -106,8 +111,8 @@ int main(int argc, char* argv[]) {
 
       // Generate foreground masks
       const std::vector<cv::Mat_<bool>> foregroundMasks =
-          background_subtraction::generateForegroundMasks<PixelType, PixelTypeFloat>(
-              backgroundColors,
+          background_subtraction::generateForegroundMasks<PixelType>(
+              backgrounds,
               frameColors,
               outputSize,
               FLAGS_blur_radius,
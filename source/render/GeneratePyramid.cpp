@@ -0,0 +1,131 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/String.h>
+
+#include "source/util/CvUtil.h"
+#include "source/util/ImageManifest.h"
+#include "source/util/ImageUtil.h"
+#include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
+#include "source/util/VideoReader.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::image_util;
+
+const std::string kUsageMessage = R"(
+   - Resizes full size images to the fixed widths of the depth estimation pyramid levels, saved in
+   <dst_dir>/level_0/<camera>, <dst_dir>/level_1/<camera>, ... Same output as
+   scripts/render/resize.py, but each image is decoded once and each level is area downsampled from
+   the previous one. Frames of video inputs are saved as .png.
+
+   - Example:
+     ./GeneratePyramid \
+     --rig=/path/to/rigs/rig.json \
+     --src_dir=/path/to/video/color \
+     --dst_dir=/path/to/video/color_levels \
+     --first=000000 \
+     --last=000000
+ )";
+
+DEFINE_string(cameras, "", "comma-separated cameras to resize (empty for all)");
+DEFINE_string(dst_dir, "", "path to output level directories (required)");
+DEFINE_string(first, "", "first frame to process (lexical) (required)");
+DEFINE_string(last, "", "last frame to process (lexical) (required)");
+DEFINE_string(rig, "", "path to camera rig .json (required)");
+DEFINE_string(src_dir, "", "path to input full size images (required)");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
+DEFINE_int32(threshold, -1, "binary threshold applied to every level, e.g. masks (-1 = none)");
+DEFINE_string(widths, "2048,1024,512,256,200,128,100,80,60,50", "level widths, see config.py");
+
+void verifyInputs() {
+  CHECK_NE(FLAGS_dst_dir, "");
+  CHECK_NE(FLAGS_first, "");
+  CHECK_NE(FLAGS_last, "");
+  CHECK_NE(FLAGS_rig, "");
+  CHECK_NE(FLAGS_src_dir, "");
+  CHECK_LE(FLAGS_first, FLAGS_last);
+  CHECK_LE(FLAGS_threshold, 255);
+}
+
+filesystem::path getLevelDir(const int level) {
+  return filesystem::path(FLAGS_dst_dir) / ("level_" + std::to_string(level));
+}
+
+void saveLevel(const filesystem::path& path, const cv::Mat& image) {
+  filesystem::create_directories(path.parent_path());
+  if (path.extension() == ".pfm") {
+    cv_util::writeCvMat32FC1ToPFM(path, image);
+  } else {
+    cv_util::imwriteExceptionOnFail(path, image);
+  }
+}
+
+// Decodes a camera's frame once and saves all its levels
+void generatePyramid(
+    const Camera& camera,
+    const std::vector<int>& widths,
+    const std::string& frame) {
+  const filesystem::path srcPath = imagePath(FLAGS_src_dir, camera.id, frame);
+  const cv::Mat image = cv_util::loadImageUnchanged(srcPath);
+
+  std::vector<cv::Size> sizes;
+  for (const int width : widths) {
+    sizes.push_back(getPyramidLevelSize(camera.resolution, width));
+  }
+  std::vector<cv::Mat> levels = buildPyramid(image, sizes);
+
+  const bool isVideo = !filesystem::exists(srcPath) && video_util::isVideoFrame(srcPath);
+  const std::string ext = isVideo ? ".png" : srcPath.extension().string();
+  for (int level = 0; level < int(levels.size()); ++level) {
+    if (FLAGS_threshold >= 0) {
+      cv::threshold(levels[level], levels[level], FLAGS_threshold, 255, cv::THRESH_BINARY);
+    }
+    saveLevel(getLevelDir(level) / camera.id / (frame + ext), levels[level]);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  system_util::initDep(argc, argv, kUsageMessage);
+  verifyInputs();
+
+  std::vector<std::string> values;
+  folly::split(",", FLAGS_widths, values, true);
+  std::vector<int> widths;
+  for (const std::string& value : values) {
+    widths.push_back(std::stoi(value));
+  }
+  CHECK(!widths.empty()) << "no level widths";
+
+  const Camera::Rig rig = filterDestinations(Camera::loadRig(FLAGS_rig), FLAGS_cameras);
+  const int first = std::stoi(FLAGS_first);
+  const int last = std::stoi(FLAGS_last);
+
+  // One task per image, each decodes its image once and writes all its levels
+  ThreadPool threadPool(FLAGS_threads);
+  for (int iFrame = first; iFrame <= last; ++iFrame) {
+    const std::string frame = intToStringZeroPad(iFrame, 6);
+    for (const Camera& camera : rig) {
+      threadPool.spawn([&, frame] { generatePyramid(camera, widths, frame); });
+    }
+  }
+  threadPool.join();
+
+  for (int level = 0; level < int(widths.size()); ++level) {
+    writeManifest(getLevelDir(level));
+  }
+  LOG(INFO) << folly::sformat(
+      "Saved {} levels of {} frames of {} cameras", widths.size(), last - first + 1, rig.size());
+  return EXIT_SUCCESS;
+}
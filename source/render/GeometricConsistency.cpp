@@ -5,13 +5,15 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <array>
 #include <cmath>
 #include <future>
+#include <map>
+#include <memory>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <opencv2/opencv.hpp>
-#include <unsupported/Eigen/CXX11/Tensor>
 
 #include <folly/Format.h>
 
@@ -21,6 +23,7 @@
 #include "source/util/CvUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 
@@ -40,6 +43,7 @@ const std::string kUsageMessage = R"(
 )";
 
 DEFINE_double(agree_fraction, 0.75, "fraction considered in agreement");
+DEFINE_int32(coarse_levels, 0, "initial depth starts this many halvings coarser (0 = full search)");
 DEFINE_string(color, "", "color directory (required)");
 DEFINE_double(disparity_step, 0.5, "pixels per disparity step");
 DEFINE_double(downscale, 4, "reduced resolution output");
@@ -49,16 +53,15 @@ DEFINE_string(last, "", "last frame to process (lexical)");
 DEFINE_int32(median, 0, "radius of median filter applied to input");
 DEFINE_string(output, "", "output subdirectory (required)");
 DEFINE_int32(pass_count, 2, "how many times to refine depth");
+DEFINE_string(reprojection_cache_dir, "", "directory to cache reprojection tables (empty = none)");
 DEFINE_string(rig, "", "path to rig .json file (required)");
 DEFINE_string(single, "", "render a single destination camera");
+DEFINE_int32(slice_window, 3, "slices searched on either side of the coarser level's depth");
 
 // Image is 16-bit RGBA
 using Pixel = cv::Vec4w;
 using Image = cv::Mat_<Pixel>;
 
-const int kSignedMax = INT16_MAX;
-using SignedPixel = cv::Vec<int16_t, 4>;
-
 void dump(const filesystem::path& path, const cv::Mat_<float>& mat) {
   fb360_dep::cv_util::writeCvMat32FC1ToPFM(path.string() + ".pfm", mat);
   // for convenience, also dump 1.0 m / mat as png
@@ -92,6 +95,33 @@ std::vector<GLuint> createTextures(
   return result;
 }
 
+// same as createTextures() the first time, after that mats go into the existing textures
+template <typename T>
+void uploadTextures(
+    std::vector<GLuint>& textures,
+    const std::vector<T>& mats,
+    const GLenum internalFormat,
+    const GLenum format,
+    const GLenum type) {
+  if (textures.empty()) {
+    textures = createTextures(mats, internalFormat, format, type);
+    return;
+  }
+  CHECK_EQ(textures.size(), mats.size());
+  for (int i = 0; i < int(mats.size()); ++i) {
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    glTexSubImage2D(
+        GL_TEXTURE_2D, 0, 0, 0, mats[i].cols, mats[i].rows, format, type, mats[i].ptr());
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+}
+
+void deleteTextures(const std::vector<GLuint>& textures) {
+  for (const GLuint& texture : textures) {
+    glDeleteTextures(1, &texture);
+  }
+}
+
 static Camera::Real computeRigRadius(const Camera::Rig& rig) {
   Camera::Real sum = 0;
   for (const Camera& camera : rig) {
@@ -100,160 +130,416 @@ static Camera::Real computeRigRadius(const Camera::Rig& rig) {
   return sum / rig.size();
 }
 
-template <typename T>
-T sq(const T& t) {
-  return t * t;
+Camera::Real sliceDisparity(const int slice, const int sliceCount) {
+  return ReprojectionTable::unnormalizeDisparity((slice + 0.5) / sliceCount);
 }
 
-float sumNorm(const SignedPixel& rgba) {
-  float sum = 0;
-  for (int c = 0; c < 3; ++c) { // exclude alpha
-    sum += float(rgba[c]);
-  }
-  return sum / kSignedMax;
+// inverse of sliceDisparity(), not rounded
+float depthSlice(const float depth, const int sliceCount) {
+  return ReprojectionTable::normalizeDisparity(1 / depth) * sliceCount - 0.5f;
 }
 
-float sumSqNorm(const SignedPixel& rgba) {
-  float sum = 0;
-  for (int c = 0; c < 3; ++c) { // exclude alpha
-    sum += sq(float(rgba[c]));
-  }
-  return sum / (kSignedMax * kSignedMax);
+// how many slices it takes for the closest depth to move FLAGS_disparity_step pixels
+int computeSliceCount(const Camera::Rig& rig, const Camera& dst) {
+  const Camera::Real radius = computeRigRadius(rig);
+  const Camera::Real minDistance = 1 / ReprojectionTable::maxDisparity();
+  const Camera::Real angle = asin(radius / minDistance);
+  const Camera::Real focal = dst.focal.norm() * sqrt(0.5);
+  const Camera::Real pixels = focal * angle;
+  return std::round(pixels / FLAGS_disparity_step);
 }
 
-Camera::Real sliceDisparity(const int slice, const int sliceCount) {
-  return ReprojectionTable::unnormalizeDisparity((slice + 0.5) / sliceCount);
-}
+// cost of a slice for one src, blended into (sum of costs, count of srcs)
+// cost is the variance over a 3x3 window of the difference between the reprojected src and the dst
+// image, summed over color channels. Pixels where any of the window is outside the src, or
+// occluded according to the src depth, don't count
+// With a prior, pixels only consider slices within sliceWindow of the prior's slice
+const std::string kAccumulateShader = R"(
+  #version 330 core
+
+  uniform vec3 reprojectionScale;
+  uniform vec3 reprojectionOffset;
+  uniform sampler3D reprojectionTexture;
+  uniform sampler2D srcTexture;
+  uniform sampler2D referenceTexture; // dst color, at dst resolution
+  uniform sampler2D directionTexture; // direction of the rig ray through each dst pixel
+  uniform sampler2D depthTexture; // src depth
+  uniform sampler2D priorTexture; // dst depth at a coarser resolution
+
+  uniform bool useDepths;
+  uniform bool usePrior;
+  uniform vec3 dstPosition;
+  uniform vec3 srcPosition;
+  uniform float agreeFraction;
+  uniform float disparity;
+  uniform float slice;
+  uniform float sliceCount;
+  uniform float sliceWindow;
+  uniform float minDisparity;
+  uniform float maxDisparity;
+
+  in vec2 texVar;
+  out vec2 result;
+
+  vec2 reproject(vec2 dst) {
+    return texture(
+      reprojectionTexture,
+      vec3(dst, disparity) * reprojectionScale + reprojectionOffset).xy;
+  }
 
-using Volume = Eigen::Tensor<float, 3, Eigen::RowMajor>;
-
-DepthMat winnerTakesAll(const Volume& costs) {
-  // find cheapest depth for each x, y in costs (NAN if everything is NAN)
-  DepthMat depth(costs.dimension(1), costs.dimension(2), NAN);
-  Eigen::MatrixXf best(depth.rows, depth.cols);
-  best.setConstant(FLT_MAX);
-  for (int d = 0; d < costs.dimension(0); ++d) {
-    for (int y = 0; y < costs.dimension(1); ++y) {
-      for (int x = 0; x < costs.dimension(2); ++x) {
-        if (best(y, x) > costs(d, y, x)) { // note: (x > NAN) is alwyas false
-          best(y, x) = costs(d, y, x);
-          depth(y, x) = 1 / sliceDisparity(d, costs.dimension(0));
+  void main() {
+    ivec2 size = textureSize(referenceTexture, 0);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    if (usePrior) {
+      ivec2 priorSize = textureSize(priorTexture, 0);
+      ivec2 priorPixel = min(ivec2(texVar * vec2(priorSize)), priorSize - 1);
+      float prior = texelFetch(priorTexture, priorPixel, 0).r;
+      if (!isnan(prior)) {
+        float normalized = (1 / prior - minDisparity) / (maxDisparity - minDisparity);
+        if (abs(normalized * sliceCount - 0.5 - slice) > sliceWindow) {
+          discard;
         }
       }
     }
-  }
 
-  // NAN out the edges
-  for (int y = 0; y < costs.dimension(1); ++y) {
-    depth(y, 0) = depth(y, costs.dimension(2) - 1) = NAN;
+    vec3 sum = vec3(0);
+    vec3 sumSq = vec3(0);
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        ivec2 p = clamp(pixel + ivec2(dx, dy), ivec2(0), size - 1);
+        vec2 srcCoor = reproject((vec2(p) + 0.5) / vec2(size));
+        vec4 src = texture(srcTexture, srcCoor);
+        if (src.a < 1) {
+          discard; // outside src
+        }
+        if (useDepths) {
+          float depth = texture(depthTexture, srcCoor).r;
+          vec3 world = dstPosition + texelFetch(directionTexture, p, 0).xyz / disparity;
+          if (depth < distance(world, srcPosition) * agreeFraction) {
+            discard; // src is occluded, note: (NAN < x) is false
+          }
+        }
+        vec3 diff = src.rgb - texelFetch(referenceTexture, p, 0).rgb;
+        sum += diff;
+        sumSq += diff * diff;
+      }
+    }
+    vec3 average = sum / 9;
+    result = vec2(dot(sumSq / 9 - average * average, vec3(1)), 1);
   }
-  for (int x = 0; x < costs.dimension(2); ++x) {
-    depth(0, x) = depth(costs.dimension(1) - 1, x) = NAN;
+)";
+
+// winner takes all, one slice at a time: keep (cost, depth) of the cheapest slice so far
+const std::string kReduceShader = R"(
+  #version 330 core
+
+  uniform sampler2D accumTexture;
+  uniform sampler2D bestTexture;
+  uniform float depth;
+
+  out vec2 result;
+
+  void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec2 accum = texelFetch(accumTexture, pixel, 0).xy;
+    vec2 best = texelFetch(bestTexture, pixel, 0).xy;
+    result = best;
+    if (accum.y > 0 && accum.x / accum.y < best.x) {
+      result = vec2(accum.x / accum.y, depth);
+    }
   }
-  return depth;
+)";
+
+// Unlike setUniform(), these don't complain about uniforms the compiler optimized away
+void setUniformIfUsed(const GLuint program, const char* name, const GLint value) {
+  glUniform1i(glGetUniformLocation(program, name), value);
 }
 
-cv::Mat_<SignedPixel> computeReference(const Image& image, int w, int h) {
-  Image resized = cv_util::resizeImage(image, {w, h});
-  cv::Mat_<SignedPixel> reference;
-  resized.convertTo(reference, CV_16S, INT16_MAX / double(UINT16_MAX));
-  return reference;
+void setUniformIfUsed(const GLuint program, const char* name, const float value) {
+  glUniform1f(glGetUniformLocation(program, name), value);
 }
 
-DepthMat computeDepth(
-    const Camera::Rig& rig, // rig determines the resolution of the result
-    const int d,
-    const std::vector<Image>& images, // full resolution images
-    const std::vector<GLuint>& imageTextures,
-    const std::vector<DepthMat>& depths = {}, // could be same rez as rig, or not
-    const std::vector<GLuint>& depthTextures = {}) {
-  const Camera& dst = rig[d];
-  LOG(INFO) << folly::sformat("compute depth for {}", dst.id);
+void setUniformIfUsed(const GLuint program, const char* name, const Camera::Vector3& value) {
+  const Eigen::Vector3f v = value.cast<float>();
+  glUniform3fv(glGetUniformLocation(program, name), 1, v.data());
+}
+
+void bindTextureIfUsed(
+    const GLuint program,
+    const char* name,
+    const GLuint unit,
+    const GLenum target,
+    const GLuint texture) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(target, texture);
+  glUniform1i(glGetUniformLocation(program, name), unit);
+}
+
+GLuint createTargetTexture(const cv::Size& size) {
+  GLuint texture = createTexture(GL_TEXTURE_2D);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, size.width, size.height, 0, GL_RG, GL_FLOAT, nullptr);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  return texture;
+}
 
-  // compute reprojection textures
-  std::vector<ReprojectionTexture> reprojections;
-  for (const Camera& src : rig) {
-    reprojections.emplace_back(dst, src);
+// One resolution of the downscaled rig
+// Everything but the colors and depths of the current frame is computed the first time it is
+// needed and then kept for the whole run
+struct Level {
+  explicit Level(const Camera::Rig& rig) : rig(rig), reprojections(rig.size()) {
+    for (auto& row : reprojections) {
+      row.resize(rig.size());
+    }
   }
 
-  // downsample destination image
-  const int w = dst.resolution.x();
-  const int h = dst.resolution.y();
-  cv::Mat_<SignedPixel> reference = computeReference(images[d], w, h);
+  ~Level() {
+    deleteTextures(references);
+    deleteTextures(directions);
+    deleteTextures(depths);
+  }
 
-  // compute how many slices we need
-  const Camera::Real radius = computeRigRadius(rig);
-  const Camera::Real minDistance = 1 / ReprojectionTable::maxDisparity();
-  const Camera::Real angle = asin(radius / minDistance);
-  const Camera::Real focal = dst.focal.norm() * sqrt(0.5);
-  const Camera::Real pixels = focal * angle;
-  const int sliceCount = std::round(pixels / FLAGS_disparity_step);
-
-  // compute each slice of the cost volume
-  Volume costs(sliceCount, h, w);
-  for (int slice = 0; slice < sliceCount; ++slice) {
-    Camera::Real disparity = sliceDisparity(slice, sliceCount);
-    LOG(INFO) << folly::sformat("slice {}/{} ({})", slice, sliceCount, disparity);
-
-    // accumulate each source cost into accum
-    cv::Mat_<cv::Vec2f> accum(h, w, cv::Vec2f(0, 0));
-    for (int s = 0; s < int(rig.size()); ++s) {
-      if (s == d) {
-        continue; // don't compare destination to itself
-      }
+  const ReprojectionTexture& getReprojection(const int d, const int s) {
+    if (!reprojections[d][s]) {
+      reprojections[d][s] =
+          std::make_unique<ReprojectionTexture>(rig[d], rig[s], FLAGS_reprojection_cache_dir);
+    }
+    return *reprojections[d][s];
+  }
 
-      // compute src color at disparity by reprojection
-      cv::Mat_<SignedPixel> image = reproject<SignedPixel>(
-          w, h, GL_RGBA16, GL_RGBA, GL_SHORT, reprojections[s], imageTextures[s], disparity);
-
-      // alpha away occluded areas if we have depth information
-      if (!depths.empty()) {
-        DepthMat depth = reproject<float>(
-            w, h, GL_R32F, GL_RED, GL_FLOAT, reprojections[s], depthTextures[s], disparity);
-        for (int y = 0; y < h; ++y) {
-          for (int x = 0; x < w; ++x) {
-            if (!std::isnan(depth(y, x))) {
-              const Camera::Vector3 world = dst.rig({x, y}, 1 / disparity);
-              const Camera::Real distance = (world - rig[s].position).norm();
-              if (depth(y, x) < distance * FLAGS_agree_fraction) {
-                image(y, x)[3] = 0; // src is occluded
-              }
-            }
+  GLuint getDirections(const int d) {
+    if (directions.empty()) {
+      for (const Camera& dst : rig) {
+        const cv::Size size(dst.resolution.x(), dst.resolution.y());
+        cv::Mat_<cv::Vec3f> mat(size);
+        for (int y = 0; y < size.height; ++y) {
+          for (int x = 0; x < size.width; ++x) {
+            const Camera::Vector3 direction = dst.rig({x + 0.5, y + 0.5}).direction();
+            mat(y, x) = cv::Vec3f(direction.x(), direction.y(), direction.z());
           }
         }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        directions.push_back(
+            createTexture(size.width, size.height, mat.ptr(), GL_RGB32F, GL_RGB, GL_FLOAT));
       }
+    }
+    return directions[d];
+  }
 
-      // compute average of difference
-      cv::Mat_<SignedPixel> diff = image - reference;
-      const cv::Size box(3, 3);
-      cv::Mat_<SignedPixel> average;
-      cv::blur(diff, average, box);
-
-      // compute average of diff^2
-      cv::Mat_<SignedPixel> averageOfSq;
-      cv::blur(diff.mul(diff, 1.0 / kSignedMax), averageOfSq, box);
-
-      // cost += variance of diff = average of diff^2 - (average of diff)^2
-      for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-          if (image(y, x)[3] == kSignedMax && average(y, x)[3] == 0) {
-            accum(y, x) += cv::Vec2f(sumNorm(averageOfSq(y, x)) - sumSqNorm(average(y, x)), 1);
-          }
+  // dst colors at the resolution of the level, for the current frame
+  void uploadReferences(const std::vector<Image>& images) {
+    std::vector<Image> resized;
+    for (int d = 0; d < int(rig.size()); ++d) {
+      const cv::Size size(rig[d].resolution.x(), rig[d].resolution.y());
+      resized.push_back(cv_util::resizeImage(images[d], size));
+    }
+    uploadTextures(references, resized, GL_RGBA16, GL_RGBA, GL_UNSIGNED_SHORT);
+  }
+
+  void uploadDepths(const std::vector<DepthMat>& mats) {
+    uploadTextures(depths, mats, GL_R32F, GL_RED, GL_FLOAT);
+    depthMats = mats;
+  }
+
+  const Camera::Rig rig;
+  std::vector<std::vector<std::unique_ptr<ReprojectionTexture>>> reprojections; // [dst][src]
+  std::vector<GLuint> references;
+  std::vector<GLuint> directions;
+  std::vector<GLuint> depths; // clean depths at level 0, estimates at coarser levels
+  std::vector<DepthMat> depthMats; // what depths holds
+};
+
+// copy of depth with the NAN edges from computeDepth() replaced by their neighbors
+DepthMat fillEdges(const DepthMat& depth) {
+  DepthMat result = depth.clone();
+  if (result.rows > 2 && result.cols > 2) {
+    result.row(1).copyTo(result.row(0));
+    result.row(result.rows - 2).copyTo(result.row(result.rows - 1));
+    result.col(1).copyTo(result.col(0));
+    result.col(result.cols - 2).copyTo(result.col(result.cols - 1));
+  }
+  return result;
+}
+
+// Programs and render targets, kept for the whole run
+class CostVolume {
+ public:
+  CostVolume()
+      : accumulate(createProgram(fullscreenVertexShader(), kAccumulateShader)),
+        reduce(createProgram(fullscreenVertexShader(), kReduceShader)) {
+    glGenFramebuffers(1, &fbo);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+  }
+
+  ~CostVolume() {
+    for (const auto& entry : targets) {
+      deleteTextures({entry.second.accum, entry.second.best[0], entry.second.best[1]});
+    }
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteProgram(accumulate);
+    glDeleteProgram(reduce);
+  }
+
+  // Winner takes all over the slices of dst d, computed slice by slice without leaving the GPU
+  // Only the winning depth is read back
+  DepthMat computeDepth(
+      Level& level,
+      const int d,
+      const std::vector<GLuint>& imageTextures,
+      const bool useDepths,
+      const Level* prior = nullptr) {
+    const Camera& dst = level.rig[d];
+    LOG(INFO) << folly::sformat("compute depth for {}", dst.id);
+    const cv::Size size(dst.resolution.x(), dst.resolution.y());
+    const Targets& target = getTargets(size);
+    const int sliceCount = computeSliceCount(level.rig, dst);
+    const std::pair<int, int> slices = prior ? priorSlices(*prior, d, sliceCount)
+                                             : std::make_pair(0, sliceCount);
+
+    glUseProgram(accumulate);
+    bindTextureIfUsed(accumulate, "referenceTexture", 2, GL_TEXTURE_2D, level.references[d]);
+    bindTextureIfUsed(accumulate, "directionTexture", 3, GL_TEXTURE_2D, level.getDirections(d));
+    bindTextureIfUsed(accumulate, "priorTexture", 5, GL_TEXTURE_2D, prior ? prior->depths[d] : 0);
+    setUniformIfUsed(accumulate, "useDepths", GLint(useDepths));
+    setUniformIfUsed(accumulate, "usePrior", GLint(prior != nullptr));
+    setUniformIfUsed(accumulate, "dstPosition", dst.position);
+    setUniformIfUsed(accumulate, "agreeFraction", float(FLAGS_agree_fraction));
+    setUniformIfUsed(accumulate, "sliceCount", float(sliceCount));
+    setUniformIfUsed(accumulate, "sliceWindow", float(FLAGS_slice_window));
+    setUniformIfUsed(accumulate, "minDisparity", ReprojectionTable::minDisparity());
+    setUniformIfUsed(accumulate, "maxDisparity", ReprojectionTable::maxDisparity());
+    glUseProgram(reduce);
+    bindTextureIfUsed(reduce, "accumTexture", 6, GL_TEXTURE_2D, target.accum);
+
+    clear(target.best[0], size, FLT_MAX); // depth 0 is no depth
+    int current = 0;
+    for (int slice = slices.first; slice < slices.second; ++slice) {
+      const Camera::Real disparity = sliceDisparity(slice, sliceCount);
+      LOG(INFO) << folly::sformat("slice {}/{} ({})", slice, sliceCount, disparity);
+
+      // accumulate each source cost into accum
+      clear(target.accum, size, 0);
+      glUseProgram(accumulate);
+      setUniformIfUsed(accumulate, "disparity", float(disparity));
+      setUniformIfUsed(accumulate, "slice", float(slice));
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_ONE, GL_ONE);
+      for (int s = 0; s < int(level.rig.size()); ++s) {
+        if (s == d) {
+          continue; // don't compare destination to itself
         }
+        const ReprojectionTexture& reprojection = level.getReprojection(d, s);
+        bindTextureIfUsed(
+            accumulate, "reprojectionTexture", 0, GL_TEXTURE_3D, reprojection.texture);
+        bindTextureIfUsed(accumulate, "srcTexture", 1, GL_TEXTURE_2D, imageTextures[s]);
+        const GLuint depthTexture = useDepths ? level.depths[s] : 0;
+        bindTextureIfUsed(accumulate, "depthTexture", 4, GL_TEXTURE_2D, depthTexture);
+        glUniform3fv(
+            glGetUniformLocation(accumulate, "reprojectionScale"), 1, reprojection.scale.data());
+        glUniform3fv(
+            glGetUniformLocation(accumulate, "reprojectionOffset"), 1, reprojection.offset.data());
+        setUniformIfUsed(accumulate, "srcPosition", level.rig[s].position);
+        render(accumulate, size, target.accum);
       }
+      glDisable(GL_BLEND);
+
+      // transfer accumulated fraction to cost and keep the cheapest
+      glUseProgram(reduce);
+      bindTextureIfUsed(reduce, "bestTexture", 7, GL_TEXTURE_2D, target.best[current]);
+      setUniformIfUsed(reduce, "depth", float(1 / disparity));
+      render(reduce, size, target.best[1 - current]);
+      current = 1 - current;
     }
 
-    // transfer accumulated fraction to cost
-    for (int y = 0; y < h; ++y) {
-      for (int x = 0; x < w; ++x) {
-        costs(slice, y, x) = accum(y, x)[0] / accum(y, x)[1];
+    // read back the depths of the winners
+    cv::Mat_<cv::Vec2f> best(size);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.best[current], 0);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, size.width, size.height, GL_RG, GL_FLOAT, best.ptr());
+    DepthMat depth(size);
+    for (int y = 0; y < size.height; ++y) {
+      for (int x = 0; x < size.width; ++x) {
+        depth(y, x) = best(y, x)[1] == 0 ? NAN : best(y, x)[1]; // NAN if everything is NAN
       }
     }
+
+    // NAN out the edges
+    for (int y = 0; y < depth.rows; ++y) {
+      depth(y, 0) = depth(y, depth.cols - 1) = NAN;
+    }
+    for (int x = 0; x < depth.cols; ++x) {
+      depth(0, x) = depth(depth.rows - 1, x) = NAN;
+    }
+    return depth;
   }
 
-  // winner takes all
-  return winnerTakesAll(costs);
-}
+ private:
+  struct Targets {
+    GLuint accum; // (sum of costs, count) of the current slice
+    std::array<GLuint, 2> best; // (cost, depth) of the cheapest slice so far, ping pong
+  };
+
+  const Targets& getTargets(const cv::Size& size) {
+    const std::pair<int, int> key(size.width, size.height);
+    auto it = targets.find(key);
+    if (it == targets.end()) {
+      Targets target;
+      target.accum = createTargetTexture(size);
+      target.best = {{createTargetTexture(size), createTargetTexture(size)}};
+      it = targets.emplace(key, target).first;
+    }
+    return it->second;
+  }
+
+  // slices within the window of some prior, or every slice if the prior has no estimate somewhere
+  static std::pair<int, int> priorSlices(const Level& prior, const int d, const int sliceCount) {
+    const DepthMat& depth = prior.depthMats[d];
+    float lo = FLT_MAX;
+    float hi = -FLT_MAX;
+    for (int y = 0; y < depth.rows; ++y) {
+      for (int x = 0; x < depth.cols; ++x) {
+        if (std::isnan(depth(y, x))) {
+          return std::make_pair(0, sliceCount);
+        }
+        const float slice = depthSlice(depth(y, x), sliceCount);
+        lo = std::min(lo, slice);
+        hi = std::max(hi, slice);
+      }
+    }
+    const int begin = std::max(0, int(std::floor(lo - FLAGS_slice_window)));
+    const int end = std::min(sliceCount, int(std::ceil(hi + FLAGS_slice_window)) + 1);
+    LOG(INFO) << folly::sformat("searching slices {}..{} of {}", begin, end, sliceCount);
+    return std::make_pair(begin, end);
+  }
+
+  void clear(const GLuint texture, const cv::Size& size, const float value) {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glViewport(0, 0, size.width, size.height);
+    glClearColor(value, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+
+  void render(const GLuint program, const cv::Size& size, const GLuint texture) {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    glViewport(0, 0, size.width, size.height);
+    glUseProgram(program);
+    fullscreen(program);
+  }
+
+  const GLuint accumulate;
+  const GLuint reduce;
+  GLuint fbo;
+  std::map<std::pair<int, int>, Targets> targets;
+};
 
 bool isPointBad(
     const Camera::Vector3& world,
@@ -296,14 +582,14 @@ DepthMat cleanDepth(const Camera::Rig& rig, const int d, const std::vector<Depth
   DepthMat depth = depths[d].clone();
   CHECK_EQ(dst.resolution.x(), depth.cols);
   CHECK_EQ(dst.resolution.y(), depth.rows);
-  for (int y = 0; y < depth.rows; ++y) {
+  parallelFor(0, depth.rows, 1, [&](const int y) {
     for (int x = 0; x < depth.cols; ++x) {
       Camera::Vector3 world = dst.rig({x + 0.5, y + 0.5}, depth(y, x));
       if (isPointBad(world, rig, d, depths)) {
         depth(y, x) = NAN;
       }
     }
-  }
+  });
   return depth;
 }
 
@@ -328,65 +614,100 @@ Camera::Rig downscale(const Camera::Rig& rig) {
   return result;
 }
 
-void processFrame(const std::string& frameName, const Camera::Rig& rig) {
+// halve the resolution of every camera
+Camera::Rig coarsen(const Camera::Rig& rig) {
+  Camera::Rig result;
+  for (const Camera& camera : rig) {
+    Camera::Vector2 resolution = camera.resolution / 2;
+    result.push_back(camera.rescale(resolution.array().round()));
+  }
+  return result;
+}
+
+// GL state kept from frame to frame
+struct Gpu {
+  explicit Gpu(const Camera::Rig& rig) {
+    // levels[0] is the output resolution, each coarser level halves it
+    levels.push_back(std::make_unique<Level>(downscale(rig)));
+    for (int level = 1; level <= FLAGS_coarse_levels; ++level) {
+      levels.push_back(std::make_unique<Level>(coarsen(levels.back()->rig)));
+    }
+  }
+
+  ~Gpu() {
+    deleteTextures(imageTextures);
+  }
+
+  CostVolume costVolume;
+  std::vector<std::unique_ptr<Level>> levels;
+  std::vector<GLuint> imageTextures; // full resolution images of the current frame
+};
+
+void processFrame(const std::string& frameName, const Camera::Rig& rig, Gpu& gpu) {
   const filesystem::path path = filesystem::path(FLAGS_output) / frameName;
   filesystem::create_directory(path);
 
   // load images
   const std::vector<Image> images = image_util::loadImages<Pixel>(FLAGS_color, rig, frameName);
-  const std::vector<GLuint> imageTextures =
-      createTextures(images, GL_RGBA16, GL_RGBA, GL_UNSIGNED_SHORT);
-
-  // compute initial depth estimate
-  Camera::Rig small = downscale(rig);
-  std::vector<DepthMat> depths(small.size());
-  for (int d = 0; d < int(small.size()); ++d) {
-    depths[d] = computeDepth(small, d, images, imageTextures);
-    dump(path / folly::sformat("{}_iffy", small[d].id), depths[d]);
+  uploadTextures(gpu.imageTextures, images, GL_RGBA16, GL_RGBA, GL_UNSIGNED_SHORT);
+
+  // compute initial depth estimate, coarse to fine
+  std::vector<DepthMat> depths;
+  for (int l = int(gpu.levels.size()) - 1; l >= 0; --l) {
+    Level& level = *gpu.levels[l];
+    const Level* prior = l + 1 < int(gpu.levels.size()) ? gpu.levels[l + 1].get() : nullptr;
+    level.uploadReferences(images);
+    depths.resize(level.rig.size());
+    for (int d = 0; d < int(level.rig.size()); ++d) {
+      const bool kUseDepths = false;
+      depths[d] = gpu.costVolume.computeDepth(level, d, gpu.imageTextures, kUseDepths, prior);
+    }
+    if (l > 0) {
+      std::vector<DepthMat> filled;
+      for (const DepthMat& depth : depths) {
+        filled.push_back(fillEdges(depth));
+      }
+      level.uploadDepths(filled);
+    }
+  }
+  Level& small = *gpu.levels[0];
+  for (int d = 0; d < int(small.rig.size()); ++d) {
+    dump(path / folly::sformat("{}_iffy", small.rig[d].id), depths[d]);
   }
 
   // refine depth estimate
   for (int pass = 0; pass < FLAGS_pass_count; ++pass) {
     // compute clean depths by getting rid of improbable ones
     std::vector<DepthMat> cleanDepths;
-    for (int d = 0; d < int(small.size()); ++d) {
-      cleanDepths.push_back(cleanDepth(small, d, depths));
-      dump(path / folly::sformat("{}_{}_clean", small[d].id, pass), cleanDepths[d]);
+    for (int d = 0; d < int(small.rig.size()); ++d) {
+      cleanDepths.push_back(cleanDepth(small.rig, d, depths));
+      dump(path / folly::sformat("{}_{}_clean", small.rig[d].id, pass), cleanDepths[d]);
     }
-    const std::vector<GLuint> cleanDepthTextures =
-        createTextures(cleanDepths, GL_R32F, GL_RED, GL_FLOAT);
+    small.uploadDepths(cleanDepths);
 
     // recompute depth using cleaned depths
-    for (int d = 0; d < int(small.size()); ++d) {
-      depths[d] = computeDepth(small, d, images, imageTextures, cleanDepths, cleanDepthTextures);
-      dump(path / folly::sformat("{}_{}", small[d].id, pass), depths[d]);
+    for (int d = 0; d < int(small.rig.size()); ++d) {
+      const bool kUseDepths = true;
+      depths[d] = gpu.costVolume.computeDepth(small, d, gpu.imageTextures, kUseDepths);
+      dump(path / folly::sformat("{}_{}", small.rig[d].id, pass), depths[d]);
     }
 
     // restore clean depths
     if (FLAGS_keep_clean) {
-      for (int d = 0; d < int(small.size()); ++d) {
+      for (int d = 0; d < int(small.rig.size()); ++d) {
         restoreCleanDepth(depths[d], cleanDepths[d]);
       }
     }
-
-    // free clean depth textures
-    for (const GLuint& texture : cleanDepthTextures) {
-      glDeleteTextures(1, &texture);
-    }
-  }
-
-  // free image textures
-  for (const GLuint& texture : imageTextures) {
-    glDeleteTextures(1, &texture);
   }
 }
 
 class OffscreenWindow : public GlWindow {
  protected:
   Camera::Rig& rig;
+  Gpu gpu;
 
  public:
-  OffscreenWindow(Camera::Rig& rig) : GlWindow::GlWindow(), rig(rig) {
+  OffscreenWindow(Camera::Rig& rig) : GlWindow::GlWindow(), rig(rig), gpu(rig) {
     filesystem::create_directory(FLAGS_output);
   }
 
@@ -397,7 +718,7 @@ class OffscreenWindow : public GlWindow {
           image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
       LOG(INFO) << folly::sformat("Processing frame {}", frameName);
 
-      processFrame(frameName, rig);
+      processFrame(frameName, rig, gpu);
     }
   }
 };
@@ -0,0 +1,269 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include <glog/logging.h>
+#include <Eigen/Geometry>
+#include <opencv2/core/core.hpp>
+
+namespace fb360_dep {
+namespace render {
+
+// Simplifier for meshes that are regular grids, such as the equi-error meshes of a depth map (see
+// mesh_util::getVertexesEquiError)
+// Based on "Right-Triangulated Irregular Networks", by W. Evans, D. Kirkpatrick and G. Townsend
+// The grid is covered by a binary tree of right triangles, each split in two at the middle of its
+// hypotenuse. The error of a split is how far the vertex at the middle is from the hypotenuse (in
+// z), accumulated over the descendants, so a mesh for any error threshold comes from a single walk
+// down the tree and has no cracks. Unlike MeshSimplifier vertexes never move, and both building
+// the tree and extracting a mesh take time linear in the size of the grid and of the mesh
+// Triangles with masked out vertexes are dropped, and so are the ones that cross a tear, i.e.
+//   min(z) / max(z) < tearRatio
+// as in mesh_util::getFaces. Triangles that contain any of those are always split
+class GridSimplifier final {
+ public:
+  // vertexes hold the grid in row-major order, mask is false where there is no geometry
+  // vertexes must outlive the simplifier
+  GridSimplifier(const Eigen::MatrixXd& vertexes, const cv::Mat_<bool>& mask, const float tearRatio)
+      : vertexesIn(vertexes), width(mask.cols), height(mask.rows), tearRatio(tearRatio) {
+    CHECK_EQ(width * height, vertexes.rows());
+    int tileSize = 1;
+    while (tileSize + 1 < std::max(width, height)) {
+      tileSize *= 2;
+    }
+    size = tileSize + 1;
+    isValid.assign(size * size, false);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const double z = vertexes(y * width + x, 2);
+        isValid[y * size + x] = mask(y, x) && !std::isnan(z);
+      }
+    }
+    computeErrors();
+  }
+
+  // Coarsest mesh with at most numFacesOut faces, as long as the masks and tears allow it
+  // Each split adds one face, so the mesh for a threshold has as many faces as the coarsest mesh
+  // plus the number of triangles whose (finite) error is above the threshold. Errors are shared by
+  // two triangles, or one on the border of the tree's grid
+  void simplify(const int numFacesOut) {
+    const int numSplits = numFacesOut - countFaces(maxError);
+    std::vector<float> splits;
+    const int tileSize = size - 1;
+    for (int y = 0; y < size; ++y) {
+      for (int x = 0; x < size; ++x) {
+        const float error = errors[y * size + x];
+        if (0 < error && error < kInfinity) {
+          splits.push_back(error);
+          if (0 < x && x < tileSize && 0 < y && y < tileSize) {
+            splits.push_back(error);
+          }
+        }
+      }
+    }
+    double threshold = maxError;
+    if (numSplits >= int(splits.size())) {
+      threshold = 0;
+    } else if (numSplits > 0) {
+      std::nth_element(
+          splits.begin(), splits.begin() + numSplits, splits.end(), std::greater<float>());
+      threshold = splits[numSplits];
+    }
+    simplifyToError(threshold);
+  }
+
+  // Mesh with z within maxErrorOut of the grid
+  void simplifyToError(const double maxErrorOut) {
+    faces.clear();
+    walk(maxErrorOut, [&](const int a, const int b, const int c) { faces.push_back({a, b, c}); });
+  }
+
+  Eigen::MatrixXd getVertexes() {
+    reindex();
+    Eigen::MatrixXd vertexesOut(vertexesUsed.size(), 3);
+    for (int i = 0; i < int(vertexesUsed.size()); ++i) {
+      vertexesOut.row(i) = vertexesIn.row(vertexesUsed[i]);
+    }
+    return vertexesOut;
+  }
+
+  Eigen::MatrixXi getFaces() {
+    reindex();
+    Eigen::MatrixXi facesOut(faces.size(), 3);
+    for (int i = 0; i < int(faces.size()); ++i) {
+      for (int j = 0; j < 3; ++j) {
+        facesOut(i, j) = vertexesIndex[faces[i][j]];
+      }
+    }
+    return facesOut;
+  }
+
+ private:
+  static constexpr float kInfinity = std::numeric_limits<float>::infinity();
+
+  double getZ(const int x, const int y) const {
+    return vertexesIn(y * width + x, 2);
+  }
+
+  // Whether the unit triangle with corners a, b, c goes in the mesh
+  bool isKept(const int ax, const int ay, const int bx, const int by, const int cx, const int cy)
+      const {
+    if (!isValid[ay * size + ax] || !isValid[by * size + bx] || !isValid[cy * size + cx]) {
+      return false;
+    }
+    const double za = getZ(ax, ay);
+    const double zb = getZ(bx, by);
+    const double zc = getZ(cx, cy);
+    const double zMin = std::min(za, std::min(zb, zc));
+    const double zMax = std::max(za, std::max(zb, zc));
+    return zMin >= tearRatio * zMax;
+  }
+
+  // Triangle i of the tree has corners a, b (the hypotenuse) and c. Triangles 0 and 1 cover the
+  // grid, and the children of i are 2i + 2 (c, a, m) and 2i + 3 (b, c, m), m the middle of ab
+  // As in Martini (https://github.com/mapbox/martini), errors are kept per grid point: a split
+  // vertex is shared by the two triangles on each side of the hypotenuse, so they split together
+  void computeErrors() {
+    errors.assign(size * size, 0);
+    const int tileSize = size - 1;
+    const int64_t numTriangles = int64_t(tileSize) * tileSize * 2 - 2;
+    const int64_t numParentTriangles = numTriangles - int64_t(tileSize) * tileSize;
+    for (int64_t i = numTriangles - 1; i >= 0; --i) {
+      int64_t id = i + 2;
+      int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+      if (id & 1) {
+        bx = by = cx = tileSize;
+      } else {
+        ax = ay = cy = tileSize;
+      }
+      while ((id >>= 1) > 1) {
+        const int mx = (ax + bx) >> 1;
+        const int my = (ay + by) >> 1;
+        if (id & 1) {
+          bx = ax;
+          by = ay;
+          ax = cx;
+          ay = cy;
+        } else {
+          ax = bx;
+          ay = by;
+          bx = cx;
+          by = cy;
+        }
+        cx = mx;
+        cy = my;
+      }
+
+      const int mx = (ax + bx) >> 1;
+      const int my = (ay + by) >> 1;
+      float& error = errors[my * size + mx];
+      if (i >= numParentTriangles) {
+        // Children are unit triangles, split unless both of them go in the mesh
+        if (!isKept(cx, cy, ax, ay, mx, my) || !isKept(bx, by, cx, cy, mx, my)) {
+          error = kInfinity;
+        }
+      } else {
+        error = std::max(error, errors[((ay + cy) >> 1) * size + ((ax + cx) >> 1)]);
+        error = std::max(error, errors[((by + cy) >> 1) * size + ((bx + cx) >> 1)]);
+      }
+      if (error == kInfinity) {
+        continue; // a, b or m may not be valid
+      }
+      const double interpolated = (getZ(ax, ay) + getZ(bx, by)) / 2;
+      error = std::max(error, float(std::abs(interpolated - getZ(mx, my))));
+      maxError = std::max(maxError, double(error));
+    }
+  }
+
+  // Calls emit(a, b, c) for each triangle of the mesh for threshold, with grid indexes
+  template <typename Emit>
+  void walk(const double threshold, Emit emit) const {
+    const int tileSize = size - 1;
+    walk(0, 0, tileSize, tileSize, tileSize, 0, threshold, emit);
+    walk(tileSize, tileSize, 0, 0, 0, tileSize, threshold, emit);
+  }
+
+  template <typename Emit>
+  void walk(
+      const int ax,
+      const int ay,
+      const int bx,
+      const int by,
+      const int cx,
+      const int cy,
+      const double threshold,
+      Emit& emit) const {
+    const int mx = (ax + bx) >> 1;
+    const int my = (ay + by) >> 1;
+    const bool isUnit = std::abs(ax - cx) + std::abs(ay - cy) == 1;
+    if (!isUnit && errors[my * size + mx] > threshold) {
+      walk(cx, cy, ax, ay, mx, my, threshold, emit);
+      walk(bx, by, cx, cy, mx, my, threshold, emit);
+      return;
+    }
+    if (isUnit && !isKept(ax, ay, bx, by, cx, cy)) {
+      return;
+    }
+    // Same winding as mesh_util::addTriangle
+    const int cross = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    const int a = ay * width + ax;
+    const int b = by * width + bx;
+    const int c = cy * width + cx;
+    if (cross < 0) {
+      emit(a, b, c);
+    } else {
+      emit(a, c, b);
+    }
+  }
+
+  int countFaces(const double threshold) const {
+    int count = 0;
+    walk(threshold, [&](const int, const int, const int) { ++count; });
+    return count;
+  }
+
+  // Output vertexes are the ones faces use, in grid order
+  void reindex() {
+    vertexesIndex.assign(width * height, -1);
+    for (const std::array<int, 3>& face : faces) {
+      for (const int v : face) {
+        vertexesIndex[v] = 0;
+      }
+    }
+    vertexesUsed.clear();
+    for (int v = 0; v < width * height; ++v) {
+      if (vertexesIndex[v] >= 0) {
+        vertexesIndex[v] = vertexesUsed.size();
+        vertexesUsed.push_back(v);
+      }
+    }
+  }
+
+  const Eigen::MatrixXd& vertexesIn;
+  const int width;
+  const int height;
+  const float tearRatio;
+  int size; // side of the tree's grid, 2^k + 1 >= width, height
+  std::vector<bool> isValid; // size x size, false outside width x height
+  std::vector<float> errors; // size x size
+  double maxError = 0; // largest finite error
+  std::vector<std::array<int, 3>> faces; // grid indexes
+  std::vector<int> vertexesIndex;
+  std::vector<int> vertexesUsed;
+};
+
+} // namespace render
+} // namespace fb360_dep
@@ -0,0 +1,241 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <folly/dynamic.h>
+
+#include "source/gpu/GlUtil.h"
+#include "source/mesh_stream/MeshCodec.h"
+
+namespace fb360_dep {
+
+// Expands mesh_codec::kGpu encoded .vtx and .idx on the gpu, from one gl buffer to another
+// The encoded bytes can go from the disk to a mapped buffer (e.g. GpuRingBuffer) and be expanded
+// by a compute shader into the float vertexes and uint32 indexes RigScene draws, so neither the
+// disk nor the bus moves the decoded size and the cpu does not decode
+// Extensions that are not encoded (e.g. color) are copied as is
+// Requires compute shaders and storage buffers (gl 4.3 or ARB_compute_shader and
+// ARB_shader_storage_buffer_object), see isSupported()
+class MeshCodecGpu {
+ public:
+  static bool isSupported() {
+#ifdef GL_COMPUTE_SHADER
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major > 4 || (major == 4 && minor >= 3)) {
+      return true;
+    }
+    bool hasCompute = false;
+    bool hasStorage = false;
+    GLint count;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+      const char* ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+      hasCompute |= strcmp(ext, "GL_ARB_compute_shader") == 0;
+      hasStorage |= strcmp(ext, "GL_ARB_shader_storage_buffer_object") == 0;
+    }
+    return hasCompute && hasStorage;
+#else
+    return false;
+#endif
+  }
+
+  // Whether decode() can expand the entries of a camera layout read at offset: every encoded
+  // entry is kGpu and every entry starts on a 32 bit word
+  static bool canDecode(const folly::dynamic& layout, const uint64_t offset) {
+    for (const auto& item : layout.items()) {
+      const folly::dynamic& entry = item.second;
+      if (!entry.isObject()) {
+        continue;
+      }
+      if (mesh_codec::isEncoded(entry) && entry["compression"].getString() != mesh_codec::kGpu) {
+        return false;
+      }
+      if ((entry["offset"].getInt() - offset) % sizeof(uint32_t) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  MeshCodecGpu() {
+#ifdef GL_COMPUTE_SHADER
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+
+    // mesh_codec::decodeVertexesUnorm16, one vertex per invocation
+    const std::string unorm16 = R"(
+      void main() {
+        uint i = first + gl_GlobalInvocationID.x;
+        if (i >= count) {
+          return;
+        }
+        const uint kHeaderWords = 7u; // count, lo[3], hi[3]
+        for (uint axis = 0u; axis < 3u; ++axis) {
+          float lo = uintBitsToFloat(src[srcWord + 1u + axis]);
+          float hi = uintBitsToFloat(src[srcWord + 4u + axis]);
+          float q = float(halfword(srcWord + kHeaderWords, 3u * i + axis));
+          dst[dstWord + 3u * i + axis] = floatBitsToUint(lo + q * ((hi - lo) / 65535.0));
+        }
+      }
+    )";
+
+    // mesh_codec::decodeIndexesBlock16, one index per invocation
+    static_assert(mesh_codec::kIndexBlockSize == 64, "update the block size in the shader");
+    const std::string block16 = R"(
+      void main() {
+        uint i = first + gl_GlobalInvocationID.x;
+        if (i >= count) {
+          return;
+        }
+        const uint kBlockSize = 64u;
+        uint blocks = (count + kBlockSize - 1u) / kBlockSize;
+        uint base = src[srcWord + 1u + i / kBlockSize];
+        dst[dstWord + i] = base + halfword(srcWord + 1u + blocks, i);
+      }
+    )";
+
+    vertexProgram = createComputeProgram(unorm16);
+    indexProgram = createComputeProgram(block16);
+#endif
+  }
+
+  ~MeshCodecGpu() {
+    glDeleteProgram(vertexProgram);
+    glDeleteProgram(indexProgram);
+  }
+
+  MeshCodecGpu(const MeshCodecGpu&) = delete;
+  MeshCodecGpu& operator=(const MeshCodecGpu&) = delete;
+
+  // Decodes the entry.size bytes at srcOffset in src to dstOffset in dst, which must hold
+  // mesh_codec::getDecodedSize(entry) bytes there. Encoded entries need word aligned offsets
+  // Call barrier() before drawing with dst
+  void decode(
+      const GLuint dst,
+      const uint64_t dstOffset,
+      const GLuint src,
+      const uint64_t srcOffset,
+      const folly::dynamic& entry) const {
+    const uint64_t size = entry["size"].getInt();
+    const uint64_t decodedSize = mesh_codec::getDecodedSize(entry);
+    if (!mesh_codec::isEncoded(entry)) {
+      glBindBuffer(GL_COPY_READ_BUFFER, src);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, dst);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, srcOffset, dstOffset, size);
+      glBindBuffer(GL_COPY_READ_BUFFER, 0);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+      return;
+    }
+#ifdef GL_COMPUTE_SHADER
+    CHECK_EQ(srcOffset % sizeof(uint32_t), 0);
+    CHECK_EQ(dstOffset % sizeof(uint32_t), 0);
+    const std::string encoding = entry["encoding"].getString();
+    uint64_t count; // invocations, one per vertex or index
+    GLuint program;
+    if (encoding == mesh_codec::kUnorm16) {
+      count = decodedSize / (3 * sizeof(float));
+      program = vertexProgram;
+    } else {
+      CHECK_EQ(encoding, mesh_codec::kBlock16) << "encoding is not expanded on the gpu";
+      count = decodedSize / sizeof(uint32_t);
+      program = indexProgram;
+    }
+    if (count == 0) {
+      return;
+    }
+    glUseProgram(program);
+    bindWords(program, 0, "srcWord", src, srcOffset, size);
+    bindWords(program, 1, "dstWord", dst, dstOffset, decodedSize);
+    const uint64_t kMaxGroups = 65535; // guaranteed by gl
+    for (uint64_t first = 0; first < count; first += kMaxGroups * kGroupSize) {
+      const uint64_t groups = std::min(kMaxGroups, (count - first + kGroupSize - 1) / kGroupSize);
+      glUniform1ui(getUniformLocation(program, "first"), GLuint(first));
+      glUniform1ui(getUniformLocation(program, "count"), GLuint(count));
+      glDispatchCompute(GLuint(groups), 1, 1);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+    glUseProgram(0);
+#else
+    LOG(FATAL) << "compute shaders not supported";
+#endif
+  }
+
+  // Makes the vertexes and indexes decode() wrote visible to draws issued after it
+  static void barrier() {
+#ifdef GL_COMPUTE_SHADER
+    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT);
+#endif
+  }
+
+ private:
+  static const uint64_t kGroupSize = 64;
+
+#ifdef GL_COMPUTE_SHADER
+  // main() with the buffers and uniforms decode() binds, and halfword(base, i), element i of
+  // the 16 bit array that starts at word base
+  static GLuint createComputeProgram(const std::string& main) {
+    const std::string source = R"(
+      #version 430
+      layout(local_size_x = )" + std::to_string(kGroupSize) + R"() in;
+      layout(std430, binding = 0) readonly buffer Src { uint src[]; };
+      layout(std430, binding = 1) writeonly buffer Dst { uint dst[]; };
+      uniform uint srcWord;
+      uniform uint dstWord;
+      uniform uint first;
+      uniform uint count;
+
+      uint halfword(uint base, uint i) {
+        uint word = src[base + i / 2u];
+        return (i & 1u) == 0u ? word & 0xffffu : word >> 16;
+      }
+    )" + main;
+    GLuint program = glCreateProgram();
+    attachShader(program, GL_COMPUTE_SHADER, source);
+    glLinkProgram(program);
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+      GLint length = 0;
+      glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+      std::vector<GLchar> log(length);
+      glGetProgramInfoLog(program, length, &length, &log[0]);
+      LOG(FATAL) << folly::sformat("{}\ncs:\n{}", log.data(), source);
+    }
+    return program;
+  }
+
+  // Binds the size bytes at offset in buffer to binding, storage buffers can only be bound at
+  // aligned offsets, so the binding starts before offset and uniform is set to the word it is at
+  void bindWords(
+      const GLuint program,
+      const GLuint binding,
+      const char* uniform,
+      const GLuint buffer,
+      const uint64_t offset,
+      const uint64_t size) const {
+    const uint64_t begin = offset / offsetAlignment * offsetAlignment;
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, buffer, begin, offset + size - begin);
+    glUniform1ui(getUniformLocation(program, uniform), GLuint((offset - begin) / sizeof(uint32_t)));
+  }
+#endif
+
+  GLint offsetAlignment = 1;
+  GLuint vertexProgram = 0;
+  GLuint indexProgram = 0;
+};
+
+} // namespace fb360_dep
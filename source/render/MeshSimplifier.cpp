@@ -14,12 +14,11 @@
 #include "source/render/MeshSimplifier.h"
 #pragma GCC diagnostic pop
 
-#include <map>
-#include <set>
-#include <thread>
-
+#include <cmath>
 #include <folly/Format.h>
 
+#include "source/util/ThreadPool.h"
+
 using namespace fb360_dep;
 using namespace fb360_dep::render;
 
@@ -28,19 +27,15 @@ void MeshSimplifier::loadVertexes(
     const int begin,
     const int end) {
   for (int i = begin; i < end; ++i) {
-    Vertex vertex;
-    vertex.coord = vertexesIn.row(i);
-    vertexes[i] = vertex;
+    mesh.coords[i] = vertexesIn.row(i);
   }
 }
 
 void MeshSimplifier::loadFaces(const Eigen::MatrixXi& facesIn, const int begin, const int end) {
   for (int i = begin; i < end; ++i) {
-    Face face;
     for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      face.vertexesIdx[j] = facesIn(i, j);
+      mesh.faces[i][j] = facesIn(i, j);
     }
-    faces[i] = face;
   }
 }
 
@@ -49,58 +44,72 @@ MeshSimplifier::MeshSimplifier(
     const Eigen::MatrixXi& facesIn,
     const bool equiError,
     const int nThreads) {
-  numThreads = nThreads;
+  numThreads = std::max(1, ThreadPool::getThreadCountFromFlag(nThreads));
   isEquiError = equiError;
 
   LOG(INFO) << folly::sformat("Getting {} vertexes...", vertexesIn.rows());
 
-  vertexes.resize(vertexesIn.rows());
-  std::vector<std::thread> threads;
+  mesh.coords.resize(vertexesIn.rows());
+  mesh.quadrics.resize(vertexesIn.rows());
+  mesh.vertexFlags.assign(vertexesIn.rows(), 0);
+  ThreadPool threadPool(numThreads);
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * vertexesIn.rows() / numThreads;
     const int end = (i + 1) * vertexesIn.rows() / numThreads;
-    threads.emplace_back(&MeshSimplifier::loadVertexes, this, vertexesIn, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::loadVertexes, this, std::cref(vertexesIn), begin, end);
   }
+  threadPool.join();
 
   LOG(INFO) << folly::sformat("Getting {} faces...", facesIn.rows());
 
-  faces.resize(facesIn.rows());
-  threads.clear();
+  mesh.faces.resize(facesIn.rows());
+  mesh.normals.resize(facesIn.rows());
+  mesh.costs.resize(facesIn.rows());
+  mesh.faceFlags.assign(facesIn.rows(), 0);
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * facesIn.rows() / numThreads;
     const int end = (i + 1) * facesIn.rows() / numThreads;
-    threads.emplace_back(&MeshSimplifier::loadFaces, this, facesIn, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::loadFaces, this, std::cref(facesIn), begin, end);
   }
+  threadPool.join();
 }
 
 Eigen::MatrixXd MeshSimplifier::getVertexes() {
-  Eigen::MatrixXd vertexesOut(vertexes.size(), NUM_VERTEXES_FACE);
-  for (int i = 0; i < int(vertexes.size()); ++i) {
-    vertexesOut.row(i) = vertexes[i].coord;
+  Eigen::MatrixXd vertexesOut(mesh.coords.size(), NUM_VERTEXES_FACE);
+  for (int i = 0; i < int(mesh.coords.size()); ++i) {
+    vertexesOut.row(i) = mesh.coords[i];
   }
   return vertexesOut;
 }
 
 Eigen::MatrixXi MeshSimplifier::getFaces() {
-  Eigen::MatrixXi facesOut(faces.size(), NUM_VERTEXES_FACE);
-  for (int i = 0; i < int(faces.size()); ++i) {
-    Face& face = faces[i];
-    facesOut.row(i) =
-        Eigen::Vector3i(face.vertexesIdx[0], face.vertexesIdx[1], face.vertexesIdx[2]);
+  Eigen::MatrixXi facesOut(mesh.faces.size(), NUM_VERTEXES_FACE);
+  for (int i = 0; i < int(mesh.faces.size()); ++i) {
+    const Face& face = mesh.faces[i];
+    facesOut.row(i) = Eigen::Vector3i(face[0], face[1], face[2]);
   }
   return facesOut;
 }
 
-double computeFastError(Eigen::Matrix4d q, Eigen::Vector3d& v) {
-  return q(0, 0) * v.x() * v.x() + 2 * q(0, 1) * v.x() * v.y() + 2 * q(0, 2) * v.x() * v.z() +
-      2 * q(0, 3) * v.x() + q(1, 1) * v.y() * v.y() + 2 * q(1, 2) * v.y() * v.z() +
-      2 * q(1, 3) * v.y() + q(2, 2) * v.z() * v.z() + 2 * q(2, 3) * v.z() + q(3, 3);
+// q is the upper triangle of Q, see Quadric
+double computeFastError(const double* q, const Eigen::Vector3d& v) {
+  return q[0] * v.x() * v.x() + 2 * q[1] * v.x() * v.y() + 2 * q[2] * v.x() * v.z() +
+      2 * q[3] * v.x() + q[4] * v.y() * v.y() + 2 * q[5] * v.y() * v.z() + 2 * q[6] * v.y() +
+      q[7] * v.z() * v.z() + 2 * q[8] * v.z() + q[9];
+}
+
+// Determinant of the 3x3 matrix with rows (a0 a1 a2), (b0 b1 b2), (c0 c1 c2)
+double det3(
+    const double a0,
+    const double a1,
+    const double a2,
+    const double b0,
+    const double b1,
+    const double b2,
+    const double c0,
+    const double c1,
+    const double c2) {
+  return a0 * (b1 * c2 - b2 * c1) - a1 * (b0 * c2 - b2 * c0) + a2 * (b0 * c1 - b1 * c0);
 }
 
 // error = vT * Q * v, where Q = (Q1 + Q2)
@@ -127,36 +136,39 @@ double computeFastError(Eigen::Matrix4d q, Eigen::Vector3d& v) {
 //    vT * Q * v = q11x^2 + 2q12xy + 2q13xz + 2q14x + q22y^2 + 2q23yz + 2q24y +
 //                 q33z^2 + 2q34z + q44
 double MeshSimplifier::computeError(
-    const Vertex& vertex0,
-    const Vertex& vertex1,
-    Eigen::Vector3d& vTarget) {
-  Eigen::Matrix4d q = vertex0.q + vertex1.q;
-  const double det = q.block<3, 3>(0, 0).determinant();
+    const Mesh& m,
+    const int vIdx0,
+    const int vIdx1,
+    Eigen::Vector3d& vTarget) const {
+  Quadric sum = m.quadrics[vIdx0];
+  sum += m.quadrics[vIdx1];
+  const double* q = sum.q; // q11 q12 q13 q14 q22 q23 q24 q33 q34 q44
+  const double det = det3(q[0], q[1], q[2], q[1], q[4], q[5], q[2], q[5], q[7]);
 
   // Do not do quadric approach on boundary edges
-  const bool isBoundary = vertex0.isBoundary && vertex1.isBoundary;
+  const bool isBoundary = (m.vertexFlags[vIdx0] & m.vertexFlags[vIdx1]) & kBoundary;
 
   double error;
   if (det != 0 && !isBoundary) {
-    Eigen::Matrix3d mX;
-    mX << q(0, 1), q(0, 2), q(0, 3), q(1, 1), q(1, 2), q(1, 3), q(2, 1), q(2, 2), q(2, 3);
-    Eigen::Matrix3d mY;
-    mY << q(0, 0), q(0, 2), q(0, 3), q(1, 0), q(1, 2), q(1, 3), q(2, 0), q(2, 2), q(2, 3);
-    Eigen::Matrix3d mZ;
-    mZ << q(0, 0), q(0, 1), q(0, 3), q(1, 0), q(1, 1), q(1, 3), q(2, 0), q(2, 1), q(2, 3);
-    vTarget = 1 / det * Eigen::Vector3d(-mX.determinant(), mY.determinant(), -mZ.determinant());
+    const double mX = det3(q[1], q[2], q[3], q[4], q[5], q[6], q[5], q[7], q[8]);
+    const double mY = det3(q[0], q[2], q[3], q[1], q[5], q[6], q[2], q[7], q[8]);
+    const double mZ = det3(q[0], q[1], q[3], q[1], q[4], q[6], q[2], q[5], q[8]);
+    vTarget = 1 / det * Eigen::Vector3d(-mX, mY, -mZ);
 
     error = computeFastError(q, vTarget);
   } else {
-    std::vector<Eigen::Vector3d> vCandidates = {
-        vertex0.coord, vertex1.coord, (vertex0.coord + vertex1.coord) / 2};
-    std::vector<double> errors;
-    for (auto& v : vCandidates) {
-      errors.push_back(computeFastError(q, v));
+    const Eigen::Vector3d& coord0 = m.coords[vIdx0];
+    const Eigen::Vector3d& coord1 = m.coords[vIdx1];
+    const Eigen::Vector3d vCandidates[] = {coord0, coord1, (coord0 + coord1) / 2};
+    error = computeFastError(q, vCandidates[0]);
+    vTarget = vCandidates[0];
+    for (int i = 1; i < 3; ++i) {
+      const double candidateError = computeFastError(q, vCandidates[i]);
+      if (candidateError < error) {
+        error = candidateError;
+        vTarget = vCandidates[i];
+      }
     }
-    auto minIter = std::min_element(errors.begin(), errors.end());
-    vTarget = vCandidates[minIter - errors.begin()];
-    error = *minIter;
   }
 
   // If mesh is not distributed to have equierror, we need to penalize costs for
@@ -176,163 +188,146 @@ double MeshSimplifier::computeError(
 //     | ac bc cc cd |
 //     | ad bd cd dd |
 // Note how Q is symmetric
-void MeshSimplifier::computeSubQuadrics(const int begin, const int end) {
-  for (int i = begin; i < end; ++i) {
-    Face& face = faces[i];
-    face.isDeleted = false;
-    Eigen::Vector3d p[NUM_VERTEXES_FACE];
-    for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      p[j] = vertexes[face.vertexesIdx[j]].coord;
-    }
-    Eigen::Vector3d normal = (p[1] - p[0]).cross(p[2] - p[0]).normalized();
-    face.normal = normal;
-    Eigen::Vector4d q(normal.x(), normal.y(), normal.z(), -normal.dot(p[0]));
-    face.q = q * q.transpose();
-  }
-}
-
-void MeshSimplifier::computeSubError(const int begin, const int end) {
-  for (int i = begin; i < end; ++i) {
-    Face& face = faces[i];
-    for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      const int i0 = face.vertexesIdx[j];
-      const int i1 = face.vertexesIdx[(j + 1) % NUM_VERTEXES_FACE];
-      Eigen::Vector3d p;
-      face.cost[j] = computeError(vertexes[i0], vertexes[i1], p);
-    }
-  }
-}
-
+// Face quadrics are not stored, each vertex adds up the quadrics of its faces
 void MeshSimplifier::computeInitialQuadrics() {
-  std::vector<std::thread> threads;
-
   LOG(INFO) << "Computing quadrics...";
-  for (int i = 0; i < numThreads; ++i) {
-    const int begin = i * faces.size() / numThreads;
-    const int end = (i + 1) * faces.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::computeSubQuadrics, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
-  }
+  parallelFor(
+      0,
+      mesh.faces.size(),
+      4096,
+      [&](const int i) {
+        const Face& face = mesh.faces[i];
+        const Eigen::Vector3d& p0 = mesh.coords[face[0]];
+        const Eigen::Vector3d& p1 = mesh.coords[face[1]];
+        const Eigen::Vector3d& p2 = mesh.coords[face[2]];
+        mesh.normals[i] = (p1 - p0).cross(p2 - p0).normalized();
+      },
+      numThreads);
 
   LOG(INFO) << "Accumulating quadrics...";
-  for (auto& face : faces) {
-    for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      vertexes[face.vertexesIdx[j]].q += face.q;
-    }
-  }
+  parallelFor(
+      0,
+      mesh.coords.size(),
+      4096,
+      [&](const int i) {
+        Quadric& quadric = mesh.quadrics[i];
+        for (int f = mesh.facesBegin[i]; f < mesh.facesBegin[i + 1]; ++f) {
+          const int faceIdx = mesh.vertexFaces[f];
+          const Eigen::Vector3d& normal = mesh.normals[faceIdx];
+          const Eigen::Vector4d q(
+              normal.x(), normal.y(), normal.z(), -normal.dot(mesh.coords[mesh.faces[faceIdx][0]]));
+          int k = 0;
+          for (int r = 0; r < 4; ++r) {
+            for (int c = r; c < 4; ++c) {
+              quadric.q[k++] += q[r] * q[c];
+            }
+          }
+        }
+      },
+      numThreads);
 
   LOG(INFO) << "Updating faces costs...";
-  threads.clear();
-  for (int i = 0; i < numThreads; ++i) {
-    const int begin = i * faces.size() / numThreads;
-    const int end = (i + 1) * faces.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::computeSubError, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
-  }
+  parallelFor(
+      0,
+      mesh.faces.size(),
+      4096,
+      [&](const int i) {
+        const Face& face = mesh.faces[i];
+        for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
+          Eigen::Vector3d p;
+          mesh.costs[i][j] = computeError(mesh, face[j], face[(j + 1) % NUM_VERTEXES_FACE], p);
+        }
+      },
+      numThreads);
 }
 
 // Remove from the list all faces that have been marked as deleted
-void MeshSimplifier::removeDeletedFaces() {
+void MeshSimplifier::removeDeletedFaces(Mesh& m) {
   int idx = 0;
-  for (auto& face : faces) {
-    face.isTouched = false;
-    if (!face.isDeleted) {
-      faces[idx++] = face;
+  for (int i = 0; i < int(m.faces.size()); ++i) {
+    if (!(m.faceFlags[i] & kDeleted)) {
+      m.faces[idx] = m.faces[i];
+      m.normals[idx] = m.normals[i];
+      m.costs[idx] = m.costs[i];
+      m.faceFlags[idx] = 0;
+      ++idx;
     }
   }
-  faces.resize(idx);
+  m.faces.resize(idx);
+  m.normals.resize(idx);
+  m.costs.resize(idx);
+  m.faceFlags.resize(idx);
 }
 
-void MeshSimplifier::assignFaceVertexes() {
-  for (auto& vertex : vertexes) {
-    vertex.facesIdx.clear();
+void MeshSimplifier::assignFaceVertexes(Mesh& m) {
+  m.facesBegin.assign(m.coords.size() + 1, 0);
+  for (const Face& face : m.faces) {
+    for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
+      ++m.facesBegin[face[j] + 1];
+    }
+  }
+  for (int i = 0; i < int(m.coords.size()); ++i) {
+    m.facesBegin[i + 1] += m.facesBegin[i];
   }
 
-  for (int i = 0; i < int(faces.size()); ++i) {
-    const Face& face = faces[i];
+  m.vertexFaces.resize(m.facesBegin.back());
+  std::vector<int> next(m.facesBegin.begin(), m.facesBegin.end() - 1);
+  for (int i = 0; i < int(m.faces.size()); ++i) {
     for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      vertexes[face.vertexesIdx[j]].facesIdx.push_back(i);
+      m.vertexFaces[next[m.faces[i][j]]++] = i;
     }
   }
 }
 
-std::vector<int> MeshSimplifier::commonFaces(const int vIdx0, const int vIdx1) {
+std::vector<int> MeshSimplifier::commonFaces(const Mesh& m, const int vIdx0, const int vIdx1) {
   std::vector<int> commonFaces;
-  for (int i1 : vertexes[vIdx0].facesIdx) {
-    for (int i2 : vertexes[vIdx1].facesIdx) {
-      if (i1 == i2) {
-        commonFaces.push_back(i1);
+  for (int f0 = m.facesBegin[vIdx0]; f0 < m.facesBegin[vIdx0 + 1]; ++f0) {
+    for (int f1 = m.facesBegin[vIdx1]; f1 < m.facesBegin[vIdx1 + 1]; ++f1) {
+      if (m.vertexFaces[f0] == m.vertexFaces[f1]) {
+        commonFaces.push_back(m.vertexFaces[f0]);
       }
     }
   }
   return commonFaces;
 }
 
-// A vertex is is considered a to be on the boundary if it only shares one face
-// with any adjacent vertex
-void MeshSimplifier::identifySubBoundaries(const int begin, const int end) {
-  for (int i = begin; i < end; ++i) {
-    vertexes[i].isBoundary = false;
-  }
-
-  for (int i = begin; i < end; ++i) {
-    // Ignore if it has already been marked as boundary
-    if (vertexes[i].isBoundary) {
-      continue;
-    }
-
-    // If it only has one face, it is a boundary
-    if (vertexes[i].facesIdx.size() == 1) {
-      vertexes[i].isBoundary = true;
-      continue;
-    }
-
-    bool isBorder = false;
-    std::set<int> vertexesVisited;
-    for (auto& faceIdx : vertexes[i].facesIdx) {
-      for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-        const int vIdx = faces[faceIdx].vertexesIdx[j];
-        if (vIdx != i) {
-          // Check if we already visited this vertex on a previous face
-          if (vertexesVisited.count(vIdx) == 0) {
-            vertexesVisited.insert(vIdx);
-            if (vertexes[vIdx].facesIdx.size() == 1 || commonFaces(i, vIdx).size() == 1) {
-              vertexes[vIdx].isBoundary = true;
-              isBorder = true;
+// A vertex is considered to be on the boundary if it only has one face, or if it only shares
+// one face with any adjacent vertex, or if any adjacent vertex only has one face
+void MeshSimplifier::identifyBoundaries() {
+  const Mesh& m = mesh;
+  parallelFor(
+      0,
+      m.coords.size(),
+      4096,
+      [&](const int i) {
+        bool isBoundary = m.facesBegin[i + 1] - m.facesBegin[i] == 1;
+        std::vector<int> vertexesVisited;
+        for (int f = m.facesBegin[i]; f < m.facesBegin[i + 1] && !isBoundary; ++f) {
+          for (const int vIdx : m.faces[m.vertexFaces[f]]) {
+            // Check if we already visited this vertex on a previous face
+            if (vIdx == i ||
+                std::find(vertexesVisited.begin(), vertexesVisited.end(), vIdx) !=
+                    vertexesVisited.end()) {
               continue;
             }
+            vertexesVisited.push_back(vIdx);
+            if (m.facesBegin[vIdx + 1] - m.facesBegin[vIdx] == 1 ||
+                commonFaces(m, i, vIdx).size() == 1) {
+              isBoundary = true;
+              break;
+            }
           }
         }
-      }
-    }
-    if (isBorder) {
-      vertexes[i].isBoundary = true;
-    }
-  }
+        mesh.vertexFlags[i] = isBoundary ? kBoundary : 0;
+      },
+      numThreads);
 }
 
-void MeshSimplifier::identifyBoundaries() {
-  std::vector<std::thread> threads;
-  for (int i = 0; i < numThreads; ++i) {
-    const int begin = i * vertexes.size() / numThreads;
-    const int end = (i + 1) * vertexes.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::identifySubBoundaries, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
-  }
-}
-
-double MeshSimplifier::getThreshold(const float strictness) {
-  std::vector<double> errors(faces.size() * NUM_VERTEXES_FACE);
-  for (int i = 0; i < int(faces.size()); ++i) {
-    Face& face = faces[i];
+double MeshSimplifier::getThreshold(const Mesh& m, const float strictness) {
+  std::vector<double> errors(m.faces.size() * NUM_VERTEXES_FACE);
+  for (int i = 0; i < int(m.faces.size()); ++i) {
     for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      errors[i * NUM_VERTEXES_FACE + j] = face.cost[j];
+      errors[i * NUM_VERTEXES_FACE + j] = m.costs[i][j];
     }
   }
   const int idxPerc = strictness * (errors.size() - 1);
@@ -342,25 +337,30 @@ double MeshSimplifier::getThreshold(const float strictness) {
 
 // Compare the normal of each neighboring face before and after the contraction.
 // If the normal flips, that contraction will be disallowed
-bool MeshSimplifier::haveNormalsFlipped(Eigen::Vector3d p, int vIdx0, int vIdx1) {
-  for (int i = 0; i < int(vertexes[vIdx0].facesIdx.size()); ++i) {
-    Face& face = faces[vertexes[vIdx0].facesIdx[i]];
+bool MeshSimplifier::haveNormalsFlipped(
+    const Mesh& m,
+    const Eigen::Vector3d& p,
+    int vIdx0,
+    int vIdx1) {
+  for (int f = m.facesBegin[vIdx0]; f < m.facesBegin[vIdx0 + 1]; ++f) {
+    const int faceIdx = m.vertexFaces[f];
 
     // Ignore faces marked as deleted
-    if (face.isDeleted) {
+    if (m.faceFlags[faceIdx] & kDeleted) {
       continue;
     }
 
     // Find vertex index in the face, clockwise
+    const Face& face = m.faces[faceIdx];
     int order = 0;
     for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
-      if (face.vertexesIdx[j] == vIdx0) {
+      if (face[j] == vIdx0) {
         order = j;
         break;
       }
     }
-    int i0 = face.vertexesIdx[(order + 1) % 3];
-    int i1 = face.vertexesIdx[(order + 2) % 3];
+    int i0 = face[(order + 1) % 3];
+    int i1 = face[(order + 2) % 3];
 
     // Ignore edge formed by vertex0 and vertex1 (= deleted face)
     if (i0 == vIdx1 || i1 == vIdx1) {
@@ -368,117 +368,106 @@ bool MeshSimplifier::haveNormalsFlipped(Eigen::Vector3d p, int vIdx0, int vIdx1)
     }
 
     // Opposite directions begin at negative dot product
-    Eigen::Vector3d v0 = (vertexes[i0].coord - p).normalized();
-    Eigen::Vector3d v1 = (vertexes[i1].coord - p).normalized();
+    Eigen::Vector3d v0 = (m.coords[i0] - p).normalized();
+    Eigen::Vector3d v1 = (m.coords[i1] - p).normalized();
     Eigen::Vector3d normal = v0.cross(v1).normalized();
-    if (normal.dot(face.normal) < 0) {
+    if (normal.dot(m.normals[faceIdx]) < 0) {
       return true;
     }
   }
   return false;
 }
 
-void MeshSimplifier::updateCosts(const int vIdx0, const int vIdx1, const Eigen::Vector3d& pTarget) {
+void MeshSimplifier::updateCosts(
+    Mesh& m,
+    const int vIdx0,
+    const int vIdx1,
+    const Eigen::Vector3d& pTarget) const {
   // Both vertexes collapse into new one, defined by pTarget and Q0 + Q1
   // Vertex 0 will act as new vertex
-  vertexes[vIdx0].coord = pTarget;
-  vertexes[vIdx0].q += vertexes[vIdx1].q;
+  m.coords[vIdx0] = pTarget;
+  m.quadrics[vIdx0] += m.quadrics[vIdx1];
 
-  // Gather all faces touched by both vertexes
+  // Go through all faces touched by both vertexes
   // No need to check for duplicates, since they are faces marked for deletion
-  std::vector<int> allFaces(vertexes[vIdx0].facesIdx);
-  std::vector<int> facesVertex1 = vertexes[vIdx1].facesIdx;
-  allFaces.insert(allFaces.end(), facesVertex1.begin(), facesVertex1.end());
-
-  for (int faceIdx : allFaces) {
-    Face& face = faces[faceIdx];
-
-    if (face.isDeleted) {
-      continue;
-    }
-
-    // Find vertex index in the face
-    for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
-      if (face.vertexesIdx[i] == vIdx0 || face.vertexesIdx[i] == vIdx1) {
-        face.vertexesIdx[i] = vIdx0;
-        face.isTouched = true;
-        break;
+  for (const int vIdx : {vIdx0, vIdx1}) {
+    for (int f = m.facesBegin[vIdx]; f < m.facesBegin[vIdx + 1]; ++f) {
+      const int faceIdx = m.vertexFaces[f];
+      if (m.faceFlags[faceIdx] & kDeleted) {
+        continue;
       }
-    }
 
-    for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
-      const int i0 = face.vertexesIdx[i];
-      const int i1 = face.vertexesIdx[(i + 1) % NUM_VERTEXES_FACE];
+      // Find vertex index in the face
+      Face& face = m.faces[faceIdx];
+      for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
+        if (face[i] == vIdx0 || face[i] == vIdx1) {
+          face[i] = vIdx0;
+          m.faceFlags[faceIdx] |= kTouched;
+          break;
+        }
+      }
 
-      Eigen::Vector3d p;
-      face.cost[i] = computeError(vertexes[i0], vertexes[i1], p);
+      for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
+        Eigen::Vector3d p;
+        m.costs[faceIdx][i] = computeError(m, face[i], face[(i + 1) % NUM_VERTEXES_FACE], p);
+      }
     }
   }
 }
 
 // Reassign all indeces of all vertexes and faces to construct final mesh
 void MeshSimplifier::createFinalMesh() {
-  for (auto& vertex : vertexes) {
-    vertex.isDeleted = true;
-    vertex.facesIdx.clear();
-  }
-
   // Remove faces marked for deletion, and mark all valid vertexes
-  removeDeletedFaces();
-  for (auto& face : faces) {
+  removeDeletedFaces(mesh);
+  std::vector<int> mapVertexes(mesh.coords.size(), -1);
+  for (const Face& face : mesh.faces) {
     for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
-      vertexes[face.vertexesIdx[i]].isDeleted = false;
+      mapVertexes[face[i]] = 0;
     }
   }
 
   // Reassign vertexes coordinates
-  std::map<int, int> mapVertexes;
   int currIdx = 0;
-  for (int i = 0; i < int(vertexes.size()); ++i) {
-    if (!vertexes[i].isDeleted) {
-      mapVertexes.insert(std::make_pair(i, currIdx));
-      vertexes[currIdx++].coord = vertexes[i].coord;
+  for (int i = 0; i < int(mesh.coords.size()); ++i) {
+    if (mapVertexes[i] >= 0) {
+      mapVertexes[i] = currIdx;
+      mesh.coords[currIdx++] = mesh.coords[i];
     }
   }
-  vertexes.resize(currIdx);
+  mesh.coords.resize(currIdx);
+  mesh.quadrics.clear();
+  mesh.vertexFlags.clear();
+  mesh.facesBegin.clear();
+  mesh.vertexFaces.clear();
 
   // Reassign faces' vertexes
-  for (auto& face : faces) {
+  for (Face& face : mesh.faces) {
     for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
-      face.vertexesIdx[i] = mapVertexes.at(face.vertexesIdx[i]);
+      face[i] = mapVertexes[face[i]];
     }
   }
 }
 
-void MeshSimplifier::simplify(
+// Iteratively collapses the cheapest edges of m until it has numFacesOut faces, or no edge
+// qualifies. Edges with a locked vertex are left alone
+void MeshSimplifier::collapse(
+    Mesh& m,
     const int numFacesOut,
     const float strictness,
-    const bool removeBoundaryEdges) {
-  // Compute Q matrices and errors for all vertexes
-  LOG(INFO) << "Computing initial costs...";
-  computeInitialQuadrics();
-
-  const int numFacesIn = faces.size();
+    const bool removeBoundaryEdges,
+    const bool verbose) const {
+  const int numFacesIn = m.faces.size();
   int numFacesDeleted = 0;
   int numFacesDeletedPrev = 0;
   double threshold = 0;
   int countNumFacesSame = 0;
   int iteration = 0;
-  while (int(faces.size()) > numFacesOut) {
-    removeDeletedFaces();
-
-    if (iteration == 0) {
-      LOG(INFO) << "Assigning faces and vertexes...";
-    }
-    assignFaceVertexes();
-
-    if (iteration == 0) {
-      LOG(INFO) << "Identifying boundaries...";
-      identifyBoundaries();
-    }
+  while (int(m.faces.size()) > numFacesOut) {
+    removeDeletedFaces(m);
+    assignFaceVertexes(m);
 
     if (iteration == 0 || numFacesDeletedPrev != numFacesDeleted) {
-      threshold = getThreshold(strictness);
+      threshold = getThreshold(m, strictness);
       countNumFacesSame = 0;
     } else {
       // Scale threshold up to avoid getting stuck
@@ -491,55 +480,62 @@ void MeshSimplifier::simplify(
     }
     numFacesDeletedPrev = numFacesDeleted;
 
-    if (iteration % 1 == 0) {
+    if (verbose) {
       LOG(INFO) << folly::sformat(
-          "Iter: {}, faces: {}, threshold: {}", iteration, faces.size(), threshold);
+          "Iter: {}, faces: {}, threshold: {}", iteration, m.faces.size(), threshold);
     }
 
-    for (auto& face : faces) {
-      if (face.isDeleted || face.isTouched) {
+    for (int faceIdx = 0; faceIdx < int(m.faces.size()); ++faceIdx) {
+      if (m.faceFlags[faceIdx] & (kDeleted | kTouched)) {
         continue;
       }
 
       // Select all valid vertex pairs
       for (int i = 0; i < NUM_VERTEXES_FACE; ++i) {
         // Ignore if error (cost) is higher than threshold
-        if (face.cost[i] > threshold) {
+        if (m.costs[faceIdx][i] > threshold) {
           continue;
         }
 
-        int vIdx0 = face.vertexesIdx[i];
-        int vIdx1 = face.vertexesIdx[(i + 1) % NUM_VERTEXES_FACE];
+        const int vIdx0 = m.faces[faceIdx][i];
+        const int vIdx1 = m.faces[faceIdx][(i + 1) % NUM_VERTEXES_FACE];
+        const uint8_t flags0 = m.vertexFlags[vIdx0];
+        const uint8_t flags1 = m.vertexFlags[vIdx1];
+
+        // Ignore edges that reach into another tile
+        if ((flags0 | flags1) & kLocked) {
+          continue;
+        }
 
         // Ignore non-boundary edges with one boundary vertex
-        if (vertexes[vIdx0].isBoundary != vertexes[vIdx1].isBoundary) {
+        if ((flags0 ^ flags1) & kBoundary) {
           continue;
         }
 
         // Optionally ignore boundary edges entirely
-        if (!removeBoundaryEdges && (vertexes[vIdx0].isBoundary || vertexes[vIdx1].isBoundary)) {
+        if (!removeBoundaryEdges && ((flags0 | flags1) & kBoundary)) {
           continue;
         }
 
         // Compute optimal target point
         Eigen::Vector3d pTarget;
-        computeError(vertexes[vIdx0], vertexes[vIdx1], pTarget);
+        computeError(m, vIdx0, vIdx1, pTarget);
 
         // Prevent mesh inversion
-        if (haveNormalsFlipped(pTarget, vIdx0, vIdx1) ||
-            haveNormalsFlipped(pTarget, vIdx1, vIdx0)) {
+        if (haveNormalsFlipped(m, pTarget, vIdx0, vIdx1) ||
+            haveNormalsFlipped(m, pTarget, vIdx1, vIdx0)) {
           continue;
         }
 
         // Mark faces for deletion. These are the faces common to both vertexes
-        const std::vector<int> commonFacesIdxs = commonFaces(vIdx0, vIdx1);
-        for (int faceIdx : commonFacesIdxs) {
-          faces[faceIdx].isDeleted = true;
+        const std::vector<int> commonFacesIdxs = commonFaces(m, vIdx0, vIdx1);
+        for (int commonFaceIdx : commonFacesIdxs) {
+          m.faceFlags[commonFaceIdx] |= kDeleted;
         }
         numFacesDeleted += commonFacesIdxs.size();
 
         // Update costs of all valid pairs involving new vertex
-        updateCosts(vIdx0, vIdx1, pTarget);
+        updateCosts(m, vIdx0, vIdx1, pTarget);
 
         // Nothing else to do on the remaining vertexes of current face
         break;
@@ -552,6 +548,181 @@ void MeshSimplifier::simplify(
     }
     ++iteration;
   }
+  removeDeletedFaces(m);
+}
+
+// Tiles are cells of a grid over the two axes along which the mesh is largest, a face belongs to
+// the tile of its centroid. Each tile is copied out, simplified and copied back, so the only data
+// tiles share are the locked vertexes, which stay put
+// A tile with T faces, S of which touch locked vertexes, is simplified to r * T + (1 - r) * S
+// faces, where r is the fraction of faces kept overall. The seam pass then takes the S seam faces
+// down to about r * S, so the mesh ends up with the same density everywhere
+void MeshSimplifier::simplifyTiles(
+    const int numFacesOut,
+    const float strictness,
+    const bool removeBoundaryEdges) {
+  static const int kTilesPerThread = 4;
+  static const int kMinFacesPerTile = 20000;
+  const int numFacesIn = mesh.faces.size();
+  const int numTiles = std::min(numThreads * kTilesPerThread, numFacesIn / kMinFacesPerTile);
+  if (numThreads < 2 || numTiles < 2) {
+    return;
+  }
+
+  Eigen::Vector3d lo = mesh.coords[mesh.faces[0][0]];
+  Eigen::Vector3d hi = lo;
+  for (const Eigen::Vector3d& coord : mesh.coords) {
+    lo = lo.cwiseMin(coord);
+    hi = hi.cwiseMax(coord);
+  }
+  const Eigen::Vector3d extent = hi - lo;
+  int axes[3] = {0, 1, 2};
+  std::sort(axes, axes + 3, [&](const int a, const int b) { return extent[a] > extent[b]; });
+  const int numCols = std::ceil(std::sqrt(numTiles));
+  const int numRows = (numTiles + numCols - 1) / numCols;
+
+  std::vector<int> faceTiles(numFacesIn);
+  parallelFor(
+      0,
+      numFacesIn,
+      4096,
+      [&](const int i) {
+        const Face& face = mesh.faces[i];
+        const Eigen::Vector3d centroid =
+            (mesh.coords[face[0]] + mesh.coords[face[1]] + mesh.coords[face[2]]) / 3;
+        int cell[2];
+        const int numCells[2] = {numCols, numRows};
+        for (int a = 0; a < 2; ++a) {
+          const double size = extent[axes[a]];
+          const double t = size > 0 ? (centroid[axes[a]] - lo[axes[a]]) / size : 0;
+          cell[a] = std::min(std::max(int(t * numCells[a]), 0), numCells[a] - 1);
+        }
+        faceTiles[i] = cell[1] * numCols + cell[0];
+      },
+      numThreads);
+
+  // Lock the vertexes whose faces are in more than one tile
+  parallelFor(
+      0,
+      mesh.coords.size(),
+      4096,
+      [&](const int i) {
+        for (int f = mesh.facesBegin[i]; f < mesh.facesBegin[i + 1]; ++f) {
+          if (faceTiles[mesh.vertexFaces[f]] != faceTiles[mesh.vertexFaces[mesh.facesBegin[i]]]) {
+            mesh.vertexFlags[i] |= kLocked;
+            break;
+          }
+        }
+      },
+      numThreads);
+
+  std::vector<std::vector<int>> tileFaces(numRows * numCols);
+  for (int i = 0; i < numFacesIn; ++i) {
+    tileFaces[faceTiles[i]].push_back(i);
+  }
+
+  LOG(INFO) << folly::sformat("Simplifying {} tiles...", tileFaces.size());
+  const double ratio = std::min(1.0, double(numFacesOut) / numFacesIn);
+  std::vector<Mesh> tiles(tileFaces.size());
+  std::vector<std::vector<int>> tileVertexes(tileFaces.size()); // tile index to mesh index
+  parallelFor(
+      0,
+      tileFaces.size(),
+      1,
+      [&](const int t) {
+        Mesh& tile = tiles[t];
+        std::vector<int>& globalIdxs = tileVertexes[t];
+        for (const int faceIdx : tileFaces[t]) {
+          const Face& face = mesh.faces[faceIdx];
+          globalIdxs.insert(globalIdxs.end(), face.begin(), face.end());
+        }
+        std::sort(globalIdxs.begin(), globalIdxs.end());
+        globalIdxs.erase(std::unique(globalIdxs.begin(), globalIdxs.end()), globalIdxs.end());
+        for (const int vIdx : globalIdxs) {
+          tile.coords.push_back(mesh.coords[vIdx]);
+          tile.quadrics.push_back(mesh.quadrics[vIdx]);
+          tile.vertexFlags.push_back(mesh.vertexFlags[vIdx]);
+        }
+
+        int numSeamFaces = 0;
+        for (const int faceIdx : tileFaces[t]) {
+          Face face;
+          bool isSeam = false;
+          for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
+            const int vIdx = mesh.faces[faceIdx][j];
+            face[j] = std::lower_bound(globalIdxs.begin(), globalIdxs.end(), vIdx) -
+                globalIdxs.begin();
+            isSeam |= mesh.vertexFlags[vIdx] & kLocked;
+          }
+          numSeamFaces += isSeam;
+          tile.faces.push_back(face);
+          tile.normals.push_back(mesh.normals[faceIdx]);
+          tile.costs.push_back(mesh.costs[faceIdx]);
+          tile.faceFlags.push_back(0);
+        }
+
+        const int numTileFaces = tileFaces[t].size();
+        const int numTileFacesOut = std::lround(ratio * numTileFaces + (1 - ratio) * numSeamFaces);
+        static const bool kVerbose = false;
+        collapse(tile, numTileFacesOut, strictness, removeBoundaryEdges, kVerbose);
+
+        // Unlocked vertexes belong to this tile only
+        for (int i = 0; i < int(globalIdxs.size()); ++i) {
+          if (!(tile.vertexFlags[i] & kLocked)) {
+            mesh.coords[globalIdxs[i]] = tile.coords[i];
+            mesh.quadrics[globalIdxs[i]] = tile.quadrics[i];
+          }
+        }
+        for (Face& face : tile.faces) {
+          for (int j = 0; j < NUM_VERTEXES_FACE; ++j) {
+            face[j] = globalIdxs[face[j]];
+          }
+        }
+        tile.coords.clear();
+        tile.quadrics.clear();
+        tile.vertexFlags.clear();
+        tile.facesBegin.clear();
+        tile.vertexFaces.clear();
+        globalIdxs.clear();
+      },
+      numThreads);
+
+  // Put the simplified tiles back together
+  mesh.faces.clear();
+  mesh.normals.clear();
+  mesh.costs.clear();
+  for (const Mesh& tile : tiles) {
+    mesh.faces.insert(mesh.faces.end(), tile.faces.begin(), tile.faces.end());
+    mesh.normals.insert(mesh.normals.end(), tile.normals.begin(), tile.normals.end());
+    mesh.costs.insert(mesh.costs.end(), tile.costs.begin(), tile.costs.end());
+  }
+  mesh.faceFlags.assign(mesh.faces.size(), 0);
+  for (uint8_t& flags : mesh.vertexFlags) {
+    flags &= ~kLocked;
+  }
+  LOG(INFO) << folly::sformat("Tiles simplified to {} faces", mesh.faces.size());
+}
+
+void MeshSimplifier::simplify(
+    const int numFacesOut,
+    const float strictness,
+    const bool removeBoundaryEdges) {
+  LOG(INFO) << "Assigning faces and vertexes...";
+  assignFaceVertexes(mesh);
+
+  // Compute Q matrices and errors for all vertexes
+  LOG(INFO) << "Computing initial costs...";
+  computeInitialQuadrics();
+
+  LOG(INFO) << "Identifying boundaries...";
+  identifyBoundaries();
+
+  if (int(mesh.faces.size()) > numFacesOut) {
+    simplifyTiles(numFacesOut, strictness, removeBoundaryEdges);
+  }
+
+  static const bool kVerbose = true;
+  collapse(mesh, numFacesOut, strictness, removeBoundaryEdges, kVerbose);
 
   // Assign final values to vertexes and faces
   LOG(INFO) << "Creating final mesh...";
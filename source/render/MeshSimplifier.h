@@ -7,6 +7,11 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
 #include <Eigen/Geometry>
 
 #include "source/util/CvUtil.h"
@@ -20,6 +25,9 @@ namespace render {
 
 // Based on paper "Surface Simplification Using Quadric Error Metrics", by
 // M. Garland and P. Heckbert
+// With more than one thread the mesh is cut into spatial tiles that are simplified in parallel.
+// Vertexes shared by several tiles are locked, so tiles never touch each other's data, and a final
+// pass over the whole mesh simplifies the seams between tiles
 class MeshSimplifier final {
  public:
   MeshSimplifier(
@@ -33,57 +41,66 @@ class MeshSimplifier final {
   Eigen::MatrixXi getFaces();
 
  private:
-  struct Vertex {
-    std::vector<int> facesIdx;
-    Eigen::Vector3d coord;
-    Eigen::Matrix4d q;
-    bool isBoundary;
-    bool isDeleted;
-    Vertex() {
-      coord = Eigen::Vector3d::Zero();
-      q = Eigen::Matrix4d::Zero();
-      isBoundary = false;
-      isDeleted = false;
+  // Symmetric 4x4 matrix, upper triangle stored row by row
+  struct Quadric {
+    double q[10];
+    Quadric() {
+      std::fill(q, q + 10, 0.0);
     }
-  };
-  struct Face {
-    int vertexesIdx[NUM_VERTEXES_FACE];
-    Eigen::Matrix4d q;
-    Eigen::Vector3d normal;
-    double cost[NUM_VERTEXES_FACE];
-    bool isDeleted;
-    bool isTouched;
-    Face() {
-      q = Eigen::Matrix4d::Zero();
-      normal = Eigen::Vector3d::Zero();
-      isDeleted = false;
-      isTouched = false;
+    Quadric& operator+=(const Quadric& other) {
+      for (int i = 0; i < 10; ++i) {
+        q[i] += other.q[i];
+      }
+      return *this;
     }
   };
 
-  // To use STL containers with Eigen, a 16-byte-aligned allocator must be used.
-  // Eigen does provide one ready for use: aligned_allocator:
-  // Source: https://eigen.tuxfamily.org/dox/group__TopicStlContainers.html
-  std::vector<Vertex, Eigen::aligned_allocator<Vertex>> vertexes;
-  std::vector<Face, Eigen::aligned_allocator<Face>> faces;
+  using Face = std::array<int, NUM_VERTEXES_FACE>;
+
+  static const uint8_t kBoundary = 1 << 0;
+  static const uint8_t kLocked = 1 << 1; // shared with another tile, must not move
+  static const uint8_t kDeleted = 1 << 0;
+  static const uint8_t kTouched = 1 << 1;
+
+  // Vertexes and faces, one array per attribute
+  // The faces of vertex i are vertexFaces[facesBegin[i], facesBegin[i + 1]), rebuilt by
+  // assignFaceVertexes() at the beginning of each iteration
+  struct Mesh {
+    std::vector<Eigen::Vector3d> coords;
+    std::vector<Quadric> quadrics;
+    std::vector<uint8_t> vertexFlags;
+    std::vector<Face> faces;
+    std::vector<Eigen::Vector3d> normals;
+    std::vector<std::array<double, NUM_VERTEXES_FACE>> costs;
+    std::vector<uint8_t> faceFlags;
+    std::vector<int> facesBegin;
+    std::vector<int> vertexFaces;
+  };
 
+  Mesh mesh;
   int numThreads;
   bool isEquiError;
 
   void loadVertexes(const Eigen::MatrixXd& vertexesIn, const int start, const int end);
   void loadFaces(const Eigen::MatrixXi& facesIn, const int start, const int end);
-  void computeSubQuadrics(const int start, const int end);
-  void computeSubError(const int start, const int end);
   void computeInitialQuadrics();
-  double getThreshold(const float percRemoveEachIter);
-  void removeDeletedFaces();
-  void assignFaceVertexes();
-  void identifySubBoundaries(const int start, const int end);
   void identifyBoundaries();
-  double computeError(const Vertex& v0, const Vertex& v1, Eigen::Vector3d& pTarget);
-  std::vector<int> commonFaces(const int vertexIdx0, const int vertexIdx1);
-  bool haveNormalsFlipped(Eigen::Vector3d p, int vertexIdx0, int vertexIdx1);
-  void updateCosts(const int vertexIdx0, const int vertexIdx1, const Eigen::Vector3d& pTarget);
+  void simplifyTiles(const int numFacesOut, const float strictness, const bool removeBoundaryEdges);
+  void collapse(
+      Mesh& m,
+      const int numFacesOut,
+      const float strictness,
+      const bool removeBoundaryEdges,
+      const bool verbose) const;
+  double computeError(const Mesh& m, const int vIdx0, const int vIdx1, Eigen::Vector3d& pTarget)
+      const;
+  void updateCosts(Mesh& m, const int vIdx0, const int vIdx1, const Eigen::Vector3d& pTarget)
+      const;
+  static double getThreshold(const Mesh& m, const float strictness);
+  static void removeDeletedFaces(Mesh& m);
+  static void assignFaceVertexes(Mesh& m);
+  static std::vector<int> commonFaces(const Mesh& m, const int vIdx0, const int vIdx1);
+  static bool haveNormalsFlipped(const Mesh& m, const Eigen::Vector3d& p, int vIdx0, int vIdx1);
   void createFinalMesh();
 };
 
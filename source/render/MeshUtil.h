@@ -7,21 +7,35 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <numeric>
+#include <string>
+#include <tuple>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <Eigen/Geometry>
 
+#include <folly/Format.h>
+
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/MathUtil.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace mesh_util {
 
-Eigen::Vector3d calcBarycentrics(const Eigen::Vector2d& point, const Eigen::Matrix3d& triangle) {
+inline Eigen::Vector3d calcBarycentrics(
+    const Eigen::Vector2d& point,
+    const Eigen::Matrix3d& triangle) {
   const Eigen::Vector2d base = triangle.row(2).head<2>();
   Eigen::Matrix2d m = triangle.topLeftCorner<2, 2>();
   m.row(0) -= base;
@@ -69,6 +83,21 @@ inline void writePfm(
   cv_util::writeCvMat32FC1ToPFM(filenamePfm, dst);
 }
 
+// Contents of a .vtx file: rows of float xyz
+inline std::vector<uint8_t> serializeVertexes(const Eigen::MatrixXd& vertexes) {
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> v = vertexes.cast<float>();
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(v.data());
+  return std::vector<uint8_t>(data, data + v.size() * sizeof(float));
+}
+
+// Contents of a .idx file: rows of uint32_t vertex indexes
+inline std::vector<uint8_t> serializeFaces(const Eigen::MatrixXi& faces) {
+  Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> f =
+      faces.cast<uint32_t>();
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(f.data());
+  return std::vector<uint8_t>(data, data + f.size() * sizeof(uint32_t));
+}
+
 inline void writeDepth(
     const Eigen::MatrixXd& vertexes,
     const Eigen::MatrixXi& faces,
@@ -76,15 +105,45 @@ inline void writeDepth(
     const filesystem::path& fnIdx) {
   {
     std::ofstream file(fnVtx.string(), std::ios::binary);
-    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> v =
-        vertexes.cast<float>();
-    file.write(reinterpret_cast<char*>(v.data()), v.size() * sizeof(float));
+    const std::vector<uint8_t> v = serializeVertexes(vertexes);
+    file.write(reinterpret_cast<const char*>(v.data()), v.size());
   }
   {
     std::ofstream file(fnIdx.string(), std::ios::binary);
-    Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> f =
-        faces.cast<uint32_t>();
-    file.write(reinterpret_cast<char*>(f.data()), f.size() * sizeof(uint32_t));
+    const std::vector<uint8_t> f = serializeFaces(faces);
+    file.write(reinterpret_cast<const char*>(f.data()), f.size());
+  }
+}
+
+// Appends printf-style formatted text to buffer
+template <typename... Args>
+void appendFormat(std::string& buffer, const char* format, const Args... args) {
+  char line[256];
+  const int size = snprintf(line, sizeof(line), format, args...);
+  CHECK(0 <= size && size < int(sizeof(line))) << "line too long for format: " << format;
+  buffer.append(line, size);
+}
+
+// Writes count lines to fp, in order, where appendLine(buffer, i) appends line i to buffer
+// Chunks of lines are formatted in parallel into their own buffers, then written one after another
+template <typename Fn>
+void writeLines(FILE* fp, const int count, const Fn& appendLine, const int threads = -1) {
+  const int kLinesPerChunk = 1 << 14;
+  std::vector<std::string> chunks((count + kLinesPerChunk - 1) / kLinesPerChunk);
+  const int kChunksPerTask = 1;
+  parallelFor(
+      0,
+      int(chunks.size()),
+      kChunksPerTask,
+      [&](const int chunk) {
+        const int end = std::min(count, (chunk + 1) * kLinesPerChunk);
+        for (int i = chunk * kLinesPerChunk; i < end; ++i) {
+          appendLine(chunks[chunk], i);
+        }
+      },
+      threads);
+  for (const std::string& chunk : chunks) {
+    CHECK_EQ(fwrite(chunk.data(), 1, chunk.size(), fp), chunk.size()) << "write failed";
   }
 }
 
@@ -92,7 +151,8 @@ inline void writeObj(
     const Eigen::MatrixXd& vertexes,
     const Eigen::MatrixXi& faces,
     const filesystem::path& filenameObj,
-    const filesystem::path& filenameMtl = "") {
+    const filesystem::path& filenameMtl = "",
+    const int threads = -1) {
   const bool st = vertexes.cols() == 5;
   CHECK(vertexes.cols() == 3 || st) << "expected xyz or xyzst";
   CHECK_EQ(st, !filenameMtl.empty()) << "texture coordinates and material go together";
@@ -102,30 +162,88 @@ inline void writeObj(
   if (!filenameMtl.empty()) {
     fprintf(fp, "mtllib %s\nusemtl material\n", filenameMtl.c_str());
   }
-  for (int i = 0; i < vertexes.rows(); ++i) {
-    // Use the shortest representation: %e or %f
-    fprintf(fp, "v %g %g %g\n", vertexes(i, 0), vertexes(i, 1), vertexes(i, 2));
-    if (st) {
-      fprintf(fp, "vt %g %g\n", vertexes(i, 3), vertexes(i, 4));
-    }
-  }
-  for (int i = 0; i < faces.rows(); ++i) {
-    // obj indexes are 1-based
-    if (!st) {
-      fprintf(fp, "f %d %d %d\n", faces(i, 0) + 1, faces(i, 1) + 1, faces(i, 2) + 1);
-    } else {
-      fprintf(
-          fp,
-          "f %d/%d %d/%d %d/%d\n",
-          faces(i, 0) + 1,
-          faces(i, 0) + 1,
-          faces(i, 1) + 1,
-          faces(i, 1) + 1,
-          faces(i, 2) + 1,
-          faces(i, 2) + 1);
-    }
-  }
-  fclose(fp);
+  writeLines(
+      fp,
+      vertexes.rows(),
+      [&](std::string& buffer, const int i) {
+        // Use the shortest representation: %e or %f
+        appendFormat(buffer, "v %g %g %g\n", vertexes(i, 0), vertexes(i, 1), vertexes(i, 2));
+        if (st) {
+          appendFormat(buffer, "vt %g %g\n", vertexes(i, 3), vertexes(i, 4));
+        }
+      },
+      threads);
+  writeLines(
+      fp,
+      faces.rows(),
+      [&](std::string& buffer, const int i) {
+        // obj indexes are 1-based
+        const int a = faces(i, 0) + 1;
+        const int b = faces(i, 1) + 1;
+        const int c = faces(i, 2) + 1;
+        if (!st) {
+          appendFormat(buffer, "f %d %d %d\n", a, b, c);
+        } else {
+          appendFormat(buffer, "f %d/%d %d/%d %d/%d\n", a, a, b, b, c, c);
+        }
+      },
+      threads);
+  CHECK_EQ(fclose(fp), 0) << "file write failed: " << filenameObj;
+}
+
+// Binary little endian ply with float xyz vertexes and triangle faces, much smaller and faster to
+// write and load than obj
+inline void writePly(
+    const Eigen::MatrixXd& vertexes,
+    const Eigen::MatrixXi& faces,
+    const filesystem::path& filenamePly,
+    const int threads = -1) {
+  CHECK_GE(vertexes.cols(), 3) << "expected xyz";
+  CHECK_EQ(faces.cols(), 3) << "expected triangles";
+  const std::string header = folly::sformat(
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "element vertex {}\n"
+      "property float x\n"
+      "property float y\n"
+      "property float z\n"
+      "element face {}\n"
+      "property list uchar int vertex_indices\n"
+      "end_header\n",
+      vertexes.rows(),
+      faces.rows());
+
+  // Every record has the same size, so threads fill their rows straight into the output
+  const size_t kVertexSize = 3 * sizeof(float);
+  const size_t kFaceSize = 1 + 3 * sizeof(int32_t);
+  const size_t facesOffset = header.size() + vertexes.rows() * kVertexSize;
+  std::vector<char> data(facesOffset + faces.rows() * kFaceSize);
+  std::copy(header.begin(), header.end(), data.begin());
+  const int kRowsPerTask = 1 << 14;
+  parallelFor(
+      0,
+      vertexes.rows(),
+      kRowsPerTask,
+      [&](const int i) {
+        const Eigen::Vector3f v = vertexes.row(i).head<3>().transpose().cast<float>();
+        std::memcpy(&data[header.size() + i * kVertexSize], v.data(), kVertexSize);
+      },
+      threads);
+  parallelFor(
+      0,
+      faces.rows(),
+      kRowsPerTask,
+      [&](const int i) {
+        const Eigen::Matrix<int32_t, 3, 1> f = faces.row(i).transpose().cast<int32_t>();
+        char* dst = &data[facesOffset + i * kFaceSize];
+        dst[0] = 3;
+        std::memcpy(dst + 1, f.data(), kFaceSize - 1);
+      },
+      threads);
+
+  std::ofstream file(filenamePly.string(), std::ios::binary);
+  file.write(data.data(), data.size());
+  CHECK(file) << "file write failed: " << filenamePly;
 }
 
 inline std::string writeMtl(const filesystem::path& pathObj, const filesystem::path& pathColor) {
@@ -164,8 +282,9 @@ inline Eigen::MatrixXi readFaces(const filesystem::path& fnIdx) {
 }
 
 // return a mask representing which of the 4 possible triangles to output
+template <typename Vertexes>
 inline unsigned getTriangleMask(
-    const Eigen::MatrixXd& verts,
+    const Vertexes& verts,
     const int base,
     const int width,
     const float tearRatio,
@@ -182,13 +301,14 @@ inline unsigned getTriangleMask(
   const double bl = isRigCoordinates ? verts.row(bli).norm() : verts(bli, 2);
   const double br = isRigCoordinates ? verts.row(bri).norm() : verts(bri, 2);
 
-  std::vector<std::tuple<double, int>> v = {
+  std::array<std::tuple<double, int>, 4> v = {{
       std::make_tuple(tl, 0),
       std::make_tuple(tr, 1),
       std::make_tuple(bl, 2),
-      std::make_tuple(br, 3)};
+      std::make_tuple(br, 3),
+  }};
 
-  sort(v.begin(), v.end());
+  std::sort(v.begin(), v.end());
 
   // are all 4 values pretty close?
   if (std::get<0>(v.front()) / std::get<0>(v.back()) > tearRatio) {
@@ -261,147 +381,225 @@ inline void addTriangle(T&& face, const int which, int base, int width) {
 //
 // a reasonable value to try is ~0.95, which means it won't connect
 // vertexes if one is at 10 m while the neighbor is at 9.5 m
-inline Eigen::MatrixXi getFaces(
-    const Eigen::MatrixXd& vertexes,
+//
+// Vertexes and Faces can be any eigen matrix with 3 columns, e.g. float and uint32_t row-major
+// matrices are laid out as .vtx and .idx files. faces is resized to exactly the number of
+// triangles: a first row-parallel pass keeps each quad's triangle mask and counts the triangles
+// of each row, and the prefix sum of those counts is where the second pass writes each row
+template <typename Faces, typename Vertexes>
+inline void computeFaces(
+    Faces& faces,
+    const Vertexes& vertexes,
     const int width,
     const int height,
     const bool wrapHorizontally,
     const bool isRigCoordinates,
-    const float tearRatio = 0.0f) {
-  Eigen::MatrixXi faces(width * (height - 1) * 2, 3);
-  int face = 0;
-  for (int y = 0; y < height - 1; ++y) {
-    for (int x = 0; x < width - 1; ++x) {
-      int base = y * width + x;
-      unsigned mask = getTriangleMask(vertexes, base, width, tearRatio, isRigCoordinates);
-      for (int triangle = 0; triangle < 4; ++triangle) {
-        if ((mask >> triangle) & 1) {
-          addTriangle(faces.row(face++), triangle, base, width);
+    const float tearRatio = 0.0f,
+    const int threads = -1) {
+  const int quadRows = std::max(height - 1, 0);
+  const int quadCols = std::max(width - 1, 0);
+  std::vector<uint8_t> masks(quadRows * quadCols);
+  std::vector<int> offsets(quadRows + 1, 0);
+  const int kGrain = 8;
+  parallelFor(
+      0,
+      quadRows,
+      kGrain,
+      [&](const int y) {
+        int count = 0;
+        for (int x = 0; x < quadCols; ++x) {
+          const unsigned mask =
+              getTriangleMask(vertexes, y * width + x, width, tearRatio, isRigCoordinates);
+          masks[y * quadCols + x] = mask;
+          count += (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1) + (mask >> 3 & 1);
         }
-      }
-    }
-  }
+        offsets[y + 1] = count;
+      },
+      threads);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  faces.resize(offsets.back() + (wrapHorizontally ? 2 * quadRows : 0), 3);
+  parallelFor(
+      0,
+      quadRows,
+      kGrain,
+      [&](const int y) {
+        int face = offsets[y];
+        for (int x = 0; x < quadCols; ++x) {
+          const unsigned mask = masks[y * quadCols + x];
+          for (int triangle = 0; triangle < 4; ++triangle) {
+            if ((mask >> triangle) & 1) {
+              addTriangle(faces.row(face++), triangle, y * width + x, width);
+            }
+          }
+        }
+      },
+      threads);
 
   if (wrapHorizontally) {
     // Link last and first longitudes
     // Note how triangles are always defined counterclock-wise
-    for (int y = 0; y < height - 1; ++y) {
+    int face = offsets.back();
+    for (int y = 0; y < quadRows; ++y) {
       int base = y * width;
-      faces.row(face++) = Eigen::Vector3i(base + width, base, base + width - 1);
-      faces.row(face++) = Eigen::Vector3i(base + width - 1, base + 2 * width - 1, base + width);
+      faces.row(face++) << base + width, base, base + width - 1;
+      faces.row(face++) << base + width - 1, base + 2 * width - 1, base + width;
     }
   }
+}
 
-  return faces.topRows(face);
+inline Eigen::MatrixXi getFaces(
+    const Eigen::MatrixXd& vertexes,
+    const int width,
+    const int height,
+    const bool wrapHorizontally,
+    const bool isRigCoordinates,
+    const float tearRatio = 0.0f,
+    const int threads = -1) {
+  Eigen::MatrixXi faces;
+  computeFaces(
+      faces, vertexes, width, height, wrapHorizontally, isRigCoordinates, tearRatio, threads);
+  return faces;
 }
 
-inline Eigen::MatrixXd getVertexesEquirect(const cv::Mat_<float>& disparity, const float maxDepth) {
+template <typename Vertexes>
+inline void computeVertexesEquirect(
+    Vertexes& vertexes,
+    const cv::Mat_<float>& disparity,
+    const float maxDepth,
+    const int threads = -1) {
   const int width = disparity.cols;
   const int height = disparity.rows;
-  Eigen::MatrixXd vertexes(width * height, 3);
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      const float u = float(x + 0.5) / float(width);
-      const float v = float(y + 0.5) / float(height);
-      const float theta = u * 2.0f * M_PI;
-      const float phi = v * M_PI;
-      const float depth = std::fmin(maxDepth, 1.0f / disparity(y, x));
-      vertexes.row(y * width + x) =
-          depth * Eigen::Vector3d(sin(phi) * cos(theta), cos(phi), sin(phi) * sin(theta));
-    }
-  }
+  vertexes.resize(width * height, 3);
+  parallelFor(
+      0,
+      height,
+      1,
+      [&](const int y) {
+        for (int x = 0; x < width; ++x) {
+          const float u = float(x + 0.5) / float(width);
+          const float v = float(y + 0.5) / float(height);
+          const float theta = u * 2.0f * M_PI;
+          const float phi = v * M_PI;
+          const float depth = std::fmin(maxDepth, 1.0f / disparity(y, x));
+          const int i = y * width + x;
+          vertexes(i, 0) = depth * double(sin(phi) * cos(theta));
+          vertexes(i, 1) = depth * double(cos(phi));
+          vertexes(i, 2) = depth * double(sin(phi) * sin(theta));
+        }
+      },
+      threads);
+}
+
+inline Eigen::MatrixXd getVertexesEquirect(
+    const cv::Mat_<float>& disparity,
+    const float maxDepth,
+    const int threads = -1) {
+  Eigen::MatrixXd vertexes;
+  computeVertexesEquirect(vertexes, disparity, maxDepth, threads);
   return vertexes;
 }
 
 // for equi error discussion, see cameraMeshVS in RigScene.cpp
-inline Eigen::MatrixXd getVertexesEquiError(const cv::Mat_<float>& depth, const Camera& camera) {
-  int width = depth.cols;
-  int height = depth.rows;
+template <typename Vertexes>
+inline void computeVertexesEquiError(
+    Vertexes& vertexes,
+    const cv::Mat_<float>& depth,
+    const Camera& camera,
+    const int threads = -1) {
+  const int width = depth.cols;
+  const int height = depth.rows;
   const double kRadius = 1; // change this to 100 if rig is in cm
   const double scale = camera.getScalarFocal() * kRadius;
-  Eigen::MatrixXd vertexes(width * height, 3);
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      // equi-error coordinates
-      Eigen::Vector3d equi(
-          camera.resolution.x() / width * (x + 0.5),
-          camera.resolution.y() / height * (y + 0.5),
-          scale / depth(y, x));
-
-      // actual rig coordinates would be
-      //   Camera::Vector2 pixel(x + 0.5, y + 0.5);
-      //   Camera::Vector3 rig = camera.rig(pixel).pointAt(depth(y, x));
-      int i = y * width + x;
-      for (int c = 0; c < equi.size(); ++c) {
-        vertexes(i, c) = equi[c];
-      }
-    }
-  }
+  vertexes.resize(width * height, 3);
+  parallelFor(
+      0,
+      height,
+      1,
+      [&](const int y) {
+        for (int x = 0; x < width; ++x) {
+          // equi-error coordinates
+          // actual rig coordinates would be
+          //   Camera::Vector2 pixel(x + 0.5, y + 0.5);
+          //   Camera::Vector3 rig = camera.rig(pixel).pointAt(depth(y, x));
+          const int i = y * width + x;
+          vertexes(i, 0) = camera.resolution.x() / width * (x + 0.5);
+          vertexes(i, 1) = camera.resolution.y() / height * (y + 0.5);
+          vertexes(i, 2) = scale / depth(y, x);
+        }
+      },
+      threads);
+}
+
+inline Eigen::MatrixXd
+getVertexesEquiError(const cv::Mat_<float>& depth, const Camera& camera, const int threads = -1) {
+  Eigen::MatrixXd vertexes;
+  computeVertexesEquiError(vertexes, depth, camera, threads);
   return vertexes;
 }
 
 // Assumes vertexes have been generated in order from a depth map stored row-major so that
 // mask(y, x) corresponds to vertexes(y * mask.cols + x)
+// Keeps the faces whose vertexes are all in mask and the vertexes those faces use, compacting
+// both matrices in place: prefix sums of the kept vertexes give their new indexes
+template <typename Vertexes, typename Faces>
 inline void applyMaskToVertexesAndFaces(
-    Eigen::MatrixXd& vertexes,
-    Eigen::MatrixXi& faces,
-    const cv::Mat_<bool> mask) {
+    Vertexes& vertexes,
+    Faces& faces,
+    const cv::Mat_<bool> mask,
+    const int threads = -1) {
   const int width = mask.cols;
   const int height = mask.rows;
   CHECK_EQ(width * height, vertexes.rows());
-  bool* originalVertexMask = (bool*)mask.data;
+  CHECK(mask.isContinuous());
+  const bool* originalVertexMask = mask.ptr<bool>();
 
   // Keep faces only if all vertexes have a non-zero mask
-  std::vector<int> outputFaceIndexes;
+  std::vector<uint8_t> keepFace(faces.rows());
+  const int kGrain = 4096;
+  parallelFor(
+      0,
+      faces.rows(),
+      kGrain,
+      [&](const int i) {
+        keepFace[i] = originalVertexMask[faces(i, 0)] && originalVertexMask[faces(i, 1)] &&
+            originalVertexMask[faces(i, 2)];
+      },
+      threads);
+
+  // Keep only vertexes of retained faces, numbered in order
+  std::vector<int> vertexIndexes(vertexes.rows(), 0);
   for (int i = 0; i < faces.rows(); ++i) {
-    const Eigen::Vector3i& face = faces.row(i);
-    bool allVertexesRetained = true;
-    for (int j = 0; j < face.size(); ++j) {
-      if (!originalVertexMask[face(j)]) {
-        allVertexesRetained = false;
-        break;
+    if (keepFace[i]) {
+      for (int j = 0; j < 3; ++j) {
+        vertexIndexes[faces(i, j)] = 1;
       }
     }
-    if (allVertexesRetained) {
-      outputFaceIndexes.push_back(i);
-    }
-  }
-
-  // Keep only vertexes of retained faces
-  std::vector<bool> vertexMask(vertexes.rows(), false);
-  for (int i : outputFaceIndexes) {
-    const Eigen::Vector3i& face = faces.row(i);
-    for (int j = 0; j < face.size(); ++j) {
-      vertexMask[face(j)] = true;
-    }
   }
-
-  // Compute mapping between old and new vertex indices
-  std::map<int, int> inputToOutputVertexIndexes;
   int numOutputVertexes = 0;
   for (int i = 0; i < vertexes.rows(); ++i) {
-    if (vertexMask[i]) {
-      inputToOutputVertexIndexes[i] = numOutputVertexes++;
-    }
+    const bool keep = vertexIndexes[i];
+    vertexIndexes[i] = keep ? numOutputVertexes++ : -1;
   }
 
-  // create output vertex matrix
-  Eigen::MatrixXd inputVertexes = vertexes;
-  vertexes = Eigen::MatrixXd(numOutputVertexes, 3);
-  for (auto iter = inputToOutputVertexIndexes.begin(); iter != inputToOutputVertexIndexes.end();
-       ++iter) {
-    vertexes.row(iter->second) = inputVertexes.row(iter->first);
+  // Move kept rows forward, output rows never come after their input rows
+  for (int i = 0; i < vertexes.rows(); ++i) {
+    if (vertexIndexes[i] >= 0) {
+      vertexes.row(vertexIndexes[i]) = vertexes.row(i);
+    }
   }
+  vertexes.conservativeResize(numOutputVertexes, Eigen::NoChange);
 
-  // Create output face matrix and re-index vertexes
-  Eigen::MatrixXi inputFaces = faces;
-  faces = Eigen::MatrixXi(outputFaceIndexes.size(), 3);
-  for (ssize_t i = 0; i < ssize(outputFaceIndexes); ++i) {
-    const Eigen::Vector3i& face = inputFaces.row(outputFaceIndexes[i]);
-    for (int j = 0; j < face.size(); ++j) {
-      faces(i, j) = inputToOutputVertexIndexes[face(j)];
+  int numOutputFaces = 0;
+  for (int i = 0; i < faces.rows(); ++i) {
+    if (keepFace[i]) {
+      for (int j = 0; j < 3; ++j) {
+        faces(numOutputFaces, j) = vertexIndexes[faces(i, j)];
+      }
+      ++numOutputFaces;
     }
   }
+  faces.conservativeResize(numOutputFaces, Eigen::NoChange);
 }
 
 // Add texture coordinates to vertexes
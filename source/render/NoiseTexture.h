@@ -0,0 +1,113 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+
+#include "source/render/PerlinNoise.h"
+#include "source/util/ThreadPool.h"
+
+namespace fb360_dep {
+namespace render {
+
+// perlin_noise::pnoise sampled once on a grid over a box, then looked up with trilinear
+// interpolation, a few loads instead of the hashing and fades of every evaluation
+// The noise has features about one unit across, a few samples per unit keep the lookups within
+// a small fraction of its range. Points outside the box get the value at the closest face
+class NoiseTexture {
+ public:
+  static const int64_t kMaxSamples = int64_t(1) << 26; // 256 MB
+
+  // samplesPerUnit is lowered if the grid over [lo, hi] would have more than maxSamples
+  NoiseTexture(
+      const cv::Vec3f& lo,
+      const cv::Vec3f& hi,
+      const float samplesPerUnit,
+      const int threads = -1,
+      const int64_t maxSamples = kMaxSamples)
+      : lo(lo), samplesPerUnit(samplesPerUnit) {
+    CHECK_GT(samplesPerUnit, 0);
+    while (getSize(hi - lo, this->samplesPerUnit) > maxSamples) {
+      this->samplesPerUnit *= 0.9f;
+    }
+    if (this->samplesPerUnit < samplesPerUnit) {
+      LOG(WARNING) << "noise texture lowered to " << this->samplesPerUnit << " samples per unit";
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+      size[axis] = getSize(hi[axis] - lo[axis], this->samplesPerUnit);
+    }
+
+    samples.resize(int64_t(size[0]) * size[1] * size[2]);
+    parallelFor(
+        0,
+        size[2],
+        1,
+        [&](const int z) {
+          float* sample = &samples[int64_t(z) * size[1] * size[0]];
+          for (int y = 0; y < size[1]; ++y) {
+            for (int x = 0; x < size[0]; ++x) {
+              const cv::Vec3f p = lo + cv::Vec3f(x, y, z) / this->samplesPerUnit;
+              *sample++ = perlin_noise::pnoise(p[0], p[1], p[2]);
+            }
+          }
+        },
+        threads);
+  }
+
+  float lookup(const cv::Vec3f& p) const {
+    int i[3];
+    float f[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      const float t = std::max((p[axis] - lo[axis]) * samplesPerUnit, 0.0f);
+      i[axis] = std::min(int(t), size[axis] - 2);
+      f[axis] = std::min(t - i[axis], 1.0f);
+    }
+    const int64_t dy = size[0];
+    const int64_t dz = dy * size[1];
+    const float* s = &samples[i[2] * dz + i[1] * dy + i[0]];
+    auto lerp = [](const float a, const float b, const float t) { return a + t * (b - a); };
+    const float s00 = lerp(s[0], s[1], f[0]);
+    const float s10 = lerp(s[dy], s[dy + 1], f[0]);
+    const float s01 = lerp(s[dz], s[dz + 1], f[0]);
+    const float s11 = lerp(s[dz + dy], s[dz + dy + 1], f[0]);
+    return lerp(lerp(s00, s10, f[1]), lerp(s01, s11, f[1]), f[2]);
+  }
+
+  float getSamplesPerUnit() const {
+    return samplesPerUnit;
+  }
+
+  int64_t getSampleCount() const {
+    return samples.size();
+  }
+
+ private:
+  // At least two samples per axis, so that every lookup has a cell
+  static int getSize(const float extent, const float samplesPerUnit) {
+    return std::max(int(std::ceil(extent * samplesPerUnit)) + 1, 2);
+  }
+
+  static int64_t getSize(const cv::Vec3f& extent, const float samplesPerUnit) {
+    return int64_t(getSize(extent[0], samplesPerUnit)) * getSize(extent[1], samplesPerUnit) *
+        getSize(extent[2], samplesPerUnit);
+  }
+
+  const cv::Vec3f lo;
+  float samplesPerUnit;
+  int size[3];
+  std::vector<float> samples; // x fastest
+};
+
+} // namespace render
+} // namespace fb360_dep
@@ -0,0 +1,209 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <folly/Format.h>
+
+#include "source/gpu/GlUtil.h"
+#include "source/render/VideoFile.h"
+
+namespace fb360_dep {
+
+// Timing and i/o of the last frames of playback, to tell whether a hitch came from the disk, the
+// upload or the draw, and to tune stripes and levels of detail for a machine
+// draw() overlays the history on the bottom left of the viewport as one bar per frame, stacked
+// from the bottom: disk wait (red), upload (yellow), starting reads (magenta) and gpu render
+// (blue), under grey lines at one and two frame intervals. Two bars on the right show the frames
+// in flight (green, up to maxFrames) and the disk throughput (cyan, up to kMaxMbps)
+// Samples also go to a csv file, one line per frame, if one is given
+class PlaybackHud {
+ public:
+  struct Sample {
+    VideoFile::AdvanceStats advance;
+    float renderMs = 0; // gpu time of the scene, e.g. from a GpuTimer
+  };
+
+  static const int kHistory = 120; // frames
+  static constexpr float kMaxMbps = 2000;
+
+  PlaybackHud(const float fps, const int maxFrames, const std::string& csvPath = "")
+      : frameMs(1000 / fps), maxFrames(maxFrames) {
+    if (!csvPath.empty()) {
+      csv.open(csvPath);
+      CHECK(csv) << "cannot write " << csvPath;
+      csv << "frame,wait_ms,upload_ms,read_begin_ms,render_ms,pending_frames,mbps" << std::endl;
+    }
+  }
+
+  ~PlaybackHud() {
+    if (program) {
+      glDeleteProgram(program);
+      glDeleteBuffers(1, &buffer);
+      glDeleteVertexArrays(1, &vertexArray);
+    }
+  }
+
+  PlaybackHud(const PlaybackHud&) = delete;
+  PlaybackHud& operator=(const PlaybackHud&) = delete;
+
+  void add(const Sample& sample) {
+    history.push_back(sample);
+    if (int(history.size()) > kHistory) {
+      history.pop_front();
+    }
+    if (csv.is_open()) {
+      const VideoFile::AdvanceStats& advance = sample.advance;
+      csv << folly::sformat(
+                 "{},{:.3f},{:.3f},{:.3f},{:.3f},{},{:.1f}",
+                 frameCount,
+                 advance.waitMs,
+                 advance.uploadMs,
+                 advance.readBeginMs,
+                 sample.renderMs,
+                 advance.pendingFrames,
+                 advance.mbps)
+          << "\n";
+    }
+    ++frameCount;
+  }
+
+  // draws over the bound framebuffer
+  void draw() {
+    if (!program) {
+      createProgram();
+    }
+    std::vector<Vertex> vertexes;
+    const float kLeft = -0.95;
+    const float kBottom = -0.95;
+    const float kBarWidth = 0.8 / kHistory; // in ndc
+    const float kHeight = 0.5; // of two frame intervals
+    const float yPerMs = kHeight / (2 * frameMs);
+    for (int i = 0; i < int(history.size()); ++i) {
+      const Sample& sample = history[i];
+      const float x = kLeft + i * kBarWidth;
+      float y = kBottom;
+      for (const auto& segment :
+           {std::make_pair(sample.advance.waitMs, Color{1, 0, 0}),
+            std::make_pair(sample.advance.uploadMs, Color{1, 1, 0}),
+            std::make_pair(sample.advance.readBeginMs, Color{1, 0, 1}),
+            std::make_pair(sample.renderMs, Color{0, 0.4f, 1})}) {
+        const float top = std::min(kBottom + kHeight, y + std::max(0.0f, segment.first) * yPerMs);
+        addRect(vertexes, x, y, x + kBarWidth, top, segment.second);
+        y = top;
+      }
+    }
+    const float kRight = kLeft + kHistory * kBarWidth;
+    for (const int intervals : {1, 2}) {
+      const float y = kBottom + intervals * frameMs * yPerMs;
+      addRect(vertexes, kLeft, y, kRight, y + 0.005f, Color{0.5f, 0.5f, 0.5f});
+    }
+    if (!history.empty()) {
+      const VideoFile::AdvanceStats& last = history.back().advance;
+      const float frames = std::min(1.0f, float(last.pendingFrames) / maxFrames);
+      const float mbps = std::min(1.0f, last.mbps / kMaxMbps);
+      const float framesTop = kBottom + frames * kHeight;
+      const float mbpsTop = kBottom + mbps * kHeight;
+      addRect(vertexes, kRight + 0.02f, kBottom, kRight + 0.05f, framesTop, Color{0, 1, 0});
+      addRect(vertexes, kRight + 0.07f, kBottom, kRight + 0.1f, mbpsTop, Color{0, 1, 1});
+    }
+
+    const GLboolean isDepthTest = glIsEnabled(GL_DEPTH_TEST);
+    const GLboolean isBlend = glIsEnabled(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glUseProgram(program);
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(
+        GL_ARRAY_BUFFER, vertexes.size() * sizeof(Vertex), vertexes.data(), GL_STREAM_DRAW);
+    glDrawArrays(GL_TRIANGLES, 0, vertexes.size());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    if (isDepthTest) {
+      glEnable(GL_DEPTH_TEST);
+    }
+    if (isBlend) {
+      glEnable(GL_BLEND);
+    }
+  }
+
+ private:
+  struct Color {
+    float r, g, b;
+  };
+
+  struct Vertex {
+    float x, y;
+    Color color;
+  };
+
+  static void addRect(
+      std::vector<Vertex>& vertexes,
+      const float x0,
+      const float y0,
+      const float x1,
+      const float y1,
+      const Color& color) {
+    for (const int corner : {0, 1, 2, 2, 1, 3}) {
+      vertexes.push_back({corner & 1 ? x1 : x0, corner & 2 ? y1 : y0, color});
+    }
+  }
+
+  void createProgram() {
+    const std::string vs = R"(
+      #version 330 core
+      in vec2 position;
+      in vec3 color;
+      out vec3 vertexColor;
+      void main() {
+        gl_Position = vec4(position, 0, 1);
+        vertexColor = color;
+      }
+    )";
+    const std::string fs = R"(
+      #version 330 core
+      in vec3 vertexColor;
+      out vec4 fragColor;
+      void main() {
+        fragColor = vec4(vertexColor, 1);
+      }
+    )";
+    program = fb360_dep::createProgram(vs, fs);
+    vertexArray = createVertexArray();
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    const GLint position = getAttribLocation(program, "position");
+    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+    glEnableVertexAttribArray(position);
+    const GLint color = getAttribLocation(program, "color");
+    glVertexAttribPointer(
+        color, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, color));
+    glEnableVertexAttribArray(color);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+  }
+
+  const float frameMs;
+  const int maxFrames;
+  std::deque<Sample> history; // oldest first
+  std::ofstream csv;
+  int frameCount = 0;
+  GLuint program = 0;
+  GLuint vertexArray = 0;
+  GLuint buffer = 0;
+};
+
+} // namespace fb360_dep
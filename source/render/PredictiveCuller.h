@@ -0,0 +1,173 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <folly/Format.h>
+#include <glog/logging.h>
+
+#include "source/render/RigScene.h"
+
+namespace fb360_dep {
+
+// Culls cameras for the read path (see VideoFile::readBegin), which reads frames that are only
+// displayed once they go through the readahead window. Culling with the last rendered transform
+// drops cameras that a head turn brings into view by then, so a camera is read if it is on
+// screen for any eye:
+// - at the current pose, with the field of view widened by an angular margin
+// - at the poses extrapolated from the head's angular velocity over the lookahead, sampled so
+//   that consecutive widened frusta overlap
+// Hysteresis keeps cameras on the edge from toggling: a camera that is read is only culled once
+// it is out of view with the margin widened by hysteresis too
+// update() writes scene.culled and scene.visibility, call it right before reading
+class PredictiveCuller {
+ public:
+  struct Stats {
+    int updates = 0;
+    int64_t cameras = 0; // cameras seen by the updates
+    int64_t culled = 0; // of which culled
+    int64_t misses = 0; // on screen, but culled by the previous update, i.e. pop-in
+
+    std::string toString() const {
+      const double denominator = std::max(cameras, int64_t(1));
+      return folly::sformat(
+          "Culled {:.1f}% of {} cameras over {} updates, {} on screen when culled ({:.2f}%)",
+          100 * culled / denominator,
+          cameras,
+          updates,
+          misses,
+          100 * misses / denominator);
+    }
+  };
+
+  explicit PredictiveCuller(const float marginDegrees = 10, const float hysteresisDegrees = 5)
+      : margin(toRadians(marginDegrees)), hysteresis(toRadians(hysteresisDegrees)) {
+    CHECK_GT(margin, 0);
+    CHECK_GE(hysteresis, 0);
+  }
+
+  // projections and views are per eye, as in scene.render(projection * view), seconds is the time
+  // of the pose and lookaheadSeconds how much later the frames about to be read are displayed
+  void update(
+      const RigScene& scene,
+      const double seconds,
+      const Matrix4fVector& projections,
+      const Matrix4fVector& views,
+      const float lookaheadSeconds) {
+    CHECK_EQ(projections.size(), views.size());
+    CHECK(!views.empty());
+    const Matrix4fVector predicted = predictViews(seconds, views, lookaheadSeconds);
+    Matrix4fVector inner; // widened by margin
+    Matrix4fVector outer; // widened by margin and hysteresis
+    for (int eye = 0; eye < int(views.size()); ++eye) {
+      const Eigen::Matrix4f innerProjection = widen(projections[eye], margin);
+      const Eigen::Matrix4f outerProjection = widen(projections[eye], margin + hysteresis);
+      for (int i = eye; i < int(predicted.size()); i += views.size()) {
+        inner.push_back(innerProjection * predicted[i]);
+        outer.push_back(outerProjection * predicted[i]);
+      }
+    }
+
+    const Camera::Rig& rig = scene.rig;
+    culled.resize(rig.size(), false);
+    scene.culled.resize(rig.size());
+    scene.visibility.resize(rig.size());
+    ++stats.updates;
+    for (int i = 0; i < int(rig.size()); ++i) {
+      for (int eye = 0; eye < int(views.size()); ++eye) {
+        if (culled[i] && RigScene::getVisibility(rig[i], projections[eye] * views[eye]) > 0) {
+          ++stats.misses;
+          break;
+        }
+      }
+      const float visibility = getVisibility(rig[i], inner);
+      culled[i] = culled[i] ? visibility == 0 : getVisibility(rig[i], outer) == 0;
+      scene.culled[i] = culled[i];
+      scene.visibility[i] = visibility;
+      ++stats.cameras;
+      stats.culled += culled[i];
+    }
+  }
+
+  const Stats& getStats() const {
+    return stats;
+  }
+
+ private:
+  static constexpr float kPi = 3.14159265358979f;
+  static const int kMaxPredictions = 8; // poses sampled along the lookahead
+  static constexpr double kMaxPoseIntervalSeconds = 0.5; // longer, e.g. paused, no velocity
+
+  static float toRadians(const float degrees) {
+    return degrees * kPi / 180;
+  }
+
+  static float getVisibility(const Camera& camera, const Matrix4fVector& projviews) {
+    float result = 0;
+    for (const Eigen::Matrix4f& projview : projviews) {
+      result = std::max(result, RigScene::getVisibility(camera, projview));
+    }
+    return result;
+  }
+
+  // projection with each half field of view widened by angle
+  static Eigen::Matrix4f widen(const Eigen::Matrix4f& projection, const float angle) {
+    static const float kMaxHalfFov = toRadians(89);
+    Eigen::Matrix4f scale = Eigen::Matrix4f::Identity();
+    for (int axis = 0; axis < 2; ++axis) {
+      const float halfFov = std::atan(1 / std::abs(projection(axis, axis)));
+      scale(axis, axis) = std::tan(halfFov) / std::tan(std::min(halfFov + angle, kMaxHalfFov));
+    }
+    return scale * projection;
+  }
+
+  // views followed by the views at the extrapolated poses, eyes interleaved
+  // The head is assumed to keep turning at the angular velocity between the last two updates,
+  // which rotates every eye about its own center
+  Matrix4fVector predictViews(
+      const double seconds,
+      const Matrix4fVector& views,
+      const float lookaheadSeconds) {
+    Matrix4fVector result = views;
+    const double interval = seconds - previousSeconds;
+    const Eigen::Matrix3f rotation = views[0].topLeftCorner<3, 3>();
+    if (hasPrevious && 0 < interval && interval < kMaxPoseIntervalSeconds) {
+      const Eigen::AngleAxisf delta(rotation * previousRotation.transpose());
+      const float angle = delta.angle() * lookaheadSeconds / interval;
+      const int count = std::min(int(kMaxPredictions), int(std::ceil(angle / margin)));
+      for (int step = 1; step <= count; ++step) {
+        Eigen::Matrix4f turn = Eigen::Matrix4f::Identity();
+        turn.topLeftCorner<3, 3>() =
+            Eigen::AngleAxisf(angle * step / count, delta.axis()).toRotationMatrix();
+        for (const Eigen::Matrix4f& view : views) {
+          result.push_back(turn * view);
+        }
+      }
+    }
+    hasPrevious = true;
+    previousSeconds = seconds;
+    previousRotation = rotation;
+    return result;
+  }
+
+  const float margin; // radians
+  const float hysteresis; // radians
+  std::vector<bool> culled; // by the last update
+  bool hasPrevious = false;
+  double previousSeconds = 0;
+  Eigen::Matrix3f previousRotation;
+  Stats stats;
+};
+
+} // namespace fb360_dep
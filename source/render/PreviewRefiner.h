@@ -0,0 +1,88 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <opencv2/highgui.hpp>
+
+namespace fb360_dep {
+
+// Progressive display for the interactive threshold tools: a cheap preview is shown right away
+// and the full resolution result is computed on a background thread, then shown by poll()
+// Each request cancels the refinement in flight, which checks isCancelled() between its steps
+class PreviewRefiner {
+ public:
+  using IsCancelled = std::function<bool()>;
+  using Refine = std::function<cv::Mat(const IsCancelled& isCancelled)>;
+
+  static const int kPollMs = 30;
+
+  explicit PreviewRefiner(const std::string& winName) : winName(winName) {}
+
+  ~PreviewRefiner() {
+    ++generation;
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  // UI thread only. preview may be empty, e.g. when there is no smaller level to preview
+  void request(const cv::Mat& preview, const Refine& refine) {
+    const int current = ++generation;
+    if (worker.joinable()) {
+      worker.join(); // cancelled above, returns at its next check
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      refined.release(); // may be from a cancelled request
+    }
+    if (!preview.empty()) {
+      cv::imshow(winName, preview);
+    }
+    worker = std::thread([this, current, refine] {
+      const IsCancelled isCancelled = [this, current] { return generation != current; };
+      const cv::Mat result = refine(isCancelled);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!result.empty() && !isCancelled()) {
+        refined = result;
+      }
+    });
+  }
+
+  // UI thread only. Shows the refined result once it is ready
+  void poll() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!refined.empty()) {
+      cv::imshow(winName, refined);
+      refined.release();
+    }
+  }
+
+  // cv::waitKey(0) that keeps showing refined results
+  int waitKey() {
+    int key;
+    while ((key = cv::waitKey(kPollMs)) < 0) {
+      poll();
+    }
+    return key;
+  }
+
+ private:
+  const std::string winName;
+  std::atomic<int> generation{0};
+  std::thread worker;
+  std::mutex mutex;
+  cv::Mat refined; // guarded by mutex
+};
+
+} // namespace fb360_dep
@@ -7,7 +7,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
+
 #include "source/util/Camera.h"
+#include "source/util/CameraModel.h"
+#include "source/util/CvUtil.h"
+#include "source/util/FilesystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 
@@ -55,26 +68,26 @@ class ReprojectionTable {
       values = {{-1, -1}}; // outside
       return;
     }
+    // build once per pair of camera types, without a type switch per sample
+    withCameraModel(dst, [&](const auto& dstModel) {
+      withCameraModel(src, [&](const auto& srcModel) {
+        this->build(dstModel, srcModel, tolerance, margin);
+      });
+    });
+  }
 
-    // compute the resolution required in each dimension
-    for (int dim = 0; dim < shape.size(); ++dim) {
-      // start by checking error at kN^3 cells, increasing end[dim] as needed
-      static const int kN = 10;
-      static const float kFactor = 1.2f;
-      for (IndexType end = IndexType::Constant(kN);; end[dim] *= kFactor) {
-        if (isWithinTolerance(dst, src, end, dim, tolerance, margin)) {
-          shape[dim] = end[dim] + 1;
-          break;
-        }
-      }
-    }
-
-    // now create table with the computed shape
-    values.resize(shape.prod());
-    for (IndexType i(0, 0, 0); good(i, shape); increment(i, shape)) {
-      const Camera::Vector3 normalized = divide(i, shape - 1);
-      values[flatten(i, shape)] = compute(dst, src, normalized, margin);
-    }
+  // dst can be anything that maps normalized coordinates into the rig the way a normalized
+  // Camera does, i.e. has isOutsideImageCircle(xy) and rig(xy, depth), e.g. an equirect
+  template <typename Dst>
+  ReprojectionTable(
+      const Dst& dst,
+      const Camera& src,
+      const Camera::Vector2& tolerance,
+      const Camera::Vector2& margin = {0, 0})
+      : margin(margin) {
+    withCameraModel(src, [&](const auto& srcModel) {
+      this->build(dst, srcModel, tolerance, margin);
+    });
   }
 
   using Entry = Eigen::Vector2f; // not 16B, ok to put in vector
@@ -84,6 +97,44 @@ class ReprojectionTable {
   const Camera::Vector2 margin;
   std::vector<Entry> values;
 
+  // reads the table for (dst, src, tolerance, margin) from dir, if it was saved there, otherwise
+  // builds it and saves it. dir empty = no cache
+  // a table is saved as two mat files: values, with a row per (z, y), and shape, written last
+  static ReprojectionTable getOrCompute(
+      const filesystem::path& dir,
+      const Camera& dst,
+      const Camera& src,
+      const Camera::Vector2& tolerance,
+      const Camera::Vector2& margin = {0, 0}) {
+    if (dir.empty()) {
+      return ReprojectionTable(dst, src, tolerance, margin);
+    }
+    const std::string key = getKey(dst, src, tolerance, margin);
+    const filesystem::path valuesPath = dir / (key + ".values" + cv_util::kMatFileExtension);
+    const filesystem::path shapePath = dir / (key + ".shape" + cv_util::kMatFileExtension);
+    if (filesystem::exists(shapePath)) {
+      const cv::Mat_<int> shapeMat = cv_util::readMatFile(shapePath);
+      const cv::Mat_<cv::Vec2f> valuesMat = cv_util::readMatFile(valuesPath);
+      const IndexType shape(shapeMat(0), shapeMat(1), shapeMat(2));
+      CHECK_EQ(int(valuesMat.total()), shape.prod()) << "corrupt table: " << valuesPath;
+      std::vector<Entry> values(shape.prod());
+      std::memcpy(values.data(), valuesMat.data, values.size() * sizeof(Entry));
+      return ReprojectionTable(margin, shape, std::move(values));
+    }
+
+    ReprojectionTable table(dst, src, tolerance, margin);
+    filesystem::create_directories(dir);
+    const cv::Mat_<cv::Vec2f> valuesMat(
+        table.shape[2] * table.shape[1],
+        table.shape[0],
+        reinterpret_cast<cv::Vec2f*>(table.values.data()));
+    cv_util::writeMatFileAtomically(valuesPath, valuesMat);
+    const cv::Mat_<int> shapeMat =
+        (cv::Mat_<int>(1, 3) << table.shape[0], table.shape[1], table.shape[2]);
+    cv_util::writeMatFileAtomically(shapePath, shapeMat); // last, it marks the table as complete
+    return table;
+  }
+
   Eigen::Array3f getScale() const {
     // input range
     Eigen::Array3f input(1 + 2 * margin.x(), 1 + 2 * margin.y(), maxDisparity() - minDisparity());
@@ -102,7 +153,7 @@ class ReprojectionTable {
   }
 
   // do a trilinear lookup in the table
-  // note: this is slow. use a GPU, that is what they are for
+  // note: this is slow. use a GPU, or the batch lookup below on a CPU
   Entry lookup(const Entry& xy, const float disparity) const {
     Eigen::Array3f texcoor = getScale() * Eigen::Array3f(xy.x(), xy.y(), disparity) + getOffset();
     Eigen::Array3f unnorm = texcoor * shape.cast<float>();
@@ -125,6 +176,54 @@ class ReprojectionTable {
     return result;
   }
 
+  // trilinear lookups of a batch of (xy, disparity), for use as the CPU fallback
+  // the texture coordinate mapping is computed once per batch and the range is checked once, after
+  // the loop. unlike lookup(), the far edge of the table is in range
+  std::vector<Entry> lookup(
+      const std::vector<Entry>& xys,
+      const std::vector<float>& disparities) const {
+    CHECK_EQ(xys.size(), disparities.size());
+    CHECK((shape > 1).all()) << "no table to look up";
+    // input * a + b is unnorm - 0.5 in lookup(), i.e. in units of texels from the first center
+    const Eigen::Array3f a = getScale() * shape.cast<float>();
+    const Eigen::Array3f b = getOffset() * shape.cast<float>() - 0.5f;
+    const Eigen::Array3f last = (shape - 1).cast<float>();
+    const int strideY = shape[0];
+    const int strideZ = shape[0] * shape[1];
+    std::vector<Entry> result(xys.size());
+    bool inRange = true;
+    for (int i = 0; i < int(xys.size()); ++i) {
+      const float u = xys[i].x() * a.x() + b.x();
+      const float v = xys[i].y() * a.y() + b.y();
+      const float w = disparities[i] * a.z() + b.z();
+      if (!(0 <= u && u <= last.x() && 0 <= v && v <= last.y() && 0 <= w && w <= last.z())) {
+        inRange = false;
+        continue;
+      }
+
+      // begin of the 2^3 cube, the far edge of the table uses the last cube
+      const int x = std::min(int(u), shape[0] - 2);
+      const int y = std::min(int(v), shape[1] - 2);
+      const int z = std::min(int(w), shape[2] - 2);
+      const float tx = u - x;
+      const float ty = v - y;
+      const float tz = w - z;
+
+      // interpolate along x, then y, then z
+      const Entry* p0 = &values[(z * shape[1] + y) * shape[0] + x];
+      const Entry* p1 = p0 + strideZ;
+      const Entry p00 = p0[0] + tx * (p0[1] - p0[0]);
+      const Entry p01 = p0[strideY] + tx * (p0[strideY + 1] - p0[strideY]);
+      const Entry p10 = p1[0] + tx * (p1[1] - p1[0]);
+      const Entry p11 = p1[strideY] + tx * (p1[strideY + 1] - p1[strideY]);
+      const Entry q0 = p00 + ty * (p01 - p00);
+      const Entry q1 = p10 + ty * (p11 - p10);
+      result[i] = q0 + tz * (q1 - q0);
+    }
+    CHECK(inRange) << "lookup out of range";
+    return result;
+  }
+
   std::string toString(const int kRes = 10) const {
     std::string result;
     result += "[";
@@ -164,6 +263,62 @@ class ReprojectionTable {
   }
 
  private:
+  ReprojectionTable(
+      const Camera::Vector2& margin,
+      const IndexType& shape,
+      std::vector<Entry>&& values)
+      : shape(shape), margin(margin), values(std::move(values)) {}
+
+  // unique name of the table of a camera pair, tolerance and margin
+  static std::string getKey(
+      const Camera& dst,
+      const Camera& src,
+      const Camera::Vector2& tolerance,
+      const Camera::Vector2& margin) {
+    const std::string key = folly::sformat(
+        "{} {} {} {} {} {}",
+        folly::toJson(dst.serialize()),
+        folly::toJson(src.serialize()),
+        tolerance.x(),
+        tolerance.y(),
+        margin.x(),
+        margin.y());
+    return folly::sformat("{}_{}_{:016x}", dst.id, src.id, folly::hash::fnv64(key));
+  }
+
+  template <typename Dst, typename Src>
+  void build(
+      const Dst& dst,
+      const Src& src,
+      const Camera::Vector2& tolerance,
+      const Camera::Vector2& margin) {
+    // compute the resolution required in each dimension, the dimensions are independent
+    ThreadPool threadPool;
+    for (int dim = 0; dim < shape.size(); ++dim) {
+      threadPool.spawn([&, dim] {
+        // start by checking error at kN^3 cells, increasing end[dim] as needed
+        static const int kN = 10;
+        static const float kFactor = 1.2f;
+        for (IndexType end = IndexType::Constant(kN);; end[dim] *= kFactor) {
+          if (isWithinTolerance(dst, src, end, dim, tolerance, margin)) {
+            shape[dim] = end[dim] + 1;
+            break;
+          }
+        }
+      });
+    }
+    threadPool.join();
+
+    // now create table with the computed shape, one row at a time
+    values.resize(shape.prod());
+    threadPool.parallelFor(0, shape[2] * shape[1], 1, [&](const int row) {
+      for (IndexType i(0, row % shape[1], row / shape[1]); i[0] < shape[0]; ++i[0]) {
+        const Camera::Vector3 normalized = divide(i, shape - 1);
+        values[flatten(i, shape)] = compute(dst, src, normalized, margin);
+      }
+    });
+  }
+
   static Camera::Vector2 unnormalizeXY(
       const Camera::Vector3& normalized,
       const Camera::Vector2& margin) {
@@ -179,68 +334,77 @@ class ReprojectionTable {
     return (index[2] * shape[1] + index[1]) * shape[0] + index[0];
   }
 
-  static bool good(const IndexType& index, const IndexType& shape) {
-    return index[2] < shape[2];
-  }
-
-  static void increment(IndexType& index, const IndexType& shape) {
-    if (++index[0] == shape[0]) {
-      index[0] = 0;
-      if (++index[1] == shape[1]) {
-        index[1] = 0;
-        ++index[2];
-      }
-    }
-  }
-
   static Camera::Vector3
   divide(const IndexType& num, const IndexType& den, const Camera::Real offset = 0) {
     return (num.cast<Camera::Real>() + offset) / den.cast<Camera::Real>();
   }
 
+  template <typename Dst, typename Src>
   static bool isWithinTolerance(
-      const Camera& dst,
-      const Camera& src,
+      const Dst& dst,
+      const Src& src,
+      const IndexType& end,
+      int dim,
+      const Camera::Vector2& tolerance,
+      const Camera::Vector2& margin) {
+    // check rows of cells in parallel, until one of them exceeds tolerance
+    std::atomic<bool> within(true);
+    ThreadPool threadPool;
+    threadPool.parallelFor(0, end[2] * end[1], 1, [&](const int row) {
+      for (IndexType i(0, row % end[1], row / end[1]); within && i[0] < end[0]; ++i[0]) {
+        if (!isCellWithinTolerance(dst, src, i, end, dim, tolerance, margin)) {
+          within = false;
+        }
+      }
+    });
+    return within;
+  }
+
+  // is the linear approximation within tolerance in cell i?
+  template <typename Dst, typename Src>
+  static bool isCellWithinTolerance(
+      const Dst& dst,
+      const Src& src,
+      const IndexType& i,
       const IndexType& end,
       int dim,
       const Camera::Vector2& tolerance,
       const Camera::Vector2& margin) {
     const Eigen::Array2f tol = tolerance.array().cast<float>();
-    for (IndexType i(0, 0, 0); good(i, end); increment(i, end)) {
-      // compute values in center of cell
-      Camera::Vector3 normalized = divide(i, end, 0.5);
-      const Camera::Vector2 xy = unnormalizeXY(normalized, margin);
-      if (!dst.isOutsideImageCircle(xy)) {
-        const float disparity = unnormalizeDisparity(normalized.z());
-        Camera::Vector2 exact;
-        if (src.sees(dst.rig(xy, 1 / disparity), exact)) {
-          // compute sample on either side of normalized along dimension dim
-          normalized[dim] -= 0.5 / end[dim];
-          Entry lo = compute(dst, src, normalized, margin);
-          normalized[dim] += 1.0 / end[dim];
-          Entry hi = compute(dst, src, normalized, margin);
-
-          // does sub-texel precision error exceed tolerance?
-          const float kSubtexelPrecision = 1.0f / 512;
-          Eigen::Array2f sub = (hi - lo).array() * kSubtexelPrecision;
-          if ((abs(sub.array()) > tol).any()) {
-            return false; // error exceeds tolerance
-          }
+    // compute values in center of cell
+    Camera::Vector3 normalized = divide(i, end, 0.5);
+    const Camera::Vector2 xy = unnormalizeXY(normalized, margin);
+    if (!dst.isOutsideImageCircle(xy)) {
+      const float disparity = unnormalizeDisparity(normalized.z());
+      Camera::Vector2 exact;
+      if (src.sees(dst.rig(xy, 1 / disparity), exact)) {
+        // compute sample on either side of normalized along dimension dim
+        normalized[dim] -= 0.5 / end[dim];
+        Entry lo = compute(dst, src, normalized, margin);
+        normalized[dim] += 1.0 / end[dim];
+        Entry hi = compute(dst, src, normalized, margin);
+
+        // does sub-texel precision error exceed tolerance?
+        const float kSubtexelPrecision = 1.0f / 512;
+        Eigen::Array2f sub = (hi - lo).array() * kSubtexelPrecision;
+        if ((abs(sub.array()) > tol).any()) {
+          return false; // error exceeds tolerance
+        }
 
-          // does linear approximation error exceed tolerance?
-          Entry lin = (lo + hi) / 2 - exact.cast<float>();
-          if ((abs(lin.array()) > tol).any()) {
-            return false; // error exceeds tolerance
-          }
+        // does linear approximation error exceed tolerance?
+        Entry lin = (lo + hi) / 2 - exact.cast<float>();
+        if ((abs(lin.array()) > tol).any()) {
+          return false; // error exceeds tolerance
         }
       }
     }
     return true;
   }
 
+  template <typename Dst, typename Src>
   static Entry compute(
-      const Camera& dst,
-      const Camera& src,
+      const Dst& dst,
+      const Src& src,
       const Camera::Vector3& normalized,
       const Camera::Vector2& margin) {
     const Camera::Vector2 xy = unnormalizeXY(normalized, margin);
@@ -14,13 +14,27 @@ namespace fb360_dep {
 
 // a ReprojectionTexture holds the texture created from a ReprojectionTable
 struct ReprojectionTexture {
-  ReprojectionTexture(Camera dst, Camera src) {
+  // cacheDir: see ReprojectionTable::getOrCompute
+  ReprojectionTexture(Camera dst, Camera src, const filesystem::path& cacheDir = "") {
     CHECK(!src.isNormalized()) << "can't compute tolerance";
     // accurate to 3% of a source pixel and covers 5% outside dst
     const Camera::Vector2 tol = 0.03 / src.resolution.array();
     const Camera::Vector2 margin(0.05, 0.05);
     dst.normalize();
     src.normalize();
+    const ReprojectionTable table =
+        ReprojectionTable::getOrCompute(cacheDir, dst, src, tol, margin);
+    texture = createTexture(table);
+    scale = table.getScale();
+    offset = table.getOffset();
+  }
+
+  // dst is already in normalized coordinates, see the generic ReprojectionTable constructor
+  template <typename Dst>
+  ReprojectionTexture(const Dst& dst, Camera src) {
+    const Camera::Vector2 tol = 0.03 / src.resolution.array();
+    const Camera::Vector2 margin(0.05, 0.05);
+    src.normalize();
     ReprojectionTable table(dst, src, tol, margin);
     texture = createTexture(table);
     scale = table.getScale();
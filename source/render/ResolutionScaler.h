@@ -0,0 +1,61 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <glog/logging.h>
+
+namespace fb360_dep {
+
+// Scale of the eye buffer viewport that holds the gpu time of a frame at a target, e.g. below the
+// interval of a 90 Hz headset so that it doesn't fall back to reprojection when many cameras are
+// on screen. Fill dominates the render, so gpu time is taken as proportional to the pixels drawn,
+// i.e. to scale squared. Timings arrive a few frames late (see GpuTimer), so the scale only moves
+// part of the way each frame: quickly down when over the target, slowly back up when under it,
+// and not at all within a deadband around it
+class ResolutionScaler {
+ public:
+  static constexpr float kDeadband = 0.05f; // fraction of targetMs
+  static constexpr float kDownGain = 0.5f;
+  static constexpr float kUpGain = 0.1f;
+
+  ResolutionScaler(const float targetMs, const float minScale, const float maxScale = 1)
+      : targetMs(targetMs), minScale(minScale), maxScale(maxScale), scale(maxScale) {
+    CHECK_GT(targetMs, 0);
+    CHECK_GT(minScale, 0);
+    CHECK_LE(minScale, maxScale);
+  }
+
+  // ms is the gpu time of a recent frame, NAN if none yet (see GpuTimer::getMs), returns the scale
+  // of the next frame
+  float update(const float ms) {
+    if (!(ms > 0)) {
+      return scale;
+    }
+    const float ratio = targetMs / ms;
+    if (std::abs(ratio - 1) > kDeadband) {
+      const float gain = ratio < 1 ? kDownGain : kUpGain;
+      scale = std::max(minScale, std::min(maxScale, scale * std::pow(ratio, 0.5f * gain)));
+    }
+    return scale;
+  }
+
+  float getScale() const {
+    return scale;
+  }
+
+ private:
+  const float targetMs;
+  const float minScale;
+  const float maxScale;
+  float scale;
+};
+
+} // namespace fb360_dep
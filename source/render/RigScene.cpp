@@ -7,8 +7,13 @@
 
 #include "source/render/RigScene.h"
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <glog/logging.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -21,6 +26,7 @@
 #include "source/thirdparty/stb_image.h"
 #pragma GCC diagnostic pop
 
+#include <folly/FileUtil.h>
 #include <folly/Format.h>
 
 namespace fb360_dep {
@@ -53,6 +59,39 @@ void RigScene::createFramebuffers(const int w, const int h) {
   // framebuffer used to accumulate all the cameras
   accumulateFBO = createFramebuffer();
   accumulateTexture = createFramebufferTexture(w, h, GL_RGBA32F);
+  // shared with the camera framebuffer, for blendSubframe
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, cameraDepth);
+}
+
+void RigScene::destroyLayeredFramebuffers() {
+  glDeleteTextures(eyeAccumulateTextures.size(), eyeAccumulateTextures.data());
+  glDeleteFramebuffers(eyeAccumulateFBOs.size(), eyeAccumulateFBOs.data());
+  eyeAccumulateTextures.clear();
+  eyeAccumulateFBOs.clear();
+  glDeleteTextures(1, &layeredDepth);
+  glDeleteTextures(1, &layeredTexture);
+  glDeleteFramebuffers(1, &layeredFBO);
+  layeredFBO = 0; // flag as destroyed
+}
+
+void RigScene::createLayeredFramebuffers(const int w, const int h, const int eyes) {
+  // framebuffer used to render kLayersPerPass cameras, for every eye
+  layeredFBO = createFramebuffer();
+  layeredTexture = createFramebufferTextureArray(w, h, eyes * kLayersPerPass, GL_RGBA16);
+  layeredDepth = createFramebufferDepthTextureArray(w, h, eyes * kLayersPerPass);
+  // framebuffers used to accumulate all the cameras, one per eye
+  for (int eye = 0; eye < eyes; ++eye) {
+    eyeAccumulateFBOs.push_back(createFramebuffer());
+    eyeAccumulateTextures.push_back(createFramebufferTexture(w, h, GL_RGBA32F));
+  }
+  layeredSize = {w, h};
+}
+
+bool RigScene::isLayeredSupported() {
+  // geometry shader instancing
+  GLint major = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  return major >= 4;
 }
 
 void RigScene::createPrograms() {
@@ -211,12 +250,13 @@ void RigScene::createPrograms() {
   const std::string fullscreenVS = R"(
     #version 330 core
 
+    uniform vec2 texScale; // of the viewport in the texture, see fullscreen()
     in vec2 tex;
     out vec2 texVar;
 
     void main() {
       gl_Position = vec4(2 * tex - 1, 0, 1);
-      texVar = tex;
+      texVar = texScale * tex;
     }
   )";
 
@@ -236,6 +276,7 @@ void RigScene::createPrograms() {
     #version 330 core
 
     uniform int debug;
+    uniform bool weighted; // see blendSubframe
     uniform sampler2D sampler;
     in vec2 texVar;
     out vec4 color;
@@ -245,7 +286,8 @@ void RigScene::createPrograms() {
       // alpha is a cone, 1 in the center, epsilon at edges
       const float eps = 1.0f / 255.0f;  // max granularity
       float cone = max(eps, 1 - 2 * length(texVar - 0.5));
-      color.a = cone;
+      // weighted is exponentialFS applied here
+      color.a = weighted ? exp(30 * cone) - 1 : cone;
     }
   )";
 
@@ -253,6 +295,7 @@ void RigScene::createPrograms() {
     #version 330 core
 
     uniform float effect;
+    uniform bool weighted; // see blendSubframe
     uniform sampler2D sampler;
     in vec2 texVar;
     out vec4 color;
@@ -265,7 +308,7 @@ void RigScene::createPrograms() {
         * smoothstep(1/(effect + 0.5), 1/effect, gl_FragCoord.w);
       // alpha is a cone, 1 in the center, 0 at edges
       float cone = max(0, 1 - 2 * length(texVar - 0.5));
-      color.a = cone;
+      color.a = weighted ? exp(30 * cone) - 1 : cone;
     }
   )";
 
@@ -302,9 +345,77 @@ void RigScene::createPrograms() {
   effectMeshProgram = createProgram(cameraMeshVS, effectFS);
   updateProgram = createProgram(fullscreenVS, exponentialFS);
   resolveProgram = createProgram(fullscreenVS, resolveFS);
+
+  if (!isLayeredSupported()) {
+    return;
+  }
+
+  // cameraMeshVS with the transform left to the geometry shader
+  std::string layeredMeshVS = cameraMeshVS;
+  replaceAll(layeredMeshVS, "texVar", "vsTexVar");
+  replaceAll(layeredMeshVS, "transform * ", "");
+  replaceAll(layeredMeshVS, "uniform mat4 transform;", "");
+
+  // sends each triangle to the camera's layer of every eye
+  const std::string layeredGS = R"(
+    #version 400 core
+
+    layout(triangles, invocations = 2) in; // kMaxEyes
+    layout(triangle_strip, max_vertices = 3) out;
+
+    uniform mat4 transforms[2];
+    uniform int eyes;
+    uniform int layer; // of the camera, within an eye's layers
+    uniform int layersPerEye;
+    in vec2 vsTexVar[];
+    out vec2 texVar;
+
+    void main() {
+      if (gl_InvocationID >= eyes) {
+        return;
+      }
+      for (int i = 0; i < 3; ++i) {
+        gl_Layer = gl_InvocationID * layersPerEye + layer;
+        gl_Position = transforms[gl_InvocationID] * gl_in[i].gl_Position;
+        texVar = vsTexVar[i];
+        EmitVertex();
+      }
+      EndPrimitive();
+    }
+  )";
+
+  // exponentialFS for count layers at once, premultiplied for additive blending
+  const std::string accumulateLayersFS = R"(
+    #version 330 core
+
+    uniform sampler2DArray sampler;
+    uniform int first;
+    uniform int count;
+    in vec2 texVar;
+    out vec4 color;
+
+    void main() {
+      color = vec4(0);
+      for (int i = 0; i < count; ++i) {
+        vec4 layer = texture(sampler, vec3(texVar, first + i));
+        float weight = exp(30 * layer.a) - 1;
+        color += vec4(weight * layer.rgb, weight);
+      }
+    }
+  )";
+
+  layeredMeshProgram = createProgram(layeredMeshVS, layeredGS, cameraFS);
+  accumulateLayersProgram = createProgram(fullscreenVS, accumulateLayersFS);
+  // subframe vertex arrays are set up with cameraMeshProgram's location
+  CHECK_EQ(
+      getAttribLocation(layeredMeshProgram, "abc"), getAttribLocation(cameraMeshProgram, "abc"));
 }
 
 void RigScene::destroyPrograms() {
+  if (layeredMeshProgram) {
+    glDeleteProgram(accumulateLayersProgram);
+    glDeleteProgram(layeredMeshProgram);
+  }
   glDeleteProgram(resolveProgram);
   glDeleteProgram(updateProgram);
   glDeleteProgram(effectMeshProgram);
@@ -338,35 +449,12 @@ static MatrixDepth fakePfm(const int width, const int height, const float depth)
   return MatrixDepth::Constant(height, width, depth);
 }
 
-// glDeleteTextures appears to be slow. recycle
-static bool kRecycle = true;
-static std::vector<GLuint> recycledTextures;
+// glDeleteTextures appears to be slow, and creating and deleting a frame's objects fragments
+// driver memory, so they are recycled through the pool
+GpuResourcePool RigScene::resourcePool;
 
 void recycleTexture(const GLuint texture) {
-  if (texture != 0) { // glDeleteTexture silently ignores 0
-    if (kRecycle) {
-      recycledTextures.push_back(texture);
-    } else {
-      glDeleteTextures(1, &texture);
-    }
-  }
-}
-
-GLuint bindRecycledTexture() {
-  if (recycledTextures.empty()) {
-    return createTexture();
-  }
-  GLuint result = recycledTextures.back();
-  recycledTextures.pop_back();
-  glBindTexture(GL_TEXTURE_2D, result);
-  return result;
-}
-
-void emptyRecycling() {
-  while (!recycledTextures.empty()) {
-    glDeleteTextures(1, &recycledTextures.back());
-    recycledTextures.pop_back();
-  }
+  RigScene::resourcePool.releaseTexture(texture);
 }
 
 static GLuint linearTexture2D(
@@ -376,17 +464,22 @@ static GLuint linearTexture2D(
     const GLenum srcformat, // GL_RGBA, for example
     const GLenum srctype, // GL_UNSIGNED_BYTE, for example
     const GLvoid* data) {
-  GLuint result = bindRecycledTexture();
-  glTexImage2D(
-      GL_TEXTURE_2D,
-      0, // level
-      dstformat,
-      width,
-      height,
-      0, // border
-      srcformat,
-      srctype,
-      data);
+  bool isReused;
+  GLuint result = RigScene::resourcePool.acquireTexture(width, height, dstformat, isReused);
+  if (isReused) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, srcformat, srctype, data);
+  } else {
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0, // level
+        dstformat,
+        width,
+        height,
+        0, // border
+        srcformat,
+        srctype,
+        data);
+  }
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -400,16 +493,22 @@ static GLuint linearCompressedTexture2D(
     const GLenum format, // GL_COMPRESSED_RGBA_BPTC_UNORM, for example
     const GLvoid* data,
     const size_t size) {
-  GLuint result = bindRecycledTexture();
-  glCompressedTexImage2D(
-      GL_TEXTURE_2D,
-      0, // level
-      format,
-      width,
-      height,
-      0, // border
-      GLsizei(size),
-      data);
+  bool isReused;
+  GLuint result = RigScene::resourcePool.acquireTexture(width, height, format, isReused);
+  if (isReused) {
+    glCompressedTexSubImage2D(
+        GL_TEXTURE_2D, 0, 0, 0, width, height, format, GLsizei(size), data);
+  } else {
+    glCompressedTexImage2D(
+        GL_TEXTURE_2D,
+        0, // level
+        format,
+        width,
+        height,
+        0, // border
+        GLsizei(size),
+        data);
+  }
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -479,15 +578,6 @@ static GLuint fakeTexture(const MatrixDepth& depth, const Camera& camera) {
       fake.data());
 }
 
-template <typename T>
-static void debugSaveBinary(const std::string& filename, const T& data) {
-  const bool kSaveBinaries = false;
-  if (kSaveBinaries) {
-    std::ofstream file(filename, std::ios::binary);
-    file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(data[0]));
-  }
-}
-
 static GLuint loadImageTexture(const std::string& filename) {
   // load color from an image file as 4 channels (rgba) per pixel
   const int kDstChannels = 4;
@@ -497,10 +587,6 @@ static GLuint loadImageTexture(const std::string& filename) {
     return 0;
   }
 
-  using VectorXb = Eigen::Matrix<uint8_t, Eigen::Dynamic, 1>;
-  debugSaveBinary(
-      boost::filesystem::path(filename).replace_extension(".rgba").string(),
-      Eigen::Map<VectorXb>(data, width * height * kDstChannels));
   // hand it to opengl
   GLuint result = linearTexture2D(width, height, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, data);
   // clean up and return
@@ -508,6 +594,18 @@ static GLuint loadImageTexture(const std::string& filename) {
   return result;
 }
 
+static bool hasExtension(const char* name) {
+  GLint count;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (GLint i = 0; i < count; ++i) {
+    const char* ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+    if (strstr(ext, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static bool isBC7Supported() {
   static bool cacheValid = false;
   static bool cache = false;
@@ -516,13 +614,7 @@ static bool isBC7Supported() {
   }
   GLint count;
   glGetIntegerv(GL_NUM_EXTENSIONS, &count);
-  for (GLint i = 0; i < count; ++i) {
-    const char* ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
-    if (strstr(ext, "texture_compression_bptc")) {
-      cache = true;
-      break;
-    }
-  }
+  cache = hasExtension("texture_compression_bptc");
   if (cacheValid) {
     return cache;
   }
@@ -541,6 +633,75 @@ static bool isBC7Supported() {
   return cache;
 }
 
+// ASTC LDR, e.g. mobile and standalone headset gpus
+static bool isASTCSupported() {
+  static const bool cache = hasExtension("texture_compression_astc");
+  return cache;
+}
+
+#ifndef GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR
+#define GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR 0x93D0
+#define GL_COMPRESSED_SRGB8_ALPHA8_ASTC_5x5_KHR 0x93D2
+#define GL_COMPRESSED_SRGB8_ALPHA8_ASTC_6x6_KHR 0x93D4
+#define GL_COMPRESSED_SRGB8_ALPHA8_ASTC_8x8_KHR 0x93D7
+#endif
+
+// .astc files are raw 16 byte blocks (see bc7_util::compressASTCToBuffer), the block size of a
+// w x h image follows from its size
+static GLenum getASTCFormat(const int w, const int h, const uint64_t size) {
+  const std::pair<int, GLenum> kFormats[] = {
+      {4, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR},
+      {5, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_5x5_KHR},
+      {6, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_6x6_KHR},
+      {8, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_8x8_KHR}};
+  for (const auto& format : kFormats) {
+    const uint64_t blocksX = (w + format.first - 1) / format.first;
+    const uint64_t blocksY = (h + format.first - 1) / format.first;
+    if (blocksX * blocksY * 16 == size) {
+      return format.second;
+    }
+  }
+  CHECK(false) << folly::sformat("{} bytes is not a {}x{} astc image", size, w, h);
+  return 0;
+}
+
+std::string RigScene::getColorExtension(const bool hasAstc, const bool hasBc7) {
+  if (hasAstc && isASTCSupported()) {
+    return ".astc";
+  }
+  if (hasBc7 && isBC7Supported()) {
+    return ".bc7";
+  }
+  return ".rgba";
+}
+
+std::string RigScene::getColorExtension(const folly::dynamic& layout) {
+  auto has = [&](const char* extension) {
+    return layout.find(extension) != layout.items().end();
+  };
+  return getColorExtension(has(".astc"), has(".bc7"));
+}
+
+GLuint RigScene::createColorTexture(const int width, const int height, const uint8_t* rgba) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // rgba is client memory, not an offset into a PBO
+  return linearTexture2D(width, height, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+}
+
+RigScene::SubframeLayout RigScene::getSubframeLayout(const folly::dynamic& layout) {
+  SubframeLayout result;
+  result.colorExtension = getColorExtension(layout);
+  if (const folly::dynamic* color = layout.get_ptr(result.colorExtension)) {
+    result.colorOffset = (*color)["offset"].getInt();
+    result.colorSize = (*color)["size"].getInt();
+  } else {
+    result.colorExtension = "";
+  }
+  result.vtxOffset = layout[".vtx"]["offset"].getInt();
+  result.idxOffset = layout[".idx"]["offset"].getInt();
+  result.idxSize = layout[".idx"]["size"].getInt();
+  return result;
+}
+
 static void read32(uint32_t& dst, std::ifstream& file) {
   file.read((char*)&dst, sizeof(uint32_t));
 }
@@ -612,7 +773,6 @@ static GLuint loadDdsTexture(const std::string& filename) {
   // read the bytes
   std::vector<uint8_t> compressed(size);
   file.read((char*)compressed.data(), compressed.size());
-  debugSaveBinary(boost::filesystem::path(filename).replace_extension(".bc7").string(), compressed);
   // hand it to opengl
   return linearCompressedTexture2D(width, height, glFormat, compressed.data(), compressed.size());
 }
@@ -643,49 +803,28 @@ static MatrixDepth downscale(const MatrixDepth& hires, const int factor) {
 
 static RigScene::Subframe createMeshSubframe(
     const std::string& imagePrefix,
-    const std::string& depthPrefix,
+    const Eigen::Vector3f* vertexes,
+    const size_t vertexCount,
+    const Eigen::Vector3i* faces,
+    const size_t faceCount,
     const GLuint program) {
   RigScene::Subframe subframe;
   subframe.vertexArray = createVertexArray();
-  // read .obj file
-  std::vector<Eigen::Vector3f> vertexes;
-  std::vector<Eigen::Vector3i> faces;
-  std::string depth = depthPrefix + ".obj";
-  std::ifstream file(depth);
-  CHECK(file) << "can't open " << depth;
-  while (file) {
-    std::string first;
-    file >> first;
-    if (first == "v") {
-      Eigen::Vector3f v;
-      file >> v.x() >> v.y() >> v.z();
-      vertexes.push_back(v);
-    } else if (first == "f") {
-      Eigen::Vector3i f;
-      file >> f.x() >> f.y() >> f.z();
-      f -= f.Constant(1); // first vertex in an .obj file is 1
-      faces.push_back(f);
-    }
-    std::string skip;
-    getline(file, skip); // skip rest of line
-  }
-  debugSaveBinary(imagePrefix + ".vtx", vertexes);
-  debugSaveBinary(imagePrefix + ".idx", faces);
   // pass vertexes and faces to opengl
-  GLuint meshVBO = createVertexAttributes(getAttribLocation(program, "abc"), vertexes);
-  GLuint meshIBO = createBuffer(GL_ELEMENT_ARRAY_BUFFER, faces);
-  subframe.indexCount = 3 * static_cast<GLsizei>(faces.size());
+  GLuint meshVBO = createVertexAttributes(getAttribLocation(program, "abc"), vertexes, vertexCount);
+  GLuint meshIBO = createBuffer(GL_ELEMENT_ARRAY_BUFFER, faces, faceCount);
+  subframe.indexCount = 3 * static_cast<GLsizei>(faceCount);
   Eigen::Vector3f maximum(0, 0, 0);
-  for (const Eigen::Vector3f& v : vertexes) {
-    maximum = maximum.cwiseMax(v);
+  for (size_t i = 0; i < vertexCount; ++i) {
+    maximum = maximum.cwiseMax(vertexes[i]);
   }
   subframe.size = {maximum.x() + 0.5f, maximum.y() + 0.5f};
   LOG(INFO) << folly::sformat(
       "loaded {}x{} mesh, {} vertexes, {} faces",
       subframe.size.x(),
       subframe.size.y(),
-      vertexes.size(),
-      faces.size());
+      vertexCount,
+      faceCount);
   // load color
   subframe.colorTexture = loadTexture(imagePrefix);
   // clean up buffers
@@ -696,6 +835,72 @@ static RigScene::Subframe createMeshSubframe(
   return subframe;
 }
 
+// reads the v and f lines of an .obj file, ignoring texture coordinate indexes
+static void readObj(
+    std::vector<Eigen::Vector3f>& vertexes,
+    std::vector<Eigen::Vector3i>& faces,
+    const std::string& filename) {
+  std::string contents;
+  CHECK(folly::readFile(filename.c_str(), contents)) << "can't open " << filename;
+  const char* p = contents.c_str();
+  while (*p) {
+    char* end;
+    if (p[0] == 'v' && p[1] == ' ') {
+      Eigen::Vector3f v;
+      for (int i = 0; i < v.size(); ++i) {
+        v[i] = std::strtof(p + 1, &end);
+        p = end - 1;
+      }
+      vertexes.push_back(v);
+    } else if (p[0] == 'f' && p[1] == ' ') {
+      Eigen::Vector3i f;
+      for (int i = 0; i < f.size(); ++i) {
+        f[i] = std::strtol(p + 1, &end, 10) - 1; // first vertex in an .obj file is 1
+        p = end - 1;
+        while (p[1] && !std::isspace(p[1])) {
+          ++p; // skip /texture index
+        }
+      }
+      faces.push_back(f);
+    }
+    p = std::strchr(p, '\n'); // skip rest of line
+    if (!p) {
+      break;
+    }
+    ++p;
+  }
+}
+
+static RigScene::Subframe createMeshSubframe(
+    const std::string& imagePrefix,
+    const std::string& depthPrefix,
+    const GLuint program) {
+  // .vtx and .idx files, as written by ConvertToBinary, are already laid out as opengl wants them
+  const std::string vtx = depthPrefix + ".vtx";
+  const std::string idx = depthPrefix + ".idx";
+  if (boost::filesystem::exists(vtx) && boost::filesystem::exists(idx)) {
+    CHECK_GT(boost::filesystem::file_size(vtx), 0) << "empty mesh " << vtx;
+    CHECK_GT(boost::filesystem::file_size(idx), 0) << "empty mesh " << idx;
+    const boost::interprocess::file_mapping vtxFile(vtx.c_str(), boost::interprocess::read_only);
+    const boost::interprocess::mapped_region vertexes(vtxFile, boost::interprocess::read_only);
+    const boost::interprocess::file_mapping idxFile(idx.c_str(), boost::interprocess::read_only);
+    const boost::interprocess::mapped_region faces(idxFile, boost::interprocess::read_only);
+    return createMeshSubframe(
+        imagePrefix,
+        static_cast<const Eigen::Vector3f*>(vertexes.get_address()),
+        vertexes.get_size() / sizeof(Eigen::Vector3f),
+        static_cast<const Eigen::Vector3i*>(faces.get_address()),
+        faces.get_size() / sizeof(Eigen::Vector3i),
+        program);
+  }
+
+  std::vector<Eigen::Vector3f> vertexes;
+  std::vector<Eigen::Vector3i> faces;
+  readObj(vertexes, faces, depthPrefix + ".obj");
+  return createMeshSubframe(
+      imagePrefix, vertexes.data(), vertexes.size(), faces.data(), faces.size(), program);
+}
+
 static RigScene::Subframe createPointCloudSubframeFromMemory(
     const GLuint texture,
     MatrixDepth& depthMap,
@@ -753,19 +958,38 @@ RigScene::Subframe RigScene::createSubframe(
     const Camera& camera,
     const GLuint buffer,
     const uint64_t offset,
-    const folly::dynamic& layout) const {
+    const SubframeLayout& layout,
+    const bool deleteBuffer,
+    const GLuint colorTexture) const {
+  Subframe subframe = uploadSubframe(camera, buffer, offset, layout, deleteBuffer, colorTexture);
+  bindSubframe(subframe);
+  return subframe;
+}
+
+RigScene::Subframe RigScene::uploadSubframe(
+    const Camera& camera,
+    const GLuint buffer,
+    const uint64_t offset,
+    const SubframeLayout& layout,
+    const bool deleteBuffer,
+    const GLuint colorTexture) const {
   Subframe subframe;
-  subframe.vertexArray = createVertexArray();
   const int w(static_cast<int>(camera.resolution.x()));
   const int h(static_cast<int>(camera.resolution.y()));
   // PBO for color
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
-  if (isBC7Supported()) {
+  GLvoid* const color = (GLvoid*)(layout.colorOffset - offset);
+  if (colorTexture) {
+    subframe.colorTexture = colorTexture;
+  } else if (layout.colorExtension == ".astc") {
+    subframe.colorTexture = linearCompressedTexture2D(
+        w, h, getASTCFormat(w, h, layout.colorSize), color, layout.colorSize);
+  } else if (layout.colorExtension == ".bc7") {
     subframe.colorTexture = linearCompressedTexture2D(
         w,
         h,
         GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM,
-        (GLvoid*)(layout[".bc7"]["offset"].getInt() - offset),
+        color,
         w * h); // bc7 is 1 byte/pixel
   } else {
     subframe.colorTexture = linearTexture2D(
@@ -774,24 +998,45 @@ RigScene::Subframe RigScene::createSubframe(
         GL_SRGB8_ALPHA8,
         GL_RGBA,
         GL_UNSIGNED_BYTE,
-        (GLvoid*)(layout[".rgba"]["offset"].getInt() - offset));
+        color);
   }
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  subframe.meshBuffer = buffer;
+  subframe.vertexOffset = (GLvoid*)(layout.vtxOffset - offset);
+  subframe.indexCount = static_cast<GLsizei>(layout.idxSize / sizeof(uint32_t));
+  subframe.indexOffset = (GLvoid*)(layout.idxOffset - offset);
+  subframe.size = {w, h};
+  if (deleteBuffer) {
+    subframe.buffer = buffer; // released with the frame
+  }
+  return subframe;
+}
+
+void RigScene::bindSubframe(Subframe& subframe) const {
+  subframe.vertexArray = resourcePool.acquireVertexArray();
   // VBO for vertexes
-  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, subframe.meshBuffer);
   GLint location = getAttribLocation(cameraMeshProgram, "abc");
-  glVertexAttribPointer(
-      location, 3, GL_FLOAT, GL_TRUE, 0, (GLvoid*)(layout[".vtx"]["offset"].getInt() - offset));
+  glVertexAttribPointer(location, 3, GL_FLOAT, GL_TRUE, 0, subframe.vertexOffset);
   glEnableVertexAttribArray(location);
   // IBO for indexes
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
-  subframe.indexCount = static_cast<GLsizei>(layout[".idx"]["size"].getInt() / sizeof(uint32_t));
-  subframe.indexOffset = (GLvoid*)(layout[".idx"]["offset"].getInt() - offset);
-  subframe.size = {w, h};
-  // unbind vertex array before deleting buffer so vertex array keeps it alive
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, subframe.meshBuffer);
   glBindVertexArray(0);
-  glDeleteBuffers(1, &buffer);
-  return subframe;
+}
+
+void RigScene::bindFrame(std::vector<Subframe>& subframes) const {
+  for (Subframe& subframe : subframes) {
+    if (subframe.isValid() && subframe.vertexArray == 0) {
+      bindSubframe(subframe);
+    }
+  }
+}
+
+void RigScene::releaseVertexArrays(std::vector<Subframe>& subframes) const {
+  for (Subframe& subframe : subframes) {
+    resourcePool.releaseVertexArray(subframe.vertexArray);
+    subframe.vertexArray = 0;
+  }
 }
 
 RigScene::Subframe RigScene::createSubframe(
@@ -839,25 +1084,31 @@ RigScene::Subframe RigScene::createPointCloudSubframeFromData(
 void RigScene::destroyFrame(std::vector<Subframe>& subframes) const {
   for (Subframe& subframe : subframes) {
     recycleTexture(subframe.colorTexture);
-    glDeleteVertexArrays(1, &subframe.vertexArray);
+    resourcePool.releaseVertexArray(subframe.vertexArray);
+    resourcePool.releaseBuffer(subframe.buffer);
   }
   subframes.clear();
 }
 
 GLuint RigScene::createDirection(const Camera& camera) {
   // create direction texture that tabelizes the rig() function
-  std::vector<Eigen::Vector3f> directions;
+  std::vector<Camera::Vector2> pixels;
   for (int y = 0; y < kDirections; ++y) {
     for (int x = 0; x < kDirections; ++x) {
       Camera::Vector2 c(x, y);
-      Camera::Vector2 pixel = c.cwiseProduct(camera.resolution) / (kDirections - 1);
-      Camera::Vector3 direction = camera.rig(pixel).direction();
-      if (isDepthZCoord) {
-        Camera::Real factor = -camera.pixelToCamera(pixel).z();
-        direction /= factor;
-      }
-      directions.push_back(direction.cast<float>());
+      pixels.push_back(c.cwiseProduct(camera.resolution) / (kDirections - 1));
+    }
+  }
+  const std::vector<Camera::Vector3> rigs = camera.rigs(pixels, 1);
+  std::vector<Eigen::Vector3f> directions;
+  for (const Camera::Vector3& rig : rigs) {
+    Camera::Vector3 direction = rig - camera.position;
+    if (isDepthZCoord) {
+      // z of the unit vector in camera space, same as -pixelToCamera(pixel).z()
+      Camera::Real factor = -(camera.rotation * direction).z();
+      direction /= factor;
     }
+    directions.push_back(direction.cast<float>());
   }
   return linearTexture2D(kDirections, kDirections, GL_RGB32F, GL_RGB, GL_FLOAT, directions.data());
 }
@@ -869,6 +1120,16 @@ void RigScene::fullscreen(GLuint program, GLuint texture, GLuint target) {
   static const int kUnit = 0;
   connectUnitWithTextureAndUniform(kUnit, target, texture, program, "sampler");
 
+  // the framebuffers may be larger than the viewport, e.g. with dynamic resolution, in which case
+  // the viewport's corner of texture is drawn
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  GLint width;
+  glGetTexLevelParameteriv(target, 0, GL_TEXTURE_WIDTH, &width);
+  GLint height;
+  glGetTexLevelParameteriv(target, 0, GL_TEXTURE_HEIGHT, &height);
+  setUniform(program, "texScale", viewport[2] / float(width), viewport[3] / float(height));
+
   GLuint vertexArray = createVertexArray();
   const std::vector<Eigen::Vector2f> tex{
       {0, 0},
@@ -895,14 +1156,12 @@ GLuint RigScene::getProgram() const {
   return cameraProgram;
 }
 
-void RigScene::renderSubframe(const int subframeIndex, const bool wireframe) const {
+void RigScene::setCameraUniforms(const GLuint program, const int subframeIndex) const {
   CHECK(subframeIndex < int(subframes.size()));
   const RigScene::Subframe& subframe = subframes[subframeIndex];
   const Camera& camera = rig[subframeIndex];
   const GLuint directionTexture = directionTextures[subframeIndex];
 
-  GLuint program = getProgram();
-  glUseProgram(program);
   // send camera position to gl
   Eigen::Vector3f position = camera.position.cast<float>();
   glUniform3fv(getUniformLocation(program, "camera"), 1, position.data());
@@ -917,6 +1176,38 @@ void RigScene::renderSubframe(const int subframeIndex, const bool wireframe) con
   // activate color texture for this camera
   const int kColorUnit = 1;
   connectUnitWith2DTextureAndUniform(kColorUnit, subframe.colorTexture, program, "sampler");
+}
+
+// draws the mesh of a camera, and its background if any, with the camera's uniforms set
+void RigScene::drawMesh(const GLuint program, const int subframeIndex) const {
+  const RigScene::Subframe& subframe = subframes[subframeIndex];
+  const Camera& camera = rig[subframeIndex];
+  glBindVertexArray(subframe.vertexArray);
+  float focalR = static_cast<float>(camera.getScalarFocal() * kR);
+  setUniform(program, "focalR", focalR);
+  setUniform(program, "forceMono", forceMono);
+  glDrawElements(GL_TRIANGLES, subframe.indexCount, GL_UNSIGNED_INT, subframe.indexOffset);
+
+  if (!backgroundSubframes.empty() && renderBackground) {
+    const RigScene::Subframe& backgroundSubframe = backgroundSubframes[subframeIndex];
+    const int kBackgroundColorUnit = 2;
+    connectUnitWith2DTextureAndUniform(
+        kBackgroundColorUnit, backgroundSubframe.colorTexture, program, "sampler");
+    glBindVertexArray(backgroundSubframe.vertexArray);
+    glDrawElements(
+        GL_TRIANGLES,
+        backgroundSubframe.indexCount,
+        GL_UNSIGNED_INT,
+        backgroundSubframe.indexOffset);
+  }
+}
+
+void RigScene::renderSubframe(const int subframeIndex, const bool wireframe) const {
+  CHECK(subframeIndex < int(subframes.size()));
+  const RigScene::Subframe& subframe = subframes[subframeIndex];
+  GLuint program = getProgram();
+  glUseProgram(program);
+  setCameraUniforms(program, subframeIndex);
   // activate vertex array for this camera
   glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
   glBindVertexArray(subframe.vertexArray);
@@ -925,23 +1216,7 @@ void RigScene::renderSubframe(const int subframeIndex, const bool wireframe) con
     if (effect != 0) {
       setUniform(program, "effect", effect);
     }
-    float focalR = static_cast<float>(camera.getScalarFocal() * kR);
-    setUniform(program, "focalR", focalR);
-    setUniform(program, "forceMono", forceMono);
-    glDrawElements(GL_TRIANGLES, subframe.indexCount, GL_UNSIGNED_INT, subframe.indexOffset);
-
-    if (!backgroundSubframes.empty() && renderBackground) {
-      const RigScene::Subframe& backgroundSubframe = backgroundSubframes[subframeIndex];
-      const int kBackgroundColorUnit = 2;
-      connectUnitWith2DTextureAndUniform(
-          kBackgroundColorUnit, backgroundSubframe.colorTexture, program, "sampler");
-      glBindVertexArray(backgroundSubframe.vertexArray);
-      glDrawElements(
-          GL_TRIANGLES,
-          backgroundSubframe.indexCount,
-          GL_UNSIGNED_INT,
-          backgroundSubframe.indexOffset);
-    }
+    drawMesh(program, subframeIndex);
   } else {
     setUniform(program, "modulo", subframe.size.x());
     glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, subframe.size.prod());
@@ -955,7 +1230,7 @@ GLint RigScene::clearAccumulation() {
   // save the currently bound framebuffer
   GLint result;
   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &result);
-  // destroy existing framebuffers if they're the wrong size
+  // destroy existing framebuffers if they're too small, larger ones are drawn in part
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
   const int w = viewport[2];
@@ -966,7 +1241,7 @@ GLint RigScene::clearAccumulation() {
     glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &cw);
     int ch;
     glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &ch);
-    if (cw != w || ch != h) {
+    if (cw < w || ch < h) {
       destroyFramebuffers();
     }
   }
@@ -997,6 +1272,30 @@ void RigScene::updateAccumulation() const {
   glDisable(GL_BLEND);
 }
 
+void RigScene::blendSubframe(const int subframeIndex, const bool wireframe) const {
+  glBindFramebuffer(GL_FRAMEBUFFER, accumulateFBO);
+  CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  // depth only, finds the camera's nearest surface like renderSubframe into the camera buffer
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  renderSubframe(subframeIndex, wireframe);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+  // blend the nearest surface only, with the weights and blend equations of updateAccumulation
+  const GLuint program = getProgram();
+  glUseProgram(program);
+  setUniform(program, "weighted", true);
+  glDepthMask(GL_FALSE);
+  glDepthFunc(GL_LEQUAL);
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE, GL_ONE, GL_ONE);
+  renderSubframe(subframeIndex, wireframe);
+  glDisable(GL_BLEND);
+  glDepthFunc(GL_LESS);
+  glDepthMask(GL_TRUE);
+  setUniform(program, "weighted", false);
+}
+
 void RigScene::resolveAccumulation(GLint fbo, float fade) const {
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
   glUseProgram(resolveProgram);
@@ -1027,8 +1326,11 @@ isVisible(const Camera& camera, const Camera::Vector2& frac, const Eigen::Matrix
       clip.y() < clip.w();
 }
 
-static bool isVisible(const Camera& camera, const Eigen::Matrix4f& transform) {
+// fraction of the samples along the edges and inside of camera that are on screen
+static float computeVisibility(const Camera& camera, const Eigen::Matrix4f& transform) {
   const int kIntervalsPerEdge = 3;
+  int samples = 0;
+  int visible = 0;
   for (int y = 0; y <= kIntervalsPerEdge; ++y) {
     for (int x = 0; x <= kIntervalsPerEdge; ++x) {
       if (y == 0 || y == kIntervalsPerEdge) {
@@ -1038,12 +1340,28 @@ static bool isVisible(const Camera& camera, const Eigen::Matrix4f& transform) {
       }
       Camera::Vector2 frac(
           x / Camera::Real(kIntervalsPerEdge), y / Camera::Real(kIntervalsPerEdge));
+      ++samples;
       if (isVisible(camera, frac, transform)) {
-        return true;
+        ++visible;
       }
     }
   }
-  return false;
+  return visible / float(samples);
+}
+
+// 1 until kBeginFade meters from the center of the headbox, then ramp down to kMinimumFade at
+// kEndFade
+static float getFade(const float displacementMeters) {
+  const float kBeginFade = 0.5f;
+  const float kEndFade = 0.75f;
+  const float kMinimumFade = 0.05f;
+  return kMinimumFade +
+      (1.0f - kMinimumFade) *
+          std::max(0.0f, std::min(1.0f, (displacementMeters - kEndFade) / (kBeginFade - kEndFade)));
+}
+
+float RigScene::getVisibility(const Camera& camera, const Eigen::Matrix4f& projview) {
+  return computeVisibility(camera, computeTransform(projview));
 }
 
 void RigScene::render(
@@ -1055,36 +1373,146 @@ void RigScene::render(
   updateTransform(transform);
   GLint fbo = clearAccumulation();
   culled.resize(rig.size());
+  visibility.resize(rig.size());
   for (int i = 0; i < int(rig.size()); ++i) {
-    culled[i] = doCulling && !isVisible(rig[i], transform);
+    visibility[i] = computeVisibility(rig[i], transform);
+    culled[i] = doCulling && visibility[i] == 0;
 
     if (i < int(subframes.size()) && subframes[i].isValid() && !culled[i]) {
-      clearSubframe();
-      renderSubframe(i, wireframe);
-      updateAccumulation();
+      if (directBlend) {
+        blendSubframe(i, wireframe);
+      } else {
+        clearSubframe();
+        renderSubframe(i, wireframe);
+        updateAccumulation();
+      }
     }
   }
-  const float kBeginFade = 0.5f;
-  const float kEndFade = 0.75f;
-  const float kMinimumFade = 0.05f;
-  // 0 until kBeginFade, then ramp down do kMinimumFade at kEndFade
-  const float fade = kMinimumFade +
-      (1.0f - kMinimumFade) *
-          std::max(0.0f, std::min(1.0f, (displacementMeters - kEndFade) / (kBeginFade - kEndFade)));
+  const float fade = getFade(displacementMeters);
   resolveAccumulation(fbo, fade * fade); // square to die off faster
   CHECK_EQ(glGetError(), GL_NO_ERROR);
 }
 
+void RigScene::renderLayered(
+    const Matrix4fVector& projviews,
+    const bool doCulling,
+    const bool wireframe) {
+  CHECK(layeredMeshProgram) << "layered rendering is not supported";
+  CHECK(useMesh && effect == 0) << "layered rendering draws plain meshes only";
+  const int eyes = projviews.size();
+  CHECK_GE(eyes, 1);
+  CHECK_LE(eyes, kMaxEyes);
+
+  // save the currently bound framebuffer and viewport, which sizes the framebuffers
+  GLint fbo;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fbo);
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  const Eigen::Vector2i size(viewport[2], viewport[3]);
+  // larger framebuffers are drawn in part
+  if (layeredFBO != 0 &&
+      (layeredSize.x() < size.x() || layeredSize.y() < size.y() ||
+       int(eyeAccumulateFBOs.size()) != eyes)) {
+    destroyLayeredFramebuffers();
+  }
+  if (layeredFBO == 0) {
+    createLayeredFramebuffers(size.x(), size.y(), eyes);
+  }
+  glViewport(0, 0, size.x(), size.y());
+
+  // cameras on screen for any eye
+  Matrix4fVector transforms;
+  for (const Eigen::Matrix4f& projview : projviews) {
+    transforms.push_back(computeTransform(projview));
+  }
+  culled.resize(rig.size());
+  visibility.resize(rig.size());
+  std::vector<int> cameras;
+  for (int i = 0; i < int(rig.size()); ++i) {
+    visibility[i] = 0;
+    for (const Eigen::Matrix4f& transform : transforms) {
+      visibility[i] = std::max(visibility[i], computeVisibility(rig[i], transform));
+    }
+    culled[i] = doCulling && visibility[i] == 0;
+    if (i < int(subframes.size()) && subframes[i].isValid() && !culled[i]) {
+      cameras.push_back(i);
+    }
+  }
+
+  for (const GLuint eyeAccumulateFBO : eyeAccumulateFBOs) {
+    glBindFramebuffer(GL_FRAMEBUFFER, eyeAccumulateFBO);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+  glEnable(GL_FRAMEBUFFER_SRGB);
+
+  for (int begin = 0; begin < int(cameras.size()); begin += kLayersPerPass) {
+    const int count = std::min(kLayersPerPass, int(cameras.size()) - begin);
+
+    // draw each camera into its layer of every eye
+    glBindFramebuffer(GL_FRAMEBUFFER, layeredFBO);
+    CHECK_EQ(glCheckFramebufferStatus(GL_FRAMEBUFFER), GL_FRAMEBUFFER_COMPLETE);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glUseProgram(layeredMeshProgram);
+    glUniformMatrix4fv(
+        getUniformLocation(layeredMeshProgram, "transforms"),
+        eyes,
+        GL_FALSE,
+        transforms[0].data());
+    setUniform(layeredMeshProgram, "eyes", eyes);
+    setUniform(layeredMeshProgram, "layersPerEye", kLayersPerPass);
+    glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
+    glEnable(GL_DEPTH_TEST);
+    for (int layer = 0; layer < count; ++layer) {
+      setUniform(layeredMeshProgram, "layer", layer);
+      setCameraUniforms(layeredMeshProgram, cameras[begin + layer]);
+      drawMesh(layeredMeshProgram, cameras[begin + layer]);
+    }
+    glDisable(GL_DEPTH_TEST);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+    // add the layers to each eye's accumulation, weights are premultiplied by the shader
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glUseProgram(accumulateLayersProgram);
+    setUniform(accumulateLayersProgram, "count", count);
+    for (int eye = 0; eye < eyes; ++eye) {
+      glBindFramebuffer(GL_FRAMEBUFFER, eyeAccumulateFBOs[eye]);
+      setUniform(accumulateLayersProgram, "first", eye * kLayersPerPass);
+      fullscreen(accumulateLayersProgram, layeredTexture, GL_TEXTURE_2D_ARRAY);
+    }
+    glDisable(GL_BLEND);
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  CHECK_EQ(glGetError(), GL_NO_ERROR);
+}
+
+void RigScene::resolveLayered(const int eye, const float displacementMeters) const {
+  CHECK_LT(eye, int(eyeAccumulateTextures.size())) << "renderLayered first";
+  glUseProgram(resolveProgram);
+  const float fade = getFade(displacementMeters);
+  setUniform(resolveProgram, "fade", fade * fade); // square to die off faster
+  fullscreen(resolveProgram, eyeAccumulateTextures[eye]);
+  CHECK_EQ(glGetError(), GL_NO_ERROR);
+}
+
 RigScene::~RigScene() {
   if (cameraFBO) { // framebuffers are created lazily
     destroyFramebuffers();
   }
+  if (layeredFBO) {
+    destroyLayeredFramebuffers();
+  }
   destroyFrame(subframes);
   for (const GLuint& texture : directionTextures) {
     recycleTexture(texture);
   }
   destroyPrograms();
-  emptyRecycling();
+  LOG(INFO) << "gpu resource pool: " << resourcePool.getStats().toString();
+  resourcePool.clear();
 }
 
 RigScene::RigScene(const Camera::Rig& rig, const bool useMesh, const bool isDepthZCoord)
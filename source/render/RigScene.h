@@ -12,12 +12,15 @@
 #include <boost/filesystem.hpp>
 
 #include "source/gpu/GlUtil.h"
+#include "source/gpu/GpuResourcePool.h"
 #include "source/render/AsyncLoader.h"
 #include "source/util/Camera.h"
 
 namespace fb360_dep {
 
 using MatrixDepth = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+// std::vector of fixed-size eigen types needs an aligned allocator before c++17
+using Matrix4fVector = std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>;
 
 struct RigScene {
   explicit RigScene(
@@ -65,8 +68,19 @@ struct RigScene {
   GLuint accumulateFBO;
   GLuint accumulateTexture;
 
+  // see renderLayered
+  GLuint layeredMeshProgram = 0; // 0 if not supported
+  GLuint accumulateLayersProgram = 0;
+  GLuint layeredFBO = 0; // created lazily
+  GLuint layeredTexture;
+  GLuint layeredDepth;
+  std::vector<GLuint> eyeAccumulateFBOs;
+  std::vector<GLuint> eyeAccumulateTextures;
+  Eigen::Vector2i layeredSize;
+
   bool forceMono = false; // used for demos to illustrate difference with 6dof
   bool renderBackground = true; // render separate background if available
+  bool directBlend = false; // render() blends cameras into the accumulation, see blendSubframe
   GLint debug = 0; // flags for debugging
   float effect = 0; // effect parameters
   bool isDepth;
@@ -81,10 +95,13 @@ struct RigScene {
       return colorTexture != 0;
     }
 
-    GLuint vertexArray;
+    GLuint vertexArray = 0;
     GLsizei indexCount;
     GLvoid* indexOffset = 0;
     GLuint colorTexture;
+    GLuint buffer = 0; // vertexes, indexes and color, if owned by the subframe
+    GLuint meshBuffer = 0; // vertexes and indexes, whether owned or not
+    GLvoid* vertexOffset = 0;
     Eigen::Vector2i size;
   };
   std::vector<Subframe> subframes;
@@ -92,19 +109,64 @@ struct RigScene {
 
   std::vector<GLuint> directionTextures;
 
+  // textures, buffers and vertex arrays of subframes are recycled through the pool, shared by all
+  // scenes in the gl context. Free objects are deleted when a scene is destroyed
+  static GpuResourcePool resourcePool;
+
   void createFramebuffers(const int w, const int h);
   void destroyFramebuffers();
+  void createLayeredFramebuffers(const int w, const int h, const int eyes);
+  void destroyLayeredFramebuffers();
 
   void createPrograms();
   void destroyPrograms();
 
   GLuint createDirection(const Camera& camera);
 
+  // color a camera is uploaded from: .astc or .bc7 if present and the gpu supports them, .rgba
+  // otherwise
+  static std::string getColorExtension(const bool hasAstc, const bool hasBc7);
+  static std::string getColorExtension(const folly::dynamic& layout);
+
+  // where the parts of a camera createSubframe uploads are, as offsets into a file or buffer
+  struct SubframeLayout {
+    std::string colorExtension; // see getColorExtension
+    uint64_t colorOffset = 0;
+    uint64_t colorSize = 0;
+    uint64_t vtxOffset = 0;
+    uint64_t idxOffset = 0;
+    uint64_t idxSize = 0;
+  };
+  // from a catalog layout, with .vtx, .idx and color extensions of offset and size. colorExtension
+  // is empty if the layout has no color
+  static SubframeLayout getSubframeLayout(const folly::dynamic& layout);
+
+  // colorTexture, if set, is the color instead of the one in layout, e.g. from a color video (see
+  // VideoFile). The subframe takes it over
   Subframe createSubframe(
+      const Camera& camera,
+      const GLuint buffer,
+      const uint64_t offset, // of buffer in the space of the layout offsets
+      const SubframeLayout& layout,
+      const bool deleteBuffer = true, // false if buffer is owned elsewhere
+      const GLuint colorTexture = 0) const;
+  // createSubframe is uploadSubframe then bindSubframe. Contexts share textures and buffers but
+  // not vertex arrays, so a loader thread with its own context uploads, and the thread rendering
+  // binds, e.g. with bindFrame (see FrameLoader)
+  Subframe uploadSubframe(
       const Camera& camera,
       const GLuint buffer,
       const uint64_t offset,
-      const folly::dynamic& layout) const;
+      const SubframeLayout& layout,
+      const bool deleteBuffer = true,
+      const GLuint colorTexture = 0) const;
+  // 8 bit srgb rgba texture from the pool, for createSubframe's colorTexture
+  static GLuint createColorTexture(const int width, const int height, const uint8_t* rgba);
+  void bindSubframe(Subframe& subframe) const;
+  // binds the subframes that were uploaded but not bound yet
+  void bindFrame(std::vector<Subframe>& subframes) const;
+  // releases only the vertex arrays, destroyFrame releases the rest, possibly on another thread
+  void releaseVertexArrays(std::vector<Subframe>& subframes) const;
   Subframe createSubframe(
       const std::string& id,
       const std::string& imageDir,
@@ -127,10 +189,19 @@ struct RigScene {
   GLuint getProgram() const;
   GLint clearAccumulation();
   void updateAccumulation() const;
+  // same result as clearSubframe, renderSubframe and updateAccumulation, without the camera
+  // buffer and the fullscreen pass: the camera is drawn twice into the accumulation buffer, depth
+  // only and then blended where it matches that depth. Trades the fill of two fullscreen passes
+  // per camera for a second draw of its mesh
+  void blendSubframe(const int subframeIndex, const bool wireframe = false) const;
   void resolveAccumulation(GLint fbo, float fade = 1.0f) const;
   void updateTransform(const Eigen::Matrix4f& transform) const;
 
   mutable std::vector<bool> culled;
+  mutable std::vector<float> visibility; // fraction of each camera on screen in the last render
+
+  // fraction of camera on screen when rendering with projview, as render() samples it
+  static float getVisibility(const Camera& camera, const Eigen::Matrix4f& projview);
 
   void render(
       const Eigen::Matrix4f& projview,
@@ -138,6 +209,22 @@ struct RigScene {
       const bool doCulling = true,
       const bool wireframe = false);
 
+  // renders every eye in one pass, same result as render() for each projview
+  // Each camera mesh is drawn once, and a geometry shader sends it to the camera's layer of every
+  // eye. A pass draws kLayersPerPass cameras, each into its own layer (and depth), then adds all
+  // the layers to each eye's accumulation with one fullscreen draw per eye, instead of one per
+  // camera per eye. Framebuffers take kLayersPerPass * 12 + 16 bytes per pixel per eye
+  // Requires gl 4.0 (see isLayeredSupported) and meshes, resolveLayered() writes out an eye
+  static const int kMaxEyes = 2;
+  static const int kLayersPerPass = 4;
+  static bool isLayeredSupported();
+  void renderLayered(
+      const Matrix4fVector& projviews,
+      const bool doCulling = true,
+      const bool wireframe = false);
+  // resolves the accumulation of eye into the bound framebuffer
+  void resolveLayered(const int eye, const float displacementMeters = 0) const;
+
   static GLenum getInternalRGBAFormat(const uint8_t&) {
     return GL_SRGB8_ALPHA8;
   }
@@ -157,6 +244,8 @@ struct RigScene {
       const std::vector<int>& imageWidths,
       const std::vector<int>& imageHeights);
   void renderSubframe(const int subframeIndex, const bool wireframe = false) const;
+  void setCameraUniforms(const GLuint program, const int subframeIndex) const;
+  void drawMesh(const GLuint program, const int subframeIndex) const;
 };
 
 } // namespace fb360_dep
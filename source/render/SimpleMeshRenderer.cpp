@@ -34,8 +34,10 @@ const char* kUsage = R"(
     --format=cubecolor
 )";
 
+#include <deque>
 #include <future>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <boost/algorithm/string/join.hpp>
@@ -46,10 +48,11 @@ const char* kUsage = R"(
 
 #include "source/gpu/GlUtil.h"
 #include "source/gpu/GlfwUtil.h"
+#include "source/gpu/GpuReadback.h"
 #include "source/util/Camera.h"
 
 #include "CanopyScene.h"
-#include "DisparityColor.h"
+#include "source/util/BoundedQueue.h"
 #include "source/util/CvUtil.h"
 #include "source/util/ImageUtil.h"
 #include "source/util/SystemUtil.h"
@@ -93,6 +96,8 @@ DEFINE_string(background_equirect, "", "path to optional background equirect ima
 DEFINE_string(file_type, "png", "Supports any image type allowed in OpenCV");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
 DEFINE_string(forward, "-1.0 0.0 0.0", "forward for rendering");
+DEFINE_int32(frames_in_flight, 2, "frames rendered while the previous ones are read back");
+DEFINE_bool(gpu_mesh, false, "compute meshes from disparity on the gpu, uploading no vertexes");
 DEFINE_int32(height, -1, "height of the rendering (pixels), default is width / 2");
 DEFINE_double(horizontal_fov, 90, "horizontal field of view for rendering (degrees)");
 DEFINE_bool(ignore_alpha_blend, false, "ignore alpha blend (useful if rendering single camera)");
@@ -100,6 +105,7 @@ DEFINE_string(last, "000000", "last frame to process (lexical) (ignored if on-sc
 DEFINE_string(output, "", "path to output directory");
 DEFINE_string(position, "0.0 0.0 0.0", "position to render from (m)");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
+DEFINE_double(tear_ratio, 0, "with --gpu_mesh, tear at disparity ratios below this (0 = no tear)");
 DEFINE_string(up, "0.0 0.0 1.0", "up for rendering");
 DEFINE_int32(width, 3072, "width of the rendering (pixels)");
 
@@ -123,6 +129,7 @@ void verifyInputs(const Camera::Rig& rig) {
     verifyImagePaths(FLAGS_color, rig, FLAGS_first, FLAGS_last);
   }
 
+  CHECK_GT(FLAGS_frames_in_flight, 0);
   CHECK_GT(FLAGS_width, 0);
   CHECK_EQ(FLAGS_width % 2, 0) << "width must be a multiple of 2";
   if (FLAGS_height == -1) {
@@ -158,10 +165,31 @@ static std::string encodeVector(const Eigen::Vector3f& vector) {
   return folly::sformat("'{} {} {}'", vector.x(), vector.y(), vector.z());
 }
 
-void save(const filesystem::path& path, const cv::Mat_<cv::Vec4f>& result) {
+static bool hasBackground() {
+  return !FLAGS_background.empty() || !FLAGS_background_equirect.empty();
+}
+
+// gl format and type to read offline renderings in
+// Unless they are saved as floats, they are converted to the type save() writes on the gpu, see
+// GpuReadback
+struct ReadType {
+  GLenum format;
+  GLenum type;
+};
+
+static ReadType getReadType() {
+  if (FLAGS_file_type == "exr") {
+    return {GL_BGRA, GL_FLOAT};
+  }
+  return {GL_BGR, FLAGS_file_type == "jpg" ? GLenum(GL_UNSIGNED_BYTE) : GLenum(GL_UNSIGNED_SHORT)};
+}
+
+void save(const filesystem::path& path, const cv::Mat& result) {
   filesystem::create_directories(path.parent_path());
-  cv::Mat out;
-  if (FLAGS_file_type == "jpg") {
+  cv::Mat out = result;
+  if (result.depth() != CV_32F) {
+    // already converted, see getReadType
+  } else if (FLAGS_file_type == "jpg") {
     out = cv_util::convertImage<cv::Vec3b>(result);
   } else if (FLAGS_file_type == "exr") {
     out = cv_util::convertImage<cv::Vec3f>(result);
@@ -185,46 +213,72 @@ loadColors(const Camera::Rig& rig, const std::string& frameName, const cv::Size&
   return colors;
 }
 
-const std::vector<cv::Mat_<cv::Vec4f>> loadDisparitiesAsColors(
-    const Camera::Rig& rig,
-    const std::vector<cv::Mat_<float>>& disparities,
-    bool& needDisparitiesAsColors) {
-  // To make the code flow simpler we generate dummy images when no disparities as colors are needed
-  // so we can reuse canopy scenes later on
-  // Disparities as colors are needed when:
-  // - On-screen rendering of disparities (1)
-  // - Off-screen rendering shows disparities (2)
-
-  // (1)
-  const bool onscreenDisparities = FLAGS_format.empty() && FLAGS_color.empty();
-
-  // (2)
-  const std::set<std::string> formatsWithDisp = {
-      formatsArr[int(Format::eqrdisp)],
-      formatsArr[int(Format::cubedisp)],
-      formatsArr[int(Format::snapdisp)],
-      formatsArr[int(Format::tb3dof)]};
-  const bool offscreenDisparities = formatsWithDisp.find(FLAGS_format) != formatsWithDisp.end();
-
-  needDisparitiesAsColors = onscreenDisparities || offscreenDisparities;
-  std::vector<cv::Mat_<cv::Vec4f>> disparitiesAsColors;
-  if (needDisparitiesAsColors) {
-    const Eigen::Vector3f position = decodeVector(FLAGS_position);
-    disparitiesAsColors = disparityColors(rig, disparities, position, metersToGrayscale);
-  } else {
-    const cv::Size& dummySize = disparities[0].size();
-    const cv::Mat_<cv::Vec4f> dummy(dummySize, 0);
-    disparitiesAsColors.assign(rig.size(), dummy);
+// Blends the backgrounds, if any, behind the image in foreground, one fragment per pixel
+// Rows are numbered top to bottom, as in opencv, whichever way the image is stored
+const std::string compositeFS = R"(
+  #version 330 core
+
+  uniform sampler2D foreground;
+  uniform bool isTopFirst; // foreground's rows are top to bottom
+  uniform bool hasBackground;
+  uniform sampler2D background; // same size as foreground
+  uniform bool hasBackgroundEquirect;
+  uniform sampler2D backgroundEquirect;
+  uniform vec2 nearMax; // half the extent of the near plane
+  uniform float nearZ;
+  uniform mat4 nearToWorld; // near plane to world, scaled to near infinity
+
+  in vec2 texVar;
+  out vec4 color;
+
+  vec4 blend(const vec4 fore, const vec4 back) {
+    if (isnan(fore.a)) {
+      return back; // just swap in background
+    }
+    return vec4(fore.a * fore.rgb + (1 - fore.a) * back.rgb, fore.a + (1 - fore.a) * back.a);
   }
-  return disparitiesAsColors;
-}
+
+  void main() {
+    ivec2 size = textureSize(foreground, 0);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    color = texelFetch(foreground, pixel, 0);
+    int row = isTopFirst ? pixel.y : size.y - 1 - pixel.y;
+    if (hasBackground) {
+      color = blend(color, texelFetch(background, ivec2(pixel.x, row), 0));
+    }
+    if (hasBackgroundEquirect && color.a != 1) {
+      // the center of the pixel at the near plane, in world coordinates at near infinity
+      vec2 xy = (vec2(pixel.x, row) + 0.5) / vec2(size) * 2 - 1;
+      vec3 near = vec3(xy.x * nearMax.x, -xy.y * nearMax.y, -nearZ);
+      vec3 world = (nearToWorld * vec4(near, 1)).xyz;
+      const float kPi = 3.1415926535897932384626433832795;
+      float lon = atan(-world.y, -world.x); // -x is in the middle, -y to the right
+      float lat = asin(normalize(world).z);
+      ivec2 equiSize = textureSize(backgroundEquirect, 0);
+      ivec2 equi = ivec2( // nearest
+          (-lon / kPi + 1) / 2 * equiSize.x, // sign flip to get 360 ... 0
+          (-lat / kPi + 0.5) * equiSize.y); // sign flip because images are upside down
+      color = blend(color, texelFetch(backgroundEquirect, min(equi, equiSize - 1), 0));
+    }
+  }
+)";
 
 class SimpleMeshWindow : public GlWindow {
  public:
-  std::shared_ptr<CanopyScene> sceneColor;
-  std::shared_ptr<CanopyScene> sceneDisp;
+  std::shared_ptr<CanopyScene> scene;
 
  protected:
+  // Images are drawn into imageFBO, then composited into compositeFBO if there is a background
+  // All of them are created once and reused for every image of the same size
+  GLuint imageFBO = 0;
+  GLuint imageTexture;
+  cv::Size imageSize;
+  GLuint compositeFBO;
+  GLuint compositeColor;
+  GLuint compositeProgram = 0;
+  GLuint backgroundTexture = 0;
+  GLuint backgroundEquirectTexture = 0;
+
   void report() {
     std::cerr << folly::sformat(
                      "--position {} --forward {} --up {} --horizontal_fov {}",
@@ -258,61 +312,103 @@ class SimpleMeshWindow : public GlWindow {
     return result;
   }
 
-  cv::Mat_<cv::Vec4f> alphaBlend(const cv::Mat_<cv::Vec4f>& fore, const cv::Mat_<cv::Vec4f>& back) {
-    CHECK_EQ(fore.rows, back.rows);
-    CHECK_EQ(fore.cols, back.cols);
-    cv::Mat_<cv::Vec4f> result(fore.rows, fore.cols);
-    for (int y = 0; y < result.rows; ++y) {
-      for (int x = 0; x < result.cols; ++x) {
-        float alpha = fore(y, x)[3];
-        if (std::isnan(alpha)) {
-          result(y, x) = back(y, x); // just swap in background
-        } else {
-          result(y, x) = alpha * fore(y, x) + (1 - alpha) * back(y, x);
-          result(y, x)[3] = alpha + (1 - alpha) * back(y, x)[3];
-        }
-      }
+  void createImageBuffers(const cv::Size& size) {
+    imageFBO = createFramebuffer();
+    imageTexture = createFramebufferTexture(size.width, size.height, GL_RGBA32F);
+    compositeFBO = createFramebuffer();
+    compositeColor = createFramebufferColor(size.width, size.height, GL_RGBA32F);
+    imageSize = size;
+  }
+
+  void destroyImageBuffers() {
+    glDeleteRenderbuffers(1, &compositeColor);
+    glDeleteFramebuffers(1, &compositeFBO);
+    glDeleteTextures(1, &imageTexture);
+    glDeleteFramebuffers(1, &imageFBO);
+    imageFBO = 0; // flag as destroyed
+  }
+
+  // Backgrounds are loaded once, on the first image that needs them
+  void loadBackgrounds() {
+    if (compositeProgram != 0) {
+      return;
+    }
+    compositeProgram = createProgram(fullscreenVertexShader(), compositeFS);
+    if (!FLAGS_background.empty()) {
+      const cv::Mat_<cv::Vec4f> background = cv_util::loadImage<cv::Vec4f>(FLAGS_background);
+      backgroundTexture = createTexture(
+          background.cols, background.rows, background.ptr(), GL_RGBA32F, GL_BGRA, GL_FLOAT);
+    }
+    if (!FLAGS_background_equirect.empty()) {
+      const cv::Mat_<cv::Vec4f> equirect = cv_util::loadImage<cv::Vec4f>(FLAGS_background_equirect);
+      backgroundEquirectTexture = createTexture(
+          equirect.cols, equirect.rows, equirect.ptr(), GL_RGBA32F, GL_BGRA, GL_FLOAT);
     }
-    return result;
   }
 
-  void backgroundEquirect(cv::Mat_<cv::Vec4f>& fore, const cv::Mat_<cv::Vec4f>& equi) {
-    const int width = fore.cols;
-    const int height = fore.rows;
+  // Blends the backgrounds behind imageTexture into compositeFBO
+  void composite(const bool isTopFirst) {
+    loadBackgrounds();
+    glBindFramebuffer(GL_FRAMEBUFFER, compositeFBO);
+    glViewport(0, 0, imageSize.width, imageSize.height);
+    glUseProgram(compositeProgram);
+    connectUnitWith2DTextureAndUniform(0, imageTexture, compositeProgram, "foreground");
+    setUniform(compositeProgram, "isTopFirst", GLint(isTopFirst));
+    setUniform(compositeProgram, "hasBackground", GLint(backgroundTexture != 0));
+    if (backgroundTexture != 0) {
+      GLint width;
+      GLint height;
+      glBindTexture(GL_TEXTURE_2D, backgroundTexture);
+      glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+      glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+      CHECK_EQ(cv::Size(width, height), imageSize) << "background must match the output size";
+      connectUnitWith2DTextureAndUniform(1, backgroundTexture, compositeProgram, "background");
+    }
+    setUniform(compositeProgram, "hasBackgroundEquirect", GLint(backgroundEquirectTexture != 0));
+    if (backgroundEquirectTexture != 0) {
+      connectUnitWith2DTextureAndUniform(
+          2, backgroundEquirectTexture, compositeProgram, "backgroundEquirect");
+      const float xMax = kNearZ * tan(FLAGS_horizontal_fov / 180 * M_PI / 2);
+      const Eigen::Affine3f transform = posForwardUp(
+          decodeVector(FLAGS_position), decodeVector(FLAGS_forward), decodeVector(FLAGS_up));
+      // scale the near plane to near infinity, then go back to world coordinates
+      Eigen::Affine3f nearToWorld = transform.inverse();
+      nearToWorld.scale(Camera::kNearInfinity);
+      setUniform(compositeProgram, "nearMax", xMax, xMax * imageSize.height / imageSize.width);
+      setUniform(compositeProgram, "nearZ", kNearZ);
+      glUniformMatrix4fv(
+          getUniformLocation(compositeProgram, "nearToWorld"), 1, GL_FALSE, nearToWorld.data());
+    }
+    glActiveTexture(GL_TEXTURE0);
+    fullscreen(compositeProgram);
+  }
 
-    // compute transform
-    const float xMax = kNearZ * tan(FLAGS_horizontal_fov / 180 * M_PI / 2);
-    const Eigen::Affine3f transform = posForwardUp(
-        decodeVector(FLAGS_position), decodeVector(FLAGS_forward), decodeVector(FLAGS_up));
-    const Eigen::Affine3f inverse = transform.inverse();
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        float alpha = fore(y, x)[3];
-        if (alpha == 1) {
-          continue; // short-circuit for performance
-        }
-
-        // compute the center of the pixel at the near plane
-        Eigen::Vector3f pixel = {
-            ((x + 0.5f) / width * 2 - 1) * xMax,
-            -((y + 0.5f) / height * 2 - 1) * xMax * height / width, // image upside down, sign flip
-            -kNearZ};
-
-        // scale it to near infinity and apply the inverse transform to get world coordinates
-        Eigen::Vector3f world = inverse * (Camera::kNearInfinity * pixel);
-        float lon = atan2(-world.y(), -world.x()); // -x is in the middle, -y to the right
-        float lat = asin(world.normalized().z());
-        float equiX = (-lon / M_PI + 1) / 2 * equi.cols; // sign flip to get 360 ... 0
-        float equiY = (-lat / M_PI + 0.5) * equi.rows; // sign flip because images are upside down
-        cv::Vec4f back = equi(equiY, equiX); // nearest
-        if (std::isnan(alpha)) {
-          fore(y, x) = back; // just swap in background
-        } else {
-          fore(y, x) = alpha * fore(y, x) + (1 - alpha) * back;
-          fore(y, x)[3] = alpha + (1 - alpha) * back[3];
-        }
-      }
+  // Queues the read of an image of size, drawn by draw(framebuffer), with the backgrounds blended
+  // in on the gpu. isTopFirst if draw leaves the rows top to bottom, as equirects are
+  template <typename Fn>
+  void readImage(
+      GpuReadback& readback,
+      const ReadType& readType,
+      const cv::Size& size,
+      const bool isTopFirst,
+      Fn&& draw) {
+    if (imageFBO != 0 && imageSize != size) {
+      destroyImageBuffers();
+    }
+    if (imageFBO == 0) {
+      createImageBuffers(size);
+    }
+    draw(imageFBO);
+    GLuint readFBO = imageFBO;
+    if (hasBackground()) {
+      composite(isTopFirst);
+      readFBO = compositeFBO;
     }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, readFBO);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    readback.begin(size, readType.format, readType.type, !isTopFirst);
+    glReadPixels(0, 0, size.width, size.height, readType.format, readType.type, readback.at(0));
+    readback.end();
   }
 
  public:
@@ -344,17 +440,31 @@ class SimpleMeshWindow : public GlWindow {
     }
   }
 
+  ~SimpleMeshWindow() {
+    if (imageFBO != 0) {
+      destroyImageBuffers();
+    }
+    if (compositeProgram != 0) {
+      glDeleteTextures(1, &backgroundEquirectTexture);
+      glDeleteTextures(1, &backgroundTexture);
+      glDeleteProgram(compositeProgram);
+    }
+  }
+
   void display() override {
-    sceneColor->render(0, projection * transform);
+    scene->render(0, projection * transform);
   }
 
-  cv::Mat_<cv::Vec4f> snapshot(const bool isColorDisp = false) {
-    // Create snapshot framebuffer
+  // Colors the scene by disparity from --position instead of by color, see
+  // CanopyScene::setDisparity
+  void setDisparity(const bool isDisparity) {
+    scene->setDisparity(isDisparity, decodeVector(FLAGS_position));
+  }
+
+  // Queues the read of a snapshot, see GpuReadback
+  void snapshot(GpuReadback& readback, const ReadType& readType, const bool isColorDisp = false) {
     const int width = FLAGS_width;
     const int height = FLAGS_height;
-    GLuint framebuffer = createFramebuffer();
-    GLuint snapshot = createFramebufferColor(width, height, GL_RGBA32F);
-    glViewport(0, 0, width, height);
 
     // Compute projection
     const float xMax = kNearZ * tan(FLAGS_horizontal_fov / 180 * M_PI / 2);
@@ -365,67 +475,126 @@ class SimpleMeshWindow : public GlWindow {
     const Eigen::Affine3f transform = posForwardUp(
         decodeVector(FLAGS_position), decodeVector(FLAGS_forward), decodeVector(FLAGS_up));
 
-    // Render scene and read result
+    // Render scene and queue the read, readback flips the result
     const float kIpd = 0.0f;
-    if (isColorDisp) {
-      sceneDisp->render(framebuffer, projection * transform, kIpd, !FLAGS_ignore_alpha_blend);
-    } else {
-      sceneColor->render(framebuffer, projection * transform, kIpd, !FLAGS_ignore_alpha_blend);
-    }
-    glReadBuffer(GL_COLOR_ATTACHMENT0);
-    cv::Mat_<cv::Vec4f> result(height, width);
-    glReadPixels(0, 0, result.cols, result.rows, GL_BGRA, GL_FLOAT, result.ptr());
-    const int kVertical = 0;
-    cv::flip(result, result, kVertical);
-
-    // Clean up
-    glDeleteRenderbuffers(1, &snapshot);
-    glDeleteFramebuffers(1, &framebuffer);
-    return result;
+    const bool kIsTopFirst = false;
+    setDisparity(isColorDisp);
+    readImage(readback, readType, {width, height}, kIsTopFirst, [&](const GLuint framebuffer) {
+      glViewport(0, 0, width, height);
+      scene->render(framebuffer, projection * transform, kIpd, !FLAGS_ignore_alpha_blend);
+    });
+    setDisparity(false);
   }
 
-  cv::Mat_<cv::Vec4f> generate(const cv::Mat_<cv::Vec4f>& foreground) {
-    cv::Mat_<cv::Vec4f> result;
-    if (FLAGS_background.empty()) {
-      result = foreground;
-    } else {
-      result = alphaBlend(foreground, cv_util::loadImage<cv::Vec4f>(FLAGS_background));
-    }
-    if (!FLAGS_background_equirect.empty()) {
-      backgroundEquirect(result, cv_util::loadImage<cv::Vec4f>(FLAGS_background_equirect));
-    }
-    return result;
+  // Queues the read of an equirect, see GpuReadback
+  void equirect(
+      GpuReadback& readback,
+      const ReadType& readType,
+      const float ipd,
+      const bool isColorDisp = false) {
+    const Eigen::Vector3f position = decodeVector(FLAGS_position);
+    const bool kIsTopFirst = true; // see CanopyScene::equirect
+    setDisparity(isColorDisp);
+    readImage(
+        readback,
+        readType,
+        {2 * FLAGS_height, FLAGS_height},
+        kIsTopFirst,
+        [&](const GLuint framebuffer) {
+          scene->equirect(framebuffer, FLAGS_height, position, ipd, !FLAGS_ignore_alpha_blend);
+        });
+    setDisparity(false);
+  }
+
+  // Queues the read of a cubemap, faces stacked top to bottom, see GpuReadback
+  void cubemap(GpuReadback& readback, const ReadType& readType, const bool isColorDisp = false) {
+    const Eigen::Vector3f position = decodeVector(FLAGS_position);
+    const float kIpd = 0.0f;
+    const bool kIsTopFirst = false;
+    const int kFaceCount = 6;
+    setDisparity(isColorDisp);
+    readImage(
+        readback,
+        readType,
+        {FLAGS_height, kFaceCount * FLAGS_height},
+        kIsTopFirst,
+        [&](const GLuint framebuffer) {
+          scene->cubemap(framebuffer, FLAGS_height, position, kIpd, !FLAGS_ignore_alpha_blend);
+        });
+    setDisparity(false);
   }
 
-  cv::Mat_<cv::Vec4f>
-  stereo(const int formatIdx, const int width, const Eigen::Vector3f& position) {
+  // Queues the reads of the images of a frame in formatIdx, returns how many, see compose()
+  // Backgrounds are blended in on the gpu, the reads are ready to save
+  int render(GpuReadback& readback, const int formatIdx, const ReadType& readType) {
+    const float ipdDefault = 0.0f;
+
     // Average human IPD is 6.4cm
     const float halfIpdM = 0.032f; // left = halfIpdM, right = -halfIpdM
-    const cv::Mat_<cv::Vec4f> leftEye =
-        generate(sceneColor->equirect(width, position, halfIpdM, !FLAGS_ignore_alpha_blend));
-    const cv::Mat_<cv::Vec4f> rightEye =
-        generate(sceneColor->equirect(width, position, -halfIpdM, !FLAGS_ignore_alpha_blend));
-
-    cv::Mat_<cv::Vec4f> outputImage;
-    if (formatIdx == int(Format::tbstereo)) {
-      outputImage = cv_util::stackVertical<cv::Vec4f>({leftEye, rightEye});
-    } else if (formatIdx == int(Format::lr180)) {
-      // Crop half the image on each eye
-      const cv::Rect roi(leftEye.cols / 4, 0, leftEye.cols / 2, leftEye.rows);
-      const cv::Mat_<cv::Vec4f> left = leftEye(roi);
-      const cv::Mat_<cv::Vec4f> right = rightEye(roi);
-      outputImage = cv_util::stackHorizontal<cv::Vec4f>({left, right});
+
+    switch (formatIdx) {
+      case int(Format::eqrcolor): {
+        equirect(readback, readType, ipdDefault);
+        return 1;
+      }
+      case int(Format::eqrdisp): {
+        equirect(readback, readType, ipdDefault, true);
+        return 1;
+      }
+      case int(Format::cubecolor): {
+        cubemap(readback, readType);
+        return 1;
+      }
+      case int(Format::cubedisp): {
+        cubemap(readback, readType, true);
+        return 1;
+      }
+      case int(Format::lr180):
+      case int(Format::tbstereo): {
+        equirect(readback, readType, halfIpdM);
+        equirect(readback, readType, -halfIpdM);
+        return 2;
+      }
+      case int(Format::tb3dof): {
+        equirect(readback, readType, ipdDefault);
+        equirect(readback, readType, ipdDefault, true);
+        return 2;
+      }
+      case int(Format::snapcolor): {
+        snapshot(readback, readType, false);
+        return 1;
+      }
+      case int(Format::snapdisp): {
+        snapshot(readback, readType, true);
+        return 1;
+      }
+      default: {
+        CHECK(false) << "Invalid format " << FLAGS_format;
+      }
     }
-    return outputImage;
+    return 0;
   }
 
-  cv::Mat_<cv::Vec4f> tb3dof(const int width, const Eigen::Vector3f& position) {
-    const float ipd = 0.0f;
-    const cv::Mat_<cv::Vec4f> color =
-        generate(sceneColor->equirect(width, position, ipd, !FLAGS_ignore_alpha_blend));
-    const cv::Mat_<cv::Vec4f> disparity =
-        generate(sceneDisp->equirect(width, position, ipd, !FLAGS_ignore_alpha_blend));
-    return cv_util::stackVertical<cv::Vec4f>({color, disparity});
+  // Combines the images render() read for a frame into the output image
+  cv::Mat compose(const int formatIdx, const std::vector<cv::Mat>& images) {
+    cv::Mat outputImage;
+    switch (formatIdx) {
+      case int(Format::tbstereo):
+      case int(Format::tb3dof): {
+        cv::vconcat(images[0], images[1], outputImage);
+        break;
+      }
+      case int(Format::lr180): {
+        // Crop half the image on each eye
+        const cv::Rect roi(images[0].cols / 4, 0, images[0].cols / 2, images[0].rows);
+        cv::hconcat(images[0](roi), images[1](roi), outputImage);
+        break;
+      }
+      default: {
+        outputImage = images[0];
+      }
+    }
+    return outputImage;
   }
 };
 
@@ -445,6 +614,42 @@ int main(int argc, char* argv[]) {
 
   // On and off screen rendering
   SimpleMeshWindow window(FLAGS_format.empty() ? GlWindow::ON_SCREEN : GlWindow::OFF_SCREEN);
+  auto it = std::find(formats.begin(), formats.end(), FLAGS_format);
+  const int formatIdx = std::distance(formats.begin(), it);
+
+  // Off-screen frames go through a pipeline: while the gpu renders frame i and reads it into a
+  // pack buffer, frame i - frames_in_flight is copied out of its buffer, and older frames are
+  // composed, converted and saved on a writer thread
+  struct PendingFrame {
+    std::string frameName;
+    int numReads;
+  };
+  struct ReadFrame {
+    std::string frameName;
+    std::vector<cv::Mat> images;
+  };
+  const ReadType readType = getReadType();
+  const int kMaxReadsPerFrame = 2;
+  GpuReadback readback(FLAGS_frames_in_flight * kMaxReadsPerFrame);
+  std::deque<PendingFrame> pending;
+  BoundedQueue<ReadFrame> writeQueue(FLAGS_frames_in_flight);
+  std::thread writer([&] {
+    ReadFrame readFrame;
+    while (writeQueue.pop(readFrame)) {
+      const filesystem::path filename =
+          filesystem::path(FLAGS_output) / (readFrame.frameName + "." + FLAGS_file_type);
+      save(filename, window.compose(formatIdx, readFrame.images));
+      LOG(INFO) << "File saved in " << filename;
+    }
+  });
+  const auto readBackFrame = [&] {
+    ReadFrame readFrame{pending.front().frameName, {}};
+    for (int i = 0; i < pending.front().numReads; ++i) {
+      readFrame.images.push_back(readback.pop());
+    }
+    pending.pop_front();
+    writeQueue.push(std::move(readFrame));
+  };
 
   for (int iFrame = first; iFrame <= last; ++iFrame) {
     const std::string frameName = image_util::intToStringZeroPad(iFrame, 6);
@@ -459,17 +664,18 @@ int main(int argc, char* argv[]) {
     const std::vector<cv::Mat_<cv::Vec4f>> colors = loadColors(rig, frameName, dummySize);
     CHECK_EQ(ssize(colors), ssize(rig));
 
-    // Disparities need to be used as colors when we want to show disparity maps
-    bool needDisparitiesAsColors;
-    const std::vector<cv::Mat_<cv::Vec4f>> disparitiesAsColors =
-        loadDisparitiesAsColors(rig, disparities, needDisparitiesAsColors);
-    CHECK_EQ(ssize(disparitiesAsColors), ssize(rig));
+    // The first frame creates the scene, later ones only upload their images into it. gl orders
+    // the uploads after the reads of the previous frames
+    if (!window.scene) {
+      window.scene = std::make_shared<CanopyScene>(
+          rig, disparities, colors, FLAGS_format.empty(), FLAGS_gpu_mesh, FLAGS_tear_ratio);
+    } else {
+      window.scene->update(disparities, colors);
+    }
 
     if (FLAGS_format.empty()) {
-      const std::shared_ptr<CanopyScene> sceneColor(new CanopyScene(
-          rig, disparities, needDisparitiesAsColors ? disparitiesAsColors : colors));
-
-      window.sceneColor = sceneColor;
+      // Show disparities when there are no colors
+      window.setDisparity(FLAGS_color.empty());
 
       // Render loop
       window.mainLoop();
@@ -478,68 +684,17 @@ int main(int argc, char* argv[]) {
       break;
     }
 
-    // Update the scene
-    const std::shared_ptr<CanopyScene> sceneColor(new CanopyScene(rig, disparities, colors, false));
-    const std::shared_ptr<CanopyScene> sceneDisp(
-        new CanopyScene(rig, disparities, disparitiesAsColors, false));
-
-    window.sceneColor = sceneColor;
-    window.sceneDisp = sceneDisp;
-
-    auto it = std::find(formats.begin(), formats.end(), FLAGS_format);
-    const int formatIdx = std::distance(formats.begin(), it);
-
-    cv::Mat_<cv::Vec4f> outputImage;
-    const Eigen::Vector3f position = decodeVector(FLAGS_position);
-    const float ipdDefault = 0.0f;
-
-    switch (formatIdx) {
-      case int(Format::eqrcolor): {
-        outputImage = window.generate(
-            sceneColor->equirect(FLAGS_height, position, ipdDefault, !FLAGS_ignore_alpha_blend));
-        break;
-      }
-      case int(Format::eqrdisp): {
-        outputImage = window.generate(
-            sceneDisp->equirect(FLAGS_height, position, ipdDefault, !FLAGS_ignore_alpha_blend));
-        break;
-      }
-      case int(Format::cubecolor): {
-        outputImage = window.generate(
-            sceneColor->cubemap(FLAGS_height, position, ipdDefault, !FLAGS_ignore_alpha_blend));
-        break;
-      }
-      case int(Format::cubedisp): {
-        outputImage = window.generate(
-            sceneDisp->cubemap(FLAGS_height, position, ipdDefault, !FLAGS_ignore_alpha_blend));
-        break;
-      }
-      case int(Format::lr180):
-      case int(Format::tbstereo): {
-        outputImage = window.generate(window.stereo(formatIdx, FLAGS_height, position));
-        break;
-      }
-      case int(Format::tb3dof): {
-        outputImage = window.generate(window.tb3dof(FLAGS_height, position));
-        break;
-      }
-      case int(Format::snapcolor): {
-        outputImage = window.generate(window.snapshot(false));
-        break;
-      }
-      case int(Format::snapdisp): {
-        outputImage = window.generate(window.snapshot(true));
-        break;
-      }
-      default: {
-        CHECK(false) << "Invalid format " << FLAGS_format;
-      }
+    // Read back the oldest frame once enough newer ones are queued behind it
+    if (ssize(pending) == FLAGS_frames_in_flight) {
+      readBackFrame();
     }
+    pending.push_back({frameName, window.render(readback, formatIdx, readType)});
+  }
 
-    const filesystem::path filename =
-        filesystem::path(FLAGS_output) / (frameName + "." + FLAGS_file_type);
-    save(filename, outputImage);
-    LOG(INFO) << "File saved in " << filename;
+  while (!pending.empty()) {
+    readBackFrame();
   }
+  writeQueue.close();
+  writer.join();
   return EXIT_SUCCESS;
 }
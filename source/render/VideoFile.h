@@ -5,25 +5,44 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <deque>
 #include <fstream>
+#include <future>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <mutex>
 
 #include <boost/filesystem.hpp>
 
 #include <folly/Format.h>
 
+#include <opencv2/imgproc.hpp>
+
 #include "source/gpu/GlUtil.h"
+#include "source/gpu/GpuRingBuffer.h"
+#include "source/mesh_stream/CatalogIndex.h"
+#include "source/mesh_stream/MeshCodec.h"
 #include "source/mesh_stream/StripedFile.h"
+#include "source/render/MeshCodecGpu.h"
 #include "source/render/RigScene.h"
+#include "source/util/MathUtil.h"
+#include "source/util/VideoReader.h"
 
 namespace fb360_dep {
 
 // a video file is a striped file with a catalog describing the layout
+// the catalog is read from its flat index (see CatalogIndex) when fusion wrote one next to it,
+// from the json otherwise
+// color comes from a video per camera instead of the striped file when fusion wrote them next to
+// the catalog (see getColorVideoDir), decoded by frame index, with a hardware decoder if there is
+// one, while meshes are still read from the striped file
 struct VideoFile {
   StripedFile stripedFile;
-  folly::dynamic catalog;
+  std::unique_ptr<CatalogIndex> catalogIndex;
+  folly::dynamic catalog; // only if there is no index
   std::vector<std::string> frames;
   int current = 0;
 
@@ -31,50 +50,160 @@ struct VideoFile {
 
   VideoFile& operator=(const VideoFile& videoFile) = delete;
 
-  VideoFile(const std::string& catalogName, const std::vector<std::string>& diskNames)
-      : stripedFile(diskNames), catalog(parseCatalog(catalogName)) {
-    // find and sort all the frame names
-    for (const auto& key : catalog["frames"].keys()) {
-      frames.push_back(key.getString());
+  ~VideoFile() {
+    releaseHeld();
+  }
+
+  // queueDepth is the max reads in flight per disk for each camera, see StripedFile
+  VideoFile(
+      const std::string& catalogName,
+      const std::vector<std::string>& diskNames,
+      const int queueDepth = 1)
+      : stripedFile(diskNames),
+        catalogIndex(CatalogIndex::load(CatalogIndex::getPath(catalogName))) {
+    CHECK_GE(queueDepth, 1);
+    stripedFile.queueDepth = queueDepth;
+    if (catalogIndex) {
+      // frames are sorted in the index
+      for (int frame = 0; frame < catalogIndex->getFrameCount(); ++frame) {
+        frames.push_back(catalogIndex->getFrameName(frame));
+      }
+      findIndexExtensions();
+    } else {
+      catalog = parseCatalog(catalogName);
+      // find and sort all the frame names
+      for (const auto& key : catalog["frames"].keys()) {
+        frames.push_back(key.getString());
+      }
+      sort(frames.begin(), frames.end());
     }
+    // the layout the disks were fused with
+    stripedFile.stripeSize =
+        catalogIndex ? catalogIndex->getStripeSize() : StripedFile::getStripeSize(catalog);
+    StripedFile::checkStripeSize(stripedFile.stripeSize);
     CHECK(frames.size()) << "no frames in catalog " << catalogName;
-    sort(frames.begin(), frames.end());
-    LOG(INFO) << folly::sformat("{} frames found", frames.size());
+    LOG(INFO) << folly::sformat(
+        "{} frames found{}", frames.size(), catalogIndex ? " (indexed)" : "");
+    const filesystem::path videoDir =
+        getColorVideoDir(filesystem::path(catalogName).parent_path());
+    if (filesystem::is_directory(videoDir)) {
+      colorVideoDir = videoDir;
+      LOG(INFO) << folly::sformat("Color from the videos in {}", videoDir.string());
+    }
   }
 
+  // <fused>/color_video/<camera>.mp4, see ConvertToBinary --color_video
+  static filesystem::path getColorVideoDir(const filesystem::path& fusedDir) {
+    return fusedDir / "color_video";
+  }
+
+  // index of the next frame readEnd will return
   int getFront() const {
-    return static_cast<int>((current - pending.size() + frames.size()) % frames.size());
+    for (const PendingFrame& pendingFrame : pending) {
+      if (!pendingFrame.isStale) {
+        return pendingFrame.frame;
+      }
+    }
+    return current;
+  }
+
+  // levels of detail of the mesh of a camera are stored as extra extensions, coarser as lod
+  // increases, e.g. .vtx, .lod1.vtx, .lod2.vtx
+  static std::string getLodExtension(const std::string& extension, const int lod) {
+    return lod == 0 ? extension : folly::sformat(".lod{}{}", lod, extension);
   }
 
+  // cameras that were culled in the last scene.render are skipped if cull is set, the others are
+  // read at a level of detail that drops as they move out of view (see chooseLod)
+  // a camera that repeats the frame read just before, as fusion stores static cameras (see
+  // binary_fusion::CameraRepeats), is not read again: the frame reuses the textures and buffers of
+  // the previous one, which readFrame holds on to for it
   void readBegin(const RigScene& scene, bool cull = false) {
-    const folly::dynamic& frame = catalog["frames"][frames[current]];
     pending.emplace_back();
-    std::vector<Loader>& loaders = pending.back();
+    pending.back().frame = current;
+    std::vector<Loader>& loaders = pending.back().loaders;
+    const bool isNextFrame = lastBegun + 1 == current;
+    lastBegun = current;
+    begun.resize(scene.rig.size());
     // kick off a loader for every camera in scene.rig
     loaders.reserve(scene.rig.size());
     for (int i = 0; i < int(scene.rig.size()); ++i) {
-      const Camera& camera = scene.rig[i];
-      const folly::dynamic& layout = frame[camera.id];
-      if (cull && i < int(scene.culled.size()) && scene.culled[i]) {
-        loaders.push_back({nullptr, 0, 0, layout, nullptr});
-        loaders.back().read = nullptr;
+      const std::vector<bool>& culled = isViewSet ? viewCulled : scene.culled;
+      if (cull && i < int(culled.size()) && culled[i]) {
+        loaders.push_back({nullptr, 0, 0, 0, {}, nullptr});
+        begun[i] = {};
+        continue;
+      }
+      // only the level of detail the view needs is read
+      const CameraRead cameraRead =
+          catalogIndex ? getIndexedRead(scene, i) : getCatalogRead(scene, i);
+      const uint64_t size = cameraRead.size;
+      const uint64_t offset = cameraRead.offset;
+      const bool isRepeat =
+          isNextFrame && begun[i].isHeld && begun[i].offset == offset && begun[i].size == size;
+      // held cameras need buffers of their own, the ring is released frame by frame
+      const bool isHeld = repeatsNext(scene, current, i);
+      begun[i] = {offset, size, isHeld};
+      if (isRepeat) {
+        loaders.push_back({nullptr, 0, offset, size, {}, nullptr});
+        loaders.back().isRepeat = true;
+        if (!colorVideoDir.empty()) {
+          loaders.back().color = decodeColor(scene, i, current);
+        }
+      } else if (!cameraRead.encodedLayout.isNull() && !canExpand(cameraRead)) {
+        // read to memory, then decode on a worker thread, the gl buffer is created from the
+        // decoded data in readFrame
+        const uint64_t sizeAligned = align(size, kPageSize);
+        std::vector<uint8_t> staging(sizeAligned + kPageSize - 1);
+        uint8_t* const pAligned = align(staging.data(), kPageSize);
+        StripedFile::PendingRead* const read = stripedFile.readBegin(pAligned, offset, sizeAligned);
+        loaders.push_back({read, 0, offset, size, {}, nullptr});
+        loaders.back().isEncoded = true;
+        const folly::dynamic& layout = cameraRead.encodedLayout;
+        loaders.back().decoding = std::async(
+            std::launch::async, [read, pAligned, offset, layout, staging = std::move(staging)] {
+              StripedFile::readEnd(read);
+              return decodeCamera(pAligned, offset, layout);
+            });
       } else {
-        const uint64_t size = layout["size"].getInt();
         // when reading, size must be page aligned
         const uint64_t sizeAligned = align(size, kPageSize);
-        // allocate, map and align a buffer
+        // allocate, map and align a buffer, from the ring if there is room
+        // encoded cameras are expanded into buffers of their own, so they can be held
         const uint64_t sizeAlloc = sizeAligned + kPageSize - 1;
-        const GLuint buffer = createBuffer(kBufferType, (uint8_t*)nullptr, sizeAlloc);
-        uint8_t* const p = static_cast<uint8_t*>(glMapBuffer(kBufferType, GL_WRITE_ONLY));
-        CHECK(p);
+        const bool isExpanded = !cameraRead.encodedLayout.isNull();
+        uint64_t ringOffset = GpuRingBuffer::kFull;
+        if (ring && (!isHeld || isExpanded)) {
+          ringOffset = ring->allocate(sizeAlloc);
+        }
+        GLuint buffer;
+        uint8_t* bufferBase; // mapping of the buffer's offset 0
+        uint8_t* p;
+        if (ringOffset != GpuRingBuffer::kFull) {
+          buffer = ring->getBuffer();
+          bufferBase = ring->getBase();
+          p = bufferBase + ringOffset;
+        } else {
+          // a recycled buffer may still be in use by gl, invalidating lets it map without waiting
+          bool isReused;
+          buffer = RigScene::resourcePool.acquireBuffer(kBufferType, sizeAlloc, isReused);
+          const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+          bufferBase = p =
+              static_cast<uint8_t*>(glMapBufferRange(kBufferType, 0, sizeAlloc, access));
+          CHECK(p);
+          glBindBuffer(kBufferType, 0);
+        }
         uint8_t* const pAligned = align(p, kPageSize);
-        glBindBuffer(kBufferType, 0);
         // start the read
-        const uint64_t offset = layout["offset"].getInt();
         StripedFile::PendingRead* const read = stripedFile.readBegin(pAligned, offset, sizeAligned);
         // stash the loader information for this camera
-        const uint64_t offsetUnaligned = offset - (pAligned - p);
-        loaders.push_back({read, buffer, offsetUnaligned, layout, p});
+        const uint64_t offsetUnaligned = offset - (pAligned - bufferBase);
+        loaders.push_back({read, buffer, offsetUnaligned, size, cameraRead.layout, p});
+        loaders.back().ringOffset = ringOffset;
+        loaders.back().expandedLayout = cameraRead.encodedLayout;
+      }
+      if (!isRepeat && !colorVideoDir.empty()) {
+        loaders.back().color = decodeColor(scene, i, current);
       }
     }
     // increment frame counter
@@ -84,9 +213,19 @@ struct VideoFile {
   // blocking function: wait for disk read
   void readWait(const RigScene& scene, int index = 0) {
     CHECK(index < int(pending.size()));
-    const std::vector<Loader>& loaders = pending[index];
-    for (const Loader& loader : loaders) {
-      if (loader.read != nullptr) {
+    std::vector<Loader>& loaders = pending[index].loaders;
+    for (Loader& loader : loaders) {
+      if (loader.color.valid()) {
+        loader.color.wait();
+      }
+      if (loader.read == nullptr) {
+        continue;
+      }
+      if (loader.isEncoded) {
+        if (loader.decoding.valid()) {
+          loader.decoded = loader.decoding.get();
+        }
+      } else {
         stripedFile.readEnd(loader.read);
       }
     }
@@ -95,9 +234,9 @@ struct VideoFile {
   // unmap gl buffer
   void readUnmap(const RigScene& scene, int index = 0) {
     CHECK(index < int(pending.size()));
-    const std::vector<Loader>& loaders = pending[index];
+    const std::vector<Loader>& loaders = pending[index].loaders;
     for (const Loader& loader : loaders) {
-      if (loader.read != nullptr) {
+      if (loader.read != nullptr && !loader.isEncoded && !loader.isInRing()) {
         glBindBuffer(kBufferType, loader.buffer);
         glUnmapBuffer(kBufferType);
         glBindBuffer(kBufferType, 0);
@@ -108,21 +247,70 @@ struct VideoFile {
   // create subframes from read data
   std::vector<RigScene::Subframe> readFrame(const RigScene& scene) {
     CHECK(!pending.empty());
-    const std::vector<Loader>& loaders = pending.front();
+    const std::vector<Loader>& loaders = pending.front().loaders;
     CHECK_EQ(loaders.size(), scene.rig.size());
+    // unless deferred (see setDeferred), the previous frame has been destroyed by now, its ring
+    // allocations are free once gl is done with them
+    if (!deferred) {
+      releaseDisplayed();
+    }
+    displayed.emplace_back();
+    auto create = [&](
+        const int i,
+        const GLuint buffer,
+        const uint64_t offset,
+        const RigScene::SubframeLayout& layout,
+        const bool deleteBuffer) {
+      const GLuint color = createColorTexture(loaders[i]);
+      return deferred
+          ? scene.uploadSubframe(scene.rig[i], buffer, offset, layout, deleteBuffer, color)
+          : scene.createSubframe(scene.rig[i], buffer, offset, layout, deleteBuffer, color);
+    };
     std::vector<RigScene::Subframe> result;
     // create a subframe for every camera in scene.rig
     result.reserve(scene.rig.size());
     for (int i = 0; i < int(scene.rig.size()); ++i) {
       const Loader& loader = loaders[i];
-      if (loader.read == nullptr) {
+      if (loader.isRepeat) {
+        // shares the previous frame's texture and buffer, each frame releases its reference
+        CHECK(i < int(held.size()) && held[i].isValid()) << "repeat of a camera that was not held";
+        RigScene::Subframe subframe = held[i];
+        if (loader.color.valid()) {
+          subframe.colorTexture = createColorTexture(loader); // the video is not deduplicated
+        } else {
+          RigScene::resourcePool.retainTexture(subframe.colorTexture);
+        }
+        RigScene::resourcePool.retainBuffer(subframe.buffer);
+        if (!deferred) {
+          scene.bindSubframe(subframe);
+        }
+        result.push_back(subframe);
+      } else if (loader.read == nullptr) {
         result.emplace_back();
+      } else if (loader.isEncoded) {
+        const std::vector<uint8_t>& data = loader.decoded.data;
+        bool isReused;
+        const GLuint buffer =
+            RigScene::resourcePool.acquireBuffer(kBufferType, data.size(), isReused);
+        glBufferSubData(kBufferType, 0, data.size(), data.data());
+        glBindBuffer(kBufferType, 0);
+        result.emplace_back(
+            create(i, buffer, 0, RigScene::getSubframeLayout(loader.decoded.layout), true));
+      } else if (!loader.expandedLayout.isNull()) {
+        RigScene::SubframeLayout layout;
+        const GLuint buffer = expandCamera(loader, layout);
+        result.emplace_back(create(i, buffer, 0, layout, true));
+      } else if (loader.isInRing()) {
+        // the subframe uses the ring until the frame is destroyed
+        const bool kDeleteBuffer = false;
+        result.emplace_back(create(i, loader.buffer, loader.offset, loader.layout, kDeleteBuffer));
+        displayed.back().push_back(loader.ringOffset);
       } else {
         // create the frame
-        result.emplace_back(
-            scene.createSubframe(scene.rig[i], loader.buffer, loader.offset, loader.layout));
+        result.emplace_back(create(i, loader.buffer, loader.offset, loader.layout, true));
       }
     }
+    holdRepeated(scene, pending.front().frame, result);
     pending.pop_front();
     return result;
   }
@@ -134,6 +322,168 @@ struct VideoFile {
     return readFrame(scene);
   }
 
+  // readahead window used by advance(), the number of frames in flight adapts within
+  // [minFrames, maxFrames]
+  void setReadahead(const int minFrames, const int maxFrames, const float fps) {
+    CHECK_GE(minFrames, 1);
+    CHECK_GE(maxFrames, minFrames);
+    readaheadMin = minFrames;
+    readaheadMax = maxFrames;
+    readaheadFps = fps;
+    readahead = math_util::clamp(readahead, readaheadMin, readaheadMax);
+  }
+
+  int getReadahead() const {
+    return readahead;
+  }
+
+  // read frames straight into a persistently mapped ring buffer, rather than into a new gl buffer
+  // per camera, if the gl context supports it. The ring holds the readahead window plus the
+  // frame on display, within maxBytes, cameras that do not fit go through their own buffers
+  // frames must be destroyed before the next one is read, as advance() callers do
+  // meshes fused with mesh_codec::kGpu are then read encoded too, and expanded by the gpu, if it
+  // has compute shaders (see MeshCodecGpu), rather than decoded by the cpu
+  void setUploadRing(const uint64_t maxBytes) {
+    CHECK(pending.empty()) << "set the upload ring before reading";
+    ring.reset();
+    meshCodecGpu.reset();
+    if (maxBytes == 0) {
+      return;
+    }
+    if (!GpuRingBuffer::isSupported()) {
+      LOG(INFO) << "Buffer storage not supported, uploading through per camera buffers";
+      return;
+    }
+    const uint64_t capacity = std::min(maxBytes, (readaheadMax + 2) * getMaxFrameAlloc());
+    ring = std::make_unique<GpuRingBuffer>(capacity);
+    // reads into the ring can skip pinning its pages
+    AsyncFile::registerBuffers({{ring->getBase(), capacity}});
+    LOG(INFO) << folly::sformat("Uploading through a {} MB ring", capacity / (1024 * 1024));
+    if (MeshCodecGpu::isSupported()) {
+      meshCodecGpu = std::make_unique<MeshCodecGpu>();
+    }
+  }
+
+  // start reads until the readahead window is full
+  void fillReadahead(const RigScene& scene, bool cull = false) {
+    while (countLive() < readahead) {
+      readBegin(scene, cull);
+    }
+  }
+
+  // returns the next frame and keeps the readahead window full
+  // the window adapts to the disk: a frame that is not ready when it is needed (the disk could
+  // not keep up with playback) widens the window by one frame, a couple of seconds of frames
+  // that were all ready narrows it by one
+  std::vector<RigScene::Subframe> advance(const RigScene& scene, bool cull = false) {
+    discardStale(scene);
+    if (pending.empty()) {
+      readBegin(scene, cull);
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto getMs = [](const Clock::time_point& begin, const Clock::time_point& end) {
+      return std::chrono::duration<float, std::milli>(end - begin).count();
+    };
+    const auto start = Clock::now();
+    readWait(scene);
+    const auto waited = Clock::now();
+    const float waitMs = getMs(start, waited);
+    const uint64_t frameBytes = getFrameBytes(pending.front());
+    std::vector<RigScene::Subframe> result = readEnd(scene);
+    const auto uploaded = Clock::now();
+
+    // frames that were read ahead of time return almost immediately
+    // the first frames after a start or a seek were not requested ahead of time, ignore them
+    static const float kStallMs = 2;
+    if (framesSinceReset++ < readahead) {
+      // warming up
+    } else if (waitMs > kStallMs) {
+      readyFrames = 0;
+      if (readahead < readaheadMax) {
+        ++readahead;
+        const float mbps = frameBytes * readaheadFps / (1024 * 1024);
+        LOG(INFO) << folly::sformat(
+            "Waited {:.1f} ms for frame, {} MB/s needed, readahead is now {} frames",
+            waitMs,
+            mbps,
+            readahead);
+      }
+    } else if (++readyFrames >= std::max(1.0f, 2 * readaheadFps) && readahead > readaheadMin) {
+      readyFrames = 0;
+      --readahead;
+    }
+
+    fillReadahead(scene, cull);
+
+    const auto end = Clock::now();
+    const uint64_t bytes = AsyncFile::bytesRead();
+    advanceStats.waitMs = waitMs;
+    advanceStats.uploadMs = getMs(waited, uploaded);
+    advanceStats.readBeginMs = getMs(uploaded, end);
+    advanceStats.pendingFrames = countLive();
+    if (lastAdvance != Clock::time_point()) {
+      const float seconds = std::chrono::duration<float>(end - lastAdvance).count();
+      advanceStats.mbps = (bytes - lastBytesRead) / (1024 * 1024 * seconds);
+    }
+    lastAdvance = end;
+    lastBytesRead = bytes;
+    return result;
+  }
+
+  // where the last advance() spent its time, to tell whether a hitch came from the disk, the
+  // upload or elsewhere (see PlaybackHud)
+  struct AdvanceStats {
+    float waitMs = 0; // for the disk
+    float uploadMs = 0; // unmapping buffers and creating textures
+    float readBeginMs = 0; // starting the reads that refill the readahead window
+    int pendingFrames = 0; // in flight once refilled
+    float mbps = 0; // read from all files since the previous advance()
+  };
+
+  const AdvanceStats& getAdvanceStats() const {
+    return advanceStats;
+  }
+
+  // jump to frame, reads already in flight are discarded by advance() as they complete, so the
+  // new reads are queued right away instead of waiting for them
+  void seek(const RigScene& scene, const int frame, bool cull = false) {
+    CHECK_GE(frame, 0);
+    CHECK_LT(frame, int(frames.size()));
+    for (PendingFrame& pendingFrame : pending) {
+      pendingFrame.isStale = true;
+    }
+    current = frame;
+    readyFrames = 0;
+    framesSinceReset = 0;
+    fillReadahead(scene, cull);
+  }
+
+  // for reading on a loader thread whose gl context shares objects with the render thread's (see
+  // FrameLoader): frames are left without vertex arrays, which contexts do not share, for the
+  // render thread to bind (see RigScene::bindFrame), and several frames can be alive at once, so
+  // each one keeps its ring allocations until releaseFrame()
+  void setDeferred(const bool isDeferred) {
+    deferred = isDeferred;
+  }
+
+  // gl is done with the oldest frame still holding ring allocations, see setDeferred
+  void releaseFrame() {
+    CHECK(!displayed.empty());
+    for (const uint64_t offset : displayed.front()) {
+      ring->release(offset);
+    }
+    displayed.pop_front();
+  }
+
+  // cull state to read with rather than the scene's, which the render thread is updating when
+  // reading on another thread. Culling as in readBegin, levels of detail as in chooseLod
+  void setView(const std::vector<bool>& culled, const std::vector<float>& visibility) {
+    viewCulled = culled;
+    viewVisibility = visibility;
+    isViewSet = true;
+  }
+
  private:
   static folly::dynamic parseCatalog(const std::string& fileName) {
     CHECK(boost::filesystem::exists(boost::filesystem::path(fileName)));
@@ -164,15 +514,454 @@ struct VideoFile {
 
   GLenum kBufferType = GL_TEXTURE_BUFFER; // unimportant, pick unused type
 
+  // camera with its encoded extensions decoded, packed in memory
+  struct DecodedCamera {
+    std::vector<uint8_t> data;
+    folly::dynamic layout = folly::dynamic::object; // offsets into data
+  };
+
   struct Loader {
     StripedFile::PendingRead* read;
     GLuint buffer;
     uint64_t offset; // offset of the unaligned buffer
-    const folly::dynamic layout; // HACK FOR WINDOWS: should be reference
+    uint64_t size; // bytes read
+    RigScene::SubframeLayout layout; // unless encoded, see decoded
     uint8_t* p; // for debugging
+    uint64_t ringOffset = GpuRingBuffer::kFull; // allocation in ring, kFull if own buffer
+    bool isEncoded = false; // see mesh_codec, read to memory and decoded instead of mapped
+    bool isRepeat = false; // not read, the previous frame's subframe is reused, see readBegin
+    std::shared_future<cv::Mat> color; // rgba from the color video, if there is one
+    std::future<DecodedCamera> decoding;
+    DecodedCamera decoded;
+    folly::dynamic expandedLayout = nullptr; // catalog layout, if the gpu expands the camera
+
+    bool isInRing() const {
+      return ringOffset != GpuRingBuffer::kFull;
+    }
   };
 
-  std::deque<std::vector<Loader>> pending;
+  // what readBegin reads for a camera, offset and size cover just the parts that are uploaded
+  struct CameraRead {
+    uint64_t offset;
+    uint64_t size;
+    RigScene::SubframeLayout layout;
+    folly::dynamic encodedLayout = nullptr; // catalog layout, if the camera needs decoding
+  };
+
+  // frame current of camera scene.rig[i] from the json catalog
+  CameraRead getCatalogRead(const RigScene& scene, const int i) const {
+    const folly::dynamic& cameraLayout = catalog["frames"][frames[current]][scene.rig[i].id];
+    const int lod = chooseLod(getVisibility(scene), i, getLodCount(cameraLayout));
+    const folly::dynamic layout =
+        selectLod(cameraLayout, lod, stripedFile.stripeSize, colorVideoDir.empty());
+    CameraRead result;
+    result.offset = layout["offset"].getInt();
+    result.size = layout["size"].getInt();
+    if (isEncoded(layout)) {
+      result.encodedLayout = layout;
+    } else {
+      result.layout = RigScene::getSubframeLayout(layout);
+    }
+    return result;
+  }
+
+  // index of camera scene.rig[i] in the catalog index
+  int getIndexCamera(const RigScene& scene, const int i) {
+    if (indexCameras.size() != scene.rig.size()) {
+      indexCameras.clear();
+      for (const Camera& camera : scene.rig) {
+        indexCameras.push_back(catalogIndex->findCamera(camera.id));
+        CHECK_GE(indexCameras.back(), 0) << "camera not in catalog index: " << camera.id;
+      }
+    }
+    return indexCameras[i];
+  }
+
+  // same as getCatalogRead, from the index
+  CameraRead getIndexedRead(const RigScene& scene, const int i) {
+    const int camera = getIndexCamera(scene, i);
+    auto get = [&](const int extension) {
+      return extension < 0 ? CatalogIndex::Extent{0, 0}
+                           : catalogIndex->getExtent(current, camera, extension);
+    };
+    const int lod = chooseLod(getVisibility(scene), i, indexVtx.size());
+    const CatalogIndex::Extent vtx = get(indexVtx[lod]);
+    const CatalogIndex::Extent idx = get(indexIdx[lod]);
+    CameraRead result;
+    result.layout.colorExtension =
+        RigScene::getColorExtension(get(indexAstc).size > 0, get(indexBc7).size > 0);
+    CatalogIndex::Extent color = get(
+        result.layout.colorExtension == ".astc"
+            ? indexAstc
+            : result.layout.colorExtension == ".bc7" ? indexBc7 : indexRgba);
+    if (!colorVideoDir.empty()) {
+      result.layout.colorExtension = ""; // from the video
+      color = {0, 0};
+    }
+    result.layout.colorOffset = color.offset;
+    result.layout.colorSize = color.size;
+    result.layout.vtxOffset = vtx.offset;
+    result.layout.idxOffset = idx.offset;
+    result.layout.idxSize = idx.size;
+
+    uint64_t begin = std::numeric_limits<uint64_t>::max();
+    uint64_t end = catalogIndex->getCamera(current, camera).offset;
+    for (const CatalogIndex::Extent& extent : {color, vtx, idx}) {
+      if (extent.size > 0) {
+        begin = std::min(begin, extent.offset);
+        end = std::max(end, extent.offset + extent.size);
+      }
+    }
+    // reads must start on a stripe, as cameras do (see StripedFile::readBegin)
+    const uint64_t stripeSize = stripedFile.stripeSize;
+    result.offset = std::min(begin, end) / stripeSize * stripeSize;
+    result.size = end - result.offset;
+    return result;
+  }
+
+  // extensions of the index, resolved once rather than looked up for every camera
+  void findIndexExtensions() {
+    indexAstc = catalogIndex->findExtension(".astc");
+    indexBc7 = catalogIndex->findExtension(".bc7");
+    indexRgba = catalogIndex->findExtension(".rgba");
+    for (int lod = 0;; ++lod) {
+      const int vtx = catalogIndex->findExtension(getLodExtension(".vtx", lod));
+      if (lod > 0 && vtx < 0) {
+        break;
+      }
+      indexVtx.push_back(vtx);
+      indexIdx.push_back(catalogIndex->findExtension(getLodExtension(".idx", lod)));
+    }
+  }
+
+  // buffer bytes readBegin needs for the largest frame
+  uint64_t getMaxFrameAlloc() const {
+    uint64_t result = 0;
+    if (catalogIndex) {
+      for (int frame = 0; frame < catalogIndex->getFrameCount(); ++frame) {
+        uint64_t total = 0;
+        for (int camera = 0; camera < catalogIndex->getCameraCount(); ++camera) {
+          total += align(catalogIndex->getCamera(frame, camera).size, kPageSize) + kPageSize - 1;
+        }
+        result = std::max(result, total);
+      }
+      return result;
+    }
+    for (const auto& frame : catalog["frames"].values()) {
+      uint64_t total = 0;
+      for (const auto& camera : frame.values()) {
+        total += align(camera["size"].getInt(), kPageSize) + kPageSize - 1;
+      }
+      result = std::max(result, total);
+    }
+    return result;
+  }
+
+  void releaseDisplayed() {
+    while (!displayed.empty()) {
+      releaseFrame();
+    }
+  }
+
+  // frame of camera scene.rig[i]'s color video, decoded to rgba on a worker thread once the frames
+  // requested before it are, so each video is decoded in order
+  std::shared_future<cv::Mat> decodeColor(const RigScene& scene, const int i, const int frame) {
+    if (colorVideos.size() != scene.rig.size()) {
+      colorVideos.clear();
+      for (const Camera& camera : scene.rig) {
+        const filesystem::path path = video_util::findVideo(colorVideoDir, camera.id);
+        CHECK(!path.empty()) << "no color video for camera " << camera.id;
+        const bool kHardware = true;
+        colorVideos.push_back(std::make_shared<video_util::VideoReader>(path, kHardware));
+        CHECK_EQ(colorVideos.back()->getFrameCount(), int(frames.size()))
+            << "color video and catalog frames differ: " << path.string();
+      }
+      colorDecodes.assign(scene.rig.size(), {});
+    }
+    std::shared_ptr<video_util::VideoReader> video = colorVideos[i];
+    std::shared_future<cv::Mat> previous = colorDecodes[i];
+    auto decode = [video, previous, frame]() mutable {
+      if (previous.valid()) {
+        previous.wait();
+        previous = {}; // don't keep the whole chain of frames alive
+      }
+      cv::Mat rgba;
+      cv::cvtColor(video->read(frame), rgba, cv::COLOR_BGR2RGBA);
+      return rgba;
+    };
+    colorDecodes[i] = std::async(std::launch::async, decode).share();
+    return colorDecodes[i];
+  }
+
+  // 0 unless the loader has color from a video
+  static GLuint createColorTexture(const Loader& loader) {
+    if (!loader.color.valid()) {
+      return 0;
+    }
+    const cv::Mat& rgba = loader.color.get();
+    return RigScene::createColorTexture(rgba.cols, rgba.rows, rgba.ptr<uint8_t>());
+  }
+
+  // true if camera scene.rig[i] is stored once for frame and the frame after it
+  bool repeatsNext(const RigScene& scene, const int frame, const int i) {
+    const int next = frame + 1;
+    if (next == int(frames.size())) {
+      return false;
+    }
+    if (catalogIndex) {
+      const int camera = getIndexCamera(scene, i);
+      const CatalogIndex::Extent& extent = catalogIndex->getCamera(frame, camera);
+      const CatalogIndex::Extent& nextExtent = catalogIndex->getCamera(next, camera);
+      return extent.size > 0 && extent.offset == nextExtent.offset;
+    }
+    const std::string& id = scene.rig[i].id;
+    const folly::dynamic* layout = catalog["frames"][frames[frame]].get_ptr(id);
+    const folly::dynamic* nextLayout = catalog["frames"][frames[next]].get_ptr(id);
+    return layout && nextLayout && (*layout)["offset"] == (*nextLayout)["offset"];
+  }
+
+  // keeps a reference to the subframes of frame that the next frame repeats, see readBegin
+  void holdRepeated(
+      const RigScene& scene,
+      const int frame,
+      const std::vector<RigScene::Subframe>& subframes) {
+    releaseHeld();
+    held.resize(subframes.size());
+    for (int i = 0; i < int(subframes.size()); ++i) {
+      // only subframes that own their buffer, cameras in the ring are released with their frame
+      if (subframes[i].isValid() && subframes[i].buffer != 0 && repeatsNext(scene, frame, i)) {
+        held[i] = subframes[i];
+        held[i].vertexArray = 0; // not shared, each frame binds its own
+        RigScene::resourcePool.retainTexture(held[i].colorTexture);
+        RigScene::resourcePool.retainBuffer(held[i].buffer);
+      }
+    }
+  }
+
+  void releaseHeld() {
+    for (RigScene::Subframe& subframe : held) {
+      if (subframe.isValid()) {
+        RigScene::resourcePool.releaseTexture(subframe.colorTexture);
+        RigScene::resourcePool.releaseBuffer(subframe.buffer);
+      }
+      subframe = {};
+    }
+  }
+
+  // .vtx, .idx or one of their levels of detail
+  static bool isMesh(const std::string& extension) {
+    return !mesh_codec::getEncoding(extension).empty();
+  }
+
+  // number of levels of detail of a camera, 1 if it has no coarser ones
+  static int getLodCount(const folly::dynamic& layout) {
+    int count = 1;
+    while (layout.find(getLodExtension(".vtx", count)) != layout.items().end()) {
+      ++count;
+    }
+    return count;
+  }
+
+  // finest level of detail for a camera that fills the view, coarsest for one out of view,
+  // evenly in between based on the fraction of the camera on screen in the last scene.render
+  static int chooseLod(const std::vector<float>& visibility, const int i, const int lodCount) {
+    if (lodCount == 1 || i >= int(visibility.size())) {
+      return 0;
+    }
+    return std::min(lodCount - 1, int((1 - visibility[i]) * lodCount));
+  }
+
+  const std::vector<float>& getVisibility(const RigScene& scene) const {
+    return isViewSet ? viewVisibility : scene.visibility;
+  }
+
+  static bool isColor(const std::string& extension) {
+    return extension == ".astc" || extension == ".bc7" || extension == ".rgba";
+  }
+
+  // layout of camera with the mesh of level of detail lod as .vtx and .idx, the one color format
+  // the gpu uploads (see RigScene::getColorExtension), and offset and size covering just what is
+  // needed. Fusion puts the other extensions first and then the levels from coarsest to finest
+  // (see ConvertToBinary), so coarser levels are shorter reads
+  // the color is left out if readColor is false, e.g. when it comes from a video
+  static folly::dynamic selectLod(
+      const folly::dynamic& layout,
+      const int lod,
+      const uint64_t stripeSize,
+      const bool readColor) {
+    const std::string colorExtension = RigScene::getColorExtension(layout);
+    uint64_t begin = std::numeric_limits<uint64_t>::max();
+    uint64_t end = layout["offset"].getInt();
+    folly::dynamic result = folly::dynamic::object;
+    auto add = [&](const std::string& extension, const folly::dynamic& entry) {
+      result[extension] = entry;
+      begin = std::min(begin, uint64_t(entry["offset"].getInt()));
+      end = std::max(end, uint64_t(entry["offset"].getInt() + entry["size"].getInt()));
+    };
+    for (const auto& item : layout.items()) {
+      const std::string extension = item.first.getString();
+      if (item.second.isObject() && !isMesh(extension)) {
+        if (!isColor(extension) || (readColor && extension == colorExtension)) {
+          add(extension, item.second);
+        }
+      }
+    }
+    for (const std::string extension : {".vtx", ".idx"}) {
+      const auto it = layout.find(getLodExtension(extension, lod));
+      if (it != layout.items().end()) {
+        add(extension, it->second);
+      }
+    }
+    // reads must start on a stripe, as cameras do (see StripedFile::readBegin)
+    begin = std::min(begin, end) / stripeSize * stripeSize;
+    result["offset"] = begin;
+    result["size"] = end - begin;
+    return result;
+  }
+
+  static bool isEncoded(const folly::dynamic& layout) {
+    for (const auto& item : layout.items()) {
+      if (item.second.isObject() && mesh_codec::isEncoded(item.second)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // where the extensions of a camera go once decoded, packed, and the size they take
+  static folly::dynamic getDecodedLayout(const folly::dynamic& layout, uint64_t& size) {
+    static const uint64_t kAlignment = 16; // keeps every extension aligned for gl
+    folly::dynamic result = folly::dynamic::object;
+    size = 0;
+    for (const auto& item : layout.items()) {
+      if (item.second.isObject()) {
+        size = align(size, kAlignment);
+        const uint64_t decodedSize = mesh_codec::getDecodedSize(item.second);
+        result[item.first] = folly::dynamic::object("offset", size)("size", decodedSize);
+        size += decodedSize;
+      }
+    }
+    return result;
+  }
+
+  // decodes the extensions of a camera that was read to data, data is at offset in the file
+  static DecodedCamera
+  decodeCamera(const uint8_t* data, const uint64_t offset, const folly::dynamic& layout) {
+    DecodedCamera result;
+    uint64_t size;
+    result.layout = getDecodedLayout(layout, size);
+    result.data.resize(size);
+    for (const auto& item : result.layout.items()) {
+      const folly::dynamic& entry = layout[item.first];
+      uint8_t* const dst = result.data.data() + item.second["offset"].getInt();
+      mesh_codec::decode(dst, data + entry["offset"].getInt() - offset, entry);
+    }
+    return result;
+  }
+
+  // whether the gpu can expand an encoded camera, read where reads are (see readBegin)
+  bool canExpand(const CameraRead& cameraRead) const {
+    return meshCodecGpu && MeshCodecGpu::canDecode(cameraRead.encodedLayout, cameraRead.offset);
+  }
+
+  // expands a camera the gpu can expand, from the buffer it was read to into one of its own,
+  // the read buffer goes back to the ring or the pool once gl is done with it
+  GLuint expandCamera(const Loader& loader, RigScene::SubframeLayout& layout) {
+    uint64_t size;
+    const folly::dynamic decodedLayout = getDecodedLayout(loader.expandedLayout, size);
+    bool isReused;
+    const GLuint buffer = RigScene::resourcePool.acquireBuffer(kBufferType, size, isReused);
+    glBindBuffer(kBufferType, 0);
+    for (const auto& item : decodedLayout.items()) {
+      const folly::dynamic& entry = loader.expandedLayout[item.first];
+      const uint64_t srcOffset = entry["offset"].getInt() - loader.offset;
+      meshCodecGpu->decode(buffer, item.second["offset"].getInt(), loader.buffer, srcOffset, entry);
+    }
+    MeshCodecGpu::barrier();
+    if (loader.isInRing()) {
+      ring->release(loader.ringOffset);
+    } else {
+      RigScene::resourcePool.releaseBuffer(loader.buffer);
+    }
+    layout = RigScene::getSubframeLayout(decodedLayout);
+    return buffer;
+  }
+
+  struct PendingFrame {
+    int frame;
+    std::vector<Loader> loaders;
+    bool isStale = false; // read before a seek
+  };
+
+  int countLive() const {
+    return std::count_if(pending.begin(), pending.end(), [](const PendingFrame& pendingFrame) {
+      return !pendingFrame.isStale;
+    });
+  }
+
+  static uint64_t getFrameBytes(const PendingFrame& pendingFrame) {
+    uint64_t result = 0;
+    for (const Loader& loader : pendingFrame.loaders) {
+      if (loader.read != nullptr) {
+        result += loader.size;
+      }
+    }
+    return result;
+  }
+
+  void discardStale(const RigScene& scene) {
+    while (!pending.empty() && pending.front().isStale) {
+      std::vector<RigScene::Subframe> subframes = readEnd(scene);
+      scene.destroyFrame(subframes);
+      // never displayed, its ring allocations can go right away
+      for (const uint64_t offset : displayed.back()) {
+        ring->release(offset);
+      }
+      displayed.pop_back();
+    }
+  }
+
+  // extension indexes in catalogIndex, -1 if missing, and camera indexes of the scene's rig
+  int indexAstc = -1;
+  int indexBc7 = -1;
+  int indexRgba = -1;
+  std::vector<int> indexVtx; // per level of detail
+  std::vector<int> indexIdx;
+  std::vector<int> indexCameras;
+
+  // what the last readBegin read of each camera, see readBegin
+  struct BegunCamera {
+    uint64_t offset = 0;
+    uint64_t size = 0; // 0 if culled
+    bool isHeld = false; // readFrame will hold on to it for the next frame
+  };
+  int lastBegun = -1; // frame
+  std::vector<BegunCamera> begun;
+  std::vector<RigScene::Subframe> held; // per camera, invalid if the next frame reads it
+
+  filesystem::path colorVideoDir; // empty if color is in the striped file
+  std::vector<std::shared_ptr<video_util::VideoReader>> colorVideos; // per camera
+  std::vector<std::shared_future<cv::Mat>> colorDecodes; // per camera, the last one requested
+
+  std::deque<PendingFrame> pending;
+  std::unique_ptr<GpuRingBuffer> ring;
+  std::unique_ptr<MeshCodecGpu> meshCodecGpu; // null if meshes are decoded on the cpu
+  // ring allocations of the frames read and not released yet, oldest first
+  std::deque<std::vector<uint64_t>> displayed;
+  bool deferred = false;
+  bool isViewSet = false;
+  std::vector<bool> viewCulled;
+  std::vector<float> viewVisibility;
+
+  int readaheadMin = 1;
+  int readaheadMax = 1;
+  float readaheadFps = 30;
+  int readahead = 1; // frames to keep in flight
+  int readyFrames = 0; // consecutive frames that were ready when needed
+  int framesSinceReset = 0; // frames returned by advance() since the start or the last seek
+  AdvanceStats advanceStats;
+  std::chrono::steady_clock::time_point lastAdvance;
+  uint64_t lastBytesRead = 0;
 };
 
 } // namespace fb360_dep
@@ -18,12 +18,16 @@ const char* kUsage = R"(
      Random proposals and disparity mismatches are accepted if their variance is higher than this
      threshold.
 
+   Each change is shown right away on a --preview_width copy of the image, then refined at full
+   size in the background. The variance map is computed once, only the thresholds are reapplied.
+
  )";
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "source/depth_estimation/DerpUtil.h"
+#include "source/render/PreviewRefiner.h"
 #include "source/util/CvUtil.h"
 #include "source/util/SystemUtil.h"
 
@@ -33,6 +37,7 @@ using namespace fb360_dep;
 using namespace fb360_dep::cv_util;
 
 DEFINE_string(fullsize_image, "", "path to full-size RGB image (required)");
+DEFINE_int32(preview_width, 512, "width of the preview shown while refining (0 = no preview)");
 DEFINE_double(var_high_max, 5e-2, "max high variance allowed");
 DEFINE_double(var_low_max, 4e-3, "max low variance allowed");
 DEFINE_int32(width, 2048, "loaded image width (0 = original size)");
@@ -43,9 +48,16 @@ const std::string varHighFlag = "--var_high_thresh";
 class TrackVar {
   const std::string winName = "Color thresholds";
   const int sliderMaxCount = 100;
+  const int kBandRows = 64; // rows thresholded between cancellation checks
+
+  // Image and its variance, at full size or downscaled for the preview
+  struct Level {
+    cv::Mat_<PixelType> image;
+    cv::Mat_<float> var;
+  };
 
-  cv::Mat_<PixelType> image;
-  cv::Mat_<float> var;
+  Level full;
+  Level preview; // empty if the image is no wider than the preview
 
   int sliderLowVal;
   int sliderHighVal;
@@ -59,41 +71,82 @@ class TrackVar {
 
   float scaleVar;
 
+  PreviewRefiner refiner; // last, so it stops refining before the levels go away
+
   static void onChange(int, void* object) {
     reinterpret_cast<TrackVar*>(object)->update();
   }
 
  private:
+  cv::Mat_<PixelType> markVariance(
+      const Level& level,
+      const float varLow,
+      const float varHigh,
+      const PreviewRefiner::IsCancelled& isCancelled) const {
+    const PixelType kBlue = cv_util::createBGR<PixelType>(1, 0, 0);
+    const PixelType kPurple = cv_util::createBGR<PixelType>(1, 0, 1);
+    cv::Mat_<PixelType> srcMarked = level.image.clone();
+    for (int begin = 0; begin < srcMarked.rows; begin += kBandRows) {
+      if (isCancelled()) {
+        return cv::Mat_<PixelType>();
+      }
+      const cv::Range rows(begin, std::min(begin + kBandRows, srcMarked.rows));
+      cv::Mat_<PixelType> band = srcMarked.rowRange(rows);
+      const cv::Mat_<float> varBand = level.var.rowRange(rows);
+      band.setTo(kBlue, varBand < varLow);
+      band.setTo(kPurple, varBand > varHigh);
+    }
+    return srcMarked;
+  }
+
   void update() {
     varNoiseFloor = varLowMax * sliderLowVal / sliderMaxCount;
     varHighThresh = varHighMax * sliderHighVal / sliderMaxCount;
     varLowShow = std::max(varNoiseFloor * scaleVar, depth_estimation::kMinVar);
     varHighShow = std::max(varHighThresh, varLowShow);
-    cv::Mat_<PixelType> srcMarked = image.clone();
 
-    const PixelType kBlue = cv_util::createBGR<PixelType>(1, 0, 0);
-    const PixelType kPurple = cv_util::createBGR<PixelType>(1, 0, 1);
-    srcMarked.setTo(kBlue, var < varLowShow);
-    srcMarked.setTo(kPurple, var > varHighShow);
-    imshow(winName, srcMarked);
+    const float varLow = varLowShow;
+    const float varHigh = varHighShow;
+    cv::Mat_<PixelType> previewMarked;
+    if (!preview.image.empty()) {
+      const auto never = [] { return false; };
+      previewMarked = resizeImage(
+          markVariance(preview, varLow, varHigh, never), full.image.size(), cv::INTER_NEAREST);
+    }
+    refiner.request(
+        previewMarked,
+        [this, varLow, varHigh](const PreviewRefiner::IsCancelled& isCancelled) {
+          return cv::Mat(markVariance(full, varLow, varHigh, isCancelled));
+        });
   }
 
  public:
   TrackVar(
       const std::string& imagePath,
       const int width,
+      const int previewWidth,
       const float varLowMaxIn,
       const float varHighMaxIn)
-      : varLowMax(varLowMaxIn), varHighMax(varHighMaxIn), varNoiseFloor(1e-4), varHighThresh(1e-3) {
+      : varLowMax(varLowMaxIn),
+        varHighMax(varHighMaxIn),
+        varNoiseFloor(1e-4),
+        varHighThresh(1e-3),
+        refiner(winName) {
     // Load image
-    image = loadImage<PixelType>(imagePath);
-    const double scale = width > 0 ? double(width) / image.cols : 1.0;
+    full.image = loadImage<PixelType>(imagePath);
+    const double scale = width > 0 ? double(width) / full.image.cols : 1.0;
     if (width > 0) {
-      image = scaleImage(image, scale);
+      full.image = scaleImage(full.image, scale);
     }
-    var = depth_estimation::computeImageVariance(image);
+    full.var = depth_estimation::computeImageVariance(full.image);
     scaleVar = math_util::square(scale);
 
+    // The preview samples the full size variance, so it marks the same pixels the refinement does
+    if (previewWidth > 0 && previewWidth < full.image.cols) {
+      preview.image = scaleImage(full.image, double(previewWidth) / full.image.cols);
+      preview.var = resizeImage(full.var, preview.image.size(), cv::INTER_NEAREST);
+    }
+
     // Initialize values
     sliderLowVal = varNoiseFloor / varLowMax * sliderMaxCount;
     sliderHighVal = varHighThresh / varHighMax * sliderMaxCount;
@@ -105,6 +158,10 @@ class TrackVar {
     update();
   }
 
+  int waitKey() {
+    return refiner.waitKey();
+  }
+
   float getVarNoiseFloor() {
     return varNoiseFloor;
   }
@@ -121,12 +178,18 @@ int main(int argc, char* argv[]) {
   CHECK_NE(FLAGS_fullsize_image, "");
   CHECK_GT(FLAGS_var_low_max, 0);
   CHECK_GT(FLAGS_var_high_max, 0);
+  CHECK_GE(FLAGS_preview_width, 0);
   CHECK_GE(FLAGS_width, 0);
 
-  TrackVar trackVar(FLAGS_fullsize_image, FLAGS_width, FLAGS_var_low_max, FLAGS_var_high_max);
+  TrackVar trackVar(
+      FLAGS_fullsize_image,
+      FLAGS_width,
+      FLAGS_preview_width,
+      FLAGS_var_low_max,
+      FLAGS_var_high_max);
 
   LOG(INFO) << "Press any key to exit.";
-  cv::waitKey(0);
+  trackVar.waitKey();
 
   LOG(INFO) << folly::sformat("{}={:.3e}", varLowFlag, trackVar.getVarNoiseFloor());
   LOG(INFO) << folly::sformat("{}={:.3e}", varHighFlag, trackVar.getVarHighThresh());
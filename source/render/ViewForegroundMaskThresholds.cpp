@@ -16,17 +16,21 @@ const char* kUsage = R"(
      foreground mask = ||background - foreground||^2 > threshold
    - morph_closing_size: Morphological closing size, used to fill holes on the final mask
 
+   Each change is shown right away on --preview_width copies of the images, then refined at full
+   size in the background. Blurred differences are kept until the blur radius changes, so moving
+   the other trackbars only reapplies the threshold and closing.
+
  )";
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "source/render/BackgroundSubtractionUtil.h"
+#include "source/render/PreviewRefiner.h"
 #include "source/util/CvUtil.h"
 #include "source/util/SystemUtil.h"
 
 using PixelType = cv::Vec3w;
-using PixelTypeFloat = cv::Vec3f;
 
 using namespace fb360_dep;
 using namespace fb360_dep::cv_util;
@@ -35,6 +39,7 @@ DEFINE_int32(blur_radius_max, 20, "max Gaussian blur radius allowed");
 DEFINE_string(fullsize_bg_image, "", "path to full-size RGB background image (required)");
 DEFINE_string(fullsize_fg_image, "", "path to full-size RGB foreground image (required)");
 DEFINE_int32(morph_closing_size_max, 20, "max morphological closing size allowed");
+DEFINE_int32(preview_width, 512, "width of the preview shown while refining (0 = no preview)");
 DEFINE_int32(width, 2048, "loaded image width (0 = original size)");
 
 const std::string blurFlag = "--blur_radius";
@@ -45,8 +50,17 @@ class TrackVar {
   const std::string winName = "Foreground mask thresholds";
   const PixelType green = cv_util::createBGR<PixelType>(0, 1, 0);
 
-  cv::Mat_<PixelType> imageBg;
-  cv::Mat_<PixelType> imageFg;
+  // Images at full size or downscaled for the preview, and their blurred squared difference
+  struct Level {
+    cv::Mat_<PixelType> imageBg;
+    cv::Mat_<PixelType> imageFg;
+    double scale = 1.0; // of radii, relative to full size
+    int blur = -1; // radius distSq was blurred with, -1 if none yet
+    cv::Mat_<float> distSq; // ||blurred background - blurred foreground||^2
+  };
+
+  Level full; // only touched by the refinement after construction
+  Level preview; // empty if the images are no wider than the preview
 
   int sliderThreshVal;
   float threshMax;
@@ -59,21 +73,68 @@ class TrackVar {
   float threshold;
   int closing;
 
+  PreviewRefiner refiner; // last, so it stops refining before the levels go away
+
   static void onChange(int, void* object) {
     reinterpret_cast<TrackVar*>(object)->update();
   }
 
  private:
-  void update() {
-    threshold = threshMax * sliderThreshVal / sliderThreshMaxCount;
-    const cv::Mat_<bool> mask =
-        background_subtraction::generateForegroundMask<PixelType, PixelTypeFloat>(
-            imageBg, imageFg, blur, threshold, closing);
+  // Same mask as background_subtraction::generateForegroundMask, reusing the level's blur
+  cv::Mat_<PixelType> overlayMask(
+      Level& level,
+      const int blurFull,
+      const float thresholdIn,
+      const int closingFull,
+      const PreviewRefiner::IsCancelled& isCancelled) const {
+    const int blurLevel = std::round(blurFull * level.scale);
+    if (level.blur != blurLevel) {
+      const cv::Mat_<cv::Vec3f> bgBlurred =
+          background_subtraction::blurBackground(level.imageBg, blurLevel);
+      if (isCancelled()) {
+        return cv::Mat_<PixelType>();
+      }
+      const cv::Mat_<cv::Vec3f> fgBlurred =
+          background_subtraction::blurBackground(level.imageFg, blurLevel);
+      const cv::Mat_<cv::Vec3f> diff = fgBlurred - bgBlurred;
+      cv::transform(diff.mul(diff), level.distSq, cv::Matx13f(1, 1, 1));
+      level.blur = blurLevel;
+    }
+    if (isCancelled()) {
+      return cv::Mat_<PixelType>();
+    }
+
+    cv::Mat_<bool> mask = (level.distSq > thresholdIn * thresholdIn) / 255;
+    background_subtraction::closeForegroundMask(mask, std::round(closingFull * level.scale));
+    if (isCancelled()) {
+      return cv::Mat_<PixelType>();
+    }
     cv::Mat_<PixelType> maskPt = cv_util::convertImage<PixelType>(255.0f * mask);
     maskPt.setTo(green, mask);
     cv::Mat_<PixelType> overlay;
-    cv::addWeighted(imageFg, 1.0, maskPt, 0.5, 0, overlay);
-    imshow(winName, overlay);
+    cv::addWeighted(level.imageFg, 1.0, maskPt, 0.5, 0, overlay);
+    return overlay;
+  }
+
+  void update() {
+    threshold = threshMax * sliderThreshVal / sliderThreshMaxCount;
+
+    const int blurIn = blur;
+    const float thresholdIn = threshold;
+    const int closingIn = closing;
+    cv::Mat_<PixelType> previewOverlay;
+    if (!preview.imageFg.empty()) {
+      const auto never = [] { return false; };
+      previewOverlay = resizeImage(
+          overlayMask(preview, blurIn, thresholdIn, closingIn, never),
+          full.imageFg.size(),
+          cv::INTER_NEAREST);
+    }
+    refiner.request(
+        previewOverlay,
+        [this, blurIn, thresholdIn, closingIn](const PreviewRefiner::IsCancelled& isCancelled) {
+          return cv::Mat(overlayMask(full, blurIn, thresholdIn, closingIn, isCancelled));
+        });
   }
 
  public:
@@ -81,18 +142,24 @@ class TrackVar {
       const std::string& imageBgPath,
       const std::string& imageFgPath,
       const int width,
+      const int previewWidth,
       const int blurMaxIn,
       const float threshMaxIn,
       const int closingMaxIn)
-      : threshMax(threshMaxIn), blur(1), threshold(0.04f), closing(4) {
+      : threshMax(threshMaxIn), blur(1), threshold(0.04f), closing(4), refiner(winName) {
     // Load (and scale) images
-    imageBg = loadImage<PixelType>(imageBgPath);
-    imageFg = loadImage<PixelType>(imageFgPath);
-    CHECK_EQ(imageBg.size(), imageFg.size());
-    const double scale = width > 0 ? double(width) / imageBg.cols : 1.0;
+    full.imageBg = loadImage<PixelType>(imageBgPath);
+    full.imageFg = loadImage<PixelType>(imageFgPath);
+    CHECK_EQ(full.imageBg.size(), full.imageFg.size());
+    const double scale = width > 0 ? double(width) / full.imageBg.cols : 1.0;
     if (width > 0) {
-      imageBg = scaleImage(imageBg, scale);
-      imageFg = scaleImage(imageFg, scale);
+      full.imageBg = scaleImage(full.imageBg, scale);
+      full.imageFg = scaleImage(full.imageFg, scale);
+    }
+    if (previewWidth > 0 && previewWidth < full.imageFg.cols) {
+      preview.scale = double(previewWidth) / full.imageFg.cols;
+      preview.imageBg = scaleImage(full.imageBg, preview.scale);
+      preview.imageFg = scaleImage(full.imageFg, preview.scale);
     }
 
     // Initialize values
@@ -109,6 +176,10 @@ class TrackVar {
     update();
   }
 
+  int waitKey() {
+    return refiner.waitKey();
+  }
+
   int getBlur() {
     return blur;
   }
@@ -130,6 +201,7 @@ int main(int argc, char* argv[]) {
   CHECK_NE(FLAGS_fullsize_fg_image, "");
   CHECK_GT(FLAGS_blur_radius_max, 0);
   CHECK_GT(FLAGS_morph_closing_size_max, 0);
+  CHECK_GE(FLAGS_preview_width, 0);
   CHECK_GE(FLAGS_width, 0);
 
   const float threshMax = 1.0f;
@@ -137,12 +209,13 @@ int main(int argc, char* argv[]) {
       FLAGS_fullsize_bg_image,
       FLAGS_fullsize_fg_image,
       FLAGS_width,
+      FLAGS_preview_width,
       FLAGS_blur_radius_max,
       threshMax,
       FLAGS_morph_closing_size_max);
 
   LOG(INFO) << "Press any key to exit.";
-  cv::waitKey(0);
+  trackVar.waitKey();
 
   LOG(INFO) << folly::sformat("{}={}", blurFlag, trackVar.getBlur());
   LOG(INFO) << folly::sformat("{}={:.3e}", threshFlag, trackVar.getThreshold());
@@ -163,12 +163,15 @@ void renderReprojections(
   }
 }
 
-std::vector<FeatureList> generateFeatures(const Camera::Rig& rig, const PointCloud& pointCloud) {
+std::vector<FeatureList> generateFeatures(
+    const Camera::Rig& rig,
+    const PointCloud& pointCloud,
+    const PointCloudIndex& pointCloudIndex) {
   LOG(INFO) << "Loading images";
   const std::vector<Image> images = loadChannels(rig);
 
   const std::vector<PointCloudProjection>& projectedPointClouds =
-      generateProjectedImages(pointCloud, rig);
+      generateProjectedImages(pointCloud, pointCloudIndex, rig, FLAGS_threads);
 
   if (FLAGS_debug_dir != "") {
     const filesystem::path initialProjectionDir =
@@ -369,8 +372,9 @@ int main(int argc, char* argv[]) {
 
   LOG(INFO) << "Loading point cloud";
   const PointCloud& pointCloud = extractPoints(FLAGS_point_cloud, FLAGS_threads);
+  const PointCloudIndex pointCloudIndex = buildIndex(pointCloud);
 
-  std::vector<FeatureList> allFeatures = generateFeatures(rig, pointCloud);
+  std::vector<FeatureList> allFeatures = generateFeatures(rig, pointCloud, pointCloudIndex);
 
   if (FLAGS_debug_dir != "") {
     const filesystem::path matchesDir = filesystem::path(FLAGS_debug_dir) / "matches";
@@ -396,7 +400,7 @@ int main(int argc, char* argv[]) {
     const filesystem::path finalProjectionDir =
         filesystem::path(FLAGS_debug_dir) / "final_projections";
     const std::vector<PointCloudProjection>& projectedPointClouds =
-        generateProjectedImages(pointCloud, transformedRig);
+        generateProjectedImages(pointCloud, pointCloudIndex, transformedRig, FLAGS_threads);
     saveDebugImages(transformedRig, projectedPointClouds, finalProjectionDir);
 
     const filesystem::path finalDisparityDir =
@@ -7,14 +7,18 @@
 
 #include "source/rig/RigAligner.h"
 
+#include <algorithm>
 #include <random>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
+#include <folly/String.h>
 
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 
@@ -27,6 +31,10 @@ const std::string kUsageMessage = R"(
      --rig_in=/path/to/rigs/rig.json \
      --rig_reference=/path/to/rigs/reference.json \
      --rig_out=/path/to/rigs/aligned.json
+
+   - A sequence of takes is aligned in one run by passing comma-separated lists to --rig_in and
+   --rig_out. Takes are split into --threads runs of consecutive takes that are solved
+   concurrently, each solve starting from the solution for the previous take of its run.
  )";
 
 DEFINE_bool(lock_rotation, false, "don't rotate the rig");
@@ -36,10 +44,11 @@ DEFINE_bool(
     randomize_rig,
     false,
     "create a test rig by applying a random rotation, translation and scale to the original rig");
-DEFINE_string(rig_in, "", "path to rig .json file (required)");
-DEFINE_string(rig_out, "", "path to output rig .json file (required)");
+DEFINE_string(rig_in, "", "path to rig .json file, or comma-separated sequence of them (required)");
+DEFINE_string(rig_out, "", "path to output rig .json file, one per --rig_in (required)");
 DEFINE_string(rig_reference, "", "path to the reference rig .json file (required)");
 DEFINE_double(rng_seed, 1, "random number generator seed");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_string(transformed_rig, "", "path to transformed test rig .json file");
 
 Camera::Rig randomizeRig(Camera::Rig rig, int seed) {
@@ -76,19 +85,53 @@ int main(int argc, char* argv[]) {
   CHECK_NE(FLAGS_rig_reference, "");
   CHECK_NE(FLAGS_rig_out, "");
 
+  std::vector<std::string> rigPaths;
+  std::vector<std::string> rigOutPaths;
+  folly::split(",", FLAGS_rig_in, rigPaths, true);
+  folly::split(",", FLAGS_rig_out, rigOutPaths, true);
+  CHECK_EQ(rigPaths.size(), rigOutPaths.size()) << "need one --rig_out per --rig_in";
+  CHECK(!FLAGS_randomize_rig || rigPaths.size() == 1) << "can only randomize a single rig";
+
   // Read in the rig and reference rig
   LOG(INFO) << "Loading the cameras";
-  Camera::Rig rig = Camera::loadRig(FLAGS_rig_in);
   const Camera::Rig referenceRig = Camera::loadRig(FLAGS_rig_reference);
-
-  if (FLAGS_randomize_rig) {
-    // Randomly transform the original rig
-    LOG(INFO) << "Randomizing rig";
-    rig = randomizeRig(rig, FLAGS_rng_seed);
+  if (rigPaths.size() == 1) {
+    Camera::Rig rig = Camera::loadRig(FLAGS_rig_in);
+    if (FLAGS_randomize_rig) {
+      // Randomly transform the original rig
+      LOG(INFO) << "Randomizing rig";
+      rig = randomizeRig(rig, FLAGS_rng_seed);
+    }
+    const Camera::Rig transformedRig =
+        alignRig(rig, referenceRig, FLAGS_lock_rotation, FLAGS_lock_translation, FLAGS_lock_scale);
+    Camera::saveRig(FLAGS_rig_out, transformedRig);
+    return 0;
   }
-  const Camera::Rig transformedRig =
-      alignRig(rig, referenceRig, FLAGS_lock_rotation, FLAGS_lock_translation, FLAGS_lock_scale);
-  Camera::saveRig(FLAGS_rig_out, transformedRig);
+
+  // Takes drift slowly, so each solve of a run starts from the previous take's solution
+  const int takeCount = rigPaths.size();
+  const int threads = ThreadPool::getThreadCountFromFlag(FLAGS_threads);
+  const int runCount = std::max(1, std::min(takeCount, threads));
+  parallelFor(
+      0,
+      runCount,
+      1,
+      [&](const int run) {
+        RigTransform transform;
+        for (int i = run * takeCount / runCount; i < (run + 1) * takeCount / runCount; ++i) {
+          const Camera::Rig rig = Camera::loadRig(rigPaths[i]);
+          const Camera::Rig transformedRig = alignRig(
+              rig,
+              referenceRig,
+              transform,
+              FLAGS_lock_rotation,
+              FLAGS_lock_translation,
+              FLAGS_lock_scale);
+          Camera::saveRig(rigOutPaths[i], transformedRig);
+          LOG(INFO) << folly::sformat("Aligned {} to {}", rigPaths[i], rigOutPaths[i]);
+        }
+      },
+      FLAGS_threads);
 
   return 0;
 }
@@ -128,16 +128,26 @@ Camera::Rig transformRig(
   return result;
 }
 
+// Rotation, translation and scale that transformRig applies to a rig
+struct RigTransform {
+  Camera::Vector3 rotation = Camera::Vector3(0, 0, 0);
+  Camera::Vector3 translation = Camera::Vector3(0, 0, 0);
+  Eigen::UniformScaling<double> scale = Eigen::UniformScaling<double>(1);
+};
+
+// The solve starts from transform, e.g. the solution for the previous take of a sequence, and
+// stores its solution there. Locked parameters keep their starting value
 Camera::Rig alignRig(
     const Camera::Rig& rig,
     const Camera::Rig& referenceRig,
+    RigTransform& transform,
     bool lockRotation = false,
     bool lockTranslation = false,
     bool lockScale = false) {
   ceres::Problem problem;
-  Camera::Vector3 rotation(0, 0, 0);
-  Camera::Vector3 translation(0, 0, 0);
-  Eigen::UniformScaling<double> scale(1);
+  Camera::Vector3& rotation = transform.rotation;
+  Camera::Vector3& translation = transform.translation;
+  Eigen::UniformScaling<double>& scale = transform.scale;
 
   for (int i = 0; i < int(rig.size()); ++i) {
     const Camera& referenceCamera = Camera::findCameraById(rig[i].id, referenceRig);
@@ -173,4 +183,14 @@ Camera::Rig alignRig(
   const Camera::Rig transformedRig = transformRig(rig, rotation, translation, scale);
   return transformedRig;
 }
+
+Camera::Rig alignRig(
+    const Camera::Rig& rig,
+    const Camera::Rig& referenceRig,
+    bool lockRotation = false,
+    bool lockTranslation = false,
+    bool lockScale = false) {
+  RigTransform transform;
+  return alignRig(rig, referenceRig, transform, lockRotation, lockTranslation, lockScale);
+}
 } // namespace fb360_dep
@@ -5,6 +5,7 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -13,6 +14,7 @@
 
 #include "source/util/Camera.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 
@@ -59,6 +61,7 @@ DEFINE_string(rotate_cam_z, "", "rotate camera to align with z");
 DEFINE_int32(sample_count, 100000, "number of samples");
 DEFINE_double(scale_resolution, 1, "scale camera resolutions");
 DEFINE_bool(show_timing, false, "visualize time as well as spatial overlap");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_bool(z_is_down, false, "modify rig from y-is-up to z-is-down");
 DEFINE_bool(z_is_up, false, "modify rig from y-is-up to z-is-up");
 DEFINE_double(scale_rig, 1, "scale rig space, e.g., by 1e-2 to convert from cm to m");
@@ -92,6 +95,43 @@ std::vector<Camera::Vector3> discardPoles(
   return result;
 }
 
+// Calls fn(i, c, pixel) for each of points that camera rig[c] sees, one camera at a time through
+// the batch Camera::pixels()
+template <typename Fn>
+void forEachSeen(const Camera::Rig& rig, const std::vector<Camera::Vector3>& points, Fn&& fn) {
+  for (int c = 0; c < int(rig.size()); ++c) {
+    const Camera& camera = rig[c];
+    const std::vector<Camera::Vector2> pixels = camera.pixels(points);
+    for (int i = 0; i < int(points.size()); ++i) {
+      if (!camera.isOutsideFov(points[i]) && !camera.isOutsideSensor(pixels[i])) {
+        fn(i, c, pixels[i]);
+      }
+    }
+  }
+}
+
+// Number of cameras of rig that see each point, batches of points in parallel
+std::vector<int> getCoverage(const Camera::Rig& rig, const std::vector<Camera::Vector3>& points) {
+  const int kBatchSize = 4096;
+  std::vector<int> coverage(points.size());
+  const int batchCount = (int(points.size()) + kBatchSize - 1) / kBatchSize;
+  parallelFor(
+      0,
+      batchCount,
+      1,
+      [&](const int batch) {
+        const int begin = batch * kBatchSize;
+        const int end = std::min(begin + kBatchSize, int(points.size()));
+        const std::vector<Camera::Vector3> batchPoints(
+            points.begin() + begin, points.begin() + end);
+        forEachSeen(rig, batchPoints, [&](const int i, const int, const Camera::Vector2&) {
+          ++coverage[begin + i];
+        });
+      },
+      FLAGS_threads);
+  return coverage;
+}
+
 Camera::Matrix3 rotationMatrixFromEulers(const Camera::Vector3& euler, bool xyz = true) {
   Eigen::AngleAxis<Camera::Real> x(euler.x(), Camera::Vector3::UnitX());
   Eigen::AngleAxis<Camera::Real> y(euler.y(), Camera::Vector3::UnitY());
@@ -342,6 +382,7 @@ void saveRigObj(const std::string& filename, const Camera::Rig& rig) {
   writeArrowObj(file, {1, 1, 0}, {0, 0, -1}, {0, 0, 1}, {1, 0, 0}, {0, 1, 0}, 1.0, 0.01);
 }
 
+// Rows are computed in parallel, then written in order
 void saveCamera(const std::string& filename, const std::string& camId, const Camera::Rig& rig) {
   for (const Camera& cam : rig) {
     if (cam.id != camId) {
@@ -349,33 +390,82 @@ void saveCamera(const std::string& filename, const std::string& camId, const Cam
     }
     const int kDimX = cam.resolution.x();
     const int kDimY = cam.resolution.y();
+    std::vector<std::vector<int>> counts(kDimY, std::vector<int>(kDimX));
+    parallelFor(
+        0,
+        kDimY,
+        1,
+        [&](const int y) {
+          std::vector<int> xs;
+          std::vector<Camera::Vector2> pixels;
+          for (int x = 0; x < kDimX; ++x) {
+            const Camera::Vector2 p(x + 0.5, y + 0.5);
+            if (!cam.isOutsideImageCircle(p)) {
+              xs.push_back(x);
+              pixels.push_back(p);
+            }
+          }
+          const std::vector<Camera::Vector3> points = cam.rigs(pixels, FLAGS_overlap_distance);
+          forEachSeen(rig, points, [&](const int i, const int, const Camera::Vector2&) {
+            ++counts[y][xs[i]];
+          });
+        },
+        FLAGS_threads);
+
     std::ofstream file(filename, std::ios::binary);
     file << "P2" << std::endl;
     file << kDimX << " " << kDimY << std::endl;
     file << rig.size() << std::endl;
     for (int y = 0; y < kDimY; ++y) {
       for (int x = 0; x < kDimX; ++x) {
-        const Camera::Vector2 p(x + 0.5, y + 0.5);
-        int count = 0;
-        if (!cam.isOutsideImageCircle(p)) {
-          const Camera::Vector3 pWorld = cam.rig(p, FLAGS_overlap_distance);
-          for (const Camera& camera : rig) {
-            if (camera.sees(pWorld)) {
-              ++count;
-            }
-          }
-        }
-        file << count << " ";
+        file << counts[y][x] << " ";
       }
       file << std::endl;
     }
   }
 }
 
+// Rows are computed in parallel, then written in order
 void saveEquirect(const std::string& filename, const Camera::Rig& rig) {
   const int kPixelsPerDegree = 5;
   const int kDimX = 360 * kPixelsPerDegree;
   const int kDimY = 180 * kPixelsPerDegree;
+  std::vector<std::vector<int>> counts(kDimY, std::vector<int>(kDimX));
+  std::vector<std::vector<double>> minTimingDiffs(kDimY, std::vector<double>(kDimX));
+  parallelFor(
+      0,
+      kDimY,
+      1,
+      [&](const int y) {
+        // latitude goes from pi/2 down to -pi/2
+        Camera::Real lat = M_PI / 2 - (y + 0.5) / kDimY * M_PI;
+        std::vector<Camera::Vector3> points(kDimX);
+        for (int x = 0; x < kDimX; ++x) {
+          // lon goes from -pi up to pi
+          Camera::Real lon = -M_PI + (x + 0.5) / kDimX * 2 * M_PI;
+          Camera::Vector3 direction(cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat));
+          points[x] = direction * FLAGS_overlap_distance;
+        }
+        // Normalized timing distance assuming all the cameras' pixel clocks are synced and
+        // single line activated/reset rolling shutter
+        std::vector<std::vector<float>> timings(kDimX);
+        forEachSeen(rig, points, [&](const int x, const int c, const Camera::Vector2& p) {
+          timings[x].push_back(p.y() / rig[c].resolution.y());
+        });
+        for (int x = 0; x < kDimX; ++x) {
+          const std::vector<float>& timing = timings[x];
+          double minTimingDiff = 1.0;
+          for (int i = 0; i < int(timing.size()); ++i) {
+            for (int j = i + 1; j < int(timing.size()); ++j) {
+              minTimingDiff = std::min(minTimingDiff, double(std::abs(timing[i] - timing[j])));
+            }
+          }
+          counts[y][x] = timing.size();
+          minTimingDiffs[y][x] = minTimingDiff;
+        }
+      },
+      FLAGS_threads);
+
   std::ofstream file(filename, std::ios::binary);
   file << "P2" << std::endl;
   file << kDimX << " " << kDimY << std::endl;
@@ -388,34 +478,8 @@ void saveEquirect(const std::string& filename, const Camera::Rig& rig) {
   double maxMin = 0;
   double aveMin = 0;
   for (int y = 0; y < kDimY; ++y) {
-    // latitude goes from pi/2 down to -pi/2
-    Camera::Real lat = M_PI / 2 - (y + 0.5) / kDimY * M_PI;
     for (int x = 0; x < kDimX; ++x) {
-      // lon goes from -pi up to pi
-      Camera::Real lon = -M_PI + (x + 0.5) / kDimX * 2 * M_PI;
-      Camera::Vector3 direction(cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat));
-      std::vector<float> timing(rig.size());
-      int count = 0;
-      for (const Camera& camera : rig) {
-        Camera::Vector2 p;
-        if (camera.sees(direction * FLAGS_overlap_distance, p)) {
-          // Normalized timing distance assuming all the cameras'
-          // pixel clocks are synced and single line activated/reset rolling
-          // shutter.
-          timing[count] = p.y() / camera.resolution.y();
-          // Count this camera
-          ++count;
-        }
-      }
-      double minTimingDiff = 1.0;
-      double maxTimingDiff = 0.0;
-      for (int i = 0; i < count; ++i) {
-        for (int j = i + 1; j < count; ++j) {
-          const double timingDiff = std::abs(timing[i] - timing[j]);
-          minTimingDiff = std::min(minTimingDiff, timingDiff);
-          maxTimingDiff = std::max(maxTimingDiff, timingDiff);
-        }
-      }
+      const double minTimingDiff = minTimingDiffs[y][x];
       maxMin = std::max(maxMin, minTimingDiff);
       aveMin += minTimingDiff;
 
@@ -423,9 +487,9 @@ void saveEquirect(const std::string& filename, const Camera::Rig& rig) {
         const int timeWeightedCount = int((1.0 - minTimingDiff) * 255.0);
         file << timeWeightedCount << " ";
       } else {
-        file << count << " ";
+        file << counts[y][x] << " ";
       }
-      holes += (0 == count) ? 1 : 0;
+      holes += (0 == counts[y][x]) ? 1 : 0;
     }
     file << std::endl;
   }
@@ -438,21 +502,22 @@ void saveEquirect(const std::string& filename, const Camera::Rig& rig) {
 
 void saveCrossSection(const std::string& filename, const Camera::Rig& rig) {
   const int kDim = 400;
+  std::vector<Camera::Vector3> points;
+  for (int y = 0; y < kDim; ++y) {
+    for (int x = 0; x < kDim; ++x) {
+      // points are distributed within +/-0.5 * (kDim, kDim)
+      points.emplace_back(x + 0.5 - 0.5 * kDim, y + 0.5 - 0.5 * kDim, 0);
+    }
+  }
+  const std::vector<int> coverage = getCoverage(rig, points);
+
   std::ofstream file(filename, std::ios::binary);
   file << "P2" << std::endl;
   file << kDim << " " << kDim << std::endl;
   file << rig.size() << std::endl;
   for (int y = 0; y < kDim; ++y) {
     for (int x = 0; x < kDim; ++x) {
-      // points are distributed within +/-0.5 * (kDim, kDim)
-      Camera::Vector3 point(x + 0.5 - 0.5 * kDim, y + 0.5 - 0.5 * kDim, 0);
-      int count = 0;
-      for (const Camera& camera : rig) {
-        if (camera.sees(point)) {
-          ++count;
-        }
-      }
-      file << count << " ";
+      file << coverage[y * kDim + x] << " ";
     }
     file << std::endl;
   }
@@ -564,15 +629,14 @@ int main(int argc, char* argv[]) {
     Camera::Real distance = FLAGS_min_distance / (1 - frac);
 
     // Compute coverage for each sample
+    std::vector<Camera::Vector3> points(samples.size());
+    for (int i = 0; i < int(samples.size()); ++i) {
+      points[i] = distance * samples[i];
+    }
+    const std::vector<int> coverage = getCoverage(rig, points);
     Eigen::VectorXd coverages(samples.size());
     for (int i = 0; i < int(samples.size()); ++i) {
-      int coverage = 0;
-      for (const Camera& camera : rig) {
-        if (camera.sees(distance * samples[i])) {
-          ++coverage;
-        }
-      }
-      coverages[i] = coverage;
+      coverages[i] = coverage[i];
     }
 
     // Report results
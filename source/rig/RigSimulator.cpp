@@ -6,11 +6,13 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cfloat>
 #include <cstdlib>
 #include <fstream>
 #include <functional>
+#include <memory>
 #include <string>
-#include <thread>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -19,12 +21,15 @@
 #include <folly/Format.h>
 
 #include "source/render/BoundingVolumeHierarchy.h"
+#include "source/render/NoiseTexture.h"
 #include "source/render/PerlinNoise.h"
 #include "source/render/RaytracingPrimitives.h"
 #include "source/util/Camera.h"
+#include "source/util/CameraModel.h"
 #include "source/util/CvUtil.h"
 #include "source/util/MathUtil.h"
 #include "source/util/SystemUtil.h"
+#include "source/util/ThreadPool.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::cv_util;
@@ -80,6 +85,10 @@ DEFINE_bool(
     false,
     "if true, adds a marble (perlin noise) texture to the objects in the scene");
 DEFINE_double(marble_scale, 0.1, "scale applied to marble texture");
+DEFINE_double(
+    marble_texture_resolution,
+    8,
+    "samples per unit of marble noise in its precomputed texture (0 = exact noise at every hit)");
 DEFINE_double(
     max_icosahedron_dist,
     250,
@@ -115,7 +124,9 @@ DEFINE_double(
     0.218,
     "radius of the rig/sphere of cameras (m). distance from center to lens exit pupil.");
 DEFINE_string(scene, "icosahedron", "scene to draw: 'icosahedron', 'cube', 'ground_plane'");
+DEFINE_int32(seed, 1, "seed of the random scene and camera noise");
 DEFINE_string(skybox_path, "res/skybox.jpg", "path to image to use as background/skybox");
+DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_double(top_cam_vertical_offset, 13.0, "distance from center plane to top camera");
 
 namespace icosahedron_data {
@@ -165,41 +176,41 @@ void makeIcosahedron(
   }
 }
 
-RayIntersectionResult raytraceBVH(const Ray& ray, const BoundingVolumeHierarchy& bvh) {
-  RayIntersectionResult closestIntersection(false, FLT_MAX, -1);
-
-  // if the ray misses the bvh, it misses everything
-  if (!rayIntersectSphereYesNo(ray, bvh.sphere)) {
-    return closestIntersection;
-  }
-
-  if (bvh.isLeaf) { // if its a leaf, do intersection with triangles in the leaf
-    for (int i = 0; i < int(bvh.leafTriangles.size()); ++i) {
-      RayIntersectionResult triResult = rayIntersectTriangle(ray, bvh.leafTriangles[i]);
-      if (triResult.hit && triResult.dist < closestIntersection.dist) {
-        closestIntersection = triResult;
-      }
-    }
-  } else { // if not a leaf, do intersection with child bvh's
-    for (int i = 0; i < int(bvh.children.size()); ++i) {
-      RayIntersectionResult childResult = raytraceBVH(ray, bvh.children[i]);
-      if (childResult.hit && childResult.dist < closestIntersection.dist) {
-        closestIntersection = childResult;
+// Built in main() unless --marble_texture_resolution is 0
+std::unique_ptr<NoiseTexture> marbleTexture;
+
+// Marble noise is sampled on a grid over the box of the scene, see NoiseTexture
+void buildMarbleTexture(const std::vector<Triangle>& triangles) {
+  cv::Vec3f lo(FLT_MAX, FLT_MAX, FLT_MAX);
+  cv::Vec3f hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (const Triangle& triangle : triangles) {
+    for (const cv::Vec3f& v : {triangle.v0, triangle.v1, triangle.v2}) {
+      const cv::Vec3f p = FLAGS_marble_scale * v;
+      for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = std::min(lo[axis], p[axis]);
+        hi[axis] = std::max(hi[axis], p[axis]);
       }
     }
   }
-  return closestIntersection;
+  marbleTexture =
+      std::make_unique<NoiseTexture>(lo, hi, FLAGS_marble_texture_resolution, FLAGS_threads);
+  LOG(INFO) << folly::sformat(
+      "marble texture has {} samples, {} per unit",
+      marbleTexture->getSampleCount(),
+      marbleTexture->getSamplesPerUnit());
 }
 
-// returns BGR-D (D=depth)
-cv::Vec4f traceRayToGetColor(
+float marbleNoise(const cv::Vec3f& point) {
+  const cv::Vec3f p = FLAGS_marble_scale * point;
+  return marbleTexture ? marbleTexture->lookup(p) : perlin_noise::pnoise(p[0], p[1], p[2]);
+}
+
+// returns BGR-D (D=depth) of ray, given its intersection with the geometry in the bvh
+cv::Vec4f shadeRay(
     const Ray& ray,
+    const RayIntersectionResult& intersectionResult,
     const std::vector<Triangle>& triangles,
-    const BoundingVolumeHierarchy& bvh,
     const cv::Mat_<cv::Vec3b>& skybox) {
-  // intersect with geometry in bvh
-  RayIntersectionResult intersectionResult = raytraceBVH(ray, bvh);
-
   // intersect with a textured rectangle above the rig
   if (!FLAGS_ceiling_path.empty()) {
     // solve r(depth).z = ceiling_position <=>
@@ -243,12 +254,7 @@ cv::Vec4f traceRayToGetColor(
   const cv::Vec3f intersectionPoint = ray.origin + intersectionResult.dist * ray.dir;
 
   if (FLAGS_marble) {
-    baseColor *= 0.7f +
-        0.3f *
-            std::fabs(perlin_noise::pnoise(
-                FLAGS_marble_scale * intersectionPoint[0],
-                FLAGS_marble_scale * intersectionPoint[1],
-                FLAGS_marble_scale * intersectionPoint[2]));
+    baseColor *= 0.7f + 0.3f * std::fabs(marbleNoise(intersectionPoint));
   }
 
   const static cv::Vec3f kLightPos(2.0f, 1.0f, 5.2f);
@@ -260,6 +266,15 @@ cv::Vec4f traceRayToGetColor(
   return cv::Vec4f(shadedColor[0], shadedColor[1], shadedColor[2], intersectionResult.dist);
 }
 
+// returns BGR-D (D=depth)
+cv::Vec4f traceRayToGetColor(
+    const Ray& ray,
+    const std::vector<Triangle>& triangles,
+    const BoundingVolumeHierarchy& bvh,
+    const cv::Mat_<cv::Vec3b>& skybox) {
+  return shadeRay(ray, bvh.intersect(ray), triangles, skybox);
+}
+
 void makeIcosahedronScene(std::vector<Triangle>& triangles) {
   for (int i = 0; i < FLAGS_num_random_icosahedrons; ++i) {
     const float minAllowedCenterDist = FLAGS_min_icosahedron_dist + FLAGS_max_icosahedron_radius;
@@ -423,7 +438,7 @@ std::vector<Camera> makeHorizontalRingOfFThetaCameras(
 // place an ftheta camera on a sphere of some specified radius and pointing
 // forward in the direction of the sphere normal.
 Camera makeFThetaCameraOnSphere(
-    const float /*sphereRadius*/,
+    const float sphereRadius,
     const Camera::Vector3& normal,
     const int pixelWidth,
     const int pixelHeight,
@@ -434,7 +449,7 @@ Camera makeFThetaCameraOnSphere(
 
   Camera camera = makeGenericFTheta(pixelWidth, pixelHeight, imageCircleRadius, circleFov);
 
-  camera.position = imageCircleRadius * normal;
+  camera.position = sphereRadius * normal;
   Camera::Vector3 right = normal.cross(worldUp).normalized();
   camera.setRotation(normal, normal.cross(-right));
   camera.id = id;
@@ -587,72 +602,112 @@ std::pair<cv::Mat_<cv::Vec3f>, cv::Mat_<cv::Vec3f>> renderStereoEquirect(
   return std::make_pair(downscale(eqrImageLeft, aas), downscale(eqrImageRight, aas));
 }
 
-void renderCamera(
-    const Camera& cam,
+// ray packets trace tiles of neighboring pixels, so they walk the bvh together
+static const int kPacketTileWidth = 2;
+static const int kPacketTileHeight = BoundingVolumeHierarchy::kPacketSize / kPacketTileWidth;
+
+// renders rows [yBegin, yEnd) of cam's supersampled image and depth map
+// cam is a CameraModel, so the loop is compiled once per camera type
+template <typename Model>
+void renderCameraRows(
+    const Model& cam,
     const std::vector<Triangle>& triangles,
     const BoundingVolumeHierarchy& bvh,
     const cv::Mat_<cv::Vec3b>& skybox,
-    cv::Mat_<cv::Vec3f>& destImage,
-    cv::Mat_<float>& destDepthMap) {
+    cv::Mat_<cv::Vec3f>& image,
+    cv::Mat_<float>& depthMap,
+    const int yBegin,
+    const int yEnd) {
   const int aas = FLAGS_anti_alias_supersample;
-  cv::Mat_<cv::Vec3f> image(cv::Size(cam.resolution.x() * aas, cam.resolution.y() * aas));
+  std::vector<Ray> rays;
+  std::vector<cv::Point> pixels;
+  std::vector<RayIntersectionResult> results;
+  for (int y0 = yBegin; y0 < yEnd; y0 += kPacketTileHeight) {
+    for (int x0 = 0; x0 < image.cols; x0 += kPacketTileWidth) {
+      rays.clear();
+      pixels.clear();
+      for (int y = y0; y < std::min(y0 + kPacketTileHeight, yEnd); ++y) {
+        for (int x = x0; x < std::min(x0 + kPacketTileWidth, image.cols); ++x) {
+          const Camera::Vector2 pixel((x + 0.5f) / aas, (y + 0.5f) / aas);
+          if (cam.isOutsideImageCircle(pixel)) {
+            image(y, x) = cv::Vec3f(0, 0, 0);
+            depthMap(y, x) = FLT_MAX;
+            continue;
+          }
+          const Camera::Ray rig = cam.rig(pixel);
+          rays.emplace_back(
+              cv::Vec3f(rig.origin().x(), rig.origin().y(), rig.origin().z()),
+              cv::Vec3f(rig.direction().x(), rig.direction().y(), rig.direction().z()));
+          pixels.emplace_back(x, y);
+        }
+      }
+      if (rays.empty()) {
+        continue;
+      }
 
-  cv::Mat_<float> depthMap(image.size());
-  for (int y = 0; y < image.rows; ++y) {
-    if (y % 100 == 0) {
-      LOG(INFO) << y;
-    }
-    for (int x = 0; x < image.cols; ++x) {
-      const Camera::Vector2 pixel((x + 0.5f) / aas, (y + 0.5f) / aas);
-      cv::Vec4f colorAndDepth;
-      if (cam.isOutsideImageCircle(pixel)) {
-        colorAndDepth = {0, 0, 0, FLT_MAX};
-      } else {
-        const Camera::Ray rig = cam.rig(pixel);
-        const Ray rigCv(
-            cv::Vec3f(rig.origin().x(), rig.origin().y(), rig.origin().z()),
-            cv::Vec3f(rig.direction().x(), rig.direction().y(), rig.direction().z()));
-        colorAndDepth = traceRayToGetColor(rigCv, triangles, bvh, skybox);
+      results.assign(rays.size(), RayIntersectionResult::miss());
+      bvh.intersect(rays.data(), rays.size(), results.data());
+      for (int i = 0; i < int(rays.size()); ++i) {
+        const cv::Vec4f colorAndDepth = shadeRay(rays[i], results[i], triangles, skybox);
+        image(pixels[i]) = 255.0f * head3(colorAndDepth);
+        depthMap(pixels[i]) = colorAndDepth[3];
       }
-      image(y, x) = 255.0f * head3(colorAndDepth);
-      depthMap(y, x) = colorAndDepth[3];
     }
   }
-  destImage = downscale(image, aas);
-  destDepthMap = downscale(depthMap, aas);
+}
+
+// downscales, adds noise and writes a rendered camera
+void saveCamera(
+    const Camera& cam,
+    const cv::Mat_<cv::Vec3f>& image,
+    const cv::Mat_<float>& depthMap,
+    const std::string& destDir) {
+  const int aas = FLAGS_anti_alias_supersample;
+  cv::Mat_<cv::Vec3f> destImage = downscale(image, aas);
+  const cv::Mat_<float> destDepthMap = downscale(depthMap, aas);
   corruptImageWithNoise(destImage);
+  imwriteExceptionOnFail(destDir + "/" + cam.id + ".png", destImage);
+  imwriteExceptionOnFail(destDir + "/" + cam.id + "_depth.png", destDepthMap);
+  writeCvMat32FC1ToPFM(destDir + "/" + cam.id + "_depth.pfm", destDepthMap);
 }
 
+// Cameras are split into blocks of rows, all rendered on the shared thread pool, so every core
+// stays busy until the last block regardless of how much of each camera is skybox or outside the
+// image circle. The last block of a camera to finish saves it while the other cameras render
 void renderCamerasThreaded(
     const cv::Mat_<cv::Vec3b>& skybox,
     const std::vector<Triangle>& triangles,
     const BoundingVolumeHierarchy& bvh,
     const std::vector<Camera>& cameras,
     const std::string destDir) {
-  std::vector<std::thread> renderThreads;
-  std::vector<cv::Mat_<cv::Vec3f>> images(cameras.size(), cv::Mat_<cv::Vec3f>());
-  std::vector<cv::Mat_<float>> depthMaps(cameras.size(), cv::Mat_<float>());
+  const int aas = FLAGS_anti_alias_supersample;
+  const int kRowsPerBlock = 8 * kPacketTileHeight;
+  std::vector<cv::Mat_<cv::Vec3f>> images(cameras.size());
+  std::vector<cv::Mat_<float>> depthMaps(cameras.size());
+  std::vector<std::atomic<int>> blocksLeft(cameras.size());
   for (int i = 0; i < int(cameras.size()); ++i) {
-    LOG(INFO) << folly::sformat("------ rendering camera {}", i);
-    renderThreads.emplace_back(
-        renderCamera,
-        std::ref(cameras[i]),
-        std::ref(triangles),
-        std::ref(bvh),
-        std::ref(skybox),
-        std::ref(images[i]),
-        std::ref(depthMaps[i]));
-  }
-
-  for (auto& renderThread : renderThreads) {
-    renderThread.join();
+    const cv::Size size(cameras[i].resolution.x() * aas, cameras[i].resolution.y() * aas);
+    images[i].create(size);
+    depthMaps[i].create(size);
+    blocksLeft[i] = (size.height + kRowsPerBlock - 1) / kRowsPerBlock;
   }
 
-  for (int i = 0; i < int(images.size()); ++i) {
-    imwriteExceptionOnFail(destDir + "/" + cameras[i].id + ".png", images[i]);
-    imwriteExceptionOnFail(destDir + "/" + cameras[i].id + "_depth.png", depthMaps[i]);
-    writeCvMat32FC1ToPFM(destDir + "/" + cameras[i].id + "_depth.pfm", depthMaps[i]);
+  ThreadPool threadPool(FLAGS_threads);
+  for (int i = 0; i < int(cameras.size()); ++i) {
+    for (int yBegin = 0; yBegin < images[i].rows; yBegin += kRowsPerBlock) {
+      threadPool.spawn([&, i, yBegin] {
+        const int yEnd = std::min(yBegin + kRowsPerBlock, images[i].rows);
+        withCameraModel(cameras[i], [&](const auto& cam) {
+          renderCameraRows(cam, triangles, bvh, skybox, images[i], depthMaps[i], yBegin, yEnd);
+        });
+        if (--blocksLeft[i] == 0) {
+          saveCamera(cameras[i], images[i], depthMaps[i], destDir);
+          LOG(INFO) << folly::sformat("------ rendered camera {}", cameras[i].id);
+        }
+      });
+    }
   }
+  threadPool.join();
 }
 
 int main(int argc, char** argv) {
@@ -660,6 +715,7 @@ int main(int argc, char** argv) {
 
   CHECK_NE(FLAGS_mode, "");
   CHECK_NE(FLAGS_skybox_path, "");
+  srand(FLAGS_seed);
 
   // load skybox
   cv::Mat_<cv::Vec3b> skybox = imreadExceptionOnFail(FLAGS_skybox_path, cv::IMREAD_COLOR);
@@ -682,17 +738,14 @@ int main(int argc, char** argv) {
     triangles[i].selfIdx = i;
   }
 
+  if (FLAGS_marble && FLAGS_marble_texture_resolution > 0 && !triangles.empty()) {
+    buildMarbleTexture(triangles);
+  }
+
   // build bounding volume hierarchy
   LOG(INFO) << "building BVH";
-  const static int kBVHStopNumTrianglesInLeaf = 20;
-  const static int kBVHSplitK = 5;
-  const static int kBVHMaxDepth = 50;
-  BoundingVolumeHierarchy bvh = BoundingVolumeHierarchy::makeBVH(
-      triangles,
-      kBVHStopNumTrianglesInLeaf,
-      kBVHSplitK,
-      0, // start at depth = 0
-      kBVHMaxDepth);
+  const BoundingVolumeHierarchy bvh(triangles);
+  LOG(INFO) << folly::sformat("BVH has {} nodes", bvh.getNodeCount());
 
   if (FLAGS_mode == "mono_eqr") {
     CHECK_NE(FLAGS_dest_mono, "");
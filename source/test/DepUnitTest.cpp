@@ -5,6 +5,7 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
 #include "source/util/CvUtil.h"
@@ -12,5 +13,6 @@
 int main(int argc, char** argv) {
   ::cv::setNumThreads(1);
   ::testing::InitGoogleTest(&argc, argv);
+  gflags::ParseCommandLineFlags(&argc, &argv, true); // e.g. --perf_baseline, see PerfBaseline.h
   return RUN_ALL_TESTS();
 }
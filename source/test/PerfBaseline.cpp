@@ -0,0 +1,89 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/test/PerfBaseline.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Format.h>
+#include <folly/json.h>
+
+#include "source/util/FilesystemUtil.h"
+
+DEFINE_string(perf_baseline, "", "path to baseline timings .json (empty = skip timed tests)");
+DEFINE_double(perf_tolerance, 0.25, "fraction a timed test may exceed its baseline by");
+DEFINE_bool(perf_update, false, "write measured timings to --perf_baseline instead of checking");
+
+namespace fb360_dep {
+namespace perf_test {
+
+bool isEnabled() {
+  return !FLAGS_perf_baseline.empty();
+}
+
+double timeBestOf(const std::function<void()>& fn, const int repetitions) {
+  double best = DBL_MAX;
+  for (int i = 0; i < repetitions; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+void expectNoRegression(
+    const std::string& name,
+    const std::function<void()>& fn,
+    const int repetitions) {
+  CHECK(isEnabled());
+  const double ms = timeBestOf(fn, repetitions);
+
+  folly::dynamic baselines = folly::dynamic::object;
+  std::string json;
+  if (filesystem::exists(FLAGS_perf_baseline)) {
+    CHECK(folly::readFile(FLAGS_perf_baseline.c_str(), json))
+        << "cannot read " << FLAGS_perf_baseline;
+    baselines = folly::parseJson(json);
+  }
+
+  if (FLAGS_perf_update) {
+    baselines[name] = ms;
+    folly::json::serialization_opts opts;
+    opts.pretty_formatting = true;
+    opts.sort_keys = true;
+    json = folly::json::serialize(baselines, opts) + "\n";
+    CHECK(folly::writeFile(json, FLAGS_perf_baseline.c_str()))
+        << "cannot write " << FLAGS_perf_baseline;
+    LOG(INFO) << folly::sformat("{}: baseline set to {:.3f} ms", name, ms);
+    return;
+  }
+
+  const folly::dynamic* baseline = baselines.get_ptr(name);
+  if (!baseline) {
+    ADD_FAILURE() << folly::sformat(
+        "{}: {:.3f} ms, no baseline in {}, record one with --perf_update",
+        name,
+        ms,
+        FLAGS_perf_baseline);
+    return;
+  }
+  const double limit = baseline->asDouble() * (1 + FLAGS_perf_tolerance);
+  EXPECT_LE(ms, limit) << folly::sformat(
+      "{}: {:.3f} ms, baseline {:.3f} ms", name, ms, baseline->asDouble());
+  LOG(INFO) << folly::sformat("{}: {:.3f} ms, baseline {:.3f} ms", name, ms, baseline->asDouble());
+}
+
+} // namespace perf_test
+} // namespace fb360_dep
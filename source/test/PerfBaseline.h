@@ -0,0 +1,39 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <gflags/gflags.h>
+
+DECLARE_string(perf_baseline);
+DECLARE_double(perf_tolerance);
+DECLARE_bool(perf_update);
+
+namespace fb360_dep {
+namespace perf_test {
+
+// Timed tests are named Perf* and only run when --perf_baseline is set, e.g.
+//   ./DepUnitTest --gtest_filter='*.Perf*' --perf_baseline=res/test/perf_baseline.json
+// Baselines hold milliseconds measured on the reference build machine: refresh them there with
+// --perf_update when a change is meant to move them
+bool isEnabled();
+
+// Best time of fn over repetitions, in milliseconds
+double timeBestOf(const std::function<void()>& fn, const int repetitions);
+
+// Fails the calling test if fn is more than --perf_tolerance slower than the baseline of name
+// With --perf_update, records the time as the new baseline instead
+void expectNoRegression(
+    const std::string& name,
+    const std::function<void()>& fn,
+    const int repetitions = 5);
+
+} // namespace perf_test
+} // namespace fb360_dep
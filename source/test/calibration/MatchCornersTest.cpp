@@ -10,11 +10,11 @@
 
 #include <gtest/gtest.h>
 
-#include <folly/FileUtil.h>
 #include <folly/Format.h>
-#include <folly/json.h>
 
 #include "source/calibration/Calibration.h"
+#include "source/calibration/MatchesFile.h"
+#include "source/test/PerfBaseline.h"
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 
@@ -65,15 +65,11 @@ static const char* testRigJson = R"({
 })";
 
 std::vector<Camera::Vector2> loadCorners(const std::string& path) {
-  std::string json;
-  folly::readFile(path.c_str(), json);
-  folly::dynamic parsed = folly::parseJson(json);
+  const calibration::MatchesData matches = calibration::MatchesData::load(path);
 
   std::vector<Camera::Vector2> corners;
-  for (const auto& image : parsed["images"].items()) {
-    for (const auto& corner : image.second) {
-      corners.push_back(Camera::Vector2(corner["x"].asDouble(), corner["y"].asDouble()));
-    }
+  for (const calibration::MatchesData::ImageCorners& image : matches.images) {
+    corners.insert(corners.end(), image.corners.begin(), image.corners.end());
   }
   return corners;
 }
@@ -112,7 +108,9 @@ void insertIfInsideImage(
   }
 }
 
-TEST(MatchCornersTest, TestTransformationDetection) {
+// Writes the frame of the test rig's camera, squares rotated and translated on black, and returns
+// their corners. Also sets the flags matchCorners() reads
+std::vector<Camera::Vector2> writeTestImage() {
   // flags that need to be defined for calls to MatchCorners
   FLAGS_color = boost::filesystem::unique_path("test_%%%%%%").string();
   FLAGS_frame = "000000";
@@ -127,7 +125,6 @@ TEST(MatchCornersTest, TestTransformationDetection) {
   static const int yGap = 200;
   static const int rows = 3;
   static const int cols = 5;
-  static const double tolerance = 0.25;
 
   static const double angle = 1.0;
   static const double tX = 5.0;
@@ -173,6 +170,18 @@ TEST(MatchCornersTest, TestTransformationDetection) {
 
   cv_util::imwriteExceptionOnFail(folly::sformat("{}/{}.png", testPath, FLAGS_frame), image);
   Camera::saveRig(FLAGS_rig_in, rig);
+  return trueCorners;
+}
+
+void removeTestFiles() {
+  boost::filesystem::remove_all(FLAGS_color);
+  boost::filesystem::remove_all(FLAGS_rig_in);
+  boost::filesystem::remove_all(FLAGS_matches);
+}
+
+TEST(MatchCornersTest, TestTransformationDetection) {
+  static const double tolerance = 0.25;
+  const std::vector<Camera::Vector2> trueCorners = writeTestImage();
 
   matchCorners();
   std::vector<Camera::Vector2> corners = loadCorners(FLAGS_matches);
@@ -197,9 +206,48 @@ TEST(MatchCornersTest, TestTransformationDetection) {
         bestTrueCorner.y());
   }
 
-  boost::filesystem::remove_all(FLAGS_color);
-  boost::filesystem::remove_all(FLAGS_rig_in);
-  boost::filesystem::remove_all(FLAGS_matches);
+  removeTestFiles();
+}
+
+TEST(MatchCornersTest, PerfMatchCorners) {
+  if (!perf_test::isEnabled()) {
+    return;
+  }
+  writeTestImage();
+  perf_test::expectNoRegression("MatchCornersTest.PerfMatchCorners", [] { matchCorners(); }, 3);
+  removeTestFiles();
+}
+
+TEST(MatchCornersTest, TestMatchesFileRoundTrips) {
+  calibration::MatchesData matches;
+  matches.images.push_back(
+      {"cam0/000000.png", {Camera::Vector2(1.5, 2.25), Camera::Vector2(3, 4)}});
+  matches.images.push_back({"cam1/000000.png", {Camera::Vector2(5, 6)}});
+  matches.overlaps.push_back({"cam0/000000.png", "cam1/000000.png", {{0.875, 1, 0}}});
+
+  for (const bool json : {false, true}) {
+    const filesystem::path path = boost::filesystem::unique_path("matches_%%%%%%");
+    matches.save(path, json);
+    calibration::MatchesData loaded = calibration::MatchesData::load(path);
+    boost::filesystem::remove(path);
+
+    // json objects do not keep the order of the images
+    std::sort(loaded.images.begin(), loaded.images.end(), [](const auto& a, const auto& b) {
+      return a.image < b.image;
+    });
+    ASSERT_EQ(loaded.images.size(), matches.images.size());
+    for (int i = 0; i < int(matches.images.size()); ++i) {
+      EXPECT_EQ(loaded.images[i].image, matches.images[i].image);
+      EXPECT_EQ(loaded.images[i].corners, matches.images[i].corners);
+    }
+    ASSERT_EQ(loaded.overlaps.size(), 1);
+    EXPECT_EQ(loaded.overlaps[0].image1, matches.overlaps[0].image1);
+    EXPECT_EQ(loaded.overlaps[0].image2, matches.overlaps[0].image2);
+    ASSERT_EQ(loaded.overlaps[0].matches.size(), 1);
+    EXPECT_EQ(loaded.overlaps[0].matches[0].score, 0.875);
+    EXPECT_EQ(loaded.overlaps[0].matches[0].idx1, 1);
+    EXPECT_EQ(loaded.overlaps[0].matches[0].idx2, 0);
+  }
 }
 
 } // namespace fb360_dep
@@ -0,0 +1,93 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/PatchSet.h"
+
+using namespace fb360_dep::calibration;
+
+namespace {
+
+// zncc computed directly from the definition, in doubles
+double naiveZncc(const std::vector<uint8_t>& p, const std::vector<uint8_t>& q, bool isCustom) {
+  const double n = p.size();
+  double avgP = 0, avgQ = 0;
+  for (size_t i = 0; i < p.size(); ++i) {
+    avgP += p[i] / n;
+    avgQ += q[i] / n;
+  }
+  double dot = 0, varP = 0, varQ = 0;
+  for (size_t i = 0; i < p.size(); ++i) {
+    dot += (p[i] - avgP) * (q[i] - avgQ);
+    varP += (p[i] - avgP) * (p[i] - avgP) / n;
+    varQ += (q[i] - avgQ) * (q[i] - avgQ) / n;
+  }
+  if (isCustom) {
+    const double denominator = std::max(std::sqrt(varP) / avgP, std::sqrt(varQ) / avgQ);
+    return dot / n / (avgP * avgQ) / (denominator * denominator);
+  }
+  return dot / (std::sqrt(varP) * std::sqrt(varQ) * n);
+}
+
+} // namespace
+
+TEST(PatchSetTest, TestMatchesNaiveZncc) {
+  const int kSize = 33;
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> pixel(0, 255);
+  std::normal_distribution<double> noise(0, 20);
+  PatchSet patches0(kSize);
+  PatchSet patches1(kSize);
+  std::vector<std::vector<uint8_t>> pixels0, pixels1;
+  for (int i = 0; i < 50; ++i) {
+    // pairs of similar patches, so that scores cover [-1, 1]
+    std::vector<uint8_t> p(kSize * kSize), q(kSize * kSize);
+    for (int j = 0; j < kSize * kSize; ++j) {
+      p[j] = pixel(rng);
+      const double related = i % 2 ? p[j] : 255 - p[j];
+      q[j] = std::max(0.0, std::min(255.0, related + (i % 5) * noise(rng)));
+    }
+    EXPECT_EQ(patches0.add(p.data(), kSize), i);
+    EXPECT_EQ(patches1.add(q.data(), kSize), i);
+    pixels0.push_back(p);
+    pixels1.push_back(q);
+  }
+
+  for (const bool isCustom : {false, true}) {
+    for (int a = 0; a < patches0.count(); ++a) {
+      for (int b = 0; b < patches1.count(); ++b) {
+        const double expected = naiveZncc(pixels0[a], pixels1[b], isCustom);
+        ASSERT_NEAR(patches0.zncc(a, patches1, b, -1, isCustom), expected, 1e-9);
+        for (const double floor : {-0.5, 0.0, 0.5, 0.9}) {
+          const double score = patches0.zncc(a, patches1, b, floor, isCustom);
+          if (score == -std::numeric_limits<double>::infinity()) {
+            EXPECT_LE(expected, floor + 1e-9) << a << " " << b;
+          } else {
+            EXPECT_NEAR(score, expected, 1e-9) << a << " " << b;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(PatchSetTest, TestFlatPatchIsUndefined) {
+  const int kSize = 5;
+  PatchSet patches(kSize);
+  const std::vector<uint8_t> flat(kSize * kSize, 100);
+  std::vector<uint8_t> ramp(kSize * kSize);
+  for (int i = 0; i < kSize * kSize; ++i) {
+    ramp[i] = i;
+  }
+  patches.add(flat.data(), kSize);
+  patches.add(ramp.data(), kSize);
+  EXPECT_TRUE(std::isnan(patches.zncc(0, patches, 1)));
+  EXPECT_NEAR(patches.zncc(1, patches, 1), 1, 1e-12);
+}
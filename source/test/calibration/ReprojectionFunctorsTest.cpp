@@ -0,0 +1,153 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/ReprojectionFunctors.h"
+#include "source/util/Camera.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::calibration;
+
+static const Camera::Vector2 kPixel = {990, 880};
+
+struct ReprojectionFunctorsTest : ::testing::Test {
+  // cameras of every type with analytic jacobians
+  std::vector<Camera> cameras() const {
+    std::vector<Camera> result;
+    for (const Camera::Type type : {Camera::Type::FTHETA, Camera::Type::RECTILINEAR}) {
+      result.emplace_back(type, Camera::Vector2(2000, 1800), Camera::Vector2(focal, -focal));
+      result.back().position = {0.1, 0.2, -0.05};
+      result.back().setRotation(rotation);
+      result.back().principal = {1010, 890};
+      result.back().setDistortion(distortion);
+    }
+    return result;
+  }
+
+  // points in front of camera, away from its optical axis
+  static std::vector<Camera::Vector3> worlds(const Camera& camera) {
+    return {camera.rig({1500, 400}, 3), camera.rig({300, 1200}, 3)};
+  }
+
+  Camera::Vector3 rotation = {0.1, -0.2, 0.3};
+  Camera::Distortion distortion = {0.05, -0.01, 0.002};
+  Camera::Real focal = 800;
+};
+
+// Compares residuals and jacobians of analytic to those of numeric, which takes ownership of both
+static void expectSameJacobians(
+    ceres::CostFunction* analytic,
+    ceres::CostFunction* numeric,
+    std::vector<double*> parameters) {
+  const std::unique_ptr<ceres::CostFunction> a(analytic);
+  const std::unique_ptr<ceres::CostFunction> n(numeric);
+  ASSERT_EQ(a->parameter_block_sizes(), n->parameter_block_sizes());
+  ASSERT_EQ(parameters.size(), a->parameter_block_sizes().size());
+
+  std::vector<std::vector<double>> aJacobians;
+  std::vector<std::vector<double>> nJacobians;
+  for (const int size : a->parameter_block_sizes()) {
+    aJacobians.emplace_back(2 * size);
+    nJacobians.emplace_back(2 * size);
+  }
+  std::vector<double*> aBlocks;
+  std::vector<double*> nBlocks;
+  for (int i = 0; i < int(aJacobians.size()); ++i) {
+    aBlocks.push_back(aJacobians[i].data());
+    nBlocks.push_back(nJacobians[i].data());
+  }
+  Camera::Vector2 aResiduals;
+  Camera::Vector2 nResiduals;
+  ASSERT_TRUE(a->Evaluate(parameters.data(), aResiduals.data(), aBlocks.data()));
+  ASSERT_TRUE(n->Evaluate(parameters.data(), nResiduals.data(), nBlocks.data()));
+
+  EXPECT_TRUE(aResiduals.isApprox(nResiduals, 1e-9)) << aResiduals << "\n" << nResiduals;
+  for (int i = 0; i < int(aJacobians.size()); ++i) {
+    for (int j = 0; j < int(aJacobians[i].size()); ++j) {
+      const double expected = nJacobians[i][j];
+      EXPECT_NEAR(aJacobians[i][j], expected, 1e-5 * std::max(1.0, std::abs(expected)))
+          << "block " << i << " entry " << j;
+    }
+  }
+}
+
+TEST_F(ReprojectionFunctorsTest, TestReprojection) {
+  const int weight = 4;
+  for (Camera& camera : cameras()) {
+    for (Camera::Vector3 world : worlds(camera)) {
+      expectSameJacobians(
+          ReprojectionFunctor::makeCostFunction(camera, kPixel, weight),
+          ReprojectionFunctor::makeCostFunction(camera, kPixel, weight, false),
+          {camera.position.data(),
+           rotation.data(),
+           camera.principal.data(),
+           &focal,
+           distortion.data(),
+           world.data()});
+    }
+  }
+}
+
+TEST_F(ReprojectionFunctorsTest, TestReprojectionWithoutRotation) {
+  rotation.setZero();
+  for (Camera& camera : cameras()) {
+    for (Camera::Vector3 world : worlds(camera)) {
+      expectSameJacobians(
+          ReprojectionFunctor::makeCostFunction(camera, kPixel, 1),
+          ReprojectionFunctor::makeCostFunction(camera, kPixel, 1, false),
+          {camera.position.data(),
+           rotation.data(),
+           camera.principal.data(),
+           &focal,
+           distortion.data(),
+           world.data()});
+    }
+  }
+}
+
+TEST_F(ReprojectionFunctorsTest, TestSphericalReprojection) {
+  const int weight = 2;
+  const Camera::Vector3 referencePosition(0.05, 0.05, 0);
+  for (Camera& camera : cameras()) {
+    Camera::Real radius;
+    Camera::Real theta;
+    Camera::Real phi;
+    cartesianToSpherical(radius, theta, phi, camera.position - referencePosition);
+    for (Camera::Vector3 world : worlds(camera)) {
+      expectSameJacobians(
+          SphericalReprojectionFunctor::makeCostFunction(
+              camera, kPixel, weight, radius, referencePosition),
+          SphericalReprojectionFunctor::makeCostFunction(
+              camera, kPixel, weight, radius, referencePosition, false),
+          {&theta,
+           &phi,
+           rotation.data(),
+           camera.principal.data(),
+           &focal,
+           distortion.data(),
+           world.data()});
+    }
+  }
+}
+
+TEST_F(ReprojectionFunctorsTest, TestTriangulation) {
+  for (const Camera& camera : cameras()) {
+    for (const Camera::Vector3& world : worlds(camera)) {
+      Camera::Vector3 inv = world / world.squaredNorm();
+      expectSameJacobians(
+          TriangulationFunctor::makeCostFunction(camera, kPixel),
+          TriangulationFunctor::makeCostFunction(camera, kPixel, false),
+          {inv.data()});
+    }
+  }
+}
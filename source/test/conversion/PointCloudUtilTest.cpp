@@ -0,0 +1,193 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "source/conversion/PointCloudUtil.h"
+#include "source/util/FilesystemUtil.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::point_cloud_util;
+
+std::string getTempFile(const std::string& name) {
+  return (filesystem::temp_directory_path() / name).string();
+}
+
+TEST(PointCloudUtilTest, TestAsciiWithPointCount) {
+  const std::string path = getTempFile("PointCloudUtilTest.xyz");
+  {
+    std::ofstream file(path);
+    file << "3\n"
+         << "1 2 3 1 10 20 30\n"
+         << "-1.5e2 .25 4 1 255 0 7\n"
+         << "\n"
+         << "  7 8 9 1 1 2 3\r\n";
+  }
+  EXPECT_EQ(getPointCount(path), 3);
+  const PointCloud points = extractPoints(path, 4);
+  ASSERT_EQ(points.size(), 3);
+  EXPECT_EQ(points[1].coords, Camera::Vector3(-150, 0.25, 4));
+  EXPECT_EQ(points[1].bgrColor, cv::Vec3b(7, 0, 255));
+  EXPECT_EQ(points[2].coords, Camera::Vector3(7, 8, 9));
+}
+
+TEST(PointCloudUtilTest, TestAsciiChunks) {
+  // Large enough to be parsed in several chunks
+  const std::string path = getTempFile("PointCloudUtilTest.txt");
+  const int kCount = 300000;
+  {
+    std::ofstream file(path);
+    for (int i = 0; i < kCount; ++i) {
+      file << i * 0.001 << " " << -i << " 1e-3 1 1 2 3\n";
+    }
+  }
+  const PointCloud points = extractPoints(path, 8);
+  ASSERT_EQ(points.size(), kCount);
+  for (int i = 0; i < kCount; ++i) {
+    ASSERT_NEAR(points[i].coords.x(), i * 0.001, 1e-9) << i;
+    ASSERT_EQ(points[i].coords.y(), -i) << i;
+  }
+}
+
+TEST(PointCloudUtilTest, TestBinaryPcd) {
+  const std::string path = getTempFile("PointCloudUtilTest.pcd");
+  {
+    std::ofstream file(path, std::ios::binary);
+    file << "# .PCD v0.7 - Point Cloud Data file format\n"
+         << "VERSION 0.7\n"
+         << "FIELDS x y z rgb\n"
+         << "SIZE 4 4 4 4\n"
+         << "TYPE F F F U\n"
+         << "COUNT 1 1 1 1\n"
+         << "WIDTH 2\n"
+         << "HEIGHT 1\n"
+         << "VIEWPOINT 0 0 0 1 0 0 0\n"
+         << "POINTS 2\n"
+         << "DATA binary\n";
+    for (int i = 0; i < 2; ++i) {
+      const float coords[3] = {float(i), 2, 3};
+      const uint32_t rgb = 0x102030;
+      file.write(reinterpret_cast<const char*>(coords), sizeof(coords));
+      file.write(reinterpret_cast<const char*>(&rgb), sizeof(rgb));
+    }
+  }
+  const PointCloud points = extractPoints(path, 4);
+  ASSERT_EQ(points.size(), 2);
+  EXPECT_EQ(points[1].coords, Camera::Vector3(1, 2, 3));
+  EXPECT_EQ(points[1].bgrColor, cv::Vec3b(0x30, 0x20, 0x10));
+}
+
+TEST(PointCloudUtilTest, TestBigEndianPly) {
+  const std::string path = getTempFile("PointCloudUtilTest.ply");
+  {
+    std::ofstream file(path, std::ios::binary);
+    file << "ply\n"
+         << "format binary_big_endian 1.0\n"
+         << "element vertex 1\n"
+         << "property double x\n"
+         << "property double y\n"
+         << "property double z\n"
+         << "property uchar red\n"
+         << "property uchar green\n"
+         << "property uchar blue\n"
+         << "element face 0\n"
+         << "property list uchar int vertex_indices\n"
+         << "end_header\n";
+    for (const double coord : {1.5, -2.0, 3.0}) {
+      char bytes[sizeof(coord)];
+      std::memcpy(bytes, &coord, sizeof(coord));
+      std::reverse(bytes, bytes + sizeof(bytes));
+      file.write(bytes, sizeof(bytes));
+    }
+    file << uint8_t(9) << uint8_t(8) << uint8_t(7);
+  }
+  const PointCloud points = extractPoints(path, 4);
+  ASSERT_EQ(points.size(), 1);
+  EXPECT_EQ(points[0].coords, Camera::Vector3(1.5, -2, 3));
+  EXPECT_EQ(points[0].bgrColor, cv::Vec3b(7, 8, 9));
+}
+
+TEST(PointCloudUtilTest, TestIndexMatchesBruteForce) {
+  std::mt19937 rng(1);
+  std::normal_distribution<double> normal(0, 5);
+  PointCloud pointCloud(100000);
+  for (BGRPoint& point : pointCloud) {
+    point.coords = Camera::Vector3(normal(rng), normal(rng), normal(rng) / 5);
+  }
+  const PointCloudIndex index = buildIndex(pointCloud);
+
+  for (int i = 0; i < 12; ++i) {
+    const Camera::Type type = i % 2 ? Camera::Type::FTHETA : Camera::Type::RECTILINEAR;
+    Camera camera(type, {1000, 800}, {300, 300});
+    camera.position = Camera::Vector3(normal(rng), normal(rng), normal(rng));
+    const Camera::Vector3 forward = Camera::Vector3::Random().normalized();
+    camera.setRotation(forward, forward.unitOrthogonal());
+    if (i % 3 == 0) {
+      camera.setFov(M_PI / 2);
+    } else if (i % 3 == 1) {
+      camera.setFov(0.3 + i * 0.1);
+    }
+
+    std::vector<int> expected;
+    for (int p = 0; p < int(pointCloud.size()); ++p) {
+      if (camera.sees(pointCloud[p].coords)) {
+        expected.push_back(p);
+      }
+    }
+    EXPECT_EQ(getVisiblePoints(pointCloud, index, camera), expected) << i;
+  }
+}
+
+TEST(PointCloudUtilTest, TestProjectionMatchesSerial) {
+  std::mt19937 rng(2);
+  std::normal_distribution<double> normal(0, 5);
+  std::uniform_int_distribution<int> color(0, 255);
+  PointCloud pointCloud(100000);
+  for (BGRPoint& point : pointCloud) {
+    point.coords = Camera::Vector3(normal(rng), normal(rng), normal(rng) / 5);
+    point.bgrColor = cv::Vec3b(color(rng), color(rng), color(rng));
+  }
+  // Same coordinates, different colors: the first point wins the tie
+  for (int p = 0; p < 1000; ++p) {
+    pointCloud[pointCloud.size() - 1 - p].coords = pointCloud[p].coords;
+  }
+
+  Camera::Rig rig;
+  for (int i = 0; i < 4; ++i) {
+    Camera camera(Camera::Type::FTHETA, {200, 160}, {60, 60});
+    camera.position = Camera::Vector3(normal(rng), normal(rng), normal(rng));
+    const Camera::Vector3 forward = Camera::Vector3::Random().normalized();
+    camera.setRotation(forward, forward.unitOrthogonal());
+    rig.push_back(camera);
+  }
+
+  const std::vector<PointCloudProjection> projections = generateProjectedImages(pointCloud, rig);
+  ASSERT_EQ(projections.size(), rig.size());
+  for (int i = 0; i < int(rig.size()); ++i) {
+    const Camera& camera = rig[i];
+    cv::Mat_<float> disparity(camera.resolution[1], camera.resolution[0], 0.0f);
+    cv::Mat_<cv::Vec3b> image(disparity.size(), cv::Vec3b(0, 0, 0));
+    for (const BGRPoint& point : pointCloud) {
+      Camera::Vector2 pixel;
+      if (!camera.sees(point.coords, pixel)) {
+        continue;
+      }
+      const float d = 1.0f / (point.coords - camera.position).norm();
+      if (disparity(pixel.y(), pixel.x()) < d) {
+        disparity(pixel.y(), pixel.x()) = d;
+        image(pixel.y(), pixel.x()) = point.bgrColor;
+      }
+    }
+    EXPECT_EQ(cv::norm(projections[i].disparityImage, disparity, cv::NORM_INF), 0) << i;
+    EXPECT_EQ(cv::norm(projections[i].image, image, cv::NORM_INF), 0) << i;
+  }
+}
@@ -0,0 +1,106 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "source/depth_estimation/BilateralFilterGpu.h"
+#include "source/depth_estimation/DerpUtil.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/gpu/GlfwUtil.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+namespace {
+
+class OffscreenContext : public GlWindow {
+ protected:
+  void display() override {}
+};
+
+// Not a multiple of the CPU tile size, with NAN values behind the mask as outside the FOV
+void randomImages(
+    std::mt19937& engine,
+    cv::Mat_<PixelType>& guide,
+    cv::Mat_<float>& image,
+    cv::Mat_<bool>& mask) {
+  std::uniform_int_distribution<int> pixelValue(0, 65535);
+  std::uniform_real_distribution<float> disparity(0.0f, 1.0f);
+  guide.create(45, 70);
+  image.create(45, 70);
+  mask.create(45, 70);
+  for (PixelType& p : guide) {
+    // Close colors, so a good part of the weights is far from zero
+    p = PixelType(pixelValue(engine) / 8, pixelValue(engine) / 8, pixelValue(engine) / 8);
+  }
+  for (int y = 0; y < image.rows; ++y) {
+    for (int x = 0; x < image.cols; ++x) {
+      mask(y, x) = engine() % 5 != 0;
+      image(y, x) = mask(y, x) || x % 2 ? disparity(engine) : NAN;
+    }
+  }
+}
+
+void expectNear(const cv::Mat_<float>& result, const cv::Mat_<float>& expected) {
+  ASSERT_EQ(result.size(), expected.size());
+  for (int y = 0; y < result.rows; ++y) {
+    for (int x = 0; x < result.cols; ++x) {
+      if (std::isnan(expected(y, x))) {
+        EXPECT_TRUE(std::isnan(result(y, x)));
+      } else {
+        EXPECT_NEAR(result(y, x), expected(y, x), 1e-4);
+      }
+    }
+  }
+}
+
+} // namespace
+
+TEST(BilateralFilterGpuTest, TestJointMatchesCpu) {
+  OffscreenContext context;
+  const BilateralFilterGpu gpuFilter;
+  std::mt19937 engine(2);
+  cv::Mat_<PixelType> guide;
+  cv::Mat_<float> image;
+  cv::Mat_<bool> mask;
+  randomImages(engine, guide, image, mask);
+  cv::Mat_<PixelType> neighborGuide;
+  cv::blur(guide, neighborGuide, cv::Size(3, 3));
+
+  for (int radius = 0; radius <= 3; ++radius) {
+    const cv::Mat_<float> expected = generalizedJointBilateralFilter<float, PixelType>(
+        image, guide, neighborGuide, mask, radius, 0.05f, 0.5f, 1.0f, 1.0f);
+    const cv::Mat_<float> result = gpuFilter.generalizedJointBilateralFilter<PixelType>(
+        image, guide, neighborGuide, mask, radius, 0.05f, 0.5f, 1.0f, 1.0f);
+    expectNear(result, expected);
+  }
+}
+
+TEST(BilateralFilterGpuTest, TestTemporalMatchesCpu) {
+  OffscreenContext context;
+  const BilateralFilterGpu gpuFilter;
+  std::mt19937 engine(1);
+  const int numFrames = 3;
+  std::vector<cv::Mat_<PixelType>> guides(numFrames);
+  std::vector<cv::Mat_<float>> images(numFrames);
+  std::vector<cv::Mat_<bool>> masks(numFrames);
+  for (int t = 0; t < numFrames; ++t) {
+    randomImages(engine, guides[t], images[t], masks[t]);
+  }
+
+  for (int radius = 0; radius <= 2; ++radius) {
+    cv::Mat_<float> expected;
+    temporalJointBilateralFilter(
+        guides, images, masks, 1, 0.1f, radius, 1.0f, 0.5f, 0.25f, expected);
+    const cv::Mat_<float> result = gpuFilter.temporalJointBilateralFilter(
+        guides, images, masks, 1, 0.1f, radius, 1.0f, 0.5f, 0.25f);
+    expectNear(result, expected);
+  }
+}
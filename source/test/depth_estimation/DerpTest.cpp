@@ -5,8 +5,15 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
+#include <random>
+
 #include <gtest/gtest.h>
 
+#include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/DerpUtil.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/test/PerfBaseline.h"
 #include "source/test/TestRig.h"
 #include "source/util/ImageUtil.h"
 
@@ -24,4 +31,315 @@ TEST_F(DerpTest, TestUtilFilterDestinations) {
   EXPECT_TRUE(filtered[2].id == testRig[0].id);
 }
 
+TEST_F(DerpTest, TestComputeSSDMatchesReference) {
+  using depth_estimation::PixelType;
+  std::mt19937 engine(1);
+  std::uniform_int_distribution<int> pixelValue(0, 65535);
+  cv::Mat_<PixelType> dstColor(40, 50);
+  cv::Mat_<PixelType> dstSrcColor(40, 50);
+  for (cv::Mat_<PixelType>* image : {&dstColor, &dstSrcColor}) {
+    for (PixelType& p : *image) {
+      p = PixelType(pixelValue(engine), pixelValue(engine), pixelValue(engine));
+    }
+  }
+
+  // Include positions outside the image to exercise clamp-to-edge
+  std::uniform_real_distribution<float> coord(-3.0f, 53.0f);
+  const std::vector<depth_estimation::SSDKernel> kernels = {depth_estimation::SSDKernel::Scalar,
+                                                            depth_estimation::SSDKernel::SSE,
+                                                            depth_estimation::SSDKernel::AVX};
+  for (int radius = 1; radius <= 3; ++radius) { // compile time radii, then the generic one
+    for (int i = 0; i < 1000; ++i) {
+      const int x = radius + engine() % (dstColor.cols - 2 * radius);
+      const int y = radius + engine() % (dstColor.rows - 2 * radius);
+      const float xDstSrc = coord(engine);
+      const float yDstSrc = coord(engine);
+      const PixelType& dstBias = dstColor(y, x);
+      const PixelType& dstSrcBias = dstSrcColor(y, x);
+      const std::pair<float, float> expected = depth_estimation::computeSSDReference(
+          dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, radius);
+      for (const depth_estimation::SSDKernel kernel : kernels) {
+        const std::pair<float, float> ssd = depth_estimation::computeSSD(
+            kernel, dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, radius);
+        EXPECT_NEAR(ssd.first, expected.first, 1e-5 * expected.first + 1e-7);
+        EXPECT_NEAR(ssd.second, expected.second, 1e-5 * expected.second + 1e-7);
+      }
+    }
+  }
+}
+
+TEST_F(DerpTest, TestColorBiasAndVarianceMatchesReference) {
+  using depth_estimation::PixelType;
+  std::mt19937 engine(1);
+  std::uniform_int_distribution<int> pixelValue(0, 65535);
+  cv::Mat_<PixelType> color(70, 50); // more than one block of rows
+  for (PixelType& p : color) {
+    p = PixelType(pixelValue(engine), pixelValue(engine), pixelValue(engine));
+  }
+
+  for (int radius = 0; radius <= 2; ++radius) {
+    const cv::Mat_<PixelType> expectedBias = depth_estimation::colorBias(color, radius);
+    cv::Mat_<PixelType> bias;
+    cv::Mat_<float> variance;
+    depth_estimation::colorBiasAndVariance(&bias, &variance, color, radius);
+    for (int y = 0; y < color.rows; ++y) {
+      for (int x = 0; x < color.cols; ++x) {
+        for (int c = 0; c < PixelType::channels; ++c) {
+          EXPECT_NEAR(bias(y, x)[c], expectedBias(y, x)[c], 1); // rounding
+        }
+      }
+    }
+    if (radius == depth_estimation::kVarWinRadius) {
+      const cv::Mat_<float> expectedVariance = depth_estimation::computeImageVariance(color);
+      EXPECT_LT(cv::norm(variance, expectedVariance, cv::NORM_INF), 1e-5);
+    }
+  }
+}
+
+TEST_F(DerpTest, TestCompactComputeSSDMatchesFullPrecision) {
+  using depth_estimation::CompactPixelType;
+  using depth_estimation::PixelType;
+  std::mt19937 engine(2);
+  std::uniform_int_distribution<int> pixelValue(0, 255);
+  cv::Mat_<PixelType> dstColor(40, 50);
+  cv::Mat_<CompactPixelType> dstSrcCompact(40, 50);
+  for (PixelType& p : dstColor) {
+    p = PixelType(257 * pixelValue(engine), 257 * pixelValue(engine), 257 * pixelValue(engine));
+  }
+  for (CompactPixelType& p : dstSrcCompact) {
+    p = CompactPixelType(pixelValue(engine), pixelValue(engine), pixelValue(engine));
+  }
+
+  // Compact values are exact in 16 bits, so both must see the same colors
+  cv::Mat_<PixelType> dstSrcColor;
+  dstSrcCompact.convertTo(dstSrcColor, dstSrcColor.type(), depth_estimation::kCompactPixelScale);
+  cv::Mat_<CompactPixelType> roundTrip;
+  depth_estimation::compactColor(roundTrip, dstSrcColor);
+  EXPECT_EQ(cv::countNonZero(roundTrip.reshape(1) != dstSrcCompact.reshape(1)), 0);
+
+  std::uniform_real_distribution<float> coord(-3.0f, 53.0f);
+  const int radius = 2;
+  for (int i = 0; i < 1000; ++i) {
+    const int x = radius + engine() % (dstColor.cols - 2 * radius);
+    const int y = radius + engine() % (dstColor.rows - 2 * radius);
+    const float xDstSrc = coord(engine);
+    const float yDstSrc = coord(engine);
+    const PixelType& dstBias = dstColor(y, x);
+    const PixelType& dstSrcBias = dstSrcColor(y, x);
+    const std::pair<float, float> expected = depth_estimation::computeSSD(
+        dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, radius);
+    const depth_estimation::PixelTypeFloat dstSrcBiasFloat = dstSrcBias;
+    const std::pair<float, float> ssd = depth_estimation::computeSSD(
+        dstColor, x, y, dstBias, dstSrcCompact, xDstSrc, yDstSrc, dstSrcBiasFloat, radius);
+    EXPECT_NEAR(ssd.first, expected.first, 1e-5 * expected.first + 1e-7);
+    EXPECT_NEAR(ssd.second, expected.second, 1e-5 * expected.second + 1e-7);
+  }
+}
+
+TEST_F(DerpTest, TestTemporalJointBilateralFilterMatchesReference) {
+  using depth_estimation::PixelType;
+  std::mt19937 engine(1);
+  std::uniform_int_distribution<int> pixelValue(0, 65535);
+  std::uniform_real_distribution<float> disparity(0.0f, 1.0f);
+
+  // Sizes that are not multiples of the tile size, to exercise partial tiles and clamp-to-edge
+  const int numFrames = 3;
+  std::vector<cv::Mat_<PixelType>> guides(numFrames);
+  std::vector<cv::Mat_<float>> images(numFrames);
+  std::vector<cv::Mat_<bool>> masks(numFrames);
+  for (int t = 0; t < numFrames; ++t) {
+    guides[t] = cv::Mat_<PixelType>(45, 70);
+    images[t] = cv::Mat_<float>(45, 70);
+    masks[t] = cv::Mat_<bool>(45, 70);
+    for (PixelType& p : guides[t]) {
+      // Close colors, so a good part of the weights is far from zero
+      p = PixelType(pixelValue(engine) / 8, pixelValue(engine) / 8, pixelValue(engine) / 8);
+    }
+    for (float& d : images[t]) {
+      d = disparity(engine);
+    }
+    for (bool& m : masks[t]) {
+      m = engine() % 5 != 0;
+    }
+  }
+
+  for (int radius = 0; radius <= 2; ++radius) {
+    cv::Mat_<float> expected;
+    depth_estimation::temporalJointBilateralFilterReference(
+        guides, images, masks, 1, 0.1f, radius, 1.0f, 0.5f, 0.25f, expected);
+    cv::Mat_<float> result;
+    depth_estimation::temporalJointBilateralFilter(
+        guides, images, masks, 1, 0.1f, radius, 1.0f, 0.5f, 0.25f, result);
+    ASSERT_EQ(result.size(), expected.size());
+    for (int y = 0; y < result.rows; ++y) {
+      for (int x = 0; x < result.cols; ++x) {
+        EXPECT_NEAR(result(y, x), expected(y, x), 1e-4);
+      }
+    }
+  }
+}
+
+TEST_F(DerpTest, TestJointBilateralFilterMatchesReference) {
+  using depth_estimation::PixelType;
+  std::mt19937 engine(2);
+  std::uniform_int_distribution<int> pixelValue(0, 65535);
+  std::uniform_real_distribution<float> disparity(0.0f, 1.0f);
+
+  // Not a multiple of the tile size, with NAN values behind the mask as outside the FOV
+  cv::Mat_<PixelType> guide(45, 70);
+  cv::Mat_<float> image(45, 70);
+  cv::Mat_<bool> mask(45, 70);
+  for (PixelType& p : guide) {
+    p = PixelType(pixelValue(engine) / 8, pixelValue(engine) / 8, pixelValue(engine) / 8);
+  }
+  for (int y = 0; y < image.rows; ++y) {
+    for (int x = 0; x < image.cols; ++x) {
+      mask(y, x) = engine() % 5 != 0;
+      image(y, x) = mask(y, x) || x % 2 ? disparity(engine) : NAN;
+    }
+  }
+  cv::Mat_<PixelType> neighborGuide;
+  cv::blur(guide, neighborGuide, cv::Size(3, 3));
+
+  for (int radius = 0; radius <= 3; ++radius) {
+    const cv::Mat_<float> expected =
+        depth_estimation::generalizedJointBilateralFilterReference<float, PixelType>(
+            image, guide, neighborGuide, mask, radius, 0.05f, 0.5f, 1.0f, 1.0f);
+    const cv::Mat_<float> result =
+        depth_estimation::generalizedJointBilateralFilter<float, PixelType>(
+            image, guide, neighborGuide, mask, radius, 0.05f, 0.5f, 1.0f, 1.0f);
+    for (int y = 0; y < result.rows; ++y) {
+      for (int x = 0; x < result.cols; ++x) {
+        if (std::isnan(expected(y, x))) {
+          EXPECT_TRUE(std::isnan(result(y, x)));
+        } else {
+          EXPECT_NEAR(result(y, x), expected(y, x), 1e-4);
+        }
+      }
+    }
+  }
+}
+
+// Closest candidates by a stable sort of all of them
+template <size_t kNumNeighbors>
+void testSelectColorCandidates(const cv::Mat_<cv::Vec3b>& lab) {
+  using depth_estimation::candidateTemplateOriginal;
+  for (int y = 0; y < lab.rows; ++y) {
+    for (int x = 0; x < lab.cols; ++x) {
+      std::vector<std::pair<double, std::array<int, 2>>> expected;
+      for (const std::array<int, 2>& offset : candidateTemplateOriginal) {
+        const cv::Point p(x + offset[0], y + offset[1]);
+        if (cv::Rect(0, 0, lab.cols, lab.rows).contains(p)) {
+          expected.emplace_back(cv::norm(lab(y, x), lab(p), cv::NORM_L2), offset);
+        }
+      }
+      std::stable_sort(expected.begin(), expected.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+      });
+      expected.resize(std::min(expected.size(), kNumNeighbors));
+
+      std::array<std::array<int, 2>, kNumNeighbors> selected;
+      const int count = depth_estimation::selectColorCandidates(
+          selected, candidateTemplateOriginal, lab, x, y);
+      ASSERT_EQ(count, int(expected.size()));
+      for (int i = 0; i < count; ++i) {
+        EXPECT_EQ(selected[i], expected[i].second) << x << " " << y << " " << i;
+      }
+    }
+  }
+}
+
+TEST_F(DerpTest, TestSelectColorCandidates) {
+  std::mt19937 engine(1);
+  std::uniform_int_distribution<int> value(0, 7); // few values, so there are ties
+  cv::Mat_<cv::Vec3b> lab(12, 15);
+  for (cv::Vec3b& p : lab) {
+    p = cv::Vec3b(value(engine), value(engine), value(engine));
+  }
+  testSelectColorCandidates<1>(lab);
+  testSelectColorCandidates<4>(lab);
+  testSelectColorCandidates<25>(lab); // more than there are candidates
+}
+
+TEST_F(DerpTest, TestLayerDisparities) {
+  cv::Mat_<float> foreground(40, 30, 0.5f);
+  foreground(3, 4) = NAN;
+  foreground(20, 10) = 0;
+  foreground(39, 29) = -1;
+  const cv::Mat_<float> background(foreground.size(), 0.1f);
+  const cv::Mat_<float> layered = depth_estimation::layerDisparities(foreground, background);
+  for (int y = 0; y < layered.rows; ++y) {
+    for (int x = 0; x < layered.cols; ++x) {
+      const float expected = foreground(y, x) > 0 ? foreground(y, x) : background(y, x);
+      EXPECT_EQ(layered(y, x), expected) << x << " " << y;
+    }
+  }
+}
+
+TEST_F(DerpTest, PerfProcessLevel) {
+  using depth_estimation::PixelType;
+  if (!perf_test::isEnabled()) {
+    return;
+  }
+  Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const int widthFullSize = rig[0].resolution.x();
+  const int heightFullSize = rig[0].resolution.y();
+  Camera::normalizeRig(rig);
+  const int numCams = rig.size();
+  const cv::Size levelSize(168, 108); // test rig resolution / 20
+
+  std::vector<cv::Mat_<PixelType>> colors;
+  cv::theRNG().state = 1;
+  for (int i = 0; i < numCams; ++i) {
+    cv::Mat_<PixelType> color(levelSize);
+    cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(65535));
+    cv::GaussianBlur(color, color, cv::Size(5, 5), 0);
+    colors.push_back(color);
+  }
+
+  // Single level pyramid, solved from scratch every repetition
+  const int level = 0;
+  perf_test::expectNoRegression("DerpTest.PerfProcessLevel", [&] {
+    depth_estimation::PyramidLevel<PixelType> pyramidLevel(
+        0, // frameIdx
+        "000000",
+        1, // numFrames
+        level,
+        1, // numLevels
+        std::map<int, cv::Size>{{level, levelSize}},
+        rig,
+        rig,
+        depth_estimation::mapSrcToDstIndexes(rig, rig),
+        colors,
+        cv_util::generateAllPassMasks(levelSize, numCams),
+        depth_estimation::generateFovMasks(rig, levelSize, -1),
+        std::vector<cv::Mat_<float>>(numCams),
+        widthFullSize,
+        heightFullSize,
+        "", // color
+        4e-5, // varNoiseFloor
+        1e-3, // varHighThresh
+        false, // useForegroundMasks
+        "", // outputRoot
+        -1); // threads
+    depth_estimation::processLevel(
+        pyramidLevel,
+        "", // outputFormats
+        false, // useForegroundMasks
+        "", // outputRoot
+        2, // numRandomProposals
+        false, // partialCoverage
+        0.5, // minDepthM
+        1e4, // maxDepthM
+        true, // doMedianFilter
+        false, // saveDebugImages
+        1, // pingPongIterations
+        -1, // mismatchesStartLevel
+        true, // doBilateralFilter
+        -1, // threads
+        nullptr, // backend
+        false); // saveOutputs
+  });
+}
+
 } // namespace fb360_dep
@@ -0,0 +1,82 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include "source/isp/Filter.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+using Boundary = isp::ReflectBoundary<int>;
+
+cv::Mat_<cv::Vec3f> randomImage(const int rows, const int cols) {
+  cv::Mat_<cv::Vec3f> image(rows, cols);
+  cv::RNG rng(1);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 1);
+  return image;
+}
+
+} // namespace
+
+TEST(FilterTest, TestIirLowPassMatchesReference) {
+  // Sizes that are not multiples of the blocks, and wider than tall
+  for (const cv::Size& size : {cv::Size(53, 37), cv::Size(17, 64), cv::Size(2, 2)}) {
+    const cv::Mat_<cv::Vec3f> image = randomImage(size.height, size.width);
+    const Boundary boundary;
+    const float kAmount = 0.01f;
+    const float kMaxVal = 0.9f; // clamps some pixels
+    cv::Mat_<cv::Vec3f> expected(size);
+    isp::iirLowPassReference<Boundary, Boundary, cv::Vec3f>(
+        image, kAmount, expected, boundary, boundary, kMaxVal);
+    for (const int threads : {0, -1}) {
+      cv::Mat_<cv::Vec3f> actual(size);
+      isp::iirLowPass<Boundary, Boundary, cv::Vec3f>(
+          image, kAmount, actual, boundary, boundary, kMaxVal, threads);
+      EXPECT_LE(cv::norm(actual, expected, cv::NORM_INF), 1e-6) << size << " threads " << threads;
+    }
+  }
+}
+
+TEST(FilterTest, TestIirLowPassIgnoresBufferContents) {
+  // The output must not depend on what was in the output image before
+  const cv::Mat_<cv::Vec3f> image = randomImage(20, 30);
+  const Boundary boundary;
+  cv::Mat_<cv::Vec3f> zeros(image.size(), cv::Vec3f(0, 0, 0));
+  cv::Mat_<cv::Vec3f> ones(image.size(), cv::Vec3f(1, 1, 1));
+  isp::iirLowPass<Boundary, Boundary, cv::Vec3f>(image, 0.01f, zeros, boundary, boundary, 1.0f);
+  isp::iirLowPass<Boundary, Boundary, cv::Vec3f>(image, 0.01f, ones, boundary, boundary, 1.0f);
+  EXPECT_EQ(cv::norm(zeros, ones, cv::NORM_INF), 0);
+}
+
+TEST(FilterTest, TestParallelDctMatchesCv) {
+  // Sizes that are not multiples of the blocks, nor powers of two
+  for (const cv::Size& size : {cv::Size(94, 130), cv::Size(300, 2), cv::Size(2, 66)}) {
+    cv::Mat_<float> plane(size);
+    cv::RNG rng(1);
+    rng.fill(plane, cv::RNG::UNIFORM, 0, 1);
+    for (const bool inverse : {false, true}) {
+      cv::Mat_<float> expected;
+      cv::dct(plane, expected, inverse ? cv::DCT_INVERSE : 0);
+      for (const int threads : {0, -1}) {
+        cv::Mat_<float> actual = plane.clone();
+        isp::parallelDct(actual, inverse, threads);
+        EXPECT_LE(cv::norm(actual, expected, cv::NORM_INF), 1e-4) << size << " threads " << threads;
+      }
+    }
+  }
+}
+
+TEST(FilterTest, TestOptimalDctSize) {
+  for (const int n : {1, 2, 37, 1000, 3001}) {
+    const int size = isp::getOptimalDctSize(n);
+    EXPECT_GE(size, n);
+    EXPECT_EQ(size % 2, 0);
+    EXPECT_LT(size, n + n / 8 + 2) << "much smaller than the next power of two";
+  }
+}
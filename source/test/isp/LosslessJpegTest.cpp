@@ -0,0 +1,137 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/isp/LosslessJpeg.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+// Minimal decoder for what the encoder writes: one huffman table, predictor 1, no restarts
+std::vector<uint16_t> decode(const std::vector<uint8_t>& jpeg, int& width, int& height) {
+  size_t p = 2; // past start of image
+  auto getShort = [&](const size_t at) { return jpeg[at] << 8 | jpeg[at + 1]; };
+  int precision = 0;
+  int components = 0;
+  std::map<std::pair<int, int>, int> table; // (length, code) -> category
+  while (jpeg[p + 1] != 0xda) {
+    const uint8_t marker = jpeg[p + 1];
+    const size_t segment = p + 4;
+    if (marker == 0xc3) {
+      precision = jpeg[segment];
+      height = getShort(segment + 1);
+      components = jpeg[segment + 5];
+      width = getShort(segment + 3) * components;
+    } else if (marker == 0xc4) {
+      const size_t symbols = segment + 1 + 16;
+      int code = 0;
+      int k = 0;
+      for (int length = 1; length <= 16; ++length, code <<= 1) {
+        for (int n = 0; n < jpeg[segment + length]; ++n, ++k, ++code) {
+          table[{length, code}] = jpeg[symbols + k];
+        }
+      }
+    }
+    p += 2 + getShort(p + 2);
+  }
+  p += 2 + getShort(p + 2);
+
+  std::vector<uint8_t> data; // unstuffed
+  for (; !(jpeg[p] == 0xff && jpeg[p + 1] != 0); ++p) {
+    data.push_back(jpeg[p]);
+    p += jpeg[p] == 0xff;
+  }
+  EXPECT_EQ(jpeg[p + 1], 0xd9) << "end of image";
+
+  size_t bit = 0;
+  auto getBits = [&](const int count) {
+    int value = 0;
+    for (int i = 0; i < count; ++i, ++bit) {
+      value = value << 1 | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    return value;
+  };
+  std::vector<uint16_t> pixels(width * height);
+  for (int i = 0; i < height; ++i) {
+    for (int j = 0; j < width; ++j) {
+      int length = 0;
+      int code = 0;
+      while (!table.count({length, code})) {
+        code = code << 1 | getBits(1);
+        ++length;
+        EXPECT_LE(length, 16);
+      }
+      const int category = table[{length, code}];
+      int diff = category == 16 ? 32768 : getBits(category);
+      if (0 < category && category < 16 && diff < 1 << (category - 1)) {
+        diff -= (1 << category) - 1;
+      }
+      const int prediction = j >= components ? pixels[i * width + j - components]
+                                             : i > 0 ? pixels[(i - 1) * width + j]
+                                                     : 1 << (precision - 1);
+      pixels[i * width + j] = prediction + diff;
+    }
+  }
+  return pixels;
+}
+
+} // namespace
+
+TEST(LosslessJpegTest, TestRoundTrip) {
+  const int kWidth = 64;
+  const int kHeight = 32;
+  const int kStride = kWidth + 6;
+  std::mt19937 rng(1);
+  std::vector<uint16_t> smooth(kHeight * kStride);
+  std::vector<uint16_t> noise(kHeight * kStride);
+  std::vector<uint16_t> flat(kHeight * kStride, 1000);
+  for (int i = 0; i < kHeight; ++i) {
+    for (int j = 0; j < kStride; ++j) {
+      smooth[i * kStride + j] = i * 37 + j * 11 + rng() % 50;
+      noise[i * kStride + j] = rng(); // differences of all 16 bits
+    }
+  }
+  for (const std::vector<uint16_t>* pixels : {&smooth, &noise, &flat}) {
+    const std::vector<uint8_t> jpeg =
+        isp::LosslessJpegEncoder::encode(pixels->data(), kWidth, kHeight, kStride, 16);
+    int width;
+    int height;
+    const std::vector<uint16_t> decoded = decode(jpeg, width, height);
+    ASSERT_EQ(width, kWidth);
+    ASSERT_EQ(height, kHeight);
+    for (int i = 0; i < kHeight; ++i) {
+      for (int j = 0; j < kWidth; ++j) {
+        ASSERT_EQ(decoded[i * kWidth + j], (*pixels)[i * kStride + j]) << i << " " << j;
+      }
+    }
+    if (pixels != &noise) {
+      EXPECT_LT(jpeg.size(), kWidth * kHeight * sizeof(uint16_t) / 2);
+    }
+  }
+}
+
+TEST(LosslessJpegTest, TestEightBits) {
+  std::vector<uint8_t> pixels(16 * 4);
+  for (int i = 0; i < int(pixels.size()); ++i) {
+    pixels[i] = i * 5;
+  }
+  const std::vector<uint8_t> jpeg = isp::LosslessJpegEncoder::encode(pixels.data(), 16, 4, 16, 8);
+  int width;
+  int height;
+  const std::vector<uint16_t> decoded = decode(jpeg, width, height);
+  ASSERT_EQ(decoded.size(), pixels.size());
+  for (int i = 0; i < int(pixels.size()); ++i) {
+    EXPECT_EQ(decoded[i], pixels[i]);
+  }
+}
@@ -0,0 +1,105 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <folly/dynamic.h>
+
+#include "source/mesh_stream/CatalogIndex.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+folly::dynamic makeEntry(const uint64_t offset, const uint64_t size) {
+  return folly::dynamic::object("offset", offset)("size", size);
+}
+
+// Two frames, listed out of order, with cam1 missing from the second one
+folly::dynamic makeCatalog() {
+  folly::dynamic catalog = folly::dynamic::object;
+  catalog["metadata"] = folly::dynamic::object("isLittleEndian", folly::kIsLittleEndian);
+  catalog["frames"] = folly::dynamic::object;
+  uint64_t offset = 0;
+  for (const std::string frame : {"000001", "000000"}) {
+    for (const std::string cam : {"cam0", "cam1"}) {
+      if (frame == "000001" && cam == "cam1") {
+        continue;
+      }
+      folly::dynamic camera = makeEntry(offset, 300);
+      camera[".bc7"] = makeEntry(offset, 100);
+      camera[".vtx"] = makeEntry(offset + 100, 120);
+      camera[".idx"] = makeEntry(offset + 220, 80);
+      catalog["frames"][frame][cam] = camera;
+      offset += 1024;
+    }
+  }
+  return catalog;
+}
+
+} // namespace
+
+TEST(CatalogIndexTest, TestMatchesCatalog) {
+  const folly::dynamic catalog = makeCatalog();
+  const filesystem::path path = filesystem::unique_path("fused_%%%%%%.index");
+  ASSERT_TRUE(CatalogIndex::write(catalog, path));
+  const std::unique_ptr<CatalogIndex> index = CatalogIndex::load(path);
+  ASSERT_NE(index, nullptr);
+
+  ASSERT_EQ(index->getFrameCount(), 2);
+  EXPECT_EQ(index->getFrameName(0), "000000");
+  EXPECT_EQ(index->getFrameName(1), "000001");
+  EXPECT_EQ(index->getCameraCount(), 2);
+  EXPECT_EQ(index->getExtensionCount(), 3);
+  EXPECT_EQ(index->findCamera("cam2"), -1);
+  EXPECT_EQ(index->findExtension(".rgba"), -1);
+  for (int frame = 0; frame < index->getFrameCount(); ++frame) {
+    const folly::dynamic& frameLayout = catalog["frames"][index->getFrameName(frame)];
+    for (const std::string cam : {"cam0", "cam1"}) {
+      const int camera = index->findCamera(cam);
+      ASSERT_GE(camera, 0);
+      const folly::dynamic* cameraLayout = frameLayout.get_ptr(cam);
+      if (!cameraLayout) {
+        EXPECT_EQ(index->getCamera(frame, camera).size, 0u);
+        continue;
+      }
+      const uint64_t offset = (*cameraLayout)["offset"].getInt();
+      EXPECT_EQ(index->getCamera(frame, camera).offset, offset);
+      for (const std::string extension : {".bc7", ".vtx", ".idx"}) {
+        const CatalogIndex::Extent& extent =
+            index->getExtent(frame, camera, index->findExtension(extension));
+        EXPECT_EQ(extent.offset, uint64_t((*cameraLayout)[extension]["offset"].getInt()));
+        EXPECT_EQ(extent.size, uint64_t((*cameraLayout)[extension]["size"].getInt()));
+      }
+    }
+  }
+  filesystem::remove(path);
+}
+
+TEST(CatalogIndexTest, TestEncodedIsNotIndexed) {
+  folly::dynamic catalog = makeCatalog();
+  catalog["frames"]["000000"]["cam0"][".vtx"]["encoding"] = "vtx";
+  const filesystem::path path = filesystem::unique_path("fused_%%%%%%.index");
+  EXPECT_FALSE(CatalogIndex::write(catalog, path));
+  EXPECT_FALSE(filesystem::exists(path));
+  EXPECT_EQ(CatalogIndex::load(path), nullptr);
+}
+
+TEST(CatalogIndexTest, TestStripeSize) {
+  folly::dynamic catalog = makeCatalog();
+  const filesystem::path path = filesystem::unique_path("fused_%%%%%%.index");
+  ASSERT_TRUE(CatalogIndex::write(catalog, path));
+  EXPECT_EQ(CatalogIndex::load(path)->getStripeSize(), kDefaultStripeSize); // not recorded
+
+  const uint64_t stripeSize = 4 * 1024 * 1024;
+  catalog["metadata"][kStripeSizeKey] = stripeSize;
+  ASSERT_TRUE(CatalogIndex::write(catalog, path));
+  EXPECT_EQ(CatalogIndex::load(path)->getStripeSize(), stripeSize);
+  filesystem::remove(path);
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/mesh_stream/MeshCodec.h"
+
+using namespace fb360_dep;
+
+template <typename T>
+std::vector<uint8_t> toBytes(const std::vector<T>& values) {
+  std::vector<uint8_t> result(values.size() * sizeof(T));
+  std::memcpy(result.data(), values.data(), result.size());
+  return result;
+}
+
+TEST(MeshCodecTest, TestVertexesRoundTrip) {
+  // Pixel coordinates and disparities, like the ones in a .vtx
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> pixel(0, 2048);
+  std::uniform_real_distribution<float> disparity(0.01f, 2);
+  std::vector<float> vertexes;
+  for (int i = 0; i < 1000; ++i) {
+    vertexes.push_back(pixel(rng));
+    vertexes.push_back(pixel(rng));
+    vertexes.push_back(disparity(rng));
+  }
+  vertexes.push_back(5); // constant axis: empty range
+  vertexes.push_back(5);
+  vertexes.push_back(1);
+
+  std::vector<uint8_t> data = toBytes(vertexes);
+  const folly::dynamic entry = mesh_codec::encode(data, ".vtx", "lz4");
+  ASSERT_TRUE(mesh_codec::isEncoded(entry));
+  EXPECT_EQ(mesh_codec::getDecodedSize(entry), vertexes.size() * sizeof(float));
+
+  folly::dynamic stored = entry;
+  stored["size"] = uint64_t(data.size());
+  std::vector<float> decoded(vertexes.size());
+  mesh_codec::decode(reinterpret_cast<uint8_t*>(decoded.data()), data.data(), stored);
+  for (int i = 0; i < int(vertexes.size()); ++i) {
+    const float step = i % 3 == 2 ? 2.0f / 65535 : 2048.0f / 65535;
+    EXPECT_NEAR(decoded[i], vertexes[i], step) << i;
+  }
+}
+
+TEST(MeshCodecTest, TestIndexesRoundTrip) {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<uint32_t> index(0, 100000);
+  std::vector<uint32_t> indexes = {0, 1, 2, 2, 1, 3, 0xffffffff, 0};
+  for (int i = 0; i < 3000; ++i) {
+    indexes.push_back(index(rng));
+  }
+
+  std::vector<uint8_t> data = toBytes(indexes);
+  folly::dynamic entry = mesh_codec::encode(data, ".idx", "lz4");
+  ASSERT_TRUE(mesh_codec::isEncoded(entry));
+  entry["size"] = uint64_t(data.size());
+
+  std::vector<uint32_t> decoded(indexes.size());
+  mesh_codec::decode(reinterpret_cast<uint8_t*>(decoded.data()), data.data(), entry);
+  EXPECT_EQ(decoded, indexes);
+}
+
+TEST(MeshCodecTest, TestGpuRoundTrip) {
+  // An odd number of vertexes, so the quantized array needs padding
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> pixel(0, 2048);
+  std::vector<float> vertexes;
+  for (int i = 0; i < 3 * 333; ++i) {
+    vertexes.push_back(pixel(rng));
+  }
+  std::vector<uint8_t> vtx = toBytes(vertexes);
+  folly::dynamic vtxEntry = mesh_codec::encode(vtx, ".vtx", mesh_codec::kGpu);
+  ASSERT_TRUE(mesh_codec::isEncoded(vtxEntry));
+  EXPECT_EQ(vtxEntry["encoding"].getString(), mesh_codec::kUnorm16);
+  EXPECT_EQ(vtx.size() % sizeof(uint32_t), 0);
+  vtxEntry["size"] = uint64_t(vtx.size());
+  std::vector<float> decodedVertexes(vertexes.size());
+  mesh_codec::decode(reinterpret_cast<uint8_t*>(decodedVertexes.data()), vtx.data(), vtxEntry);
+  for (int i = 0; i < int(vertexes.size()); ++i) {
+    EXPECT_NEAR(decodedVertexes[i], vertexes[i], 2048.0f / 65535) << i;
+  }
+
+  // Triangles of a grid, indexes within a block are a couple of rows apart
+  const uint32_t kWidth = 1000;
+  std::vector<uint32_t> indexes;
+  for (uint32_t y = 0; y + 1 < 100; ++y) {
+    for (uint32_t x = 0; x + 1 < kWidth; ++x) {
+      const uint32_t i = y * kWidth + x;
+      for (const uint32_t corner : {i, i + 1, i + kWidth, i + 1, i + kWidth + 1, i + kWidth}) {
+        indexes.push_back(corner);
+      }
+    }
+  }
+  indexes.pop_back(); // a partial last block
+  std::vector<uint8_t> idx = toBytes(indexes);
+  folly::dynamic idxEntry = mesh_codec::encode(idx, ".idx", mesh_codec::kGpu);
+  ASSERT_TRUE(mesh_codec::isEncoded(idxEntry));
+  EXPECT_EQ(idxEntry["encoding"].getString(), mesh_codec::kBlock16);
+  EXPECT_LT(idx.size(), indexes.size() * sizeof(uint32_t));
+  idxEntry["size"] = uint64_t(idx.size());
+  std::vector<uint32_t> decodedIndexes(indexes.size());
+  mesh_codec::decode(reinterpret_cast<uint8_t*>(decodedIndexes.data()), idx.data(), idxEntry);
+  EXPECT_EQ(decodedIndexes, indexes);
+
+  // A block spanning more than 16 bits is left as is
+  const std::vector<uint32_t> wide = {0, 1, 70000};
+  std::vector<uint8_t> wideIdx = toBytes(wide);
+  EXPECT_FALSE(mesh_codec::isEncoded(mesh_codec::encode(wideIdx, ".idx", mesh_codec::kGpu)));
+  EXPECT_EQ(wideIdx, toBytes(wide));
+}
+
+TEST(MeshCodecTest, TestOtherExtensionsAreNotEncoded) {
+  std::vector<uint8_t> data = {1, 2, 3, 4};
+  const folly::dynamic entry = mesh_codec::encode(data, ".bc7", "lz4");
+  EXPECT_FALSE(mesh_codec::isEncoded(entry));
+  EXPECT_EQ(data, std::vector<uint8_t>({1, 2, 3, 4}));
+}
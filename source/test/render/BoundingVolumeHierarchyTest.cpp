@@ -0,0 +1,76 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "source/render/BoundingVolumeHierarchy.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::render;
+
+namespace {
+
+// closest hit by testing every triangle
+RayIntersectionResult bruteForce(const Ray& ray, const std::vector<Triangle>& triangles) {
+  RayIntersectionResult closest(false, FLT_MAX, -1);
+  for (const Triangle& triangle : triangles) {
+    const RayIntersectionResult result = rayIntersectTriangle(ray, triangle);
+    if (result.hit && result.dist < closest.dist) {
+      closest = result;
+    }
+  }
+  return closest;
+}
+
+} // namespace
+
+TEST(BoundingVolumeHierarchyTest, TestMatchesBruteForce) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> position(-100, 100);
+  std::uniform_real_distribution<float> offset(-5, 5);
+  std::vector<Triangle> triangles;
+  for (int i = 0; i < 2000; ++i) {
+    const cv::Vec3f center(position(rng), position(rng), position(rng));
+    triangles.emplace_back(
+        center + cv::Vec3f(offset(rng), offset(rng), offset(rng)),
+        center + cv::Vec3f(offset(rng), offset(rng), offset(rng)),
+        center + cv::Vec3f(offset(rng), offset(rng), offset(rng)),
+        cv::Vec3f(1, 1, 1));
+    triangles.back().selfIdx = i;
+  }
+  const BoundingVolumeHierarchy bvh(triangles);
+
+  // packets of neighboring directions, as from a tile of pixels, from inside and outside the scene
+  std::normal_distribution<float> normal;
+  int hits = 0;
+  for (int packet = 0; packet < 500; ++packet) {
+    const float scale = packet % 2 ? 10 : 200;
+    const cv::Vec3f origin(scale * normal(rng), scale * normal(rng), scale * normal(rng));
+    const cv::Vec3f dir = cv::normalize(cv::Vec3f(normal(rng), normal(rng), normal(rng)));
+    std::vector<Ray> rays;
+    for (int i = 0; i < BoundingVolumeHierarchy::kPacketSize; ++i) {
+      const cv::Vec3f jitter(0.01f * normal(rng), 0.01f * normal(rng), 0.01f * normal(rng));
+      rays.emplace_back(origin, cv::normalize(dir + jitter));
+    }
+    const int count = 1 + packet % BoundingVolumeHierarchy::kPacketSize;
+    std::vector<RayIntersectionResult> results(count, RayIntersectionResult::miss());
+    bvh.intersect(rays.data(), count, results.data());
+    for (int i = 0; i < count; ++i) {
+      const RayIntersectionResult expected = bruteForce(rays[i], triangles);
+      ASSERT_EQ(results[i].hit, expected.hit) << packet << " " << i;
+      if (expected.hit) {
+        EXPECT_EQ(results[i].hitObjectIdx, expected.hitObjectIdx) << packet << " " << i;
+        EXPECT_FLOAT_EQ(results[i].dist, expected.dist) << packet << " " << i;
+        ++hits;
+      }
+      EXPECT_EQ(bvh.intersect(rays[i]).hitObjectIdx, expected.hitObjectIdx);
+    }
+  }
+  EXPECT_GT(hits, 50);
+}
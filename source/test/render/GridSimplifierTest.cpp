@@ -0,0 +1,113 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "source/render/GridSimplifier.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+// Grid laid out like the equi-error meshes of a depth map: pixel x, y and a depth-like z
+Eigen::MatrixXd makeGrid(const int width, const int height, const bool isPlanar) {
+  Eigen::MatrixXd vertexes(width * height, 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      double z = 100 + x / 4.0;
+      if (!isPlanar) {
+        z += 5 * std::sin(x / 7.0) * std::cos(y / 5.0);
+        z *= x < width / 2 ? 1 : 0.5; // tear down the middle
+      }
+      vertexes.row(y * width + x) = Eigen::Vector3d(x + 0.5, y + 0.5, z);
+    }
+  }
+  return vertexes;
+}
+
+} // namespace
+
+TEST(GridSimplifierTest, TestPlaneIsTwoTriangles) {
+  const int kSize = 65;
+  const Eigen::MatrixXd vertexes = makeGrid(kSize, kSize, true);
+  const cv::Mat_<bool> mask(kSize, kSize, true);
+  render::GridSimplifier simplifier(vertexes, mask, 0.95);
+  simplifier.simplify(1000);
+  EXPECT_EQ(simplifier.getFaces().rows(), 2);
+  EXPECT_EQ(simplifier.getVertexes().rows(), 4);
+}
+
+TEST(GridSimplifierTest, TestMasksTearsAndCracks) {
+  const int kWidth = 100;
+  const int kHeight = 70;
+  const float kTearRatio = 0.95;
+  const Eigen::MatrixXd vertexes = makeGrid(kWidth, kHeight, false);
+  cv::Mat_<bool> mask(kHeight, kWidth, true);
+  for (int y = 20; y < 30; ++y) {
+    for (int x = 10; x < 25; ++x) {
+      mask(y, x) = false;
+    }
+  }
+
+  render::GridSimplifier simplifier(vertexes, mask, kTearRatio);
+  const int kNumFacesOut = 3000;
+  simplifier.simplify(kNumFacesOut);
+  const Eigen::MatrixXd vertexesOut = simplifier.getVertexes();
+  const Eigen::MatrixXi facesOut = simplifier.getFaces();
+  EXPECT_LE(facesOut.rows(), kNumFacesOut);
+  EXPECT_GT(facesOut.rows(), kNumFacesOut / 2);
+
+  std::set<std::pair<int, int>> used;
+  for (int i = 0; i < vertexesOut.rows(); ++i) {
+    const int x = vertexesOut(i, 0);
+    const int y = vertexesOut(i, 1);
+    EXPECT_TRUE(mask(y, x)) << x << " " << y;
+    used.emplace(x, y);
+  }
+
+  std::map<std::pair<int, int>, int> edges;
+  for (int i = 0; i < facesOut.rows(); ++i) {
+    Eigen::Vector3d p[3];
+    for (int j = 0; j < 3; ++j) {
+      p[j] = vertexesOut.row(facesOut(i, j));
+    }
+
+    // Same winding as mesh_util::getFaces
+    const double cross = (p[1].x() - p[0].x()) * (p[2].y() - p[0].y()) -
+        (p[1].y() - p[0].y()) * (p[2].x() - p[0].x());
+    EXPECT_LT(cross, 0);
+
+    const double zMin = std::min(p[0].z(), std::min(p[1].z(), p[2].z()));
+    const double zMax = std::max(p[0].z(), std::max(p[1].z(), p[2].z()));
+    EXPECT_GE(zMin, kTearRatio * zMax);
+
+    for (int j = 0; j < 3; ++j) {
+      const int v0 = facesOut(i, j);
+      const int v1 = facesOut(i, (j + 1) % 3);
+      ++edges[std::make_pair(std::min(v0, v1), std::max(v0, v1))];
+
+      // No vertex in the middle of an edge, i.e. no cracks
+      const int x0 = vertexesOut(v0, 0);
+      const int y0 = vertexesOut(v0, 1);
+      const int dx = int(vertexesOut(v1, 0)) - x0;
+      const int dy = int(vertexesOut(v1, 1)) - y0;
+      const int steps = std::max(std::abs(dx), std::abs(dy));
+      for (int s = 1; s < steps; ++s) {
+        EXPECT_EQ(used.count(std::make_pair(x0 + dx / steps * s, y0 + dy / steps * s)), 0);
+      }
+    }
+  }
+  for (const auto& edge : edges) {
+    EXPECT_LE(edge.second, 2);
+  }
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "source/render/MeshSimplifier.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+const int kWidth = 300;
+const int kHeight = 300;
+
+// Grid laid out like the equi-error meshes of a depth map: pixel x, y and a depth-like z
+Eigen::MatrixXd makeGrid(const bool isPlanar) {
+  Eigen::MatrixXd vertexes(kWidth * kHeight, 3);
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < kWidth; ++x) {
+      const double bump = isPlanar ? 0 : 20 * std::sin(x / 30.0) * std::cos(y / 40.0);
+      vertexes.row(y * kWidth + x) = Eigen::Vector3d(x + 0.5, y + 0.5, 100 + 0.1 * x + bump);
+    }
+  }
+  return vertexes;
+}
+
+Eigen::MatrixXi makeFaces() {
+  Eigen::MatrixXi faces(2 * (kWidth - 1) * (kHeight - 1), 3);
+  int i = 0;
+  for (int y = 0; y < kHeight - 1; ++y) {
+    for (int x = 0; x < kWidth - 1; ++x) {
+      const int v = y * kWidth + x;
+      faces.row(i++) = Eigen::Vector3i(v, v + 1, v + kWidth);
+      faces.row(i++) = Eigen::Vector3i(v + 1, v + kWidth + 1, v + kWidth);
+    }
+  }
+  return faces;
+}
+
+void checkMesh(const Eigen::MatrixXd& vertexes, const Eigen::MatrixXi& faces) {
+  std::vector<bool> isUsed(vertexes.rows(), false);
+  for (int i = 0; i < faces.rows(); ++i) {
+    for (int j = 0; j < 3; ++j) {
+      ASSERT_GE(faces(i, j), 0);
+      ASSERT_LT(faces(i, j), vertexes.rows());
+      isUsed[faces(i, j)] = true;
+    }
+    EXPECT_NE(faces(i, 0), faces(i, 1));
+    EXPECT_NE(faces(i, 1), faces(i, 2));
+    EXPECT_NE(faces(i, 2), faces(i, 0));
+  }
+  for (int i = 0; i < vertexes.rows(); ++i) {
+    EXPECT_TRUE(isUsed[i]) << i;
+  }
+}
+
+} // namespace
+
+TEST(MeshSimplifierTest, TestPlaneStaysPlanar) {
+  const Eigen::MatrixXi faces = makeFaces();
+  const int numFacesOut = faces.rows() / 10;
+  for (const int threads : {1, 4}) {
+    render::MeshSimplifier simplifier(makeGrid(true), faces, true, threads);
+    simplifier.simplify(numFacesOut, 0.2);
+    const Eigen::MatrixXd vertexesOut = simplifier.getVertexes();
+    const Eigen::MatrixXi facesOut = simplifier.getFaces();
+    checkMesh(vertexesOut, facesOut);
+    EXPECT_LE(facesOut.rows(), numFacesOut) << threads;
+    EXPECT_GT(facesOut.rows(), numFacesOut * 0.9) << threads;
+    for (int i = 0; i < vertexesOut.rows(); ++i) {
+      EXPECT_NEAR(vertexesOut(i, 2), 100 + 0.1 * (vertexesOut(i, 0) - 0.5), 1e-6) << threads;
+    }
+  }
+}
+
+TEST(MeshSimplifierTest, TestTilesMatchSerial) {
+  const Eigen::MatrixXd vertexes = makeGrid(false);
+  const Eigen::MatrixXi faces = makeFaces();
+  const int numFacesOut = faces.rows() / 20;
+
+  // Max distance from a vertex to the surface
+  auto getError = [](const Eigen::MatrixXd& vertexesOut) {
+    double result = 0;
+    for (int i = 0; i < vertexesOut.rows(); ++i) {
+      const double x = vertexesOut(i, 0) - 0.5;
+      const double y = vertexesOut(i, 1) - 0.5;
+      const double z = 100 + 0.1 * x + 20 * std::sin(x / 30.0) * std::cos(y / 40.0);
+      result = std::max(result, std::abs(vertexesOut(i, 2) - z));
+    }
+    return result;
+  };
+
+  render::MeshSimplifier serial(vertexes, faces, true, 1);
+  serial.simplify(numFacesOut, 0.2);
+  const Eigen::MatrixXd vertexesSerial = serial.getVertexes();
+  checkMesh(vertexesSerial, serial.getFaces());
+
+  render::MeshSimplifier tiled(vertexes, faces, true, 4);
+  tiled.simplify(numFacesOut, 0.2);
+  const Eigen::MatrixXd vertexesTiled = tiled.getVertexes();
+  const Eigen::MatrixXi facesTiled = tiled.getFaces();
+  checkMesh(vertexesTiled, facesTiled);
+  EXPECT_LE(facesTiled.rows(), numFacesOut);
+  EXPECT_GT(facesTiled.rows(), numFacesOut * 0.9);
+  EXPECT_LT(getError(vertexesTiled), 2 * getError(vertexesSerial) + 0.01);
+}
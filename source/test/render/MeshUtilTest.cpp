@@ -0,0 +1,153 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <folly/FileUtil.h>
+
+#include "source/render/MeshUtil.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+using VertexesF = Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor>;
+using FacesU = Eigen::Matrix<uint32_t, Eigen::Dynamic, 3, Eigen::RowMajor>;
+
+const int kWidth = 40;
+const int kHeight = 30;
+const float kTearRatio = 0.95;
+
+// Equi-error grid with a tear down the middle
+Eigen::MatrixXd makeGrid() {
+  Eigen::MatrixXd vertexes(kWidth * kHeight, 3);
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < kWidth; ++x) {
+      double z = 100 + x / 4.0 + 5 * std::sin(x / 7.0) * std::cos(y / 5.0);
+      z *= x < kWidth / 2 ? 1 : 0.5;
+      vertexes.row(y * kWidth + x) = Eigen::Vector3d(x + 0.5, y + 0.5, z);
+    }
+  }
+  return vertexes;
+}
+
+} // namespace
+
+TEST(MeshUtilTest, TestFacesMatchAcrossTypesAndThreads) {
+  const Eigen::MatrixXd vertexes = makeGrid();
+  for (const bool wrap : {false, true}) {
+    const Eigen::MatrixXi serial =
+        mesh_util::getFaces(vertexes, kWidth, kHeight, wrap, false, kTearRatio, 1);
+    FacesU parallel;
+    mesh_util::computeFaces(
+        parallel, VertexesF(vertexes.cast<float>()), kWidth, kHeight, wrap, false, kTearRatio);
+
+    // the tear drops the column of quads straddling it, every other quad has 2 triangles
+    const int quads = (kWidth - 1) * (kHeight - 1);
+    const int wrapFaces = wrap ? 2 * (kHeight - 1) : 0;
+    EXPECT_EQ(serial.rows(), 2 * (quads - (kHeight - 1)) + wrapFaces);
+    EXPECT_TRUE(parallel.cast<int>() == serial);
+  }
+}
+
+TEST(MeshUtilTest, TestMaskCompactsVertexesAndFaces) {
+  const Eigen::MatrixXd original = makeGrid();
+  const Eigen::MatrixXi originalFaces =
+      mesh_util::getFaces(original, kWidth, kHeight, false, false, kTearRatio);
+  cv::Mat_<bool> mask(kHeight, kWidth, true);
+  for (int y = 5; y < 12; ++y) {
+    for (int x = 3; x < 9; ++x) {
+      mask(y, x) = false;
+    }
+  }
+
+  // expected faces, as vertex positions
+  std::set<std::vector<double>> expected;
+  std::set<int> used;
+  for (int i = 0; i < originalFaces.rows(); ++i) {
+    std::vector<double> face;
+    bool keep = true;
+    for (int j = 0; j < 3; ++j) {
+      const int v = originalFaces(i, j);
+      keep = keep && mask(v / kWidth, v % kWidth);
+      for (int c = 0; c < 3; ++c) {
+        face.push_back(original(v, c));
+      }
+    }
+    if (keep) {
+      expected.insert(face);
+      for (int j = 0; j < 3; ++j) {
+        used.insert(originalFaces(i, j));
+      }
+    }
+  }
+
+  Eigen::MatrixXd vertexes = original;
+  Eigen::MatrixXi faces = originalFaces;
+  mesh_util::applyMaskToVertexesAndFaces(vertexes, faces, mask);
+  EXPECT_EQ(vertexes.rows(), int(used.size()));
+  EXPECT_EQ(faces.rows(), int(expected.size()));
+  std::set<std::vector<double>> actual;
+  for (int i = 0; i < faces.rows(); ++i) {
+    std::vector<double> face;
+    for (int j = 0; j < 3; ++j) {
+      ASSERT_LT(faces(i, j), vertexes.rows());
+      for (int c = 0; c < 3; ++c) {
+        face.push_back(vertexes(faces(i, j), c));
+      }
+    }
+    actual.insert(face);
+  }
+  EXPECT_EQ(actual, expected);
+}
+
+TEST(MeshUtilTest, TestObjAndPlyWriters) {
+  const Eigen::MatrixXd vertexes = makeGrid();
+  const Eigen::MatrixXi faces =
+      mesh_util::getFaces(vertexes, kWidth, kHeight, false, false, kTearRatio);
+
+  // threaded obj is the same as a serial one
+  std::vector<std::string> objs;
+  for (const int threads : {1, -1}) {
+    const filesystem::path path = filesystem::unique_path("mesh_%%%%%%.obj");
+    mesh_util::writeObj(vertexes, faces, path, "", threads);
+    std::string obj;
+    CHECK(folly::readFile(path.string().c_str(), obj));
+    filesystem::remove(path);
+    objs.push_back(obj);
+  }
+  EXPECT_EQ(objs[0], objs[1]);
+  EXPECT_EQ(std::count(objs[0].begin(), objs[0].end(), '\n'), vertexes.rows() + faces.rows());
+  EXPECT_LT(objs[0].rfind("v "), objs[0].find("f ")) << "vertexes come first";
+
+  // binary ply holds float vertexes, then faces prefixed by their vertex count
+  const filesystem::path path = filesystem::unique_path("mesh_%%%%%%.ply");
+  mesh_util::writePly(vertexes, faces, path);
+  std::string ply;
+  CHECK(folly::readFile(path.string().c_str(), ply));
+  filesystem::remove(path);
+  const std::string kEndHeader = "end_header\n";
+  const size_t begin = ply.find(kEndHeader) + kEndHeader.size();
+  ASSERT_EQ(ply.size(), begin + vertexes.rows() * 3 * sizeof(float) + faces.rows() * 13);
+  const VertexesF v = Eigen::Map<const VertexesF>(
+      reinterpret_cast<const float*>(&ply[begin]), vertexes.rows(), 3);
+  EXPECT_TRUE(v == vertexes.cast<float>());
+  const char* face = &ply[begin + v.size() * sizeof(float)];
+  for (int i = 0; i < faces.rows(); ++i, face += 13) {
+    int32_t f[3];
+    std::memcpy(f, face + 1, sizeof(f));
+    ASSERT_EQ(face[0], 3);
+    ASSERT_TRUE(Eigen::RowVector3i(f[0], f[1], f[2]) == faces.row(i));
+  }
+}
@@ -0,0 +1,54 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "source/render/NoiseTexture.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::render;
+
+TEST(NoiseTextureTest, TestMatchesNoise) {
+  const cv::Vec3f lo(-3.2, 1.5, -0.7);
+  const cv::Vec3f hi(2.9, 4.1, 3.3);
+  const NoiseTexture texture(lo, hi, 8);
+  EXPECT_EQ(texture.getSamplesPerUnit(), 8);
+
+  // exact at the samples
+  for (const cv::Vec3f& offset : {cv::Vec3f(0, 0, 0), cv::Vec3f(1, 2, 3), cv::Vec3f(5, 0.5, 2)}) {
+    const cv::Vec3f p = lo + offset;
+    EXPECT_NEAR(texture.lookup(p), perlin_noise::pnoise(p[0], p[1], p[2]), 1e-4);
+  }
+
+  // close everywhere else
+  cv::RNG rng(1);
+  double sumError = 0;
+  float maxError = 0;
+  const int kCount = 10000;
+  for (int i = 0; i < kCount; ++i) {
+    const cv::Vec3f p(
+        rng.uniform(lo[0], hi[0]), rng.uniform(lo[1], hi[1]), rng.uniform(lo[2], hi[2]));
+    const float error = std::abs(texture.lookup(p) - perlin_noise::pnoise(p[0], p[1], p[2]));
+    sumError += error;
+    maxError = std::max(maxError, error);
+  }
+  EXPECT_LT(maxError, 0.1);
+  EXPECT_LT(sumError / kCount, 0.01);
+
+  // outside the box clamps to it
+  EXPECT_EQ(texture.lookup(hi + cv::Vec3f(1, 1, 1)), texture.lookup(hi + cv::Vec3f(9, 5, 7)));
+  EXPECT_EQ(texture.lookup(lo - cv::Vec3f(1, 0, 0)), texture.lookup(lo));
+}
+
+TEST(NoiseTextureTest, TestMaxSamples) {
+  const int64_t kMaxSamples = 1000;
+  const NoiseTexture texture(cv::Vec3f(0, 0, 0), cv::Vec3f(4, 4, 4), 8, 0, kMaxSamples);
+  EXPECT_LT(texture.getSamplesPerUnit(), 8);
+  EXPECT_LE(texture.getSampleCount(), kMaxSamples);
+}
@@ -0,0 +1,100 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include "source/render/ReprojectionTable.h"
+#include "source/util/Camera.h"
+#include "source/util/CvUtil.h"
+#include "source/util/FilesystemUtil.h"
+
+using namespace fb360_dep;
+
+static const char* testCameraJson = R"({
+  "version" : 1,
+  "type" : "FTHETA",
+  "origin" : [0, 0, 0],
+  "forward" : [0, 1, 0],
+  "up" : [0, 0, 1],
+  "right" : [1, 0, 0],
+  "resolution" : [256, 256],
+  "focal" : [80, -80],
+  "id" : "dst"
+})";
+
+struct ReprojectionTableTest : ::testing::Test {
+  ReprojectionTableTest() : dst(folly::parseJson(testCameraJson)), src(dst) {
+    src.id = "src";
+    src.position = Camera::Vector3(0.1, 0, 0);
+    tolerance = Camera::Vector2(0.03, 0.03).cwiseQuotient(src.resolution);
+    dst.normalize();
+    src.normalize();
+  }
+
+  Camera dst;
+  Camera src;
+  Camera::Vector2 tolerance;
+  const Camera::Vector2 margin = {0.05, 0.05};
+};
+
+TEST_F(ReprojectionTableTest, TestLookupIsWithinTolerance) {
+  const ReprojectionTable table(dst, src, tolerance, margin);
+  for (const float disparity : {0.1f, 0.5f, 1.0f}) {
+    for (const float y : {0.25f, 0.5f, 0.75f}) {
+      for (const float x : {0.25f, 0.5f, 0.75f}) {
+        const ReprojectionTable::Entry xy(x, y);
+        const Camera::Vector2 exact = src.pixel(dst.rig(xy.cast<Camera::Real>(), 1 / disparity));
+        const ReprojectionTable::Entry approx = table.lookup(xy, disparity);
+        // tolerance is checked at cell centers, allow some slack elsewhere
+        EXPECT_NEAR(approx.x(), exact.x(), 2 * tolerance.x());
+        EXPECT_NEAR(approx.y(), exact.y(), 2 * tolerance.y());
+      }
+    }
+  }
+}
+
+TEST_F(ReprojectionTableTest, TestBatchLookupMatchesLookup) {
+  const ReprojectionTable table(dst, src, tolerance, margin);
+  std::vector<ReprojectionTable::Entry> xys;
+  std::vector<float> disparities;
+  for (const float disparity : {0.1f, 0.5f, 0.9f}) {
+    for (float y = 0.01f - margin.y(); y < 1 + margin.y(); y += 0.1f) {
+      for (float x = 0.01f - margin.x(); x < 1 + margin.x(); x += 0.1f) {
+        xys.emplace_back(x, y);
+        disparities.push_back(disparity);
+      }
+    }
+  }
+  const std::vector<ReprojectionTable::Entry> batch = table.lookup(xys, disparities);
+  ASSERT_EQ(batch.size(), xys.size());
+  for (int i = 0; i < int(xys.size()); ++i) {
+    const ReprojectionTable::Entry single = table.lookup(xys[i], disparities[i]);
+    EXPECT_NEAR(batch[i].x(), single.x(), 1e-5);
+    EXPECT_NEAR(batch[i].y(), single.y(), 1e-5);
+  }
+}
+
+TEST_F(ReprojectionTableTest, TestCacheRoundTrips) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "ReprojectionTableTest";
+  filesystem::remove_all(dir);
+  const ReprojectionTable computed =
+      ReprojectionTable::getOrCompute(dir, dst, src, tolerance, margin);
+  const ReprojectionTable loaded =
+      ReprojectionTable::getOrCompute(dir, dst, src, tolerance, margin);
+  EXPECT_TRUE((computed.shape == loaded.shape).all());
+  EXPECT_EQ(computed.values, loaded.values);
+
+  // a different tolerance is a different table
+  ReprojectionTable::getOrCompute(dir, dst, src, 2 * tolerance, margin);
+  int fileCount = 0;
+  for (const auto& entry : filesystem::directory_iterator(dir)) {
+    EXPECT_EQ(entry.path().extension().string(), cv_util::kMatFileExtension);
+    ++fileCount;
+  }
+  EXPECT_EQ(fileCount, 4); // values and shape of each table
+  filesystem::remove_all(dir);
+}
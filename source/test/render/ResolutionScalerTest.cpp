@@ -0,0 +1,51 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "source/render/ResolutionScaler.h"
+
+using namespace fb360_dep;
+
+// gpu time of a frame whose fill at full scale takes fillMs
+static float frameMs(const float scale, const float fillMs) {
+  const float kFixedMs = 1;
+  return kFixedMs + fillMs * scale * scale;
+}
+
+TEST(ResolutionScalerTest, TestHoldsTarget) {
+  const float kTargetMs = 9;
+  ResolutionScaler scaler(kTargetMs, 0.5);
+  EXPECT_EQ(scaler.update(NAN), 1);
+
+  // a heavy scene scales down until it fits
+  for (int frame = 0; frame < 200; ++frame) {
+    scaler.update(frameMs(scaler.getScale(), 12));
+  }
+  EXPECT_LT(scaler.getScale(), 1);
+  EXPECT_NEAR(frameMs(scaler.getScale(), 12), kTargetMs, 0.1 * kTargetMs);
+
+  // a light scene goes back to full scale
+  for (int frame = 0; frame < 200; ++frame) {
+    scaler.update(frameMs(scaler.getScale(), 4));
+  }
+  EXPECT_EQ(scaler.getScale(), 1);
+}
+
+TEST(ResolutionScalerTest, TestStaysInBounds) {
+  ResolutionScaler scaler(9, 0.5, 0.8);
+  for (int frame = 0; frame < 200; ++frame) {
+    scaler.update(frameMs(scaler.getScale(), 100));
+  }
+  EXPECT_EQ(scaler.getScale(), 0.5f);
+  for (int frame = 0; frame < 200; ++frame) {
+    scaler.update(frameMs(scaler.getScale(), 1));
+  }
+  EXPECT_EQ(scaler.getScale(), 0.8f);
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <folly/json.h>
+
+#include "source/util/BenchTrace.h"
+#include "source/util/FilesystemUtil.h"
+
+DECLARE_string(bench_trace_dir);
+
+using namespace fb360_dep;
+
+TEST(BenchTraceTest, TestRecordLine) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "BenchTraceTest";
+  filesystem::remove_all(dir);
+  FLAGS_bench_trace_dir = dir.string();
+  bench_trace::init("/some/where/BenchTraceTest");
+  ASSERT_TRUE(bench_trace::isEnabled());
+  {
+    bench_trace::ScopedRecord record("stage", "000042", 3);
+    std::vector<char> bytes(1 << 20, 1); // something to count
+  }
+
+  std::vector<filesystem::path> paths;
+  for (const auto& entry : filesystem::directory_iterator(dir)) {
+    paths.push_back(entry.path());
+  }
+  ASSERT_EQ(paths.size(), 1);
+  EXPECT_EQ(paths[0].extension().string(), ".jsonl");
+  std::string contents;
+  ASSERT_TRUE(folly::readFile(paths[0].string().c_str(), contents));
+  std::vector<std::string> lines;
+  folly::split("\n", folly::rtrimWhitespace(contents), lines);
+  ASSERT_EQ(lines.size(), 1);
+
+  const folly::dynamic record = folly::parseJson(lines[0]);
+  EXPECT_EQ(record["binary"].getString(), "BenchTraceTest");
+  EXPECT_EQ(record["stage"].getString(), "stage");
+  EXPECT_EQ(record["frame"].getString(), "000042");
+  EXPECT_EQ(record["cameras"].getInt(), 3);
+  EXPECT_GT(record["start"].asDouble(), 0);
+  EXPECT_GE(record["wall_seconds"].asDouble(), 0);
+  EXPECT_GE(record["cpu_seconds"].asDouble(), 0);
+  EXPECT_GE(record["read_bytes"].asInt(), 0);
+  EXPECT_GE(record["written_bytes"].asInt(), 0);
+  EXPECT_GT(record["peak_rss_bytes"].asInt(), 0);
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/util/BoundedQueue.h"
+
+using namespace fb360_dep;
+
+TEST(BoundedQueueTest, TestFifoOrder) {
+  BoundedQueue<int> queue(4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.push(i));
+  }
+  queue.close();
+  EXPECT_FALSE(queue.push(4));
+
+  // Items pushed before close are still delivered, in order
+  int item;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue.pop(item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(queue.pop(item));
+}
+
+TEST(BoundedQueueTest, TestProducersConsumers) {
+  // A small capacity makes producers block on full queues and consumers on empty ones
+  BoundedQueue<int> queue(2);
+  const int kNumProducers = 3;
+  const int kNumConsumers = 4;
+  const int kItemsPerProducer = 1000;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&, p] {
+      for (int i = 0; i < kItemsPerProducer; ++i) {
+        queue.push(p * kItemsPerProducer + i);
+      }
+    });
+  }
+  std::vector<std::vector<int>> popped(kNumConsumers);
+  std::vector<std::thread> consumers;
+  for (int c = 0; c < kNumConsumers; ++c) {
+    consumers.emplace_back([&, c] {
+      int item;
+      while (queue.pop(item)) {
+        popped[c].push_back(item);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  queue.close();
+  for (std::thread& consumer : consumers) {
+    consumer.join();
+  }
+
+  std::vector<int> counts(kNumProducers * kItemsPerProducer, 0);
+  for (const std::vector<int>& items : popped) {
+    for (const int item : items) {
+      ++counts[item];
+    }
+  }
+  EXPECT_EQ(counts, std::vector<int>(counts.size(), 1));
+}
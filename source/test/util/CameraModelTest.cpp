@@ -0,0 +1,63 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <math.h>
+
+#include <gtest/gtest.h>
+
+#include "source/util/Camera.h"
+#include "source/util/CameraModel.h"
+
+using namespace fb360_dep;
+
+// a distorted camera of each type, with an image circle
+static std::vector<Camera> testCameras() {
+  std::vector<Camera> cameras;
+  for (const Camera::Type type :
+       {Camera::Type::FTHETA,
+        Camera::Type::RECTILINEAR,
+        Camera::Type::EQUISOLID,
+        Camera::Type::ORTHOGRAPHIC}) {
+    Camera camera(type, {2048, 2048}, {1240, -1240});
+    camera.position = Camera::Vector3(1, 2, 3);
+    camera.setRotation({0, 1, 0}, {0, 0, 1}, {1, 0, 0});
+    camera.setDistortion({0.01, -0.002, 0});
+    camera.setFov(0.4 * M_PI);
+    cameras.push_back(camera);
+  }
+  return cameras;
+}
+
+TEST(CameraModelTest, TestModelMatchesCamera) {
+  for (const Camera& camera : testCameras()) {
+    withCameraModel(camera, [&](const auto& model) {
+      EXPECT_EQ(&model.getCamera(), &camera);
+      for (int y = 0; y < camera.resolution.y(); y += 97) {
+        for (int x = 0; x < camera.resolution.x(); x += 97) {
+          const Camera::Vector2 pixel(x + 0.5, y + 0.5);
+          EXPECT_EQ(model.isOutsideImageCircle(pixel), camera.isOutsideImageCircle(pixel));
+          if (camera.isOutsideImageCircle(pixel)) {
+            continue;
+          }
+          const Camera::Vector3 rig = camera.rig(pixel, 10);
+          EXPECT_TRUE(model.rig(pixel, 10).isApprox(rig, 1e-12)) << rig;
+          EXPECT_TRUE(model.pixel(rig).isApprox(camera.pixel(rig), 1e-12)) << pixel;
+          EXPECT_EQ(model.sees(rig), camera.sees(rig));
+        }
+      }
+    });
+  }
+}
+
+TEST(CameraModelTest, TestDispatchesOnType) {
+  for (const Camera& camera : testCameras()) {
+    const Camera::Type type = withCameraModel(camera, [](const auto& model) {
+      return model.getCamera().type;
+    });
+    EXPECT_EQ(int(type), int(camera.type));
+  }
+}
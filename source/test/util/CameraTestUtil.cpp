@@ -5,6 +5,12 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <cmath>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/test/PerfBaseline.h"
 #include "source/util/Camera.h"
 
 namespace fb360_dep {
@@ -17,4 +23,26 @@ bool testUndoPixel(
   Camera::Vector3 actual = camera.rig(camera.pixel(targetPoint)).pointAt(depth);
   return expected.isApprox(actual, 1e-10);
 }
+
+void expectRoundTripNoRegression(const std::string& name, const Camera& camera) {
+  const int kSteps = 256;
+  const Camera::Real kDepth = 3;
+  std::vector<Camera::Vector2> pixels;
+  for (int y = 0; y < kSteps; ++y) {
+    for (int x = 0; x < kSteps; ++x) {
+      pixels.push_back(Camera::Vector2(x + 0.5, y + 0.5).cwiseProduct(camera.resolution) / kSteps);
+    }
+  }
+  Camera::Real error = 0; // also keeps the round trips from being optimized away
+  perf_test::expectNoRegression(name, [&] {
+    for (const Camera::Vector2& pixel : pixels) {
+      error += (camera.pixel(camera.rig(pixel, kDepth)) - pixel).norm();
+    }
+    const std::vector<Camera::Vector2> roundTrip = camera.pixels(camera.rigs(pixels, kDepth));
+    for (int i = 0; i < int(pixels.size()); ++i) {
+      error += (roundTrip[i] - pixels[i]).norm();
+    }
+  });
+  EXPECT_TRUE(std::isfinite(error));
+}
 } // namespace fb360_dep
@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <string>
+
 #include "source/util/Camera.h"
 
 namespace fb360_dep {
@@ -15,4 +17,8 @@ bool testUndoPixel(
     Camera::Vector3 targetPoint,
     Camera::Real depth,
     Camera::Vector3 expected);
+
+// Times pixel -> rig -> pixel round trips over a grid of camera's pixels, one point at a time and
+// batched, against the perf baseline of name
+void expectRoundTripNoRegression(const std::string& name, const Camera& camera);
 }
@@ -0,0 +1,68 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include "source/util/CvUtil.h"
+#include "source/util/FilesystemUtil.h"
+
+using namespace fb360_dep;
+
+namespace {
+
+filesystem::path getTempMatFile(const std::string& name) {
+  return filesystem::temp_directory_path() / (name + cv_util::kMatFileExtension);
+}
+
+bool isIdentical(const cv::Mat& a, const cv::Mat& b) {
+  return a.size() == b.size() && a.type() == b.type() &&
+      cv::countNonZero(a.reshape(1) != b.reshape(1)) == 0;
+}
+
+} // namespace
+
+TEST(CvUtilTest, TestMatFileRoundTrips) {
+  cv::RNG rng(1);
+  for (const int type : {CV_8UC1, CV_8UC3, CV_16UC1, CV_16UC4, CV_32FC1, CV_32FC3}) {
+    cv::Mat image(37, 53, type);
+    rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+    const filesystem::path path = getTempMatFile("CvUtilTest");
+    cv_util::imwriteExceptionOnFail(path, image);
+    EXPECT_TRUE(isIdentical(cv_util::imreadExceptionOnFail(path, cv::IMREAD_UNCHANGED), image));
+    EXPECT_TRUE(isIdentical(cv_util::loadImageUnchanged(path), image));
+    filesystem::remove(path);
+  }
+}
+
+TEST(CvUtilTest, TestMatFileSavesRegionsAndPfms) {
+  cv::Mat_<float> image(40, 60);
+  cv::RNG(2).fill(image, cv::RNG::UNIFORM, -1, 1);
+  image(3, 4) = NAN;
+  const cv::Mat_<float> region = image(cv::Rect(5, 6, 20, 10));
+  const filesystem::path path = getTempMatFile("CvUtilTestPfm");
+  cv_util::writeCvMat32FC1ToPFM(path, region);
+  const cv::Mat_<float> loaded = cv_util::readCvMat32FC1FromPFM(path);
+  EXPECT_TRUE(isIdentical(loaded, region));
+
+  cv_util::writeCvMat32FC1ToPFM(path, image);
+  EXPECT_TRUE(std::isnan(cv_util::readCvMat32FC1FromPFM(path)(3, 4)));
+  filesystem::remove(path);
+}
+
+TEST(CvUtilTest, TestMatFileAppliesImreadFlags) {
+  cv::Mat_<cv::Vec4w> image(8, 8, cv::Vec4w(65535, 0, 65535, 65535));
+  const filesystem::path path = getTempMatFile("CvUtilTestFlags");
+  cv_util::imwriteExceptionOnFail(path, image);
+
+  const cv::Mat color = cv_util::imreadExceptionOnFail(path);
+  EXPECT_EQ(color.type(), CV_8UC3);
+  EXPECT_EQ(color.at<cv::Vec3b>(0, 0), cv::Vec3b(255, 0, 255));
+  EXPECT_EQ(cv_util::imreadExceptionOnFail(path, cv::IMREAD_GRAYSCALE).type(), CV_8UC1);
+  EXPECT_EQ(cv_util::imreadExceptionOnFail(path, cv::IMREAD_ANYDEPTH).type(), CV_16UC1);
+  EXPECT_EQ(cv_util::loadImage<cv::Vec3f>(path).type(), CV_32FC3);
+  filesystem::remove(path);
+}
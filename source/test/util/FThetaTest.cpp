@@ -9,6 +9,7 @@
 
 #include <gtest/gtest.h>
 
+#include "source/test/PerfBaseline.h"
 #include "source/test/util/CameraTestUtil.h"
 #include "source/util/Camera.h"
 
@@ -156,3 +157,35 @@ TEST_F(FThetaTest, TestRescale) {
   EXPECT_TRUE(expected.focal.isApprox(camera.focal * scaleFactor, 1e-10));
   EXPECT_TRUE(expected.resolution.isApprox(camera.resolution * scaleFactor, 1e-10));
 }
+
+TEST_F(FThetaTest, TestBatch) {
+  // check that the batch functions invert each other and agree with the per point functions
+  Camera camera = ftheta;
+  Camera::Distortion distortion = camera.getDistortion();
+  distortion[0] = -0.03658484692522479;
+  distortion[1] = -0.004515457470690702;
+  camera.setDistortion(distortion);
+  std::vector<Camera::Vector2> pixels;
+  for (int y = 0; y <= 64; ++y) {
+    for (int x = 0; x <= 64; ++x) {
+      pixels.push_back(Camera::Vector2(x, y).cwiseProduct(camera.resolution) / 64);
+    }
+  }
+  const Camera::Real depth = 3;
+  const std::vector<Camera::Vector3> rigs = camera.rigs(pixels, depth);
+  const std::vector<Camera::Vector2> roundTrip = camera.pixels(rigs);
+  for (int i = 0; i < int(pixels.size()); ++i) {
+    EXPECT_NEAR((roundTrip[i] - pixels[i]).norm(), 0, 0.01) << pixels[i];
+    EXPECT_EQ(roundTrip[i], camera.pixel(rigs[i])) << pixels[i];
+    // per point undistort() stops within 1 / kNearInfinity, about as many radians for ftheta
+    const Camera::Real tol = 2 * depth / Camera::kNearInfinity;
+    EXPECT_NEAR((rigs[i] - camera.rig(pixels[i], depth)).norm(), 0, tol) << pixels[i];
+  }
+}
+
+TEST_F(FThetaTest, PerfRoundTrip) {
+  if (!perf_test::isEnabled()) {
+    return;
+  }
+  expectRoundTripNoRegression("FThetaTest.PerfRoundTrip", ftheta);
+}
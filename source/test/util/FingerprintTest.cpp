@@ -0,0 +1,50 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "source/util/Fingerprint.h"
+
+using namespace fb360_dep;
+
+TEST(FingerprintTest, TestInputsAndSidecar) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "FingerprintTest";
+  filesystem::remove_all(dir);
+  filesystem::create_directories(dir);
+  const filesystem::path input = dir / "input.txt";
+  const filesystem::path output = dir / "output.txt";
+  std::ofstream(input.string()) << "abc";
+
+  auto fingerprintOf = [&](const std::string& value) {
+    return Fingerprint("FingerprintTest").add(value).addFile(input);
+  };
+  const Fingerprint fingerprint = fingerprintOf("x");
+  EXPECT_EQ(fingerprintOf("x").get(), fingerprint.get());
+  EXPECT_NE(fingerprintOf("y").get(), fingerprint.get());
+
+  // Rewriting an input with the same contents keeps the fingerprint
+  std::ofstream(input.string()) << "abc";
+  EXPECT_EQ(fingerprintOf("x").get(), fingerprint.get());
+  std::ofstream(input.string()) << "abd";
+  EXPECT_NE(fingerprintOf("x").get(), fingerprint.get());
+
+  // Missing inputs are fingerprinted too
+  EXPECT_NE(
+      Fingerprint("FingerprintTest").addFile(dir / "missing.txt").get(),
+      Fingerprint("FingerprintTest").get());
+
+  // No output, no match
+  writeFingerprint(output, fingerprint);
+  EXPECT_FALSE(hasFingerprint(output, fingerprint));
+  std::ofstream(output.string()) << "out";
+  EXPECT_TRUE(hasFingerprint(output, fingerprint));
+  EXPECT_FALSE(hasFingerprint(output, fingerprintOf("y")));
+  EXPECT_EQ(getFingerprintPath(output).filename().string(), ".output.txt.fingerprint");
+  filesystem::remove_all(dir);
+}
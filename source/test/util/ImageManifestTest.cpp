@@ -0,0 +1,40 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include "source/util/CvUtil.h"
+#include "source/util/ImageManifest.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::image_util;
+
+TEST(ImageManifestTest, TestWriteThenRead) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "ImageManifestTest";
+  filesystem::remove_all(dir);
+  const cv::Mat_<uint8_t> image(24, 32, uint8_t(128));
+  for (const std::string& camId : {"cam0", "cam1"}) {
+    filesystem::create_directories(dir / camId);
+    for (const std::string& frame : {"000001", "000000"}) {
+      cv_util::imwriteExceptionOnFail(dir / camId / (frame + ".png"), image);
+    }
+  }
+  EXPECT_EQ(getManifest(dir), nullptr);
+
+  writeManifest(dir);
+  const std::shared_ptr<const ImageManifest> manifest = getManifest(dir);
+  ASSERT_NE(manifest, nullptr);
+  EXPECT_EQ(manifest->size(), 2);
+  const CameraImages* images = getCameraImages(manifest, "cam1");
+  ASSERT_NE(images, nullptr);
+  EXPECT_EQ(images->extension, ".png");
+  EXPECT_EQ(images->size, image.size());
+  EXPECT_EQ(images->frames, std::vector<std::string>({"000000", "000001"}));
+  EXPECT_EQ(getCameraImages(manifest, "cam2"), nullptr);
+  EXPECT_EQ(getImageExtension(dir, "cam0"), ".png");
+  filesystem::remove_all(dir);
+}
@@ -0,0 +1,70 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/util/Mailbox.h"
+
+using namespace fb360_dep;
+
+TEST(MailboxTest, TestFullAndEmpty) {
+  Mailbox<std::unique_ptr<int>> mailbox(2);
+  std::unique_ptr<int> item;
+  EXPECT_FALSE(mailbox.tryPop(item));
+  EXPECT_EQ(mailbox.front(), nullptr);
+
+  for (int i = 0; i < 2; ++i) {
+    item.reset(new int(i));
+    EXPECT_TRUE(mailbox.tryPush(item));
+    EXPECT_EQ(item, nullptr) << "pushed items are moved";
+  }
+  EXPECT_TRUE(mailbox.isFull());
+  item.reset(new int(2));
+  EXPECT_FALSE(mailbox.tryPush(item));
+  ASSERT_NE(item, nullptr) << "rejected items are left alone";
+
+  // Oldest first, front() peeks without popping
+  ASSERT_NE(mailbox.front(), nullptr);
+  EXPECT_EQ(**mailbox.front(), 0);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(mailbox.tryPop(item));
+    EXPECT_EQ(*item, i);
+  }
+  EXPECT_EQ(mailbox.size(), 0u);
+  EXPECT_FALSE(mailbox.tryPop(item));
+}
+
+TEST(MailboxTest, TestProducerConsumer) {
+  // A small capacity keeps the mailbox wrapping around, and alternating between full and empty
+  Mailbox<int> mailbox(3);
+  const int kItems = 100000;
+  std::thread producer([&] {
+    for (int i = 0; i < kItems; ++i) {
+      int item = i;
+      while (!mailbox.tryPush(item)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  std::vector<int> popped;
+  while (int(popped.size()) < kItems) {
+    int item;
+    if (mailbox.tryPop(item)) {
+      popped.push_back(item);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  for (int i = 0; i < kItems; ++i) {
+    ASSERT_EQ(popped[i], i);
+  }
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "source/util/MatPool.h"
+
+using namespace fb360_dep;
+
+static cv::Mat createMat(const MatPool& pool, const int rows, const int cols, const int type) {
+  cv::Mat mat;
+  mat.allocator = const_cast<MatPool*>(&pool);
+  mat.create(rows, cols, type);
+  return mat;
+}
+
+TEST(MatPoolTest, TestClassBytes) {
+  const size_t kMB = size_t(1) << 20;
+  EXPECT_EQ(MatPool::getClassBytes(1000), size_t(1000));
+  EXPECT_EQ(MatPool::getClassBytes(3 * kMB), 4 * kMB);
+  EXPECT_EQ(MatPool::getClassBytes(33 * kMB), 40 * kMB);
+  for (size_t bytes = 2 * kMB; bytes < 1000 * kMB; bytes = bytes * 5 / 4 + 12345) {
+    const size_t classBytes = MatPool::getClassBytes(bytes);
+    EXPECT_GE(classBytes, bytes);
+    EXPECT_EQ(classBytes % (2 * kMB), size_t(0));
+    EXPECT_EQ(MatPool::getClassBytes(classBytes), classBytes) << "classes are their own class";
+  }
+}
+
+TEST(MatPoolTest, TestReusesFreedMats) {
+  MatPool pool(64 << 20);
+  const uchar* data;
+  {
+    cv::Mat mat = createMat(pool, 1080, 1920, CV_32FC3);
+    mat.setTo(1);
+    data = mat.data;
+  }
+  EXPECT_EQ(pool.getStats().bytesInUse, 0);
+  EXPECT_GT(pool.getStats().bytesRetained, 0);
+
+  // a slightly smaller mat of the same class gets the same buffer
+  cv::Mat mat = createMat(pool, 1070, 1920, CV_32FC3);
+  EXPECT_EQ(mat.data, data);
+  EXPECT_TRUE(mat.isContinuous());
+  MatPool::Stats stats = pool.getStats();
+  EXPECT_EQ(stats.allocations, 2);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.bytesRetained, 0);
+  EXPECT_EQ(stats.bytesInUse, int64_t(MatPool::getClassBytes(mat.total() * mat.elemSize())));
+
+  // small mats are not pooled
+  cv::Mat small = createMat(pool, 10, 10, CV_8UC1);
+  EXPECT_EQ(pool.getStats().allocations, 2);
+}
+
+TEST(MatPoolTest, TestCapacity) {
+  MatPool pool(0);
+  {
+    cv::Mat mat = createMat(pool, 2048, 2048, CV_8UC1);
+  }
+  EXPECT_EQ(pool.getStats().bytesRetained, 0) << "nothing is kept without capacity";
+  EXPECT_EQ(pool.getStats().peakBytesInUse, 4 << 20);
+}
@@ -0,0 +1,62 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include "source/test/TestRig.h"
+#include "source/util/OverlapMatrix.h"
+
+using namespace fb360_dep;
+
+TEST(OverlapMatrixTest, TestMatchesCamera) {
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const OverlapMatrix overlapMatrix(rig);
+  ASSERT_EQ(overlapMatrix.size(), int(rig.size()));
+  int numVisible = 0;
+  for (int i = 0; i < int(rig.size()); ++i) {
+    for (int j = 0; j < int(rig.size()); ++j) {
+      EXPECT_EQ(overlapMatrix.overlap(i, j), rig[i].overlap(rig[j]));
+      EXPECT_EQ(overlapMatrix.overlap(rig[i].id, rig[j].id), overlapMatrix.overlap(i, j));
+      numVisible += overlapMatrix.isVisible(i, j);
+    }
+  }
+
+  // Every camera sees itself, and some neighbor
+  EXPECT_GT(numVisible, int(rig.size()));
+}
+
+TEST(OverlapMatrixTest, TestCacheRoundTrips) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "OverlapMatrixTest";
+  filesystem::remove_all(dir);
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  const OverlapMatrix computed = OverlapMatrix::getOrCompute(dir, rig);
+  const OverlapMatrix loaded = OverlapMatrix::getOrCompute(dir, rig);
+
+  // A rescaled rig has the same overlaps, and shares the file
+  Camera::Rig rescaled;
+  for (const Camera& camera : rig) {
+    rescaled.push_back(camera.rescale(camera.resolution / 4));
+  }
+  const OverlapMatrix loadedRescaled = OverlapMatrix::getOrCompute(dir, rescaled);
+  for (int i = 0; i < int(rig.size()); ++i) {
+    for (int j = 0; j < int(rig.size()); ++j) {
+      EXPECT_DOUBLE_EQ(loaded.overlap(i, j), computed.overlap(i, j));
+      EXPECT_DOUBLE_EQ(loadedRescaled.overlap(i, j), computed.overlap(i, j));
+    }
+  }
+
+  // A subset of the rig is a different matrix
+  const Camera::Rig subset(rig.begin(), rig.begin() + 3);
+  EXPECT_EQ(OverlapMatrix::getOrCompute(dir, subset).size(), 3);
+  int fileCount = 0;
+  for (const auto& entry : filesystem::directory_iterator(dir)) {
+    EXPECT_EQ(entry.path().extension().string(), ".json");
+    ++fileCount;
+  }
+  EXPECT_EQ(fileCount, 2);
+  filesystem::remove_all(dir);
+}
@@ -0,0 +1,78 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/util/Profiler.h"
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+TEST(ProfilerTest, TestScopedStageCountsAcrossThreads) {
+  profiler::Profile profile;
+  {
+    profiler::ScopedStage stage(&profile, "pingPong", 2, "cam0");
+    parallelFor(0, 1000, 10, [&](const int) {
+      stage.addCostEvaluations(3);
+      stage.addPixels(1);
+    });
+  }
+  const profiler::StageCounters counters = profile.get("pingPong", 2, "cam0");
+  EXPECT_EQ(counters.calls, 1);
+  EXPECT_EQ(counters.costEvaluations, 3000);
+  EXPECT_EQ(counters.pixels, 1000);
+  EXPECT_EQ(counters.bytes, 0);
+  EXPECT_GE(counters.seconds, 0);
+}
+
+TEST(ProfilerTest, TestEntriesAccumulatePerKey) {
+  profiler::Profile profile;
+  for (int i = 0; i < 3; ++i) {
+    profiler::ScopedStage stage(&profile, "median", 1);
+    stage.addBytes(100);
+  }
+  { profiler::ScopedStage stage(&profile, "median", 0); }
+  { profiler::ScopedStage stage(nullptr, "median", 1); } // no-op
+
+  EXPECT_EQ(profile.get("median", 1).calls, 3);
+  EXPECT_EQ(profile.get("median", 1).bytes, 300);
+  EXPECT_EQ(profile.get("median", 0).calls, 1);
+  EXPECT_EQ(profile.get("median", 1, "cam0").calls, 0);
+  EXPECT_EQ(profile.serialize().size(), 2u);
+}
+
+TEST(ProfilerTest, TestMemoryPeaksAreMaxed) {
+  profiler::Profile profile;
+  profiler::StageCounters counters;
+  counters.rssBytes = 100;
+  counters.peakRssBytes = 300;
+  profile.add("median", 1, "", counters);
+  counters.rssBytes = 200;
+  counters.peakRssBytes = 250;
+  profile.add("median", 1, "", counters);
+
+  EXPECT_EQ(profile.get("median", 1).rssBytes, 200);
+  EXPECT_EQ(profile.get("median", 1).peakRssBytes, 300);
+}
+
+TEST(ProfilerTest, TestRssHighWaterKeepsPeak) {
+  if (system_util::getResidentBytes() == 0) {
+    return; // not known on this platform
+  }
+  const int64_t kBytes = 64 << 20;
+  system_util::RssHighWater highWater;
+  int64_t peak;
+  {
+    std::vector<char> buffer(kBytes, 1); // touched, so resident
+    peak = highWater.get();
+    EXPECT_GE(peak, kBytes);
+  }
+  EXPECT_GE(highWater.get(), peak); // still there after the memory is gone
+  EXPECT_GE(system_util::getPeakResidentBytes(), peak);
+}
@@ -8,6 +8,7 @@
 
 #include <gtest/gtest.h>
 
+#include "source/test/PerfBaseline.h"
 #include "source/test/util/CameraTestUtil.h"
 #include "source/util/Camera.h"
 
@@ -162,3 +163,10 @@ TEST_F(RectilinearTest, TestRescale) {
   EXPECT_TRUE(expected.focal.isApprox(camera.focal * scaleFactor, 1e-10));
   EXPECT_TRUE(expected.resolution.isApprox(camera.resolution * scaleFactor, 1e-10));
 }
+
+TEST_F(RectilinearTest, PerfRoundTrip) {
+  if (!perf_test::isEnabled()) {
+    return;
+  }
+  expectRoundTripNoRegression("RectilinearTest.PerfRoundTrip", rectilinear);
+}
@@ -0,0 +1,110 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "source/util/CvUtil.h"
+#include "source/util/TarArchive.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::tar_util;
+
+namespace {
+
+// Appends a ustar header and its data, padded to whole blocks
+void addMember(std::string& tar, const std::string& name, const std::string& data, char type) {
+  std::string header(512, '\0');
+  header.replace(0, name.size(), name);
+  char field[13];
+  snprintf(field, sizeof(field), "%011zo", data.size());
+  header.replace(124, 11, field);
+  header[156] = type;
+  header.replace(257, 8, std::string("ustar\0" "00", 8));
+  header.replace(148, 8, 8, ' ');
+  unsigned checksum = 0;
+  for (const char c : header) {
+    checksum += uint8_t(c);
+  }
+  snprintf(field, sizeof(field), "%06o", checksum);
+  header.replace(148, 7, field, 7);
+  tar += header + data + std::string((512 - data.size() % 512) % 512, '\0');
+}
+
+void writeTar(const filesystem::path& path, std::string tar) {
+  tar += std::string(1024, '\0');
+  std::ofstream(path.string(), std::ios::binary) << tar;
+}
+
+} // namespace
+
+TEST(TarArchiveTest, TestMembers) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "TarArchiveTest";
+  filesystem::remove_all(dir);
+  filesystem::create_directories(dir);
+  const std::string longName = "cam1/" + std::string(120, 'x') + ".txt";
+  std::string tar;
+  addMember(tar, "cam0/", "", '5'); // directory
+  addMember(tar, "cam0/000000.txt", "hello", '0');
+  addMember(tar, "././@LongLink", longName, 'L');
+  addMember(tar, "cam1/truncated", std::string(600, 'a'), '0');
+  writeTar(dir / "000000.tar", tar);
+
+  const std::shared_ptr<const TarArchive> archive = getArchive(dir / "000000.tar");
+  ASSERT_NE(archive, nullptr);
+  EXPECT_EQ(archive->getMembers().size(), 2);
+  const TarArchive::Member* member = archive->find("cam0/000000.txt");
+  ASSERT_NE(member, nullptr);
+  EXPECT_EQ(std::string(member->data, member->size), "hello");
+  member = archive->find(longName);
+  ASSERT_NE(member, nullptr);
+  EXPECT_EQ(std::string(member->data, member->size), std::string(600, 'a'));
+  EXPECT_EQ(archive->find("cam0/"), nullptr);
+  EXPECT_EQ(archive->findPrefix("cam0/000000."), "cam0/000000.txt");
+  EXPECT_EQ(archive->findPrefix("cam2/"), "");
+  EXPECT_EQ(getArchive(dir / "000001.tar"), nullptr);
+
+  // Same object until the file changes
+  EXPECT_EQ(getArchive(dir / "000000.tar"), archive);
+
+  EXPECT_NE(findImage(dir / "cam0" / "000000.txt", member), nullptr);
+  EXPECT_EQ(findImage(dir / "cam0" / "000000.png", member), nullptr);
+  EXPECT_EQ(findImageExtension(dir, "cam0", "000000"), ".txt");
+  EXPECT_EQ(findImageExtension(dir, "cam1", "000000"), "");
+  filesystem::remove_all(dir);
+}
+
+TEST(TarArchiveTest, TestLoadImages) {
+  const filesystem::path dir = filesystem::temp_directory_path() / "TarArchiveLoadTest";
+  filesystem::remove_all(dir);
+  filesystem::create_directories(dir / "cam0");
+  const cv::Mat_<cv::Vec3b> color(24, 32, cv::Vec3b(10, 20, 30));
+  const cv::Mat_<float> disparity(24, 32, 0.5f);
+  cv_util::imwriteExceptionOnFail(dir / "cam0" / "000000.png", color);
+  cv_util::writeCvMat32FC1ToPFM(dir / "cam0" / "000000.pfm", disparity);
+
+  // Pack them the way the farm does, then remove the extracted files
+  std::string tar;
+  for (const std::string& name : {"000000.png", "000000.pfm"}) {
+    std::ifstream file((dir / "cam0" / name).string(), std::ios::binary);
+    std::stringstream data;
+    data << file.rdbuf();
+    addMember(tar, "cam0/" + name, data.str(), '0');
+  }
+  writeTar(dir / "000000.tar", tar);
+  filesystem::remove_all(dir / "cam0");
+
+  const cv::Mat_<cv::Vec3b> colorLoaded = cv_util::loadImage<cv::Vec3b>(dir / "cam0/000000.png");
+  EXPECT_EQ(cv::norm(colorLoaded, color, cv::NORM_INF), 0);
+  const cv::Mat_<float> disparityLoaded = cv_util::readCvMat32FC1FromPFM(dir / "cam0/000000.pfm");
+  EXPECT_EQ(cv::norm(disparityLoaded, disparity, cv::NORM_INF), 0);
+  filesystem::remove_all(dir);
+}
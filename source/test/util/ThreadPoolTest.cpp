@@ -0,0 +1,91 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+
+#include <gtest/gtest.h>
+
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+static void addTo(int& dst, const int value) {
+  dst += value;
+}
+
+TEST(ThreadPoolTest, TestSpawnJoin) {
+  std::vector<int> values(1000, 0);
+  ThreadPool threadPool(4);
+  for (int i = 0; i < int(values.size()); ++i) {
+    threadPool.spawn(&addTo, std::ref(values[i]), i);
+  }
+  threadPool.join();
+  for (int i = 0; i < int(values.size()); ++i) {
+    EXPECT_EQ(values[i], i);
+  }
+}
+
+TEST(ThreadPoolTest, TestNoThreadsRunsInline) {
+  const std::thread::id caller = std::this_thread::get_id();
+  ThreadPool threadPool(0);
+  bool ranInline = false;
+  threadPool.spawn([&] { ranInline = std::this_thread::get_id() == caller; });
+  threadPool.join();
+  EXPECT_TRUE(ranInline);
+}
+
+TEST(ThreadPoolTest, TestParallelFor) {
+  std::vector<int> values(10007, 0);
+  parallelFor(0, values.size(), 64, [&](const int i) { values[i] = i; });
+  std::vector<int> expected(values.size());
+  std::iota(expected.begin(), expected.end(), 0);
+  EXPECT_EQ(values, expected);
+}
+
+TEST(ThreadPoolTest, TestNestedParallelFor) {
+  // Every worker may end up waiting on an inner loop, which must not deadlock
+  std::atomic<int> count(0);
+  parallelFor(0, 64, 1, [&](int) { parallelFor(0, 64, 1, [&](int) { ++count; }); });
+  EXPECT_EQ(count, 64 * 64);
+}
+
+TEST(ThreadPoolTest, TestExceptionPropagatesToJoin) {
+  ThreadPool threadPool(2);
+  threadPool.spawn([] { throw std::runtime_error("task failed"); });
+  EXPECT_THROW(threadPool.join(), std::runtime_error);
+}
+
+TEST(ThreadPoolTest, TestSpawnOnNode) {
+  // Whatever the machine's topology, every task runs once
+  std::atomic<int> count(0);
+  ThreadPool threadPool(4);
+  for (int i = 0; i < 100; ++i) {
+    threadPool.spawnOnNode(numa::nodeOf(i, 100), [&] { ++count; });
+  }
+  threadPool.spawnOnNode(numa::getNumNodes(), [&] { ++count; }); // no such node, any will do
+  threadPool.join();
+  EXPECT_EQ(count, 101);
+}
+
+TEST(ThreadPoolTest, TestForEachByNode) {
+  std::vector<int> values(37, 0);
+  forEachByNode(int(values.size()), [&](const int i) {
+    parallelFor(0, 10, 1, [&](int) { addTo(values[i], 0); });
+    values[i] += i;
+  });
+  std::vector<int> expected(values.size());
+  std::iota(expected.begin(), expected.end(), 0);
+  EXPECT_EQ(values, expected);
+
+  // Nodes own contiguous runs of indexes
+  for (int i = 1; i < int(values.size()); ++i) {
+    EXPECT_LE(numa::nodeOf(i - 1, values.size()), numa::nodeOf(i, values.size()));
+  }
+  EXPECT_EQ(numa::nodeOf(values.size() - 1, values.size()), numa::getNumNodes() - 1);
+}
@@ -0,0 +1,96 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "source/util/BoundedQueue.h"
+
+namespace fb360_dep {
+
+// Background threads running output tasks (encoding, disk writes) while the caller moves on
+// Tasks must own the data they write, e.g. capture cv::Mats by value and never modify them again
+// write() blocks while capacity tasks are pending, which bounds the memory held by the queue
+// flush() waits until every task written so far is done and rethrows the first exception any of
+// them threw. Call it before reading back what was written
+// numThreads = 0 runs every task inline in write()
+class AsyncWriter {
+ public:
+  AsyncWriter(const int numThreads, const size_t capacity) : queue(capacity) {
+    for (int i = 0; i < numThreads; ++i) {
+      threads.emplace_back([this] { run(); });
+    }
+  }
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  ~AsyncWriter() {
+    queue.close();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  void write(std::function<void()> task) {
+    if (threads.empty()) {
+      task();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++pending;
+    }
+    queue.push(std::move(task));
+  }
+
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+    if (error) {
+      std::exception_ptr e = error;
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+ private:
+  void run() {
+    std::function<void()> task;
+    while (queue.pop(task)) {
+      std::exception_ptr e;
+      try {
+        task();
+      } catch (...) {
+        e = std::current_exception();
+      }
+      task = nullptr; // release what the task owns before reporting it done
+      std::lock_guard<std::mutex> lock(mutex);
+      if (e && !error) {
+        error = e;
+      }
+      if (--pending == 0) {
+        done.notify_all();
+      }
+    }
+  }
+
+  BoundedQueue<std::function<void()>> queue;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable done;
+  int pending = 0;
+  std::exception_ptr error;
+};
+
+} // namespace fb360_dep
@@ -0,0 +1,139 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/BenchTrace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+#include "source/util/FilesystemUtil.h"
+
+DEFINE_string(
+    bench_trace_dir,
+    "",
+    "append a json line per frame and stage to a file per process in this directory");
+
+namespace fb360_dep {
+namespace bench_trace {
+
+namespace {
+
+struct Trace {
+  std::mutex mutex;
+  FILE* file = nullptr;
+  std::string binary;
+  std::string host;
+  int pid = 0;
+  ScopedRecord::Snapshot start; // of the process
+};
+
+Trace& getTrace() {
+  static Trace trace;
+  return trace;
+}
+
+double toUnixSeconds(const std::chrono::system_clock::time_point& time) {
+  return std::chrono::duration<double>(time.time_since_epoch()).count();
+}
+
+void write(
+    const std::string& stage,
+    const std::string& frame,
+    const int cameras,
+    const ScopedRecord::Snapshot& start,
+    const int64_t peakRssBytes) {
+  Trace& trace = getTrace();
+  const ScopedRecord::Snapshot end = ScopedRecord::Snapshot::now();
+  folly::dynamic record = folly::dynamic::object;
+  record["binary"] = trace.binary;
+  record["host"] = trace.host;
+  record["pid"] = trace.pid;
+  record["stage"] = stage;
+  record["frame"] = frame;
+  record["cameras"] = cameras;
+  record["start"] = toUnixSeconds(start.wall);
+  record["wall_seconds"] = std::chrono::duration<double>(end.wall - start.wall).count();
+  record["cpu_seconds"] = end.cpuSeconds - start.cpuSeconds;
+  record["read_bytes"] = end.readBytes - start.readBytes;
+  record["written_bytes"] = end.writtenBytes - start.writtenBytes;
+  record["peak_rss_bytes"] = peakRssBytes;
+  folly::json::serialization_opts opts;
+  opts.sort_keys = true;
+  const std::string line = folly::json::serialize(record, opts) + "\n";
+
+  // Whole lines, so records of concurrent scopes don't interleave
+  std::lock_guard<std::mutex> lock(trace.mutex);
+  fwrite(line.data(), 1, line.size(), trace.file);
+  fflush(trace.file);
+}
+
+void writeProcess() {
+  write("process", "", 0, getTrace().start, system_util::getPeakResidentBytes());
+}
+
+} // namespace
+
+void init(const std::string& argv0) {
+  Trace& trace = getTrace();
+  if (FLAGS_bench_trace_dir.empty() || trace.file) {
+    return;
+  }
+  trace.start = ScopedRecord::Snapshot::now();
+  trace.binary = filesystem::path(argv0).filename().string();
+  char host[256] = "";
+#ifndef WIN32
+  gethostname(host, sizeof(host) - 1);
+  trace.pid = getpid();
+#endif
+  trace.host = host;
+  filesystem::create_directories(FLAGS_bench_trace_dir);
+  const filesystem::path path = filesystem::path(FLAGS_bench_trace_dir) /
+      folly::sformat("{}.{}.{}.jsonl", trace.binary, trace.host, trace.pid);
+  trace.file = fopen(path.string().c_str(), "a");
+  CHECK(trace.file) << "cannot open bench trace " << path.string();
+  std::atexit(writeProcess);
+}
+
+bool isEnabled() {
+  return getTrace().file != nullptr;
+}
+
+ScopedRecord::Snapshot ScopedRecord::Snapshot::now() {
+  Snapshot result;
+  result.wall = std::chrono::system_clock::now();
+  result.cpuSeconds = system_util::getCpuSeconds();
+  system_util::getIoBytes(result.readBytes, result.writtenBytes);
+  return result;
+}
+
+ScopedRecord::ScopedRecord(const std::string& stage, const std::string& frame, const int cameras)
+    : stage(stage), frame(frame), cameras(cameras) {
+  if (isEnabled()) {
+    start = Snapshot::now();
+    rss = std::make_unique<system_util::RssHighWater>();
+  }
+}
+
+ScopedRecord::~ScopedRecord() {
+  if (rss) {
+    write(stage, frame, cameras, start, rss->get());
+  }
+}
+
+} // namespace bench_trace
+} // namespace fb360_dep
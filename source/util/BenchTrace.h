@@ -0,0 +1,64 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "source/util/SystemUtil.h"
+
+namespace fb360_dep {
+namespace bench_trace {
+
+// Opt-in record of where the binaries of a run spend their time, to aggregate across farm jobs
+// With --bench_trace_dir, each process appends one json object per line to
+// <dir>/<binary>.<host>.<pid>.jsonl: one per ScopedRecord, one per job in --serve mode and one for
+// the whole process when it exits. Every record has the same fields:
+//   binary, host, pid, stage, frame, cameras, start (unix seconds), wall_seconds, cpu_seconds,
+//   read_bytes, written_bytes, peak_rss_bytes
+// The files of a run merge by concatenation, e.g. cat <dir>/*.jsonl
+// Cpu time and io bytes are the process's over the scope of the record, so records that overlap
+// in time (e.g. frames in flight at once) share them
+
+// Opens the trace file of the process if --bench_trace_dir is set, called by system_util::initDep
+void init(const std::string& argv0);
+
+bool isEnabled();
+
+// Records its scope as stage of frame, cameras is the number of cameras it processed
+// A no-op unless the trace is enabled
+class ScopedRecord {
+ public:
+  ScopedRecord(const std::string& stage, const std::string& frame = "", const int cameras = 0);
+  ~ScopedRecord();
+
+  ScopedRecord(const ScopedRecord&) = delete;
+  ScopedRecord& operator=(const ScopedRecord&) = delete;
+
+  // Process counters at a point in time
+  struct Snapshot {
+    std::chrono::system_clock::time_point wall;
+    double cpuSeconds;
+    int64_t readBytes;
+    int64_t writtenBytes;
+
+    static Snapshot now();
+  };
+
+ private:
+  const std::string stage;
+  const std::string frame;
+  const int cameras;
+  Snapshot start;
+  std::unique_ptr<system_util::RssHighWater> rss;
+};
+
+} // namespace bench_trace
+} // namespace fb360_dep
@@ -0,0 +1,75 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace fb360_dep {
+
+// FIFO connecting the stages of a pipeline
+// push() blocks while the queue is full, so a fast producer cannot run ahead of its consumers by
+// more than capacity items, pop() blocks while it is empty
+// Once close() is called pushes are rejected, and pops return false after the remaining items
+// have been drained. Close when all the producers are done to release the consumers
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(const size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Returns false if the queue was closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    lock.unlock();
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Returns false if the queue is closed and empty
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    lock.unlock();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+ private:
+  const size_t capacity;
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::deque<T> items;
+  bool closed = false;
+};
+
+} // namespace fb360_dep
@@ -9,6 +9,8 @@
 
 #include <unsupported/Eigen/Polynomials>
 
+#include "source/util/CameraModel.h"
+
 #include <folly/Format.h>
 
 namespace fb360_dep {
@@ -150,6 +152,68 @@ void Camera::setDistortion(const Distortion& distortion) {
   distortionMax_ = sqrt(y);
 }
 
+std::vector<Camera::Vector2> Camera::pixels(const std::vector<Vector3>& points) const {
+  std::vector<Vector2> result(points.size());
+  withCameraModel(*this, [&](const auto& model) {
+    for (int i = 0; i < int(points.size()); ++i) {
+      result[i] = model.pixel(points[i]);
+    }
+  });
+  return result;
+}
+
+std::vector<Camera::Vector3> Camera::rigs(const std::vector<Vector2>& pixels, const Real depth)
+    const {
+  // transform from pixel to distorted sensor coordinates
+  std::vector<Vector2> sensors(pixels.size());
+  Real maxNorm = 0;
+  for (int i = 0; i < int(pixels.size()); ++i) {
+    sensors[i] = (pixels[i] - principal).cwiseQuotient(focal);
+    maxNorm = std::max(maxNorm, sensors[i].norm());
+  }
+
+  // tabulate undistort() over the norms in the batch, unless newton's method is cheaper
+  static const int kTableSize = 256;
+  const Real yEnd = distort(distortionMax_);
+  const Real yMax = std::min(maxNorm, yEnd);
+  std::vector<Real> table;
+  if (!getDistortion().isZero() && int(pixels.size()) >= kTableSize && yMax > 0) {
+    table.resize(kTableSize);
+    for (int j = 0; j < kTableSize; ++j) {
+      table[j] = undistort(yMax * j / (kTableSize - 1));
+    }
+  }
+  const Real step = yMax / (kTableSize - 1);
+
+  const Real smidgen = 1.0 / kNearInfinity;
+  const Matrix3 cameraToRig = rotation.transpose();
+  std::vector<Vector3> result(pixels.size());
+  withCameraModel(*this, [&](const auto& model) {
+    for (int i = 0; i < int(pixels.size()); ++i) {
+      const Vector2& sensor = sensors[i];
+      const Real norm = sensor.norm();
+      if (norm == 0) {
+        result[i] = position + depth * (cameraToRig * Vector3(0, 0, -1));
+        continue;
+      }
+      Real r;
+      if (table.empty() || norm >= yEnd) {
+        r = undistort(norm);
+      } else {
+        // interpolate, then take one newton step with the slope of the table
+        const int j = std::min(int(norm / step), kTableSize - 2);
+        const Real slope = (table[j + 1] - table[j]) / step;
+        const Real x0 = table[j] + (norm - j * step) * slope;
+        const Real x1 = x0 + (norm - distort(x0)) * slope;
+        r = std::abs(distort(x1) - norm) < smidgen ? x1 : undistort(norm);
+      }
+      // transform from distorted sensor coordinates to unit camera vector, then to rig space
+      result[i] = position + depth * (cameraToRig * model.sensorToCamera(sensor, norm, r));
+    }
+  });
+  return result;
+}
+
 #ifndef SUPPRESS_RIG_IO
 
 folly::dynamic Camera::serialize() const {
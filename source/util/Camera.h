@@ -141,6 +141,11 @@ struct Camera {
     return rig(pixel).pointAt(depth);
   }
 
+  // batch versions of pixel() and rig(pixel, depth), for many points of the same camera
+  // rigs() undistorts through a table built for the batch rather than solving for every pixel
+  std::vector<Vector2> pixels(const std::vector<Vector3>& points) const;
+  std::vector<Vector3> rigs(const std::vector<Vector2>& pixels, const Real depth) const;
+
   // compute rig coordinates for point near infinity, inverse of pixel()
   Vector3 rigNearInfinity(const Vector2& pixel) const {
     return rig(pixel, kNearInfinity);
@@ -242,6 +247,27 @@ struct Camera {
     return 1 + rSquared * result;
   }
 
+  // solve y = distort(x) for x using newton's method, starting at x0 with y0 = distort(x0) and
+  // slope dy0
+  Real solveDistort(const Real y, Real x0, Real y0, Real dy0) const {
+    const Real smidgen = 1.0 / kNearInfinity;
+    const int kMaxSteps = 10;
+
+    for (int step = 0; step < kMaxSteps; ++step) {
+      const Real x1 = (y - y0) / dy0 + x0;
+      const Real y1 = distort(x1);
+      if (std::abs(y1 - y) < smidgen) {
+        return x1; // close enough
+      }
+      Real dy1 = (distort(x1 + smidgen) - y1) / smidgen;
+      CHECK_GE(dy1, 0) << "went past a maximum";
+      x0 = x1;
+      y0 = y1;
+      dy0 = dy1;
+    }
+    return x0; // this should not happen
+  }
+
  public:
   // distortion is modeled in pixel space as:
   //   distort(r) = r + d0 * r^3 + d1 * r^5
@@ -259,26 +285,7 @@ struct Camera {
       return distortionMax_;
     }
 
-    const Real smidgen = 1.0 / kNearInfinity;
-    const int kMaxSteps = 10;
-
-    // solve y = distort(x) for y using newton's method
-    Real x0 = 0;
-    Real y0 = 0;
-    Real dy0 = 1;
-    for (int step = 0; step < kMaxSteps; ++step) {
-      const Real x1 = (y - y0) / dy0 + x0;
-      const Real y1 = distort(x1);
-      if (std::abs(y1 - y) < smidgen) {
-        return x1; // close enough
-      }
-      Real dy1 = (distort(x1 + smidgen) - y1) / smidgen;
-      CHECK_GE(dy1, 0) << "went past a maximum";
-      x0 = x1;
-      y0 = y1;
-      dy0 = dy1;
-    }
-    return x0; // this should not happen
+    return solveDistort(y, 0, 0, 1);
   }
 
   Vector3 pixelToCamera(const Vector2& pixel) const {
@@ -295,20 +302,22 @@ struct Camera {
     return sensor.cwiseProduct(focal) + principal;
   }
 
- private:
+ public:
+  // projections for a type known at compile time, the branches on kType fold away, see CameraModel
+  template <Type kType>
   Vector2 cameraToSensor(const Vector3& camera) const {
     // FTHETA: r = theta
     // RECTILINEAR: r = tan(theta)
     // EQUISOLID: r = 2 sin(theta / 2)
     // ORTHOGRAPHIC: r = sin(theta)
     // see https://wiki.panotools.org/Fisheye_Projection
-    if (type == Type::FTHETA) {
+    if (kType == Type::FTHETA) {
       Real xy = camera.head<2>().norm();
       // r = theta <=>
       // r = atan2(|xy|, -z)
       Real r = atan2(xy, -camera.z());
       return distort(r) / xy * camera.head<2>();
-    } else if (type == Type::RECTILINEAR) {
+    } else if (kType == Type::RECTILINEAR) {
       // r = tan(theta) <=>
       // r = |xy| / -z <=>
       // pre-distortion result is xy / -z
@@ -320,7 +329,7 @@ struct Camera {
         r = xy / -camera.z();
       }
       return distort(r) / xy * camera.head<2>();
-    } else if (type == Type::EQUISOLID) {
+    } else if (kType == Type::EQUISOLID) {
       Real xy = camera.head<2>().norm();
       // r = 2 sin(theta / 2) <=>
       //   using sin(theta / 2) = sqrt((1 - cos(theta)) / 2)
@@ -328,7 +337,6 @@ struct Camera {
       Real r = 2 * sqrt((1 + camera.z() / camera.norm()) / 2);
       return distort(r) / xy * camera.head<2>();
     } else {
-      CHECK(type == Type::ORTHOGRAPHIC) << "unexpected: " << int(type);
       // r = sin(theta) <=>
       // r = |xy| / |xyz| <=>
       // pre-distortion result is xy / |xyz|
@@ -339,32 +347,37 @@ struct Camera {
   }
 
   // compute unit vector in camera coors from normalized sensor coors
+  template <Type kType>
   Vector3 sensorToCamera(const Vector2& sensor) const {
-    // FTHETA: r = theta
-    // RECTILINEAR: r = tan(theta)
-    // EQUISOLID: r = 2 sin(theta / 2)
-    // ORTHOGRAPHIC: r = sin(theta)
-    // see https://wiki.panotools.org/Fisheye_Projection
     Real squaredNorm = sensor.squaredNorm();
     if (squaredNorm == 0) {
       // avoid divide-by-zero later
       return Vector3(0, 0, -1);
     }
     Real norm = sqrt(squaredNorm);
-    Real r = undistort(norm);
+    return sensorToCamera<kType>(sensor, norm, undistort(norm));
+  }
+
+  // same, given the norm of sensor and its undistorted value r
+  template <Type kType>
+  Vector3 sensorToCamera(const Vector2& sensor, const Real norm, const Real r) const {
+    // FTHETA: r = theta
+    // RECTILINEAR: r = tan(theta)
+    // EQUISOLID: r = 2 sin(theta / 2)
+    // ORTHOGRAPHIC: r = sin(theta)
+    // see https://wiki.panotools.org/Fisheye_Projection
     Real theta;
-    if (type == Type::FTHETA) {
+    if (kType == Type::FTHETA) {
       // r = theta
       theta = r;
-    } else if (type == Type::RECTILINEAR) {
+    } else if (kType == Type::RECTILINEAR) {
       // r = tan(theta)
       theta = atan(r);
-    } else if (type == Type::EQUISOLID) {
+    } else if (kType == Type::EQUISOLID) {
       // r = 2 sin(theta / 2)
       // Note: arcsin function is undefined outside the interval [-1, 1]
       theta = r <= 2 ? 2 * asin(r / 2) : M_PI;
     } else {
-      CHECK(type == Type::ORTHOGRAPHIC) << "unexpected: " << int(type);
       // r = sin(theta)
       theta = r <= 1 ? asin(r) : M_PI / 2;
     }
@@ -375,6 +388,35 @@ struct Camera {
     return unit;
   }
 
+ private:
+  Vector2 cameraToSensor(const Vector3& camera) const {
+    switch (type) {
+      case Type::FTHETA:
+        return cameraToSensor<Type::FTHETA>(camera);
+      case Type::RECTILINEAR:
+        return cameraToSensor<Type::RECTILINEAR>(camera);
+      case Type::EQUISOLID:
+        return cameraToSensor<Type::EQUISOLID>(camera);
+      default:
+        CHECK(type == Type::ORTHOGRAPHIC) << "unexpected: " << int(type);
+        return cameraToSensor<Type::ORTHOGRAPHIC>(camera);
+    }
+  }
+
+  Vector3 sensorToCamera(const Vector2& sensor) const {
+    switch (type) {
+      case Type::FTHETA:
+        return sensorToCamera<Type::FTHETA>(sensor);
+      case Type::RECTILINEAR:
+        return sensorToCamera<Type::RECTILINEAR>(sensor);
+      case Type::EQUISOLID:
+        return sensorToCamera<Type::EQUISOLID>(sensor);
+      default:
+        CHECK(type == Type::ORTHOGRAPHIC) << "unexpected: " << int(type);
+        return sensorToCamera<Type::ORTHOGRAPHIC>(sensor);
+    }
+  }
+
   template <typename T>
   static folly::dynamic serializeVector(const T& v) {
     return folly::dynamic(v.data(), v.data() + v.size());
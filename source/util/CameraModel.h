@@ -0,0 +1,117 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "source/util/Camera.h"
+
+namespace fb360_dep {
+
+// View of a camera whose type is known at compile time, for loops over many points of one camera
+// Projections skip the per point switch on Camera::type, and the image circle is computed once
+// The camera must outlive the view and not change while it is in use
+template <Camera::Type kType>
+class CameraModel {
+ public:
+  using Real = Camera::Real;
+  using Vector2 = Camera::Vector2;
+  using Vector3 = Camera::Vector3;
+  using Ray = Camera::Ray;
+
+  explicit CameraModel(const Camera& camera) : camera(camera) {
+    CHECK(camera.type == kType) << "unexpected: " << int(camera.type);
+    if (!camera.isDefaultFov()) {
+      // see Camera::isOutsideImageCircle()
+      const Real sinFov = std::sqrt(1 - camera.cosFov * camera.cosFov);
+      const Vector3 edge(0, sinFov, -camera.cosFov);
+      edgeSquaredNorm = camera.cameraToSensor<kType>(edge).squaredNorm();
+    }
+  }
+
+  const Camera& getCamera() const {
+    return camera;
+  }
+
+  // same as Camera::pixel()
+  Vector2 pixel(const Vector3& rig) const {
+    const Vector3 unit = camera.rotation * (rig - camera.position);
+    return camera.focal.cwiseProduct(camera.cameraToSensor<kType>(unit)) + camera.principal;
+  }
+
+  // same as Camera::rig()
+  Ray rig(const Vector2& pixel) const {
+    const Vector2 sensor = (pixel - camera.principal).cwiseQuotient(camera.focal);
+    return Ray(camera.position, camera.rotation.transpose() * camera.sensorToCamera<kType>(sensor));
+  }
+
+  Vector3 rig(const Vector2& pixel, const Real depth) const {
+    return rig(pixel).pointAt(depth);
+  }
+
+  // unit camera vector of sensor, given its norm and undistorted norm r, see Camera::rigs()
+  Vector3 sensorToCamera(const Vector2& sensor, const Real norm, const Real r) const {
+    return camera.sensorToCamera<kType>(sensor, norm, r);
+  }
+
+  bool isOutsideFov(const Vector3& rig) const {
+    return camera.isOutsideFov(rig);
+  }
+
+  bool isOutsideImageCircle(const Vector2& pix) const {
+    const Vector2 sensor = (pix - camera.principal).cwiseQuotient(camera.focal);
+    return sensor.squaredNorm() >= edgeSquaredNorm;
+  }
+
+  bool isOutsideSensor(const Vector2& pix) const {
+    return camera.isOutsideSensor(pix);
+  }
+
+  bool sees(const Vector3& rig, Vector2& pix) const {
+    if (isOutsideFov(rig)) {
+      return false;
+    }
+    pix = pixel(rig);
+    return !isOutsideSensor(pix);
+  }
+
+  bool sees(const Vector3& rig) const {
+    Vector2 ignored;
+    return sees(rig, ignored);
+  }
+
+ private:
+  const Camera& camera;
+  Real edgeSquaredNorm = std::numeric_limits<Real>::infinity(); // default fov: no image circle
+};
+
+// Calls fn(model) with the CameraModel of camera's type and returns its result
+// fn is typically a generic lambda, so a loop over the points of a camera inside it is compiled
+// once per camera type, e.g.
+//   withCameraModel(camera, [&](const auto& model) {
+//     for (...) { pixels[i] = model.pixel(points[i]); }
+//   });
+template <typename Fn>
+auto withCameraModel(const Camera& camera, Fn&& fn)
+    -> decltype(fn(CameraModel<Camera::Type::FTHETA>(camera))) {
+  switch (camera.type) {
+    case Camera::Type::FTHETA:
+      return fn(CameraModel<Camera::Type::FTHETA>(camera));
+    case Camera::Type::RECTILINEAR:
+      return fn(CameraModel<Camera::Type::RECTILINEAR>(camera));
+    case Camera::Type::EQUISOLID:
+      return fn(CameraModel<Camera::Type::EQUISOLID>(camera));
+    default:
+      return fn(CameraModel<Camera::Type::ORTHOGRAPHIC>(camera));
+  }
+}
+
+} // namespace fb360_dep
@@ -7,22 +7,199 @@
 
 #include "source/util/CvUtil.h"
 
+#include <cstring>
 #include <fstream>
+#include <random>
 #include <string>
 #include <vector>
 
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <folly/Format.h>
 #include <glog/logging.h>
 
+#include "source/util/TarArchive.h"
+#include "source/util/VideoReader.h"
+
 namespace fb360_dep {
 namespace cv_util {
 
 using namespace math_util;
 
+namespace {
+
+const uint32_t kMatFileMagic = 0x54414d44; // "DMAT"
+const uint32_t kMatFileVersion = 1;
+
+// How the payload encodes the pixels. A new codec gets a case in writeMatFile and readMatFile
+enum class MatFileCodec : uint32_t {
+  RAW = 0, // rows * cols * elemSize bytes, row major
+};
+
+struct MatFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t rows;
+  int32_t cols;
+  int32_t type; // opencv type, e.g. CV_16UC3
+  uint32_t codec;
+  uint64_t bytes; // payload after the header
+  uint8_t padding[32]; // pixels start 64 bytes into the file
+};
+static_assert(sizeof(MatFileHeader) == 64, "MatFileHeader must be 64 bytes");
+
+cv::Mat convertChannels(const cv::Mat& image, const int channels) {
+  const int chI = image.channels();
+  if (chI == channels) {
+    return image;
+  }
+  cv::Mat result;
+  if (chI == 1 && channels == 3) {
+    cv::cvtColor(image, result, cv::COLOR_GRAY2BGR);
+  } else if (chI == 3 && channels == 1) {
+    cv::cvtColor(image, result, cv::COLOR_BGR2GRAY);
+  } else if (chI == 4 && channels == 1) {
+    cv::cvtColor(image, result, cv::COLOR_BGRA2GRAY);
+  } else if (chI == 4 && channels == 3) {
+    cv::cvtColor(image, result, cv::COLOR_BGRA2BGR);
+  } else {
+    CHECK(false) << "Conversion from " << chI << " channels to " << channels << " not supported";
+  }
+  return result;
+}
+
+// What cv::imread would return with flags for an image file holding these pixels
+cv::Mat applyImreadFlags(const cv::Mat& image, const int flags) {
+  if (flags == cv::IMREAD_UNCHANGED) {
+    return image;
+  }
+  cv::Mat result = flags & cv::IMREAD_ANYDEPTH ? image : convertTo(image, CV_8U);
+  if (!(flags & cv::IMREAD_ANYCOLOR)) {
+    result = convertChannels(result, flags & cv::IMREAD_COLOR ? 3 : 1);
+  }
+  return result;
+}
+
+// The member of a frame archive holding path, if path itself does not exist, see
+// tar_util::findImage. Null if there is none
+std::shared_ptr<const tar_util::TarArchive> findInArchive(
+    const filesystem::path& path,
+    const tar_util::TarArchive::Member*& member) {
+  if (filesystem::exists(path)) {
+    return nullptr;
+  }
+  return tar_util::findImage(path, member);
+}
+
+cv::Mat decodeMatFile(const filesystem::path& path, const char* const data, const size_t size) {
+  CHECK_GE(size, sizeof(MatFileHeader)) << folly::sformat("truncated image: {}", path.string());
+  const MatFileHeader& header = *reinterpret_cast<const MatFileHeader*>(data);
+  CHECK_EQ(header.magic, kMatFileMagic) << folly::sformat("not a mat file: {}", path.string());
+  CHECK_EQ(header.version, kMatFileVersion)
+      << folly::sformat("unsupported mat file version: {}", path.string());
+  CHECK_EQ(size, sizeof(header) + header.bytes)
+      << folly::sformat("truncated image: {}", path.string());
+
+  cv::Mat mat(header.rows, header.cols, header.type);
+  switch (MatFileCodec(header.codec)) {
+    case MatFileCodec::RAW:
+      CHECK_EQ(header.bytes, mat.total() * mat.elemSize())
+          << folly::sformat("corrupt image: {}", path.string());
+      memcpy(mat.data, data + sizeof(header), header.bytes);
+      break;
+    default:
+      LOG(FATAL) << folly::sformat("unknown codec {} in {}", header.codec, path.string());
+  }
+  return mat;
+}
+
+cv::Mat_<float> readPfm(std::istream& file, const filesystem::path& path) {
+  CHECK(file.good()) << "cannot load file: " << path;
+
+  std::string format;
+  getline(file, format);
+  CHECK_EQ(format, "Pf") << folly::sformat(
+      "expected 'Pf' in 1-channel .pfm file header: {}", path.string());
+
+  int width, height;
+  file >> width >> height;
+
+  double endian;
+  file >> endian;
+  CHECK_LE(endian, 0.0) << folly::sformat(
+      "only little endian .pfm files supported: ", path.string());
+  file.ignore(); // eat newline
+
+  cv::Mat_<float> m(cv::Size(width, height));
+  file.read((char*)m.ptr(), width * height * sizeof(float));
+  return m;
+}
+
+// Reads bytes in memory as a stream, without copying them
+struct MemoryBuffer : std::streambuf {
+  MemoryBuffer(const char* const data, const size_t size) {
+    char* const begin = const_cast<char*>(data);
+    setg(begin, begin, begin + size);
+  }
+};
+
+} // namespace
+
+void writeMatFile(const filesystem::path& path, const cv::Mat& mat) {
+  CHECK_EQ(mat.dims, 2) << folly::sformat("expected a 2d image: {}", path.string());
+  const cv::Mat contiguous = mat.isContinuous() ? mat : mat.clone();
+  MatFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kMatFileMagic;
+  header.version = kMatFileVersion;
+  header.rows = contiguous.rows;
+  header.cols = contiguous.cols;
+  header.type = contiguous.type();
+  header.codec = uint32_t(MatFileCodec::RAW);
+  header.bytes = contiguous.total() * contiguous.elemSize();
+
+  std::ofstream file(path.string(), std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(contiguous.data), header.bytes);
+  file.close();
+  CHECK(file) << folly::sformat("failed to save image: {}", path.string());
+}
+
+void writeMatFileAtomically(const filesystem::path& path, const cv::Mat& mat) {
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  writeMatFile(tmpPath, mat);
+  filesystem::rename(tmpPath, path);
+}
+
+cv::Mat readMatFile(const filesystem::path& path) {
+  const tar_util::TarArchive::Member* member;
+  if (const auto archive = findInArchive(path, member)) {
+    return decodeMatFile(path, member->data, member->size);
+  }
+  CHECK(filesystem::exists(path)) << folly::sformat("failed to load image: {}", path.string());
+  CHECK_GE(filesystem::file_size(path), sizeof(MatFileHeader))
+      << folly::sformat("truncated image: {}", path.string());
+  const boost::interprocess::file_mapping file(
+      path.string().c_str(), boost::interprocess::read_only);
+  const boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+  return decodeMatFile(path, static_cast<const char*>(region.get_address()), region.get_size());
+}
+
 cv::Mat imreadExceptionOnFail(const filesystem::path& filename, const int flags) {
+  if (isMatFile(filename)) {
+    return applyImreadFlags(readMatFile(filename), flags);
+  }
   CHECK_NE(filename.extension(), ".pfm")
       << folly::sformat("Cannot imread .pfm with OpenCV: ", filename.string());
-  const cv::Mat image = cv::imread(filename.string(), flags);
+  const tar_util::TarArchive::Member* member;
+  const auto archive = findInArchive(filename, member);
+  if (!archive && !filesystem::exists(filename) && video_util::isVideoFrame(filename)) {
+    return applyImreadFlags(video_util::readVideoFrame(filename), flags);
+  }
+  const cv::Mat image = archive
+      ? cv::imdecode(cv::Mat(1, member->size, CV_8U, const_cast<char*>(member->data)), flags)
+      : cv::imread(filename.string(), flags);
   CHECK(!image.empty()) << folly::sformat("failed to load image: {}", filename.string());
   return image;
 }
@@ -31,11 +208,19 @@ void imwriteExceptionOnFail(
     const filesystem::path& filename,
     const cv::Mat& image,
     const std::vector<int>& params) {
+  if (isMatFile(filename)) {
+    writeMatFile(filename, image);
+    return;
+  }
   CHECK(imwrite(filename.string(), image, params))
       << folly::sformat("failed to save image: {}", filename.string());
 }
 
 void writeCvMat32FC1ToPFM(const filesystem::path& path, const cv::Mat_<float>& m) {
+  if (isMatFile(path)) {
+    writeMatFile(path, m);
+    return;
+  }
   const int height = m.rows;
   const int width = m.cols;
 
@@ -48,27 +233,19 @@ void writeCvMat32FC1ToPFM(const filesystem::path& path, const cv::Mat_<float>& m
 }
 
 cv::Mat_<float> readCvMat32FC1FromPFM(const filesystem::path& path) {
+  if (isMatFile(path)) {
+    const cv::Mat mat = readMatFile(path);
+    CHECK_EQ(mat.type(), CV_32FC1) << folly::sformat("expected a float image: {}", path.string());
+    return mat;
+  }
+  const tar_util::TarArchive::Member* member;
+  if (const auto archive = findInArchive(path, member)) {
+    MemoryBuffer buffer(member->data, member->size);
+    std::istream file(&buffer);
+    return readPfm(file, path);
+  }
   std::ifstream file(path.string(), std::ios::binary);
-
-  CHECK(file.good()) << "cannot load file: " << path;
-
-  std::string format;
-  getline(file, format);
-  CHECK_EQ(format, "Pf") << folly::sformat(
-      "expected 'Pf' in 1-channel .pfm file header: {}", path.string());
-
-  int width, height;
-  file >> width >> height;
-
-  double endian;
-  file >> endian;
-  CHECK_LE(endian, 0.0) << folly::sformat(
-      "only little endian .pfm files supported: ", path.string());
-  file.ignore(); // eat newline
-
-  cv::Mat_<float> m(cv::Size(width, height));
-  file.read((char*)m.ptr(), width * height * sizeof(float));
-  return m;
+  return readPfm(file, path);
 }
 
 } // namespace cv_util
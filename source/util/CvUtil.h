@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <string>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -74,6 +76,23 @@ void writeCvMat32FC1ToPFM(const filesystem::path& path, const cv::Mat_<float>& m
 
 cv::Mat_<float> readCvMat32FC1FromPFM(const filesystem::path& path);
 
+// Uncompressed files for intermediate images that a later stage reads back at memcpy speed
+// A 64-byte header (magic, version, rows, cols, opencv type, codec, payload bytes) is followed by
+// the pixels, row major. Any depth and channel count round-trips losslessly. All save and load
+// helpers above and below, including the pfm ones, switch to it on this extension
+const std::string kMatFileExtension = ".dmat";
+
+inline bool isMatFile(const filesystem::path& path) {
+  return path.extension() == kMatFileExtension;
+}
+
+void writeMatFile(const filesystem::path& path, const cv::Mat& mat);
+
+// Writes to a temporary file and renames it, so concurrent readers never see a partial file
+void writeMatFileAtomically(const filesystem::path& path, const cv::Mat& mat);
+
+cv::Mat readMatFile(const filesystem::path& path);
+
 template <typename T>
 const T& clampToEdge(const cv::Mat_<T>& src, const int x, const int y) {
   return src(math_util::clamp(y, 0, src.rows - 1), math_util::clamp(x, 0, src.cols - 1));
@@ -332,54 +351,64 @@ inline cv::Mat_<bool> dilate(const cv::Mat_<bool>& mat, const int dilateRadius =
   return matDilated;
 }
 
+// Median of the neighbors inside mask, background (if any) outside of it
+// Runs one task per row. Neighbors are gathered into a buffer reused across the row, and only the
+// middle of it is ordered
 inline cv::Mat_<float> maskedMedianBlur(
     const cv::Mat_<float>& mat,
     const cv::Mat_<float>& background,
     const cv::Mat_<bool>& mask,
     const int radius,
-    const bool ignoreNan = true) {
+    const bool ignoreNan = true,
+    const int numThreads = -1) {
   cv::Mat_<float> blurred(mat.size(), 0.0);
-  for (int y = 0; y < mat.rows; ++y) {
-    for (int x = 0; x < mat.cols; ++x) {
-      std::vector<float> values;
-      if (!mask(y, x)) {
-        if (!background.empty()) {
-          blurred(y, x) = background(y, x);
-        }
-        continue;
-      }
-      for (int yy = y - radius; yy <= y + radius; ++yy) {
-        for (int xx = x - radius; xx <= x + radius; ++xx) {
-          // Ignore out of bounds
-          if (0 > yy || yy >= mat.rows || 0 > xx || xx >= mat.cols) {
+  const int diameter = 2 * radius + 1;
+  parallelFor(
+      0,
+      mat.rows,
+      1,
+      [&](const int y) {
+        std::vector<float> values(diameter * diameter);
+        const int yBegin = std::max(y - radius, 0);
+        const int yEnd = std::min(y + radius + 1, mat.rows);
+        for (int x = 0; x < mat.cols; ++x) {
+          if (!mask(y, x)) {
+            if (!background.empty()) {
+              blurred(y, x) = background(y, x);
+            }
             continue;
           }
 
-          // Ignore outside mask
-          if (!mask(yy, xx)) {
-            continue;
+          // Ignore out of bounds and outside mask
+          const int xBegin = std::max(x - radius, 0);
+          const int xEnd = std::min(x + radius + 1, mat.cols);
+          int count = 0;
+          for (int yy = yBegin; yy < yEnd; ++yy) {
+            const float* const row = mat.ptr<float>(yy);
+            const bool* const rowMask = mask.ptr<bool>(yy);
+            for (int xx = xBegin; xx < xEnd; ++xx) {
+              // Ignore NAN values if specified to do so
+              const float value = row[xx];
+              if (rowMask[xx] && !(ignoreNan && (std::isnan(value) || value == 0))) {
+                values[count++] = value;
+              }
+            }
           }
 
-          // Ignore NAN values if specified to do so
-          if (ignoreNan && (std::isnan(mat(yy, xx)) || mat(yy, xx) == 0)) {
-            continue;
+          if (count != 0) {
+            const int n = count / 2;
+            std::nth_element(values.begin(), values.begin() + n, values.begin() + count);
+            if (count % 2 == 1) {
+              blurred(y, x) = values[n];
+            } else {
+              // Lower middle is the largest of the values before the upper one
+              const float lower = *std::max_element(values.begin(), values.begin() + n);
+              blurred(y, x) = (lower + values[n]) / 2.0;
+            }
           }
-
-          values.push_back(mat(yy, xx));
-        }
-      }
-
-      if (values.size() != 0) {
-        const size_t n = values.size() / 2;
-        std::partial_sort(values.begin(), values.begin() + n + 1, values.end());
-        if (values.size() % 2 == 1) {
-          blurred(y, x) = values[n];
-        } else {
-          blurred(y, x) = (values[n - 1] + values[n]) / 2.0;
         }
-      }
-    }
-  }
+      },
+      numThreads);
   return blurred;
 }
 
@@ -16,6 +16,9 @@
 #include <boost/filesystem.hpp>
 #endif
 
+#include <cstdlib>
+#include <string>
+
 #include <glog/logging.h>
 
 namespace filesystem {
@@ -92,4 +95,24 @@ inline const std::string getFirstExtension(const filesystem::path& dir) {
   return paths[0].extension().string();
 }
 
+// Node-local shared memory: shm://<path> names <path> in a tmpfs directory, $DEP_SHM_ROOT if set
+// Stages chained on one node that save and load intermediates there never touch the disk, and
+// with .dmat images a load is a single copy out of the page cache
+const std::string kShmScheme = "shm://";
+const std::string kDefaultShmRoot = "/dev/shm/fb360_dep";
+
+inline bool isShmUri(const std::string& uri) {
+  return uri.compare(0, kShmScheme.size(), kShmScheme) == 0;
+}
+
+inline path getShmRoot() {
+  const char* root = std::getenv("DEP_SHM_ROOT");
+  return root && *root ? path(root) : path(kDefaultShmRoot);
+}
+
+// Local path a uri refers to. Plain paths are returned unchanged
+inline path resolveUri(const std::string& uri) {
+  return isShmUri(uri) ? getShmRoot() / uri.substr(kShmScheme.size()) : path(uri);
+}
+
 } // namespace filesystem
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/Fingerprint.h"
+
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+#include "source/util/TarArchive.h"
+
+namespace fb360_dep {
+
+Fingerprint& Fingerprint::addFile(const filesystem::path& path) {
+  add(path.filename().string());
+  const tar_util::TarArchive::Member* member;
+  if (filesystem::is_regular_file(path)) {
+    add(std::to_string(filesystem::file_size(path)));
+    if (filesystem::file_size(path) > 0) {
+      const boost::interprocess::file_mapping file(
+          path.string().c_str(), boost::interprocess::read_only);
+      const boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+      hash = folly::hash::fnv64_buf(region.get_address(), region.get_size(), hash);
+    }
+  } else if (const auto archive = tar_util::findImage(path, member)) {
+    add(std::to_string(member->size));
+    hash = folly::hash::fnv64_buf(member->data, member->size, hash);
+  } else {
+    add("missing");
+  }
+  return *this;
+}
+
+Fingerprint& Fingerprint::addFlags(
+    const std::string& filename,
+    const std::set<std::string>& ignored) {
+  std::vector<gflags::CommandLineFlagInfo> flags;
+  gflags::GetAllFlags(&flags); // sorted by filename, then name
+  for (const gflags::CommandLineFlagInfo& flag : flags) {
+    if (flag.filename == filename && !ignored.count(flag.name)) {
+      add(flag.name + "=" + flag.current_value);
+    }
+  }
+  return *this;
+}
+
+std::string Fingerprint::str() const {
+  return folly::sformat("{:016x}", hash);
+}
+
+filesystem::path getFingerprintPath(const filesystem::path& output) {
+  return output.parent_path() / ("." + output.filename().string() + ".fingerprint");
+}
+
+void writeFingerprint(const filesystem::path& output, const Fingerprint& fingerprint) {
+  const filesystem::path path = getFingerprintPath(output);
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  {
+    std::ofstream file(tmpPath.string());
+    file << fingerprint.str() << std::endl;
+    CHECK(file) << "Cannot write " << tmpPath;
+  }
+  filesystem::rename(tmpPath, path);
+}
+
+bool hasFingerprint(const filesystem::path& output, const Fingerprint& fingerprint) {
+  if (!filesystem::is_regular_file(output)) {
+    return false;
+  }
+  std::ifstream file(getFingerprintPath(output).string());
+  std::string saved;
+  return std::getline(file, saved) && saved == fingerprint.str();
+}
+
+} // namespace fb360_dep
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+#include <folly/hash/Hash.h>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+
+// Hash of everything an output depends on: its input files, by content, and the flags that change
+// it. Saved next to the output (see writeFingerprint), so a later run given the same inputs and
+// flags can tell the output would come out the same and skip recomputing it. Inputs rewritten by
+// an upstream stage with the same content keep the fingerprint, so only affected frames are redone
+class Fingerprint {
+ public:
+  // Bumped when a change to the code changes outputs
+  static const int kVersion = 1;
+
+  explicit Fingerprint(const std::string& app) {
+    add(app + " " + std::to_string(kVersion));
+  }
+
+  Fingerprint& add(const std::string& value) {
+    // Length first, so that ("ab", "c") and ("a", "bc") differ
+    hash = folly::hash::fnv64(std::to_string(value.size()) + ":" + value, hash);
+    return *this;
+  }
+
+  // Contents of a file, read from its frame's archive if it was not extracted (see TarArchive.h).
+  // A missing file counts as such rather than failing, the app reports it when it reads it
+  Fingerprint& addFile(const filesystem::path& path);
+
+  // Current values of the flags defined in filename (i.e. __FILE__ of the app), but ignored ones,
+  // e.g. threads, paths of inputs added by content and outputs
+  Fingerprint& addFlags(const std::string& filename, const std::set<std::string>& ignored);
+
+  uint64_t get() const {
+    return hash;
+  }
+
+  std::string str() const;
+
+ private:
+  uint64_t hash = folly::hash::FNV_64_HASH_START;
+};
+
+// Hidden sidecar file next to output, so image directory listings skip it
+filesystem::path getFingerprintPath(const filesystem::path& output);
+
+// Writes the sidecar atomically. Call once the output is on disk
+void writeFingerprint(const filesystem::path& output, const Fingerprint& fingerprint);
+
+// True if output exists and its sidecar holds fingerprint
+bool hasFingerprint(const filesystem::path& output, const Fingerprint& fingerprint);
+
+} // namespace fb360_dep
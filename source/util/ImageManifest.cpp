@@ -0,0 +1,136 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/ImageManifest.h"
+
+#include <mutex>
+#include <random>
+
+#include <glog/logging.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Format.h>
+#include <folly/json.h>
+
+#include "source/util/CvUtil.h"
+
+namespace fb360_dep {
+namespace image_util {
+
+ImageManifest scanImageDir(const filesystem::path& dir) {
+  ImageManifest manifest;
+  for (const filesystem::path& camDir : filesystem::getDirectoriesSorted(dir)) {
+    if (filesystem::isHidden(camDir)) {
+      continue;
+    }
+    const std::vector<filesystem::path> files = filesystem::getVisibleFilesSorted(camDir);
+    if (files.empty()) {
+      continue;
+    }
+    CameraImages& images = manifest[camDir.filename().string()];
+    images.extension = files.front().extension().string();
+    for (const filesystem::path& file : files) {
+      if (file.extension().string() == images.extension) {
+        images.frames.push_back(file.stem().string());
+      }
+    }
+    try {
+      images.size = cv_util::loadImageUnchanged(files.front()).size();
+    } catch (const std::exception& e) {
+      LOG(WARNING) << folly::sformat(
+          "Cannot read size of {}: {}", files.front().string(), e.what());
+    }
+  }
+  return manifest;
+}
+
+void writeManifest(const filesystem::path& dir) {
+  writeManifest(dir, scanImageDir(dir));
+}
+
+void writeManifest(const filesystem::path& dir, const ImageManifest& manifest) {
+  folly::dynamic cameras = folly::dynamic::object;
+  for (const auto& entry : manifest) {
+    const CameraImages& images = entry.second;
+    cameras[entry.first] = folly::dynamic::object("extension", images.extension)(
+        "size", folly::dynamic::array(images.size.width, images.size.height))(
+        "frames", folly::dynamic::array(images.frames.begin(), images.frames.end()));
+  }
+  folly::json::serialization_opts opts;
+  opts.sort_keys = true;
+
+  // Concurrent producers may write the same manifest, readers see one of them in full
+  const filesystem::path path = dir / kManifestFilename;
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  const folly::dynamic json = folly::dynamic::object("cameras", cameras);
+  CHECK(folly::writeFile(folly::json::serialize(json, opts), tmpPath.string().c_str()))
+      << folly::sformat("failed to write {}", tmpPath.string());
+  filesystem::rename(tmpPath, path);
+}
+
+static std::shared_ptr<const ImageManifest> readManifest(const filesystem::path& path) {
+  std::string contents;
+  CHECK(folly::readFile(path.string().c_str(), contents))
+      << folly::sformat("failed to read {}", path.string());
+  const folly::dynamic json = folly::parseJson(contents);
+  auto manifest = std::make_shared<ImageManifest>();
+  for (const auto& entry : json["cameras"].items()) {
+    CameraImages& images = (*manifest)[entry.first.asString()];
+    images.extension = entry.second["extension"].asString();
+    images.size = cv::Size(entry.second["size"][0].asInt(), entry.second["size"][1].asInt());
+    for (const folly::dynamic& frame : entry.second["frames"]) {
+      images.frames.push_back(frame.asString());
+    }
+  }
+  return manifest;
+}
+
+std::shared_ptr<const ImageManifest> getManifest(const filesystem::path& dir) {
+  using Time = decltype(filesystem::last_write_time(filesystem::path()));
+  struct Entry {
+    Time modified;
+    std::shared_ptr<const ImageManifest> manifest;
+  };
+  static std::mutex mutex;
+  static std::map<std::string, Entry> entries;
+
+  const filesystem::path path = dir / kManifestFilename;
+  if (!filesystem::exists(path)) {
+    return nullptr;
+  }
+  const Time modified = filesystem::last_write_time(path);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Entry& entry = entries[path.string()];
+  if (!entry.manifest || entry.modified != modified) {
+    entry.manifest = readManifest(path);
+    entry.modified = modified;
+  }
+  return entry.manifest;
+}
+
+const CameraImages* getCameraImages(
+    const std::shared_ptr<const ImageManifest>& manifest,
+    const std::string& camId) {
+  if (!manifest) {
+    return nullptr;
+  }
+  const auto it = manifest->find(camId);
+  return it == manifest->end() ? nullptr : &it->second;
+}
+
+std::string getImageExtension(const filesystem::path& dir, const std::string& camId) {
+  const std::shared_ptr<const ImageManifest> manifest = getManifest(dir);
+  if (const CameraImages* images = getCameraImages(manifest, camId)) {
+    return images->extension;
+  }
+  return filesystem::getFirstExtension(dir / camId);
+}
+
+} // namespace image_util
+} // namespace fb360_dep
@@ -0,0 +1,54 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace image_util {
+
+// Contents of an image directory laid out as <dir>/<camera>/<frame><extension>, so that consumers
+// do not have to list directories with thousands of files or decode an image to learn its size
+// Producers write it to <dir>/.manifest.json once they are done writing images (see writeManifest)
+// A manifest only speeds up lookups: frames it does not list are still looked for on disk
+struct CameraImages {
+  std::string extension; // extension of the first file, same as filesystem::getFirstExtension
+  cv::Size size; // of the first file, empty if unknown
+  std::vector<std::string> frames; // sorted names of the files with that extension
+};
+using ImageManifest = std::map<std::string, CameraImages>; // by camera id
+
+const std::string kManifestFilename = ".manifest.json";
+
+// Lists dir and decodes the first image of each camera
+ImageManifest scanImageDir(const filesystem::path& dir);
+
+// Writes the manifest of dir atomically, scanning dir if no manifest is given
+void writeManifest(const filesystem::path& dir);
+void writeManifest(const filesystem::path& dir, const ImageManifest& manifest);
+
+// Thread safe. Null if dir has no manifest. Manifests are cached until their file changes
+std::shared_ptr<const ImageManifest> getManifest(const filesystem::path& dir);
+
+// Camera images from the manifest of dir, null if there is none or it does not list camId
+const CameraImages* getCameraImages(
+    const std::shared_ptr<const ImageManifest>& manifest,
+    const std::string& camId);
+
+// Extension of the images of camId in dir, from the manifest if there is one
+std::string getImageExtension(const filesystem::path& dir, const std::string& camId);
+
+} // namespace image_util
+} // namespace fb360_dep
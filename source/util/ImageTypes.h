@@ -40,6 +40,7 @@ namespace fb360_dep {
   X(foreground_masks_levels, "video/foreground_masks_levels")         \
   X(fused, "fused")                                                   \
   X(mismatches, "mismatches")                                         \
+  X(profiles, "profiles")                                             \
   X(video_bin, "video/bin")                                           \
   X(video_disp, "video/disparity")                                    \
   X(video_disp_levels, "video/disparity_levels")                      \
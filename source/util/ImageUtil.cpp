@@ -7,29 +7,37 @@
 
 #include "source/util/ImageUtil.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include <boost/algorithm/string/split.hpp>
 
 namespace fb360_dep {
 namespace image_util {
 
-static inline const std::vector<filesystem::path> checkAndGetSortedFiles(
+// First and last lexical frames of the first camera of the rig
+static std::pair<std::string, std::string> getFirstAndLastFrames(
     const filesystem::path& imageDir,
     const Camera::Rig& rig) {
   CHECK_GT(rig.size(), 0);
+  const std::shared_ptr<const ImageManifest> manifest = getManifest(imageDir);
+  const CameraImages* images = getCameraImages(manifest, rig[0].id);
+  if (images && !images->frames.empty()) {
+    return std::make_pair(images->frames.front(), images->frames.back());
+  }
   filesystem::path camDir = imageDir / rig[0].id;
   CHECK(filesystem::exists(camDir)) << folly::sformat("No folder found at {}", camDir.string());
   const bool includeHidden = false;
   const std::vector<filesystem::path> sortedFiles =
       filesystem::getFilesSorted(camDir, includeHidden);
   CHECK_GT(sortedFiles.size(), 0) << folly::sformat("No files found in {}", camDir.string());
-  return sortedFiles;
+  return std::make_pair(sortedFiles.front().stem().string(), sortedFiles.back().stem().string());
 }
 
 // Get first lexical frame if flag isn't filled in and validate the frame
 int getSingleFrame(const filesystem::path& imageDir, const Camera::Rig& rig, std::string frame) {
   if (frame == "") {
-    const std::vector<filesystem::path>& sortedFiles = checkAndGetSortedFiles(imageDir, rig);
-    frame = sortedFiles.front().stem().string();
+    frame = getFirstAndLastFrames(imageDir, rig).first;
   }
   verifyImagePaths(imageDir, rig, frame, frame);
   return std::stoi(frame);
@@ -43,12 +51,12 @@ std::pair<int, int> getFrameRange(
     std::string firstFrame,
     std::string lastFrame) {
   if (firstFrame == "" || lastFrame == "") {
-    const std::vector<filesystem::path>& sortedFiles = checkAndGetSortedFiles(imageDir, rig);
+    const std::pair<std::string, std::string> frames = getFirstAndLastFrames(imageDir, rig);
     if (firstFrame == "") {
-      firstFrame = sortedFiles.front().stem().string();
+      firstFrame = frames.first;
     }
     if (lastFrame == "") {
-      lastFrame = sortedFiles.back().stem().string();
+      lastFrame = frames.second;
     }
   }
 
@@ -79,14 +87,25 @@ void verifyImagePaths(
 
   CHECK_LE(first, last);
   CHECK_GT(rig.size(), 0);
-  const std::string extGuess = filesystem::getFirstExtension(imageDir / rig[0].id);
-  const std::string ext = !extension.empty() ? extension : extGuess;
+  const std::shared_ptr<const ImageManifest> manifest = getManifest(imageDir);
+  const std::string ext = !extension.empty()
+      ? extension
+      : imagePath(imageDir, rig[0].id, intToStringZeroPad(first, 6)).extension().string();
   for (const Camera& cam : rig) {
     const filesystem::path camDir = imageDir / cam.id;
+    const CameraImages* images = getCameraImages(manifest, cam.id);
+    const bool useManifest = images && images->extension == ext;
     for (int frameNum = first; frameNum <= last; ++frameNum) {
       const std::string frameName = intToStringZeroPad(frameNum, 6);
+      if (useManifest &&
+          std::binary_search(images->frames.begin(), images->frames.end(), frameName)) {
+        continue;
+      }
       const filesystem::path p = camDir / (frameName + ext);
-      const bool exists = filesystem::is_regular_file(p);
+      const tar_util::TarArchive::Member* member;
+      const bool exists = filesystem::is_regular_file(p) || tar_util::findImage(p, member) ||
+          (video_util::isVideoFrame(p) &&
+           frameNum < video_util::getVideo(imageDir / (cam.id + ext))->getFrameCount());
       CHECK(exists) << "Missing file: " << p;
     }
   }
@@ -147,23 +166,49 @@ cv::Mat_<cv::Vec2f> computeWarpDstToSrc(const Camera& dst, const Camera& src) {
     return warpMap;
   }
 
+  std::vector<Camera::Vector2> dstPixels;
   for (int y = 0; y < warpMap.rows; ++y) {
+    // unproject a row at a time
+    dstPixels.clear();
     for (int x = 0; x < warpMap.cols; ++x) {
       const Camera::Vector2 dstPixel(x + 0.5, y + 0.5);
-      if (dst.isOutsideImageCircle(dstPixel)) {
-        continue;
+      if (!dst.isOutsideImageCircle(dstPixel)) {
+        dstPixels.push_back(dstPixel);
       }
-      const Camera::Vector3 rig = dst.rigNearInfinity(dstPixel);
+    }
+    const std::vector<Camera::Vector3> rigs = dst.rigs(dstPixels, Camera::kNearInfinity);
+    for (int i = 0; i < int(dstPixels.size()); ++i) {
       Camera::Vector2 srcPixel;
-      if (!src.sees(rig, srcPixel)) {
+      if (!src.sees(rigs[i], srcPixel)) {
         continue;
       }
       // note: convert to opencv coordinate convention because it must be fed to cv::remap later
+      const int x = dstPixels[i].x();
       warpMap(y, x) = cv::Vec2f(srcPixel.x() - 0.5f, srcPixel.y() - 0.5f);
     }
   }
   return warpMap;
 }
 
+cv::Size getPyramidLevelSize(const Camera::Vector2& resolution, const int width) {
+  // nearbyint rounds half to even in the default rounding mode, like python's round
+  int height = std::nearbyint(resolution.y() / resolution.x() * width);
+  height += height % 2;
+  return cv::Size(width, height);
+}
+
+std::vector<cv::Mat> buildPyramid(const cv::Mat& image, const std::vector<cv::Size>& sizes) {
+  std::vector<cv::Mat> levels(sizes.size());
+  const cv::Mat* src = &image;
+  for (int i = 0; i < int(sizes.size()); ++i) {
+    if (sizes[i].width > src->cols || sizes[i].height > src->rows) {
+      src = &image; // not smaller than the previous level
+    }
+    cv::resize(*src, levels[i], sizes[i], 0, 0, cv::INTER_AREA);
+    src = &levels[i];
+  }
+  return levels;
+}
+
 } // namespace image_util
 } // namespace fb360_dep
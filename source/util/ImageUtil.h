@@ -13,7 +13,10 @@
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
+#include "source/util/ImageManifest.h"
 #include "source/util/ImageTypes.h"
+#include "source/util/TarArchive.h"
+#include "source/util/VideoReader.h"
 
 namespace fb360_dep {
 namespace image_util {
@@ -50,9 +53,17 @@ inline const filesystem::path imagePath(
     const std::string& camId,
     const std::string& frameName,
     const std::string& extension = "") {
-  filesystem::path camDir = dir / camId;
-  std::string ext = extension.empty() ? filesystem::getFirstExtension(camDir) : extension;
-  return camDir / (frameName + ext);
+  std::string ext = extension;
+  if (ext.empty() && !filesystem::is_directory(dir / camId)) {
+    ext = tar_util::findImageExtension(dir, camId, frameName); // frame was not extracted
+    if (ext.empty()) {
+      ext = video_util::findVideo(dir, camId).extension().string(); // frames are in a video
+    }
+  }
+  if (ext.empty()) {
+    ext = getImageExtension(dir, camId);
+  }
+  return dir / camId / (frameName + ext);
 }
 
 template <typename T>
@@ -174,5 +185,13 @@ Camera::Vector2 worldToEquirect(const Camera::Vector3 world, const int eqrW, con
 
 cv::Mat_<cv::Vec2f> computeWarpDstToSrc(const Camera& dst, const Camera& src);
 
+// Size of the pyramid level of the given width for images of a camera of resolution: the height
+// keeps the aspect ratio, rounded half to even, then up to even, as in scripts/render/resize.py
+cv::Size getPyramidLevelSize(const Camera::Vector2& resolution, const int width);
+
+// image area downsampled to each of sizes, largest first. Each level is downsampled from the
+// previous one when it is at least as large, so the full size image is only read for the first
+std::vector<cv::Mat> buildPyramid(const cv::Mat& image, const std::vector<cv::Size>& sizes);
+
 } // namespace image_util
 } // end namespace fb360_dep
@@ -0,0 +1,78 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace fb360_dep {
+
+// Lock-free FIFO from one producer thread to one consumer thread
+// Nothing blocks: tryPush() fails while the mailbox is full and tryPop() while it is empty, so
+// e.g. a render loop can check for new frames without ever waiting for the thread making them
+// Only the producer may push, and only the consumer may pop or look at the front
+template <typename T>
+class Mailbox {
+ public:
+  explicit Mailbox(const size_t capacity) : slots(std::max<size_t>(1, capacity) + 1) {}
+
+  Mailbox(const Mailbox&) = delete;
+  Mailbox& operator=(const Mailbox&) = delete;
+
+  // producer: moves item into the mailbox, returns false and leaves item alone if it is full
+  bool tryPush(T& item) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    const size_t next = (t + 1) % slots.size();
+    if (next == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slots[t] = std::move(item);
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // consumer: oldest item, nullptr if the mailbox is empty. It stays valid until it is popped
+  T* front() {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &slots[h];
+  }
+
+  // consumer: moves the oldest item out, returns false if the mailbox is empty
+  bool tryPop(T& item) {
+    T* const oldest = front();
+    if (!oldest) {
+      return false;
+    }
+    item = std::move(*oldest);
+    const size_t h = head.load(std::memory_order_relaxed);
+    head.store((h + 1) % slots.size(), std::memory_order_release);
+    return true;
+  }
+
+  // either thread: a snapshot, the other thread may have pushed or popped since
+  size_t size() const {
+    const size_t h = head.load(std::memory_order_acquire);
+    const size_t t = tail.load(std::memory_order_acquire);
+    return (t + slots.size() - h) % slots.size();
+  }
+
+  bool isFull() const {
+    return size() == slots.size() - 1;
+  }
+
+ private:
+  std::vector<T> slots; // one more than the capacity, so head == tail only when empty
+  std::atomic<size_t> head{0}; // next to pop, written by the consumer
+  std::atomic<size_t> tail{0}; // next to push, written by the producer
+};
+
+} // namespace fb360_dep
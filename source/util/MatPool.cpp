@@ -0,0 +1,194 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/MatPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+namespace fb360_dep {
+
+static MatPool* installed = nullptr;
+
+std::string MatPool::Stats::toString() const {
+  return folly::sformat(
+      "Mat pool: {} allocations, {:.1f}% reused, peak {:.1f} MB in use, {:.1f} MB retained",
+      allocations,
+      100.0 * hits / std::max(allocations, int64_t(1)),
+      peakBytesInUse / 1e6,
+      bytesRetained / 1e6);
+}
+
+MatPool::~MatPool() {
+  trim();
+}
+
+void MatPool::install(const size_t capacityBytes) {
+  CHECK(!installed) << "mat pool already installed";
+  // never deleted, mats may outlive everything else
+  installed = new MatPool(capacityBytes);
+  cv::Mat::setDefaultAllocator(installed);
+  std::atexit([] { LOG(INFO) << installed->getStats().toString(); });
+}
+
+MatPool* MatPool::getInstalled() {
+  return installed;
+}
+
+size_t MatPool::getClassBytes(const size_t bytes) {
+  if (bytes < kMinPooledBytes) {
+    return bytes;
+  }
+  // quarters of the highest power of two not above bytes
+  size_t power = kMinPooledBytes;
+  while (power <= bytes / 2) {
+    power *= 2;
+  }
+  const size_t quarter = power / 4;
+  const size_t classBytes = (bytes + quarter - 1) / quarter * quarter;
+  return (classBytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+}
+
+void* MatPool::acquire(const size_t bytes) const {
+  if (bytes < kMinPooledBytes) {
+    return cv::fastMalloc(bytes);
+  }
+  const size_t classBytes = getClassBytes(bytes);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++stats.allocations;
+    stats.bytesInUse += classBytes;
+    stats.peakBytesInUse = std::max(stats.peakBytesInUse, stats.bytesInUse);
+    std::vector<void*>& buffers = freeBuffers[classBytes];
+    if (!buffers.empty()) {
+      void* const data = buffers.back();
+      buffers.pop_back();
+      ++stats.hits;
+      stats.bytesRetained -= classBytes;
+      return data;
+    }
+  }
+
+  void* data = nullptr;
+#ifdef WIN32
+  data = _aligned_malloc(classBytes, kHugePageBytes);
+#else
+  if (posix_memalign(&data, kHugePageBytes, classBytes) != 0) {
+    data = nullptr;
+  }
+#endif
+  CHECK(data) << folly::sformat("cannot allocate {} bytes", classBytes);
+#ifdef __linux__
+  madvise(data, classBytes, MADV_HUGEPAGE); // advisory, ignored where unsupported
+#endif
+  return data;
+}
+
+static void freeBuffer(void* data) {
+#ifdef WIN32
+  _aligned_free(data);
+#else
+  free(data);
+#endif
+}
+
+void MatPool::release(void* data, const size_t bytes) const {
+  if (bytes < kMinPooledBytes) {
+    cv::fastFree(data);
+    return;
+  }
+  const size_t classBytes = getClassBytes(bytes);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.bytesInUse -= classBytes;
+    if (stats.bytesRetained + classBytes <= capacityBytes) {
+      freeBuffers[classBytes].push_back(data);
+      stats.bytesRetained += classBytes;
+      return;
+    }
+  }
+  freeBuffer(data);
+}
+
+void MatPool::trim() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& buffers : freeBuffers) {
+    for (void* const data : buffers.second) {
+      freeBuffer(data);
+    }
+  }
+  freeBuffers.clear();
+  stats.bytesRetained = 0;
+}
+
+MatPool::Stats MatPool::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+// Same as opencv's default allocator, with the buffer from acquire()
+cv::UMatData* MatPool::allocate(
+    int dims,
+    const int* sizes,
+    int type,
+    void* data,
+    size_t* step,
+    int /* flags */,
+    cv::UMatUsageFlags /* usageFlags */) const {
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; --i) {
+    if (step) {
+      if (data && step[i] != CV_AUTOSTEP) {
+        CHECK_LE(total, step[i]);
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= sizes[i];
+  }
+
+  cv::UMatData* const u = new cv::UMatData(this);
+  u->data = u->origdata = static_cast<uchar*>(data ? data : acquire(total));
+  u->size = total;
+  if (data) {
+    u->flags |= cv::UMatData::USER_ALLOCATED;
+  }
+  return u;
+}
+
+bool MatPool::allocate(
+    cv::UMatData* u,
+    int /* accessFlags */,
+    cv::UMatUsageFlags /* usageFlags */) const {
+  return u != nullptr;
+}
+
+void MatPool::deallocate(cv::UMatData* u) const {
+  if (!u) {
+    return;
+  }
+  CHECK_EQ(u->urefcount, 0);
+  CHECK_EQ(u->refcount, 0);
+  if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+    release(u->origdata, u->size);
+    u->origdata = nullptr;
+  }
+  delete u;
+}
+
+} // namespace fb360_dep
@@ -0,0 +1,84 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace fb360_dep {
+
+// cv::Mat allocator that keeps freed large buffers for reuse instead of returning them to the os
+// Tools that process frame after frame allocate the same multi-megabyte mats every frame (pyramid
+// levels, filter windows, isp planes, projections), and each new mapping faults its pages in
+// again. Buffers of at least kMinPooledBytes are rounded up to a size class, a quarter step
+// between powers of two in whole huge pages, then aligned and advised as transparent huge pages on
+// linux. Freed buffers wait in their class for the next allocation, up to capacityBytes in total
+// Smaller buffers go through opencv's own allocation
+// install() makes a process wide pool the default allocator of cv::Mat (see --mat_pool_mb)
+class MatPool : public cv::MatAllocator {
+ public:
+  static const size_t kHugePageBytes = size_t(2) << 20;
+  static const size_t kMinPooledBytes = kHugePageBytes;
+
+  struct Stats {
+    int64_t allocations = 0; // pooled sizes only
+    int64_t hits = 0; // of which reused a freed buffer
+    int64_t bytesInUse = 0;
+    int64_t peakBytesInUse = 0;
+    int64_t bytesRetained = 0; // freed, waiting for reuse
+
+    std::string toString() const;
+  };
+
+  explicit MatPool(const size_t capacityBytes) : capacityBytes(capacityBytes) {}
+  ~MatPool() override;
+
+  MatPool(const MatPool&) = delete;
+  MatPool& operator=(const MatPool&) = delete;
+
+  // Process wide pool, made the default allocator of cv::Mat, logs its stats at exit
+  // Mats allocated before keep the allocator they were created with
+  static void install(const size_t capacityBytes);
+  static MatPool* getInstalled(); // nullptr if not installed
+
+  cv::UMatData* allocate(
+      int dims,
+      const int* sizes,
+      int type,
+      void* data,
+      size_t* step,
+      int flags,
+      cv::UMatUsageFlags usageFlags) const override;
+  bool allocate(cv::UMatData* u, int accessFlags, cv::UMatUsageFlags usageFlags) const override;
+  void deallocate(cv::UMatData* u) const override;
+
+  Stats getStats() const;
+
+  // Returns the retained buffers to the os
+  void trim() const;
+
+  // Bytes actually reserved for a buffer of bytes
+  static size_t getClassBytes(const size_t bytes);
+
+ private:
+  void* acquire(const size_t bytes) const;
+  void release(void* data, const size_t bytes) const;
+
+  const size_t capacityBytes;
+  mutable std::mutex mutex;
+  mutable std::map<size_t, std::vector<void*>> freeBuffers; // by class bytes
+  mutable Stats stats;
+};
+
+} // namespace fb360_dep
@@ -122,8 +122,16 @@ class BezierCurve {
     return (i == j) ? points_[i] : lerp((*this)(i, j - 1, t), (*this)(i + 1, j, t), t);
   }
 
+  // Same as (*this)(0, points_.size() - 1, t), de Casteljau's algorithm: the same lerps as the
+  // recursion, in quadratic rather than exponential time in the number of points
   inline V operator()(const T t) const {
-    return (*this)(0, points_.size() - 1, t);
+    std::vector<V> p(points_);
+    for (int n = int(p.size()) - 1; n > 0; --n) {
+      for (int i = 0; i < n; ++i) {
+        p[i] = lerp(p[i], p[i + 1], t);
+      }
+    }
+    return p[0];
   }
 };
 
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace fb360_dep {
+namespace numa {
+
+// Cpus of every numa node, from sysfs, without depending on libnuma
+// A single node with no cpus listed when there is no topology to go by: not linux, a single node,
+// or DEP_NUMA=0 in the environment. Threads are then left wherever the os puts them
+inline const std::vector<std::vector<int>>& getNodeCpus() {
+  static const std::vector<std::vector<int>> nodeCpus = [] {
+    std::vector<std::vector<int>> nodes;
+    const char* const env = std::getenv("DEP_NUMA");
+    if (env && std::string(env) == "0") {
+      return std::vector<std::vector<int>>(1);
+    }
+    for (int node = 0;; ++node) {
+      // e.g. "0-15,32-47"
+      std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      std::string cpulist;
+      if (!std::getline(file, cpulist)) {
+        break;
+      }
+      std::vector<int> cpus;
+      std::stringstream ranges(cpulist);
+      std::string range;
+      while (std::getline(ranges, range, ',')) {
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) { // memory-only nodes have no cpus
+        nodes.push_back(cpus);
+      }
+    }
+    if (nodes.size() < 2) {
+      return std::vector<std::vector<int>>(1);
+    }
+    return nodes;
+  }();
+  return nodeCpus;
+}
+
+inline int getNumNodes() {
+  return getNodeCpus().size();
+}
+
+// Node that owns item index of count, e.g. a dst camera: contiguous runs of items per node
+inline int nodeOf(const int index, const int count) {
+  return count > 0 ? int(int64_t(index) * getNumNodes() / count) : 0;
+}
+
+// Node of the idx-th of count threads spread over the nodes in proportion to their cpus
+inline int nodeOfThread(const int idx, const int count) {
+  const std::vector<std::vector<int>>& nodes = getNodeCpus();
+  int numCpus = 0;
+  for (const std::vector<int>& cpus : nodes) {
+    numCpus += cpus.size();
+  }
+  int cpu = count > 0 ? int(int64_t(idx % count) * numCpus / count) : 0;
+  for (int node = 0; node < int(nodes.size()); ++node) {
+    if (cpu < int(nodes[node].size())) {
+      return node;
+    }
+    cpu -= nodes[node].size();
+  }
+  return 0;
+}
+
+// Restricts the calling thread to the cpus of node, so the memory it first touches is local
+// Returns false if there is no topology, or the os refused
+inline bool pinToNode(const int node) {
+#ifdef __linux__
+  const std::vector<std::vector<int>>& nodes = getNodeCpus();
+  if (nodes.size() < 2 || node < 0 || node >= int(nodes.size())) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : nodes[node]) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace numa
+} // namespace fb360_dep
@@ -0,0 +1,145 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/OverlapMatrix.h"
+
+#include <random>
+
+#include <glog/logging.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
+
+#include "source/util/ThreadPool.h"
+
+namespace fb360_dep {
+
+namespace {
+
+// Hash of the normalized cameras, to a precision that rescaling a rig doesn't change
+std::string overlapMatrixKey(const Camera::Rig& rig) {
+  Camera::Rig normalized = rig;
+  Camera::normalizeRig(normalized);
+  folly::dynamic cameras = folly::dynamic::array;
+  for (const Camera& camera : normalized) {
+    cameras.push_back(camera.serialize());
+  }
+  folly::json::serialization_opts opts;
+  opts.sort_keys = true;
+  opts.double_mode = double_conversion::DoubleToStringConverter::PRECISION;
+  opts.double_num_digits = 9;
+  return folly::sformat("{:016x}", folly::hash::fnv64(folly::json::serialize(cameras, opts)));
+}
+
+} // namespace
+
+OverlapMatrix::OverlapMatrix(const Camera::Rig& rig, const int threads)
+    : OverlapMatrix(rig, std::vector<Camera::Real>(rig.size() * rig.size())) {
+  parallelFor(
+      0,
+      size(),
+      1,
+      [&](const int i) {
+        for (int j = 0; j < size(); ++j) {
+          overlaps[i * size() + j] = rig[i].overlap(rig[j]);
+        }
+      },
+      threads);
+}
+
+OverlapMatrix::OverlapMatrix(const Camera::Rig& rig, std::vector<Camera::Real>&& overlaps)
+    : overlaps(std::move(overlaps)) {
+  CHECK_EQ(this->overlaps.size(), rig.size() * rig.size());
+  for (const Camera& camera : rig) {
+    indexes[camera.id] = ids.size();
+    ids.push_back(camera.id);
+  }
+  CHECK_EQ(indexes.size(), ids.size()) << "duplicate camera ids";
+}
+
+filesystem::path OverlapMatrix::getDefaultDir(const filesystem::path& rigPath) {
+  return rigPath.parent_path() / (rigPath.stem().string() + "_overlaps");
+}
+
+OverlapMatrix OverlapMatrix::getOrCompute(
+    const filesystem::path& dir,
+    const Camera::Rig& rig,
+    const int threads) {
+  if (dir.empty()) {
+    return OverlapMatrix(rig, threads);
+  }
+  const filesystem::path path = dir / (overlapMatrixKey(rig) + ".json");
+  std::vector<Camera::Real> overlaps;
+  if (load(overlaps, path, rig)) {
+    return OverlapMatrix(rig, std::move(overlaps));
+  }
+  const OverlapMatrix result(rig, threads);
+  result.save(path);
+  return result;
+}
+
+int OverlapMatrix::getIndex(const std::string& id) const {
+  const auto found = indexes.find(id);
+  CHECK(found != indexes.end()) << "no camera " << id << " in overlap matrix";
+  return found->second;
+}
+
+bool OverlapMatrix::load(
+    std::vector<Camera::Real>& overlaps,
+    const filesystem::path& path,
+    const Camera::Rig& rig) {
+  std::string json;
+  if (!filesystem::exists(path) || !folly::readFile(path.string().c_str(), json)) {
+    return false;
+  }
+  const folly::dynamic parsed = folly::parseJson(json);
+  const folly::dynamic& ids = parsed["ids"];
+  const folly::dynamic& rows = parsed["overlaps"];
+  if (ids.size() != rig.size() || rows.size() != rig.size()) {
+    LOG(WARNING) << folly::sformat("Ignoring stale overlap matrix {}", path.string());
+    return false;
+  }
+  overlaps.clear();
+  for (int i = 0; i < int(rig.size()); ++i) {
+    if (ids[i].asString() != rig[i].id || rows[i].size() != rig.size()) {
+      LOG(WARNING) << folly::sformat("Ignoring stale overlap matrix {}", path.string());
+      return false;
+    }
+    for (const folly::dynamic& overlap : rows[i]) {
+      overlaps.push_back(overlap.asDouble());
+    }
+  }
+  return true;
+}
+
+void OverlapMatrix::save(const filesystem::path& path) const {
+  folly::dynamic rows = folly::dynamic::array;
+  for (int i = 0; i < size(); ++i) {
+    folly::dynamic row = folly::dynamic::array;
+    for (int j = 0; j < size(); ++j) {
+      row.push_back(overlap(i, j));
+    }
+    rows.push_back(row);
+  }
+  const folly::dynamic json = folly::dynamic::object(
+      "ids", folly::dynamic::array(ids.begin(), ids.end()))("overlaps", rows);
+
+  // Write to a temporary file and rename, so concurrent readers never see a partial file
+  filesystem::create_directories(path.parent_path());
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  if (!folly::writeFile(folly::toPrettyJson(json), tmpPath.string().c_str())) {
+    LOG(WARNING) << folly::sformat("Cannot write overlap matrix {}", tmpPath.string());
+    filesystem::remove(tmpPath);
+    return;
+  }
+  filesystem::rename(tmpPath, path);
+}
+
+} // namespace fb360_dep
@@ -0,0 +1,69 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "source/util/Camera.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+
+// Camera::overlap of every ordered pair of cameras of a rig, sampled once
+// overlap(i, j) is the fraction of the frame of camera i that camera j sees, camera j is visible
+// from camera i if it is not zero. Overlaps don't depend on the resolution, so a rig and any of
+// its rescaled versions share a matrix
+class OverlapMatrix {
+ public:
+  // Rows are computed in parallel
+  explicit OverlapMatrix(const Camera::Rig& rig, const int threads = -1);
+
+  // Directory next to the rig json, e.g. rigs/rig_calibrated_overlaps for rigs/rig_calibrated.json
+  static filesystem::path getDefaultDir(const filesystem::path& rigPath);
+
+  // Reads the matrix of rig from dir, if it was saved there, otherwise computes it and saves it
+  // Matrices are keyed by a hash of the normalized cameras. dir empty = no cache
+  static OverlapMatrix
+  getOrCompute(const filesystem::path& dir, const Camera::Rig& rig, const int threads = -1);
+
+  int size() const {
+    return ids.size();
+  }
+
+  Camera::Real overlap(const int i, const int j) const {
+    return overlaps[i * size() + j];
+  }
+
+  Camera::Real overlap(const std::string& id0, const std::string& id1) const {
+    return overlap(getIndex(id0), getIndex(id1));
+  }
+
+  bool isVisible(const int i, const int j) const {
+    return overlap(i, j) > 0;
+  }
+
+  bool isVisible(const std::string& id0, const std::string& id1) const {
+    return overlap(id0, id1) > 0;
+  }
+
+ private:
+  OverlapMatrix(const Camera::Rig& rig, std::vector<Camera::Real>&& overlaps);
+
+  int getIndex(const std::string& id) const;
+  static bool
+  load(std::vector<Camera::Real>& overlaps, const filesystem::path& path, const Camera::Rig& rig);
+  void save(const filesystem::path& path) const;
+
+  std::vector<std::string> ids;
+  std::map<std::string, int> indexes;
+  std::vector<Camera::Real> overlaps; // row major
+};
+
+} // namespace fb360_dep
@@ -0,0 +1,164 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include <folly/FileUtil.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+#include "source/util/FilesystemUtil.h"
+#include "source/util/SystemUtil.h"
+
+namespace fb360_dep {
+namespace profiler {
+
+// What a stage did, at one level, for one dst (empty dst = all of them)
+struct StageCounters {
+  int64_t calls = 0;
+  double seconds = 0;
+  int64_t costEvaluations = 0;
+  int64_t pixels = 0; // pixels touched
+  int64_t bytes = 0; // bytes allocated
+  int64_t rssBytes = 0; // resident set size of the process at the end, max over calls
+  int64_t peakRssBytes = 0; // highest resident set size sampled during the stage, max over calls
+
+  StageCounters& operator+=(const StageCounters& other) {
+    calls += other.calls;
+    seconds += other.seconds;
+    costEvaluations += other.costEvaluations;
+    pixels += other.pixels;
+    bytes += other.bytes;
+    rssBytes = std::max(rssBytes, other.rssBytes);
+    peakRssBytes = std::max(peakRssBytes, other.peakRssBytes);
+    return *this;
+  }
+};
+
+// StageCounters keyed by (stage, level, dst), accumulated over calls
+// Thread safe, stages running concurrently can add to the same profile
+class Profile {
+ public:
+  void add(
+      const std::string& stage,
+      const int level,
+      const std::string& dst,
+      const StageCounters& counters) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stages[std::make_tuple(stage, level, dst)] += counters;
+  }
+
+  StageCounters get(const std::string& stage, const int level, const std::string& dst = "") const {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = stages.find(std::make_tuple(stage, level, dst));
+    return it == stages.end() ? StageCounters() : it->second;
+  }
+
+  // One entry per (stage, level, dst)
+  folly::dynamic serialize() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    folly::dynamic result = folly::dynamic::array();
+    for (const auto& entry : stages) {
+      const StageCounters& counters = entry.second;
+      result.push_back(folly::dynamic::object("stage", std::get<0>(entry.first))(
+          "level", std::get<1>(entry.first))("dst", std::get<2>(entry.first))(
+          "calls", counters.calls)("seconds", counters.seconds)(
+          "cost_evaluations", counters.costEvaluations)("pixels", counters.pixels)(
+          "bytes", counters.bytes)("rss_bytes", counters.rssBytes)(
+          "peak_rss_bytes", counters.peakRssBytes));
+    }
+    return result;
+  }
+
+  void saveJson(const filesystem::path& filename, const folly::dynamic& extra) const {
+    folly::dynamic dynamic = extra;
+    dynamic["stages"] = serialize();
+    folly::json::serialization_opts opts;
+    opts.sort_keys = true;
+    opts.pretty_formatting = true;
+    folly::writeFile(folly::json::serialize(dynamic, opts), filename.string().c_str());
+  }
+
+ private:
+  mutable std::mutex mutex;
+  std::map<std::tuple<std::string, int, std::string>, StageCounters> stages;
+};
+
+// Times its scope and adds it to a profile, together with what was counted in it
+// Counting is thread safe, so the tasks of a stage can report into the same scope; count in
+// batches (e.g. once per row or tile) to keep atomics off the hot loops
+// The resident set size is sampled in the background while the scope is alive, see RssHighWater
+// A null profile makes it a no-op
+class ScopedStage {
+ public:
+  ScopedStage(
+      Profile* profile,
+      const std::string& stage,
+      const int level,
+      const std::string& dst = "")
+      : profile(profile),
+        stage(stage),
+        level(level),
+        dst(dst),
+        start(std::chrono::steady_clock::now()),
+        rss(profile ? new system_util::RssHighWater : nullptr) {}
+
+  ~ScopedStage() {
+    if (!profile) {
+      return;
+    }
+    StageCounters counters;
+    counters.calls = 1;
+    counters.seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    counters.costEvaluations = costEvaluations;
+    counters.pixels = pixels;
+    counters.bytes = bytes;
+    counters.rssBytes = system_util::getResidentBytes();
+    counters.peakRssBytes = rss->get();
+    profile->add(stage, level, dst, counters);
+  }
+
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+  void addCostEvaluations(const int64_t count) {
+    costEvaluations.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void addPixels(const int64_t count) {
+    pixels.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void addBytes(const int64_t count) {
+    bytes.fetch_add(count, std::memory_order_relaxed);
+  }
+
+ private:
+  Profile* const profile;
+  const std::string stage;
+  const int level;
+  const std::string dst;
+  const std::chrono::steady_clock::time_point start;
+  const std::unique_ptr<system_util::RssHighWater> rss;
+  std::atomic<int64_t> costEvaluations{0};
+  std::atomic<int64_t> pixels{0};
+  std::atomic<int64_t> bytes{0};
+};
+
+} // namespace profiler
+} // namespace fb360_dep
@@ -7,6 +7,8 @@
 
 #include "source/util/RawUtil.h"
 
+#include <cstring>
+
 #include <opencv2/core.hpp>
 
 #include <folly/FileUtil.h>
@@ -14,6 +16,8 @@
 
 #include "source/isp/CameraIsp.h"
 #include "source/isp/DngTags.h"
+#include "source/isp/LosslessJpeg.h"
+#include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 
@@ -37,6 +41,9 @@ std::vector<T> readRawImage(const filesystem::path& rawImageFilename, const Came
   return rawImage;
 }
 
+template std::vector<uint8_t> readRawImage(const filesystem::path&, const CameraIsp&);
+template std::vector<uint16_t> readRawImage(const filesystem::path&, const CameraIsp&);
+
 std::unique_ptr<CameraIsp> cameraIspFromConfigFileWithOptions(
     const filesystem::path& configFilename,
     int pow2DownscaleFactor,
@@ -114,88 +121,103 @@ cv::Mat rawToRgb(
   }
 }
 
-void writeIfd(
-    const uint16_t tag,
-    const uint16_t type,
-    const uint32_t count,
-    const uint32_t offset,
-    const uint32_t offsetInc,
-    uint32_t& dOffset,
-    FILE* fDng) {
-  // Write out a tiff directory entry aka an ifd
-  fwrite(&tag, sizeof(tag), 1, fDng);
-  fwrite(&type, sizeof(type), 1, fDng);
-  fwrite(&count, sizeof(count), 1, fDng);
-  fwrite(&offset, sizeof(offset), 1, fDng);
-
-  dOffset += offsetInc;
-}
+namespace {
 
-template <typename T>
-bool writeDng(
-    const filesystem::path& rawImageFilename,
-    const filesystem::path& outputFilename,
-    CameraIsp& cameraIsp) {
-  LOG(INFO) << folly::sformat("Writing: {}", outputFilename.string()) << std::endl;
-  // - sanity check
-  CHECK_EQ(rawImageFilename.extension(), ".raw");
-  int outputBitsPerPixel = 8 * sizeof(T);
+const int kDngTileSize = 256; // tiff tiles are multiples of 16
 
-  LOG_IF(WARNING, outputBitsPerPixel != cameraIsp.getSensorBitsPerPixel())
-      << outputBitsPerPixel << "-bit output precision != " << cameraIsp.getSensorBitsPerPixel()
-      << "-bit input precision" << std::endl;
-
-  // - load ISP config and read raw image
-  switch (cameraIsp.getSensorBitsPerPixel()) {
-    case 8: {
-      std::vector<uint8_t> rawImage = readRawImage<uint8_t>(rawImageFilename, cameraIsp);
-      cameraIsp.loadImageFromSensor(rawImage);
-      break;
-    }
-    case 16: {
-      std::vector<uint16_t> rawImage = readRawImage<uint16_t>(rawImageFilename, cameraIsp);
-      cameraIsp.loadImageFromSensor(rawImage);
-      break;
-    }
-    default:
-      CHECK(false) << "Unsupported output precision" << std::endl;
-  };
+// A tiff directory entry with its values. Values that fit in the entry's 4 bytes are stored in
+// the entry, the others after the directory, and the entry points to them
+struct IfdEntry {
+  TiffIfdEntry entry;
+  std::vector<uint8_t> data;
+};
 
-  // The step below involves an internal conversion to and from float32, which, for uint16
-  // input+output type, can result in off-by-one differences between pixels in the original image
-  // and the written DNG
-  cv::Mat_<T> preprocessedRawImage = cameraIsp.getRawImage<T>();
+IfdEntry
+ifdEntry(const uint16_t tag, const uint16_t type, const uint32_t count, const uint32_t value) {
+  return {{tag, type, count, value}, {}};
+}
 
-  FILE* fDng = fopen(outputFilename.string().c_str(), "w");
-  if (fDng == NULL) {
-    LOG(ERROR) << folly::sformat("Failed to open file: {}", outputFilename.string()) << std::endl;
-    return false;
+IfdEntry ifdEntry(
+    const uint16_t tag,
+    const uint16_t type,
+    const uint32_t count,
+    const void* const data,
+    const size_t size) {
+  IfdEntry ifd = ifdEntry(tag, type, count, 0);
+  if (size <= sizeof(ifd.entry.uOffset)) {
+    memcpy(&ifd.entry.uOffset, data, size);
+  } else {
+    const uint8_t* const bytes = static_cast<const uint8_t*>(data);
+    ifd.data.assign(bytes, bytes + size);
   }
+  return ifd;
+}
 
-  uint32_t width = preprocessedRawImage.cols;
-  uint32_t height = preprocessedRawImage.rows;
+template <typename V>
+IfdEntry ifdEntry(const uint16_t tag, const uint16_t type, const std::vector<V>& values) {
+  return ifdEntry(tag, type, values.size(), values.data(), values.size() * sizeof(V));
+}
 
-  // TIFF data layout calculations (64k strip for 16bit data)
-  uint16_t rowsPerStrip = (32 * 1024) / width;
-  uint16_t stripsPerImg = (height / rowsPerStrip);
-  if (height % rowsPerStrip != 0) {
-    ++stripsPerImg;
+// Writes the tiff header and a single directory, with the values that do not fit in the entries
+// right after it. Returns the offset past them, where the image data goes
+uint32_t writeIfds(std::vector<IfdEntry>& entries, FILE* fDng) {
+  std::stable_sort(entries.begin(), entries.end(), [](const IfdEntry& a, const IfdEntry& b) {
+    return a.entry.uTag < b.entry.uTag; // as tiff requires
+  });
+  const uint16_t ifdCount = entries.size();
+  const uint32_t kIfdEntrySize = sizeof(uint16_t) * 2 + sizeof(uint32_t) * 2;
+  uint32_t dOffset = 8 + sizeof(ifdCount) + ifdCount * kIfdEntrySize + sizeof(uint32_t);
+  for (IfdEntry& ifd : entries) {
+    if (!ifd.data.empty()) {
+      ifd.entry.uOffset = dOffset;
+      dOffset += (ifd.data.size() + 1) & ~1; // values start on a word boundary
+    }
   }
 
-  const std::string cameraSoftware("RawToRgb");
-
-  // Write the TIFF file header
   const char byteOrder[3] = "II";
   fwrite(byteOrder, sizeof(char), 2, fDng);
-
   const uint16_t version = 42;
   fwrite(&version, sizeof(uint16_t), 1, fDng);
-
   const uint32_t Idf0Offset = 0x00000008;
-  fwrite(&Idf0Offset, sizeof(unsigned), 1, fDng);
+  fwrite(&Idf0Offset, sizeof(uint32_t), 1, fDng);
 
-  const uint16_t ifdCount = 42;
   fwrite(&ifdCount, sizeof(uint16_t), 1, fDng);
+  for (const IfdEntry& ifd : entries) {
+    fwrite(&ifd.entry.uTag, sizeof(ifd.entry.uTag), 1, fDng);
+    fwrite(&ifd.entry.uType, sizeof(ifd.entry.uType), 1, fDng);
+    fwrite(&ifd.entry.uCount, sizeof(ifd.entry.uCount), 1, fDng);
+    fwrite(&ifd.entry.uOffset, sizeof(ifd.entry.uOffset), 1, fDng);
+  }
+  const uint32_t nextIfd = 0x00000000;
+  fwrite(&nextIfd, sizeof(uint32_t), 1, fDng);
+
+  for (const IfdEntry& ifd : entries) {
+    fwrite(ifd.data.data(), sizeof(uint8_t), ifd.data.size(), fDng);
+    if (ifd.data.size() % 2) {
+      fputc(0, fDng);
+    }
+  }
+  return dOffset;
+}
+
+} // namespace
+
+// Streams the image out a row of tiles at a time, so the file is never in memory. The tiles of a
+// row are copied out of the image, and compressed, in parallel. Their offsets and sizes are only
+// known once they are written, so the directory is written again at the end
+template <typename T>
+bool writeDng(
+    const cv::Mat_<T>& preprocessedRawImage,
+    const filesystem::path& outputFilename,
+    const CameraIsp& cameraIsp,
+    const bool compress) {
+  LOG(INFO) << folly::sformat("Writing: {}", outputFilename.string()) << std::endl;
+  // - sanity check
+  int outputBitsPerPixel = 8 * sizeof(T);
+
+  LOG_IF(WARNING, outputBitsPerPixel != cameraIsp.getSensorBitsPerPixel())
+      << outputBitsPerPixel << "-bit output precision != " << cameraIsp.getSensorBitsPerPixel()
+      << "-bit input precision" << std::endl;
 
   // Map ISP cfa pattern code to DNG's
   uint32_t cfaFilter;
@@ -215,96 +237,23 @@ bool writeDng(
       break;
     default:
       LOG(ERROR) << "Unknown bayer-pattern found while writing DNG file" << std::endl;
-      fclose(fDng);
       return false;
   }
 
-  // Write the tags
-  const uint32_t kIfdEntrySize = sizeof(uint16_t) * 2 + sizeof(uint32_t) * 2;
-  uint32_t dOffset = 10 + ifdCount * kIfdEntrySize + 4;
-
-  writeIfd(kTiffTagNewSubFileType, kTiffTypeLONG, 1, 0, 0, dOffset, fDng);
-  writeIfd(kTiffTagImageWidth, kTiffTypeLONG, 1, width, 0, dOffset, fDng);
-  writeIfd(kTiffTagImageLength, kTiffTypeLONG, 1, height, 0, dOffset, fDng);
-  writeIfd(kTiffTagBitsPerSample, kTiffTypeSHORT, 1, outputBitsPerPixel, 0, dOffset, fDng);
-  writeIfd(kTiffTagCompression, kTiffTypeSHORT, 1, 1, 0, dOffset, fDng);
-  writeIfd(kTiffTagPhotometricInterpretation, kTiffTypeSHORT, 1, 32803, 0, dOffset, fDng);
-  writeIfd(
-      kTiffTagStripOffsets, kTiffTypeLONG, stripsPerImg, dOffset, stripsPerImg * 4, dOffset, fDng);
-  writeIfd(kTiffTagOrientation, kTiffTypeSHORT, 1, 1, 0, dOffset, fDng);
-  writeIfd(kTiffTagSamplesPerPixel, kTiffTypeSHORT, 1, 1, 0, dOffset, fDng);
-  writeIfd(kTiffTagRowsPerStrip, kTiffTypeSHORT, 1, rowsPerStrip, 0, dOffset, fDng);
-  writeIfd(
-      kTiffTagStripByteCounts,
-      kTiffTypeSHORT,
-      stripsPerImg,
-      dOffset,
-      stripsPerImg * 2,
-      dOffset,
-      fDng);
-  writeIfd(kTiffTagPlanarConfiguration, kTiffTypeSHORT, 1, 1, 0, dOffset, fDng);
-  writeIfd(kTiffTagResolutionUnit, kTiffTypeSHORT, 1, 2, 0, dOffset, fDng);
-  writeIfd(
-      kTiffTagSoftware,
-      kTiffTypeASCII,
-      cameraSoftware.size() + 1,
-      dOffset,
-      cameraSoftware.size() + 1,
-      dOffset,
-      fDng);
-  writeIfd(kTiffTagDateTime, kTiffTypeASCII, 20, dOffset, 20, dOffset, fDng);
-  writeIfd(kTiffEpTagCFARepeatPatternDim, kTiffTypeSHORT, 2, 0x00020002, 0, dOffset, fDng);
-  writeIfd(kTiffEpTagCFAPattern, kTiffTypeBYTE, 4, cfaFilter, 0, dOffset, fDng);
-  writeIfd(kDngTagDNGVersion, kTiffTypeBYTE, 4, 0x00000301, 0, dOffset, fDng);
-  writeIfd(kDngTagDNGBackwardVersion, kTiffTypeBYTE, 4, 0x00000101, 0, dOffset, fDng);
-  writeIfd(kDngTagCFAPlaneColor, kTiffTypeBYTE, 3, 0x00020100, 0, dOffset, fDng);
-  writeIfd(kDngTagCFALayout, kTiffTypeSHORT, 1, 1, 0, dOffset, fDng);
-  writeIfd(kDngTagBlackLevelRepeatDim, kTiffTypeSHORT, 2, 0x00020002, 0, dOffset, fDng);
-  writeIfd(kDngTagBlackLevel, kTiffTypeSHORT, 4, dOffset, 8, dOffset, fDng);
-  writeIfd(kDngTagWhiteLevel, kTiffTypeLONG, 1, (1 << outputBitsPerPixel) - 1, 0, dOffset, fDng);
-  writeIfd(kDngTagDefaultScale, kTiffTypeRATIONAL, 2, dOffset, 16, dOffset, fDng);
-  writeIfd(kDngTagDefaultCropOrigin, kTiffTypeSHORT, 2, 0, 0, dOffset, fDng);
-  writeIfd(kDngTagDefaultCropSize, kTiffTypeSHORT, 2, (height << 16) | width, 0, dOffset, fDng);
-  writeIfd(kDngTagColorMatrix1, kTiffTypeSRATIONAL, 9, dOffset, 9 * 8, dOffset, fDng);
-  writeIfd(kDngTagAnalogBalance, kTiffTypeRATIONAL, 3, dOffset, 3 * 8, dOffset, fDng);
-  writeIfd(kDngTagAsShotNeutral, kTiffTypeRATIONAL, 3, dOffset, 3 * 8, dOffset, fDng);
-  writeIfd(kDngTagBaselineExposure, kTiffTypeSRATIONAL, 1, dOffset, 8, dOffset, fDng);
-  writeIfd(kDngTagBaselineSharpness, kTiffTypeRATIONAL, 1, dOffset, 8, dOffset, fDng);
-  writeIfd(kDngTagBayerGreenSplit, kTiffTypeLONG, 1, 0, 0, dOffset, fDng);
-  writeIfd(kDngTagLinearResponseLimit, kTiffTypeRATIONAL, 1, dOffset, 8, dOffset, fDng);
-  writeIfd(kDngTagLensInfo, kTiffTypeRATIONAL, 4, dOffset, 32, dOffset, fDng);
-  writeIfd(kDngTagAntiAliasStrength, kTiffTypeRATIONAL, 1, dOffset, 8, dOffset, fDng);
-  writeIfd(kDngTagCalibrationIlluminant1, kTiffTypeSHORT, 1, 23, 0, dOffset, fDng);
-  writeIfd(kDngTagBestQualityScale, kTiffTypeRATIONAL, 1, dOffset, 8, dOffset, fDng);
-
-  // Now write data fields
-  uint32_t firstIFD = 0x00000000;
-
-  fwrite(&firstIFD, sizeof(uint32_t), 1, fDng);
-
-  std::vector<uint32_t> stripOff;
-  stripOff.push_back(dOffset); // where image data will be written...
-  for (int16_t s = 1; s < stripsPerImg; ++s) {
-    stripOff.push_back(stripOff[s - 1] + (rowsPerStrip * width) * 2);
+  FILE* fDng = fopen(outputFilename.string().c_str(), "wb");
+  if (fDng == NULL) {
+    LOG(ERROR) << folly::sformat("Failed to open file: {}", outputFilename.string()) << std::endl;
+    return false;
   }
 
-  fwrite(&stripOff[0], sizeof(unsigned), stripsPerImg, fDng);
-
-  std::vector<uint16_t> stripCnt;
-  int nRowsLeft = height;
-  uint32_t t = 0;
-  while (nRowsLeft > 0) {
-    if ((unsigned)nRowsLeft > rowsPerStrip) {
-      stripCnt.push_back(rowsPerStrip * width * 2);
-    } else {
-      stripCnt.push_back(nRowsLeft * width * 2);
-    }
-    ++t;
-    nRowsLeft -= rowsPerStrip;
-  }
+  uint32_t width = preprocessedRawImage.cols;
+  uint32_t height = preprocessedRawImage.rows;
+  const int tilesAcross = (width + kDngTileSize - 1) / kDngTileSize;
+  const int tilesDown = (height + kDngTileSize - 1) / kDngTileSize;
+  std::vector<uint32_t> tileOffsets(tilesAcross * tilesDown);
+  std::vector<uint32_t> tileByteCounts(tilesAcross * tilesDown);
 
-  fwrite(&stripCnt[0], sizeof(uint16_t), stripsPerImg, fDng);
-  fwrite(cameraSoftware.c_str(), sizeof(char), cameraSoftware.size() + 1, fDng);
+  const std::string cameraSoftware("RawToRgb");
 
   char szDateTime[72];
   time_t time = 0; // Need to get this from the camera meta data.
@@ -321,8 +270,6 @@ bool writeDng(
       tlocal->tm_sec);
   szDateTime[71] = '\0';
 
-  fwrite(szDateTime, sizeof(char), 20, fDng);
-
   // Conversion to XYZ - Bradford adapted using D50 reference white point
   cv::Mat_<float> sRgbToXyzD50(3, 3);
   sRgbToXyzD50(0, 0) = 0.4360747;
@@ -342,44 +289,28 @@ bool writeDng(
   cv::Mat_<float> xyzToCam;
   invert(camToXyz, xyzToCam);
 
-  uint16_t uBlackLevel[4]; // {G, R, B, G}
+  std::vector<uint16_t> uBlackLevel(4); // {G, R, B, G}
   cv::Point3f bl = cameraIsp.getBlackLevel() * ((1 << outputBitsPerPixel) - 1);
   uBlackLevel[0] = bl.y;
   uBlackLevel[3] = bl.y;
   uBlackLevel[1] = bl.x;
   uBlackLevel[2] = bl.z;
-  fwrite(uBlackLevel, sizeof(uint16_t), 4, fDng);
 
-  uint32_t defaultScale[4];
-  defaultScale[0] = 1;
-  defaultScale[2] = 1;
-  defaultScale[1] = 1;
-  defaultScale[3] = 1;
+  const std::vector<uint32_t> defaultScale = {1, 1, 1, 1};
 
-  fwrite(defaultScale, sizeof(unsigned), 4, fDng);
-
-  int colorMatrix[18];
+  std::vector<int32_t> colorMatrix(18);
   for (int i = 0; i < 9; ++i) {
     const int x = i % 3;
     const int y = i / 3;
     colorMatrix[2 * i] = xyzToCam(y, x) * (1 << 28);
     colorMatrix[2 * i + 1] = (1 << 28);
   }
-  fwrite(colorMatrix, sizeof(int), 18, fDng);
-
-  uint32_t analogBalance[6];
-  analogBalance[0] = 256;
-  analogBalance[1] = 256;
-  analogBalance[2] = 256;
-  analogBalance[3] = 256;
-  analogBalance[4] = 256;
-  analogBalance[5] = 256;
 
-  fwrite(analogBalance, sizeof(unsigned), 6, fDng);
+  const std::vector<uint32_t> analogBalance = {256, 256, 256, 256, 256, 256};
 
   // kDngTagAsShotNeutral
   cv::Point3f whitePoint = cameraIsp.getWhiteBalanceGain();
-  uint32_t asShotNeutral[6];
+  std::vector<uint32_t> asShotNeutral(6);
   float minChannel = std::min(std::min(whitePoint.x, whitePoint.y), whitePoint.z);
   asShotNeutral[0] = (minChannel / whitePoint.x) * float(1 << 28);
   asShotNeutral[1] = 1 << 28;
@@ -388,52 +319,145 @@ bool writeDng(
   asShotNeutral[4] = (minChannel / whitePoint.z) * float(1 << 28);
   asShotNeutral[5] = 1 << 28;
 
-  fwrite(asShotNeutral, sizeof(uint32_t), 6, fDng);
-
-  int32_t baseExposure[2];
-
+  std::vector<int32_t> baseExposure(2);
   baseExposure[0] = -log2f(1.0f / minChannel) * (1 << 28);
   baseExposure[1] = (1 << 28);
 
-  fwrite(baseExposure, sizeof(unsigned), 2, fDng);
-
-  uint32_t baseSharp[2];
-
-  baseSharp[0] = 1;
-  baseSharp[1] = 1;
-
-  fwrite(baseSharp, sizeof(unsigned), 2, fDng);
-
-  uint32_t linearLimit[2];
-  linearLimit[0] = 1;
-  linearLimit[1] = 1; // 1.0 = sensor is linear
+  const std::vector<uint32_t> baseSharp = {1, 1};
+  const std::vector<uint32_t> linearLimit = {1, 1}; // 1.0 = sensor is linear
+  const std::vector<uint32_t> lensInfo = {0, 0, 0, 0, 0, 0, 0, 0};
+  const std::vector<uint32_t> antiAlias = {0, 1}; // Turn off antiAliasStrength
+  const std::vector<uint32_t> bestScale = {1, 1}; // use 1:1 scaling
+
+  const uint16_t compression = compress ? kTiffCompressionJpeg : kTiffCompressionNone;
+  std::vector<IfdEntry> entries = {
+      ifdEntry(kTiffTagNewSubFileType, kTiffTypeLONG, 1, 0),
+      ifdEntry(kTiffTagImageWidth, kTiffTypeLONG, 1, width),
+      ifdEntry(kTiffTagImageLength, kTiffTypeLONG, 1, height),
+      ifdEntry(kTiffTagBitsPerSample, kTiffTypeSHORT, 1, outputBitsPerPixel),
+      ifdEntry(kTiffTagCompression, kTiffTypeSHORT, 1, compression),
+      ifdEntry(kTiffTagPhotometricInterpretation, kTiffTypeSHORT, 1, 32803),
+      ifdEntry(kTiffTagOrientation, kTiffTypeSHORT, 1, 1),
+      ifdEntry(kTiffTagSamplesPerPixel, kTiffTypeSHORT, 1, 1),
+      ifdEntry(kTiffTagPlanarConfiguration, kTiffTypeSHORT, 1, 1),
+      ifdEntry(kTiffTagResolutionUnit, kTiffTypeSHORT, 1, 2),
+      ifdEntry(
+          kTiffTagSoftware,
+          kTiffTypeASCII,
+          cameraSoftware.size() + 1,
+          cameraSoftware.c_str(),
+          cameraSoftware.size() + 1),
+      ifdEntry(kTiffTagDateTime, kTiffTypeASCII, 20, szDateTime, 20),
+      ifdEntry(kTiffTagTileWidth, kTiffTypeLONG, 1, kDngTileSize),
+      ifdEntry(kTiffTagTileLength, kTiffTypeLONG, 1, kDngTileSize),
+      ifdEntry(kTiffTagTileOffsets, kTiffTypeLONG, tileOffsets),
+      ifdEntry(kTiffTagTileByteCounts, kTiffTypeLONG, tileByteCounts),
+      ifdEntry(kTiffEpTagCFARepeatPatternDim, kTiffTypeSHORT, 2, 0x00020002),
+      ifdEntry(kTiffEpTagCFAPattern, kTiffTypeBYTE, 4, cfaFilter),
+      ifdEntry(kDngTagDNGVersion, kTiffTypeBYTE, 4, 0x00000301),
+      ifdEntry(kDngTagDNGBackwardVersion, kTiffTypeBYTE, 4, 0x00000101),
+      ifdEntry(kDngTagCFAPlaneColor, kTiffTypeBYTE, 3, 0x00020100),
+      ifdEntry(kDngTagCFALayout, kTiffTypeSHORT, 1, 1),
+      ifdEntry(kDngTagBlackLevelRepeatDim, kTiffTypeSHORT, 2, 0x00020002),
+      ifdEntry(kDngTagBlackLevel, kTiffTypeSHORT, uBlackLevel),
+      ifdEntry(kDngTagWhiteLevel, kTiffTypeLONG, 1, (1 << outputBitsPerPixel) - 1),
+      ifdEntry(kDngTagDefaultScale, kTiffTypeRATIONAL, 2, defaultScale.data(), 16),
+      ifdEntry(kDngTagDefaultCropOrigin, kTiffTypeSHORT, 2, 0),
+      ifdEntry(kDngTagDefaultCropSize, kTiffTypeSHORT, 2, (height << 16) | width),
+      ifdEntry(kDngTagColorMatrix1, kTiffTypeSRATIONAL, 9, colorMatrix.data(), 9 * 8),
+      ifdEntry(kDngTagAnalogBalance, kTiffTypeRATIONAL, 3, analogBalance.data(), 3 * 8),
+      ifdEntry(kDngTagAsShotNeutral, kTiffTypeRATIONAL, 3, asShotNeutral.data(), 3 * 8),
+      ifdEntry(kDngTagBaselineExposure, kTiffTypeSRATIONAL, 1, baseExposure.data(), 8),
+      ifdEntry(kDngTagBaselineSharpness, kTiffTypeRATIONAL, 1, baseSharp.data(), 8),
+      ifdEntry(kDngTagBayerGreenSplit, kTiffTypeLONG, 1, 0),
+      ifdEntry(kDngTagLinearResponseLimit, kTiffTypeRATIONAL, 1, linearLimit.data(), 8),
+      ifdEntry(kDngTagLensInfo, kTiffTypeRATIONAL, 4, lensInfo.data(), 32),
+      ifdEntry(kDngTagAntiAliasStrength, kTiffTypeRATIONAL, 1, antiAlias.data(), 8),
+      ifdEntry(kDngTagCalibrationIlluminant1, kTiffTypeSHORT, 1, 23),
+      ifdEntry(kDngTagBestQualityScale, kTiffTypeRATIONAL, 1, bestScale.data(), 8),
+  };
+  uint32_t dOffset = writeIfds(entries, fDng);
+
+  // Raw image data, edge tiles are padded with zeros
+  bool isWritten = true;
+  for (int ty = 0; ty < tilesDown; ++ty) {
+    std::vector<std::vector<uint8_t>> tiles(tilesAcross);
+    parallelFor(0, tilesAcross, 1, [&](const int tx) {
+      cv::Mat_<T> tile(kDngTileSize, kDngTileSize, T(0));
+      const cv::Rect rect =
+          cv::Rect(tx * kDngTileSize, ty * kDngTileSize, kDngTileSize, kDngTileSize) &
+          cv::Rect(0, 0, width, height);
+      preprocessedRawImage(rect).copyTo(tile(cv::Rect(0, 0, rect.width, rect.height)));
+      if (compress) {
+        tiles[tx] = isp::LosslessJpegEncoder::encode(
+            tile[0], kDngTileSize, kDngTileSize, kDngTileSize, outputBitsPerPixel);
+      } else {
+        tiles[tx].assign(tile.data, tile.data + tile.total() * sizeof(T));
+      }
+    });
+    for (int tx = 0; tx < tilesAcross; ++tx) {
+      const std::vector<uint8_t>& tile = tiles[tx];
+      tileOffsets[ty * tilesAcross + tx] = dOffset;
+      tileByteCounts[ty * tilesAcross + tx] = tile.size();
+      dOffset += tile.size();
+      isWritten &= fwrite(tile.data(), sizeof(uint8_t), tile.size(), fDng) == tile.size();
+    }
+  }
 
-  fwrite(linearLimit, sizeof(unsigned), 2, fDng);
+  // Same directory, with the tile offsets and sizes filled in
+  for (IfdEntry& ifd : entries) {
+    if (ifd.entry.uTag == kTiffTagTileOffsets) {
+      ifd = ifdEntry(kTiffTagTileOffsets, kTiffTypeLONG, tileOffsets);
+    } else if (ifd.entry.uTag == kTiffTagTileByteCounts) {
+      ifd = ifdEntry(kTiffTagTileByteCounts, kTiffTypeLONG, tileByteCounts);
+    }
+  }
+  fseek(fDng, 0, SEEK_SET);
+  writeIfds(entries, fDng);
 
-  uint32_t lensInfo[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-  fwrite(lensInfo, sizeof(unsigned), 8, fDng);
+  if (!isWritten || ferror(fDng)) {
+    LOG(ERROR) << "DNG write error: image data" << std::endl;
+  }
 
-  uint32_t antiAlias[2];
-  antiAlias[0] = 0;
-  antiAlias[1] = 1; // Turn off antiAliasStrength
+  fclose(fDng);
+  return true;
+}
 
-  fwrite(antiAlias, sizeof(unsigned), 2, fDng);
+template bool
+writeDng(const cv::Mat_<uint8_t>&, const filesystem::path&, const CameraIsp&, const bool);
+template bool
+writeDng(const cv::Mat_<uint16_t>&, const filesystem::path&, const CameraIsp&, const bool);
 
-  uint32_t bestScale[2];
-  bestScale[0] = 1;
-  bestScale[1] = 1; // use 1:1 scaling
+template <typename T>
+bool writeDng(
+    const filesystem::path& rawImageFilename,
+    const filesystem::path& outputFilename,
+    CameraIsp& cameraIsp) {
+  CHECK_EQ(rawImageFilename.extension(), ".raw");
 
-  fwrite(bestScale, sizeof(unsigned), 2, fDng);
+  // - load ISP config and read raw image
+  switch (cameraIsp.getSensorBitsPerPixel()) {
+    case 8: {
+      std::vector<uint8_t> rawImage = readRawImage<uint8_t>(rawImageFilename, cameraIsp);
+      cameraIsp.loadImageFromSensor(rawImage);
+      break;
+    }
+    case 16: {
+      std::vector<uint16_t> rawImage = readRawImage<uint16_t>(rawImageFilename, cameraIsp);
+      cameraIsp.loadImageFromSensor(rawImage);
+      break;
+    }
+    default:
+      CHECK(false) << "Unsupported output precision" << std::endl;
+  };
 
-  // Raw image data
-  const size_t status = fwrite(preprocessedRawImage.data, sizeof(T), width * height, fDng);
+  // The step below involves an internal conversion to and from float32, which, for uint16
+  // input+output type, can result in off-by-one differences between pixels in the original image
+  // and the written DNG
+  cv::Mat_<T> preprocessedRawImage = cameraIsp.getRawImage<T>();
 
-  if (status != width * height) {
-    LOG(ERROR) << "DNG write error: image data" << std::endl;
-  }
 
-  fclose(fDng);
-  return true;
+  return writeDng(preprocessedRawImage, outputFilename, cameraIsp);
 }
 
 bool writeDng(
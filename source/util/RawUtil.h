@@ -28,6 +28,12 @@ std::unique_ptr<CameraIsp> cameraIspFromConfigFileWithOptions(
     DemosaicFilter demosaicFilter = kDefaultDemosaicFilterForRawToRgb,
     bool applyToneCurve = true);
 
+/* Reads sensor width x sensor height pixels of raw image data, as configured in the given ISP */
+template <typename T>
+std::vector<T> readRawImage(
+    const boost::filesystem::path& rawImageFilename,
+    const CameraIsp& cameraIsp);
+
 /* Converts the given raw image data to RGB via the given ISP */
 template <typename T>
 cv::Mat_<cv::Vec<T, 3>> rawToRgb(const std::vector<T>& rawImage, CameraIsp& cameraIsp);
@@ -67,4 +73,13 @@ bool writeDng(
     const boost::filesystem::path& outputFilename,
     const boost::filesystem::path& ispConfigFilename = "");
 
+/* Writes a DNG file for raw image data preprocessed by the given ISP, see CameraIsp::getRawImage.
+   The image is stored in tiles, losslessly jpeg compressed if compress is set */
+template <typename T>
+bool writeDng(
+    const cv::Mat_<T>& preprocessedRawImage,
+    const boost::filesystem::path& outputFilename,
+    const CameraIsp& cameraIsp,
+    const bool compress = false);
+
 }; // namespace fb360_dep
@@ -0,0 +1,160 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/RayMapCache.h"
+
+#include <fstream>
+#include <random>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
+
+namespace fb360_dep {
+
+namespace {
+
+// Ray map file: RayMapHeader, then rows * cols rays, then rows * cols fov mask bytes
+const uint32_t kRayMapMagic = 0x50414d52; // "RMAP"
+
+struct RayMapHeader {
+  uint32_t magic;
+  int32_t rows;
+  int32_t cols;
+  uint32_t padding;
+};
+
+struct MappedFile {
+  explicit MappedFile(const filesystem::path& path)
+      : file(path.string().c_str(), boost::interprocess::read_only),
+        region(file, boost::interprocess::read_only) {}
+
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+};
+
+std::string rayMapKey(const Camera& camera, const cv::Size& size) {
+  const std::string key =
+      folly::sformat("{} {}x{}", folly::toJson(camera.serialize()), size.width, size.height);
+  const uint64_t hash = folly::hash::fnv64(key);
+  return folly::sformat("{}_{}x{}_{:016x}", camera.id, size.width, size.height, hash);
+}
+
+} // namespace
+
+filesystem::path RayMapCache::getDefaultDir(const filesystem::path& rigPath) {
+  return rigPath.parent_path() / (rigPath.stem().string() + "_ray_maps");
+}
+
+const RayMap& RayMapCache::get(const Camera& camera, const cv::Size& size) {
+  const std::string key = rayMapKey(camera, size);
+  Entry* entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Entry>& slot = entries[key];
+    if (!slot) {
+      slot.reset(new Entry);
+    }
+    entry = slot.get();
+  }
+
+  // Other cameras can be computed in parallel, the same camera is computed once
+  std::call_once(entry->once, [&] {
+    const filesystem::path path = dir.empty() ? filesystem::path() : dir / (key + ".rays");
+    if (!path.empty() && load(*entry, path, size)) {
+      return;
+    }
+    compute(entry->map, camera, size);
+    if (!path.empty()) {
+      save(entry->map, path);
+    }
+  });
+  return entry->map;
+}
+
+void RayMapCache::compute(RayMap& map, const Camera& camera, const cv::Size& size) {
+  map.rays.create(size);
+  map.fovMask.create(size);
+  const Camera::Vector2 scale = camera.isNormalized()
+      ? Camera::Vector2(1.0 / size.width, 1.0 / size.height)
+      : camera.resolution.cwiseQuotient(Camera::Vector2(size.width, size.height));
+  std::vector<Camera::Vector2> pixels(size.width);
+  for (int y = 0; y < size.height; ++y) {
+    for (int x = 0; x < size.width; ++x) {
+      pixels[x] = Camera::Vector2(x + 0.5, y + 0.5).cwiseProduct(scale);
+      map.fovMask(y, x) = !camera.isOutsideImageCircle(pixels[x]);
+    }
+    const std::vector<Camera::Vector3> rigs = camera.rigs(pixels, 1);
+    for (int x = 0; x < size.width; ++x) {
+      const Camera::Vector3 ray = rigs[x] - camera.position;
+      map.rays(y, x) = cv::Vec3f(ray.x(), ray.y(), ray.z());
+    }
+  }
+}
+
+bool RayMapCache::load(Entry& entry, const filesystem::path& path, const cv::Size& size) {
+  if (!filesystem::exists(path)) {
+    return false;
+  }
+  std::shared_ptr<MappedFile> mapped;
+  try {
+    mapped = std::make_shared<MappedFile>(path);
+  } catch (const boost::interprocess::interprocess_exception& e) {
+    LOG(WARNING) << folly::sformat("Cannot map ray map {}: {}", path.string(), e.what());
+    return false;
+  }
+  const size_t fileSize = mapped->region.get_size();
+  char* data = static_cast<char*>(mapped->region.get_address());
+  const size_t count = size_t(size.width) * size.height;
+  if (fileSize != sizeof(RayMapHeader) + count * (sizeof(cv::Vec3f) + sizeof(bool))) {
+    LOG(WARNING) << folly::sformat("Ignoring stale ray map {}", path.string());
+    return false;
+  }
+  const RayMapHeader& header = *reinterpret_cast<const RayMapHeader*>(data);
+  if (header.magic != kRayMapMagic || header.rows != size.height || header.cols != size.width) {
+    LOG(WARNING) << folly::sformat("Ignoring stale ray map {}", path.string());
+    return false;
+  }
+
+  // Mats point straight into the read-only mapping
+  char* p = data + sizeof(header);
+  entry.map.rays = cv::Mat_<cv::Vec3f>(size, reinterpret_cast<cv::Vec3f*>(p));
+  p += count * sizeof(cv::Vec3f);
+  entry.map.fovMask = cv::Mat_<bool>(size, reinterpret_cast<bool*>(p));
+  entry.mapped = mapped;
+  return true;
+}
+
+void RayMapCache::save(const RayMap& map, const filesystem::path& path) {
+  RayMapHeader header;
+  header.magic = kRayMapMagic;
+  header.rows = map.rays.rows;
+  header.cols = map.rays.cols;
+  header.padding = 0;
+
+  // Write to a temporary file and rename, so concurrent readers never see a partial file
+  filesystem::create_directories(path.parent_path());
+  const filesystem::path tmpPath =
+      folly::sformat("{}.{}.tmp", path.string(), std::random_device()());
+  std::ofstream file(tmpPath.string(), std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(map.rays.data), map.rays.total() * sizeof(cv::Vec3f));
+  file.write(reinterpret_cast<const char*>(map.fovMask.data), map.fovMask.total() * sizeof(bool));
+  file.close();
+  if (!file) {
+    LOG(WARNING) << folly::sformat("Cannot write ray map {}", tmpPath.string());
+    filesystem::remove(tmpPath);
+    return;
+  }
+  filesystem::rename(tmpPath, path);
+}
+
+} // namespace fb360_dep
@@ -0,0 +1,63 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "source/util/Camera.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+
+// Per pixel unit rays and fov mask of a camera scaled to an image size
+// Pixel (x, y) is ((x + 0.5) / width, (y + 0.5) / height) in normalized camera coordinates, so the
+// world point at depth d is camera.position + d * rays(y, x), same as camera.rig(pixel, d)
+struct RayMap {
+  cv::Mat_<cv::Vec3f> rays; // rig space
+  cv::Mat_<bool> fovMask; // false outside the image circle
+};
+
+// Computes the ray map of each (camera, size) once
+// If dir is not empty, maps are also saved there, keyed by a hash of the camera and the size.
+// Later lookups, in this or any other process, memory-map the files instead of computing the maps,
+// so all the tools of a pipeline share them. Maps read from disk are read-only
+class RayMapCache {
+ public:
+  explicit RayMapCache(const filesystem::path& dir = "") : dir(dir) {}
+
+  RayMapCache(const RayMapCache&) = delete;
+  RayMapCache& operator=(const RayMapCache&) = delete;
+
+  // Directory next to the rig json, e.g. rigs/rig_calibrated_ray_maps for rigs/rig_calibrated.json
+  static filesystem::path getDefaultDir(const filesystem::path& rigPath);
+
+  // Thread safe. The map is valid as long as the cache is
+  const RayMap& get(const Camera& camera, const cv::Size& size);
+
+ private:
+  struct Entry {
+    std::once_flag once;
+    RayMap map;
+    std::shared_ptr<void> mapped; // keeps the memory behind map mapped
+  };
+
+  static void compute(RayMap& map, const Camera& camera, const cv::Size& size);
+  static bool load(Entry& entry, const filesystem::path& path, const cv::Size& size);
+  static void save(const RayMap& map, const filesystem::path& path);
+
+  const filesystem::path dir;
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<Entry>> entries;
+};
+
+} // namespace fb360_dep
@@ -0,0 +1,91 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/RemapUtil.h"
+
+#include <climits>
+#include <cmath>
+
+#include <glog/logging.h>
+#include <opencv2/imgproc.hpp>
+
+#include <folly/Format.h>
+#include <folly/hash/Hash.h>
+#include <folly/json.h>
+
+#include "source/util/CvUtil.h"
+
+namespace fb360_dep {
+namespace remap_util {
+
+RemapTable makeTable(const cv::Mat_<cv::Vec2f>& map, const bool isNearest) {
+  // (-1, -1) with no bilinear weight on its neighbors only reads the border
+  cv::Mat_<cv::Vec2f> mapValid = map.clone();
+  for (cv::Vec2f& p : mapValid) {
+    if (std::isnan(p[0]) || std::isnan(p[1])) {
+      p = cv::Vec2f(-1, -1);
+    }
+  }
+  RemapTable table;
+  cv::convertMaps(mapValid, cv::noArray(), table.map1, table.map2, CV_16SC2, isNearest);
+  return table;
+}
+
+cv::Mat remap(
+    const cv::Mat& src,
+    const RemapTable& table,
+    const int borderMode,
+    const cv::Scalar& border) {
+  CHECK_LT(std::max(src.rows, src.cols), SHRT_MAX) << "fixed-point maps are 16 bits";
+  cv::Mat dst;
+  cv::remap(
+      src,
+      dst,
+      table.map1,
+      table.map2,
+      table.isNearest() ? cv::INTER_NEAREST : cv::INTER_LINEAR,
+      borderMode,
+      border);
+  return dst;
+}
+
+std::string getKey(const std::string& tag, const Camera& camera, const cv::Size& size) {
+  const std::string key = folly::sformat(
+      "{} {} {}x{}", tag, folly::toJson(camera.serialize()), size.width, size.height);
+  const uint64_t hash = folly::hash::fnv64(key);
+  return folly::sformat("{}_{}x{}_{:016x}", camera.id, size.width, size.height, hash);
+}
+
+RemapTable getOrCompute(
+    const filesystem::path& dir,
+    const std::string& key,
+    const std::function<RemapTable()>& compute) {
+  if (dir.empty()) {
+    return compute();
+  }
+  const filesystem::path map1Path = dir / (key + ".map1" + cv_util::kMatFileExtension);
+  const filesystem::path map2Path = dir / (key + ".map2" + cv_util::kMatFileExtension);
+  RemapTable table;
+  if (filesystem::exists(map1Path)) {
+    table.map1 = cv_util::readMatFile(map1Path);
+    if (filesystem::exists(map2Path)) {
+      table.map2 = cv_util::readMatFile(map2Path);
+    }
+    return table;
+  }
+
+  table = compute();
+  filesystem::create_directories(dir);
+  if (!table.isNearest()) {
+    cv_util::writeMatFileAtomically(map2Path, table.map2);
+  }
+  cv_util::writeMatFileAtomically(map1Path, table.map1); // last, it marks the table as complete
+  return table;
+}
+
+} // namespace remap_util
+} // namespace fb360_dep
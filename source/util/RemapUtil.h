@@ -0,0 +1,56 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "source/util/Camera.h"
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace remap_util {
+
+// Fixed-point cv::remap tables, as made by cv::convertMaps
+// map1 has the integer source coordinates of each pixel (CV_16SC2), map2 the bilinear weights
+// (CV_16UC1), empty for nearest neighbor. Pixels without a source point take the border value
+struct RemapTable {
+  cv::Mat map1;
+  cv::Mat map2;
+
+  bool isNearest() const {
+    return map2.empty();
+  }
+};
+
+// map has the source coordinates of each pixel, in the cv::remap convention where (0, 0) is the
+// center of the top left pixel, and NAN where there is no source point
+// If isNearest, coordinates are rounded to the nearest pixel
+RemapTable makeTable(const cv::Mat_<cv::Vec2f>& map, const bool isNearest);
+
+// Gathers src through table. Outside of src is border, or the edge with cv::BORDER_REPLICATE
+cv::Mat remap(
+    const cv::Mat& src,
+    const RemapTable& table,
+    const int borderMode = cv::BORDER_CONSTANT,
+    const cv::Scalar& border = cv::Scalar());
+
+// Unique name of a table that depends on camera, size, and whatever else tag spells out
+std::string getKey(const std::string& tag, const Camera& camera, const cv::Size& size);
+
+// Reads table key from dir, if it was saved there, otherwise computes it and saves it
+// dir empty = no cache. Later runs on the same rig, resolution and parameters only read the files
+RemapTable getOrCompute(
+    const filesystem::path& dir,
+    const std::string& key,
+    const std::function<RemapTable()>& compute);
+
+} // namespace remap_util
+} // namespace fb360_dep
@@ -8,17 +8,33 @@
 #include "source/util/SystemUtil.h"
 
 #include <signal.h>
+#include <condition_variable>
 #include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <folly/Format.h>
 
+#include "source/util/BenchTrace.h"
+#include "source/util/MatPool.h"
+
 DECLARE_bool(help);
 DECLARE_bool(helpshort);
 
+DEFINE_int32(mat_pool_mb, 0, "keep up to this many MB of freed large mats for reuse (0 = off)");
+DEFINE_bool(serve, false, "stay resident and run one job per stdin line of flags (see runJobs)");
+
 namespace fb360_dep {
 namespace system_util {
 
@@ -95,6 +111,19 @@ void logFlags() {
   }
 }
 
+// Rewrite string flags holding uris, e.g. --output_root=shm://frame_0, as the local paths they
+// refer to, so every binary accepts them wherever it takes a path
+void resolveUriFlags() {
+  std::vector<gflags::CommandLineFlagInfo> flags;
+  gflags::GetAllFlags(&flags);
+  for (const auto& flag : flags) {
+    if (flag.type == "string" && ::filesystem::isShmUri(flag.current_value)) {
+      const std::string resolved = ::filesystem::resolveUri(flag.current_value).string();
+      gflags::SetCommandLineOption(flag.name.c_str(), resolved.c_str());
+    }
+  }
+}
+
 void initDep(int& argc, char**& argv, const std::string kUsageMessage) {
   if (kUsageMessage != "") {
     gflags::SetUsageMessage(kUsageMessage);
@@ -108,12 +137,18 @@ void initDep(int& argc, char**& argv, const std::string kUsageMessage) {
   FLAGS_helpshort |= FLAGS_help;
   FLAGS_help = false;
   gflags::HandleCommandLineHelpFlags();
+  resolveUriFlags();
 
   if (FLAGS_log_dir != "") {
     ::filesystem::create_directories(FLAGS_log_dir);
   }
 
   logFlags();
+  bench_trace::init(argv[0]);
+
+  if (FLAGS_mat_pool_mb > 0) {
+    MatPool::install(size_t(FLAGS_mat_pool_mb) << 20);
+  }
 
   // setup signal and termination handlers
   std::set_terminate(terminateHandler);
@@ -157,5 +192,180 @@ void initDep(int& argc, char**& argv, const std::string kUsageMessage) {
 #endif
 }
 
+// Applies "--name=value" and "--name" (= true) tokens of line to the flags
+static void setJobFlags(const std::string& line) {
+  std::istringstream tokens(line);
+  std::string token;
+  while (tokens >> token) {
+    if (token.compare(0, 2, "--") != 0) {
+      throw std::runtime_error(folly::sformat("expected --name=value, got {}", token));
+    }
+    const size_t eq = token.find('=');
+    const std::string name = token.substr(2, eq == std::string::npos ? eq : eq - 2);
+    const std::string value = eq == std::string::npos ? "true" : token.substr(eq + 1);
+    if (gflags::SetCommandLineOption(name.c_str(), value.c_str()).empty()) {
+      throw std::runtime_error(folly::sformat("cannot set --{} to {}", name, value));
+    }
+  }
+}
+
+int runJobs(const std::function<int()>& job) {
+  if (!FLAGS_serve) {
+    return job();
+  }
+
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::string status = "ok";
+    try {
+      gflags::FlagSaver flagSaver; // restores the flags the process was started with
+      setJobFlags(line);
+      resolveUriFlags();
+      logFlags();
+      bench_trace::ScopedRecord record("job");
+      const int code = job();
+      if (code != EXIT_SUCCESS) {
+        status = folly::sformat("error exit code {}", code);
+      }
+    } catch (const std::exception& e) {
+      status = folly::sformat("error {}", e.what());
+    }
+    LOG(INFO) << folly::sformat("Job done: {}", status);
+    std::cout << kJobReplyPrefix << status << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+int64_t getResidentBytes() {
+#ifdef __linux__
+  // Sizes in pages: total program size, then resident
+  std::ifstream statm("/proc/self/statm");
+  int64_t size = 0;
+  int64_t resident = 0;
+  if (statm >> size >> resident) {
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+#endif
+  return 0;
+}
+
+int64_t getPeakResidentBytes() {
+#ifndef WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return int64_t(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+  }
+#endif
+  return 0;
+}
+
+double getCpuSeconds() {
+#ifndef WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  }
+#endif
+  return 0;
+}
+
+void getIoBytes(int64_t& readBytes, int64_t& writtenBytes) {
+  readBytes = 0;
+  writtenBytes = 0;
+#ifdef __linux__
+  // Lines of "<name>: <value>", rchar and wchar count every read and write
+  std::ifstream io("/proc/self/io");
+  std::string name;
+  int64_t value;
+  while (io >> name >> value) {
+    if (name == "rchar:") {
+      readBytes = value;
+    } else if (name == "wchar:") {
+      writtenBytes = value;
+    }
+  }
+#endif
+}
+
+// Samples the resident set size for every live RssHighWater, sleeps while there are none
+class RssSampler {
+ public:
+  static RssSampler& getInstance() {
+    static RssSampler sampler;
+    return sampler;
+  }
+
+  void add(RssHighWater* highWater) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      highWaters.insert(highWater);
+      if (!thread.joinable()) {
+        thread = std::thread(&RssSampler::run, this);
+      }
+    }
+    wake.notify_one();
+  }
+
+  void remove(RssHighWater* highWater) {
+    std::lock_guard<std::mutex> lock(mutex);
+    highWaters.erase(highWater);
+  }
+
+  ~RssSampler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop) {
+      if (highWaters.empty()) {
+        wake.wait(lock);
+        continue;
+      }
+      const int64_t bytes = getResidentBytes();
+      for (RssHighWater* highWater : highWaters) {
+        highWater->raise(bytes);
+      }
+      wake.wait_for(lock, std::chrono::milliseconds(RssHighWater::kRssSampleMs));
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::set<RssHighWater*> highWaters;
+  std::thread thread;
+  bool stop = false;
+};
+
+RssHighWater::RssHighWater() {
+  raise(getResidentBytes());
+  RssSampler::getInstance().add(this);
+}
+
+RssHighWater::~RssHighWater() {
+  RssSampler::getInstance().remove(this);
+}
+
+int64_t RssHighWater::get() {
+  raise(getResidentBytes());
+  return peak.load(std::memory_order_relaxed);
+}
+
 } // namespace system_util
 } // namespace fb360_dep
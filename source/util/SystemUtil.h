@@ -19,7 +19,10 @@
 #include <math.h>
 
 #include <glog/logging.h>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -38,5 +41,56 @@ namespace system_util {
 // exception
 void initDep(int& argc, char**& argv, const std::string kUsageMessage = "");
 
+// Prefix of the status line written to stdout after each job in --serve mode
+const std::string kJobReplyPrefix = "[job] ";
+
+// Runs job once and returns its exit code, unless --serve is set. In that case the process stays
+// resident and runs job once per line read from stdin, until end of file. A line holds the flags of
+// the job, e.g. "--first=000010 --last=000010", applied on top of the flags the process was started
+// with and reverted when the job is done. State kept outside of job (thread pools, caches) stays
+// warm across jobs. After each job a line "<kJobReplyPrefix>ok" or "<kJobReplyPrefix>error <what>"
+// is written to stdout. Failed CHECKs still terminate the process
+int runJobs(const std::function<int()>& job);
+
+// Resident set size of the process in bytes, 0 where it is not known
+int64_t getResidentBytes();
+
+// Highest resident set size of the process since it started, in bytes, 0 where it is not known
+int64_t getPeakResidentBytes();
+
+// User plus system cpu time of all the threads of the process so far, 0 where it is not known
+double getCpuSeconds();
+
+// Bytes the process has read and written so far through system calls, whether they went to disk
+// or to the page cache, 0 where it is not known
+void getIoBytes(int64_t& readBytes, int64_t& writtenBytes);
+
+// High water mark of the resident set size over the lifetime of the object
+// While any exist, a background thread samples the resident set size every kRssSampleMs and raises
+// all of them, so spikes inside a scope are caught even when they are gone by the end of it
+class RssHighWater {
+ public:
+  static const int kRssSampleMs = 10;
+
+  RssHighWater();
+  ~RssHighWater();
+
+  RssHighWater(const RssHighWater&) = delete;
+  RssHighWater& operator=(const RssHighWater&) = delete;
+
+  // Highest resident bytes sampled so far, including now
+  int64_t get();
+
+  // Called by the sampler
+  void raise(const int64_t bytes) {
+    int64_t prev = peak.load(std::memory_order_relaxed);
+    while (prev < bytes && !peak.compare_exchange_weak(prev, bytes, std::memory_order_relaxed)) {
+    }
+  }
+
+ private:
+  std::atomic<int64_t> peak{0};
+};
+
 } // namespace system_util
 } // namespace fb360_dep
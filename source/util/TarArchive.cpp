@@ -0,0 +1,193 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/TarArchive.h"
+
+#include <cstring>
+#include <mutex>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+namespace fb360_dep {
+namespace tar_util {
+
+namespace {
+
+const size_t kBlockSize = 512;
+
+// Header fields, POSIX.1-1988 ustar
+const size_t kNameOffset = 0;
+const size_t kNameSize = 100;
+const size_t kSizeOffset = 124;
+const size_t kSizeSize = 12;
+const size_t kTypeOffset = 156;
+const size_t kMagicOffset = 257;
+const size_t kPrefixOffset = 345;
+const size_t kPrefixSize = 155;
+
+std::string getString(const char* field, const size_t size) {
+  return std::string(field, strnlen(field, size));
+}
+
+// Octal, or big endian base 256 if the high bit of the first byte is set (gnu, for sizes >= 8GB)
+size_t getNumber(const char* field, const size_t size) {
+  size_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < size; ++i) {
+      value = value << 8 | uint8_t(field[i]);
+    }
+    return value;
+  }
+  for (size_t i = 0; i < size && field[i]; ++i) {
+    if ('0' <= field[i] && field[i] <= '7') {
+      value = value << 3 | (field[i] - '0');
+    }
+  }
+  return value;
+}
+
+// The path record of a pax extended header, "<length> path=<name>\n", empty if none
+std::string getPaxPath(const char* data, const size_t size) {
+  size_t pos = 0;
+  while (pos < size) {
+    const size_t space = std::string(data + pos, size - pos).find(' ');
+    if (space == std::string::npos) {
+      break;
+    }
+    const size_t length = std::stoul(std::string(data + pos, space));
+    if (length == 0 || pos + length > size) {
+      break;
+    }
+    const std::string record(data + pos + space + 1, length - space - 2); // without the newline
+    if (record.compare(0, 5, "path=") == 0) {
+      return record.substr(5);
+    }
+    pos += length;
+  }
+  return "";
+}
+
+bool isZeroBlock(const char* block) {
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    if (block[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+TarArchive::TarArchive(const filesystem::path& path)
+    : file(path.string().c_str(), boost::interprocess::read_only),
+      region(file, boost::interprocess::read_only) {
+  const char* const data = static_cast<const char*>(region.get_address());
+  const size_t size = region.get_size();
+  std::string longName; // from a gnu or pax header, for the next member
+  for (size_t pos = 0; pos + kBlockSize <= size;) {
+    const char* const header = data + pos;
+    if (isZeroBlock(header)) {
+      break; // end of archive
+    }
+    const size_t memberSize = getNumber(header + kSizeOffset, kSizeSize);
+    const size_t dataPos = pos + kBlockSize;
+    CHECK_LE(dataPos + memberSize, size) << folly::sformat("truncated archive: {}", path.string());
+    const char type = header[kTypeOffset];
+    if (type == 'L') { // gnu long name
+      longName = getString(data + dataPos, memberSize);
+    } else if (type == 'x') { // pax extended header
+      longName = getPaxPath(data + dataPos, memberSize);
+    } else {
+      std::string name = longName;
+      if (name.empty()) {
+        name = getString(header + kNameOffset, kNameSize);
+        const bool isUstar = memcmp(header + kMagicOffset, "ustar", 5) == 0;
+        const std::string prefix =
+            isUstar ? getString(header + kPrefixOffset, kPrefixSize) : std::string();
+        if (!prefix.empty()) {
+          name = prefix + "/" + name;
+        }
+      }
+      longName.clear();
+      if (name.compare(0, 2, "./") == 0) {
+        name = name.substr(2);
+      }
+      if (type == '0' || type == '\0') { // regular file
+        members[name] = Member{data + dataPos, memberSize};
+      }
+    }
+    pos = dataPos + (memberSize + kBlockSize - 1) / kBlockSize * kBlockSize;
+  }
+}
+
+const TarArchive::Member* TarArchive::find(const std::string& name) const {
+  const auto it = members.find(name);
+  return it == members.end() ? nullptr : &it->second;
+}
+
+std::string TarArchive::findPrefix(const std::string& prefix) const {
+  const auto it = members.lower_bound(prefix);
+  if (it == members.end() || it->first.compare(0, prefix.size(), prefix) != 0) {
+    return "";
+  }
+  return it->first;
+}
+
+std::shared_ptr<const TarArchive> getArchive(const filesystem::path& path) {
+  using Time = decltype(filesystem::last_write_time(filesystem::path()));
+  struct Entry {
+    Time modified;
+    std::shared_ptr<const TarArchive> archive;
+  };
+  static std::mutex mutex;
+  static std::map<std::string, Entry> entries;
+
+  if (!filesystem::is_regular_file(path) || filesystem::file_size(path) == 0) {
+    return nullptr;
+  }
+  const Time modified = filesystem::last_write_time(path);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Entry& entry = entries[path.string()];
+  if (!entry.archive || entry.modified != modified) {
+    entry.archive = std::make_shared<const TarArchive>(path);
+    entry.modified = modified;
+  }
+  return entry.archive;
+}
+
+std::shared_ptr<const TarArchive> findImage(
+    const filesystem::path& imagePath,
+    const TarArchive::Member*& member) {
+  const filesystem::path camDir = imagePath.parent_path();
+  const std::string frameName = imagePath.stem().string();
+  std::shared_ptr<const TarArchive> archive =
+      getArchive(camDir.parent_path() / (frameName + ".tar"));
+  if (!archive) {
+    return nullptr;
+  }
+  member = archive->find(camDir.filename().string() + "/" + imagePath.filename().string());
+  return member ? archive : nullptr;
+}
+
+std::string findImageExtension(
+    const filesystem::path& dir,
+    const std::string& camId,
+    const std::string& frameName) {
+  const std::shared_ptr<const TarArchive> archive = getArchive(dir / (frameName + ".tar"));
+  if (!archive) {
+    return "";
+  }
+  const std::string name = archive->findPrefix(camId + "/" + frameName + ".");
+  return name.empty() ? "" : filesystem::path(name).extension().string();
+}
+
+} // namespace tar_util
+} // namespace fb360_dep
@@ -0,0 +1,71 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace tar_util {
+
+// Uncompressed tar archive (ustar, gnu or pax), memory-mapped, with an index of its regular files
+// built once when it is opened. Members are read in place, nothing is extracted
+class TarArchive {
+ public:
+  struct Member {
+    const char* data; // into the mapping, valid while the archive is
+    size_t size;
+  };
+
+  explicit TarArchive(const filesystem::path& path);
+
+  TarArchive(const TarArchive&) = delete;
+  TarArchive& operator=(const TarArchive&) = delete;
+
+  // Null if there is no such member, e.g. "cam0/000000.png"
+  const Member* find(const std::string& name) const;
+
+  // Name of the first member that starts with prefix, empty if none
+  std::string findPrefix(const std::string& prefix) const;
+
+  const std::map<std::string, Member>& getMembers() const {
+    return members;
+  }
+
+ private:
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+  std::map<std::string, Member> members;
+};
+
+// Thread safe. Null if path is not a file. Archives are cached until their file changes
+std::shared_ptr<const TarArchive> getArchive(const filesystem::path& path);
+
+// Frames are moved around the farm as <dir>/<frame>.tar, holding <camera>/<frame><extension> for
+// every camera of <dir> (see scripts/render/network.py tar_frame). These find the image at
+// <dir>/<camera>/<frame><extension> in such an archive, for when it was not extracted
+
+// Null if the image is not in its frame's archive, else the archive, and member set to it
+std::shared_ptr<const TarArchive> findImage(
+    const filesystem::path& imagePath,
+    const TarArchive::Member*& member);
+
+// Extension of the image of camId and frameName in the archive of frameName in dir, empty if none
+std::string findImageExtension(
+    const filesystem::path& dir,
+    const std::string& camId,
+    const std::string& frameName);
+
+} // namespace tar_util
+} // namespace fb360_dep
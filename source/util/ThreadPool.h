@@ -7,10 +7,19 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+#include "source/util/Numa.h"
 #include "source/util/SystemUtil.h"
 
 namespace fb360_dep {
@@ -19,6 +28,196 @@ inline int getThreadCount() {
   return std::max<int>(1, std::thread::hardware_concurrency());
 }
 
+// Long-lived pool of worker threads shared by the whole process
+// Each worker owns a deque of tasks: it pushes and pops at the back (LIFO, cache friendly) and
+// idle workers steal from the front of other workers' deques
+// Threads that are waiting on tasks (see ThreadPool::join) run pending tasks instead of blocking,
+// so nested parallelism cannot deadlock the pool
+// On numa machines workers are spread over the nodes and pinned to them, tasks can be submitted to
+// a node, and idle workers steal from their own node before they steal from the others. Tasks
+// spawned by a worker stay on its node unless another node runs out of work
+class WorkStealingPool {
+ public:
+  using Task = std::function<void()>;
+
+  explicit WorkStealingPool(const int numWorkers)
+      : queues(std::max(1, numWorkers)),
+        nodeWorkers(numa::getNumNodes()),
+        nextNodeQueue(nodeWorkers.size()) {
+    for (int i = 0; i < int(queues.size()); ++i) {
+      queues[i].node = numa::nodeOfThread(i, queues.size());
+      nodeWorkers[queues[i].node].push_back(i);
+    }
+    for (int i = 0; i < int(queues.size()); ++i) {
+      workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  // Process-wide pool, created on first use with one worker per hardware thread
+  static WorkStealingPool& getInstance() {
+    static WorkStealingPool pool(getThreadCount());
+    return pool;
+  }
+
+  int getNumWorkers() const {
+    return workers.size();
+  }
+
+  int getNumNodes() const {
+    return nodeWorkers.size();
+  }
+
+  // Node of the calling worker, -1 if it is not one of our workers
+  int getWorkerNode() const {
+    const int idx = workerIdx();
+    return idx >= 0 ? queues[idx].node : -1;
+  }
+
+  // node < 0 is any node
+  void submit(Task task, const int node = -1) {
+    // Workers keep their own tasks local, everybody else distributes round robin, over the
+    // workers of the node if there is one
+    const int ownIdx = workerIdx();
+    int idx;
+    if (node >= 0 && node < getNumNodes() && !nodeWorkers[node].empty() &&
+        (ownIdx < 0 || queues[ownIdx].node != node)) {
+      const std::vector<int>& candidates = nodeWorkers[node];
+      idx = candidates[nextNodeQueue[node]++ % candidates.size()];
+    } else {
+      idx = ownIdx >= 0 ? ownIdx : int(nextQueue++ % queues.size());
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues[idx].mutex);
+      queues[idx].tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      ++numPending;
+    }
+    workAvailable.notify_one();
+  }
+
+  // Runs one pending task on the calling thread, if there is any
+  // Returns false if no task was found
+  bool runPendingTask() {
+    Task task;
+    if (!popTask(task, workerIdx())) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    int node = 0; // of the worker
+  };
+
+  struct WorkerId {
+    const WorkStealingPool* pool = nullptr;
+    int idx = -1;
+  };
+
+  static WorkerId& currentWorker() {
+    static thread_local WorkerId id;
+    return id;
+  }
+
+  // Index of the calling thread in this pool, -1 if it is not one of our workers
+  int workerIdx() const {
+    const WorkerId& id = currentWorker();
+    return id.pool == this ? id.idx : -1;
+  }
+
+  bool popTask(Task& task, const int ownIdx) {
+    const int n = queues.size();
+
+    // Own deque first, newest task first
+    if (ownIdx >= 0) {
+      Queue& q = queues[ownIdx];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        --numPending;
+        return true;
+      }
+    }
+
+    // Steal oldest task from someone else, on our own node first
+    const int start = ownIdx >= 0 ? ownIdx + 1 : int(nextSteal++ % n);
+    const int ownNode = ownIdx >= 0 ? queues[ownIdx].node : -1;
+    const int passes = ownNode >= 0 && getNumNodes() > 1 ? 2 : 1; // own node, then the others
+    for (int pass = 0; pass < passes; ++pass) {
+      for (int i = 0; i < n; ++i) {
+        const int victim = (start + i) % n;
+        if (victim == ownIdx || (passes == 2 && (queues[victim].node == ownNode) != (pass == 0))) {
+          continue;
+        }
+        Queue& q = queues[victim];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+          --numPending;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void workerLoop(const int idx) {
+    currentWorker().pool = this;
+    currentWorker().idx = idx;
+    numa::pinToNode(queues[idx].node);
+    while (true) {
+      Task task;
+      if (popTask(task, idx)) {
+        task();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      workAvailable.wait(lock, [this] { return stopping || numPending > 0; });
+      if (stopping && numPending == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<Queue> queues;
+  std::vector<std::vector<int>> nodeWorkers; // worker indexes of every numa node
+  std::vector<std::atomic<unsigned>> nextNodeQueue;
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> nextQueue{0};
+  std::atomic<unsigned> nextSteal{0};
+  std::atomic<int> numPending{0};
+  std::mutex sleepMutex;
+  std::condition_variable workAvailable;
+  bool stopping = false;
+};
+
+// Group of tasks submitted to the shared WorkStealingPool
+// spawn() never creates a thread, it queues the task and returns unless maxThreads tasks of this
+// group are already in flight, in which case it helps running tasks until a slot frees up
+// join() waits for all the tasks spawned so far, running pending tasks while it waits
+// maxThreads = 0 runs every task inline on the calling thread
 struct ThreadPool {
   ThreadPool(const int maxThreadsFlag) {
     maxThreads = ThreadPool::getThreadCountFromFlag(maxThreadsFlag);
@@ -26,6 +225,12 @@ struct ThreadPool {
   ThreadPool() {
     maxThreads = ThreadPool::getThreadCountFromFlag(-1);
   }
+  ~ThreadPool() {
+    waitUntil([this] { return state->inFlight == 0; });
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
   static int getThreadCountFromFlag(const int maxThreadsFlag) {
     return (maxThreadsFlag < 0) ? getThreadCount() : maxThreadsFlag;
   }
@@ -34,24 +239,133 @@ struct ThreadPool {
   }
   template <class Fn, class... Args>
   void spawn(Fn&& fn, Args&&... args) {
+    spawnOnNode(-1, std::forward<Fn>(fn), std::forward<Args>(args)...);
+  }
+  // Same as spawn(), on a worker of the given numa node if there is one, see numa::nodeOf()
+  template <class Fn, class... Args>
+  void spawnOnNode(const int node, Fn&& fn, Args&&... args) {
     if (maxThreads == 0) {
-      fn(std::forward<Args>(args)...);
+      std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...)(); // also member functions
     } else {
-      if (int(threads.size()) == maxThreads) {
-        join();
+      // Same argument semantics as std::thread: decayed copies, use std::ref for references
+      std::function<void()> task = std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      waitUntil([this] { return state->inFlight < maxThreads; });
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        ++state->inFlight;
       }
-      threads.emplace_back(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      std::shared_ptr<State> s = state;
+      auto run = [s, task = std::move(task)] {
+        try {
+          task();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(s->mutex);
+          if (!s->exception) {
+            s->exception = std::current_exception();
+          }
+        }
+        {
+          std::lock_guard<std::mutex> lock(s->mutex);
+          --s->inFlight;
+        }
+        s->done.notify_all();
+      };
+      WorkStealingPool::getInstance().submit(std::move(run), node);
     }
   }
   void join() {
-    for (std::thread& thread : threads) {
-      thread.join();
+    waitUntil([this] { return state->inFlight == 0; });
+    std::exception_ptr exception;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      std::swap(exception, state->exception);
+    }
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+  // Calls fn(i) for every i in [begin, end), in chunks of grain consecutive indexes
+  template <class Fn>
+  void parallelFor(const int begin, const int end, const int grain, Fn&& fn) {
+    const int step = std::max(1, grain);
+    for (int chunkBegin = begin; chunkBegin < end; chunkBegin += step) {
+      const int chunkEnd = std::min(chunkBegin + step, end);
+      spawn([&fn, chunkBegin, chunkEnd] {
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+          fn(i);
+        }
+      });
     }
-    threads.clear();
+    join();
   }
 
  private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable done;
+    int inFlight = 0;
+    std::exception_ptr exception;
+  };
+
+  template <class Pred>
+  void waitUntil(Pred pred) {
+    WorkStealingPool& pool = WorkStealingPool::getInstance();
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (pred()) {
+          return;
+        }
+      }
+      if (pool.runPendingTask()) {
+        continue;
+      }
+      // Nothing to run, sleep until one of our tasks finishes (or new work may have shown up)
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->done.wait_for(lock, std::chrono::milliseconds(1), pred);
+      if (pred()) {
+        return;
+      }
+    }
+  }
+
   int maxThreads;
-  std::vector<std::thread> threads;
+  std::shared_ptr<State> state = std::make_shared<State>();
 };
+
+// Convenience wrapper: parallel loop over [begin, end) using up to maxThreadsFlag threads
+// (-1 = auto, 0 = run on the calling thread)
+template <class Fn>
+void parallelFor(const int begin, const int end, const int grain, Fn&& fn, const int threads = -1) {
+  ThreadPool threadPool(threads);
+  threadPool.parallelFor(begin, end, grain, std::forward<Fn>(fn));
+}
+
+// Calls fn(i) for every i in [0, count), the indexes of each numa node (see numa::nodeOf) one
+// after the other on a worker of that node, and the nodes in parallel. Parallel loops inside fn
+// then run on the node too, next to the memory first touched there
+// Without numa, or with threads = 0, it is a plain loop on the calling thread
+template <class Fn>
+void forEachByNode(const int count, Fn&& fn, const int threads = -1) {
+  const int numNodes = numa::getNumNodes();
+  if (numNodes == 1 || threads == 0) {
+    for (int i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  ThreadPool threadPool(threads);
+  for (int node = 0; node < numNodes; ++node) {
+    threadPool.spawnOnNode(node, [&fn, count, node] {
+      for (int i = 0; i < count; ++i) {
+        if (numa::nodeOf(i, count) == node) {
+          fn(i);
+        }
+      }
+    });
+  }
+  threadPool.join();
+}
+
 } // namespace fb360_dep
@@ -0,0 +1,116 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/VideoReader.h"
+
+#include <algorithm>
+#include <map>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+namespace fb360_dep {
+namespace video_util {
+
+#if CV_VERSION_MAJOR > 4 ||                              \
+    (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 ||   \
+                               (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+#define HAS_HW_ACCELERATION 1
+#endif
+
+static cv::VideoCapture openCapture(const filesystem::path& path, const bool isHardware) {
+#ifdef HAS_HW_ACCELERATION
+  if (isHardware) {
+    cv::VideoCapture capture(
+        path.string(),
+        cv::CAP_FFMPEG,
+        {cv::CAP_PROP_HW_ACCELERATION, cv::VIDEO_ACCELERATION_ANY});
+    if (capture.isOpened()) {
+      return capture;
+    }
+    LOG(WARNING) << folly::sformat("No hardware decoder for {}", path.string());
+  }
+#else
+  LOG_IF(WARNING, isHardware) << "Hardware decoding needs opencv 4.5.2, decoding in software";
+#endif
+  return cv::VideoCapture(path.string(), cv::CAP_FFMPEG);
+}
+
+VideoReader::VideoReader(const filesystem::path& path, const bool isHardware)
+    : path(path), capture(openCapture(path, isHardware)) {
+  CHECK(capture.isOpened()) << folly::sformat("cannot open video: {}", path.string());
+  frameCount = capture.get(cv::CAP_PROP_FRAME_COUNT);
+}
+
+cv::Mat VideoReader::read(const int frame) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = cache.begin(); it != cache.end(); ++it) {
+    if (it->first == frame) {
+      cache.splice(cache.begin(), cache, it);
+      return it->second;
+    }
+  }
+
+  CHECK(0 <= frame && frame < frameCount)
+      << folly::sformat("no frame {} in {} frames of {}", frame, frameCount, path.string());
+  if (frame != next) {
+    capture.set(cv::CAP_PROP_POS_FRAMES, frame);
+  }
+  cv::Mat image;
+  CHECK(capture.read(image))
+      << folly::sformat("cannot decode frame {} of {}", frame, path.string());
+  next = frame + 1;
+
+  cache.emplace_front(frame, image);
+  if (int(cache.size()) > kCachedFrames) {
+    cache.pop_back();
+  }
+  return image;
+}
+
+std::shared_ptr<VideoReader> getVideo(const filesystem::path& path) {
+  static std::mutex mutex;
+  static std::map<std::string, std::shared_ptr<VideoReader>> readers;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<VideoReader>& reader = readers[path.string()];
+  if (!reader) {
+    reader = std::make_shared<VideoReader>(path);
+  }
+  return reader;
+}
+
+filesystem::path findVideo(const filesystem::path& dir, const std::string& camId) {
+  for (const std::string& extension : kVideoExtensions) {
+    const filesystem::path path = dir / (camId + extension);
+    if (filesystem::is_regular_file(path)) {
+      return path;
+    }
+  }
+  return "";
+}
+
+bool isVideoFrame(const filesystem::path& imagePath) {
+  const std::string extension = imagePath.extension().string();
+  if (std::find(kVideoExtensions.begin(), kVideoExtensions.end(), extension) ==
+      kVideoExtensions.end()) {
+    return false;
+  }
+  const filesystem::path camDir = imagePath.parent_path();
+  const filesystem::path video = camDir.parent_path() / (camDir.filename().string() + extension);
+  return filesystem::is_regular_file(video);
+}
+
+cv::Mat readVideoFrame(const filesystem::path& imagePath) {
+  const filesystem::path camDir = imagePath.parent_path();
+  const filesystem::path video =
+      camDir.parent_path() / (camDir.filename().string() + imagePath.extension().string());
+  return getVideo(video)->read(std::stoi(imagePath.stem().string()));
+}
+
+} // namespace video_util
+} // namespace fb360_dep
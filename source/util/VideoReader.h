@@ -0,0 +1,73 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace video_util {
+
+// Color frames can come straight from one video per camera, <dir>/<camera><ext>, instead of an
+// image per frame in <dir>/<camera>/. The image of frame n is then read as <dir>/<camera>/<n><ext>
+// (see image_util::imagePath), which does not exist on disk: loads decode it from the video
+const std::vector<std::string> kVideoExtensions = {".mp4", ".mov", ".mkv", ".avi"};
+
+// Frames of a video decoded through opencv (its ffmpeg backend), in any order
+// Reading the frame after the last one read only decodes it, any other seeks first. The last few
+// frames decoded stay in memory, so all the loads of a frame in a process decode it once
+class VideoReader {
+ public:
+  static const int kCachedFrames = 4;
+
+  // isHardware asks ffmpeg for a hardware decoder (nvdec, vaapi, d3d11, videotoolbox, ...), which
+  // opencv supports from 4.5.2, and falls back to software decoding
+  explicit VideoReader(const filesystem::path& path, const bool isHardware = false);
+
+  VideoReader(const VideoReader&) = delete;
+  VideoReader& operator=(const VideoReader&) = delete;
+
+  int getFrameCount() const {
+    return frameCount;
+  }
+
+  // Thread safe. Frame as the video holds it, usually 8 bit BGR
+  cv::Mat read(const int frame);
+
+ private:
+  const filesystem::path path;
+  std::mutex mutex;
+  cv::VideoCapture capture;
+  int frameCount;
+  int next = 0; // frame the next decode returns
+  std::list<std::pair<int, cv::Mat>> cache; // most recently used first
+};
+
+// Thread safe. Readers are shared by the whole process
+std::shared_ptr<VideoReader> getVideo(const filesystem::path& path);
+
+// Video of camId in dir, empty if there is none
+filesystem::path findVideo(const filesystem::path& dir, const std::string& camId);
+
+// True if imagePath, <dir>/<camera>/<frame><ext>, is a frame of <dir>/<camera><ext>
+bool isVideoFrame(const filesystem::path& imagePath);
+
+// Frame at imagePath, see isVideoFrame
+cv::Mat readVideoFrame(const filesystem::path& imagePath);
+
+} // namespace video_util
+} // namespace fb360_dep
@@ -5,11 +5,16 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <chrono>
+
 #include <boost/algorithm/string.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "source/gpu/GlfwUtil.h"
+#include "source/gpu/GpuTimer.h"
+#include "source/render/PlaybackHud.h"
+#include "source/render/PredictiveCuller.h"
 #include "source/render/RigScene.h"
 #include "source/render/VideoFile.h"
 #include "source/util/SystemUtil.h"
@@ -30,6 +35,7 @@ const std::string kUsageMessage = R"(
   Misc:
   - Hit 'r' to reset the view to what was on the command line.
   - Hit 'p' to dump the current view parameters in the command line format.
+  - Hit 't' to toggle the frame timing and i/o overlay.
 
   - Example:
     ./GlViewer \
@@ -39,10 +45,22 @@ const std::string kUsageMessage = R"(
   )";
 
 DEFINE_string(catalog, "", "json file describing strip files");
+DEFINE_double(cull_hysteresis, 5, "extra degrees out of view before a camera is culled again");
+DEFINE_double(cull_margin, 10, "degrees around the view, and where it is heading, to read");
+DEFINE_bool(direct_blend, false, "blend cameras without per camera fullscreen passes");
+DEFINE_string(disk_trace, "", "save a chrome trace of disk reads and frames to this json file");
 DEFINE_string(strip_files, "", "comma-separated list of strip files");
-DEFINE_int32(readahead, 3, "how many frames to read ahead");
+DEFINE_int32(gpu_pool_mb, 2048, "max size of gpu frame objects in use and kept for reuse");
+DEFINE_bool(hud, false, "show the frame timing and i/o overlay, toggle with t");
+DEFINE_int32(max_readahead, 16, "max frames to read ahead, when the disk can't keep up");
+DEFINE_int32(read_queue_depth, 1, "max reads in flight per strip file and camera (> 1 for nvme)");
+DEFINE_int32(readahead, 3, "min frames to read ahead");
 DEFINE_string(rig, "", "path to rig .json file (required)");
+DEFINE_string(stats_csv, "", "log frame timing and i/o to this csv file, one line per frame");
+DEFINE_int32(upload_ring_mb, 1024, "max size of the upload ring buffer (0 = buffer per camera)");
 
+// no framerate here, frames are played as fast as they are displayed
+static const float kDisplayFps = 60;
 static const float kEffectIncrement = 1; // meters per frame
 static const float kEffectMax = 15; // meters
 // Rig scene use a flipped coordinate system relative to canopy scene
@@ -57,20 +75,30 @@ class GlViewer : public GlWindow {
   RigScene scene;
   std::unique_ptr<AsyncLoader> asyncLoader;
   std::unique_ptr<VideoFile> videoFile;
-
-  GlViewer() : GlWindow("GL viewer", 512, 512), scene(RigScene(FLAGS_rig)) {
+  PredictiveCuller culler;
+  GpuTimer renderTimer;
+  PlaybackHud hud;
+  bool showHud = FLAGS_hud;
+
+  GlViewer()
+      : GlWindow("GL viewer", 512, 512),
+        scene(RigScene(FLAGS_rig)),
+        culler(FLAGS_cull_margin, FLAGS_cull_hysteresis),
+        hud(kDisplayFps, FLAGS_max_readahead, FLAGS_stats_csv) {
     // Initialize the viewer
     CHECK_NE(FLAGS_strip_files, "");
+    scene.directBlend = FLAGS_direct_blend;
     std::vector<std::string> disks;
     boost::split(disks, FLAGS_strip_files, boost::is_any_of(","));
-    videoFile = std::make_unique<VideoFile>(FLAGS_catalog, disks);
+    videoFile = std::make_unique<VideoFile>(FLAGS_catalog, disks, FLAGS_read_queue_depth);
     if (videoFile->frames.size() == 1) {
       videoFile->readBegin(scene);
       scene.subframes = videoFile->readEnd(scene);
     } else {
-      for (int i = 0; i < FLAGS_readahead; ++i) {
-        videoFile->readBegin(scene);
-      }
+      videoFile->setReadahead(FLAGS_readahead, FLAGS_max_readahead, kDisplayFps);
+      videoFile->setUploadRing(uint64_t(FLAGS_upload_ring_mb) * 1024 * 1024);
+      RigScene::resourcePool.setBudget(uint64_t(FLAGS_gpu_pool_mb) * 1024 * 1024);
+      videoFile->fillReadahead(scene);
     }
   }
 
@@ -122,6 +150,10 @@ class GlViewer : public GlWindow {
         case GLFW_KEY_L:
           effectBegin();
           break;
+
+        case GLFW_KEY_T:
+          showHud = !showHud;
+          break;
       }
     }
   }
@@ -140,22 +172,39 @@ class GlViewer : public GlWindow {
   }
 
   void display() override {
+    AsyncFile::ActivityLog& log = AsyncFile::activityLog();
+    const auto frameBegin = AsyncFile::ActivityLog::Clock::now();
+    const Eigen::Matrix4f view = transform.matrix() * kPermutationMatrix;
     if (videoFile->frames.size() > 1) {
+      // the frames read now are displayed once they go through the readahead window
+      const float lookahead = (videoFile->getReadahead() + 1) / kDisplayFps;
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now().time_since_epoch())
+                                 .count();
+      culler.update(scene, seconds, {projection.matrix()}, {view}, lookahead);
       scene.destroyFrame(scene.subframes);
-      scene.subframes = videoFile->readEnd(scene);
-      videoFile->readBegin(scene, true);
+      const auto advanceBegin = AsyncFile::ActivityLog::Clock::now();
+      scene.subframes = videoFile->advance(scene, true);
+      log.span("advance", advanceBegin, AsyncFile::ActivityLog::Clock::now());
+      hud.add({videoFile->getAdvanceStats(), renderTimer.getMs()});
     }
 
     // Loop effect
     effectUpdate();
 
     // draw the scene
-    scene.render(projection * transform.matrix() * kPermutationMatrix, 0, true, wireframe);
+    renderTimer.begin();
+    scene.render(projection * view, 0, true, wireframe);
+    renderTimer.end();
+    if (showHud) {
+      hud.draw();
+    }
 
     // Let the read thread drain if when we finish
     if (done && asyncLoader) {
       asyncLoader->wait();
     }
+    log.span("frame", frameBegin, AsyncFile::ActivityLog::Clock::now());
   }
 };
 
@@ -167,8 +216,10 @@ int main(int argc, char* argv[]) {
 
   CHECK_NE(FLAGS_rig, "");
   CHECK_NE(FLAGS_catalog, "");
+  AsyncFile::activityLog().enable(FLAGS_disk_trace);
   GlViewer glViewer;
   GlWindow::mainLoop();
+  LOG(INFO) << glViewer.culler.getStats().toString();
 
   return EXIT_SUCCESS;
 }
@@ -18,6 +18,11 @@
 #include <folly/dynamic.h>
 #include <folly/json.h>
 
+#include "source/gpu/GpuTimer.h"
+#include "source/render/FrameLoader.h"
+#include "source/render/PlaybackHud.h"
+#include "source/render/PredictiveCuller.h"
+#include "source/render/ResolutionScaler.h"
 #include "source/render/RigScene.h"
 #include "source/render/Soundtrack.h"
 #include "source/render/VideoFile.h"
@@ -40,6 +45,7 @@ const std::string kUsageMessage = R"(
    - ESC/ctrl-Q closes the app
    - H toggles headbox fade-out
    - B toggles background rendering (experimental)
+   - T toggles the frame timing and i/o overlay
 
    Example:
      ./RiftViewer.exe \
@@ -52,9 +58,22 @@ DEFINE_string(audio, "", "optional .tbe audio file");
 DEFINE_string(background_catalog, "", "optional path to catalog for background (experimental)");
 DEFINE_string(background_file, "", "optional single strip file for background (experimental)");
 DEFINE_string(catalog, "", "path to catalog file (required)");
+DEFINE_double(cull_hysteresis, 5, "extra degrees out of view before a camera is culled again");
+DEFINE_double(cull_margin, 10, "degrees around the view, and where it is heading, to read");
+DEFINE_bool(direct_blend, false, "blend cameras without a fullscreen pass each, if not layered");
+DEFINE_string(disk_trace, "", "save a chrome trace of disk reads and frames to this json file");
 DEFINE_int32(fps, 30, "video framerate");
+DEFINE_int32(gpu_pool_mb, 2048, "max size of gpu frame objects in use and kept for reuse");
+DEFINE_bool(hud, false, "show the frame timing and i/o overlay, toggle with T");
+DEFINE_bool(layered, true, "render both eyes in a single pass, if supported (gl 4.0)");
+DEFINE_int32(max_readahead, 16, "max frames to read ahead, when the disk can't keep up");
+DEFINE_double(min_resolution_scale, 1, "lowest eye buffer scale to hold the frame rate (1 = off)");
+DEFINE_int32(read_queue_depth, 1, "max reads in flight per strip file and camera (> 1 for nvme)");
+DEFINE_int32(readahead, 3, "min frames to read ahead");
 DEFINE_string(rig, "", "path to rig.json (required)");
+DEFINE_string(stats_csv, "", "log frame timing and i/o to this csv file, one line per frame");
 DEFINE_string(strip_files, "", "comma-separated list of strip files (required)");
+DEFINE_int32(upload_ring_mb, 1024, "max size of the upload ring buffer (0 = buffer per camera)");
 
 struct OculusTextureBuffer {
   ovrSession Session;
@@ -202,16 +221,24 @@ static Time getCurrentTime() {
   return std::chrono::high_resolution_clock::now();
 }
 
-static float getVideoTimeMs(const VideoFile& videoFile) {
-  return videoFile.getFront() * (1000.f / FLAGS_fps);
+static float getVideoTimeMs(const int front) {
+  return front * (1000.f / FLAGS_fps);
+}
+
+// context for the frame loader thread, sharing objects with the window's
+static HGLRC createLoaderContext() {
+  const int attribs[] = {0};
+  HGLRC context = wglCreateContextAttribsARB(Platform.hDC, Platform.WglContext, attribs);
+  VALIDATE(context, "Failed to create loader context.");
+  return context;
 }
 
 static std::set<char> depressedKeys;
 
 static std::vector<char> getAndUpdateActiveKeys() {
   static std::set<char> keysOfInterest = {
-      VK_LEFT, VK_RIGHT, 'W', VK_UP, 'S', VK_DOWN, 'D', 'A', 'C', 'H', 'M', 'B', ' '};
-  static std::set<char> keysActiveOnlyOnKeyPress = {'C', 'H', 'M', 'B', ' '};
+      VK_LEFT, VK_RIGHT, 'W', VK_UP, 'S', VK_DOWN, 'D', 'A', 'C', 'H', 'M', 'B', 'T', ' '};
+  static std::set<char> keysActiveOnlyOnKeyPress = {'C', 'H', 'M', 'B', 'T', ' '};
 
   std::vector<char> activeKeys;
   for (char c : keysOfInterest) {
@@ -297,6 +324,7 @@ static bool MainLoop(bool retryCreate) {
 
     // create the scene
     RigScene scene(FLAGS_rig);
+    scene.directBlend = FLAGS_direct_blend;
 
     // load background geometry
     if (!FLAGS_background_catalog.empty()) {
@@ -310,16 +338,28 @@ static bool MainLoop(bool retryCreate) {
     // create the video and begin loading the first frame
     std::vector<std::string> v;
     boost::algorithm::split(v, FLAGS_strip_files, [](char c) { return c == ','; });
-    VideoFile videoFile(FLAGS_catalog, v);
+    VideoFile videoFile(FLAGS_catalog, v, FLAGS_read_queue_depth);
+    std::unique_ptr<FrameLoader> frameLoader;
     if (videoFile.frames.size() == 1) {
       // special case a single-frame video
       videoFile.readBegin(scene);
       scene.subframes = videoFile.readEnd(scene);
     } else {
-      for (int readahead = 0; readahead < 3; ++readahead) {
-        videoFile.readBegin(scene);
-      }
+      videoFile.setReadahead(FLAGS_readahead, FLAGS_max_readahead, FLAGS_fps);
+      videoFile.setUploadRing(uint64_t(FLAGS_upload_ring_mb) * 1024 * 1024);
+      RigScene::resourcePool.setBudget(uint64_t(FLAGS_gpu_pool_mb) * 1024 * 1024);
+      // frames are read and uploaded on their own thread, so the disk never stalls head tracking
+      const HGLRC loaderContext = createLoaderContext();
+      frameLoader = std::make_unique<FrameLoader>(
+          videoFile,
+          scene,
+          [loaderContext] { wglMakeCurrent(Platform.hDC, loaderContext); },
+          [loaderContext] {
+            wglMakeCurrent(nullptr, nullptr);
+            wglDeleteContext(loaderContext);
+          });
     }
+    auto getFront = [&] { return frameLoader ? frameLoader->getFront() : 0; };
 
     // create soundtrack and load it, if requested
     Soundtrack soundtrack;
@@ -327,6 +367,17 @@ static bool MainLoop(bool retryCreate) {
       soundtrack.load(FLAGS_audio);
     }
 
+    PredictiveCuller culler(FLAGS_cull_margin, FLAGS_cull_hysteresis);
+    GpuTimer renderTimer;
+    PlaybackHud hud(FLAGS_fps, FLAGS_max_readahead, FLAGS_stats_csv);
+    bool showHud = FLAGS_hud;
+    const bool useLayered = FLAGS_layered && RigScene::isLayeredSupported();
+    LOG(INFO) << (useLayered ? "Rendering both eyes in one pass" : "Rendering one eye at a time");
+    // eye buffers are drawn and submitted in part to hold the gpu time below the frame interval
+    const float kGpuBudget = 0.8f; // of the frame interval, the rest is left to the compositor
+    ResolutionScaler scaler(
+        kGpuBudget * 1000 / hmdDesc.DisplayRefreshRate, FLAGS_min_resolution_scale);
+
     static bool pause = true;
     static bool started = false;
     static int const kHeadboxFade = 2;
@@ -389,7 +440,7 @@ static bool MainLoop(bool retryCreate) {
                 } else {
                   pause = false;
                   startTime =
-                      getCurrentTime() - std::chrono::milliseconds((int)getVideoTimeMs(videoFile));
+                      getCurrentTime() - std::chrono::milliseconds((int)getVideoTimeMs(getFront()));
                   soundtrack.play();
                 }
               } else {
@@ -403,6 +454,9 @@ static bool MainLoop(bool retryCreate) {
             case 'B':
               scene.renderBackground = !scene.renderBackground;
               break;
+            case 'T':
+              showHud = !showHud;
+              break;
           }
         }
 
@@ -424,14 +478,16 @@ static bool MainLoop(bool retryCreate) {
         double sensorSampleTime; // sensorSampleTime is fed into the layer later
         ovr_GetEyePoses(
             session, frameIndex, ovrTrue, HmdToEyePose, EyeRenderPose, &sensorSampleTime);
+        const auto frameBegin = AsyncFile::ActivityLog::Clock::now();
 
         menu.update();
         soundtrack.updatePositionalTracking(EyeRenderPose[0]);
 
         // Sync audio and video
         bool delayNextFrame = false;
+        int framesBehind = 0;
         if (menu.isHidden && !pause) {
-          if (videoFile.getFront() == 0) {
+          if (getFront() == 0) {
             startTime = getCurrentTime();
             soundtrack.restart(); // video is at beginning, restart audio
           } else {
@@ -444,49 +500,102 @@ static bool MainLoop(bool retryCreate) {
             // 90 ms is the acceptability threshold (Rec. ITU-R BT.1359-1)
             static const float kMaxVideoLag = 90;
             static const float kMaxAudioLag = 5;
-            const float videoTimeMs = getVideoTimeMs(videoFile);
+            const float videoTimeMs = getVideoTimeMs(getFront());
             if (videoTimeMs > referenceTimeMs + kMaxAudioLag) { // video is ahead
               // Delay if we have no audio or if we're using audio and it has started
               if (!soundtrack.isPlaying() || audioTimeMs != 0) {
                 delayNextFrame = true;
               }
             } else if (referenceTimeMs > videoTimeMs + kMaxVideoLag) { // video is behind
-              // Stuttering is worse than de-sync, as long as it catches up, so do nothing;
-              // alternatively, we can stutter to realign via soundtrack.setElapsedMs(videoTimeMs)
+              // stuttering is better than falling further behind, skip frames to catch up
+              framesBehind = int((referenceTimeMs - videoTimeMs) * FLAGS_fps / 1000);
             }
           }
         }
 
-        if (!delayNextFrame && !pause && videoFile.frames.size() > 1) {
-          // destroy previous frame, finish loading current frame, kick off next frame
-          scene.destroyFrame(scene.subframes);
-          scene.subframes = videoFile.readEnd(scene);
-          videoFile.readBegin(scene, true);
-        }
-
-        // Render Scene to Eye Buffers
+        // Get view and projection matrices
+        Matrix4f eyeViews[2];
+        Matrix4f eyeProjs[2];
         for (int eye = 0; eye < 2; ++eye) {
-          // Switch to eye render target
-          eyeRenderTexture[eye]->SetAndClearRenderSurface();
-
-          // Get view and projection matrices
           Matrix4f rollPitchYaw = Matrix4f::RotationY(Yaw);
           Matrix4f finalRollPitchYaw = rollPitchYaw * Matrix4f(EyeRenderPose[eye].Orientation);
           Vector3f finalUp = finalRollPitchYaw.Transform(Vector3f(0, 1, 0));
           Vector3f finalForward = finalRollPitchYaw.Transform(Vector3f(0, 0, -1));
           Vector3f shiftedEyePos = Pos2 + rollPitchYaw.Transform(EyeRenderPose[eye].Position);
 
-          Matrix4f view = Matrix4f::LookAtRH(shiftedEyePos, shiftedEyePos + finalForward, finalUp);
-          Matrix4f proj = ovrMatrix4f_Projection(
+          eyeViews[eye] =
+              Matrix4f::LookAtRH(shiftedEyePos, shiftedEyePos + finalForward, finalUp);
+          eyeProjs[eye] = ovrMatrix4f_Projection(
               hmdDesc.DefaultEyeFov[eye], 0.2f, 30000.0f, ovrProjection_None);
+        }
+        using ForeignType = const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>;
+
+        if (!delayNextFrame && !pause && frameLoader) {
+          // cull what the tracked head will not see by the time the frames read now are
+          // displayed, i.e. once they go through the readahead window
+          Matrix4fVector projections;
+          Matrix4fVector views;
+          for (int eye = 0; eye < 2; ++eye) {
+            projections.push_back(Eigen::Map<ForeignType>(eyeProjs[eye].M[0]));
+            views.push_back(Eigen::Map<ForeignType>(eyeViews[eye].M[0]));
+          }
+          const float lookahead = (frameLoader->getReadahead() + 1) / float(FLAGS_fps);
+          culler.update(scene, sensorSampleTime, projections, views, lookahead);
+          frameLoader->updateView();
+
+          // show the next frame if it is loaded, the last one again otherwise, never wait for the
+          // disk. Video that is behind skips ahead through the frames that are already loaded
+          for (int i = 0; i <= framesBehind; ++i) {
+            if (!frameLoader->next(scene.subframes)) {
+              break;
+            }
+            hud.add({frameLoader->getStats(), renderTimer.getMs()});
+          }
+        }
+
+        // Part of each eye buffer drawn this frame
+        const float scale = scaler.update(renderTimer.getMs());
+        Recti eyeViewports[2];
+        for (int eye = 0; eye < 2; ++eye) {
+          const Sizei size = eyeRenderTexture[eye]->GetSize();
+          eyeViewports[eye] = Recti(0, 0, int(scale * size.w), int(scale * size.h));
+        }
+
+        // Draw both eyes at once, each eye then resolves its accumulation
+        const bool isLayered = useLayered && menu.isHidden;
+        renderTimer.begin();
+        if (isLayered) {
+          Matrix4fVector projViews;
+          for (int eye = 0; eye < 2; ++eye) {
+            Matrix4f projView = eyeProjs[eye] * eyeViews[eye];
+            projViews.push_back(Eigen::Map<ForeignType>(projView.M[0]));
+          }
+          glViewport(0, 0, eyeViewports[0].w, eyeViewports[0].h);
+          scene.renderLayered(projViews);
+        }
+
+        // Render Scene to Eye Buffers
+        for (int eye = 0; eye < 2; ++eye) {
+          // Switch to eye render target
+          eyeRenderTexture[eye]->SetAndClearRenderSurface();
+          glViewport(0, 0, eyeViewports[eye].w, eyeViewports[eye].h);
+
+          const Matrix4f& view = eyeViews[eye];
+          const Matrix4f& proj = eyeProjs[eye];
 
           // Render world
           Matrix4f projView = proj * view;
-          using ForeignType = const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>;
 
           if (menu.isHidden) {
             const float displacement = fade * Vector3f(EyeRenderPose[0].Position).Length();
-            scene.render(Eigen::Map<ForeignType>(projView.M[0]), displacement);
+            if (isLayered) {
+              scene.resolveLayered(eye, displacement);
+            } else {
+              scene.render(Eigen::Map<ForeignType>(projView.M[0]), displacement);
+            }
+            if (showHud) {
+              hud.draw();
+            }
           } else {
             menu.draw(view, proj);
           }
@@ -500,6 +609,7 @@ static bool MainLoop(bool retryCreate) {
           // Commit changes to the textures so they get picked up frame
           eyeRenderTexture[eye]->Commit();
         }
+        renderTimer.end();
 
         // Do distortion rendering, Present and flush/sync
 
@@ -510,14 +620,19 @@ static bool MainLoop(bool retryCreate) {
         for (int eye = 0; eye < 2; ++eye) {
           ld.ColorTexture[eye] = eyeRenderTexture[eye]->ColorTextureChain;
           ld.DepthTexture[eye] = eyeRenderTexture[eye]->DepthTextureChain;
-          ld.Viewport[eye] = Recti(eyeRenderTexture[eye]->GetSize());
+          ld.Viewport[eye] = eyeViewports[eye]; // bottom left, as the texture origin
           ld.Fov[eye] = hmdDesc.DefaultEyeFov[eye];
           ld.RenderPose[eye] = EyeRenderPose[eye];
           ld.SensorSampleTime = sensorSampleTime;
         }
 
         ovrLayerHeader* layers = &ld.Header;
+        // submit waits for the gpu to finish the previous frame
+        const auto submitBegin = AsyncFile::ActivityLog::Clock::now();
         result = ovr_SubmitFrame(session, frameIndex, nullptr, &layers, 1);
+        const auto submitEnd = AsyncFile::ActivityLog::Clock::now();
+        AsyncFile::activityLog().span("submit", submitBegin, submitEnd);
+        AsyncFile::activityLog().span("frame", frameBegin, submitEnd);
 
         // exit the rendering loop if submit returns an error, will retry on ovrError_DisplayLost
         if (!OVR_SUCCESS(result))
@@ -536,6 +651,10 @@ static bool MainLoop(bool retryCreate) {
 
       SwapBuffers(Platform.hDC);
     }
+    if (frameLoader) {
+      frameLoader->retire(scene.subframes);
+    }
+    LOG(INFO) << culler.getStats().toString();
   }
 
 Done:
@@ -560,6 +679,7 @@ int main(int argc, char* argv[]) {
   system_util::initDep(argc, argv, kUsageMessage);
 
   verifyInputs();
+  AsyncFile::activityLog().enable(FLAGS_disk_trace);
 
   LOG(INFO) << "Starting...";
 